@@ -41,16 +41,27 @@
 #define MBEDTLS_SSL_PROTO_TLS1_0
 #define MBEDTLS_SSL_PROTO_TLS1_1
 #define MBEDTLS_SSL_PROTO_TLS1_2
+#define MBEDTLS_SSL_SESSION_TICKETS
 
 /* mbed TLS modules */
 #define MBEDTLS_AES_C
+
+/*
+ * AES-NI on x86_64, chosen at run time by CPUID with software AES as the
+ * fallback. Compiles to nothing on other architectures. Build with
+ * AES_ACCEL=0 to leave it out.
+ */
+#define MBEDTLS_AESNI_C
 #define MBEDTLS_ASN1_PARSE_C
 #define MBEDTLS_ASN1_WRITE_C
 #define MBEDTLS_BIGNUM_C
+#define MBEDTLS_CHACHA20_C
+#define MBEDTLS_CHACHAPOLY_C
 #define MBEDTLS_CIPHER_C
 #define MBEDTLS_CTR_DRBG_C
 #define MBEDTLS_DES_C
 #define MBEDTLS_ENTROPY_C
+#define MBEDTLS_GCM_C
 #define MBEDTLS_MD_C
 #define MBEDTLS_MD5_C
 #define MBEDTLS_NET_C
@@ -58,6 +69,7 @@
 #define MBEDTLS_PK_C
 #define MBEDTLS_PK_PARSE_C
 #define MBEDTLS_PK_WRITE_C
+#define MBEDTLS_POLY1305_C
 #define MBEDTLS_RSA_C
 #define MBEDTLS_SHA1_C
 #define MBEDTLS_SHA256_C
@@ -99,6 +99,8 @@ module MetasploitPayloads
           case format
           when :process_image
             "#{filename}.bin"
+          when :process_image_lz4
+            "#{filename}.bin.lz4"
           when :exec
             "#{filename}"
           else
@@ -170,7 +172,7 @@ module MetasploitPayloads
 
       extensions = ::Dir.entries(dir_path)
       # Only return extensions!
-      extensions - [ '.', '..', 'mettle', 'mettle.bin' ]
+      extensions - [ '.', '..', 'mettle', 'mettle.bin', 'mettle.bin.lz4' ]
     end
 
     #
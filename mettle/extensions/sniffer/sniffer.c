@@ -5,12 +5,30 @@
  */
 
 #include <dnet.h>
+#include <errno.h>
 #include <pcap.h>
-#include <signal.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#include <zlib.h>
+
+#ifdef __linux__
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#ifdef TPACKET3_HDRLEN
+#define HAVE_TPACKET_V3
+#endif
+#endif
 
 #include "extension.h"
-#include "ringbuf.h"
+#include "thread_role.h"
 #include "uthash.h"
 
 #include "sniffer.h"
@@ -20,12 +38,38 @@
 #define MSF_PACKET_HEADER_SIZE	20
 
 #define PCAP_MAX_PKT_BATCH 100000
-#define PCAP_ACTIVE_PKT_SLEEP_US 1000
-#define PCAP_INACTIVE_PKT_SLEEP_US 100000
 #define PCAP_SNAP_LEN 16000
 #define PCAP_BUFFER_PKTS 1024
+#define PCAP_HEADERS_SNAP_LEN 256	// enough for any L2-L4 headers we parse
+#define PCAP_HEADERS_AVG 66		// ethernet, IPv4 and TCP with timestamps
 #define PCAP_BUFFER_SIZE (PCAP_SNAP_LEN * PCAP_BUFFER_PKTS)
 #define PCAP_TIMEOUT_MS 10
+#define PCAP_POLL_MS 100
+#define STATS_INTERVAL_NS 1000000000ULL
+#define SPILL_RETRY_NS 1000000000ULL
+
+/*
+ * Live streams send pcapng in responses of about STREAM_CHUNK_LEN bytes,
+ * and hold off while more than STREAM_WINDOW is still on its way to mettle.
+ * Packets meanwhile wait in the capture ring, which drops the oldest.
+ */
+#define STREAM_CHUNK_LEN TLV_STREAM_CHUNK_LEN
+#ifdef METTLE_LOW_MEMORY
+#define STREAM_WINDOW (128 * 1024)
+#else
+#define STREAM_WINDOW (1024 * 1024)
+#endif
+#define STREAM_BUF_LEN (STREAM_CHUNK_LEN + PCAPNG_EPB_LEN + PCAP_SNAP_LEN + 4)
+
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define PCAPNG_EPB_LEN 32
+
+#define TPACKET_BLOCK_SIZE (1 << 20)
+#define TPACKET_BLOCK_NR (PCAP_BUFFER_SIZE / TPACKET_BLOCK_SIZE)
+#define TPACKET_FRAME_SIZE TPACKET_ALIGN(TPACKET3_HDRLEN + PCAP_SNAP_LEN)
 
 /*
  * *** NETWORK INTERFACES ***
@@ -89,15 +133,76 @@ static pcap_if_t *find_interface(uint32_t index)
 /*
  * *** PACKET CAPTURE ***
  */
-struct packet {
-	struct pcap_pkthdr header;
-	uint8_t data[];
-};
-
 struct captured_packets {
 	uint32_t packet_cnt;
 	uint32_t byte_cnt;
-	ringbuf_t ringbuf;
+
+	/*
+	 * Preallocated byte ring of packet records, each a pcap_pkthdr followed
+	 * by caplen bytes of data. Records may wrap around the end of the ring.
+	 * When a new packet doesn't fit, the oldest records are overwritten.
+	 */
+	uint8_t *ring;
+	size_t ring_size;
+	size_t head;
+	size_t tail;
+	size_t used;
+	uint32_t records;
+	uint32_t record_max;
+	size_t data_bytes;
+	uint32_t dropped;
+};
+
+/*
+ * Per 5-tuple summary kept in flow mode instead of the packets themselves
+ */
+struct flow_key {
+	uint8_t family;
+	uint8_t proto;
+	uint16_t sport;
+	uint16_t dport;
+	uint8_t src[16];
+	uint8_t dst[16];
+};
+
+struct flow {
+	struct flow_key key;
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t first_us;
+	uint64_t last_us;
+	uint8_t tcp_flags;
+	UT_hash_handle hh;
+};
+
+/*
+ * Counters for finding where packets are lost: in the kernel or at the
+ * interface before we see them, or overwritten in our ring before a dump
+ * or stream takes them
+ */
+struct capture_stats {
+	uint64_t packets;
+	uint64_t kernel_drops;
+	uint64_t if_drops;
+	uint64_t ring_drops;
+	uint64_t handler_ns;	// time spent in packet dispatch, packet_handler included
+	uint32_t rate;		// packets per second over the last interval
+	uint64_t spill_bytes;	// spilled to disk and not yet read back
+};
+
+/*
+ * A pcap file of packets spilled from the ring. It is mapped for writing
+ * while open and mapped again to be read back once closed.
+ */
+struct spill_file {
+	struct spill_file *next;
+	uint32_t seq;
+	int fd;			// open while being written
+	uint8_t *map;
+	size_t map_len;
+	size_t len;		// bytes written, file header included
+	size_t off;		// next record to read back
+	uint32_t records;	// records not yet read back
 };
 
 struct capture {
@@ -109,38 +214,144 @@ struct capture {
 	char *filter_str;
 	struct bpf_program filter_bpf;
 
+	/*
+	 * A filter handed to a pcap capture thread to install between
+	 * dispatches, with pcap_setfilter's result
+	 */
+	struct bpf_program *filter_wanted;
+	int filter_result;
+
 	bool active;
+	bool pinned;
 
 	pcap_t *pcap_handle;
+	int linktype;
+#ifdef HAVE_TPACKET_V3
+	// AF_PACKET ring, used instead of pcap_dispatch when tpacket_fd != -1.
+	int tpacket_fd;
+	uint8_t *tpacket_map;
+	struct tpacket_req3 tpacket_req;
+	unsigned int tpacket_block;
+#endif
 	uint32_t packet_max;
+	size_t ring_size;
+	uint32_t snaplen;
+	bool headers_only;	// truncate each packet after its transport header
 	struct captured_packets *current; // Current packets captured by the sniffing thread.
 	struct captured_packets *dump;    // Captured packets ready for dumping.
 	struct captured_packets *new;     // New, empty capture buffer (when dumping-while-capturing)
+	struct captured_packets *spare;   // Drained buffer kept for the next dump
 	uint8_t *dump_buffer;
 	size_t dump_buffer_len;
 	uint32_t dump_packet_cnt;
 	uint32_t dump_buffer_index;
 
+	/*
+	 * Spill mode dumps are read from the files and then the ring as
+	 * dump_read asks, through dump_buffer a record at a time
+	 */
+	bool dump_spilled;
+	struct captured_packets *dump_ring;
+	uint64_t dump_next_id;
+	size_t dump_record_len;
+	size_t dump_record_off;
+
+	/*
+	 * Spill mode, see SPILL FILES. The capture thread owns 'spill_files',
+	 * oldest first, the last of which is 'spill_writing' while it is open,
+	 * and hands them over as 'spill_dump' when a dump takes the ring.
+	 */
+	char *spill_dir;
+	size_t spill_file_size;
+	uint64_t spill_max;
+	uint32_t spill_seq;
+	uint64_t spill_retry_ns;
+	struct spill_file *spill_files;
+	struct spill_file *spill_writing;
+	struct spill_file *spill_dump;
+
+	/*
+	 * Live pcapng stream, fed by the capture thread once the request
+	 * context is published under sync_lock
+	 */
+	struct tlv_handler_ctx *stream_ctx;
+	bool stream_compress;
+	z_stream stream_z;
+	uint8_t *stream_buf;
+	size_t stream_len;
+	uint8_t *stream_zbuf;
+	size_t stream_zbuf_len;
+
+	/*
+	 * Flow mode tables. The capture thread owns 'flows' and hands it over
+	 * as 'flows_dump' when a request sets flows_wanted.
+	 */
+	bool flow_mode;
+	struct flow *flows;
+	uint32_t flow_cnt;
+	uint32_t flows_dropped;
+	bool flows_wanted;
+	struct flow *flows_dump;
+	uint32_t flows_dump_dropped;
+
+	/*
+	 * The other threads of a fanout capture, each a capture of its own
+	 * with a socket in the same PACKET_FANOUT group and its own ring
+	 */
+	struct capture **fanout;
+	uint32_t fanout_cnt;
+
+	/*
+	 * The capture thread keeps 'stats_local', publishing it as 'stats'
+	 * under sync_lock about once a second and when it exits
+	 */
+	struct capture_stats stats_local;
+	struct capture_stats stats;
+	uint64_t stats_sampled_ns;
+	uint64_t stats_sampled_packets;
+	uint64_t ring_drops_swapped;
+
 	pthread_t thread;
+	int wake_fds[2];	// Pipe to wake the capture thread for stop/dump requests
 	pthread_mutex_t sync_lock;
 	pthread_cond_t sync_cv;
 
 	UT_hash_handle hh;
-	UT_hash_handle hh_tid;
 };
 
 static struct capture *captures = NULL;		// key is index
-static struct capture *captures_by_tid = NULL;	// key is thread ID
+static struct extension *sniffer_extension = NULL;
+
+static void capture_stream_end(struct capture *c, int rc);
+
+static void flows_free(struct flow *flows)
+{
+	struct flow *f, *tmp;
+	HASH_ITER(hh, flows, f, tmp) {
+		HASH_DEL(flows, f);
+		free(f);
+	}
+}
 
 /*
- * Allocate enough pointers for the max number of packets we might capture.
+ * Size a ring for packet_cnt typical records at this snaplen, plus room for
+ * one maximum sized capture so a single large packet always fits.
  */
-static struct captured_packets *capture_buffer_new(size_t packet_cnt)
+static size_t capture_ring_size(uint32_t packet_cnt, uint32_t snaplen, bool headers_only)
+{
+	size_t avg = headers_only ? PCAP_HEADERS_AVG : TYPESAFE_MIN(snaplen, 1514);
+	return packet_cnt * (sizeof(struct pcap_pkthdr) + avg) +
+		sizeof(struct pcap_pkthdr) + snaplen;
+}
+
+static struct captured_packets *capture_buffer_new(size_t ring_size, uint32_t record_max)
 {
 	struct captured_packets *captured_packets = calloc(1, sizeof(*captured_packets));
 	if (captured_packets) {
-		captured_packets->ringbuf = ringbuf_new(packet_cnt * sizeof(struct packet *));
-		if (captured_packets->ringbuf == NULL) {
+		captured_packets->ring_size = ring_size;
+		captured_packets->record_max = record_max;
+		captured_packets->ring = malloc(captured_packets->ring_size);
+		if (captured_packets->ring == NULL) {
 			free(captured_packets);
 			captured_packets = NULL;
 		}
@@ -148,224 +359,1485 @@ static struct captured_packets *capture_buffer_new(size_t packet_cnt)
 	return captured_packets;
 }
 
-/*
- * Free up all the packets and associated ring buffer of packet pointers.
- */
 static void capture_buffer_free(struct captured_packets *captured_packets)
 {
 	if (captured_packets == NULL) {
 		return;
 	}
 
-	// Walk all packet pointers and free each one...
-	if (captured_packets->ringbuf) {
-		struct packet *packet;
-		while (!ringbuf_is_empty(captured_packets->ringbuf)) {
-			ringbuf_memcpy_from(&packet, captured_packets->ringbuf, sizeof(packet));
-			free(packet);
-		}
-		ringbuf_free(&captured_packets->ringbuf);
-	}
-
+	free(captured_packets->ring);
 	free(captured_packets);
+}
 
-	return;
+/*
+ * Forget all stored packets so the ring can be handed back to the capture thread.
+ */
+static void capture_buffer_reset(struct captured_packets *captured_packets)
+{
+	captured_packets->packet_cnt = 0;
+	captured_packets->byte_cnt = 0;
+	captured_packets->head = 0;
+	captured_packets->tail = 0;
+	captured_packets->used = 0;
+	captured_packets->records = 0;
+	captured_packets->data_bytes = 0;
+	captured_packets->dropped = 0;
+}
+
+static void capture_buffer_write(struct captured_packets *cp, const void *buf, size_t len)
+{
+	size_t first = TYPESAFE_MIN(len, cp->ring_size - cp->head);
+	memcpy(cp->ring + cp->head, buf, first);
+	memcpy(cp->ring, (const uint8_t *)buf + first, len - first);
+	cp->head = (cp->head + len) % cp->ring_size;
+	cp->used += len;
+}
+
+static void capture_buffer_read(struct captured_packets *cp, void *buf, size_t len)
+{
+	size_t first = TYPESAFE_MIN(len, cp->ring_size - cp->tail);
+	if (buf) {
+		memcpy(buf, cp->ring + cp->tail, first);
+		memcpy((uint8_t *)buf + first, cp->ring, len - first);
+	}
+	cp->tail = (cp->tail + len) % cp->ring_size;
+	cp->used -= len;
 }
 
-static struct packet *capture_buffer_get_packet(ringbuf_t ringbuf)
+/*
+ * Remove the oldest packet from the ring, copying its data into 'data' if
+ * given, which must have room for PCAP_SNAP_LEN bytes.
+ */
+static bool capture_buffer_get_packet(struct captured_packets *cp,
+		struct pcap_pkthdr *header, uint8_t *data)
 {
-	struct packet *packet = NULL;
-	if (!ringbuf_is_empty(ringbuf)) {
-		ringbuf_memcpy_from(&packet, ringbuf, sizeof(packet));
+	if (cp->records == 0) {
+		return false;
 	}
-	return packet;
+	capture_buffer_read(cp, header, sizeof(*header));
+	capture_buffer_read(cp, data, header->caplen);
+	cp->records--;
+	cp->data_bytes -= header->caplen;
+	return true;
 }
 
-static struct packet *capture_buffer_add_packet(ringbuf_t ringbuf,
+static bool capture_buffer_add_packet(struct captured_packets *cp,
 		const struct pcap_pkthdr *header, const uint8_t *data)
 {
-	if (header == NULL || data == NULL) {
+	if (header == NULL || data == NULL || header->caplen > PCAP_SNAP_LEN) {
+		return false;
+	}
+
+	// Drop the oldest packets until the new one fits.
+	size_t len = sizeof(*header) + header->caplen;
+	struct pcap_pkthdr old_header;
+	while (cp->records >= cp->record_max || cp->ring_size - cp->used < len) {
+		capture_buffer_get_packet(cp, &old_header, NULL);
+		cp->dropped++;
+	}
+
+	capture_buffer_write(cp, header, sizeof(*header));
+	capture_buffer_write(cp, data, header->caplen);
+	cp->records++;
+	cp->data_bytes += header->caplen;
+
+	return true;
+}
+
+/*
+ * *** SPILL FILES ***
+ *
+ * In spill mode the records a full ring would drop are moved instead to
+ * pcap files in the spill directory, each reserved at its full size and
+ * written through a shared mapping. Once a file fills the next is started,
+ * and past spill_max bytes the oldest goes. Everything spilled is older
+ * than what is in the ring, so the files read in order and then the ring
+ * give the packets oldest first.
+ */
+struct spill_record {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t caplen;
+	uint32_t len;
+};
+
+static uint64_t now_ns(void);
+
+static void spill_path(struct capture *c, uint32_t seq, char *path, size_t len)
+{
+	snprintf(path, len, "%s/sniff-%u-%u.pcap", c->spill_dir, c->index, seq);
+}
+
+/*
+ * A page of a mapping that the disk cannot back faults with SIGBUS when
+ * written, so the whole file is allocated before it is mapped
+ */
+static int spill_reserve(int fd, size_t len)
+{
+#ifdef __APPLE__
+	fstore_t store = { F_ALLOCATEALL, F_PEOFPOSMODE, 0, len, 0 };
+	if (fcntl(fd, F_PREALLOCATE, &store) == -1) {
+		return -1;
+	}
+	return ftruncate(fd, len);
+#else
+	return posix_fallocate(fd, 0, len) == 0 ? 0 : -1;
+#endif
+}
+
+static struct spill_file *spill_file_open(struct capture *c)
+{
+	struct spill_file *f = calloc(1, sizeof(*f));
+	if (f == NULL) {
 		return NULL;
 	}
+	f->seq = c->spill_seq++;
 
-	struct packet *packet = malloc(sizeof(*header) + header->caplen);
-	if (packet == NULL) {
+	char path[PATH_MAX];
+	spill_path(c, f->seq, path, sizeof(path));
+	f->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (f->fd == -1) {
+		free(f);
+		return NULL;
+	}
+	if (spill_reserve(f->fd, c->spill_file_size) == -1
+			|| (f->map = mmap(NULL, c->spill_file_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, f->fd, 0)) == MAP_FAILED) {
+		close(f->fd);
+		unlink(path);
+		free(f);
 		return NULL;
 	}
-	packet->header = *header;
-	memcpy(&packet->data, data, header->caplen);
+	f->map_len = c->spill_file_size;
+
+	struct pcap_file_header header = {
+		.magic = 0xa1b2c3d4,
+		.version_major = PCAP_VERSION_MAJOR,
+		.version_minor = PCAP_VERSION_MINOR,
+		.snaplen = c->snaplen,
+		.linktype = c->linktype,
+	};
+	memcpy(f->map, &header, sizeof(header));
+	f->len = f->off = sizeof(header);
+	return f;
+}
 
-	if (ringbuf_is_full(ringbuf)) {
-		// Ring buffer is full, so let's free/drop the oldest packet.
-		struct packet *old_packet = capture_buffer_get_packet(ringbuf);
-		if (old_packet) {
-			free(old_packet);
+/*
+ * Finishes writing a file, trimming off the space it didn't use
+ */
+static void spill_file_close(struct spill_file *f)
+{
+	if (f->fd != -1) {
+		munmap(f->map, f->map_len);
+		f->map = NULL;
+		if (ftruncate(f->fd, f->len) == -1) {
+			log_info("Cannot trim spill file: %s", strerror(errno));
 		}
+		close(f->fd);
+		f->fd = -1;
 	}
+}
 
-	// Save the new packet pointer as the "most recent" packet captured.
-	ringbuf_memcpy_into(ringbuf, &packet, sizeof(packet));
+static int spill_file_map(struct capture *c, struct spill_file *f)
+{
+	char path[PATH_MAX];
+	spill_path(c, f->seq, path, sizeof(path));
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+	void *map = mmap(NULL, f->len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+	f->map = map;
+	f->map_len = f->len;
+	return 0;
+}
 
-	return packet;
+static void spill_file_remove(struct capture *c, struct spill_file *f)
+{
+	spill_file_close(f);
+	if (f->map) {
+		munmap(f->map, f->map_len);
+	}
+	char path[PATH_MAX];
+	spill_path(c, f->seq, path, sizeof(path));
+	unlink(path);
+	free(f);
 }
 
-static struct capture *capture_new(uint32_t index, pcap_t *handle, uint32_t packet_max)
+static void spill_files_remove(struct capture *c, struct spill_file *files)
 {
-	if (index == 0 || index > SNIFFER_MAX_INTERFACES) {
-		return NULL;
+	while (files) {
+		struct spill_file *next = files->next;
+		spill_file_remove(c, files);
+		files = next;
+	}
+}
+
+static uint64_t spill_files_unread(struct spill_file *files)
+{
+	uint64_t bytes = 0;
+	for (struct spill_file *f = files; f; f = f->next) {
+		bytes += f->len - f->off;
+	}
+	return bytes;
+}
+
+/*
+ * Starts the next file, first removing the oldest ones if it would take
+ * the spill past spill_max. Their packets count as dropped.
+ */
+static struct spill_file *spill_file_next(struct capture *c)
+{
+	while (c->spill_max && c->spill_files && c->spill_files->fd == -1 &&
+			spill_files_unread(c->spill_files) + c->spill_file_size > c->spill_max) {
+		struct spill_file *f = c->spill_files;
+		c->spill_files = f->next;
+		c->current->dropped += f->records;
+		spill_file_remove(c, f);
+	}
+
+	struct spill_file *f = spill_file_open(c);
+	if (f) {
+		struct spill_file **tail = &c->spill_files;
+		while (*tail) {
+			tail = &(*tail)->next;
+		}
+		*tail = f;
+	}
+	return f;
+}
+
+/*
+ * Moves the oldest record in the ring to the file being written, or drops
+ * it if no file can be had. After a failure, files are not tried again for
+ * SPILL_RETRY_NS.
+ */
+static void capture_spill_oldest(struct capture *c)
+{
+	struct captured_packets *cp = c->current;
+	struct pcap_pkthdr header;
+	capture_buffer_read(cp, &header, sizeof(header));
+	cp->records--;
+	cp->data_bytes -= header.caplen;
+
+	size_t len = sizeof(struct spill_record) + header.caplen;
+	struct spill_file *f = c->spill_writing;
+	if (f && f->map_len - f->len < len) {
+		spill_file_close(f);
+		f = c->spill_writing = NULL;
+	}
+	if (f == NULL && now_ns() >= c->spill_retry_ns) {
+		f = c->spill_writing = spill_file_next(c);
+		if (f == NULL) {
+			c->spill_retry_ns = now_ns() + SPILL_RETRY_NS;
+		}
 	}
+	if (f == NULL) {
+		capture_buffer_read(cp, NULL, header.caplen);
+		cp->dropped++;
+		return;
+	}
+
+	struct spill_record rec = {
+		.ts_sec = header.ts.tv_sec,
+		.ts_usec = header.ts.tv_usec,
+		.caplen = header.caplen,
+		.len = header.len
+	};
+	memcpy(f->map + f->len, &rec, sizeof(rec));
+	capture_buffer_read(cp, f->map + f->len + sizeof(rec), header.caplen);
+	f->len += len;
+	f->records++;
+}
+
+static void capture_spill_make_room(struct capture *c, const struct pcap_pkthdr *header)
+{
+	struct captured_packets *cp = c->current;
+	size_t len = sizeof(*header) + header->caplen;
+	while (cp->records && (cp->records >= cp->record_max || cp->ring_size - cp->used < len)) {
+		capture_spill_oldest(c);
+	}
+}
+
+/*
+ * Takes the oldest record from a list of spill files, copying its data to
+ * 'data' if given, and removes each file once it has all been read. The
+ * file still being written is kept but emptied, to be filled again.
+ * Returns false if there is nothing to read.
+ */
+static bool spill_get_packet(struct capture *c, struct spill_file **files,
+		struct pcap_pkthdr *header, uint8_t *data)
+{
+	struct spill_file *f;
+	while ((f = *files)) {
+		if (f->records && (f->map || spill_file_map(c, f) == 0)) {
+			break;
+		}
+		if (f->records == 0 && f->fd != -1) {
+			f->len = f->off = sizeof(struct pcap_file_header);
+			return false;
+		}
+		*files = f->next;
+		spill_file_remove(c, f);
+	}
+	if (f == NULL) {
+		return false;
+	}
+
+	struct spill_record rec;
+	memcpy(&rec, f->map + f->off, sizeof(rec));
+	header->ts.tv_sec = rec.ts_sec;
+	header->ts.tv_usec = rec.ts_usec;
+	header->caplen = rec.caplen;
+	header->len = rec.len;
+	if (data) {
+		memcpy(data, f->map + f->off + sizeof(rec), rec.caplen);
+	}
+	f->off += sizeof(rec) + rec.caplen;
+	f->records--;
+	return true;
+}
 
+static bool spill_pending(struct spill_file *files)
+{
+	for (struct spill_file *f = files; f; f = f->next) {
+		if (f->records) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Hands what has been spilled to a dump. The writer starts a new file for
+ * whatever comes next.
+ */
+static void capture_spill_handoff(struct capture *c)
+{
+	if (c->spill_writing) {
+		spill_file_close(c->spill_writing);
+		c->spill_writing = NULL;
+	}
+	struct spill_file **tail = &c->spill_dump;
+	while (*tail) {
+		tail = &(*tail)->next;
+	}
+	*tail = c->spill_files;
+	c->spill_files = NULL;
+}
+
+/*
+ * Takes the oldest packet a capture holds, spilled ones first
+ */
+static bool capture_next_packet(struct capture *c, struct pcap_pkthdr *header, uint8_t *data)
+{
+	return spill_get_packet(c, &c->spill_files, header, data)
+		|| (c->current && capture_buffer_get_packet(c->current, header, data));
+}
+
+static bool capture_has_packets(struct capture *c)
+{
+	return spill_pending(c->spill_files) || (c->current && c->current->records);
+}
+
+static struct capture *capture_alloc(uint32_t index, size_t ring_size, uint32_t packet_max)
+{
 	struct capture *c = calloc(1, sizeof(*c));
 	if (c) {
-		c->current = capture_buffer_new(packet_max);
+		c->current = capture_buffer_new(ring_size, packet_max);
 		if (c->current == NULL) {
 			free(c);
 			return NULL;
 		}
+		if (pipe(c->wake_fds) == -1) {
+			capture_buffer_free(c->current);
+			free(c);
+			return NULL;
+		}
+		for (int i = 0; i < 2; i++) {
+			fcntl(c->wake_fds[i], F_SETFL, O_NONBLOCK);
+			fcntl(c->wake_fds[i], F_SETFD, FD_CLOEXEC);
+		}
 		c->index = index;
-		c->pcap_handle = handle;
+#ifdef HAVE_TPACKET_V3
+		c->tpacket_fd = -1;
+#endif
 		c->packet_max = packet_max;
+		c->ring_size = ring_size;
+		c->snaplen = PCAP_SNAP_LEN;
 		pthread_mutex_init(&c->sync_lock, NULL);
 		pthread_cond_init(&c->sync_cv, NULL);
+	}
+	return c;
+}
+
+static struct capture *capture_new(uint32_t index, pcap_t *handle,
+		size_t ring_size, uint32_t packet_max)
+{
+	if (index == 0 || index > SNIFFER_MAX_INTERFACES) {
+		return NULL;
+	}
+
+	struct capture *c = capture_alloc(index, ring_size, packet_max);
+	if (c) {
+		c->pcap_handle = handle;
 		HASH_ADD_INT(captures, index, c);
 	}
 	return c;
 }
 
+static void capture_destroy(struct capture *c)
+{
+	for (uint32_t i = 0; i < c->fanout_cnt; i++) {
+		capture_destroy(c->fanout[i]);
+	}
+	free(c->fanout);
+	if (c->stream_ctx) {
+		capture_stream_end(c, TLV_RESULT_SUCCESS);
+	}
+#ifdef HAVE_TPACKET_V3
+	if (c->tpacket_fd != -1) {
+		munmap(c->tpacket_map,
+			c->tpacket_req.tp_block_size * c->tpacket_req.tp_block_nr);
+		close(c->tpacket_fd);
+	}
+#endif
+	if (c->pcap_handle) {
+		pcap_close(c->pcap_handle);
+	}
+	if (c->filter_str) {
+		pcap_freecode(&c->filter_bpf);
+	}
+	capture_buffer_free(c->current);
+	capture_buffer_free(c->dump);
+	capture_buffer_free(c->new);
+	capture_buffer_free(c->spare);
+	flows_free(c->flows);
+	flows_free(c->flows_dump);
+	if (c->dump_buffer) {
+		free(c->dump_buffer);
+	}
+	capture_buffer_free(c->dump_ring);
+	spill_files_remove(c, c->spill_files);
+	spill_files_remove(c, c->spill_dump);
+	free(c->spill_dir);
+	if (c->filter_str) {
+		free(c->filter_str);
+	}
+	close(c->wake_fds[0]);
+	close(c->wake_fds[1]);
+	pthread_mutex_destroy(&c->sync_lock);
+	pthread_cond_destroy(&c->sync_cv);
+	free(c);
+}
+
 static void capture_free(uint32_t index)
 {
 	struct capture *c;
 	HASH_FIND_INT(captures, &index, c);
 	if (c) {
 		HASH_DEL(captures, c);
-		capture_buffer_free(c->current);
-		capture_buffer_free(c->dump);
-		capture_buffer_free(c->new);
-		if (c->dump_buffer) {
-			free(c->dump_buffer);
+		capture_destroy(c);
+	}
+}
+
+static struct capture *find_capture(uint32_t index)
+{
+	if (index == 0 || index > SNIFFER_MAX_INTERFACES) {
+		return NULL;
+	}
+
+	struct capture *c = NULL;
+	HASH_FIND_INT(captures, &index, c);
+	return c;
+}
+
+/*
+ * Wake the capture thread so it notices a stop or dump request.
+ */
+static void capture_wake(struct capture *c)
+{
+	char b = 0;
+	if (write(c->wake_fds[1], &b, 1) == -1 && errno != EAGAIN) {
+		log_error("Error waking capture thread: %s", strerror(errno));
+	}
+}
+
+static uint16_t get_u16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+/*
+ * Find the network header for the capture's link type, returning the
+ * ethertype-style protocol or 0 if it isn't IP
+ */
+static uint16_t flow_link_payload(int linktype, const uint8_t **data, size_t *len)
+{
+	const uint8_t *p = *data;
+	size_t n = *len;
+	uint16_t type = 0;
+
+	switch (linktype) {
+		case DLT_EN10MB:
+			if (n < ETH_HDR_LEN) {
+				return 0;
+			}
+			type = get_u16(p + 12);
+			p += ETH_HDR_LEN;
+			n -= ETH_HDR_LEN;
+			// Skip any VLAN tags.
+			while ((type == ETH_TYPE_8021Q || type == 0x88a8) && n >= 4) {
+				type = get_u16(p + 2);
+				p += 4;
+				n -= 4;
+			}
+			break;
+#ifdef DLT_LINUX_SLL
+		case DLT_LINUX_SLL:
+			if (n < 16) {
+				return 0;
+			}
+			type = get_u16(p + 14);
+			p += 16;
+			n -= 16;
+			break;
+#endif
+		case DLT_NULL:
+		case DLT_LOOP:
+			// The address family here varies by platform, use the IP version.
+			if (n < 4) {
+				return 0;
+			}
+			p += 4;
+			n -= 4;
+			/* FALLTHROUGH */
+		case DLT_RAW:
+			if (n < 1) {
+				return 0;
+			}
+			type = (p[0] >> 4) == 4 ? ETH_TYPE_IP :
+				(p[0] >> 4) == 6 ? ETH_TYPE_IPV6 : 0;
+			break;
+		default:
+			return 0;
+	}
+
+	*data = p;
+	*len = n;
+	return type;
+}
+
+/*
+ * Parse a packet's L3/L4 headers into a flow key, returning -1 for anything
+ * but IP or when it was truncated before the addresses. If hdr_len is given,
+ * it is set to the length of the headers, or of the whole packet if they
+ * couldn't be parsed.
+ */
+static int flow_parse(int linktype, const uint8_t *p, size_t n,
+		struct flow_key *key, uint8_t *tcp_flags, size_t *hdr_len)
+{
+	const uint8_t *start = p;
+	size_t ignored;
+	if (hdr_len == NULL) {
+		hdr_len = &ignored;
+	}
+	*hdr_len = n;
+
+	memset(key, 0, sizeof(*key));
+	uint16_t type = flow_link_payload(linktype, &p, &n);
+	bool first_fragment = true;
+
+	if (type == ETH_TYPE_IP) {
+		if (n < IP_HDR_LEN || (p[0] >> 4) != 4) {
+			return -1;
+		}
+		size_t hl = (p[0] & 0xf) * 4;
+		key->family = 4;
+		key->proto = p[9];
+		memcpy(key->src, p + 12, 4);
+		memcpy(key->dst, p + 16, 4);
+		first_fragment = (get_u16(p + 6) & IP_OFFMASK) == 0;
+		if (hl < IP_HDR_LEN || hl > n) {
+			return 0;
+		}
+		p += hl;
+		n -= hl;
+	} else if (type == ETH_TYPE_IPV6) {
+		if (n < IP6_HDR_LEN || (p[0] >> 4) != 6) {
+			return -1;
+		}
+		key->family = 6;
+		key->proto = p[6];
+		memcpy(key->src, p + 8, 16);
+		memcpy(key->dst, p + 24, 16);
+		p += IP6_HDR_LEN;
+		n -= IP6_HDR_LEN;
+		// Walk past extension headers to the transport header.
+		while (n >= 8) {
+			size_t ext_len;
+			if (key->proto == IP_PROTO_HOPOPTS || key->proto == IP_PROTO_ROUTING
+					|| key->proto == IP_PROTO_DSTOPTS) {
+				ext_len = (p[1] + 1) * 8;
+			} else if (key->proto == IP_PROTO_FRAGMENT) {
+				first_fragment = (get_u16(p + 2) & 0xfff8) == 0;
+				ext_len = 8;
+			} else {
+				break;
+			}
+			if (ext_len > n) {
+				return 0;
+			}
+			key->proto = p[0];
+			p += ext_len;
+			n -= ext_len;
+		}
+	} else {
+		return -1;
+	}
+
+	// Later fragments have no ports, so they count towards the portless flow.
+	if (!first_fragment) {
+		*hdr_len = p - start;
+		return 0;
+	}
+	size_t l4_len = 0;
+	switch (key->proto) {
+		case IP_PROTO_TCP:
+			if (n >= 14) {
+				key->sport = get_u16(p);
+				key->dport = get_u16(p + 2);
+				*tcp_flags = p[13];
+				l4_len = (p[12] >> 4) * 4;
+			} else {
+				l4_len = n;
+			}
+			break;
+		case IP_PROTO_UDP:
+		case IP_PROTO_SCTP:
+			if (n >= 4) {
+				key->sport = get_u16(p);
+				key->dport = get_u16(p + 2);
+			}
+			l4_len = key->proto == IP_PROTO_UDP ? 8 : 12;
+			break;
+		case IP_PROTO_ICMP:
+		case IP_PROTO_ICMPV6:
+			if (n >= 2) {
+				key->dport = get_u16(p);
+			}
+			l4_len = 8;
+			break;
+	}
+	*hdr_len = (p - start) + TYPESAFE_MIN(l4_len, n);
+	return 0;
+}
+
+static void flow_account(struct capture *c, const struct pcap_pkthdr *header,
+		const uint8_t *data)
+{
+	struct flow_key key;
+	uint8_t tcp_flags = 0;
+	if (flow_parse(c->linktype, data, header->caplen, &key, &tcp_flags, NULL) == -1) {
+		return;
+	}
+
+	uint64_t ts = header->ts.tv_sec * 1000000ULL + header->ts.tv_usec;
+	struct flow *f;
+	HASH_FIND(hh, c->flows, &key, sizeof(key), f);
+	if (f == NULL) {
+		if (c->flow_cnt >= SNIFFER_MAX_FLOWS || (f = calloc(1, sizeof(*f))) == NULL) {
+			c->flows_dropped++;
+			return;
+		}
+		f->key = key;
+		f->first_us = ts;
+		HASH_ADD(hh, c->flows, key, sizeof(key), f);
+		c->flow_cnt++;
+	}
+	f->packets++;
+	f->bytes += header->len;
+	f->last_us = ts;
+	f->tcp_flags |= tcp_flags;
+}
+
+/*
+ * Callback (via pcap) for each packet captured.
+ */
+void packet_handler(unsigned char *user,
+		const struct pcap_pkthdr *header, const unsigned char *data)
+{
+	struct capture *capture = (struct capture *)user;
+	struct pcap_pkthdr h = *header;
+
+	if (capture->flow_mode) {
+		flow_account(capture, header, data);
+	} else {
+		if (capture->headers_only) {
+			struct flow_key key;
+			uint8_t tcp_flags;
+			size_t hdr_len;
+			flow_parse(capture->linktype, data, h.caplen, &key, &tcp_flags, &hdr_len);
+			h.caplen = hdr_len;
+		}
+		h.caplen = TYPESAFE_MIN(h.caplen, capture->snaplen);
+		if (capture->spill_dir) {
+			capture_spill_make_room(capture, &h);
+		}
+		capture_buffer_add_packet(capture->current, &h, data);
+	}
+	capture->current->packet_cnt++;
+	capture->current->byte_cnt += h.caplen;
+	capture->stats_local.packets++;
+
+	return;
+}
+
+#ifdef HAVE_TPACKET_V3
+/*
+ * Map a TPACKET_V3 receive ring for an interface. Only interfaces that carry
+ * ethernet headers are handled here, so that the capture can report
+ * DLT_EN10MB; anything else is left to libpcap. The socket isn't bound until
+ * tpacket_bind(), so a filter can be attached first.
+ */
+static int tpacket_open(struct capture *c, const char *ifname)
+{
+	int fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htons(ETH_P_ALL));
+	if (fd == -1) {
+		return -1;
+	}
+
+	struct ifreq ifr = { 0 };
+	strncpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name) - 1);
+	if (ioctl(fd, SIOCGIFHWADDR, &ifr) == -1
+			|| (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER
+				&& ifr.ifr_hwaddr.sa_family != ARPHRD_LOOPBACK)) {
+		goto err;
+	}
+
+	int version = TPACKET_V3;
+	if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1) {
+		goto err;
+	}
+
+	struct tpacket_req3 *req = &c->tpacket_req;
+	memset(req, 0, sizeof(*req));
+	req->tp_block_size = TPACKET_BLOCK_SIZE;
+	req->tp_block_nr = TPACKET_BLOCK_NR;
+	req->tp_frame_size = TPACKET_FRAME_SIZE;
+	req->tp_frame_nr = (TPACKET_BLOCK_SIZE / TPACKET_FRAME_SIZE) * TPACKET_BLOCK_NR;
+	req->tp_retire_blk_tov = PCAP_TIMEOUT_MS;
+	if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, req, sizeof(*req)) == -1) {
+		goto err;
+	}
+
+	c->tpacket_map = mmap(NULL, req->tp_block_size * req->tp_block_nr,
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (c->tpacket_map == MAP_FAILED) {
+		goto err;
+	}
+
+	c->tpacket_fd = fd;
+	c->tpacket_block = 0;
+	return 0;
+
+err:
+	close(fd);
+	return -1;
+}
+
+static int tpacket_set_filter(struct capture *c, struct bpf_program *bpf)
+{
+	// libpcap's bpf_insn has the same layout as the kernel's sock_filter.
+	struct sock_fprog prog = {
+		.len = bpf->bf_len,
+		.filter = (struct sock_filter *)bpf->bf_insns
+	};
+	return setsockopt(c->tpacket_fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+static int tpacket_bind(struct capture *c, const char *ifname)
+{
+	struct sockaddr_ll sll = {
+		.sll_family = AF_PACKET,
+		.sll_protocol = htons(ETH_P_ALL),
+		.sll_ifindex = if_nametoindex(ifname)
+	};
+	if (sll.sll_ifindex == 0) {
+		return -1;
+	}
+	return bind(c->tpacket_fd, (struct sockaddr *)&sll, sizeof(sll));
+}
+
+/*
+ * Copy every packet in the kernel's retired blocks straight into the
+ * capture ring and hand the blocks back. Returns the number of packets.
+ */
+static int tpacket_dispatch(struct capture *c)
+{
+	int count = 0;
+	struct tpacket_block_desc *block;
+
+	while (1) {
+		block = (struct tpacket_block_desc *)(c->tpacket_map +
+			c->tpacket_block * c->tpacket_req.tp_block_size);
+		if ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE)
+				& TP_STATUS_USER) == 0) {
+			break;
+		}
+
+		struct tpacket3_hdr *tp = (struct tpacket3_hdr *)((uint8_t *)block +
+			block->hdr.bh1.offset_to_first_pkt);
+		for (uint32_t i = 0; i < block->hdr.bh1.num_pkts; i++) {
+			struct pcap_pkthdr header = {
+				.ts.tv_sec = tp->tp_sec,
+				.ts.tv_usec = tp->tp_nsec / 1000,
+				.caplen = TYPESAFE_MIN(tp->tp_snaplen, PCAP_SNAP_LEN),
+				.len = tp->tp_len
+			};
+			packet_handler((unsigned char *)c, &header, (uint8_t *)tp + tp->tp_mac);
+			tp = (struct tpacket3_hdr *)((uint8_t *)tp + tp->tp_next_offset);
+			count++;
+		}
+
+		__atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		c->tpacket_block = (c->tpacket_block + 1) % c->tpacket_req.tp_block_nr;
+	}
+	return count;
+}
+
+/*
+ * Spread the capture over 'threads' sockets in one PACKET_FANOUT group,
+ * splitting its packet budget between their rings. The kernel keeps each
+ * flow on one socket in hash mode, or each CPU's packets in CPU mode.
+ */
+static int capture_fanout(struct capture *c, const char *ifname,
+		uint32_t threads, bool cpu_mode)
+{
+	int mode = cpu_mode ? PACKET_FANOUT_CPU : (PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG);
+	int arg = ((getpid() ^ (c->index << 8)) & 0xffff) | (mode << 16);
+	uint32_t packet_max = TYPESAFE_MAX(c->packet_max / threads, 1);
+	size_t ring_size = TYPESAFE_MAX(c->ring_size / threads,
+		sizeof(struct pcap_pkthdr) + c->snaplen);
+
+	c->fanout = calloc(threads - 1, sizeof(*c->fanout));
+	struct captured_packets *current = capture_buffer_new(ring_size, packet_max);
+	if (c->fanout == NULL || current == NULL) {
+		capture_buffer_free(current);
+		return -1;
+	}
+	capture_buffer_free(c->current);
+	c->current = current;
+	c->packet_max = packet_max;
+	c->ring_size = ring_size;
+
+	if (setsockopt(c->tpacket_fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) == -1) {
+		return -1;
+	}
+
+	for (uint32_t i = 1; i < threads; i++) {
+		struct capture *w = capture_alloc(c->index, ring_size, packet_max);
+		if (w == NULL) {
+			return -1;
+		}
+		c->fanout[c->fanout_cnt++] = w;
+		w->flow_mode = c->flow_mode;
+		w->snaplen = c->snaplen;
+		w->headers_only = c->headers_only;
+		w->linktype = c->linktype;
+		if (tpacket_open(w, ifname) == -1
+				|| (c->filter_str && tpacket_set_filter(w, &c->filter_bpf) == -1)
+				|| tpacket_bind(w, ifname) == -1
+				|| setsockopt(w->tpacket_fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void capture_pin(struct capture *c, uint32_t n)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(n % TYPESAFE_MAX(cpus, 1), &set);
+	int ret_val = pthread_setaffinity_np(c->thread, sizeof(set), &set);
+	if (ret_val) {
+		log_info("Cannot pin capture thread %u: %s", n, strerror(ret_val));
+	}
+}
+#endif
+
+/*
+ * Hand the current buffer to a waiting dump request, if there is one, and
+ * say whether a live stream is waiting for packets.
+ */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Called with sync_lock held on the capture thread
+ */
+static void capture_sample_stats(struct capture *c, bool force)
+{
+	uint64_t now = now_ns();
+	uint64_t elapsed = now - c->stats_sampled_ns;
+	if (!force && elapsed < STATS_INTERVAL_NS) {
+		return;
+	}
+
+	struct capture_stats *st = &c->stats_local;
+#ifdef HAVE_TPACKET_V3
+	if (c->tpacket_fd != -1) {
+		// The kernel resets these each time they are read.
+		struct tpacket_stats_v3 tp;
+		socklen_t len = sizeof(tp);
+		if (getsockopt(c->tpacket_fd, SOL_PACKET, PACKET_STATISTICS, &tp, &len) == 0) {
+			st->kernel_drops += tp.tp_drops;
+		}
+	} else
+#endif
+	{
+		struct pcap_stat ps;
+		if (pcap_stats(c->pcap_handle, &ps) == 0) {
+			st->kernel_drops = ps.ps_drop;
+			st->if_drops = ps.ps_ifdrop;
+		}
+	}
+	st->ring_drops = c->ring_drops_swapped + c->current->dropped;
+	st->spill_bytes = spill_files_unread(c->spill_files);
+	if (elapsed) {
+		st->rate = (st->packets - c->stats_sampled_packets) * 1000000000ULL / elapsed;
+	}
+
+	c->stats = *st;
+	c->stats_sampled_ns = now;
+	c->stats_sampled_packets = st->packets;
+}
+
+static bool capture_sync(struct capture *capture)
+{
+	pthread_mutex_lock(&capture->sync_lock);
+	if (capture->new) {
+		capture->ring_drops_swapped += capture->current->dropped;
+		capture->dump = capture->current;
+		capture->current = capture->new;
+		capture->new = NULL;
+		if (capture->spill_dir) {
+			capture_spill_handoff(capture);
+		}
+		pthread_cond_signal(&capture->sync_cv);
+	}
+	if (capture->filter_wanted) {
+		capture->filter_result = pcap_setfilter(capture->pcap_handle, capture->filter_wanted);
+		if (capture->filter_result == -1) {
+			log_error("Error from pcap_setfilter(): %s", pcap_geterr(capture->pcap_handle));
+		}
+		capture->filter_wanted = NULL;
+		pthread_cond_signal(&capture->sync_cv);
+	}
+	if (capture->flows_wanted) {
+		capture->flows_dump = capture->flows;
+		capture->flows_dump_dropped = capture->flows_dropped;
+		capture->flows = NULL;
+		capture->flow_cnt = 0;
+		capture->flows_dropped = 0;
+		capture->flows_wanted = false;
+		pthread_cond_signal(&capture->sync_cv);
+	}
+	bool streaming = capture->stream_ctx != NULL;
+	capture_sample_stats(capture, !capture->active);
+	pthread_mutex_unlock(&capture->sync_lock);
+	return streaming;
+}
+
+/*
+ * *** LIVE PCAPNG STREAM ***
+ */
+static size_t pcapng_put_u32(uint8_t *buf, uint32_t v)
+{
+	memcpy(buf, &v, sizeof(v));
+	return sizeof(v);
+}
+
+/*
+ * Blocks are written in host byte order, which the section header's magic
+ * tells readers about
+ */
+static size_t pcapng_section(uint8_t *buf, int linktype, uint32_t snaplen)
+{
+	size_t off = 0;
+	off += pcapng_put_u32(buf + off, PCAPNG_SHB);
+	off += pcapng_put_u32(buf + off, 28);
+	off += pcapng_put_u32(buf + off, PCAPNG_BYTE_ORDER_MAGIC);
+	off += pcapng_put_u32(buf + off, 1);		// version 1.0
+	off += pcapng_put_u32(buf + off, UINT32_MAX);	// section length unknown
+	off += pcapng_put_u32(buf + off, UINT32_MAX);
+	off += pcapng_put_u32(buf + off, 28);
+
+	off += pcapng_put_u32(buf + off, PCAPNG_IDB);
+	off += pcapng_put_u32(buf + off, 20);
+	off += pcapng_put_u32(buf + off, linktype & 0xffff);
+	off += pcapng_put_u32(buf + off, snaplen);
+	off += pcapng_put_u32(buf + off, 20);
+	return off;
+}
+
+/*
+ * Move the oldest captured packet into an enhanced packet block, with
+ * microsecond timestamps as the interface block leaves them by default
+ */
+static size_t pcapng_packet(uint8_t *buf, struct capture *c)
+{
+	struct pcap_pkthdr header;
+	capture_next_packet(c, &header, buf + PCAPNG_EPB_LEN - 4);
+
+	uint32_t padded = (header.caplen + 3) & ~3;
+	uint32_t block_len = PCAPNG_EPB_LEN + padded;
+	uint64_t ts = header.ts.tv_sec * 1000000ULL + header.ts.tv_usec;
+	memset(buf + PCAPNG_EPB_LEN - 4 + header.caplen, 0, padded - header.caplen);
+
+	size_t off = 0;
+	off += pcapng_put_u32(buf + off, PCAPNG_EPB);
+	off += pcapng_put_u32(buf + off, block_len);
+	off += pcapng_put_u32(buf + off, 0);		// interface
+	off += pcapng_put_u32(buf + off, ts >> 32);
+	off += pcapng_put_u32(buf + off, ts & 0xffffffff);
+	off += pcapng_put_u32(buf + off, header.caplen);
+	off += pcapng_put_u32(buf + off, header.len);
+	pcapng_put_u32(buf + block_len - 4, block_len);
+	return block_len;
+}
+
+/*
+ * Send what is in stream_buf as one response, deflated if asked for. Each
+ * chunk is sync flushed, so the client can inflate it as it arrives.
+ */
+static struct tlv_packet *capture_stream_chunk(struct capture *c, bool last)
+{
+	struct tlv_packet *p = tlv_packet_response(c->stream_ctx);
+	if (c->stream_compress) {
+		c->stream_z.next_in = c->stream_buf;
+		c->stream_z.avail_in = c->stream_len;
+		c->stream_z.next_out = c->stream_zbuf;
+		c->stream_z.avail_out = c->stream_zbuf_len;
+		deflate(&c->stream_z, last ? Z_FINISH : Z_SYNC_FLUSH);
+		p = tlv_packet_add_raw(p, TLV_TYPE_SNIFFER_PACKET, c->stream_zbuf,
+			c->stream_zbuf_len - c->stream_z.avail_out);
+	} else {
+		p = tlv_packet_add_raw(p, TLV_TYPE_SNIFFER_PACKET, c->stream_buf, c->stream_len);
+	}
+	c->stream_len = 0;
+	return p;
+}
+
+static void capture_stream_continue(struct capture *c)
+{
+	while (capture_has_packets(c) && c->stream_len < STREAM_CHUNK_LEN) {
+		c->stream_len += pcapng_packet(c->stream_buf + c->stream_len, c);
+	}
+	struct tlv_packet *p = capture_stream_chunk(c, false);
+	p = tlv_packet_add_bool(p, TLV_TYPE_CONTINUATION, true);
+	tlv_dispatcher_enqueue_response(c->stream_ctx->td, p);
+}
+
+/*
+ * Runs on the capture thread, draining the ring while mettle keeps up
+ */
+static void capture_stream_flush(struct capture *c)
+{
+	while ((c->stream_len || capture_has_packets(c))
+			&& extension_output_queued(sniffer_extension) < STREAM_WINDOW) {
+		capture_stream_continue(c);
+	}
+}
+
+static int capture_stream_start(struct capture *c, struct tlv_handler_ctx *ctx, bool compress)
+{
+	c->stream_buf = malloc(STREAM_BUF_LEN);
+	if (c->stream_buf == NULL) {
+		return -1;
+	}
+	if (compress) {
+		if (deflateInit(&c->stream_z, Z_DEFAULT_COMPRESSION) != Z_OK) {
+			goto err;
+		}
+		c->stream_zbuf_len = deflateBound(&c->stream_z, STREAM_BUF_LEN) + 16;
+		c->stream_zbuf = malloc(c->stream_zbuf_len);
+		if (c->stream_zbuf == NULL) {
+			deflateEnd(&c->stream_z);
+			goto err;
+		}
+	}
+	c->stream_compress = compress;
+	c->stream_len = pcapng_section(c->stream_buf, pcap_datalink(c->pcap_handle), c->snaplen);
+
+	pthread_mutex_lock(&c->sync_lock);
+	c->stream_ctx = ctx;
+	pthread_mutex_unlock(&c->sync_lock);
+	capture_wake(c);
+	return 0;
+
+err:
+	free(c->stream_buf);
+	c->stream_buf = NULL;
+	return -1;
+}
+
+/*
+ * Sends the rest of the stream with the final result, once the capture
+ * thread has stopped
+ */
+static void capture_stream_end(struct capture *c, int rc)
+{
+	/*
+	 * The ring is bounded, so whatever is left can go without waiting.
+	 * Spill files are not, so once anything has been spilled the rest is
+	 * left for a dump to read back in order.
+	 */
+	while (!spill_pending(c->spill_files) && c->current && c->current->records) {
+		capture_stream_continue(c);
+	}
+
+	struct tlv_packet *p = capture_stream_chunk(c, true);
+	p = tlv_packet_add_u32(p, TLV_TYPE_SNIFFER_PACKETS_DROPPED,
+		c->current ? c->current->dropped : 0);
+	p = tlv_packet_add_result(p, rc);
+	tlv_dispatcher_enqueue_response(c->stream_ctx->td, p);
+	tlv_handler_ctx_free(c->stream_ctx);
+	c->stream_ctx = NULL;
+
+	if (c->stream_compress) {
+		deflateEnd(&c->stream_z);
+		free(c->stream_zbuf);
+		c->stream_zbuf = NULL;
+	}
+	free(c->stream_buf);
+	c->stream_buf = NULL;
+}
+
+/*
+ * This function runs as a pthread and captures packets.
+ */
+void *sniff_packets(void *arg)
+{
+	struct capture *capture = (struct capture *)arg;
+
+	/*
+	 * Threads pinned one per fanout queue keep their CPU whatever the bulk
+	 * class says
+	 */
+	if (capture->pinned) {
+		thread_role_set_name("sniff");
+	} else {
+		thread_role_enter(THREAD_ROLE_BULK, "sniff");
+	}
+
+	/*
+	 * Sleep in poll() until packets arrive or a request wakes us. The
+	 * timeout only guards against platforms where the pcap fd doesn't
+	 * become readable when its buffer timeout expires.
+	 */
+	struct pollfd pfd[2] = {
+		{ .fd = capture->wake_fds[0], .events = POLLIN },
+		{ .fd = -1, .events = POLLIN }
+	};
+	int timeout = PCAP_POLL_MS;
+#ifdef HAVE_TPACKET_V3
+	if (capture->tpacket_fd != -1) {
+		pfd[1].fd = capture->tpacket_fd;
+	} else
+#endif
+	{
+		pcap_setnonblock(capture->pcap_handle, 1, NULL);
+		pfd[1].fd = pcap_get_selectable_fd(capture->pcap_handle);
+		if (pfd[1].fd == -1) {
+			// Nothing to wait on, fall back to polling pcap.
+			timeout = PCAP_TIMEOUT_MS;
+		}
+	}
+
+	capture->stats_sampled_ns = now_ns();
+	while (capture->active) {
+		int ret_val;
+		uint64_t start_ns = now_ns();
+#ifdef HAVE_TPACKET_V3
+		if (capture->tpacket_fd != -1) {
+			ret_val = tpacket_dispatch(capture);
+		} else
+#endif
+		ret_val = pcap_dispatch(capture->pcap_handle,
+				PCAP_MAX_PKT_BATCH,
+				packet_handler,
+				(unsigned char *)capture);
+		capture->stats_local.handler_ns += now_ns() - start_ns;
+		if (capture_sync(capture)) {
+			capture_stream_flush(capture);
+		}
+
+		if (ret_val == PCAP_MAX_PKT_BATCH) {
+			// More is likely waiting, go straight back for it.
+			continue;
+		}
+
+		// After an error, don't spin on a capture fd that stays readable.
+		int nfds = (ret_val < 0 || pfd[1].fd == -1) ? 1 : 2;
+		if (poll(pfd, nfds, ret_val < 0 ? PCAP_POLL_MS : timeout) > 0 && pfd[0].revents) {
+			char buf[64];
+			while (read(capture->wake_fds[0], buf, sizeof(buf)) > 0);
+		}
+	}
+
+	// Publish the final counts for stats on the stopped capture.
+	pthread_mutex_lock(&capture->sync_lock);
+	capture_sample_stats(capture, true);
+	pthread_mutex_unlock(&capture->sync_lock);
+	thread_role_leave();
+	return NULL;
+}
+
+/*
+ * Thread 'n' of a capture, where 0 is the capture itself and any others
+ * are its fanout
+ */
+static struct capture *capture_thread(struct capture *c, uint32_t n)
+{
+	return n == 0 ? c : c->fanout[n - 1];
+}
+
+static void capture_stop(struct capture *c)
+{
+	for (uint32_t i = 0; i <= c->fanout_cnt; i++) {
+		struct capture *t = capture_thread(c, i);
+		if (t->active) {
+			t->active = false;
+			capture_wake(t);
+			pthread_join(t->thread, NULL);
+		}
+	}
+}
+
+static int capture_run(struct capture *c, bool pin)
+{
+	for (uint32_t i = 0; i <= c->fanout_cnt; i++) {
+		struct capture *t = capture_thread(c, i);
+		t->active = true;
+#ifdef HAVE_TPACKET_V3
+		t->pinned = pin;
+#endif
+		int ret_val = pthread_create(&t->thread, NULL, sniff_packets, t);
+		if (ret_val) {
+			log_error("Error from pthread_create(): %d", ret_val);
+			t->active = false;
+			capture_stop(c);
+			return -1;
+		}
+#ifdef HAVE_TPACKET_V3
+		if (pin) {
+			capture_pin(t, i);
+		}
+#endif
+	}
+	return 0;
+}
+
+static void capture_totals(struct capture *c, uint32_t *packets, uint32_t *bytes)
+{
+	*packets = 0;
+	*bytes = 0;
+	for (uint32_t i = 0; i <= c->fanout_cnt; i++) {
+		struct capture *t = capture_thread(c, i);
+		if (t->current) {
+			*packets += t->current->packet_cnt;
+			*bytes += t->current->byte_cnt;
+		}
+	}
+}
+
+/*
+ * Add up the counters last published by each thread
+ */
+static void capture_stats_totals(struct capture *c, struct capture_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+	for (uint32_t i = 0; i <= c->fanout_cnt; i++) {
+		struct capture *t = capture_thread(c, i);
+		pthread_mutex_lock(&t->sync_lock);
+		st->packets += t->stats.packets;
+		st->kernel_drops += t->stats.kernel_drops;
+		st->if_drops += t->stats.if_drops;
+		st->ring_drops += t->stats.ring_drops;
+		st->handler_ns += t->stats.handler_ns;
+		st->rate += t->stats.rate;
+		st->spill_bytes += t->stats.spill_bytes;
+		pthread_mutex_unlock(&t->sync_lock);
+	}
+}
+
+/*
+ * Take the packets a thread has captured, handing it a fresh ring if it
+ * is still running. Returns NULL if there is nothing to take.
+ */
+static struct captured_packets *capture_take_packets(struct capture *capture)
+{
+	struct captured_packets *captured_packets;
+	if (capture->active) {
+		// Capture is active on this interface, give the capture thread a new buffer...
+		struct captured_packets *captured_packets_new = capture->spare;
+		capture->spare = NULL;
+		if (captured_packets_new == NULL) {
+			captured_packets_new = capture_buffer_new(capture->ring_size, capture->packet_max);
+		}
+		if (captured_packets_new == NULL) {
+			return NULL;
 		}
-		if (c->filter_str) {
-			free(c->filter_str);
+		// Swap out active capture buffer gracefully...
+		pthread_mutex_lock(&capture->sync_lock);
+		capture->new = captured_packets_new;
+		capture_wake(capture);
+		while (capture->dump == NULL) {
+			pthread_cond_wait(&capture->sync_cv, &capture->sync_lock);
 		}
-		pthread_mutex_destroy(&c->sync_lock);
-		pthread_cond_destroy(&c->sync_cv);
-		free(c);
+		captured_packets = capture->dump;
+		capture->dump = NULL;
+		pthread_mutex_unlock(&capture->sync_lock);
+	} else {
+		captured_packets = capture->current;
+		capture->current = NULL;
 	}
+	return captured_packets;
 }
 
-static struct capture *find_capture(uint32_t index)
+static void capture_return_packets(struct capture *capture,
+		struct captured_packets *captured_packets)
 {
-	if (index == 0 || index > SNIFFER_MAX_INTERFACES) {
-		return NULL;
+	if (capture->active && capture->spare == NULL) {
+		// Keep the drained ring around for the next dump.
+		capture_buffer_reset(captured_packets);
+		capture->spare = captured_packets;
+	} else {
+		capture_buffer_free(captured_packets);
 	}
-
-	struct capture *c = NULL;
-	HASH_FIND_INT(captures, &index, c);
-	return c;
 }
 
-static struct capture *find_capture_by_thread(pthread_t thread)
+/*
+ * Drop whatever is left of the last dump
+ */
+static void capture_dump_clear(struct capture *capture)
 {
-	struct capture *c = NULL;
-	HASH_FIND(hh_tid, captures, &thread, sizeof(thread), c);
-	return c;
+	free(capture->dump_buffer);
+	capture->dump_buffer = NULL;
+	capture->dump_packet_cnt = 0;
+	capture->dump_buffer_len = 0;
+	capture->dump_buffer_index = 0;
+
+	spill_files_remove(capture, capture->spill_dump);
+	capture->spill_dump = NULL;
+	if (capture->dump_ring) {
+		capture_return_packets(capture, capture->dump_ring);
+		capture->dump_ring = NULL;
+	}
+	capture->dump_spilled = false;
+	capture->dump_record_len = 0;
+	capture->dump_record_off = 0;
 }
 
-uint64_t time_us(void)
+static uint64_t capture_buffer_peek_time(struct captured_packets *cp)
 {
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	return (tv.tv_sec * 1000000ULL) + tv.tv_usec;
+	struct pcap_pkthdr header;
+	size_t first = TYPESAFE_MIN(sizeof(header), cp->ring_size - cp->tail);
+	memcpy(&header, cp->ring + cp->tail, first);
+	memcpy((uint8_t *)&header + first, cp->ring, sizeof(header) - first);
+	return header.ts.tv_sec * 1000000ULL + header.ts.tv_usec;
 }
 
 /*
- * Callback (via pcap) for each packet captured.
+ * Install a new filter on a running capture without stopping it. Kernel
+ * filters are swapped in place on each AF_PACKET socket, while a pcap
+ * handle is only touched by its thread, so that is asked to do it.
  */
-void packet_handler(unsigned char *user,
-		const struct pcap_pkthdr *header, const unsigned char *data)
+static int capture_install_filter(struct capture *capture, struct bpf_program *bpf)
 {
-	struct capture *capture = (struct capture *)user;
-
-	capture_buffer_add_packet(capture->current->ringbuf, header, data);
-	capture->current->packet_cnt++;
-	capture->current->byte_cnt += header->caplen;
-
-	return;
+#ifdef HAVE_TPACKET_V3
+	if (capture->tpacket_fd != -1) {
+		for (uint32_t i = 0; i <= capture->fanout_cnt; i++) {
+			if (tpacket_set_filter(capture_thread(capture, i), bpf) == -1) {
+				log_error("Error attaching filter: %s", strerror(errno));
+				return -1;
+			}
+		}
+		return 0;
+	}
+#endif
+	pthread_mutex_lock(&capture->sync_lock);
+	capture->filter_wanted = bpf;
+	capture_wake(capture);
+	while (capture->filter_wanted) {
+		pthread_cond_wait(&capture->sync_cv, &capture->sync_lock);
+	}
+	int rc = capture->filter_result;
+	pthread_mutex_unlock(&capture->sync_lock);
+	return rc;
 }
 
 /*
- * Signal handler for sniffer pthread.
+ * Take a thread's flow table, handing it over from the capture thread if
+ * it is still running
  */
-void sniff_packets_signal_handler(int signal)
+static struct flow *capture_take_flows(struct capture *capture, uint32_t *dropped)
 {
-	struct capture *capture;
-
-	switch (signal) {
-		case SIGTERM:
-		case SIGUSR1:
-			capture = find_capture_by_thread(pthread_self());
-			if (capture) {
-				pcap_breakloop(capture->pcap_handle);
-			}
-			break;
-		default:
-			break;
+	struct flow *flows;
+	pthread_mutex_lock(&capture->sync_lock);
+	if (capture->active) {
+		// Have the capture thread hand over its table, as with dumps.
+		capture->flows_wanted = true;
+		capture_wake(capture);
+		while (capture->flows_wanted) {
+			pthread_cond_wait(&capture->sync_cv, &capture->sync_lock);
+		}
+		flows = capture->flows_dump;
+		*dropped += capture->flows_dump_dropped;
+		capture->flows_dump = NULL;
+	} else {
+		flows = capture->flows;
+		*dropped += capture->flows_dropped;
+		capture->flows = NULL;
+		capture->flow_cnt = 0;
+		capture->flows_dropped = 0;
 	}
-
+	pthread_mutex_unlock(&capture->sync_lock);
+	return flows;
 }
 
 /*
- * This function runs as a pthread and captures packets.
+ * Fold one flow table into another, for flows split between fanout threads
  */
-void *sniff_packets(void *arg)
+static struct flow *flows_merge(struct flow *into, struct flow *from)
 {
-	struct capture *capture = (struct capture *)arg;
-
-	// Setup signal handling for this pthread.
-	struct sigaction action;
-	sigset_t mask;
-
-	sigemptyset(&mask);
-	sigaddset(&mask, SIGTERM);	// stop capture thread
-	sigaddset(&mask, SIGUSR1);	// dump current capture contents
-
-	action.sa_handler = sniff_packets_signal_handler;
-	action.sa_flags = 0;
-	sigemptyset(&action.sa_mask);
-	sigaction(SIGTERM, &action, NULL);
-	sigaction(SIGUSR1, &action, NULL);
-
-	// Capture loop
-	uint64_t start_us;
-	int ret_val = 0;
-	while (capture->active) {
-		// Measure the time spent processing packets.
-		start_us = time_us();
-
-		ret_val = pcap_dispatch(capture->pcap_handle,
-				PCAP_MAX_PKT_BATCH,
-				packet_handler,
-				(unsigned char *)capture);
-		if (capture->new) {
-			capture->dump = capture->current;
-			capture->current = capture->new;
-			capture->new = NULL;
-			pthread_cond_signal(&capture->sync_cv);
-		}
-
-		/*
-		 * Sleep an duration based on activity (or lack thereof).
-		 *
-		 * Hat-tip to bcook-r7 for this code!
-		 */
-		uint64_t processing_us = time_us() - start_us;
-		if (ret_val > 0 && processing_us < PCAP_ACTIVE_PKT_SLEEP_US) {
-			usleep(PCAP_ACTIVE_PKT_SLEEP_US - processing_us);
-		} else if (ret_val == 0) {
-			usleep(PCAP_INACTIVE_PKT_SLEEP_US);
+	struct flow *f, *tmp, *g;
+	HASH_ITER(hh, from, f, tmp) {
+		HASH_DEL(from, f);
+		HASH_FIND(hh, into, &f->key, sizeof(f->key), g);
+		if (g == NULL) {
+			HASH_ADD(hh, into, key, sizeof(f->key), f);
+			continue;
 		}
+		g->packets += f->packets;
+		g->bytes += f->bytes;
+		g->first_us = TYPESAFE_MIN(g->first_us, f->first_us);
+		g->last_us = TYPESAFE_MAX(g->last_us, f->last_us);
+		g->tcp_flags |= f->tcp_flags;
+		free(f);
 	}
-	return NULL;
+	return into;
 }
 
 /*
@@ -416,7 +1888,6 @@ done:
 static struct tlv_packet *request_capture_start(struct tlv_handler_ctx *ctx)
 {
 	char errbuf[PCAP_ERRBUF_SIZE] = { 0 };
-	int ret_val;
 	int tlv_result = TLV_RESULT_FAILURE;
 	struct tlv_packet *r = tlv_packet_response(ctx);
 
@@ -426,12 +1897,34 @@ static struct tlv_packet *request_capture_start(struct tlv_handler_ctx *ctx)
 	}
 
 	// Retrieve command parameters.
-	uint32_t index, maxp;
+	uint32_t index, maxp = 0;
 	tlv_packet_get_u32(ctx->req, TLV_TYPE_SNIFFER_INTERFACE_ID, &index);
-	tlv_packet_get_u32(ctx->req, TLV_TYPE_SNIFFER_PACKET_COUNT, &maxp);
+	bool have_maxp = tlv_packet_get_u32(ctx->req, TLV_TYPE_SNIFFER_PACKET_COUNT, &maxp) == 0;
 	maxp = TYPESAFE_MIN(maxp, SNIFFER_MAX_QUEUE);
 	maxp = TYPESAFE_MAX(maxp, 1);
+	uint32_t snaplen = PCAP_SNAP_LEN, buffer_size = 0;
+	bool headers_only = false;
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_SNIFFER_SNAPLEN, &snaplen);
+	tlv_packet_get_bool(ctx->req, TLV_TYPE_SNIFFER_HEADERS_ONLY, &headers_only);
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_SNIFFER_BUFFER_SIZE, &buffer_size);
+	snaplen = TYPESAFE_MIN(snaplen, headers_only ? PCAP_HEADERS_SNAP_LEN : PCAP_SNAP_LEN);
+	snaplen = TYPESAFE_MAX(snaplen, 1);
 	char *filter = tlv_packet_get_str(ctx->req, TLV_TYPE_SNIFFER_ADDITIONAL_FILTER);
+	bool flow_mode = false;
+	tlv_packet_get_bool(ctx->req, TLV_TYPE_SNIFFER_FLOWS, &flow_mode);
+	uint32_t threads = 1;
+	bool fanout_cpu = false, pin = false;
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_SNIFFER_FANOUT_THREADS, &threads);
+	tlv_packet_get_bool(ctx->req, TLV_TYPE_SNIFFER_FANOUT_CPU, &fanout_cpu);
+	tlv_packet_get_bool(ctx->req, TLV_TYPE_SNIFFER_FANOUT_PIN, &pin);
+	threads = TYPESAFE_MIN(threads, SNIFFER_MAX_FANOUT);
+	char *spill_dir = tlv_packet_get_str(ctx->req, TLV_TYPE_SNIFFER_SPILL_DIR);
+	uint32_t spill_file_size = SNIFFER_SPILL_FILE_SIZE;
+	uint64_t spill_max = 0;
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_SNIFFER_SPILL_FILE_SIZE, &spill_file_size);
+	tlv_packet_get_u64(ctx->req, TLV_TYPE_SNIFFER_SPILL_MAX, &spill_max);
+	spill_file_size = TYPESAFE_MIN(spill_file_size, SNIFFER_SPILL_FILE_MAX);
+	spill_file_size = TYPESAFE_MAX(spill_file_size, SNIFFER_SPILL_FILE_MIN);
 
 	pcap_if_t *intf = find_interface(index);
 	if (intf == NULL) {
@@ -446,51 +1939,144 @@ static struct tlv_packet *request_capture_start(struct tlv_handler_ctx *ctx)
 		goto done;
 	}
 
-	// Open the interface for "live" packet capturing.
-	pcap_t *handle = pcap_open_live(intf->name, PCAP_SNAP_LEN, 0, PCAP_TIMEOUT_MS, errbuf);
-	if (handle == NULL) {
-		log_error("Error from pcap_open_live(): %s", errbuf);
-		goto done;
-	} else if (strlen(errbuf)) {
-		log_info("Warning from pcap_open_live(): %s", errbuf);
+	if (spill_dir) {
+		// Spilling keeps packets in order for one thread, and flows keep none.
+		if (threads > 1 || flow_mode) {
+			tlv_result = TLV_RESULT_EINVAL;
+			goto done;
+		}
+		if (access(spill_dir, W_OK | X_OK) == -1) {
+			tlv_result = errno;
+			goto done;
+		}
+	}
+
+	/*
+	 * Size the ring for the packet count asked for, or to a byte budget,
+	 * in which case it holds as many packets as fit unless also given a
+	 * count. Flow mode keeps no packets.
+	 */
+	size_t ring_size;
+	if (flow_mode) {
+		maxp = 1;
+		ring_size = capture_ring_size(maxp, snaplen, headers_only);
+	} else if (buffer_size) {
+		ring_size = TYPESAFE_MIN(buffer_size, SNIFFER_MAX_BUFFER);
+		ring_size = TYPESAFE_MAX(ring_size, sizeof(struct pcap_pkthdr) + snaplen);
+		if (!have_maxp) {
+			maxp = UINT32_MAX;
+		}
+	} else {
+		ring_size = capture_ring_size(maxp, snaplen, headers_only);
 	}
-	pcap_set_buffer_size(handle, PCAP_BUFFER_SIZE);
 
 	// Create an associated capture object.
-	struct capture *capture = capture_new(index, handle, maxp);
+	struct capture *capture = capture_new(index, NULL, ring_size, maxp);
 	if (capture == NULL) {
 		tlv_result = TLV_RESULT_FAILURE;
 		goto done;
 	}
+	capture->flow_mode = flow_mode;
+	capture->snaplen = snaplen;
+	capture->headers_only = headers_only;
+	if (spill_dir) {
+		capture->spill_dir = strdup(spill_dir);
+		if (capture->spill_dir == NULL) {
+			capture_free(index);
+			tlv_result = TLV_RESULT_ENOMEM;
+			goto done;
+		}
+		capture->spill_file_size = spill_file_size;
+		capture->spill_max = spill_max;
+	}
+
+#ifdef HAVE_TPACKET_V3
+	/*
+	 * Prefer a mapped AF_PACKET ring on Linux. libpcap is still used to
+	 * compile filters, through a dead handle with the same link type.
+	 */
+	if (tpacket_open(capture, intf->name) == 0) {
+		capture->pcap_handle = pcap_open_dead(DLT_EN10MB, snaplen);
+		if (capture->pcap_handle == NULL) {
+			capture_free(index);
+			goto done;
+		}
+	}
+#endif
+
+	if (capture->pcap_handle == NULL) {
+		// Open the interface for "live" packet capturing.
+		capture->pcap_handle = pcap_open_live(intf->name, snaplen, 0, PCAP_TIMEOUT_MS, errbuf);
+		if (capture->pcap_handle == NULL) {
+			log_error("Error from pcap_open_live(): %s", errbuf);
+			capture_free(index);
+			goto done;
+		} else if (strlen(errbuf)) {
+			log_info("Warning from pcap_open_live(): %s", errbuf);
+		}
+		pcap_set_buffer_size(capture->pcap_handle, PCAP_BUFFER_SIZE);
+	}
+	capture->linktype = pcap_datalink(capture->pcap_handle);
+
+#ifdef HAVE_TPACKET_V3
+	/*
+	 * Filters compiled for the dead handle return its snaplen, so an empty
+	 * one has the kernel truncate packets before copying them to the ring.
+	 */
+	if (filter == NULL && capture->tpacket_fd != -1 && snaplen < PCAP_SNAP_LEN) {
+		filter = "";
+	}
+#endif
 
 	if (filter) {
 		// Setup the interface to use the provided BPF filter.
-		if (pcap_lookupnet(intf->name, &capture->network, &capture->netmask, errbuf) == -1) {
+		if (*filter && pcap_lookupnet(intf->name, &capture->network, &capture->netmask, errbuf) == -1) {
 			log_error("Error from pcap_lookupnet(): %s", errbuf);
-			pcap_close(handle);
+			capture_free(index);
 			goto done;
 		}
 		capture->filter_str = strdup(filter);
 		if (pcap_compile(capture->pcap_handle, &capture->filter_bpf, capture->filter_str, 0, capture->netmask) == -1) {
 			log_error("Error from pcap_compile(): %s", pcap_geterr(capture->pcap_handle));
-			pcap_close(handle);
+			capture_free(index);
 			goto done;
 		}
+#ifdef HAVE_TPACKET_V3
+		if (capture->tpacket_fd != -1) {
+			if (tpacket_set_filter(capture, &capture->filter_bpf) == -1) {
+				log_error("Error attaching filter: %s", strerror(errno));
+				capture_free(index);
+				goto done;
+			}
+		} else
+#endif
 		if (pcap_setfilter(capture->pcap_handle, &capture->filter_bpf) == -1) {
 			log_error("Error from pcap_setfilter(): %s", pcap_geterr(capture->pcap_handle));
-			pcap_close(handle);
+			capture_free(index);
 			goto done;
 		}
 	}
 
-	capture->active = true;
-	ret_val = pthread_create(&capture->thread, NULL, sniff_packets, capture);
-	if (ret_val) {
-		log_error("Error from pthread_create(): %d", ret_val);
-		capture->active = false;
-		pcap_close(handle);
+#ifdef HAVE_TPACKET_V3
+	if (capture->tpacket_fd != -1 && tpacket_bind(capture, intf->name) == -1) {
+		log_error("Error binding to %s: %s", intf->name, strerror(errno));
+		capture_free(index);
+		goto done;
+	}
+
+	// Fanout needs AF_PACKET sockets, elsewhere one thread does it all.
+	if (threads > 1 && capture->tpacket_fd != -1
+			&& capture_fanout(capture, intf->name, threads, fanout_cpu) == -1) {
+		log_error("Error setting up fanout on %s: %s", intf->name, strerror(errno));
+		capture_free(index);
+		goto done;
+	}
+#endif
+
+	if (capture_run(capture, pin) == -1) {
+		capture_free(index);
+		goto done;
 	}
-	HASH_ADD(hh_tid, captures_by_tid, thread, sizeof(pthread_t), capture);
 
 	tlv_result = TLV_RESULT_SUCCESS;
 
@@ -517,14 +2103,16 @@ static struct tlv_packet *request_capture_stop(struct tlv_handler_ctx *ctx)
 		goto done;
 	}
 
-	// Stop capture and wait for thread to exit.
-	capture->active = false;
-	pthread_kill(capture->thread, SIGTERM);
-	pthread_join(capture->thread, NULL);
-	HASH_DELETE(hh_tid, captures_by_tid, capture);
+	// Stop capture and wait for its threads to exit.
+	capture_stop(capture);
+	if (capture->stream_ctx) {
+		capture_stream_end(capture, TLV_RESULT_SUCCESS);
+	}
 
-	r = tlv_packet_add_u32(r, TLV_TYPE_SNIFFER_PACKET_COUNT, capture->current->packet_cnt);
-	r = tlv_packet_add_u32(r, TLV_TYPE_SNIFFER_BYTE_COUNT, capture->current->byte_cnt);
+	uint32_t packets, bytes;
+	capture_totals(capture, &packets, &bytes);
+	r = tlv_packet_add_u32(r, TLV_TYPE_SNIFFER_PACKET_COUNT, packets);
+	r = tlv_packet_add_u32(r, TLV_TYPE_SNIFFER_BYTE_COUNT, bytes);
 
 	tlv_result = TLV_RESULT_SUCCESS;
 
@@ -551,8 +2139,19 @@ static struct tlv_packet *request_capture_stats(struct tlv_handler_ctx *ctx)
 		goto done;
 	}
 
-	r = tlv_packet_add_u32(r, TLV_TYPE_SNIFFER_PACKET_COUNT, capture->current->packet_cnt);
-	r = tlv_packet_add_u32(r, TLV_TYPE_SNIFFER_BYTE_COUNT, capture->current->byte_cnt);
+	uint32_t packets, bytes;
+	capture_totals(capture, &packets, &bytes);
+	r = tlv_packet_add_u32(r, TLV_TYPE_SNIFFER_PACKET_COUNT, packets);
+	r = tlv_packet_add_u32(r, TLV_TYPE_SNIFFER_BYTE_COUNT, bytes);
+
+	struct capture_stats st;
+	capture_stats_totals(capture, &st);
+	r = tlv_packet_add_u64(r, TLV_TYPE_SNIFFER_KERNEL_DROPS, st.kernel_drops);
+	r = tlv_packet_add_u64(r, TLV_TYPE_SNIFFER_INTERFACE_DROPS, st.if_drops);
+	r = tlv_packet_add_u64(r, TLV_TYPE_SNIFFER_RING_DROPS, st.ring_drops);
+	r = tlv_packet_add_u64(r, TLV_TYPE_SNIFFER_HANDLER_TIME, st.handler_ns / 1000);
+	r = tlv_packet_add_u32(r, TLV_TYPE_SNIFFER_PACKET_RATE, st.rate);
+	r = tlv_packet_add_u64(r, TLV_TYPE_SNIFFER_SPILL_BYTES, st.spill_bytes);
 	tlv_result = TLV_RESULT_SUCCESS;
 
 done:
@@ -578,8 +2177,10 @@ static struct tlv_packet *request_capture_release(struct tlv_handler_ctx *ctx)
 		goto done;
 	}
 
-	r = tlv_packet_add_u32(r, TLV_TYPE_SNIFFER_PACKET_COUNT, capture->current->packet_cnt);
-	r = tlv_packet_add_u32(r, TLV_TYPE_SNIFFER_BYTE_COUNT, capture->current->byte_cnt);
+	uint32_t packets, bytes;
+	capture_totals(capture, &packets, &bytes);
+	r = tlv_packet_add_u32(r, TLV_TYPE_SNIFFER_PACKET_COUNT, packets);
+	r = tlv_packet_add_u32(r, TLV_TYPE_SNIFFER_BYTE_COUNT, bytes);
 
 	capture_free(index);
 	tlv_result = TLV_RESULT_SUCCESS;
@@ -589,6 +2190,87 @@ done:
 	return r;
 }
 
+/*
+ * Add the 20-byte header that Framework parses before each packet
+ */
+static void msf_packet_header(uint8_t *record, uint64_t id, const struct pcap_pkthdr *header)
+{
+	uint32_t *buf_ptr = (uint32_t *)record;
+
+	*buf_ptr = htonl(id >> 32); buf_ptr++;
+	*buf_ptr = htonl(id & 0xffffffff); buf_ptr++;
+
+	// Put time in Microsoft format (Framework is expecting it in this format)
+	uint64_t converted_time = (header->ts.tv_sec + 11644473600) * 10000000;
+	converted_time += (header->ts.tv_usec * 10);
+	*buf_ptr = htonl(converted_time >> 32); buf_ptr++;
+	*buf_ptr = htonl(converted_time & 0xffffffff); buf_ptr++;
+
+	*buf_ptr = htonl(header->caplen); buf_ptr++;
+}
+
+/*
+ * Spilled captures may hold more than fits in memory, so their dumps are
+ * not built up front. The spill files and the ring are kept and read back
+ * as dump_read asks, dump_buffer holding the record being sent. Framework
+ * counts a dump's bytes in 32 bits, so one should be taken before 4 GB
+ * have been spilled.
+ */
+static int capture_dump_spilled(struct capture *capture, struct captured_packets *ring)
+{
+	if (!capture->active) {
+		capture_spill_handoff(capture);
+	}
+	capture->dump_buffer = malloc(MSF_PACKET_HEADER_SIZE + PCAP_SNAP_LEN);
+	if (capture->dump_buffer == NULL) {
+		return TLV_RESULT_ENOMEM;
+	}
+	uint64_t records = 0, bytes = 0;
+	for (struct spill_file *f = capture->spill_dump; f; f = f->next) {
+		records += f->records;
+		bytes += f->len - f->off - (size_t)f->records * sizeof(struct spill_record);
+	}
+	if (ring) {
+		records += ring->records;
+		bytes += ring->data_bytes;
+	}
+	capture->dump_spilled = true;
+	capture->dump_ring = ring;
+	capture->dump_next_id = 1;
+	capture->dump_packet_cnt = records;
+	capture->dump_buffer_len = records * MSF_PACKET_HEADER_SIZE + bytes;
+	return TLV_RESULT_SUCCESS;
+}
+
+/*
+ * Copy up to 'len' bytes of a spilled dump to 'buf', continuing from
+ * wherever the last read stopped, even partway through a record
+ */
+static size_t capture_dump_fill(struct capture *capture, uint8_t *buf, size_t len)
+{
+	size_t filled = 0;
+	while (filled < len) {
+		if (capture->dump_record_off == capture->dump_record_len) {
+			struct pcap_pkthdr header;
+			uint8_t *data = capture->dump_buffer + MSF_PACKET_HEADER_SIZE;
+			if (!spill_get_packet(capture, &capture->spill_dump, &header, data)
+					&& (capture->dump_ring == NULL
+					|| !capture_buffer_get_packet(capture->dump_ring, &header, data))) {
+				break;
+			}
+			msf_packet_header(capture->dump_buffer, capture->dump_next_id++, &header);
+			capture->dump_record_len = MSF_PACKET_HEADER_SIZE + header.caplen;
+			capture->dump_record_off = 0;
+		}
+		size_t n = TYPESAFE_MIN(len - filled,
+			capture->dump_record_len - capture->dump_record_off);
+		memcpy(buf + filled, capture->dump_buffer + capture->dump_record_off, n);
+		capture->dump_record_off += n;
+		filled += n;
+	}
+	return filled;
+}
+
 /*
  * Take captured frames in current capture buffer and process them to be ready for
  * sending over to Metasploit Framework.
@@ -608,86 +2290,79 @@ static struct tlv_packet *request_capture_dump(struct tlv_handler_ctx *ctx)
 		goto done;
 	}
 
-	struct captured_packets *captured_packets;
-	if (capture->active) {
-		// Capture is active on this interface, give the capture thread a new buffer...
-		struct captured_packets *captured_packets_new = capture_buffer_new(capture->packet_max);
-		if (captured_packets_new == NULL) {
-			tlv_result = TLV_RESULT_FAILURE;
-			goto done;
-		}
-		// Swap out active capture buffer gracefully...
-		pthread_mutex_lock(&capture->sync_lock);
-		capture->new = captured_packets_new;
-		pthread_kill(capture->thread, SIGUSR1);
-		while (capture->dump == NULL) {
-			pthread_cond_wait(&capture->sync_cv, &capture->sync_lock);
+	struct captured_packets *rings[SNIFFER_MAX_FANOUT] = { NULL };
+	uint32_t ring_cnt = capture->fanout_cnt + 1;
+	size_t buf_size = 0;
+	for (uint32_t i = 0; i < ring_cnt; i++) {
+		rings[i] = capture_take_packets(capture_thread(capture, i));
+		if (rings[i]) {
+			buf_size += (size_t)rings[i]->records * MSF_PACKET_HEADER_SIZE +
+				rings[i]->data_bytes;
 		}
-		captured_packets = capture->dump;
-		capture->dump = NULL;
-		pthread_mutex_unlock(&capture->sync_lock);
-	} else {
-		captured_packets = capture->current;
-		capture->current = NULL;
 	}
 
 	// Create TLV-friendly buffer of packets for dump_read().
 	if (capture->dump_buffer) {
 		// Stale packets present in the buffer, free it up.
-		free(capture->dump_buffer);
-		capture->dump_buffer = NULL;
-		capture->dump_packet_cnt = 0;
-		capture->dump_buffer_len = 0;
-		capture->dump_buffer_index = 0;
-	}
-	size_t buf_size = 1024 * 1024;
-	capture->dump_buffer = malloc(buf_size);
+		capture_dump_clear(capture);
+	}
+	if (capture->spill_dir) {
+		// Spill mode captures have one thread; its ring is kept for dump_read().
+		tlv_result = capture_dump_spilled(capture, rings[0]);
+		if (tlv_result != TLV_RESULT_SUCCESS) {
+			goto out;
+		}
+		rings[0] = NULL;
+		goto respond;
+	}
+	// The rings know exactly how much they hold, so size the dump buffer once.
+	capture->dump_buffer = malloc(TYPESAFE_MAX(buf_size, 1));
 	if (capture->dump_buffer == NULL) {
 		tlv_result = TLV_RESULT_ENOMEM;
-		goto done;
+		goto out;
 	}
 	uint64_t id = 1;
-	struct packet *packet;
-	while ((packet = capture_buffer_get_packet(captured_packets->ringbuf))) {
-		if (capture->dump_buffer_len + MSF_PACKET_HEADER_SIZE + packet->header.caplen > buf_size) {
-			// Need to increase out buffer...
-			buf_size += (1024 * 1024);
-			capture->dump_buffer = realloc(capture->dump_buffer, buf_size);
-			if (capture->dump_buffer == NULL) {
-				tlv_result = TLV_RESULT_ENOMEM;
-				goto done;
+	struct pcap_pkthdr header;
+	while (1) {
+		// Merge the threads' rings by timestamp, oldest packet first.
+		struct captured_packets *captured_packets = NULL;
+		uint64_t oldest = 0;
+		for (uint32_t i = 0; i < ring_cnt; i++) {
+			if (rings[i] && rings[i]->records) {
+				uint64_t ts = capture_buffer_peek_time(rings[i]);
+				if (captured_packets == NULL || ts < oldest) {
+					captured_packets = rings[i];
+					oldest = ts;
+				}
 			}
 		}
-		// Add 20-byte header that Framework can parse.
-		uint32_t *buf_ptr = (uint32_t *)&capture->dump_buffer[capture->dump_buffer_len];
-
-		*buf_ptr = htonl(id >> 32); buf_ptr++;
-		*buf_ptr = htonl(id & 0xffffffff); buf_ptr++;
-
-		// Put time in Microsoft format (Framework is expecting it in this format)
-		uint64_t converted_time = (packet->header.ts.tv_sec + 11644473600) * 10000000;
-		converted_time += (packet->header.ts.tv_usec * 10);
-		*buf_ptr = htonl(converted_time >> 32); buf_ptr++;
-		*buf_ptr = htonl(converted_time & 0xffffffff); buf_ptr++;
-
-		*buf_ptr = htonl(packet->header.caplen); buf_ptr++;
+		if (captured_packets == NULL) {
+			break;
+		}
 
-		// Add the packet itself.
-		memcpy((u_char *)buf_ptr, packet->data, packet->header.caplen);
+		// Copy the packet itself straight out of the ring, after its header.
+		uint8_t *record = &capture->dump_buffer[capture->dump_buffer_len];
+		capture_buffer_get_packet(captured_packets, &header, record + MSF_PACKET_HEADER_SIZE);
+		msf_packet_header(record, id, &header);
 
-		capture->dump_buffer_len += MSF_PACKET_HEADER_SIZE + packet->header.caplen;
+		capture->dump_buffer_len += MSF_PACKET_HEADER_SIZE + header.caplen;
 		capture->dump_packet_cnt++;
 		id++;
 	}
 
-	capture_buffer_free(captured_packets);
-
+respond:
 	r = tlv_packet_add_u32(r, TLV_TYPE_SNIFFER_PACKET_COUNT, capture->dump_packet_cnt);
 	r = tlv_packet_add_u32(r, TLV_TYPE_SNIFFER_BYTE_COUNT, capture->dump_buffer_len);
 	// per Windows Meterpreter sniffer code, overload TLV_TYPE_SNIFFER_INTERFACE_ID here with datalink type
 	r = tlv_packet_add_u32(r, TLV_TYPE_SNIFFER_INTERFACE_ID, pcap_datalink(capture->pcap_handle));
 
 	tlv_result = TLV_RESULT_SUCCESS;
+out:
+	for (uint32_t i = 0; i < ring_cnt; i++) {
+		if (rings[i]) {
+			capture_return_packets(capture_thread(capture, i), rings[i]);
+		}
+	}
 done:
 	r = tlv_packet_add_result(r, tlv_result);
 	return r;
@@ -717,19 +2392,32 @@ static struct tlv_packet *request_capture_dump_read(struct tlv_handler_ctx *ctx)
 	if (capture->dump_buffer_index + byte_count > capture->dump_buffer_len) {
 		byte_count = capture->dump_buffer_len - capture->dump_buffer_index;
 	}
-	r = tlv_packet_add_u32(r, TLV_TYPE_SNIFFER_BYTE_COUNT, byte_count);
-	r = tlv_packet_add_raw(r, TLV_TYPE_SNIFFER_PACKET,
-			&capture->dump_buffer[capture->dump_buffer_index], byte_count);
+	if (capture->dump_spilled) {
+		uint8_t *buf = malloc(TYPESAFE_MAX(byte_count, 1));
+		if (buf == NULL) {
+			tlv_result = TLV_RESULT_ENOMEM;
+			goto done;
+		}
+		size_t filled = capture_dump_fill(capture, buf, byte_count);
+		if (filled < byte_count) {
+			// A spill file went missing, so end the dump here.
+			capture->dump_buffer_len = capture->dump_buffer_index + filled;
+		}
+		r = tlv_packet_add_u32(r, TLV_TYPE_SNIFFER_BYTE_COUNT, filled);
+		r = tlv_packet_add_raw(r, TLV_TYPE_SNIFFER_PACKET, buf, filled);
+		free(buf);
+		byte_count = filled;
+	} else {
+		r = tlv_packet_add_u32(r, TLV_TYPE_SNIFFER_BYTE_COUNT, byte_count);
+		r = tlv_packet_add_raw(r, TLV_TYPE_SNIFFER_PACKET,
+				&capture->dump_buffer[capture->dump_buffer_index], byte_count);
+	}
 
 	capture->dump_buffer_index += byte_count;
 
 	if (capture->dump_buffer_index >= (capture->dump_buffer_len - 1)) {
 		// Read of captured packets has gotten them all, free the buffer.
-		free(capture->dump_buffer);
-		capture->dump_buffer = NULL;
-		capture->dump_packet_cnt = 0;
-		capture->dump_buffer_len = 0;
-		capture->dump_buffer_index = 0;
+		capture_dump_clear(capture);
 
 		// If capture isn't active, go ahead and clean it up.
 		if (!capture->active) {
@@ -744,6 +2432,148 @@ done:
 	return r;
 }
 
+/*
+ * Stream an active capture live as pcapng, in partial responses that carry
+ * on until the capture stops. The packets streamed are taken out of the
+ * capture buffer, so dumps only return what the stream hasn't sent yet.
+ */
+/*
+ * Replace the filter of a running capture, keeping its rings and threads.
+ * Packets already queued under the old filter are still delivered.
+ */
+static struct tlv_packet *request_capture_set_filter(struct tlv_handler_ctx *ctx)
+{
+	char errbuf[PCAP_ERRBUF_SIZE] = { 0 };
+	uint32_t index;
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_SNIFFER_INTERFACE_ID, &index);
+	char *filter = tlv_packet_get_str(ctx->req, TLV_TYPE_SNIFFER_ADDITIONAL_FILTER);
+	if (filter == NULL) {
+		// No filter takes everything, still truncated to the snaplen.
+		filter = "";
+	}
+
+	struct capture *capture = find_capture(index);
+	pcap_if_t *intf = find_interface(index);
+	if (capture == NULL || !capture->active || intf == NULL) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_EINVAL);
+	}
+
+	if (*filter && capture->netmask == 0
+			&& pcap_lookupnet(intf->name, &capture->network, &capture->netmask, errbuf) == -1) {
+		log_error("Error from pcap_lookupnet(): %s", errbuf);
+		return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
+	}
+
+	/*
+	 * Compiled against a handle of its own, as the capture thread may be
+	 * using the live one
+	 */
+	pcap_t *dead = pcap_open_dead(capture->linktype, capture->snaplen);
+	if (dead == NULL) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_ENOMEM);
+	}
+	struct bpf_program bpf;
+	int rc = pcap_compile(dead, &bpf, filter, 0, capture->netmask);
+	if (rc == -1) {
+		log_error("Error from pcap_compile(): %s", pcap_geterr(dead));
+	}
+	pcap_close(dead);
+	if (rc == -1) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_EINVAL);
+	}
+
+	char *filter_str = strdup(filter);
+	if (filter_str == NULL || capture_install_filter(capture, &bpf) == -1) {
+		free(filter_str);
+		pcap_freecode(&bpf);
+		return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
+	}
+
+	// Kernel and handle hold their own copies, so the old program can go.
+	if (capture->filter_str) {
+		pcap_freecode(&capture->filter_bpf);
+		free(capture->filter_str);
+	}
+	capture->filter_str = filter_str;
+	capture->filter_bpf = bpf;
+	return tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+}
+
+static struct tlv_packet *request_capture_stream(struct tlv_handler_ctx *ctx)
+{
+	uint32_t index;
+	bool compress = false;
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_SNIFFER_INTERFACE_ID, &index);
+	tlv_packet_get_bool(ctx->req, TLV_TYPE_SNIFFER_STREAM_COMPRESS, &compress);
+
+	struct capture *capture = find_capture(index);
+	if (capture == NULL || !capture->active || capture->flow_mode || capture->fanout_cnt
+			|| capture->stream_ctx || !tlv_handler_ctx_can_stream(ctx)) {
+		// Needs a running single thread capture and a client that takes partial responses.
+		return tlv_packet_response_result(ctx, TLV_RESULT_EINVAL);
+	}
+
+	if (capture_stream_start(capture, ctx, compress) == -1) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_ENOMEM);
+	}
+	return NULL;
+}
+
+/*
+ * Return the flows seen by a flow mode capture since the last call, as
+ * packed records (see sniffer.h), and start counting afresh.
+ */
+static struct tlv_packet *request_capture_flows(struct tlv_handler_ctx *ctx)
+{
+	uint32_t index;
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_SNIFFER_INTERFACE_ID, &index);
+
+	struct capture *capture = find_capture(index);
+	if (capture == NULL || !capture->flow_mode) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_EINVAL);
+	}
+
+	uint32_t dropped = 0;
+	struct flow *flows = capture_take_flows(capture, &dropped);
+	for (uint32_t i = 1; i <= capture->fanout_cnt; i++) {
+		flows = flows_merge(flows, capture_take_flows(capture_thread(capture, i), &dropped));
+	}
+
+	size_t len = HASH_COUNT(flows) * SNIFFER_FLOW_RECORD_LEN;
+	uint8_t *records = malloc(TYPESAFE_MAX(len, 1));
+	if (records == NULL) {
+		flows_free(flows);
+		return tlv_packet_response_result(ctx, TLV_RESULT_ENOMEM);
+	}
+
+	uint8_t *rec = records;
+	struct flow *f, *tmp;
+	HASH_ITER(hh, flows, f, tmp) {
+		uint16_t u16;
+		uint64_t u64;
+		rec[0] = f->key.family;
+		rec[1] = f->key.proto;
+		rec[2] = f->tcp_flags;
+		rec[3] = 0;
+		u16 = htons(f->key.sport); memcpy(rec + 4, &u16, 2);
+		u16 = htons(f->key.dport); memcpy(rec + 6, &u16, 2);
+		memcpy(rec + 8, f->key.src, 16);
+		memcpy(rec + 24, f->key.dst, 16);
+		u64 = dnet_htonll(f->packets); memcpy(rec + 40, &u64, 8);
+		u64 = dnet_htonll(f->bytes); memcpy(rec + 48, &u64, 8);
+		u64 = dnet_htonll(f->first_us); memcpy(rec + 56, &u64, 8);
+		u64 = dnet_htonll(f->last_us); memcpy(rec + 64, &u64, 8);
+		rec += SNIFFER_FLOW_RECORD_LEN;
+	}
+	flows_free(flows);
+
+	struct tlv_packet *r = tlv_packet_response(ctx);
+	r = tlv_packet_add_raw(r, TLV_TYPE_SNIFFER_FLOW_RECORDS, records, len);
+	r = tlv_packet_add_u32(r, TLV_TYPE_SNIFFER_PACKETS_DROPPED, dropped);
+	free(records);
+	return tlv_packet_add_result(r, TLV_RESULT_SUCCESS);
+}
+
 /*
  * Extension is shutting down, stop-and-release all the things.
  */
@@ -753,10 +2583,8 @@ static void sniffer_free()
 	if (captures) {
 		struct capture *capture, *tmp;
 		HASH_ITER(hh, captures, capture, tmp) {
-			// Stop capture and wait for thread to exit.
-			capture->active = false;
-			pcap_breakloop(capture->pcap_handle);
-			pthread_join(capture->thread, NULL);
+			// Stop capture and wait for its threads to exit.
+			capture_stop(capture);
 			capture_free(capture->index);
 		}
 	}
@@ -768,6 +2596,25 @@ static void sniffer_free()
 	}
 }
 
+/*
+ * Register the commands and associated handlers this extension provides.
+ */
+int mettle_extension_init(struct extension *e)
+{
+	sniffer_extension = e;
+	extension_add_handler(e, "sniffer_interfaces", request_interfaces, NULL);
+	extension_add_handler(e, "sniffer_capture_start", request_capture_start, NULL);
+	extension_add_handler(e, "sniffer_capture_stop", request_capture_stop, NULL);
+	extension_add_handler(e, "sniffer_capture_stats", request_capture_stats, NULL);
+	extension_add_handler(e, "sniffer_capture_release", request_capture_release, NULL);
+	extension_add_handler(e, "sniffer_capture_dump", request_capture_dump, NULL);
+	extension_add_handler(e, "sniffer_capture_dump_read", request_capture_dump_read, NULL);
+	extension_add_handler(e, "sniffer_capture_stream", request_capture_stream, NULL);
+	extension_add_handler(e, "sniffer_capture_flows", request_capture_flows, NULL);
+	extension_add_handler(e, "sniffer_capture_set_filter", request_capture_set_filter, NULL);
+	return 0;
+}
+
 /*
  * Sniffer module starts here!
  */
@@ -781,21 +2628,14 @@ int main(void)
 
 	struct extension *e = extension();
 
-	// Register the commands and assocaited handlers this extension provides.
-	extension_add_handler(e, "sniffer_interfaces", request_interfaces, NULL);
-	extension_add_handler(e, "sniffer_capture_start", request_capture_start, NULL);
-	extension_add_handler(e, "sniffer_capture_stop", request_capture_stop, NULL);
-	extension_add_handler(e, "sniffer_capture_stats", request_capture_stats, NULL);
-	extension_add_handler(e, "sniffer_capture_release", request_capture_release, NULL);
-	extension_add_handler(e, "sniffer_capture_dump", request_capture_dump, NULL);
-	extension_add_handler(e, "sniffer_capture_dump_read", request_capture_dump_read, NULL);
+	mettle_extension_init(e);
 
 	// Ready to go!
 	extension_start(e);
 
-	// On the way out now, let's wind things down...
-	extension_free(e);
+	// On the way out now, let's wind things down, ending any streams first.
 	sniffer_free();
+	extension_free(e);
 
 	return 0;
 }
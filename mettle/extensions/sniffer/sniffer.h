@@ -3,6 +3,30 @@
 
 #define SNIFFER_MAX_INTERFACES 128 // let's hope interface index don't go above this value
 #define SNIFFER_MAX_QUEUE  200000 // ~290Mb @ 1514 bytes
+#define SNIFFER_MAX_BUFFER (512 * 1024 * 1024) // capture ring, when sized in bytes
+#define SNIFFER_MAX_FLOWS  65536  // ~6Mb of flow state
+#define SNIFFER_MAX_FANOUT 16     // capture threads sharing one interface
+
+/*
+ * Spilled packets go to pcap files of this size by default, within these
+ * bounds
+ */
+#define SNIFFER_SPILL_FILE_SIZE (64 * 1024 * 1024)
+#define SNIFFER_SPILL_FILE_MIN  (1024 * 1024)
+#define SNIFFER_SPILL_FILE_MAX  (1024 * 1024 * 1024)
+
+/*
+ * Flow records are packed back to back in TLV_TYPE_SNIFFER_FLOW_RECORDS,
+ * with multi-byte fields in network order:
+ *
+ *   family (1, AF_INET = 4 or AF_INET6 = 6), protocol (1), TCP flags seen (1),
+ *   reserved (1), source port (2), destination port (2), source address (16),
+ *   destination address (16), packets (8), bytes (8), first seen (8) and
+ *   last seen (8), in microseconds since the epoch
+ *
+ * ICMP flows carry the type and code as the destination port.
+ */
+#define SNIFFER_FLOW_RECORD_LEN 72
 
 /*
  * TLV message types.
@@ -70,4 +94,118 @@
 		TLV_TYPE_EXTENSION_SNIFFER, \
 		TLV_EXTENSIONS + 10)
 
+#define TLV_TYPE_SNIFFER_STREAM_COMPRESS \
+	MAKE_CUSTOM_TLV( \
+		TLV_META_TYPE_BOOL, \
+		TLV_TYPE_EXTENSION_SNIFFER, \
+		TLV_EXTENSIONS + 11)
+
+#define TLV_TYPE_SNIFFER_PACKETS_DROPPED \
+	MAKE_CUSTOM_TLV( \
+		TLV_META_TYPE_UINT, \
+		TLV_TYPE_EXTENSION_SNIFFER, \
+		TLV_EXTENSIONS + 12)
+
+#define TLV_TYPE_SNIFFER_FLOWS \
+	MAKE_CUSTOM_TLV( \
+		TLV_META_TYPE_BOOL, \
+		TLV_TYPE_EXTENSION_SNIFFER, \
+		TLV_EXTENSIONS + 13)
+
+#define TLV_TYPE_SNIFFER_FLOW_RECORDS \
+	MAKE_CUSTOM_TLV( \
+		TLV_META_TYPE_RAW, \
+		TLV_TYPE_EXTENSION_SNIFFER, \
+		TLV_EXTENSIONS + 14)
+
+#define TLV_TYPE_SNIFFER_FANOUT_THREADS \
+	MAKE_CUSTOM_TLV( \
+		TLV_META_TYPE_UINT, \
+		TLV_TYPE_EXTENSION_SNIFFER, \
+		TLV_EXTENSIONS + 15)
+
+#define TLV_TYPE_SNIFFER_FANOUT_CPU \
+	MAKE_CUSTOM_TLV( \
+		TLV_META_TYPE_BOOL, \
+		TLV_TYPE_EXTENSION_SNIFFER, \
+		TLV_EXTENSIONS + 16)
+
+#define TLV_TYPE_SNIFFER_FANOUT_PIN \
+	MAKE_CUSTOM_TLV( \
+		TLV_META_TYPE_BOOL, \
+		TLV_TYPE_EXTENSION_SNIFFER, \
+		TLV_EXTENSIONS + 17)
+
+#define TLV_TYPE_SNIFFER_KERNEL_DROPS \
+	MAKE_CUSTOM_TLV( \
+		TLV_META_TYPE_QWORD, \
+		TLV_TYPE_EXTENSION_SNIFFER, \
+		TLV_EXTENSIONS + 18)
+
+#define TLV_TYPE_SNIFFER_INTERFACE_DROPS \
+	MAKE_CUSTOM_TLV( \
+		TLV_META_TYPE_QWORD, \
+		TLV_TYPE_EXTENSION_SNIFFER, \
+		TLV_EXTENSIONS + 19)
+
+#define TLV_TYPE_SNIFFER_RING_DROPS \
+	MAKE_CUSTOM_TLV( \
+		TLV_META_TYPE_QWORD, \
+		TLV_TYPE_EXTENSION_SNIFFER, \
+		TLV_EXTENSIONS + 20)
+
+#define TLV_TYPE_SNIFFER_HANDLER_TIME \
+	MAKE_CUSTOM_TLV( \
+		TLV_META_TYPE_QWORD, \
+		TLV_TYPE_EXTENSION_SNIFFER, \
+		TLV_EXTENSIONS + 21)
+
+#define TLV_TYPE_SNIFFER_PACKET_RATE \
+	MAKE_CUSTOM_TLV( \
+		TLV_META_TYPE_UINT, \
+		TLV_TYPE_EXTENSION_SNIFFER, \
+		TLV_EXTENSIONS + 22)
+
+#define TLV_TYPE_SNIFFER_SNAPLEN \
+	MAKE_CUSTOM_TLV( \
+		TLV_META_TYPE_UINT, \
+		TLV_TYPE_EXTENSION_SNIFFER, \
+		TLV_EXTENSIONS + 23)
+
+#define TLV_TYPE_SNIFFER_HEADERS_ONLY \
+	MAKE_CUSTOM_TLV( \
+		TLV_META_TYPE_BOOL, \
+		TLV_TYPE_EXTENSION_SNIFFER, \
+		TLV_EXTENSIONS + 24)
+
+#define TLV_TYPE_SNIFFER_BUFFER_SIZE \
+	MAKE_CUSTOM_TLV( \
+		TLV_META_TYPE_UINT, \
+		TLV_TYPE_EXTENSION_SNIFFER, \
+		TLV_EXTENSIONS + 25)
+
+#define TLV_TYPE_SNIFFER_SPILL_DIR \
+	MAKE_CUSTOM_TLV( \
+		TLV_META_TYPE_STRING, \
+		TLV_TYPE_EXTENSION_SNIFFER, \
+		TLV_EXTENSIONS + 26)
+
+#define TLV_TYPE_SNIFFER_SPILL_FILE_SIZE \
+	MAKE_CUSTOM_TLV( \
+		TLV_META_TYPE_UINT, \
+		TLV_TYPE_EXTENSION_SNIFFER, \
+		TLV_EXTENSIONS + 27)
+
+#define TLV_TYPE_SNIFFER_SPILL_MAX \
+	MAKE_CUSTOM_TLV( \
+		TLV_META_TYPE_QWORD, \
+		TLV_TYPE_EXTENSION_SNIFFER, \
+		TLV_EXTENSIONS + 28)
+
+#define TLV_TYPE_SNIFFER_SPILL_BYTES \
+	MAKE_CUSTOM_TLV( \
+		TLV_META_TYPE_QWORD, \
+		TLV_TYPE_EXTENSION_SNIFFER, \
+		TLV_EXTENSIONS + 29)
+
 #endif
@@ -0,0 +1,468 @@
+/**
+ * Copyright 2015 Rapid7
+ * @brief Buffer queue, ring buffer and TLV codec microbenchmarks
+ * @file bench_core.c
+ *
+ * Each case is warmed up, sized to run for about the requested time, then
+ * repeated. The median and best time per operation are reported along with
+ * the spread between repetitions, so a change can be judged against noise.
+ * Output is one whitespace separated row per case with a fixed header.
+ */
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "buffer_queue.h"
+#include "crypttlv.h"
+#include "ringbuf.h"
+#include "tlv.h"
+#include "util.h"
+
+#define BENCH_REPS 5
+#define BENCH_REPS_MAX 100
+#define BENCH_WARMUP 0.1
+
+/*
+ * Queue depth held while adding and removing, and the batch size for
+ * cases that build and then empty a queue
+ */
+#define BENCH_QUEUE_DEPTH 64
+#define BENCH_BATCH 16
+
+#define BENCH_RINGBUF_LEN (1024 * 1024)
+#define BENCH_PACKETS 64
+#define BENCH_DATA_LEN (1024 * 1024)
+
+static char data[BENCH_DATA_LEN];
+
+struct bench {
+	const char *name;
+	size_t param;
+	void *(*setup)(size_t param);
+	/*
+	 * Performs 'iters' operations and returns the payload bytes they moved
+	 */
+	size_t (*run)(void *state, size_t param, size_t iters);
+	void (*teardown)(void *state);
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *queue_setup(size_t param)
+{
+	struct buffer_queue *q = buffer_queue_new();
+	for (int i = 0; q && i < BENCH_QUEUE_DEPTH; i++) {
+		buffer_queue_add(q, data, param);
+	}
+	return q;
+}
+
+static void *queue_empty_setup(size_t param)
+{
+	return buffer_queue_new();
+}
+
+static void queue_teardown(void *state)
+{
+	buffer_queue_free(state);
+}
+
+/*
+ * FIFO traffic through a queue already holding BENCH_QUEUE_DEPTH chunks
+ */
+static size_t queue_add_remove(void *state, size_t param, size_t iters)
+{
+	static char out[BENCH_DATA_LEN];
+	struct buffer_queue *q = state;
+	for (size_t i = 0; i < iters; i++) {
+		buffer_queue_add(q, data, param);
+		buffer_queue_remove(q, out, param);
+	}
+	return iters * param;
+}
+
+static size_t queue_add_stream(void *state, size_t param, size_t iters)
+{
+	static char out[BENCH_DATA_LEN];
+	struct buffer_queue *q = state;
+	for (size_t i = 0; i < iters; i++) {
+		buffer_queue_add_stream(q, data, param);
+		buffer_queue_remove(q, out, param);
+	}
+	return iters * param;
+}
+
+static size_t queue_remove_msg(void *state, size_t param, size_t iters)
+{
+	struct buffer_queue *q = state;
+	size_t len;
+	for (size_t i = 0; i < iters; i++) {
+		buffer_queue_add(q, data, param);
+		free(buffer_queue_remove_msg(q, &len));
+	}
+	return iters * param;
+}
+
+struct queue_pair {
+	struct buffer_queue *src, *dst;
+};
+
+static void *queue_pair_setup(size_t param)
+{
+	struct queue_pair *qp = calloc(1, sizeof(*qp));
+	if (qp) {
+		qp->src = buffer_queue_new();
+		qp->dst = buffer_queue_new();
+	}
+	return qp;
+}
+
+static void queue_pair_teardown(void *state)
+{
+	struct queue_pair *qp = state;
+	buffer_queue_free(qp->src);
+	buffer_queue_free(qp->dst);
+	free(qp);
+}
+
+/*
+ * One operation fills a queue with a batch, moves it and drains it
+ */
+static size_t queue_move_all(void *state, size_t param, size_t iters)
+{
+	struct queue_pair *qp = state;
+	for (size_t i = 0; i < iters; i++) {
+		for (int j = 0; j < BENCH_BATCH; j++) {
+			buffer_queue_add(qp->src, data, param);
+		}
+		buffer_queue_move_all(qp->dst, qp->src);
+		buffer_queue_drain_all(qp->dst);
+	}
+	return iters * param * BENCH_BATCH;
+}
+
+static size_t queue_pullup(void *state, size_t param, size_t iters)
+{
+	struct buffer_queue *q = state;
+	for (size_t i = 0; i < iters; i++) {
+		for (int j = 0; j < BENCH_BATCH; j++) {
+			buffer_queue_add(q, data, param);
+		}
+		buffer_queue_pullup(q, param * BENCH_BATCH);
+		buffer_queue_drain_all(q);
+	}
+	return iters * param * BENCH_BATCH;
+}
+
+static void *ringbuf_setup(size_t param)
+{
+	return ringbuf_new(BENCH_RINGBUF_LEN);
+}
+
+static void ringbuf_teardown(void *state)
+{
+	ringbuf_t rb = state;
+	ringbuf_free(&rb);
+}
+
+static size_t ringbuf_copy_in_out(void *state, size_t param, size_t iters)
+{
+	static char out[BENCH_DATA_LEN];
+	ringbuf_t rb = state;
+	for (size_t i = 0; i < iters; i++) {
+		ringbuf_memcpy_into(rb, data, param);
+		ringbuf_memcpy_from(out, rb, param);
+	}
+	return iters * param;
+}
+
+/*
+ * A packet of 'param' integer fields, built and freed
+ */
+static size_t tlv_build(void *state, size_t param, size_t iters)
+{
+	for (size_t i = 0; i < iters; i++) {
+		struct tlv_packet *p = tlv_packet_new(TLV_PACKET_TYPE_REQUEST, 0);
+		for (uint32_t j = 0; j < param; j++) {
+			p = tlv_packet_add_u32(p, TLV_META_TYPE_UINT | (j + 1), j);
+		}
+		tlv_packet_free(p);
+	}
+	return iters * param * (TLV_MIN_LEN + sizeof(uint32_t));
+}
+
+static size_t tlv_build_raw(void *state, size_t param, size_t iters)
+{
+	for (size_t i = 0; i < iters; i++) {
+		struct tlv_packet *p = tlv_packet_new(TLV_PACKET_TYPE_RESPONSE, param + TLV_MIN_LEN);
+		p = tlv_packet_add_raw(p, TLV_TYPE_CHANNEL_DATA, data, param);
+		tlv_packet_free(p);
+	}
+	return iters * param;
+}
+
+static void *tlv_fields_setup(size_t param)
+{
+	struct tlv_packet *p = tlv_packet_new(TLV_PACKET_TYPE_REQUEST, 0);
+	for (uint32_t j = 0; j < param; j++) {
+		p = tlv_packet_add_u32(p, TLV_META_TYPE_UINT | (j + 1), j);
+	}
+	return p;
+}
+
+static void tlv_fields_teardown(void *state)
+{
+	tlv_packet_free(state);
+}
+
+/*
+ * Lookups of fields scattered through a packet of 'param' fields
+ */
+static size_t tlv_get_u32(void *state, size_t param, size_t iters)
+{
+	struct tlv_packet *p = state;
+	uint32_t value, sum = 0;
+	for (size_t i = 0; i < iters; i++) {
+		uint32_t type = TLV_META_TYPE_UINT | ((i * 7919) % param + 1);
+		if (tlv_packet_get_u32(p, type, &value) == 0) {
+			sum += value;
+		}
+	}
+	return sum == 0xffffffff;
+}
+
+struct ingress {
+	struct tlv_dispatcher *td;
+	struct buffer_queue *q;
+	void *frames;
+	size_t frames_len;
+};
+
+static void response_cb(struct tlv_dispatcher *td, void *arg)
+{
+}
+
+/*
+ * Frames BENCH_PACKETS packets carrying 'param' bytes each back to back,
+ * as they would arrive from the network
+ */
+static void *ingress_setup(size_t param)
+{
+	struct ingress *in = calloc(1, sizeof(*in));
+	if (in == NULL) {
+		return NULL;
+	}
+	in->td = tlv_dispatcher_new(response_cb, NULL);
+	in->q = buffer_queue_new();
+	if (in->td == NULL || in->q == NULL) {
+		goto err;
+	}
+	tlv_dispatcher_set_compress_threshold(in->td, 0);
+	tlv_dispatcher_add_encryption(in->td, create_tlv_encryption_context(ENC_NONE));
+
+	struct buffer_queue *frames = buffer_queue_new();
+	for (int i = 0; frames && i < BENCH_PACKETS; i++) {
+		struct tlv_packet *p = tlv_packet_new(TLV_PACKET_TYPE_REQUEST, param + 64);
+		p = tlv_packet_add_str(p, TLV_TYPE_METHOD, "core_channel_write");
+		p = tlv_packet_add_fmt(p, TLV_TYPE_REQUEST_ID, "%d", i);
+		p = tlv_packet_add_u32(p, TLV_TYPE_CHANNEL_ID, 1);
+		p = tlv_packet_add_raw(p, TLV_TYPE_CHANNEL_DATA, data, param);
+		size_t len;
+		void *buf;
+		if (p == NULL || tlv_dispatcher_enqueue_response(in->td, p) == -1
+				|| (buf = tlv_dispatcher_dequeue_response(in->td, true, &len)) == NULL) {
+			buffer_queue_free(frames);
+			goto err;
+		}
+		buffer_queue_add(frames, buf, len);
+		free(buf);
+	}
+	if (frames == NULL) {
+		goto err;
+	}
+	in->frames_len = buffer_queue_remove_all(frames, &in->frames);
+	buffer_queue_free(frames);
+	return in;
+
+err:
+	buffer_queue_free(in->q);
+	if (in->td) {
+		tlv_dispatcher_free(in->td);
+	}
+	free(in);
+	return NULL;
+}
+
+static void ingress_teardown(void *state)
+{
+	struct ingress *in = state;
+	free(in->frames);
+	buffer_queue_free(in->q);
+	tlv_dispatcher_free(in->td);
+	free(in);
+}
+
+/*
+ * One operation parses one packet, a batch of them arriving in a single
+ * network read
+ */
+static size_t tlv_ingress(void *state, size_t param, size_t iters)
+{
+	struct ingress *in = state;
+	size_t parsed = 0;
+	while (parsed < iters) {
+		struct tlv_packet *p;
+		buffer_queue_add(in->q, in->frames, in->frames_len);
+		while ((p = tlv_packet_read_buffer_queue(in->td, in->q))) {
+			tlv_packet_free(p);
+			parsed++;
+		}
+	}
+	return parsed * param;
+}
+
+#define QUEUE_CASES(name, setup, run, teardown) \
+	{name, 16, setup, run, teardown}, \
+	{name, 256, setup, run, teardown}, \
+	{name, 4096, setup, run, teardown}, \
+	{name, 65536, setup, run, teardown}
+
+static struct bench benches[] = {
+	QUEUE_CASES("queue_add_remove", queue_setup, queue_add_remove, queue_teardown),
+	QUEUE_CASES("queue_add_stream", queue_empty_setup, queue_add_stream, queue_teardown),
+	QUEUE_CASES("queue_remove_msg", queue_empty_setup, queue_remove_msg, queue_teardown),
+	QUEUE_CASES("queue_move_all", queue_pair_setup, queue_move_all, queue_pair_teardown),
+	QUEUE_CASES("queue_pullup", queue_empty_setup, queue_pullup, queue_teardown),
+	QUEUE_CASES("ringbuf_copy", ringbuf_setup, ringbuf_copy_in_out, ringbuf_teardown),
+	{"tlv_build", 8, NULL, tlv_build, NULL},
+	{"tlv_build", 64, NULL, tlv_build, NULL},
+	{"tlv_build", 512, NULL, tlv_build, NULL},
+	{"tlv_build_raw", 256, NULL, tlv_build_raw, NULL},
+	{"tlv_build_raw", 65536, NULL, tlv_build_raw, NULL},
+	{"tlv_build_raw", 1048576, NULL, tlv_build_raw, NULL},
+	{"tlv_get_u32", 8, tlv_fields_setup, tlv_get_u32, tlv_fields_teardown},
+	{"tlv_get_u32", 64, tlv_fields_setup, tlv_get_u32, tlv_fields_teardown},
+	{"tlv_get_u32", 512, tlv_fields_setup, tlv_get_u32, tlv_fields_teardown},
+	{"tlv_get_u32", 4096, tlv_fields_setup, tlv_get_u32, tlv_fields_teardown},
+	{"tlv_ingress", 64, ingress_setup, tlv_ingress, ingress_teardown},
+	{"tlv_ingress", 4096, ingress_setup, tlv_ingress, ingress_teardown},
+	{"tlv_ingress", 65536, ingress_setup, tlv_ingress, ingress_teardown},
+};
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static int run_bench(struct bench *b, double duration, int reps)
+{
+	void *state = b->setup ? b->setup(b->param) : NULL;
+	if (b->setup && state == NULL) {
+		return -1;
+	}
+
+	/*
+	 * Warm up while finding how many operations fill the repetition time
+	 */
+	size_t iters = 1;
+	double elapsed = 0, start = now();
+	while (now() - start < BENCH_WARMUP || elapsed < duration / 10) {
+		double t = now();
+		b->run(state, b->param, iters);
+		elapsed = now() - t;
+		if (elapsed < duration / 10) {
+			iters *= 2;
+		}
+	}
+	iters = TYPESAFE_MAX(1, (size_t)(iters * duration / elapsed));
+
+	double ns[BENCH_REPS_MAX];
+	size_t bytes = 0;
+	for (int i = 0; i < reps; i++) {
+		double t = now();
+		bytes = b->run(state, b->param, iters);
+		ns[i] = (now() - t) * 1e9 / iters;
+	}
+	if (b->teardown) {
+		b->teardown(state);
+	}
+
+	qsort(ns, reps, sizeof(ns[0]), cmp_double);
+	double median = ns[reps / 2];
+	printf("%-18s %8zu %12.1f %12.1f %8.1f", b->name, b->param,
+		median, ns[0], (ns[reps - 1] - ns[0]) / median * 100);
+	if (bytes > iters) {
+		printf(" %10.1f\n", (double)bytes / iters / median * 1e3);
+	} else {
+		printf(" %10s\n", "-");
+	}
+	fflush(stdout);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [options] [case...]\n", name);
+	printf("  -h             display help\n");
+	printf("  -t <seconds>   time for each repetition (default 0.2)\n");
+	printf("  -r <count>     repetitions of each case (default %u)\n", BENCH_REPS);
+	printf("\nCases:");
+	for (int i = 0; i < COUNT_OF(benches); i++) {
+		if (i == 0 || strcmp(benches[i].name, benches[i - 1].name)) {
+			printf(" %s", benches[i].name);
+		}
+	}
+	printf("\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	double duration = 0.2;
+	int reps = BENCH_REPS;
+	int c;
+
+	while ((c = getopt(argc, argv, "ht:r:")) != -1) {
+		switch (c) {
+			case 't':
+				duration = atof(optarg);
+				break;
+			case 'r':
+				reps = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (duration <= 0 || reps < 1 || reps > BENCH_REPS_MAX) {
+		usage(argv[0]);
+	}
+
+	for (size_t i = 0; i < sizeof(data); i++) {
+		data[i] = rand();
+	}
+
+	printf("%-18s %8s %12s %12s %8s %10s\n", "case", "param",
+		"ns/op med", "ns/op min", "spread%", "MB/s");
+
+	for (int i = 0; i < COUNT_OF(benches); i++) {
+		bool selected = optind == argc;
+		for (int j = optind; j < argc; j++) {
+			selected |= strcmp(argv[j], benches[i].name) == 0;
+		}
+		if (selected && run_bench(&benches[i], duration, reps) == -1) {
+			printf("%-18s %8zu failed\n", benches[i].name, benches[i].param);
+		}
+	}
+	return 0;
+}
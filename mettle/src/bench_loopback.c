@@ -0,0 +1,1146 @@
+/**
+ * Copyright 2015 Rapid7
+ * @brief End-to-end loopback benchmark against a stub handler
+ * @file bench_loopback.c
+ *
+ * Launches mettle against a minimal handler on the loopback and measures
+ * what an operator sees: command round trips, file channel downloads and
+ * uploads and TCP port forwarding, over the tcp, http, fd and unix transports.
+ * The handler frames packets with the same dispatcher code mettle uses. Each
+ * result is printed as one JSON object per line, tagged with the host, so
+ * runs on several targets can be collected and compared.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+
+#include "buffer_queue.h"
+#include "crypttlv.h"
+#include "tlv.h"
+#include "util.h"
+
+#define BENCH_COUNT 1000
+#define BENCH_SIZE (64 * 1024 * 1024)
+#define BENCH_CHUNK (1024 * 1024)
+#define BENCH_FORWARD_CHUNK (64 * 1024)
+#define BENCH_DEPTH 4
+#define BENCH_TIMEOUT 10.0
+
+/*
+ * The fd transport is handed this descriptor in the child
+ */
+#define BENCH_FD 3
+
+/*
+ * The tcp and fd transports wait for a first packet of exactly this TLV
+ * length before taking anything else
+ */
+#define BENCH_FIRST_PACKET_LEN 547
+
+#define HTTP_CONNS_MAX 16
+#define HTTP_HOLD_SECS 5
+
+enum link_kind {
+	LINK_TCP,
+	LINK_HTTP,
+	LINK_FD,
+	LINK_UNIX,
+};
+
+static const struct {
+	const char *name;
+	enum link_kind kind;
+} transports[] = {
+	{"tcp", LINK_TCP},
+	{"http", LINK_HTTP},
+	{"fd", LINK_FD},
+	{"unix", LINK_UNIX},
+};
+
+struct http_conn_state {
+	int fd;
+	struct buffer_queue *in;
+	bool held;
+	bool continued;
+	double held_since;
+};
+
+/*
+ * A peer is the far end of a port forward, either swallowing what mettle
+ * forwards to it or feeding it a fixed amount of data
+ */
+struct peer {
+	int listen_fd;
+	int fd;
+	bool fill;
+	uint64_t limit;
+	uint64_t bytes;
+};
+
+struct link {
+	enum link_kind kind;
+	const char *name;
+	pid_t pid;
+	int listen_fd;
+	int fd;
+	struct buffer_queue *rx;
+	struct http_conn_state conns[HTTP_CONNS_MAX];
+	struct buffer_queue *tx;
+	size_t patch_len;
+	struct peer *peer;
+	uint64_t forwarded;
+	uint64_t forward_want;
+};
+
+static struct tlv_dispatcher *td;
+static unsigned request_seq;
+static struct utsname host;
+static bool verbose;
+static char data[BENCH_CHUNK];
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void response_cb(struct tlv_dispatcher *td, void *arg)
+{
+}
+
+static void print_prefix(struct link *l, const char *test)
+{
+	printf("{\"bench\":\"loopback\",\"machine\":\"%s\",\"os\":\"%s\","
+		"\"transport\":\"%s\",\"test\":\"%s\"",
+		host.machine, host.sysname, l->name, test);
+}
+
+static void print_error(struct link *l, const char *test, const char *error)
+{
+	print_prefix(l, test);
+	printf(",\"error\":\"%s\"}\n", error);
+	fflush(stdout);
+}
+
+static void print_rate(struct link *l, const char *test, uint64_t bytes, double secs)
+{
+	print_prefix(l, test);
+	printf(",\"bytes\":%llu,\"secs\":%.6f,\"mb_per_s\":%.2f}\n",
+		(unsigned long long)bytes, secs, bytes / secs / 1e6);
+	fflush(stdout);
+}
+
+static int listen_loopback(uint16_t *port)
+{
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t slen = sizeof(sin);
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1) {
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1
+			|| listen(fd, 16) == -1
+			|| getsockname(fd, (struct sockaddr *)&sin, &slen) == -1) {
+		close(fd);
+		return -1;
+	}
+	*port = ntohs(sin.sin_port);
+	return fd;
+}
+
+static int listen_unix(char *path, size_t path_len)
+{
+	struct sockaddr_un sun = {
+		.sun_family = AF_UNIX,
+	};
+	snprintf(path, path_len, "/tmp/bench_loopback.%d.sock", (int)getpid());
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path);
+	unlink(path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1
+			|| listen(fd, 16) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int accept_nonblock(int listen_fd)
+{
+	int fd = accept(listen_fd, NULL, NULL);
+	if (fd != -1) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	}
+	return fd;
+}
+
+/*
+ * Reads whatever is waiting on a descriptor into a queue, returning -1 once
+ * the other end is gone
+ */
+static int read_into(int fd, struct buffer_queue *q)
+{
+	char buf[65536];
+	ssize_t len;
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		buffer_queue_add(q, buf, len);
+	}
+	if (len == 0 || (errno != EAGAIN && errno != EINTR)) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Writes everything without ever refusing to read, so neither side can
+ * stall waiting for the other to drain its socket
+ */
+static int write_all(int fd, struct buffer_queue *in, const void *buf, size_t len)
+{
+	while (len) {
+		struct pollfd pfd = {.fd = fd, .events = POLLIN | POLLOUT};
+		if (poll(&pfd, 1, BENCH_TIMEOUT * 1000) <= 0) {
+			return -1;
+		}
+		if ((pfd.revents & POLLIN) && read_into(fd, in) == -1) {
+			return -1;
+		}
+		if (pfd.revents & POLLOUT) {
+			ssize_t sent = write(fd, buf, len);
+			if (sent == -1 && errno != EAGAIN && errno != EINTR) {
+				return -1;
+			}
+			if (sent > 0) {
+				buf = (const char *)buf + sent;
+				len -= sent;
+			}
+		}
+	}
+	return 0;
+}
+
+static int http_respond(struct link *l, struct http_conn_state *c, size_t len)
+{
+	char hdr[128];
+	void *body = NULL;
+	int hdr_len = snprintf(hdr, sizeof(hdr),
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: application/octet-stream\r\n"
+		"Content-Length: %zu\r\n\r\n", len);
+
+	if (len) {
+		body = malloc(len);
+		if (body == NULL) {
+			return -1;
+		}
+		buffer_queue_remove(l->tx, body, len);
+	}
+	int rc = write_all(c->fd, c->in, hdr, hdr_len);
+	if (rc == 0 && len) {
+		rc = write_all(c->fd, c->in, body, len);
+	}
+	free(body);
+	c->held = false;
+	return rc;
+}
+
+/*
+ * The first response must carry the patch packet alone, after that a
+ * response takes everything waiting
+ */
+static size_t http_tx_len(struct link *l)
+{
+	if (l->patch_len) {
+		size_t len = l->patch_len;
+		l->patch_len = 0;
+		return len;
+	}
+	return buffer_queue_len(l->tx);
+}
+
+static void http_conn_close(struct http_conn_state *c)
+{
+	close(c->fd);
+	buffer_queue_free(c->in);
+	c->fd = -1;
+	c->in = NULL;
+	c->held = false;
+}
+
+/*
+ * Returns how many bytes a chunked body at 'body' takes up, adding its data
+ * to 'out' if given, or 0 if it has not all arrived yet
+ */
+static size_t http_dechunk(char *body, size_t avail, struct buffer_queue *out)
+{
+	size_t off = 0;
+	for (;;) {
+		char *eol = memmem(body + off, avail - off, "\r\n", 2);
+		if (eol == NULL) {
+			return 0;
+		}
+		size_t chunk = strtoul(body + off, NULL, 16);
+		off = eol + 2 - body;
+		if (chunk == 0) {
+			/*
+			 * curl sends no trailers, so a blank line follows
+			 */
+			return avail - off >= 2 ? off + 2 : 0;
+		}
+		if (avail - off < chunk + 2) {
+			return 0;
+		}
+		if (out) {
+			buffer_queue_add(out, body + off, chunk);
+		}
+		off += chunk + 2;
+	}
+}
+
+/*
+ * POST bodies carry mettle's packets, responses carry ours. A GET is held
+ * until there is something to send, as a long-polling handler would.
+ */
+static int http_conn_process(struct link *l, struct http_conn_state *c)
+{
+	while (!c->held && buffer_queue_len(c->in)) {
+		size_t avail = buffer_queue_len(c->in);
+		char *req = buffer_queue_pullup(c->in, avail);
+		char *end = memmem(req, avail, "\r\n\r\n", 4);
+		if (end == NULL) {
+			return 0;
+		}
+		size_t hdr_len = end + 4 - req;
+		*end = '\0';
+
+		size_t content_len = 0;
+		char *field = strcasestr(req, "\r\nContent-Length:");
+		if (field) {
+			content_len = strtoul(field + 17, NULL, 10);
+		}
+
+		/*
+		 * Large batches come chunked as mettle streams them
+		 */
+		bool chunked = strcasestr(req, "\r\nTransfer-Encoding: chunked") != NULL;
+		if (chunked) {
+			content_len = http_dechunk(req + hdr_len, avail - hdr_len, NULL);
+		}
+		if (chunked ? content_len == 0 : avail < hdr_len + content_len) {
+			if (!c->continued && strcasestr(req, "\r\nExpect: 100-continue")) {
+				const char *cont = "HTTP/1.1 100 Continue\r\n\r\n";
+				c->continued = true;
+				*end = '\r';
+				return write_all(c->fd, c->in, cont, strlen(cont));
+			}
+			*end = '\r';
+			return 0;
+		}
+
+		bool get = strncmp(req, "GET ", 4) == 0;
+		if (chunked) {
+			http_dechunk(req + hdr_len, avail - hdr_len, l->rx);
+			buffer_queue_drain(c->in, hdr_len + content_len);
+		} else {
+			buffer_queue_drain(c->in, hdr_len);
+			if (content_len) {
+				buffer_queue_add(l->rx, buffer_queue_pullup(c->in, content_len), content_len);
+				buffer_queue_drain(c->in, content_len);
+			}
+		}
+		c->continued = false;
+
+		size_t len = http_tx_len(l);
+		if (get && len == 0) {
+			c->held = true;
+			c->held_since = now();
+		} else if (http_respond(l, c, len) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int http_flush(struct link *l)
+{
+	for (int i = 0; i < HTTP_CONNS_MAX && buffer_queue_len(l->tx); i++) {
+		struct http_conn_state *c = &l->conns[i];
+		if (c->fd != -1 && c->held) {
+			if (http_respond(l, c, http_tx_len(l)) == -1
+					|| http_conn_process(l, c) == -1) {
+				http_conn_close(c);
+			}
+		}
+	}
+	return 0;
+}
+
+static void peer_io(struct peer *p, short revents)
+{
+	if (p->fill) {
+		if (revents & POLLOUT) {
+			size_t len = TYPESAFE_MIN(sizeof(data), p->limit - p->bytes);
+			ssize_t sent = write(p->fd, data, len);
+			if (sent > 0) {
+				p->bytes += sent;
+			}
+		}
+		if (p->bytes == p->limit) {
+			close(p->fd);
+			p->fd = -1;
+		}
+	} else if (revents & (POLLIN | POLLHUP)) {
+		char buf[65536];
+		ssize_t len;
+		while ((len = read(p->fd, buf, sizeof(buf))) > 0) {
+			p->bytes += len;
+		}
+		if (len == 0) {
+			close(p->fd);
+			p->fd = -1;
+		}
+	}
+}
+
+/*
+ * Waits for and handles I/O on the link, its HTTP connections and the port
+ * forward peer, returning -1 if mettle went away
+ */
+static int link_pump(struct link *l, double timeout)
+{
+	struct pollfd pfds[HTTP_CONNS_MAX + 4];
+	struct http_conn_state *conns[HTTP_CONNS_MAX];
+	int n = 0, nconns = 0, link_idx = -1, listen_idx = -1;
+	int peer_listen_idx = -1, peer_idx = -1;
+
+	if (l->fd != -1) {
+		link_idx = n;
+		pfds[n++] = (struct pollfd){.fd = l->fd, .events = POLLIN};
+	}
+	if (l->kind == LINK_HTTP) {
+		listen_idx = n;
+		pfds[n++] = (struct pollfd){.fd = l->listen_fd, .events = POLLIN};
+		for (int i = 0; i < HTTP_CONNS_MAX; i++) {
+			struct http_conn_state *c = &l->conns[i];
+			if (c->fd != -1) {
+				if (c->held && now() - c->held_since > HTTP_HOLD_SECS) {
+					http_respond(l, c, 0);
+				}
+				conns[nconns++] = c;
+				pfds[n++] = (struct pollfd){.fd = c->fd, .events = POLLIN};
+			}
+		}
+	}
+	if (l->peer) {
+		if (l->peer->fd == -1) {
+			peer_listen_idx = n;
+			pfds[n++] = (struct pollfd){.fd = l->peer->listen_fd, .events = POLLIN};
+		} else {
+			peer_idx = n;
+			pfds[n++] = (struct pollfd){.fd = l->peer->fd,
+				.events = l->peer->fill ? POLLOUT : POLLIN};
+		}
+	}
+
+	if (poll(pfds, n, timeout * 1000) == -1) {
+		return errno == EINTR ? 0 : -1;
+	}
+
+	if (link_idx != -1 && pfds[link_idx].revents) {
+		if (read_into(l->fd, l->rx) == -1) {
+			return -1;
+		}
+	}
+	if (listen_idx != -1 && (pfds[listen_idx].revents & POLLIN)) {
+		int fd = accept_nonblock(l->listen_fd);
+		for (int i = 0; fd != -1 && i < HTTP_CONNS_MAX; i++) {
+			if (l->conns[i].fd == -1) {
+				l->conns[i].fd = fd;
+				l->conns[i].in = buffer_queue_new();
+				fd = -1;
+			}
+		}
+		if (fd != -1) {
+			close(fd);
+		}
+	}
+	for (int i = 0; i < nconns; i++) {
+		struct http_conn_state *c = conns[i];
+		if (pfds[listen_idx + 1 + i].revents) {
+			int rc = read_into(c->fd, c->in);
+			if (http_conn_process(l, c) == -1 || rc == -1) {
+				http_conn_close(c);
+			}
+		}
+	}
+	if (peer_listen_idx != -1 && (pfds[peer_listen_idx].revents & POLLIN)) {
+		l->peer->fd = accept_nonblock(l->peer->listen_fd);
+	}
+	if (peer_idx != -1 && pfds[peer_idx].revents) {
+		peer_io(l->peer, pfds[peer_idx].revents);
+	}
+
+	if (l->pid > 0 && waitpid(l->pid, NULL, WNOHANG) == l->pid) {
+		l->pid = 0;
+		return -1;
+	}
+	return 0;
+}
+
+static int link_send(struct link *l, struct tlv_packet *p)
+{
+	size_t len = 0;
+	if (p == NULL || tlv_dispatcher_enqueue_response(td, p) == -1) {
+		return -1;
+	}
+	void *buf = tlv_dispatcher_dequeue_response(td, true, &len);
+	if (buf == NULL) {
+		return -1;
+	}
+
+	int rc = 0;
+	if (l->kind == LINK_HTTP) {
+		rc = buffer_queue_add(l->tx, buf, len);
+		http_flush(l);
+	} else {
+		rc = write_all(l->fd, l->rx, buf, len);
+	}
+	free(buf);
+	return rc;
+}
+
+static struct tlv_packet *request_new(const char *method, size_t len, unsigned *id)
+{
+	struct tlv_packet *p = tlv_packet_new(TLV_PACKET_TYPE_REQUEST, len + 128);
+	*id = ++request_seq;
+	p = tlv_packet_add_str(p, TLV_TYPE_METHOD, method);
+	p = tlv_packet_add_fmt(p, TLV_TYPE_REQUEST_ID, "%u", *id);
+	return p;
+}
+
+/*
+ * Returns the next response from mettle, counting and dropping the channel
+ * writes it sends on its own along the way. Gives up early once the writes
+ * add up to 'forward_want', if that is set.
+ */
+static struct tlv_packet *link_response(struct link *l, double timeout)
+{
+	double deadline = now() + timeout;
+
+	do {
+		struct tlv_packet *p;
+		while ((p = tlv_packet_read_buffer_queue(td, l->rx))) {
+			char *id = tlv_packet_get_str(p, TLV_TYPE_REQUEST_ID);
+			char *end = NULL;
+			if (id && strtoul(id, &end, 10) && *end == '\0') {
+				return p;
+			}
+			char *method = tlv_packet_get_str(p, TLV_TYPE_METHOD);
+			size_t len = 0;
+			if (method && strcmp(method, "core_channel_write") == 0
+					&& tlv_packet_get_raw(p, TLV_TYPE_CHANNEL_DATA, &len)) {
+				l->forwarded += len;
+			}
+			tlv_packet_free(p);
+		}
+		if (l->forward_want && l->forwarded >= l->forward_want) {
+			break;
+		}
+	} while (now() < deadline && link_pump(l, deadline - now()) == 0);
+
+	return NULL;
+}
+
+/*
+ * Sends a request and waits for its response
+ */
+static struct tlv_packet *link_call(struct link *l, struct tlv_packet *p, unsigned id)
+{
+	if (link_send(l, p) == -1) {
+		return NULL;
+	}
+	while ((p = link_response(l, BENCH_TIMEOUT))) {
+		char *rid = tlv_packet_get_str(p, TLV_TYPE_REQUEST_ID);
+		if (strtoul(rid, NULL, 10) == id) {
+			return p;
+		}
+		tlv_packet_free(p);
+	}
+	return NULL;
+}
+
+static bool response_ok(struct tlv_packet *p)
+{
+	uint32_t result = TLV_RESULT_FAILURE;
+	tlv_packet_get_u32(p, TLV_TYPE_RESULT, &result);
+	return result == TLV_RESULT_SUCCESS;
+}
+
+static int channel_open(struct link *l, struct tlv_packet *p, unsigned id, uint32_t *channel_id)
+{
+	p = link_call(l, p, id);
+	if (p == NULL) {
+		return -1;
+	}
+	int rc = response_ok(p) ? tlv_packet_get_u32(p, TLV_TYPE_CHANNEL_ID, channel_id) : -1;
+	tlv_packet_free(p);
+	return rc;
+}
+
+static void channel_close(struct link *l, uint32_t channel_id)
+{
+	unsigned id;
+	struct tlv_packet *p = request_new("core_channel_close", 0, &id);
+	p = tlv_packet_add_u32(p, TLV_TYPE_CHANNEL_ID, channel_id);
+	p = link_call(l, p, id);
+	if (p) {
+		tlv_packet_free(p);
+	}
+}
+
+static int channel_write_request(struct link *l, uint32_t channel_id, size_t len)
+{
+	unsigned id;
+	struct tlv_packet *p = request_new("core_channel_write", len, &id);
+	p = tlv_packet_add_u32(p, TLV_TYPE_CHANNEL_ID, channel_id);
+	p = tlv_packet_add_u32(p, TLV_TYPE_LENGTH, len);
+	p = tlv_packet_add_raw(p, TLV_TYPE_CHANNEL_DATA, data, len);
+	return link_send(l, p);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static void bench_latency(struct link *l, unsigned count)
+{
+	double *samples = calloc(count, sizeof(*samples));
+	if (samples == NULL) {
+		return;
+	}
+
+	for (unsigned i = 0; i < count; i++) {
+		unsigned id;
+		double start = now();
+		struct tlv_packet *p = request_new("core_uuid", 0, &id);
+		p = link_call(l, p, id);
+		if (p == NULL) {
+			print_error(l, "latency", "timeout");
+			free(samples);
+			return;
+		}
+		samples[i] = now() - start;
+		tlv_packet_free(p);
+	}
+
+	qsort(samples, count, sizeof(*samples), cmp_double);
+	print_prefix(l, "latency");
+	printf(",\"count\":%u,\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+		count, samples[count / 2] * 1e6, samples[count * 9 / 10] * 1e6,
+		samples[count * 99 / 100] * 1e6, samples[count - 1] * 1e6);
+	fflush(stdout);
+	free(samples);
+}
+
+static int file_open(struct link *l, const char *path, const char *mode, uint32_t *channel_id)
+{
+	unsigned id;
+	struct tlv_packet *p = request_new("core_channel_open", 0, &id);
+	p = tlv_packet_add_str(p, TLV_TYPE_CHANNEL_TYPE, "stdapi_fs_file");
+	p = tlv_packet_add_str(p, TLV_TYPE_FILE_PATH, path);
+	p = tlv_packet_add_str(p, TLV_TYPE_FILE_MODE, mode);
+	return channel_open(l, p, id, channel_id);
+}
+
+/*
+ * A file channel takes one read at a time and reads ahead on its own, so
+ * reads go out back to back until one comes back empty
+ */
+static void bench_download(struct link *l, const char *path, size_t size)
+{
+	uint32_t channel_id;
+	if (file_open(l, path, "rb", &channel_id) == -1) {
+		print_error(l, "file_download", "open failed");
+		return;
+	}
+
+	uint64_t bytes = 0;
+	double start = now();
+	for (;;) {
+		unsigned id;
+		struct tlv_packet *p = request_new("core_channel_read", 0, &id);
+		p = tlv_packet_add_u32(p, TLV_TYPE_CHANNEL_ID, channel_id);
+		p = tlv_packet_add_u32(p, TLV_TYPE_LENGTH, BENCH_CHUNK);
+		p = link_call(l, p, id);
+		if (p == NULL) {
+			break;
+		}
+		size_t len = 0;
+		bool ok = response_ok(p) && tlv_packet_get_raw(p, TLV_TYPE_CHANNEL_DATA, &len);
+		tlv_packet_free(p);
+		if (!ok || len == 0) {
+			break;
+		}
+		bytes += len;
+	}
+	double secs = now() - start;
+
+	if (bytes != size) {
+		print_error(l, "file_download", "short read");
+	} else {
+		print_rate(l, "file_download", bytes, secs);
+	}
+	channel_close(l, channel_id);
+}
+
+static void bench_upload(struct link *l, const char *path, size_t size)
+{
+	uint32_t channel_id;
+	if (file_open(l, path, "wb", &channel_id) == -1) {
+		print_error(l, "file_upload", "open failed");
+		return;
+	}
+
+	uint64_t bytes = 0, sent = 0;
+	int inflight = 0;
+	double start = now();
+	while (bytes < size) {
+		while (sent < size && inflight < BENCH_DEPTH) {
+			size_t len = TYPESAFE_MIN(BENCH_CHUNK, size - sent);
+			if (channel_write_request(l, channel_id, len) == -1) {
+				break;
+			}
+			sent += len;
+			inflight++;
+		}
+		struct tlv_packet *p = link_response(l, BENCH_TIMEOUT);
+		if (p == NULL) {
+			break;
+		}
+		uint32_t len = 0;
+		tlv_packet_get_u32(p, TLV_TYPE_LENGTH, &len);
+		bool ok = response_ok(p) && len;
+		tlv_packet_free(p);
+		if (!ok) {
+			break;
+		}
+		bytes += len;
+		inflight--;
+	}
+	channel_close(l, channel_id);
+	double secs = now() - start;
+
+	struct stat st;
+	if (bytes != size || stat(path, &st) == -1 || st.st_size != size) {
+		print_error(l, "file_upload", "short write");
+	} else {
+		print_rate(l, "file_upload", bytes, secs);
+	}
+}
+
+static int forward_open(struct link *l, struct peer *peer, uint16_t port, uint32_t *channel_id)
+{
+	unsigned id;
+	l->peer = peer;
+	l->forwarded = 0;
+	struct tlv_packet *p = request_new("core_channel_open", 0, &id);
+	p = tlv_packet_add_str(p, TLV_TYPE_CHANNEL_TYPE, "stdapi_net_tcp_client");
+	p = tlv_packet_add_str(p, TLV_TYPE_PEER_HOST, "127.0.0.1");
+	p = tlv_packet_add_u32(p, TLV_TYPE_PEER_PORT, port);
+	return channel_open(l, p, id, channel_id);
+}
+
+/*
+ * Handler to target: writes go through mettle into a peer that drains them
+ */
+static void bench_forward_upload(struct link *l, size_t size)
+{
+	uint16_t port;
+	struct peer peer = {.fd = -1};
+	uint32_t channel_id;
+
+	peer.listen_fd = listen_loopback(&port);
+	if (peer.listen_fd == -1 || forward_open(l, &peer, port, &channel_id) == -1) {
+		print_error(l, "forward_upload", "open failed");
+		goto out;
+	}
+
+	uint64_t sent = 0;
+	int inflight = 0;
+	double start = now();
+	while (peer.bytes < size) {
+		while (sent < size && inflight < BENCH_DEPTH) {
+			size_t len = TYPESAFE_MIN(BENCH_FORWARD_CHUNK, size - sent);
+			if (channel_write_request(l, channel_id, len) == -1) {
+				break;
+			}
+			sent += len;
+			inflight++;
+		}
+		struct tlv_packet *p = link_response(l, inflight ? BENCH_TIMEOUT : 0.1);
+		if (p) {
+			inflight--;
+			tlv_packet_free(p);
+		} else if (inflight || now() - start > BENCH_TIMEOUT * 10) {
+			break;
+		}
+	}
+	double secs = now() - start;
+
+	if (peer.bytes != size) {
+		print_error(l, "forward_upload", "short transfer");
+	} else {
+		print_rate(l, "forward_upload", peer.bytes, secs);
+	}
+	channel_close(l, channel_id);
+
+out:
+	l->peer = NULL;
+	if (peer.fd != -1) {
+		close(peer.fd);
+	}
+	if (peer.listen_fd != -1) {
+		close(peer.listen_fd);
+	}
+}
+
+/*
+ * Target to handler: a peer sends into mettle, which forwards it on with
+ * channel writes of its own
+ */
+static void bench_forward_download(struct link *l, size_t size)
+{
+	uint16_t port;
+	struct peer peer = {.fd = -1, .fill = true, .limit = size};
+	uint32_t channel_id;
+
+	peer.listen_fd = listen_loopback(&port);
+	if (peer.listen_fd == -1 || forward_open(l, &peer, port, &channel_id) == -1) {
+		print_error(l, "forward_download", "open failed");
+		goto out;
+	}
+
+	double start = now(), last = start;
+	uint64_t seen = 0;
+	l->forward_want = size;
+	while (l->forwarded < size && now() - last < BENCH_TIMEOUT) {
+		struct tlv_packet *p = link_response(l, 0.1);
+		if (p) {
+			tlv_packet_free(p);
+		}
+		if (l->forwarded != seen) {
+			seen = l->forwarded;
+			last = now();
+		}
+	}
+	double secs = now() - start;
+	l->forward_want = 0;
+
+	if (l->forwarded != size) {
+		print_error(l, "forward_download", "short transfer");
+	} else {
+		print_rate(l, "forward_download", l->forwarded, secs);
+	}
+	channel_close(l, channel_id);
+
+out:
+	l->peer = NULL;
+	if (peer.fd != -1) {
+		close(peer.fd);
+	}
+	if (peer.listen_fd != -1) {
+		close(peer.listen_fd);
+	}
+}
+
+static pid_t spawn(const char *mettle, const char *uri, int keep_fd)
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (keep_fd != -1) {
+			if (keep_fd != BENCH_FD) {
+				dup2(keep_fd, BENCH_FD);
+				close(keep_fd);
+			}
+			fcntl(BENCH_FD, F_SETFD, 0);
+		}
+		int null_fd = open("/dev/null", O_RDWR);
+		dup2(null_fd, STDIN_FILENO);
+		dup2(null_fd, STDOUT_FILENO);
+		if (!verbose) {
+			dup2(null_fd, STDERR_FILENO);
+		}
+		execl(mettle, mettle, "-u", uri, (char *)NULL);
+		_exit(127);
+	}
+	return pid;
+}
+
+/*
+ * Pads a core_uuid request out to the length the stream transports look for
+ */
+static struct tlv_packet *first_packet(void)
+{
+	static char pad[BENCH_FIRST_PACKET_LEN];
+	unsigned id;
+	struct tlv_packet *p = request_new("core_uuid", sizeof(pad), &id);
+	if (p) {
+		size_t len = BENCH_FIRST_PACKET_LEN - tlv_packet_len(p) - TLV_MIN_LEN;
+		p = tlv_packet_add_raw(p, TLV_META_TYPE_RAW | 9999, pad, len);
+	}
+	return p;
+}
+
+static int link_start(struct link *l, const char *mettle)
+{
+	char uri[64];
+	uint16_t port;
+
+	l->fd = l->listen_fd = -1;
+	l->rx = buffer_queue_new();
+	l->tx = buffer_queue_new();
+	for (int i = 0; i < HTTP_CONNS_MAX; i++) {
+		l->conns[i].fd = -1;
+	}
+	if (l->rx == NULL || l->tx == NULL) {
+		return -1;
+	}
+
+	if (l->kind == LINK_FD) {
+		int sv[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+			return -1;
+		}
+		snprintf(uri, sizeof(uri), "fd://%d", BENCH_FD);
+		l->pid = spawn(mettle, uri, sv[1]);
+		close(sv[1]);
+		l->fd = sv[0];
+		fcntl(l->fd, F_SETFL, fcntl(l->fd, F_GETFL) | O_NONBLOCK);
+		return link_send(l, first_packet());
+	}
+
+	if (l->kind == LINK_UNIX) {
+		char path[48];
+		l->listen_fd = listen_unix(path, sizeof(path));
+		if (l->listen_fd == -1) {
+			return -1;
+		}
+		snprintf(uri, sizeof(uri), "unix://%s", path);
+		l->pid = spawn(mettle, uri, -1);
+		struct pollfd pfd = {.fd = l->listen_fd, .events = POLLIN};
+		int rc = poll(&pfd, 1, BENCH_TIMEOUT * 1000);
+		unlink(path);
+		if (rc <= 0) {
+			return -1;
+		}
+		l->fd = accept_nonblock(l->listen_fd);
+		if (l->fd == -1) {
+			return -1;
+		}
+		return link_send(l, first_packet());
+	}
+
+	l->listen_fd = listen_loopback(&port);
+	if (l->listen_fd == -1) {
+		return -1;
+	}
+
+	if (l->kind == LINK_HTTP) {
+		unsigned id;
+		struct tlv_packet *p = request_new("core_patch_url", 0, &id);
+		p = tlv_packet_add_str(p, TLV_TYPE_TRANS_URL, "/bench/");
+		p = tlv_packet_add_bool(p, TLV_TYPE_TRANS_MULTI_PACKET, true);
+		p = tlv_packet_add_u32(p, TLV_TYPE_TRANS_LONG_POLL, HTTP_HOLD_SECS * 2);
+		if (link_send(l, p) == -1) {
+			return -1;
+		}
+		l->patch_len = buffer_queue_len(l->tx);
+		snprintf(uri, sizeof(uri), "http://127.0.0.1:%u/", port);
+		l->pid = spawn(mettle, uri, -1);
+		return 0;
+	}
+
+	snprintf(uri, sizeof(uri), "tcp://127.0.0.1:%u", port);
+	l->pid = spawn(mettle, uri, -1);
+	struct pollfd pfd = {.fd = l->listen_fd, .events = POLLIN};
+	if (poll(&pfd, 1, BENCH_TIMEOUT * 1000) <= 0) {
+		return -1;
+	}
+	l->fd = accept_nonblock(l->listen_fd);
+	if (l->fd == -1) {
+		return -1;
+	}
+	return link_send(l, first_packet());
+}
+
+static void link_stop(struct link *l)
+{
+	if (l->pid > 0) {
+		kill(l->pid, SIGTERM);
+		waitpid(l->pid, NULL, 0);
+	}
+	for (int i = 0; i < HTTP_CONNS_MAX; i++) {
+		if (l->conns[i].fd != -1) {
+			http_conn_close(&l->conns[i]);
+		}
+	}
+	if (l->fd != -1) {
+		close(l->fd);
+	}
+	if (l->listen_fd != -1) {
+		close(l->listen_fd);
+	}
+	buffer_queue_free(l->rx);
+	buffer_queue_free(l->tx);
+}
+
+static int make_file(char *path, size_t size)
+{
+	int fd = mkstemp(path);
+	if (fd == -1) {
+		return -1;
+	}
+	for (size_t off = 0; off < size; off += sizeof(data)) {
+		size_t len = TYPESAFE_MIN(sizeof(data), size - off);
+		if (write(fd, data, len) != len) {
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [options] [transport...]\n", name);
+	printf("  -h             display help\n");
+	printf("  -m <path>      mettle binary (default: next to this one)\n");
+	printf("  -n <count>     commands timed for latency (default %u)\n", BENCH_COUNT);
+	printf("  -s <bytes>     bytes moved by each transfer (default %u)\n", BENCH_SIZE);
+	printf("  -v             show mettle's log output\n");
+	printf("\nTransports:");
+	for (int i = 0; i < COUNT_OF(transports); i++) {
+		printf(" %s", transports[i].name);
+	}
+	printf("\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned count = BENCH_COUNT;
+	size_t size = BENCH_SIZE;
+	char *mettle = NULL;
+	int c;
+
+	while ((c = getopt(argc, argv, "hm:n:s:v")) != -1) {
+		switch (c) {
+			case 'm':
+				mettle = strdup(optarg);
+				break;
+			case 'n':
+				count = strtoul(optarg, NULL, 0);
+				break;
+			case 's':
+				size = strtoul(optarg, NULL, 0);
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (count == 0 || size == 0) {
+		usage(argv[0]);
+	}
+
+	if (mettle == NULL) {
+		const char *slash = strrchr(argv[0], '/');
+		int dir_len = slash ? slash - argv[0] + 1 : 0;
+		if (asprintf(&mettle, "%.*smettle", dir_len, argv[0]) == -1) {
+			return 1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	uname(&host);
+	for (size_t i = 0; i < sizeof(data); i++) {
+		data[i] = rand();
+	}
+
+	td = tlv_dispatcher_new(response_cb, NULL);
+	if (td == NULL) {
+		return 1;
+	}
+	tlv_dispatcher_set_compress_threshold(td, 0);
+	tlv_dispatcher_add_encryption(td, create_tlv_encryption_context(ENC_NONE));
+
+	char src[] = "/tmp/bench_loopback.XXXXXX";
+	char dst[] = "/tmp/bench_loopback.XXXXXX";
+	if (make_file(src, size) == -1 || make_file(dst, 0) == -1) {
+		fprintf(stderr, "could not create test files\n");
+		return 1;
+	}
+
+	for (int i = 0; i < COUNT_OF(transports); i++) {
+		bool selected = optind == argc;
+		for (int j = optind; j < argc; j++) {
+			selected |= strcmp(argv[j], transports[i].name) == 0;
+		}
+		if (!selected) {
+			continue;
+		}
+
+		struct link l = {
+			.kind = transports[i].kind,
+			.name = transports[i].name,
+		};
+		if (link_start(&l, mettle) == -1) {
+			print_error(&l, "start", "could not start mettle");
+		} else {
+			bench_latency(&l, count);
+			bench_download(&l, src, size);
+			bench_upload(&l, dst, size);
+			bench_forward_upload(&l, size);
+			bench_forward_download(&l, size);
+		}
+		link_stop(&l);
+	}
+
+	unlink(src);
+	unlink(dst);
+	tlv_dispatcher_free(td);
+	free(mettle);
+	return 0;
+}
@@ -7,45 +7,160 @@
 #include <stdlib.h>
 
 #include "buffer_queue.h"
+#include "mem_acct.h"
+#include "mem_pool.h"
 #include "utlist.h"
 #include "util.h"
 
+/*
+ * 'size' is the allocated length of a slab 'data' that stream adds may
+ * append to, or 0 if 'data' holds exactly one add. 'free_fn' releases 'data'
+ * if it was handed over with something other than free(). 'spare' is a slab
+ * handed out by buffer_queue_reserve_iov that has not been committed yet.
+ */
 struct buffer_queue {
 	struct buffer {
-		size_t offset, len;
+		size_t offset, len, size;
 		struct buffer *next;
 		char *data;
-	} *head;
+		void (*free_fn)(void *);
+	} *head, *tail, *spare;
 	size_t bytes;
+
+	size_t low_watermark, high_watermark;
+	buffer_queue_watermark_cb watermark_cb;
+	void *watermark_arg;
+	bool above_watermark;
 };
 
+static struct mem_pool buffer_pool =
+	MEM_POOL_INITIALIZER(sizeof(struct buffer), 256);
+
+/*
+ * Bytes held by all queues, against the budget
+ */
+static size_t total_bytes;
+static size_t budget;
+
+void buffer_queue_set_budget(size_t bytes)
+{
+	__atomic_store_n(&budget, bytes, __ATOMIC_RELAXED);
+}
+
+size_t buffer_queue_total_bytes(void)
+{
+	return __atomic_load_n(&total_bytes, __ATOMIC_RELAXED);
+}
+
+bool buffer_queue_over_budget(void)
+{
+	size_t limit = __atomic_load_n(&budget, __ATOMIC_RELAXED);
+	return limit && buffer_queue_total_bytes() >= limit;
+}
+
+static void queue_grow(struct buffer_queue *q, size_t len)
+{
+	q->bytes += len;
+	__atomic_add_fetch(&total_bytes, len, __ATOMIC_RELAXED);
+}
+
+static void queue_shrink(struct buffer_queue *q, size_t len)
+{
+	q->bytes -= len;
+	__atomic_sub_fetch(&total_bytes, len, __ATOMIC_RELAXED);
+}
+
 struct buffer_queue * buffer_queue_new(void)
 {
-	return calloc(1, sizeof(struct buffer_queue));
+	return mem_acct_calloc(MEM_TAG_BUFFER_QUEUE, 1, sizeof(struct buffer_queue));
 }
 
 static void free_buf(struct buffer *buf)
 {
 	if (buf) {
-		free(buf->data);
-		free(buf);
+		if (buf->free_fn) {
+			buf->free_fn(buf->data);
+		} else {
+			mem_acct_free(MEM_TAG_BUFFER_QUEUE, buf->data);
+		}
+		mem_pool_free(&buffer_pool, buf);
+	}
+}
+
+/*
+ * Called after the queue grows or shrinks, respectively. Over budget, a
+ * queue counts as full once it holds more than its low watermark.
+ */
+static void check_high_watermark(struct buffer_queue *q)
+{
+	if (q->watermark_cb && !q->above_watermark && (q->bytes >= q->high_watermark
+			|| (q->bytes > q->low_watermark && buffer_queue_over_budget()))) {
+		q->above_watermark = true;
+		q->watermark_cb(q, true, q->watermark_arg);
+	}
+}
+
+static void check_low_watermark(struct buffer_queue *q)
+{
+	if (q->above_watermark && q->bytes <= q->low_watermark) {
+		q->above_watermark = false;
+		if (q->watermark_cb) {
+			q->watermark_cb(q, false, q->watermark_arg);
+		}
+	}
+}
+
+void buffer_queue_set_watermarks(struct buffer_queue *q, size_t low, size_t high,
+	buffer_queue_watermark_cb cb, void *arg)
+{
+	q->low_watermark = low;
+	q->high_watermark = high;
+	q->watermark_cb = cb;
+	q->watermark_arg = arg;
+	if (cb) {
+		check_high_watermark(q);
+	} else {
+		q->above_watermark = false;
 	}
 }
 
+static void append_buf(struct buffer_queue *q, struct buffer *buf)
+{
+	buf->next = NULL;
+	if (q->tail) {
+		q->tail->next = buf;
+	} else {
+		q->head = buf;
+	}
+	q->tail = buf;
+}
+
+static struct buffer *pop_buf(struct buffer_queue *q)
+{
+	struct buffer *buf = q->head;
+	q->head = buf->next;
+	if (q->head == NULL) {
+		q->tail = NULL;
+	}
+	return buf;
+}
+
 void buffer_queue_drain_all(struct buffer_queue *q)
 {
-	struct buffer *buf, *tmp;
-	LL_FOREACH_SAFE(q->head, buf, tmp) {
-		LL_DELETE(q->head, buf);
-		free_buf(buf);
+	while (q->head) {
+		free_buf(pop_buf(q));
 	}
-	q->bytes = 0;
+	queue_shrink(q, q->bytes);
+	check_low_watermark(q);
 }
 
 void buffer_queue_free(struct buffer_queue *q)
 {
 	if (q) {
-		free(q);
+		q->watermark_cb = NULL;
+		buffer_queue_drain_all(q);
+		free_buf(q->spare);
+		mem_acct_free(MEM_TAG_BUFFER_QUEUE, q);
 	}
 }
 
@@ -54,27 +169,164 @@ size_t buffer_queue_len(struct buffer_queue *q)
 	return q->bytes;
 }
 
-int buffer_queue_add(struct buffer_queue *q, void *data, size_t len)
+static int add_buf(struct buffer_queue *q, void *data, size_t len, size_t size)
 {
-	struct buffer *buf = calloc(1, sizeof(*buf));
+	struct buffer *buf = mem_pool_alloc(&buffer_pool);
 	if (buf == NULL) {
 		return -1;
 	}
-	buf->data = malloc(len);
+	buf->data = mem_acct_malloc(MEM_TAG_BUFFER_QUEUE, size ? size : len);
 	if (buf->data == NULL) {
-		free_buf(buf);
+		mem_pool_free(&buffer_pool, buf);
 		return -1;
 	}
 
 	memcpy(buf->data, data, len);
 	buf->offset = 0;
 	buf->len = len;
+	buf->size = size;
+	buf->free_fn = NULL;
 
-	LL_APPEND(q->head, buf);
-	q->bytes += len;
+	append_buf(q, buf);
+	queue_grow(q, len);
+	check_high_watermark(q);
 	return 0;
 }
 
+int buffer_queue_add_owned(struct buffer_queue *q, void *data, size_t len,
+	void (*free_fn)(void *))
+{
+	struct buffer *buf = mem_pool_alloc(&buffer_pool);
+	if (buf == NULL) {
+		return -1;
+	}
+
+	buf->data = data;
+	buf->offset = 0;
+	buf->len = len;
+	buf->size = 0;
+	buf->free_fn = free_fn == free ? NULL : free_fn;
+	if (buf->free_fn == NULL) {
+		mem_acct_retag(data, MEM_TAG_NONE, MEM_TAG_BUFFER_QUEUE);
+	}
+
+	append_buf(q, buf);
+	queue_grow(q, len);
+	check_high_watermark(q);
+	return 0;
+}
+
+int buffer_queue_add(struct buffer_queue *q, void *data, size_t len)
+{
+	return add_buf(q, data, len, 0);
+}
+
+int buffer_queue_add_stream(struct buffer_queue *q, void *data, size_t len)
+{
+	struct buffer *tail = q->tail;
+	if (tail && tail->size && tail->size - tail->len >= len) {
+		memcpy(tail->data + tail->len, data, len);
+		tail->len += len;
+		queue_grow(q, len);
+		check_high_watermark(q);
+		return 0;
+	}
+	return add_buf(q, data, len, len < BUFFER_QUEUE_SLAB_LEN ? BUFFER_QUEUE_SLAB_LEN : 0);
+}
+
+/*
+ * Size the spare to what is wanted, so small reads do not pin large slabs
+ * and large ones are not split across many
+ */
+static struct buffer * get_spare(struct buffer_queue *q, size_t len)
+{
+	size_t size = len < BUFFER_QUEUE_SLAB_LEN ? BUFFER_QUEUE_SLAB_LEN :
+		len > BUFFER_QUEUE_SLAB_MAX ? BUFFER_QUEUE_SLAB_MAX : len;
+	if (q->spare && q->spare->size < size) {
+		free_buf(q->spare);
+		q->spare = NULL;
+	}
+	if (q->spare == NULL) {
+		struct buffer *buf = mem_pool_alloc(&buffer_pool);
+		if (buf == NULL) {
+			return NULL;
+		}
+		buf->data = mem_acct_malloc(MEM_TAG_BUFFER_QUEUE, size);
+		if (buf->data == NULL) {
+			mem_pool_free(&buffer_pool, buf);
+			return NULL;
+		}
+		buf->offset = buf->len = 0;
+		buf->size = size;
+		buf->free_fn = NULL;
+		q->spare = buf;
+	}
+	return q->spare;
+}
+
+int buffer_queue_reserve_iov(struct buffer_queue *q, size_t len, struct iovec iov[2])
+{
+	int iovcnt = 0;
+	struct buffer *tail = q->tail;
+	if (tail && tail->size && tail->size > tail->len) {
+		size_t room = tail->size - tail->len;
+		iov[iovcnt].iov_base = tail->data + tail->len;
+		iov[iovcnt].iov_len = room;
+		iovcnt++;
+		if (room >= len) {
+			return iovcnt;
+		}
+		len -= room;
+	}
+
+	struct buffer *spare = get_spare(q, len);
+	if (spare == NULL) {
+		return iovcnt ? iovcnt : -1;
+	}
+	iov[iovcnt].iov_base = spare->data;
+	iov[iovcnt].iov_len = spare->size;
+	return iovcnt + 1;
+}
+
+void * buffer_queue_reserve_slab(struct buffer_queue *q, size_t len, size_t *size)
+{
+	struct buffer *spare = get_spare(q, len);
+	if (spare == NULL) {
+		return NULL;
+	}
+	*size = spare->size;
+	return spare->data;
+}
+
+void buffer_queue_commit_slab(struct buffer_queue *q, size_t len)
+{
+	if (len) {
+		q->spare->len = len;
+		append_buf(q, q->spare);
+		q->spare = NULL;
+		queue_grow(q, len);
+		check_high_watermark(q);
+	}
+}
+
+void buffer_queue_commit(struct buffer_queue *q, size_t len)
+{
+	size_t added = len;
+	struct buffer *tail = q->tail;
+	if (tail && tail->size && tail->size > tail->len) {
+		size_t n = TYPESAFE_MIN(len, tail->size - tail->len);
+		tail->len += n;
+		len -= n;
+	}
+	if (len) {
+		q->spare->len = len;
+		append_buf(q, q->spare);
+		q->spare = NULL;
+	}
+	queue_grow(q, added);
+	check_high_watermark(q);
+}
+
 int buffer_queue_add_str(struct buffer_queue *q, char *str)
 {
 	return buffer_queue_add(q, str, strlen(str));
@@ -85,8 +337,8 @@ void * buffer_queue_peek_msg(struct buffer_queue *q, size_t *len)
 	void *data = NULL;
 	if (q->head) {
 		struct buffer *buf = q->head;
-		data = buf->data;
-		*len = buf->len;
+		data = buf->data + buf->offset;
+		*len = buf->len - buf->offset;
 	}
 	return data;
 }
@@ -96,11 +348,31 @@ void * buffer_queue_remove_msg(struct buffer_queue *q, size_t *len)
 	void *data = NULL;
 	if (q->head) {
 		struct buffer *buf = q->head;
-		LL_DELETE(q->head, buf);
-		data = buf->data;
-		*len = buf->len;
-		q->bytes -= buf->len;
-		free(buf);
+		size_t msg_len = buf->len - buf->offset;
+		if (buf->free_fn) {
+			/*
+			 * The caller will free() what it gets back, so hand over a
+			 * copy of buffers that need releasing some other way
+			 */
+			data = malloc(msg_len);
+			if (data == NULL) {
+				return NULL;
+			}
+			memcpy(data, buf->data + buf->offset, msg_len);
+			pop_buf(q);
+			free_buf(buf);
+		} else {
+			pop_buf(q);
+			data = buf->data;
+			if (buf->offset) {
+				memmove(data, buf->data + buf->offset, msg_len);
+			}
+			mem_acct_retag(data, MEM_TAG_BUFFER_QUEUE, MEM_TAG_NONE);
+			mem_pool_free(&buffer_pool, buf);
+		}
+		*len = msg_len;
+		queue_shrink(q, msg_len);
+		check_low_watermark(q);
 	}
 	return data;
 }
@@ -114,7 +386,6 @@ size_t buffer_queue_copy(struct buffer_queue *q, void *data, size_t len)
 		memcpy(data, buf->data + buf->offset, bytes);
 		data += bytes;
 		len -= bytes;
-		buf = buf->next;
 		copied += bytes;
 		if (len <= 0) {
 			break;
@@ -132,19 +403,19 @@ size_t buffer_queue_drain(struct buffer_queue *q, size_t len)
 		len -= bytes;
 		buf->offset += bytes;
 		if (buf->offset == buf->len) {
-			LL_DELETE(q->head, buf);
-			free_buf(buf);
+			free_buf(pop_buf(q));
 		}
 		drained += bytes;
 		if (len <= 0) {
 			break;
 		}
 	}
-	q->bytes -= drained;
+	queue_shrink(q, drained);
+	check_low_watermark(q);
 	return drained;
 }
 
-size_t buffer_queue_remove(struct buffer_queue *q, void *data, size_t len)
+static size_t remove_bytes(struct buffer_queue *q, void *data, size_t len)
 {
 	size_t removed = 0;
 	struct buffer *buf, *tmp;
@@ -155,15 +426,21 @@ size_t buffer_queue_remove(struct buffer_queue *q, void *data, size_t len)
 		len -= bytes;
 		buf->offset += bytes;
 		if (buf->offset == buf->len) {
-			LL_DELETE(q->head, buf);
-			free_buf(buf);
+			free_buf(pop_buf(q));
 		}
 		removed += bytes;
 		if (len <= 0) {
 			break;
 		}
 	}
-	q->bytes -= removed;
+	queue_shrink(q, removed);
+	return removed;
+}
+
+size_t buffer_queue_remove(struct buffer_queue *q, void *data, size_t len)
+{
+	size_t removed = remove_bytes(q, data, len);
+	check_low_watermark(q);
 	return removed;
 }
 
@@ -179,16 +456,119 @@ ssize_t buffer_queue_remove_all(struct buffer_queue *q, void **data)
 	return bytes;
 }
 
+int buffer_queue_peek_iov(struct buffer_queue *q, struct iovec *iov, int iovcnt)
+{
+	int i = 0;
+	struct buffer *buf;
+	LL_FOREACH(q->head, buf) {
+		if (i == iovcnt) {
+			break;
+		}
+		iov[i].iov_base = buf->data + buf->offset;
+		iov[i].iov_len = buf->len - buf->offset;
+		i++;
+	}
+	return i;
+}
+
+void * buffer_queue_peek_contiguous(struct buffer_queue *q, size_t *len)
+{
+	*len = 0;
+	if (q->head == NULL) {
+		return NULL;
+	}
+	*len = q->head->len - q->head->offset;
+	return q->head->data + q->head->offset;
+}
+
+void * buffer_queue_pullup(struct buffer_queue *q, size_t len)
+{
+	struct buffer *head = q->head;
+	if (head == NULL || len > q->bytes) {
+		return NULL;
+	}
+	if (head->len - head->offset >= len) {
+		return head->data + head->offset;
+	}
+
+	/*
+	 * Merge the first 'len' bytes into a new buffer at the front
+	 */
+	struct buffer *buf = mem_pool_alloc(&buffer_pool);
+	if (buf == NULL) {
+		return NULL;
+	}
+	buf->data = mem_acct_malloc(MEM_TAG_BUFFER_QUEUE, len);
+	if (buf->data == NULL) {
+		mem_pool_free(&buffer_pool, buf);
+		return NULL;
+	}
+	remove_bytes(q, buf->data, len);
+	buf->offset = 0;
+	buf->len = len;
+	buf->size = 0;
+	buf->free_fn = NULL;
+
+	buf->next = q->head;
+	q->head = buf;
+	if (q->tail == NULL) {
+		q->tail = buf;
+	}
+	queue_grow(q, len);
+	return buf->data;
+}
+
+void * buffer_queue_detach(struct buffer_queue *q, size_t len, void **alloc)
+{
+	struct buffer *buf = q->head;
+	if (buf == NULL || buf->len - buf->offset < len || buf->free_fn) {
+		return NULL;
+	}
+
+	size_t remaining = buf->len - buf->offset - len;
+	if (remaining) {
+		char *data = mem_acct_malloc(MEM_TAG_BUFFER_QUEUE, remaining);
+		if (data == NULL) {
+			return NULL;
+		}
+		memcpy(data, buf->data + buf->offset + len, remaining);
+		mem_acct_retag(buf->data, MEM_TAG_BUFFER_QUEUE, MEM_TAG_NONE);
+		*alloc = buf->data;
+		void *detached = buf->data + buf->offset;
+		buf->data = data;
+		buf->offset = 0;
+		buf->len = remaining;
+		buf->size = 0;
+		queue_shrink(q, len);
+		check_low_watermark(q);
+		return detached;
+	}
+
+	pop_buf(q);
+	queue_shrink(q, len);
+	check_low_watermark(q);
+	mem_acct_retag(buf->data, MEM_TAG_BUFFER_QUEUE, MEM_TAG_NONE);
+	*alloc = buf->data;
+	void *detached = buf->data + buf->offset;
+	mem_pool_free(&buffer_pool, buf);
+	return detached;
+}
+
 ssize_t buffer_queue_move_all(struct buffer_queue *dst, struct buffer_queue *src)
 {
-	size_t moved = 0;
-	struct buffer *buf, *tmp;
-	LL_FOREACH_SAFE(src->head, buf, tmp) {
-		LL_DELETE(src->head, buf);
-		src->bytes -= buf->len;
-		LL_APPEND(dst->head, buf);
-		dst->bytes += buf->len;
-		moved += buf->len;
+	size_t moved = src->bytes;
+	if (src->head) {
+		if (dst->tail) {
+			dst->tail->next = src->head;
+		} else {
+			dst->head = src->head;
+		}
+		dst->tail = src->tail;
+		dst->bytes += moved;
+		src->head = src->tail = NULL;
+		src->bytes = 0;
+		check_low_watermark(src);
+		check_high_watermark(dst);
 	}
 	return moved;
 }
@@ -7,8 +7,18 @@
 #ifndef _BUFFER_QUEUE_H_
 #define _BUFFER_QUEUE_H_
 
+#include <stdbool.h>
 #include <string.h>
 
+#ifdef _WIN32
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
+
 struct buffer_queue;
 
 struct buffer_queue * buffer_queue_new(void);
@@ -19,6 +29,50 @@ size_t buffer_queue_len(struct buffer_queue *q);
 
 int buffer_queue_add(struct buffer_queue *q, void *data, size_t len);
 
+/*
+ * Adds bytes from a byte stream, where message boundaries do not matter.
+ * Small adds are packed together into slabs of BUFFER_QUEUE_SLAB_LEN bytes
+ * rather than each getting a buffer of their own.
+ */
+#define BUFFER_QUEUE_SLAB_LEN (16 * 1024)
+
+int buffer_queue_add_stream(struct buffer_queue *q, void *data, size_t len);
+
+/*
+ * Lets a reader such as readv() fill the queue in place. Fills 'iov' with
+ * one or two writable segments totalling at least 'len' bytes: the unused
+ * end of the tail slab, then a spare slab of up to BUFFER_QUEUE_SLAB_MAX
+ * bytes. Nothing is queued until buffer_queue_commit says how many bytes
+ * were written; an unused spare is kept for the next reservation.
+ * Returns the number of segments, or -1 if no memory is available.
+ */
+#ifdef METTLE_LOW_MEMORY
+#define BUFFER_QUEUE_SLAB_MAX (32 * 1024)
+#else
+#define BUFFER_QUEUE_SLAB_MAX (256 * 1024)
+#endif
+
+int buffer_queue_reserve_iov(struct buffer_queue *q, size_t len, struct iovec iov[2]);
+
+void buffer_queue_commit(struct buffer_queue *q, size_t len);
+
+/*
+ * As above, but hands out only the spare slab, which the queue holds no
+ * other reference to until buffer_queue_commit_slab queues it. Suits
+ * overlapped reads, which may complete after the tail has been drained.
+ */
+void * buffer_queue_reserve_slab(struct buffer_queue *q, size_t len, size_t *size);
+
+void buffer_queue_commit_slab(struct buffer_queue *q, size_t len);
+
+/*
+ * Adds 'data' without copying it, taking ownership. It is released with
+ * 'free_fn' once drained, or handed back by buffer_queue_remove_msg. On
+ * failure the caller keeps ownership.
+ */
+int buffer_queue_add_owned(struct buffer_queue *q, void *data, size_t len,
+	void (*free_fn)(void *));
+
 int buffer_queue_add_str(struct buffer_queue *q, char *str);
 
 size_t buffer_queue_remove(struct buffer_queue *q, void *data, size_t len);
@@ -31,10 +85,66 @@ void buffer_queue_drain_all(struct buffer_queue *q);
 
 void * buffer_queue_peek_msg(struct buffer_queue *q, size_t *len);
 
+/*
+ * Removes the buffer at the front of the queue and returns it, to be released
+ * with free(). For buffers added with buffer_queue_add_owned and free() this
+ * is the original allocation.
+ */
 void * buffer_queue_remove_msg(struct buffer_queue *q, size_t *len);
 
 ssize_t buffer_queue_remove_all(struct buffer_queue *q, void **data);
 
 ssize_t buffer_queue_move_all(struct buffer_queue *dst, struct buffer_queue *src);
 
+/*
+ * One budget for the bytes held by all queues together, 0 for none. Over
+ * budget, queues with watermarks report being full as soon as they pass
+ * their low watermark, so producers back off early rather than the process
+ * running out of memory.
+ */
+void buffer_queue_set_budget(size_t bytes);
+
+size_t buffer_queue_total_bytes(void);
+
+bool buffer_queue_over_budget(void);
+
+/*
+ * Calls 'cb' with 'above' set once the queue grows to 'high' bytes or more,
+ * then again with it clear once it has drained back to 'low' bytes or fewer.
+ * Producers use this to stop reading while a consumer catches up. A NULL
+ * 'cb' removes the watermarks.
+ */
+typedef void (*buffer_queue_watermark_cb)(struct buffer_queue *q, bool above, void *arg);
+
+void buffer_queue_set_watermarks(struct buffer_queue *q, size_t low, size_t high,
+	buffer_queue_watermark_cb cb, void *arg);
+
+/*
+ * Fills 'iov' with up to 'iovcnt' segments covering the front of the queue,
+ * without removing them. Returns the number of segments filled.
+ */
+int buffer_queue_peek_iov(struct buffer_queue *q, struct iovec *iov, int iovcnt);
+
+/*
+ * Returns a pointer to the bytes at the front of the queue and the number of
+ * them that are contiguous in memory.
+ */
+void * buffer_queue_peek_contiguous(struct buffer_queue *q, size_t *len);
+
+/*
+ * Returns a pointer to the first 'len' bytes of the queue, merging them into
+ * one buffer first if they are not already contiguous. Returns NULL if the
+ * queue holds fewer bytes.
+ */
+void * buffer_queue_pullup(struct buffer_queue *q, size_t len);
+
+/*
+ * Removes the first len bytes without copying them, if they are contiguous.
+ * Ownership of the backing allocation passes to the caller via 'alloc' and a
+ * pointer to the bytes within it is returned. Bytes following them in the
+ * same allocation are copied to a new buffer left at the front of the queue.
+ * Returns NULL, leaving the queue untouched, if the bytes are not contiguous.
+ */
+void * buffer_queue_detach(struct buffer_queue *q, size_t len, void **alloc);
+
 #endif
@@ -16,23 +16,42 @@
 
 #include <netdb.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/uio.h>
 
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/ssl.h>
+
 #include "buffer_queue.h"
+#include "evloop.h"
+#include "iocp.h"
 #include "log.h"
 #include "bufferev.h"
+#include "token_bucket.h"
+#include "tunables.h"
 #include "util.h"
 
 struct bufferev {
-	struct ev_timer connect_timer;
+	struct evloop_timer connect_timer;
 	struct ev_loop *loop;
 
 	char *uri;
 	enum network_proto proto;
 	int sock, connected;
-	struct ev_io data_ev;
+	struct evloop_io data_ev;
+	struct evloop_io tx_ev;
+	bool read_paused, rx_full, read_eof;
+	int udp_batch;
+	enum bufferev_sock_profile sock_profile;
+
+	struct token_bucket rx_shaper, tx_shaper;
+	bool rx_throttled, tx_throttled;
 
 	struct buffer_queue *tx_queue;
 	struct buffer_queue *rx_queue;
@@ -45,8 +64,37 @@ struct bufferev {
 	char *host;
 	char **services;
 	int num_services;
+
+	struct bufferev_tls *tls;
+
+#ifdef BUFFEREV_IOCP
+	struct iocp_op rx_op, tx_op;
+	bool iocp, rx_posted, tx_posted, freed;
+#endif
+};
+
+struct bufferev_tls_session {
+	mbedtls_ssl_session session;
+	bool valid;
+};
+
+/*
+ * 'write_len' is the length of an mbedtls_ssl_write that returned
+ * WANT_WRITE, which has to be repeated with the same length
+ */
+struct bufferev_tls {
+	mbedtls_ssl_context ssl;
+	struct bufferev_tls_session *session;
+	size_t write_len;
 };
 
+static void tls_handshake(struct bufferev *be);
+
+#ifdef BUFFEREV_IOCP
+static void iocp_post_recv(struct bufferev *be);
+static void iocp_post_send(struct bufferev *be);
+#endif
+
 void bufferev_set_cbs(struct bufferev *be,
 	bufferev_data_cb read_cb,
 	bufferev_data_cb write_cb,
@@ -59,6 +107,183 @@ void bufferev_set_cbs(struct bufferev *be,
 	be->cb_arg = cb_arg;
 }
 
+/*
+ * Stop watching the socket while the owner asked us to, the rx queue is over
+ * its high watermark or the rx shaper is out of tokens
+ */
+static void update_read(struct bufferev *be)
+{
+	if (!be->connected || be->read_eof || be->sock < 0) {
+		return;
+	}
+
+#ifdef BUFFEREV_IOCP
+	/*
+	 * A receive already posted cannot be taken back, it just is not
+	 * followed by another
+	 */
+	if (be->iocp) {
+		if (!be->read_paused && !be->rx_full && !be->rx_throttled) {
+			iocp_post_recv(be);
+		}
+		return;
+	}
+#endif
+
+	if (be->read_paused || be->rx_full || be->rx_throttled) {
+		evloop_io_stop(&be->data_ev);
+	} else if (!evloop_io_active(&be->data_ev)) {
+		evloop_io_start(&be->data_ev);
+		/*
+		 * mbedtls may hold decrypted data the socket will not signal for
+		 */
+		if (be->tls && mbedtls_ssl_get_bytes_avail(&be->tls->ssl)) {
+			evloop_io_feed(&be->data_ev, EVLOOP_READ);
+		}
+	}
+}
+
+void bufferev_set_udp_batch(struct bufferev *be, int batch)
+{
+	be->udp_batch = batch < 1 ? 1 :
+		batch > BUFFEREV_UDP_BATCH_MAX ? BUFFEREV_UDP_BATCH_MAX : batch;
+}
+
+void bufferev_set_read_paused(struct bufferev *be, bool paused)
+{
+	be->read_paused = paused;
+	update_read(be);
+}
+
+static void on_rx_watermark(struct buffer_queue *q, bool above, void *arg)
+{
+	struct bufferev *be = arg;
+	be->rx_full = above;
+	update_read(be);
+}
+
+/*
+ * Returns how many bytes may be read now. When that is none, reading stops
+ * until the rx shaper refills.
+ */
+static size_t rx_allowance(struct bufferev *be)
+{
+	size_t avail = token_bucket_avail(&be->rx_shaper);
+	if (avail == 0) {
+		be->rx_throttled = true;
+		update_read(be);
+		token_bucket_wait(&be->rx_shaper);
+	}
+	return avail;
+}
+
+/*
+ * The most to take in one read, as limited by the socket.read_max tunable
+ */
+static size_t read_limit(size_t max)
+{
+	size_t limit = tunable_get(TUNABLE_SOCKET_READ_MAX);
+	return limit && limit < max ? limit : max;
+}
+
+static void on_rx_refill(struct token_bucket *tb, void *arg)
+{
+	struct bufferev *be = arg;
+	be->rx_throttled = false;
+	update_read(be);
+}
+
+static void kick_tx(struct bufferev *be)
+{
+	if (be->connected && !be->tx_throttled && buffer_queue_len(be->tx_queue)) {
+#ifdef BUFFEREV_IOCP
+		if (be->iocp) {
+			iocp_post_send(be);
+			return;
+		}
+#endif
+		evloop_io_start(&be->tx_ev);
+	}
+}
+
+static void on_tx_refill(struct token_bucket *tb, void *arg)
+{
+	struct bufferev *be = arg;
+	be->tx_throttled = false;
+	kick_tx(be);
+}
+
+void bufferev_set_rate_limit(struct bufferev *be, uint64_t rx_rate, uint64_t tx_rate)
+{
+	token_bucket_set_rate(&be->rx_shaper, rx_rate);
+	token_bucket_set_rate(&be->tx_shaper, tx_rate);
+}
+
+static void set_sock_opt(int sock, int level, int name, int value)
+{
+	if (setsockopt(sock, level, name, (void *)&value, sizeof(value)) == -1) {
+		log_debug("could not set socket option %d: %s", name, strerror(errno));
+	}
+}
+
+static void apply_sock_profile(struct bufferev *be)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+	if (be->sock < 0 || be->proto == network_proto_udp
+			|| be->sock_profile == BUFFEREV_SOCK_DEFAULT
+			|| getsockname(be->sock, (struct sockaddr *)&ss, &len) == -1
+			|| (ss.ss_family != AF_INET && ss.ss_family != AF_INET6)) {
+		return;
+	}
+
+	if (be->sock_profile == BUFFEREV_SOCK_BULK) {
+		int buf = tunable_get(TUNABLE_SOCKET_BULK_BUF);
+		if (buf) {
+			set_sock_opt(be->sock, SOL_SOCKET, SO_SNDBUF, buf);
+			set_sock_opt(be->sock, SOL_SOCKET, SO_RCVBUF, buf);
+		}
+		return;
+	}
+
+	set_sock_opt(be->sock, IPPROTO_TCP, TCP_NODELAY, 1);
+#ifdef TCP_NOTSENT_LOWAT
+	int lowat = tunable_get(TUNABLE_SOCKET_NOTSENT_LOWAT);
+	if (lowat) {
+		set_sock_opt(be->sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, lowat);
+	}
+#endif
+	if (be->sock_profile != BUFFEREV_SOCK_C2) {
+		return;
+	}
+
+	int idle = tunable_get(TUNABLE_SOCKET_KEEPALIVE_S);
+	if (idle) {
+		set_sock_opt(be->sock, SOL_SOCKET, SO_KEEPALIVE, 1);
+#ifdef TCP_KEEPIDLE
+		set_sock_opt(be->sock, IPPROTO_TCP, TCP_KEEPIDLE, idle);
+#endif
+#ifdef TCP_KEEPINTVL
+		set_sock_opt(be->sock, IPPROTO_TCP, TCP_KEEPINTVL, TYPESAFE_MAX(idle / 6, 1));
+#endif
+#ifdef TCP_KEEPCNT
+		set_sock_opt(be->sock, IPPROTO_TCP, TCP_KEEPCNT, 6);
+#endif
+	}
+#ifdef TCP_USER_TIMEOUT
+	int timeout = tunable_get(TUNABLE_SOCKET_USER_TIMEOUT_MS);
+	if (timeout) {
+		set_sock_opt(be->sock, IPPROTO_TCP, TCP_USER_TIMEOUT, timeout);
+	}
+#endif
+}
+
+void bufferev_set_sock_profile(struct bufferev *be, enum bufferev_sock_profile profile)
+{
+	be->sock_profile = profile;
+	apply_sock_profile(be);
+}
+
 struct buffer_queue * bufferev_rx_queue(struct bufferev *be)
 {
 	return be->rx_queue;
@@ -94,42 +319,379 @@ void *bufferev_peek_msg(struct bufferev *be, size_t *len)
 	return buffer_queue_peek_msg(be->rx_queue, len);
 }
 
-ssize_t bufferev_write(struct bufferev *be, void *buf, size_t buflen)
+size_t bufferev_bytes_pending(struct bufferev *be)
+{
+	return buffer_queue_len(be->tx_queue);
+}
+
+/*
+ * Write as much as the socket takes right now, returning the number of
+ * bytes written or -1 on a hard error
+ */
+static ssize_t write_iov(struct bufferev *be, struct iovec *iov, int iovcnt)
+{
+	ssize_t rc;
+	do {
+		rc = writev(be->sock, iov, iovcnt);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		rc = 0;
+	}
+	return rc;
+}
+
+/*
+ * Trims an iovec array to at most 'max' bytes, returning the new count
+ */
+static int clamp_iov(struct iovec *iov, int iovcnt, size_t max)
+{
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len >= max) {
+			iov[i].iov_len = max;
+			return i + 1;
+		}
+		max -= iov[i].iov_len;
+	}
+	return iovcnt;
+}
+
+static ssize_t flush_tcp(struct bufferev *be, size_t max)
+{
+	struct iovec iov[64];
+	int iovcnt = buffer_queue_peek_iov(be->tx_queue, iov, COUNT_OF(iov));
+	iovcnt = clamp_iov(iov, iovcnt, max);
+	ssize_t rc = write_iov(be, iov, iovcnt);
+	if (rc > 0) {
+		buffer_queue_drain(be->tx_queue, rc);
+		token_bucket_consume(&be->tx_shaper, rc);
+	}
+	return rc;
+}
+
+/*
+ * Each tx queue buffer holds one datagram. Sends up to a batch of them,
+ * returning how many went out. Datagrams the kernel refuses outright (say,
+ * ECONNREFUSED after an ICMP error) are dropped, as UDP would anyway.
+ */
+static ssize_t flush_udp(struct bufferev *be)
+{
+	struct iovec iov[BUFFEREV_UDP_BATCH_MAX];
+	int iovcnt = buffer_queue_peek_iov(be->tx_queue, iov, be->udp_batch);
+	int sent = -1;
+
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr hdrs[BUFFEREV_UDP_BATCH_MAX];
+	memset(hdrs, 0, sizeof(hdrs[0]) * iovcnt);
+	for (int i = 0; i < iovcnt; i++) {
+		hdrs[i].msg_hdr.msg_iov = &iov[i];
+		hdrs[i].msg_hdr.msg_iovlen = 1;
+	}
+	do {
+		sent = sendmmsg(be->sock, hdrs, iovcnt, 0);
+	} while (sent < 0 && errno == EINTR);
+	if (sent < 0 && errno == ENOSYS)
+#endif
+	{
+		for (sent = 0; sent < iovcnt; sent++) {
+			ssize_t rc;
+			do {
+				rc = send(be->sock, iov[sent].iov_base, iov[sent].iov_len, 0);
+			} while (rc < 0 && errno == EINTR);
+			if (rc < 0) {
+				break;
+			}
+		}
+		if (sent == 0) {
+			sent = -1;
+		}
+	}
+
+	if (sent < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+			return 0;
+		}
+		sent = 1;
+	}
+
+	size_t len = 0;
+	for (int i = 0; i < sent; i++) {
+		len += iov[i].iov_len;
+	}
+	buffer_queue_drain(be->tx_queue, len);
+	token_bucket_consume(&be->tx_shaper, len);
+	return sent;
+}
+
+static ssize_t flush_tls(struct bufferev *be, size_t max)
+{
+	size_t len;
+	void *data = buffer_queue_peek_contiguous(be->tx_queue, &len);
+	if (be->tls->write_len) {
+		len = be->tls->write_len;
+	} else if (len > max) {
+		len = max;
+	}
+
+	int rc = mbedtls_ssl_write(&be->tls->ssl, data, len);
+	if (rc == MBEDTLS_ERR_SSL_WANT_WRITE || rc == MBEDTLS_ERR_SSL_WANT_READ) {
+		be->tls->write_len = len;
+		return 0;
+	}
+	be->tls->write_len = 0;
+	if (rc < 0) {
+		return -1;
+	}
+	buffer_queue_drain(be->tx_queue, rc);
+	token_bucket_consume(&be->tx_shaper, rc);
+	return rc;
+}
+
+/*
+ * Sends what the tx shaper allows, parking the EV_WRITE watcher until it
+ * refills once it runs dry. Datagrams go whole and may overdraw it.
+ */
+static ssize_t flush(struct bufferev *be)
 {
-	ssize_t off = 0, rc;
-	ssize_t sent_bytes = 0;
+	size_t avail = token_bucket_avail(&be->tx_shaper);
+	if (avail == 0) {
+		be->tx_throttled = true;
+		evloop_io_stop(&be->tx_ev);
+		token_bucket_wait(&be->tx_shaper);
+		return 0;
+	}
 
 	switch (be->proto) {
 	case network_proto_udp:
-		return send(be->sock, buf, buflen, 0);
+		return flush_udp(be);
 	case network_proto_tcp:
-		do {
-			rc = send(be->sock, buf + off, buflen - off, 0);
-			if (rc > 0) {
-				off += rc;
-				sent_bytes += rc;
+		return flush_tcp(be, avail);
+	case network_proto_tls:
+		return flush_tls(be, avail);
+	}
+	return -1;
+}
+
+static void on_write(struct evloop_io *w, int events)
+{
+	struct bufferev *be = w->data;
+
+	while (buffer_queue_len(be->tx_queue) > 0) {
+		ssize_t rc = flush(be);
+		if (rc < 0) {
+			evloop_io_stop(&be->tx_ev);
+			buffer_queue_drain_all(be->tx_queue);
+			if (be->event_cb) {
+				be->event_cb(be, BEV_WRITING | BEV_ERROR, be->cb_arg);
 			}
-		} while (rc > 0 || (rc < 0 && (errno == EAGAIN || errno == EINTR)));
-		return sent_bytes ? sent_bytes : rc;
+			return;
+		}
+		if (rc == 0) {
+			return;
+		}
+	}
+
+	evloop_io_stop(&be->tx_ev);
+	if (be->write_cb) {
+		be->write_cb(be, be->cb_arg);
+	}
+}
+
+/*
+ * TCP writes go straight to the socket while nothing is queued ahead of
+ * them and no tx rate is set. Whatever the socket does not take is queued
+ * and sent from the EV_WRITE watcher, which fires the write callback once
+ * it has all gone.
+ */
+static ssize_t write_tcp(struct bufferev *be, struct iovec *iov, int iovcnt)
+{
+	ssize_t len = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+
+	ssize_t rc = 0;
+	if (be->connected && buffer_queue_len(be->tx_queue) == 0 &&
+			!token_bucket_limited(&be->tx_shaper)) {
+		rc = write_iov(be, iov, iovcnt);
+		if (rc < 0) {
+			return -1;
+		}
+	}
+
+	if (rc < len) {
+		size_t skip = rc;
+		for (int i = 0; i < iovcnt; i++) {
+			if (skip >= iov[i].iov_len) {
+				skip -= iov[i].iov_len;
+				continue;
+			}
+			if (buffer_queue_add_stream(be->tx_queue,
+					iov[i].iov_base + skip, iov[i].iov_len - skip) == -1) {
+				return rc ? rc : -1;
+			}
+			skip = 0;
+		}
+		kick_tx(be);
+	}
+
+	return len;
+}
+
+/*
+ * Datagrams are sent immediately unless the socket buffer is full, in which
+ * case they wait in the tx queue, one buffer each, up to
+ * BUFFEREV_UDP_TX_MAX bytes
+ */
+static ssize_t write_udp(struct bufferev *be, struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+
+	ssize_t rc;
+	if (be->connected && buffer_queue_len(be->tx_queue) == 0 &&
+			!token_bucket_limited(&be->tx_shaper)) {
+		struct msghdr msg = {
+			.msg_iov = iov,
+			.msg_iovlen = iovcnt,
+		};
+		do {
+			rc = sendmsg(be->sock, &msg, 0);
+		} while (rc < 0 && errno == EINTR);
+		if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)) {
+			return rc;
+		}
+	}
+
+	if (buffer_queue_len(be->tx_queue) + len > BUFFEREV_UDP_TX_MAX) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	char *datagram = malloc(len ? len : 1);
+	if (datagram == NULL) {
+		return -1;
+	}
+	for (size_t i = 0, off = 0; i < iovcnt; off += iov[i].iov_len, i++) {
+		memcpy(datagram + off, iov[i].iov_base, iov[i].iov_len);
+	}
+	if (buffer_queue_add_owned(be->tx_queue, datagram, len, free) == -1) {
+		free(datagram);
+		return -1;
+	}
+	kick_tx(be);
+	return len;
+}
 
+/*
+ * TLS writes are queued first, as mbedtls may need to be handed the same
+ * bytes again, then flushed as far as the socket allows
+ */
+static ssize_t write_tls(struct bufferev *be, struct iovec *iov, int iovcnt)
+{
+	bool idle = buffer_queue_len(be->tx_queue) == 0;
+	ssize_t len = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		if (buffer_queue_add_stream(be->tx_queue, iov[i].iov_base, iov[i].iov_len) == -1) {
+			return len ? len : -1;
+		}
+		len += iov[i].iov_len;
+	}
+
+	if (be->connected && idle) {
+		ssize_t rc = 0;
+		while (buffer_queue_len(be->tx_queue) > 0 && (rc = flush(be)) > 0);
+		if (rc < 0) {
+			return -1;
+		}
+		kick_tx(be);
+	}
+	return len;
+}
+
+ssize_t bufferev_write(struct bufferev *be, void *buf, size_t buflen)
+{
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = buflen
+	};
+
+	switch (be->proto) {
+	case network_proto_udp:
+		return write_udp(be, &iov, 1);
+	case network_proto_tcp:
+		return write_tcp(be, &iov, 1);
 	case network_proto_tls:
-		return buffer_queue_add(be->tx_queue, buf, buflen);
+		return write_tls(be, &iov, 1);
 	}
 
 	return -1;
 }
 
-static void on_read_tcp(struct bufferev *be)
+/*
+ * Reads straight into the rx queue's slabs, sized by what the socket says
+ * is waiting
+ */
+static ssize_t read_into_queue(struct bufferev *be, size_t max)
 {
-	size_t bytes_read = 0;
-	char buf[65535];
+	int avail = 0;
+	if (ioctl(be->sock, FIONREAD, &avail) == -1 || avail <= 0) {
+		avail = 1;
+	}
+	if (avail > max) {
+		avail = max;
+	}
+
+	struct iovec iov[2];
+	int iovcnt = buffer_queue_reserve_iov(be->rx_queue, avail, iov);
+	if (iovcnt == -1) {
+		errno = ENOMEM;
+		return -1;
+	}
+	iovcnt = clamp_iov(iov, iovcnt, max);
+
 	ssize_t rc;
-	while ((rc = read(be->sock, buf, sizeof(buf))) > 0) {
+	do {
+		rc = readv(be->sock, iov, iovcnt);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc > 0) {
+		buffer_queue_commit(be->rx_queue, rc);
+	}
+	return rc;
+}
+
+static void on_read_tcp(struct bufferev *be)
+{
+	size_t bytes_read = 0, max;
+	ssize_t rc = 1;
+
+	/*
+	 * Over the memory budget, take one small read per wakeup so that every
+	 * socket still makes some progress
+	 */
+	bool over_budget = buffer_queue_over_budget();
+	while (!be->rx_full && (max = rx_allowance(be)) > 0) {
+		if (over_budget) {
+			max = TYPESAFE_MIN(max, BUFFER_QUEUE_SLAB_LEN);
+		}
+		if ((rc = read_into_queue(be, read_limit(max))) <= 0) {
+			break;
+		}
+		token_bucket_consume(&be->rx_shaper, rc);
 		bytes_read += rc;
-		buffer_queue_add(be->rx_queue, buf, rc);
+		if (over_budget) {
+			break;
+		}
 	}
 	int my_errno = errno;
 
+	if (rc == 0 || (rc == -1 && my_errno != EAGAIN && my_errno != EINPROGRESS && my_errno != EWOULDBLOCK)) {
+		be->read_eof = true;
+	}
+
 	if (bytes_read > 0) {
 		if (be->read_cb) {
 			be->read_cb(be, be->cb_arg);
@@ -140,7 +702,7 @@ static void on_read_tcp(struct bufferev *be)
 	 * The socket shutdown as expected
 	 */
 	if (rc == 0) {
-		ev_io_stop(be->loop, &be->data_ev);
+		evloop_io_stop(&be->data_ev);
 		if (be->event_cb) {
 			be->event_cb(be, BEV_EOF, be->cb_arg);
 		}
@@ -148,37 +710,262 @@ static void on_read_tcp(struct bufferev *be)
 		/*
 		 * An error occurred
 		 */
-		ev_io_stop(be->loop, &be->data_ev);
+		evloop_io_stop(&be->data_ev);
 		if (be->event_cb) {
 			be->event_cb(be, BEV_EOF | BEV_ERROR, be->cb_arg);
 		}
 	}
 }
 
+#ifdef BUFFEREV_IOCP
+/*
+ * With a completion port, TCP sockets keep one WSARecv and one WSASend
+ * outstanding rather than being watched for readiness. Receives land in the
+ * rx queue's spare slab, sends go straight from the tx queue's buffers, and
+ * both stay queued until their completion says how much moved.
+ */
+static void iocp_release(struct bufferev *be)
+{
+	if (!be->rx_posted && !be->tx_posted) {
+		buffer_queue_free(be->rx_queue);
+		buffer_queue_free(be->tx_queue);
+		free(be);
+	}
+}
+
+static void iocp_post_recv(struct bufferev *be)
+{
+	if (be->rx_posted) {
+		return;
+	}
+
+	size_t max = token_bucket_avail(&be->rx_shaper);
+	if (max == 0) {
+		be->rx_throttled = true;
+		token_bucket_wait(&be->rx_shaper);
+		return;
+	}
+	if (buffer_queue_over_budget()) {
+		max = TYPESAFE_MIN(max, BUFFER_QUEUE_SLAB_LEN);
+	}
+	max = read_limit(max);
+
+	size_t size;
+	void *buf = buffer_queue_reserve_slab(be->rx_queue, max, &size);
+	if (buf == NULL) {
+		be->read_eof = true;
+		if (be->event_cb) {
+			be->event_cb(be, BEV_EOF | BEV_ERROR, be->cb_arg);
+		}
+		return;
+	}
+	be->rx_posted = true;
+	iocp_recv(&be->rx_op, be->sock, buf, TYPESAFE_MIN(size, max));
+}
+
+static void on_iocp_recv(struct iocp_op *op, size_t bytes, int err)
+{
+	struct bufferev *be = op->arg;
+	be->rx_posted = false;
+	if (be->freed) {
+		iocp_release(be);
+		return;
+	}
+
+	if (err || bytes == 0) {
+		be->read_eof = true;
+		if (be->event_cb) {
+			be->event_cb(be, err ? BEV_EOF | BEV_ERROR : BEV_EOF, be->cb_arg);
+		}
+		return;
+	}
+
+	buffer_queue_commit_slab(be->rx_queue, bytes);
+	token_bucket_consume(&be->rx_shaper, bytes);
+	update_read(be);
+	if (be->read_cb) {
+		be->read_cb(be, be->cb_arg);
+	}
+}
+
+static void iocp_post_send(struct bufferev *be)
+{
+	if (be->tx_posted) {
+		return;
+	}
+
+	size_t avail = token_bucket_avail(&be->tx_shaper);
+	if (avail == 0) {
+		be->tx_throttled = true;
+		token_bucket_wait(&be->tx_shaper);
+		return;
+	}
+
+	struct iovec iov[64];
+	int iovcnt = buffer_queue_peek_iov(be->tx_queue, iov, COUNT_OF(iov));
+	iovcnt = clamp_iov(iov, iovcnt, avail);
+	be->tx_posted = true;
+	iocp_send(&be->tx_op, be->sock, iov, iovcnt);
+}
+
+static void on_iocp_send(struct iocp_op *op, size_t bytes, int err)
+{
+	struct bufferev *be = op->arg;
+	be->tx_posted = false;
+	if (be->freed) {
+		iocp_release(be);
+		return;
+	}
+
+	if (err) {
+		buffer_queue_drain_all(be->tx_queue);
+		if (be->event_cb) {
+			be->event_cb(be, BEV_WRITING | BEV_ERROR, be->cb_arg);
+		}
+		return;
+	}
+
+	buffer_queue_drain(be->tx_queue, bytes);
+	token_bucket_consume(&be->tx_shaper, bytes);
+	if (buffer_queue_len(be->tx_queue)) {
+		kick_tx(be);
+	} else if (be->write_cb) {
+		be->write_cb(be, be->cb_arg);
+	}
+}
+#endif
+
+/*
+ * Datagrams are received into scratch slots big enough for any of them, then
+ * copied into the rx queue at their actual size. Every bufferev runs on the
+ * one event loop, so a single set of slots serves them all.
+ */
+#define UDP_SLOT_LEN 65535
+
+static struct bufferev_udp_msg *udp_slots[BUFFEREV_UDP_BATCH_MAX];
+
+static struct bufferev_udp_msg *udp_slot(int i)
+{
+	if (udp_slots[i] == NULL) {
+		udp_slots[i] = malloc(sizeof(struct bufferev_udp_msg) + UDP_SLOT_LEN);
+	}
+	return udp_slots[i];
+}
+
+/*
+ * Returns the number of datagrams received into the slots, or -1
+ */
+static int recv_udp(struct bufferev *be)
+{
+	struct bufferev_udp_msg *msg;
+
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr hdrs[BUFFEREV_UDP_BATCH_MAX];
+	struct iovec iov[BUFFEREV_UDP_BATCH_MAX];
+	int n;
+	for (n = 0; n < be->udp_batch && (msg = udp_slot(n)); n++) {
+		iov[n].iov_base = msg->buf;
+		iov[n].iov_len = UDP_SLOT_LEN;
+		memset(&hdrs[n], 0, sizeof(hdrs[n]));
+		hdrs[n].msg_hdr.msg_name = &msg->src;
+		hdrs[n].msg_hdr.msg_namelen = sizeof(msg->src);
+		hdrs[n].msg_hdr.msg_iov = &iov[n];
+		hdrs[n].msg_hdr.msg_iovlen = 1;
+	}
+	if (n == 0) {
+		return -1;
+	}
+
+	int rc;
+	do {
+		rc = recvmmsg(be->sock, hdrs, n, 0, NULL);
+	} while (rc < 0 && errno == EINTR);
+	if (rc >= 0 || errno != ENOSYS) {
+		for (int i = 0; i < rc; i++) {
+			udp_slots[i]->src_len = hdrs[i].msg_hdr.msg_namelen;
+			udp_slots[i]->buf_len = hdrs[i].msg_len;
+		}
+		return rc;
+	}
+#endif
+
+	msg = udp_slot(0);
+	if (msg == NULL) {
+		return -1;
+	}
+	msg->src_len = sizeof(msg->src);
+	msg->buf_len = recvfrom(be->sock, msg->buf, UDP_SLOT_LEN, 0,
+				(struct sockaddr *)&msg->src, &msg->src_len);
+	return msg->buf_len < 0 ? -1 : 1;
+}
+
 static void on_read_udp(struct bufferev *be)
 {
 	size_t bytes_read = 0;
-	struct bufferev_udp_msg *msg = calloc(1, sizeof(*msg) + 65535);
+	int rc;
+
+	while (!be->rx_full && rx_allowance(be) > 0 && (rc = recv_udp(be)) > 0) {
+		for (int i = 0; i < rc; i++) {
+			struct bufferev_udp_msg *msg = udp_slots[i];
+			if (msg->buf_len > 0) {
+				bytes_read += msg->buf_len;
+				token_bucket_consume(&be->rx_shaper, msg->buf_len);
+				buffer_queue_add(be->rx_queue, msg, sizeof(*msg) + msg->buf_len);
+			}
+		}
+	}
 
-	do {
-		msg->src_len = sizeof(msg->src),
-		msg->buf_len = recvfrom(be->sock, msg->buf, 65535, 0,
-					(struct sockaddr *)&msg->src, &msg->src_len);
-		if (msg->buf_len > 0) {
-			bytes_read += msg->buf_len;
-			buffer_queue_add(be->rx_queue, msg, sizeof(*msg) + msg->buf_len);
+	if (bytes_read > 0) {
+		if (be->read_cb) {
+			be->read_cb(be, be->cb_arg);
 		}
-	} while (msg->buf_len > 0);
+	}
+}
+
+static void on_read_tls(struct bufferev *be)
+{
+	size_t bytes_read = 0, max;
+	int rc = 1;
+	while (!be->rx_full && (max = rx_allowance(be)) > 0) {
+		struct iovec iov[2];
+		if (buffer_queue_reserve_iov(be->rx_queue, BUFFER_QUEUE_SLAB_LEN, iov) == -1) {
+			rc = MBEDTLS_ERR_SSL_ALLOC_FAILED;
+			break;
+		}
+		rc = mbedtls_ssl_read(&be->tls->ssl, iov[0].iov_base,
+			read_limit(iov[0].iov_len < max ? iov[0].iov_len : max));
+		if (rc <= 0) {
+			break;
+		}
+		buffer_queue_commit(be->rx_queue, rc);
+		token_bucket_consume(&be->rx_shaper, rc);
+		bytes_read += rc;
+	}
 
 	if (bytes_read > 0) {
 		if (be->read_cb) {
 			be->read_cb(be, be->cb_arg);
 		}
 	}
+
+	if (rc == 0 || rc == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || rc == MBEDTLS_ERR_SSL_CONN_EOF) {
+		be->read_eof = true;
+		evloop_io_stop(&be->data_ev);
+		if (be->event_cb) {
+			be->event_cb(be, BEV_EOF, be->cb_arg);
+		}
+	} else if (rc < 0 && rc != MBEDTLS_ERR_SSL_WANT_READ && rc != MBEDTLS_ERR_SSL_WANT_WRITE) {
+		log_info("TLS read failed: -0x%04x", -rc);
+		be->read_eof = true;
+		evloop_io_stop(&be->data_ev);
+		if (be->event_cb) {
+			be->event_cb(be, BEV_EOF | BEV_ERROR, be->cb_arg);
+		}
+	}
 }
 
 static void
-on_read(struct ev_loop *loop, struct ev_io *w, int events)
+on_read(struct evloop_io *w, int events)
 {
 	struct bufferev *be = w->data;
 
@@ -190,6 +977,7 @@ on_read(struct ev_loop *loop, struct ev_io *w, int events)
 		on_read_udp(be);
 		break;
 	case network_proto_tls:
+		on_read_tls(be);
 		break;
 	}
 }
@@ -204,15 +992,15 @@ close_sock(struct bufferev *be)
 }
 
 static void
-on_connect_timeout(struct ev_loop *loop, struct ev_timer *w, int revents)
+on_connect_timeout(struct evloop_timer *w)
 {
-	struct bufferev *be = (struct bufferev *)w;
+	struct bufferev *be = w->data;
 
-	ev_timer_stop(be->loop, &be->connect_timer);
+	evloop_timer_stop(&be->connect_timer);
 
 	if (!be->connected) {
 		close_sock(be);
-		ev_io_stop(be->loop, &be->data_ev);
+		evloop_io_stop(&be->data_ev);
 
 		if (be->event_cb) {
 			be->event_cb(be, BEV_ERROR | BEV_TIMEOUT, be->cb_arg);
@@ -220,13 +1008,40 @@ on_connect_timeout(struct ev_loop *loop, struct ev_timer *w, int revents)
 	}
 }
 
+/*
+ * Sends anything written before the connection completed
+ */
+static void
+start_tx(struct bufferev *be)
+{
+	evloop_io_init(&be->tx_ev, be->loop, on_write, be->sock, EVLOOP_WRITE);
+	be->tx_ev.data = be;
+	kick_tx(be);
+}
+
+static void
+established(struct bufferev *be)
+{
+	evloop_io_init(&be->data_ev, be->loop, on_read, be->sock, EVLOOP_READ);
+	be->data_ev.data = be;
+	be->connected = 1;
+#ifdef BUFFEREV_IOCP
+	be->iocp = be->proto == network_proto_tcp &&
+		iocp_op_init(&be->rx_op, be->loop, on_iocp_recv, be) == 0 &&
+		iocp_op_init(&be->tx_op, be->loop, on_iocp_send, be) == 0 &&
+		iocp_attach(be->sock) == 0;
+#endif
+	update_read(be);
+	start_tx(be);
+}
+
 static void
-on_connect(struct ev_loop *loop, struct ev_io *w, int events)
+on_connect(struct evloop_io *w, int events)
 {
 	struct bufferev *be = w->data;
 
-	ev_io_stop(be->loop, &be->data_ev);
-	ev_timer_stop(be->loop, &be->connect_timer);
+	evloop_io_stop(&be->data_ev);
+	evloop_timer_stop(&be->connect_timer);
 
 	int status;
 	socklen_t len = sizeof(status);
@@ -238,14 +1053,17 @@ on_connect(struct ev_loop *loop, struct ev_io *w, int events)
 		return;
 	}
 
+	if (be->tls) {
+		evloop_timer_start(&be->connect_timer, BUFFEREV_TLS_HANDSHAKE_TIMEOUT, 0);
+		tls_handshake(be);
+		return;
+	}
+
 	if (be->event_cb) {
 		be->event_cb(be, BEV_CONNECTED, be->cb_arg);
 	}
 
-	ev_io_init(&be->data_ev, on_read, be->sock, EV_READ);
-	be->data_ev.data = be;
-	ev_io_start(be->loop, &be->data_ev);
-	be->connected = 1;
+	established(be);
 }
 
 int bufferev_connect_addrinfo(struct bufferev *be,
@@ -282,22 +1100,26 @@ int bufferev_connect_addrinfo(struct bufferev *be,
 		}
 
 	} else {
-		be->proto = network_proto_tcp;
+		be->proto = be->tls ? network_proto_tls : network_proto_tcp;
 		if (src) {
 			if (bind(be->sock, src->ai_addr, src->ai_addrlen) != 0) {
 				log_debug("could not bind: %s", strerror(errno));
 			}
 		}
+
+		/*
+		 * Before connecting, so the buffer sizes shape the window offered
+		 */
+		apply_sock_profile(be);
 	}
 
 	int rc = connect(be->sock, dst->ai_addr, dst->ai_addrlen);
 	if (rc == 0 || errno == EINPROGRESS || errno == EWOULDBLOCK) {
-		ev_io_init(&be->data_ev, on_connect, be->sock, EV_WRITE);
+		evloop_io_init(&be->data_ev, be->loop, on_connect, be->sock, EVLOOP_WRITE);
 		be->data_ev.data = be;
-		ev_io_start(be->loop, &be->data_ev);
+		evloop_io_start(&be->data_ev);
 
-		ev_timer_init(&be->connect_timer, on_connect_timeout, timeout_s, 0);
-		ev_timer_start(be->loop, &be->connect_timer);
+		evloop_timer_start(&be->connect_timer, timeout_s, 0);
 	} else {
 		close_sock(be);
 		return -1;
@@ -312,10 +1134,9 @@ int bufferev_connect_tcp_sock(struct bufferev *be, int sock)
 	make_socket_nonblocking(be->sock);
 
 	be->proto = network_proto_tcp;
+	apply_sock_profile(be);
 
-	ev_io_init(&be->data_ev, on_read, be->sock, EV_READ);
-	be->data_ev.data = be;
-	ev_io_start(be->loop, &be->data_ev);
+	established(be);
 
 	if (be->event_cb) {
 		be->event_cb(be, BEV_CONNECTED, be->cb_arg);
@@ -324,6 +1145,173 @@ int bufferev_connect_tcp_sock(struct bufferev *be, int sock)
 	return 0;
 }
 
+/*
+ * All TLS connections share one client configuration. Peer certificates are
+ * not checked, as with the HTTP transport; the session's own TLV encryption
+ * is negotiated on top.
+ */
+static struct {
+	bool ready;
+	mbedtls_ssl_config conf;
+	mbedtls_entropy_context entropy;
+	mbedtls_ctr_drbg_context ctr_drbg;
+} tls_config;
+
+static mbedtls_ssl_config *get_tls_config(void)
+{
+	if (!tls_config.ready) {
+		mbedtls_ssl_config_init(&tls_config.conf);
+		mbedtls_entropy_init(&tls_config.entropy);
+		mbedtls_ctr_drbg_init(&tls_config.ctr_drbg);
+		if (mbedtls_ctr_drbg_seed(&tls_config.ctr_drbg, mbedtls_entropy_func,
+				&tls_config.entropy, NULL, 0) != 0 ||
+			mbedtls_ssl_config_defaults(&tls_config.conf, MBEDTLS_SSL_IS_CLIENT,
+				MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0) {
+			mbedtls_ctr_drbg_free(&tls_config.ctr_drbg);
+			mbedtls_entropy_free(&tls_config.entropy);
+			mbedtls_ssl_config_free(&tls_config.conf);
+			return NULL;
+		}
+		mbedtls_ssl_conf_authmode(&tls_config.conf, MBEDTLS_SSL_VERIFY_NONE);
+		mbedtls_ssl_conf_rng(&tls_config.conf, mbedtls_ctr_drbg_random,
+			&tls_config.ctr_drbg);
+#ifdef MBEDTLS_SSL_SESSION_TICKETS
+		mbedtls_ssl_conf_session_tickets(&tls_config.conf,
+			MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+		tls_config.ready = true;
+	}
+	return &tls_config.conf;
+}
+
+static int tls_send(void *arg, const unsigned char *buf, size_t len)
+{
+	struct bufferev *be = arg;
+	ssize_t rc;
+	do {
+		rc = send(be->sock, buf, len, 0);
+	} while (rc < 0 && errno == EINTR);
+	if (rc < 0) {
+		return errno == EAGAIN || errno == EWOULDBLOCK ?
+			MBEDTLS_ERR_SSL_WANT_WRITE : MBEDTLS_ERR_NET_SEND_FAILED;
+	}
+	return rc;
+}
+
+static int tls_recv(void *arg, unsigned char *buf, size_t len)
+{
+	struct bufferev *be = arg;
+	ssize_t rc;
+	do {
+		rc = recv(be->sock, buf, len, 0);
+	} while (rc < 0 && errno == EINTR);
+	if (rc < 0) {
+		return errno == EAGAIN || errno == EWOULDBLOCK ?
+			MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_RECV_FAILED;
+	}
+	return rc;
+}
+
+static void on_tls_handshake(struct evloop_io *w, int events)
+{
+	tls_handshake(w->data);
+}
+
+static void tls_handshake(struct bufferev *be)
+{
+	struct bufferev_tls *tls = be->tls;
+	int rc = mbedtls_ssl_handshake(&tls->ssl);
+
+	evloop_io_stop(&be->data_ev);
+	if (rc == MBEDTLS_ERR_SSL_WANT_READ || rc == MBEDTLS_ERR_SSL_WANT_WRITE) {
+		evloop_io_init(&be->data_ev, be->loop, on_tls_handshake, be->sock,
+			rc == MBEDTLS_ERR_SSL_WANT_READ ? EVLOOP_READ : EVLOOP_WRITE);
+		be->data_ev.data = be;
+		evloop_io_start(&be->data_ev);
+		return;
+	}
+
+	evloop_timer_stop(&be->connect_timer);
+
+	struct bufferev_tls_session *s = tls->session;
+	if (rc != 0) {
+		log_info("TLS handshake failed: -0x%04x", -rc);
+		if (s) {
+			s->valid = false;
+		}
+		if (be->event_cb) {
+			be->event_cb(be, BEV_ERROR, be->cb_arg);
+		}
+		return;
+	}
+
+	if (s) {
+		/*
+		 * A ticket resumption gets a new session id, but keeps the secret
+		 */
+		bool resumed = s->valid && memcmp(tls->ssl.session->master,
+			s->session.master, sizeof(s->session.master)) == 0;
+		log_debug("TLS session %s", resumed ? "resumed" : "established");
+		s->valid = mbedtls_ssl_get_session(&tls->ssl, &s->session) == 0;
+	}
+
+	if (be->event_cb) {
+		be->event_cb(be, BEV_CONNECTED, be->cb_arg);
+	}
+
+	established(be);
+}
+
+struct bufferev_tls_session * bufferev_tls_session_new(void)
+{
+	struct bufferev_tls_session *s = calloc(1, sizeof(*s));
+	if (s) {
+		mbedtls_ssl_session_init(&s->session);
+	}
+	return s;
+}
+
+void bufferev_tls_session_free(struct bufferev_tls_session *s)
+{
+	if (s) {
+		mbedtls_ssl_session_free(&s->session);
+		free(s);
+	}
+}
+
+int bufferev_enable_tls(struct bufferev *be, const char *hostname,
+	struct bufferev_tls_session *session)
+{
+	mbedtls_ssl_config *conf = get_tls_config();
+	if (conf == NULL || be->tls) {
+		return -1;
+	}
+
+	struct bufferev_tls *tls = calloc(1, sizeof(*tls));
+	if (tls == NULL) {
+		return -1;
+	}
+
+	mbedtls_ssl_init(&tls->ssl);
+	if (mbedtls_ssl_setup(&tls->ssl, conf) != 0 ||
+		(hostname && mbedtls_ssl_set_hostname(&tls->ssl, hostname) != 0)) {
+		goto err;
+	}
+	mbedtls_ssl_set_bio(&tls->ssl, be, tls_send, tls_recv, NULL);
+
+	if (session && session->valid) {
+		mbedtls_ssl_set_session(&tls->ssl, &session->session);
+	}
+	tls->session = session;
+	be->tls = tls;
+	return 0;
+
+err:
+	mbedtls_ssl_free(&tls->ssl);
+	free(tls);
+	return -1;
+}
+
 static char *
 parse_sockaddr(struct sockaddr_storage *addr, uint16_t *port)
 {
@@ -347,6 +1335,74 @@ char * bufferev_get_udp_msg_peer_addr(struct bufferev_udp_msg *msg, uint16_t *po
 	return parse_sockaddr(&msg->src, port);
 }
 
+ssize_t bufferev_writev(struct bufferev *be, struct iovec *iov, int iovcnt)
+{
+	switch (be->proto) {
+	case network_proto_udp:
+		return write_udp(be, iov, iovcnt);
+	case network_proto_tcp:
+		return write_tcp(be, iov, iovcnt);
+
+	case network_proto_tls:
+		return write_tls(be, iov, iovcnt);
+	}
+
+	return -1;
+}
+
+/*
+ * Datagrams go out a batch per sendmmsg call while the socket takes them
+ * and nothing is queued ahead; whatever is left is queued as write_udp
+ * would. Ones refused outright are dropped, as in flush_udp.
+ */
+static ssize_t write_udp_msgs(struct bufferev *be, struct iovec *msgs, int count)
+{
+	ssize_t written = 0;
+	int i = 0;
+
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr hdrs[BUFFEREV_UDP_BATCH_MAX];
+	while (i < count && be->connected && buffer_queue_len(be->tx_queue) == 0 &&
+			!token_bucket_limited(&be->tx_shaper)) {
+		int n = count - i < be->udp_batch ? count - i : be->udp_batch;
+		memset(hdrs, 0, sizeof(hdrs[0]) * n);
+		for (int j = 0; j < n; j++) {
+			hdrs[j].msg_hdr.msg_iov = &msgs[i + j];
+			hdrs[j].msg_hdr.msg_iovlen = 1;
+		}
+		int sent;
+		do {
+			sent = sendmmsg(be->sock, hdrs, n, 0);
+		} while (sent < 0 && errno == EINTR);
+		if (sent <= 0) {
+			break;
+		}
+		for (int j = 0; j < sent; j++) {
+			written += msgs[i + j].iov_len;
+		}
+		i += sent;
+	}
+#endif
+
+	for (; i < count; i++) {
+		ssize_t rc = write_udp(be, &msgs[i], 1);
+		if (rc >= 0) {
+			written += rc;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOMEM) {
+			break;
+		}
+	}
+	return written || count == 0 ? written : -1;
+}
+
+ssize_t bufferev_write_msgs(struct bufferev *be, struct iovec *msgs, int count)
+{
+	if (be->proto == network_proto_udp) {
+		return write_udp_msgs(be, msgs, count);
+	}
+	return bufferev_writev(be, msgs, count);
+}
+
 char * bufferev_get_local_addr(struct bufferev *be, uint16_t *port)
 {
 	struct sockaddr_storage addr;
@@ -374,7 +1430,26 @@ char * bufferev_get_peer_addr(struct bufferev *be, uint16_t *port)
 void bufferev_free(struct bufferev *be)
 {
 	if (be) {
-		ev_io_stop(be->loop, &be->data_ev);
+		evloop_io_close(&be->data_ev);
+		evloop_io_close(&be->tx_ev);
+		evloop_timer_close(&be->connect_timer);
+		token_bucket_stop(&be->rx_shaper);
+		token_bucket_stop(&be->tx_shaper);
+		if (be->tls) {
+			mbedtls_ssl_free(&be->tls->ssl);
+			free(be->tls);
+		}
+#ifdef BUFFEREV_IOCP
+		/*
+		 * Closing the socket aborts outstanding operations, whose
+		 * completions still refer to the queues
+		 */
+		if (be->rx_posted || be->tx_posted) {
+			close_sock(be);
+			be->freed = true;
+			return;
+		}
+#endif
 		buffer_queue_free(be->rx_queue);
 		buffer_queue_free(be->tx_queue);
 		close_sock(be);
@@ -393,6 +1468,8 @@ struct bufferev * bufferev_new(struct ev_loop *loop)
 	if (be->rx_queue == NULL) {
 		goto err;
 	}
+	buffer_queue_set_watermarks(be->rx_queue, BUFFEREV_RX_LOW_WATERMARK,
+		BUFFEREV_RX_HIGH_WATERMARK, on_rx_watermark, be);
 
 	be->tx_queue = buffer_queue_new();
 	if (be->tx_queue == NULL) {
@@ -400,6 +1477,11 @@ struct bufferev * bufferev_new(struct ev_loop *loop)
 	}
 
 	be->loop = loop;
+	be->udp_batch = BUFFEREV_UDP_BATCH;
+	evloop_timer_init(&be->connect_timer, loop, on_connect_timeout);
+	be->connect_timer.data = be;
+	token_bucket_init(&be->rx_shaper, loop, on_rx_refill, be);
+	token_bucket_init(&be->tx_shaper, loop, on_tx_refill, be);
 
 	return be;
 
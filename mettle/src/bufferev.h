@@ -8,6 +8,8 @@
 
 #include <ev.h>
 #include <netdb.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 #include "buffer_queue.h"
@@ -34,6 +36,24 @@ int bufferev_connect_addrinfo(struct bufferev *be,
 #define BEV_TIMEOUT   0x10  // user-specified timeout reached
 #define BEV_CONNECTED 0x20  // connect operation finished
 
+/*
+ * Wraps the connection made by a following bufferev_connect_addrinfo in TLS,
+ * with BEV_CONNECTED reported once the handshake is done. If 'session' is
+ * given, the session it holds is offered for resumption and it is updated
+ * with the new one, so a caller keeping it across reconnects can skip full
+ * handshakes.
+ */
+struct bufferev_tls_session;
+
+struct bufferev_tls_session * bufferev_tls_session_new(void);
+
+void bufferev_tls_session_free(struct bufferev_tls_session *s);
+
+#define BUFFEREV_TLS_HANDSHAKE_TIMEOUT 10.0
+
+int bufferev_enable_tls(struct bufferev *be, const char *hostname,
+	struct bufferev_tls_session *session);
+
 typedef void (*bufferev_data_cb)(struct bufferev *be, void *arg);
 typedef void (*bufferev_event_cb)(struct bufferev *be, int event, void *arg);
 
@@ -45,6 +65,65 @@ void bufferev_set_cbs(struct bufferev *be,
 
 struct buffer_queue * bufferev_rx_queue(struct bufferev *be);
 
+/*
+ * Reading stops by itself once this much is waiting in the rx queue, and
+ * resumes when the reader has consumed it back down to the low watermark
+ */
+#ifdef METTLE_LOW_MEMORY
+#define BUFFEREV_RX_HIGH_WATERMARK (128 * 1024)
+#define BUFFEREV_RX_LOW_WATERMARK  (32 * 1024)
+#else
+#define BUFFEREV_RX_HIGH_WATERMARK (1024 * 1024)
+#define BUFFEREV_RX_LOW_WATERMARK  (256 * 1024)
+#endif
+
+/*
+ * Stop or resume reading from the socket, e.g. while whatever the read
+ * callback feeds is backed up
+ */
+void bufferev_set_read_paused(struct bufferev *be, bool paused);
+
+/*
+ * Datagrams received or sent per recvmmsg/sendmmsg call, where available.
+ * Datagrams waiting for a full socket buffer are dropped past
+ * BUFFEREV_UDP_TX_MAX bytes.
+ */
+#define BUFFEREV_UDP_BATCH     8
+#ifdef METTLE_LOW_MEMORY
+#define BUFFEREV_UDP_BATCH_MAX 4
+#else
+#define BUFFEREV_UDP_BATCH_MAX 32
+#endif
+#define BUFFEREV_UDP_TX_MAX    (256 * 1024)
+
+void bufferev_set_udp_batch(struct bufferev *be, int batch);
+
+/*
+ * Shape traffic to at most the given bytes per second each way, 0 for
+ * unlimited. Reads and writes wait on a timer rather than block, so other
+ * connections keep moving.
+ */
+void bufferev_set_rate_limit(struct bufferev *be, uint64_t rx_rate, uint64_t tx_rate);
+
+/*
+ * Socket options for what a TCP connection carries, applied when its
+ * socket is made from the socket.* tunables at the time. Interactive
+ * connections set TCP_NODELAY and TCP_NOTSENT_LOWAT, so small writes go
+ * out at once without much queued in the kernel ahead of them. Bulk ones
+ * take socket.bulk_buf sized buffers for long fat links. C2 connections
+ * are interactive and add keepalive and TCP_USER_TIMEOUT, so a link that
+ * died while idle is noticed. Options the platform lacks are skipped.
+ * The values are fixed, as clients ask for them by number.
+ */
+enum bufferev_sock_profile {
+	BUFFEREV_SOCK_DEFAULT = 0,
+	BUFFEREV_SOCK_INTERACTIVE = 1,
+	BUFFEREV_SOCK_BULK = 2,
+	BUFFEREV_SOCK_C2 = 3,
+};
+
+void bufferev_set_sock_profile(struct bufferev *be, enum bufferev_sock_profile profile);
+
 size_t bufferev_peek(struct bufferev *be, void *buf, size_t buflen);
 
 size_t bufferev_read(struct bufferev *be, void *buf, size_t buflen);
@@ -66,8 +145,27 @@ void *bufferev_peek_msg(struct bufferev *be, size_t *len);
 
 size_t bufferev_bytes_available(struct bufferev *be);
 
+/*
+ * Writes never block: TCP data the socket cannot take yet is queued and
+ * sent as it becomes writable, and the write callback fires once the queue
+ * has drained
+ */
 ssize_t bufferev_write(struct bufferev *be, void *buf, size_t buflen);
 
+ssize_t bufferev_writev(struct bufferev *be, struct iovec *iov, int iovcnt);
+
+/*
+ * Writes each iovec as a datagram of its own on UDP, batching them into
+ * sendmmsg calls; a stream simply gets them in order. Returns the bytes
+ * accepted, which may stop short when the tx queue fills.
+ */
+ssize_t bufferev_write_msgs(struct bufferev *be, struct iovec *msgs, int count);
+
+/*
+ * Bytes accepted by bufferev_write/writev but not yet sent
+ */
+size_t bufferev_bytes_pending(struct bufferev *be);
+
 char * bufferev_get_local_addr(struct bufferev *be, uint16_t *port);
 
 char * bufferev_get_peer_addr(struct bufferev *be, uint16_t *port);
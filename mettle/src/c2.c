@@ -6,32 +6,98 @@
 #include <ev.h>
 #include <eio.h>
 #include <errno.h>
+#include <pthread.h>
 #include <string.h>
 #include <strings.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #include "c2.h"
 #include "c2_transports.h"
+#include "evloop.h"
 #include "network_client.h"
 #include "http_client.h"
 #include "log.h"
+#include "metrics.h"
+#include "probes.h"
+#include "thread_role.h"
+#include "token_bucket.h"
+#include "tunables.h"
+#include "util.h"
 #include "utlist.h"
 
+/*
+ * Most a striped transport is given from the common egress queue before it
+ * has sent what it has
+ */
+#define C2_STRIPE_DEPTH (64 * 1024)
+
+/*
+ * Transport health. RTT, error rate and throughput are exponentially
+ * weighted averages. A transport that fails is not retried for a backoff
+ * doubling from 1 s to C2_MAX_BACKOFF, and one with egress waiting but no
+ * progress for C2_STALL_RTTS round trips, at least C2_STALL_MIN seconds,
+ * is treated as failed. The minimum stays above the slowest HTTP poll.
+ */
+#define C2_DEFAULT_RTT 0.5
+#define C2_HEALTH_ALPHA 0.2
+#define C2_ERROR_WEIGHT 4.0
+#define C2_MAX_BACKOFF 10.0
+#define C2_STALL_RTTS 4
+#define C2_STALL_MIN 15.0
+
+enum c2_transport_state {
+	c2_transport_state_unknown,
+	c2_transport_state_starting,
+	c2_transport_state_reachable,
+	c2_transport_state_unreachable
+};
+
 struct c2_transport {
 	struct c2_transport *prev, *next;
 	char *uri, *dest;
 	struct c2 *c2;
 	struct c2_transport_type *type;
 	void *ctx;
+
+	struct {
+		double srtt;
+		double errors;
+		double tx_rate;
+		size_t tx_bytes;
+		unsigned failures;
+		ev_tstamp started;
+		ev_tstamp last_progress;
+		ev_tstamp retry_at;
+	} health;
+
+	/*
+	 * Only used when striping
+	 */
+	enum c2_transport_state state;
+	struct buffer_queue *ingress;
+	struct buffer_queue *egress;
+	struct buffer_queue *rx;
+};
+
+/*
+ * A packet kept for resending until the peer acknowledges it
+ */
+struct c2_unacked {
+	struct c2_unacked *prev, *next;
+	uint32_t seq;
+	size_t len;
+	char buf[];
 };
 
 struct c2_transport_type {
 	struct c2_transport_type *next;
 	char *proto;
 	struct c2_transport_cbs cbs;
+	struct metric *tx_bytes, *rx_bytes;
 };
 
 struct c2 {
@@ -41,20 +107,54 @@ struct c2 {
 	struct c2_transport *transports;
 	struct c2_transport *curr_transport;
 	struct ev_timer transport_timer;
-	enum {
-		c2_transport_state_unknown,
-		c2_transport_state_starting,
-		c2_transport_state_reachable,
-		c2_transport_state_unreachable
-	} transport_state;
+	enum c2_transport_state transport_state;
+	bool striping;
+	struct c2_transport *rx_transport;
 
 	struct buffer_queue *ingress;
 	struct buffer_queue *egress;
+	struct token_bucket tx_shaper;
+
+	/*
+	 * Packets not yet acknowledged, oldest first, when resuming. They are
+	 * added by the caller and resent by the transports, under the handoff
+	 * lock with a transport thread.
+	 */
+	size_t resume_max_bytes;
+	struct c2_unacked *unacked;
+	size_t unacked_bytes;
+	uint32_t tx_seq;
+	bool link_lost;
+
+	uint32_t idle_tick_ms;
 
 	c2_data_cb read_cb;
 	c2_data_cb write_cb;
 	c2_event_cb event_cb;
 	void *cb_arg;
+
+	/*
+	 * With a transport thread, 'loop' is that thread's and the callbacks
+	 * run on 'caller_loop'. Transports fill the ingress queues under the
+	 * handoff lock and the caller reads what was moved to 'rx'; the caller
+	 * fills 'tx' under the lock for the thread to move to egress.
+	 */
+	bool threaded;
+	bool running;
+	bool thread_started;
+	struct ev_loop *caller_loop;
+	pthread_t thread;
+	pthread_mutex_t handoff_mutex;
+	struct buffer_queue *rx;
+	struct buffer_queue *tx;
+	bool tx_rate_changed;
+	uint64_t tx_rate;
+	int pending_events;
+	bool egress_full;
+	struct ev_async tx_async;
+	struct ev_async rx_async;
+	struct ev_async event_async;
+	struct ev_async stop_async;
 };
 
 int
@@ -73,6 +173,12 @@ c2_register_transport_type(struct c2 *c2, const char *proto,
 	}
 	type->cbs = *cbs;
 
+	char name[64];
+	snprintf(name, sizeof(name), "c2.%s.tx_bytes", proto);
+	type->tx_bytes = metric_counter(name);
+	snprintf(name, sizeof(name), "c2.%s.rx_bytes", proto);
+	type->rx_bytes = metric_counter(name);
+
 	LL_PREPEND(c2->transport_types, type);
 	return 0;
 }
@@ -106,9 +212,12 @@ c2_remove_transports(struct c2 *c2)
 	struct c2_transport *t, *tmp1, *tmp2;
 	CDL_FOREACH_SAFE(c2->transports, t, tmp1, tmp2) {
 		CDL_DELETE(c2->transports, t);
-		if (t->type->cbs.free) {
+		if (t->type->cbs.free && t->ctx) {
 			t->type->cbs.free(t);
 		}
+		buffer_queue_free(t->ingress);
+		buffer_queue_free(t->egress);
+		buffer_queue_free(t->rx);
 		free(t->uri);
 		free(t);
 	}
@@ -130,7 +239,9 @@ int c2_add_transport_uri(struct c2 *c2, const char *uri)
 	t->c2 = c2;
 	t->type = type;
 	t->uri = strdup(uri);
-	if (t->uri == NULL) {
+	t->ingress = buffer_queue_new();
+	t->egress = buffer_queue_new();
+	if (t->uri == NULL || t->ingress == NULL || t->egress == NULL) {
 		goto err;
 	}
 
@@ -143,80 +254,525 @@ int c2_add_transport_uri(struct c2 *c2, const char *uri)
 	}
 	t->dest += 3;
 
-	if (t->type->cbs.init) {
-		t->type->cbs.init(t);
-	}
-
+	/*
+	 * Transports are initialized by c2_start, once the loop they run on
+	 * is known
+	 */
 	CDL_APPEND(c2->transports, t);
 
 	return 0;
 err:
 	if (t) {
+		if (t->ingress) {
+			buffer_queue_free(t->ingress);
+		}
+		if (t->egress) {
+			buffer_queue_free(t->egress);
+		}
 		free(t->uri);
 		free(t);
 	}
 	return -1;
 }
 
-static struct c2_transport *
-choose_next_transport(struct c2 *c2)
+void c2_set_striping(struct c2 *c2, bool enable)
 {
-	if (c2->curr_transport == NULL) {
-		c2->curr_transport = c2->transports;
+	c2->striping = enable;
+}
+
+void c2_transport_sample_rtt(struct c2_transport *t, double rtt)
+{
+	if (t->health.srtt == 0) {
+		t->health.srtt = rtt;
 	} else {
-		c2->curr_transport = c2->curr_transport->next;
+		t->health.srtt += C2_HEALTH_ALPHA * (rtt - t->health.srtt);
 	}
-	return c2->curr_transport;
+}
+
+static void transport_progress(struct c2_transport *t)
+{
+	t->health.last_progress = ev_now(t->c2->loop);
+}
+
+/*
+ * Lower is better. Untried transports get a default RTT, so with nothing
+ * measured yet they are tried in the order they were added.
+ */
+static double transport_score(struct c2_transport *t)
+{
+	double rtt = t->health.srtt > 0 ? t->health.srtt : C2_DEFAULT_RTT;
+	return rtt * (1 + C2_ERROR_WEIGHT * t->health.errors);
+}
+
+/*
+ * Picks the best scoring transport out of backoff, preferring higher
+ * throughput between equals. If all of them are backing off, picks the
+ * one that may be retried soonest.
+ */
+static struct c2_transport *
+choose_transport(struct c2 *c2)
+{
+	ev_tstamp now = ev_now(c2->loop);
+	struct c2_transport *t, *best = NULL, *soonest = NULL;
+	CDL_FOREACH(c2->transports, t) {
+		if (soonest == NULL || t->health.retry_at < soonest->health.retry_at) {
+			soonest = t;
+		}
+		if (t->health.retry_at > now) {
+			continue;
+		}
+		if (best == NULL || transport_score(t) < transport_score(best) ||
+				(transport_score(t) == transport_score(best)
+				 && t->health.tx_rate > best->health.tx_rate)) {
+			best = t;
+		}
+	}
+	return best ? best : soonest;
+}
+
+static void start_transport(struct c2_transport *t)
+{
+	METTLE_PROBE(transport__start, t->uri);
+	t->health.started = ev_now(t->c2->loop);
+	t->health.last_progress = t->health.started;
+	if (t->type->cbs.start) {
+		t->type->cbs.start(t);
+	}
+}
+
+static void stop_transport(struct c2_transport *t)
+{
+	METTLE_PROBE(transport__stop, t->uri);
+	if (t->type->cbs.stop) {
+		t->type->cbs.stop(t);
+	}
+}
+
+/*
+ * Reschedules the transport timer, such as for the next loop iteration
+ * rather than from inside whichever transport callback noticed a failure
+ */
+static void transport_check_in(struct c2 *c2, ev_tstamp after)
+{
+	ev_timer_stop(c2->loop, &c2->transport_timer);
+	ev_timer_set(&c2->transport_timer, after,
+		tunable_get_secs(TUNABLE_C2_CHECK_INTERVAL_MS));
+	ev_timer_start(c2->loop, &c2->transport_timer);
+}
+
+size_t c2_transport_egress_allowance(struct c2_transport *t)
+{
+	size_t avail = token_bucket_avail(&t->c2->tx_shaper);
+	if (avail == 0) {
+		token_bucket_wait(&t->c2->tx_shaper);
+	}
+	return avail;
+}
+
+void c2_transport_egress_sent(struct c2_transport *t, size_t len)
+{
+	t->health.tx_bytes += len;
+	metric_add(t->type->tx_bytes, len);
+	transport_progress(t);
+	token_bucket_consume(&t->c2->tx_shaper, len);
+}
+
+static bool stripe_has_room(struct c2_transport *t)
+{
+	return t->state == c2_transport_state_reachable &&
+		buffer_queue_len(t->egress) < C2_STRIPE_DEPTH;
+}
+
+/*
+ * Moves one whole packet from the common egress queue to a striped transport
+ */
+static bool stripe_move(struct c2_transport *t)
+{
+	size_t len;
+	void *msg = buffer_queue_remove_msg(t->c2->egress, &len);
+	if (msg == NULL) {
+		return false;
+	}
+	if (buffer_queue_add_owned(t->egress, msg, len, free) == -1) {
+		log_error("dropping %zu byte packet, out of memory", len);
+		free(msg);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * A transport that drained its share tops it up itself
+ */
+static void stripe_fill(struct c2_transport *t)
+{
+	while (stripe_has_room(t) && stripe_move(t)) {
+	}
+}
+
+/*
+ * Deals packets round-robin to the reachable transports with room for them
+ */
+static void stripe_deal(struct c2 *c2)
+{
+	struct c2_transport *t = c2->curr_transport ? c2->curr_transport : c2->transports;
+	struct c2_transport *last = t;
+	while (t && buffer_queue_len(c2->egress) > 0) {
+		t = t->next;
+		if (stripe_has_room(t)) {
+			if (!stripe_move(t)) {
+				break;
+			}
+			last = t;
+		} else if (t == last) {
+			break;
+		}
+	}
+	c2->curr_transport = last;
 }
 
 static void transport_tx(struct c2 *c2)
 {
+	if (c2->striping) {
+		stripe_deal(c2);
+		struct c2_transport *t;
+		CDL_FOREACH(c2->transports, t) {
+			if (t->state == c2_transport_state_reachable && t->type->cbs.egress
+					&& c2_transport_egress_allowance(t) > 0) {
+				t->type->cbs.egress(t, c2_transport_egress_queue(t));
+			}
+		}
+		return;
+	}
+
 	struct c2_transport *t = c2->curr_transport;
-	if (t->type->cbs.egress) {
+	if (t->type->cbs.egress && c2_transport_egress_allowance(t) > 0) {
 		t->type->cbs.egress(t, t->c2->egress);
 	}
 }
 
+static void flush_egress(struct c2 *c2)
+{
+	/*
+	 * Striped transports may still hold their share when the common queue
+	 * is empty
+	 */
+	if (buffer_queue_len(c2->egress) || c2->striping) {
+		transport_tx(c2);
+	}
+}
+
+static void on_tx_refill(struct token_bucket *tb, void *arg)
+{
+	struct c2 *c2 = arg;
+	if (c2->curr_transport) {
+		flush_egress(c2);
+	}
+}
+
+void c2_set_egress_rate(struct c2 *c2, uint64_t rate)
+{
+	if (c2->running && c2->threaded) {
+		pthread_mutex_lock(&c2->handoff_mutex);
+		c2->tx_rate = rate;
+		c2->tx_rate_changed = true;
+		pthread_mutex_unlock(&c2->handoff_mutex);
+		ev_async_send(c2->loop, &c2->tx_async);
+		return;
+	}
+	token_bucket_set_rate(&c2->tx_shaper, rate);
+}
+
 ssize_t c2_read(struct c2 *c2, void *buf, size_t buflen)
 {
-	return buffer_queue_remove(c2->ingress, buf, buflen);
+	return buffer_queue_remove(c2_ingress_queue(c2), buf, buflen);
+}
+
+/*
+ * Where the caller's egress goes
+ */
+static struct buffer_queue *caller_egress(struct c2 *c2)
+{
+	if (c2->running && c2->threaded) {
+		pthread_mutex_lock(&c2->handoff_mutex);
+		return c2->tx;
+	}
+	return c2->egress;
+}
+
+static void caller_egress_done(struct c2 *c2)
+{
+	if (c2->running && c2->threaded) {
+		pthread_mutex_unlock(&c2->handoff_mutex);
+	}
+}
+
+void c2_set_resumption(struct c2 *c2, size_t max_bytes)
+{
+	if (!c2->running) {
+		c2->resume_max_bytes = max_bytes;
+	}
+}
+
+static void drop_unacked(struct c2 *c2, struct c2_unacked *u)
+{
+	DL_DELETE(c2->unacked, u);
+	c2->unacked_bytes -= u->len;
+	free(u);
+}
+
+/*
+ * Keeps a copy of the next packet, giving up on the oldest ones once over
+ * the limit. Called with the handoff lock held.
+ */
+static void track_unacked(struct c2 *c2, void *buf, size_t buflen)
+{
+	uint32_t seq = c2->tx_seq++;
+	struct c2_unacked *u = malloc(sizeof(*u) + buflen);
+	if (u == NULL) {
+		log_error("packet %u cannot be resent, out of memory", seq);
+		return;
+	}
+	u->seq = seq;
+	u->len = buflen;
+	memcpy(u->buf, buf, buflen);
+	DL_APPEND(c2->unacked, u);
+	c2->unacked_bytes += buflen;
+
+	while (c2->unacked_bytes > c2->resume_max_bytes && c2->unacked != u) {
+		log_info("packet %u cannot be resent, over %zu unacknowledged bytes",
+			c2->unacked->seq, c2->resume_max_bytes);
+		drop_unacked(c2, c2->unacked);
+	}
+}
+
+void c2_acknowledge(struct c2 *c2, uint32_t seq)
+{
+	if (c2->resume_max_bytes == 0) {
+		return;
+	}
+	caller_egress(c2);
+	while (c2->unacked && (int32_t)(c2->unacked->seq - seq) <= 0) {
+		drop_unacked(c2, c2->unacked);
+	}
+	caller_egress_done(c2);
+}
+
+/*
+ * A lost link may have taken packets with it, partly sent ones included, so
+ * egress restarts from the oldest unacknowledged packet. It and everything
+ * queued after it is in the unacknowledged list, and the peer drops what it
+ * already has by sequence number.
+ */
+static void resend_unacked(struct c2 *c2)
+{
+	if (c2->threaded) {
+		pthread_mutex_lock(&c2->handoff_mutex);
+		buffer_queue_drain_all(c2->tx);
+	}
+	buffer_queue_drain_all(c2->egress);
+	struct c2_unacked *u;
+	DL_FOREACH(c2->unacked, u) {
+		if (buffer_queue_add(c2->egress, u->buf, u->len) == -1) {
+			log_error("could not resend packet %u, out of memory", u->seq);
+			break;
+		}
+	}
+	if (c2->threaded) {
+		pthread_mutex_unlock(&c2->handoff_mutex);
+	}
+	log_info("resending %zu unacknowledged bytes", buffer_queue_len(c2->egress));
+}
+
+ssize_t c2_enqueue(struct c2 *c2, void *buf, size_t buflen)
+{
+	struct buffer_queue *egress = caller_egress(c2);
+	if (c2->resume_max_bytes) {
+		track_unacked(c2, buf, buflen);
+	}
+	int rc = buffer_queue_add_owned(egress, buf, buflen, free);
+	caller_egress_done(c2);
+	if (rc == -1) {
+		free(buf);
+		return 0;
+	}
+	return buflen;
+}
+
+bool c2_can_compress_stream(struct c2 *c2)
+{
+	struct c2_transport *t = c2->curr_transport;
+	return !c2->threaded && !c2->striping && t != NULL
+		&& c2->transport_state == c2_transport_state_reachable
+		&& t->type->cbs.compress != NULL;
+}
+
+int c2_compress_stream(struct c2 *c2, int level, void *buf, size_t buflen)
+{
+	struct c2_transport *t = c2->curr_transport;
+	if (!c2_can_compress_stream(c2)) {
+		return -1;
+	}
+
+	size_t raw_egress = buffer_queue_len(c2->egress) + buflen;
+	if (t->type->cbs.compress(t, level, raw_egress, c2->ingress) == -1) {
+		return -1;
+	}
+
+	/*
+	 * The peer could not tell where the raw bytes end without it
+	 */
+	if (c2_enqueue(c2, buf, buflen) == 0) {
+		log_error("could not queue the last uncompressed packet");
+		c2_transport_unreachable(t);
+		return 0;
+	}
+	c2_flush(c2);
+	return 0;
+}
+
+void c2_flush(struct c2 *c2)
+{
+	if (c2->running && c2->threaded) {
+		ev_async_send(c2->loop, &c2->tx_async);
+	} else {
+		flush_egress(c2);
+	}
 }
 
 ssize_t c2_write(struct c2 *c2, void *buf, size_t buflen)
 {
-	ssize_t len = buffer_queue_add(c2->egress, buf, buflen) == 0 ? buflen : 0;
+	ssize_t len = buffer_queue_add(caller_egress(c2), buf, buflen) == 0 ? buflen : 0;
+	caller_egress_done(c2);
 	if (len) {
-		transport_tx(c2);
+		if (c2->running && c2->threaded) {
+			ev_async_send(c2->loop, &c2->tx_async);
+		} else {
+			transport_tx(c2);
+		}
 	}
 	return len;
 }
 
+/*
+ * Runs on the transport thread, taking what the caller queued
+ */
+static void tx_async_cb(struct ev_loop *loop, struct ev_async *w, int revents)
+{
+	struct c2 *c2 = w->data;
+	bool rate_changed;
+	uint64_t rate;
+
+	pthread_mutex_lock(&c2->handoff_mutex);
+	buffer_queue_move_all(c2->egress, c2->tx);
+	rate_changed = c2->tx_rate_changed;
+	rate = c2->tx_rate;
+	c2->tx_rate_changed = false;
+	pthread_mutex_unlock(&c2->handoff_mutex);
+
+	if (rate_changed) {
+		token_bucket_set_rate(&c2->tx_shaper, rate);
+	}
+	if (c2->curr_transport) {
+		flush_egress(c2);
+	}
+}
+
 struct c2_transport* c2_get_current_transport(struct c2 *c2)
 {
 	return c2->curr_transport;
 }
 
+/*
+ * Striped transports each keep their own ingress stream, so that partial
+ * packets from different links never run together
+ */
+static struct buffer_queue *transport_ingress(struct c2_transport *t)
+{
+	return t->c2->striping ? t->ingress : t->c2->ingress;
+}
+
+static void transport_rx(struct c2_transport *t)
+{
+	struct c2 *c2 = t->c2;
+	transport_progress(t);
+	if (c2->threaded) {
+		ev_async_send(c2->caller_loop, &c2->rx_async);
+	} else if (c2->read_cb) {
+		c2->rx_transport = c2->striping ? t : NULL;
+		c2->read_cb(c2, c2->cb_arg);
+		c2->rx_transport = NULL;
+	}
+}
+
 void c2_transport_ingress_buf(struct c2_transport *t, void *buf, size_t buflen)
 {
-	if (buffer_queue_add(t->c2->ingress, buf, buflen) == 0) {
-		if (t->c2->read_cb) {
-			t->c2->read_cb(t->c2, t->c2->cb_arg);
-		}
+	struct c2 *c2 = t->c2;
+	if (c2->threaded) {
+		pthread_mutex_lock(&c2->handoff_mutex);
+	}
+	int rc = buffer_queue_add(transport_ingress(t), buf, buflen);
+	if (c2->threaded) {
+		pthread_mutex_unlock(&c2->handoff_mutex);
+	}
+	if (rc == 0) {
+		metric_add(t->type->rx_bytes, buflen);
+		transport_rx(t);
 	}
 }
 
 void c2_transport_ingress_queue(struct c2_transport *t, struct buffer_queue *src)
 {
-	if (buffer_queue_move_all(t->c2->ingress, src) > 0) {
-		if (t->c2->read_cb) {
-			t->c2->read_cb(t->c2, t->c2->cb_arg);
+	struct c2 *c2 = t->c2;
+	if (c2->threaded) {
+		pthread_mutex_lock(&c2->handoff_mutex);
+	}
+	ssize_t len = buffer_queue_move_all(transport_ingress(t), src);
+	if (c2->threaded) {
+		pthread_mutex_unlock(&c2->handoff_mutex);
+	}
+	if (len > 0) {
+		metric_add(t->type->rx_bytes, len);
+		transport_rx(t);
+	}
+}
+
+/*
+ * Runs on the caller's loop, reading what the transports received
+ */
+static void caller_rx(struct c2 *c2, struct c2_transport *t,
+		struct buffer_queue *rx, struct buffer_queue *ingress)
+{
+	pthread_mutex_lock(&c2->handoff_mutex);
+	buffer_queue_move_all(rx, ingress);
+	pthread_mutex_unlock(&c2->handoff_mutex);
+
+	if (buffer_queue_len(rx) && c2->read_cb) {
+		c2->rx_transport = t;
+		c2->read_cb(c2, c2->cb_arg);
+		c2->rx_transport = NULL;
+	}
+}
+
+static void rx_async_cb(struct ev_loop *loop, struct ev_async *w, int revents)
+{
+	struct c2 *c2 = w->data;
+	if (c2->striping) {
+		struct c2_transport *t;
+		CDL_FOREACH(c2->transports, t) {
+			caller_rx(c2, t, t->rx, t->ingress);
 		}
+	} else {
+		caller_rx(c2, NULL, c2->rx, c2->ingress);
 	}
 }
 
 struct buffer_queue* c2_ingress_queue(struct c2 *c2)
 {
-	return c2->ingress;
+	if (c2->threaded) {
+		return c2->rx_transport ? c2->rx_transport->rx : c2->rx;
+	}
+	return c2->rx_transport ? c2->rx_transport->ingress : c2->ingress;
 }
 
 struct buffer_queue* c2_egress_queue(struct c2 *c2)
@@ -224,6 +780,13 @@ struct buffer_queue* c2_egress_queue(struct c2 *c2)
 	return c2->egress;
 }
 
+size_t c2_egress_len(struct c2 *c2)
+{
+	size_t len = buffer_queue_len(caller_egress(c2));
+	caller_egress_done(c2);
+	return len;
+}
+
 void c2_set_cbs(struct c2 *c2,
 	c2_data_cb read_cb,
 	c2_data_cb write_cb,
@@ -236,53 +799,227 @@ void c2_set_cbs(struct c2 *c2,
     c2->cb_arg = cb_arg;
 }
 
+/*
+ * Starts every striped transport not yet running and restarts those that
+ * went unreachable
+ */
+static void stripe_transports(struct c2 *c2)
+{
+	struct c2_transport *t;
+	CDL_FOREACH(c2->transports, t) {
+		if (t->state == c2_transport_state_unreachable) {
+			if (t->health.retry_at > ev_now(c2->loop)) {
+				continue;
+			}
+			stop_transport(t);
+		} else if (t->state != c2_transport_state_unknown) {
+			continue;
+		}
+		t->state = c2_transport_state_starting;
+		start_transport(t);
+	}
+	if (c2->curr_transport == NULL) {
+		c2->curr_transport = c2->transports;
+	}
+}
+
+void c2_set_idle_tick(struct c2 *c2, uint32_t tick_ms)
+{
+	__atomic_store_n(&c2->idle_tick_ms, tick_ms, __ATOMIC_RELAXED);
+}
+
+/*
+ * The delay until the first tick boundary at least 'after' from now
+ */
+static double align_to_tick(struct c2 *c2, double after)
+{
+	uint64_t tick_ms = __atomic_load_n(&c2->idle_tick_ms, __ATOMIC_RELAXED);
+	if (tick_ms == 0) {
+		return after;
+	}
+	ev_tstamp now = ev_now(c2->loop);
+	uint64_t due_ms = (now + after) * 1000;
+	due_ms = (due_ms + tick_ms - 1) / tick_ms * tick_ms;
+	return due_ms / 1000.0 - now;
+}
+
+double c2_transport_timer_delay(struct c2_transport *t, double after)
+{
+	return align_to_tick(t->c2, after);
+}
+
 static void
 transport_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
 {
 	struct c2 *c2 = w->data;
 
+	w->repeat = align_to_tick(c2, tunable_get_secs(TUNABLE_C2_CHECK_INTERVAL_MS));
+	ev_timer_again(loop, w);
+	if (c2->striping) {
+		stripe_transports(c2);
+		return;
+	}
+
 	struct c2_transport *t = c2->curr_transport;
 	if (c2->curr_transport == NULL) {
-		t = choose_next_transport(c2);
+		t = c2->curr_transport = choose_transport(c2);
 	}
 
 	if (t == NULL) {
 		return;
 	}
 
-	if (c2->transport_state == c2_transport_state_unknown) {
+	ev_tstamp now = ev_now(loop);
+	t->health.tx_rate += C2_HEALTH_ALPHA * (t->health.tx_bytes - t->health.tx_rate);
+	t->health.tx_bytes = 0;
 
-		if (t->type->cbs.start) {
-			t->type->cbs.start(t);
+	/*
+	 * A link that is up but moving nothing while egress waits has most
+	 * likely lost its path, well before any lower timeout notices
+	 */
+	if (c2->transport_state == c2_transport_state_reachable &&
+			buffer_queue_len(c2->egress) > 0) {
+		double rtt = t->health.srtt > 0 ? t->health.srtt : C2_DEFAULT_RTT;
+		double stall = C2_STALL_RTTS * rtt > C2_STALL_MIN ? C2_STALL_RTTS * rtt : C2_STALL_MIN;
+		if (now - t->health.last_progress > stall) {
+			log_info("%s stalled for %.1f s", t->uri, now - t->health.last_progress);
+			c2_transport_unreachable(t);
 		}
-		c2->transport_state = c2_transport_state_starting;
+	}
 
-	} if (c2->transport_state == c2_transport_state_unreachable) {
-		if (t->type->cbs.stop) {
-			t->type->cbs.stop(t);
-		}
+	if (c2->transport_state == c2_transport_state_unreachable) {
+		stop_transport(t);
+		t = c2->curr_transport = choose_transport(c2);
+		log_info("using %s (rtt %.3f s, errors %.0f%%, %.0f bytes/s)", t->uri,
+			t->health.srtt, t->health.errors * 100, t->health.tx_rate);
+		c2->transport_state = c2_transport_state_unknown;
+	}
 
-		t = choose_next_transport(c2);
+	if (c2->transport_state == c2_transport_state_unknown) {
+		if (t->health.retry_at <= now) {
+			start_transport(t);
+			c2->transport_state = c2_transport_state_starting;
+		} else {
+			transport_check_in(c2, t->health.retry_at - now);
+		}
+	}
+}
 
-		if (t->type->cbs.start) {
-			t->type->cbs.start(t);
+/*
+ * Events from the transport thread are gathered and passed to the caller's
+ * loop, where only the latest watermark crossing matters
+ */
+static void c2_notify(struct c2 *c2, int event)
+{
+	if (!c2->threaded) {
+		if (c2->event_cb) {
+			c2->event_cb(c2, event, c2->cb_arg);
 		}
-		c2->transport_state = c2_transport_state_starting;
+		return;
+	}
+	if (event & (C2_EGRESS_FULL | C2_EGRESS_DRAINED)) {
+		__atomic_store_n(&c2->egress_full, event & C2_EGRESS_FULL, __ATOMIC_RELAXED);
+	}
+	__atomic_or_fetch(&c2->pending_events, event, __ATOMIC_RELAXED);
+	ev_async_send(c2->caller_loop, &c2->event_async);
+}
+
+static void event_async_cb(struct ev_loop *loop, struct ev_async *w, int revents)
+{
+	struct c2 *c2 = w->data;
+	int events = __atomic_exchange_n(&c2->pending_events, 0, __ATOMIC_RELAXED);
+	if (events & (C2_EGRESS_FULL | C2_EGRESS_DRAINED)) {
+		events &= ~(C2_EGRESS_FULL | C2_EGRESS_DRAINED);
+		events |= __atomic_load_n(&c2->egress_full, __ATOMIC_RELAXED) ?
+			C2_EGRESS_FULL : C2_EGRESS_DRAINED;
+	}
+	if (events && c2->event_cb) {
+		c2->event_cb(c2, events, c2->cb_arg);
 	}
 }
 
 void
 c2_transport_reachable(struct c2_transport *t)
 {
-	t->c2->transport_state = c2_transport_state_reachable;
-	if (t->c2->event_cb) {
-		t->c2->event_cb(t->c2, C2_REACHABLE, t->c2->cb_arg);
+	struct c2 *c2 = t->c2;
+	bool was_reachable = t->state == c2_transport_state_reachable;
+
+	/*
+	 * The first sign of life after starting is about one connection setup
+	 */
+	if (t->health.started) {
+		c2_transport_sample_rtt(t, ev_now(c2->loop) - t->health.started);
+		t->health.started = 0;
+	}
+	t->health.errors -= C2_HEALTH_ALPHA * t->health.errors;
+	t->health.failures = 0;
+	t->health.retry_at = 0;
+	transport_progress(t);
+
+	t->state = c2_transport_state_reachable;
+	METTLE_PROBE(transport__reachable, t->uri,
+		(uint64_t)(t->health.srtt * 1000000));
+
+	if (c2->link_lost && t == c2->curr_transport) {
+		c2->link_lost = false;
+		resend_unacked(c2);
+		flush_egress(c2);
+	}
+
+	/*
+	 * Late news from a transport already switched away from says nothing
+	 * about the current one
+	 */
+	if (c2->striping || t == c2->curr_transport) {
+		c2->transport_state = c2_transport_state_reachable;
+	}
+	c2_notify(c2, C2_REACHABLE);
+
+	/*
+	 * A striped link coming up takes its share of the backlog
+	 */
+	if (c2->striping && !was_reachable) {
+		flush_egress(c2);
 	}
 }
 
 void c2_transport_unreachable(struct c2_transport *t)
 {
-	t->c2->transport_state = c2_transport_state_unreachable;
+	struct c2 *c2 = t->c2;
+	if (c2->striping || t == c2->curr_transport) {
+		c2->transport_state = c2_transport_state_unreachable;
+	}
+	if (c2->resume_max_bytes && !c2->striping && t == c2->curr_transport) {
+		c2->link_lost = true;
+	}
+
+	t->health.started = 0;
+	t->health.errors += C2_HEALTH_ALPHA * (1 - t->health.errors);
+	if (t->health.failures < 16) {
+		t->health.failures++;
+	}
+	METTLE_PROBE(transport__unreachable, t->uri, t->health.failures);
+	double backoff = (double)(1 << (t->health.failures - 1));
+	t->health.retry_at = ev_now(c2->loop) +
+		(backoff < C2_MAX_BACKOFF ? backoff : C2_MAX_BACKOFF);
+
+	/*
+	 * Fail over straight away rather than on the next tick
+	 */
+	if (!c2->striping && t == c2->curr_transport) {
+		transport_check_in(c2, 0);
+	}
+
+	/*
+	 * Whatever a striped link had not sent yet goes out on the others;
+	 * the packet sequence numbers let the handler reorder it
+	 */
+	if (c2->striping && t->state != c2_transport_state_unreachable) {
+		t->state = c2_transport_state_unreachable;
+		if (buffer_queue_move_all(c2->egress, t->egress) > 0) {
+			flush_egress(c2);
+		}
+	}
 }
 
 const char * c2_transport_uri(struct c2_transport *t)
@@ -300,6 +1037,15 @@ struct ev_loop * c2_transport_loop(struct c2_transport *t)
 	return t->c2->loop;
 }
 
+struct buffer_queue * c2_transport_egress_queue(struct c2_transport *t)
+{
+	if (t->c2->striping) {
+		stripe_fill(t);
+		return t->egress;
+	}
+	return t->c2->egress;
+}
+
 void * c2_transport_get_ctx(struct c2_transport *t)
 {
 	return t->ctx;
@@ -310,16 +1056,136 @@ void c2_transport_set_ctx(struct c2_transport *t, void *ctx)
 	t->ctx = ctx;
 }
 
+void c2_set_transport_thread(struct c2 *c2, bool enable)
+{
+	if (!c2->running) {
+		c2->threaded = enable;
+	}
+}
+
+/*
+ * Runs on the transport thread, sending what is left before it exits
+ */
+static void stop_async_cb(struct ev_loop *loop, struct ev_async *w, int revents)
+{
+	struct c2 *c2 = w->data;
+	tx_async_cb(loop, &c2->tx_async, revents);
+	ev_break(loop, EVBREAK_ALL);
+}
+
+static void *transport_thread(void *arg)
+{
+	struct c2 *c2 = arg;
+	thread_role_enter(THREAD_ROLE_C2, "c2");
+	ev_run(c2->loop, 0);
+	thread_role_leave();
+	return NULL;
+}
+
+/*
+ * Moves the transports, not yet initialized, onto a loop of their own
+ */
+static int start_transport_loop(struct c2 *c2)
+{
+	struct ev_loop *loop = ev_loop_new(EVFLAG_NOENV | probe_ev_backend());
+	if (loop == NULL) {
+		return -1;
+	}
+
+	c2->rx = buffer_queue_new();
+	c2->tx = buffer_queue_new();
+	if (c2->rx == NULL || c2->tx == NULL) {
+		goto err;
+	}
+	struct c2_transport *t;
+	CDL_FOREACH(c2->transports, t) {
+		if ((t->rx = buffer_queue_new()) == NULL) {
+			goto err;
+		}
+	}
+
+	uint64_t rate = token_bucket_rate(&c2->tx_shaper);
+	token_bucket_stop(&c2->tx_shaper);
+	token_bucket_init(&c2->tx_shaper, loop, on_tx_refill, c2);
+	token_bucket_set_rate(&c2->tx_shaper, rate);
+
+	pthread_mutex_init(&c2->handoff_mutex, NULL);
+	c2->caller_loop = c2->loop;
+	c2->loop = loop;
+
+	ev_async_init(&c2->tx_async, tx_async_cb);
+	c2->tx_async.data = c2;
+	ev_async_start(loop, &c2->tx_async);
+	ev_async_init(&c2->stop_async, stop_async_cb);
+	c2->stop_async.data = c2;
+	ev_async_start(loop, &c2->stop_async);
+	ev_async_init(&c2->rx_async, rx_async_cb);
+	c2->rx_async.data = c2;
+	ev_async_start(c2->caller_loop, &c2->rx_async);
+	ev_async_init(&c2->event_async, event_async_cb);
+	c2->event_async.data = c2;
+	ev_async_start(c2->caller_loop, &c2->event_async);
+	return 0;
+
+err:
+	evloop_loop_free(loop);
+	ev_loop_destroy(loop);
+	c2->threaded = false;
+	return -1;
+}
+
 int c2_start(struct c2 *c2)
 {
+	if (c2->threaded && start_transport_loop(c2) == -1) {
+		log_error("could not start the transport thread, using the main loop");
+	}
+
+	struct c2_transport *t, *tmp1, *tmp2;
+	CDL_FOREACH_SAFE(c2->transports, t, tmp1, tmp2) {
+		if (t->type->cbs.init && t->type->cbs.init(t) == -1) {
+			log_error("could not initialize %s", t->uri);
+			CDL_DELETE(c2->transports, t);
+			buffer_queue_free(t->ingress);
+			buffer_queue_free(t->egress);
+			buffer_queue_free(t->rx);
+			free(t->uri);
+			free(t);
+		}
+	}
+
+	/*
+	 * A transport that connects while initializing can deliver requests,
+	 * and have responses to send, before the first check in
+	 */
+	if (c2->curr_transport == NULL) {
+		c2->curr_transport = choose_transport(c2);
+	}
+
 	ev_timer_start(c2->loop, &c2->transport_timer);
+	c2->running = true;
+
+	if (c2->threaded) {
+		if (pthread_create(&c2->thread, NULL, transport_thread, c2)) {
+			log_error("could not start the transport thread");
+			return -1;
+		}
+		c2->thread_started = true;
+	}
 	return 0;
 }
 
 void c2_free(struct c2 *c2)
 {
 	if (c2) {
+		if (c2->running && c2->threaded && c2->thread_started) {
+			ev_async_send(c2->loop, &c2->stop_async);
+			pthread_join(c2->thread, NULL);
+			ev_async_stop(c2->caller_loop, &c2->rx_async);
+			ev_async_stop(c2->caller_loop, &c2->event_async);
+		}
+
 		ev_timer_stop(c2->loop, &c2->transport_timer);
+		token_bucket_stop(&c2->tx_shaper);
 
 		if (c2->ingress) {
 			buffer_queue_free(c2->ingress);
@@ -333,10 +1199,27 @@ void c2_free(struct c2 *c2)
 
 		c2_remove_transports(c2);
 		c2_remove_transport_types(c2);
+		while (c2->unacked) {
+			drop_unacked(c2, c2->unacked);
+		}
+
+		if (c2->caller_loop) {
+			evloop_loop_free(c2->loop);
+			ev_loop_destroy(c2->loop);
+			buffer_queue_free(c2->rx);
+			buffer_queue_free(c2->tx);
+			pthread_mutex_destroy(&c2->handoff_mutex);
+		}
 		free(c2);
 	}
 }
 
+static void on_egress_watermark(struct buffer_queue *q, bool above, void *arg)
+{
+	struct c2 *c2 = arg;
+	c2_notify(c2, above ? C2_EGRESS_FULL : C2_EGRESS_DRAINED);
+}
+
 struct c2* c2_new(struct ev_loop *loop)
 {
 	struct c2 *c2 = calloc(1, sizeof(*c2));
@@ -350,13 +1233,18 @@ struct c2* c2_new(struct ev_loop *loop)
 		if (c2->egress == NULL) {
 			goto err;
 		}
+		buffer_queue_set_watermarks(c2->egress, C2_EGRESS_LOW_WATERMARK,
+			C2_EGRESS_HIGH_WATERMARK, on_egress_watermark, c2);
 
-		ev_timer_init(&c2->transport_timer, transport_cb, 0, 1.0);
+		ev_timer_init(&c2->transport_timer, transport_cb, 0,
+			tunable_get_secs(TUNABLE_C2_CHECK_INTERVAL_MS));
 		c2->transport_timer.data = c2;
+		token_bucket_init(&c2->tx_shaper, loop, on_tx_refill, c2);
 
 #ifndef LIBEXTENSION
 		c2_register_http_transports(c2);
 		c2_register_tcp_transports(c2);
+		c2_register_udp_transports(c2);
 #endif
 	}
 	return c2;
@@ -7,6 +7,8 @@
 #define _C2_H_
 
 #include <ev.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include "buffer_queue.h"
 
 struct c2;
@@ -21,7 +23,62 @@ int c2_close(struct c2 *c2);
 
 void c2_free(struct c2 *c2);
 
-#define C2_REACHABLE 0x01
+/*
+ * With striping, every transport is started at once instead of failing
+ * over between them. Each packet goes out on one reachable transport,
+ * each taking more as it drains its share, so faster links carry more and
+ * a failed link's unsent packets move to the others. Packets arrive out
+ * of order and the handler needs TLV_TYPE_PACKET_SEQ to restore it.
+ */
+void c2_set_striping(struct c2 *c2, bool enable);
+
+/*
+ * Runs the transports on a thread and loop of their own from c2_start, so
+ * handlers hogging the caller's loop do not hold up the link. The data and
+ * event callbacks still run on the caller's loop, and the other functions
+ * are called from it.
+ */
+void c2_set_transport_thread(struct c2 *c2, bool enable);
+
+/*
+ * With resumption, a copy of each packet passed to c2_enqueue is kept
+ * until the peer acknowledges it, up to 'max_bytes' of them, and whatever
+ * is unacknowledged is sent again once a lost link comes back. Packets are
+ * numbered from 0 in the order they are enqueued, which is how the TLV
+ * dispatcher numbers them with TLV_TYPE_PACKET_SEQ. Not used with striping,
+ * where the peer puts packets back in order itself.
+ */
+void c2_set_resumption(struct c2 *c2, size_t max_bytes);
+
+/*
+ * While idle, the transport timer and transport polls are put back to the
+ * next multiple of 'tick_ms' after they are due, so that the wakeups left
+ * happen together. 0 leaves idle. May be called from the caller's thread.
+ */
+void c2_set_idle_tick(struct c2 *c2, uint32_t tick_ms);
+
+/*
+ * The peer received every packet up to and including 'seq'
+ */
+void c2_acknowledge(struct c2 *c2, uint32_t seq);
+
+#ifdef METTLE_LOW_MEMORY
+#define C2_RESUME_MAX_BYTES (512 * 1024)
+#else
+#define C2_RESUME_MAX_BYTES (4 * 1024 * 1024)
+#endif
+
+#define C2_REACHABLE      0x01
+#define C2_EGRESS_FULL    0x02  // egress queue passed its high watermark
+#define C2_EGRESS_DRAINED 0x04  // egress queue is back under its low watermark
+
+#ifdef METTLE_LOW_MEMORY
+#define C2_EGRESS_HIGH_WATERMARK (512 * 1024)
+#define C2_EGRESS_LOW_WATERMARK  (128 * 1024)
+#else
+#define C2_EGRESS_HIGH_WATERMARK (4 * 1024 * 1024)
+#define C2_EGRESS_LOW_WATERMARK  (1024 * 1024)
+#endif
 
 typedef void (*c2_data_cb)(struct c2 *c2, void *arg);
 typedef void (*c2_event_cb)(struct c2 *c2, int event, void *arg);
@@ -36,10 +93,50 @@ ssize_t c2_read(struct c2 *c2, void *buf, size_t buflen);
 
 ssize_t c2_write(struct c2 *c2, void *buf, size_t buflen);
 
+/*
+ * Queue data for egress without handing it to the transport yet, so that
+ * several writes can go out together on the next c2_flush. Takes ownership
+ * of 'buf', which must have come from malloc.
+ */
+ssize_t c2_enqueue(struct c2 *c2, void *buf, size_t buflen);
+
+void c2_flush(struct c2 *c2);
+
+/*
+ * Sends 'buf', then compresses the current connection both ways, when its
+ * transport supports that. Packets queued before 'buf' are not compressed,
+ * and neither was anything read before the packet being handled, so this
+ * is called from the read callback. Takes ownership of 'buf' on success.
+ *
+ * Not supported with striping or a transport thread.
+ */
+int c2_compress_stream(struct c2 *c2, int level, void *buf, size_t buflen);
+
+/*
+ * Whether c2_compress_stream could be tried, so a caller can check before
+ * encoding the packet it would send
+ */
+bool c2_can_compress_stream(struct c2 *c2);
+
+/*
+ * Shape C2 egress to at most 'rate' bytes per second, 0 for unlimited
+ */
+void c2_set_egress_rate(struct c2 *c2, uint64_t rate);
+
+/*
+ * When striping, each transport has its own ingress stream and this is the
+ * one being read from during the read callback
+ */
 struct buffer_queue* c2_ingress_queue(struct c2 *c2);
 
 struct buffer_queue* c2_egress_queue(struct c2 *c2);
 
+/*
+ * Bytes queued from the caller's side: with a transport thread, those it
+ * has yet to take, as the thread drains the egress queue itself
+ */
+size_t c2_egress_len(struct c2 *c2);
+
 /*
  * Transport API
  */
@@ -51,6 +148,14 @@ struct c2_transport_cbs {
 	void (*egress)(struct c2_transport *t, struct buffer_queue *egress);
 	void (*stop)(struct c2_transport *t);
 	void (*free)(struct c2_transport *t);
+
+	/*
+	 * Optional, compresses the connection from here on: the first
+	 * 'raw_egress' bytes of the egress queue still go out as they are,
+	 * and 'ingress' holds what was received after the request for it.
+	 */
+	int (*compress)(struct c2_transport *t, int level, size_t raw_egress,
+		struct buffer_queue *ingress);
 };
 
 int c2_register_transport_type(struct c2 *c2, const char *proto,
@@ -62,11 +167,39 @@ const char * c2_transport_uri(struct c2_transport *t);
 const char * c2_transport_dest(struct c2_transport *t);
 struct ev_loop * c2_transport_loop(struct c2_transport *loop);
 
+/*
+ * Transports that send at their own pace can leave data here rather than
+ * taking it all from the egress callback, so that it counts against the
+ * egress watermarks. When striping this is the transport's own share,
+ * topped up from the common queue on each call.
+ */
+struct buffer_queue * c2_transport_egress_queue(struct c2_transport *t);
+
+/*
+ * Transports take at most the allowance from the egress queue at a time,
+ * reporting what they sent. A transport with an egress callback has it
+ * called again once an exhausted allowance refills.
+ */
+size_t c2_transport_egress_allowance(struct c2_transport *t);
+void c2_transport_egress_sent(struct c2_transport *t, size_t len);
+
 void * c2_transport_get_ctx(struct c2_transport *t);
 void c2_transport_set_ctx(struct c2_transport *t, void *ctx);
 
+/*
+ * Transports report each success and failure. Transports able to time a
+ * round trip more finely than connection setup can also report that, to
+ * help choose between them.
+ */
 void c2_transport_reachable(struct c2_transport *t);
 void c2_transport_unreachable(struct c2_transport *t);
+void c2_transport_sample_rtt(struct c2_transport *t, double rtt);
+
+/*
+ * What a transport timer due in 'after' seconds should be set for, later
+ * when idle to line it up with the others
+ */
+double c2_transport_timer_delay(struct c2_transport *t, double after);
 
 void c2_transport_ingress_buf(struct c2_transport *t, void *buf, size_t buflen);
 void c2_transport_ingress_queue(struct c2_transport *t, struct buffer_queue *src);
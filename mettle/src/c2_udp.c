@@ -0,0 +1,791 @@
+
+/**
+ * @brief c2_udp.c Reliable UDP transport
+ * @file c2_udp.c
+ */
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "c2.h"
+#include "log.h"
+#include "network_client.h"
+#include "token_bucket.h"
+#include "tunables.h"
+#include "util.h"
+#include "utlist.h"
+
+/*
+ * An ARQ stream over datagrams, along the lines of KCP. The byte stream is
+ * cut into numbered segments, each acknowledged on its own as well as by a
+ * cumulative 'una' (the next segment the receiver is missing) on every
+ * segment going back, so one loss holds up neither the segments after it
+ * nor their acknowledgements. A segment is resent as soon as later ones
+ * have been acknowledged past it twice, without waiting for its timeout,
+ * and timeouts grow by half instead of doubling, so a lossy link with a
+ * long round trip keeps moving rather than sitting out seconds of backoff.
+ * New segments are paced out over the round trip instead of in bursts.
+ *
+ * Each datagram holds one or more segments, each with a 24 byte header in
+ * network byte order:
+ *
+ *   conv (4)  cmd (1)  reserved (1)  wnd (2)  ts (4)  sn (4)  una (4)  len (4)
+ *
+ * 'conv' is picked afresh for each connection and names it; 'wnd' is how
+ * many segments the sender can still take out of order; 'ts' is when the
+ * segment was sent in ms, echoed back in its ACK to time the round trip.
+ * The transport opens by asking the peer for its window until it answers,
+ * which is when it is reachable.
+ */
+#define UDP_CMD_PUSH 81  // data
+#define UDP_CMD_ACK  82  // acknowledges 'sn' sent at 'ts'
+#define UDP_CMD_WASK 83  // asks for the window, answered with WINS
+#define UDP_CMD_WINS 84  // tells the window
+
+#define UDP_MTU      1400
+#define UDP_OVERHEAD 24
+#define UDP_MSS      (UDP_MTU - UDP_OVERHEAD)
+
+/*
+ * Segments in flight and held out of order, each way
+ */
+#ifdef METTLE_LOW_MEMORY
+#define UDP_WND 64
+#else
+#define UDP_WND 512
+#endif
+
+#define UDP_RTO_MIN 100     // ms
+#define UDP_RTO_DEF 500
+#define UDP_RTO_MAX 60000
+
+#define UDP_FAST_RESEND 2   // later acks that resend a segment early
+#define UDP_FAST_LIMIT  5   // transmissions after which only timeouts resend
+#define UDP_DEAD_LINK   20  // transmissions of one segment before giving up
+#define UDP_CWND_MIN    4
+
+/*
+ * Idle connections say something every so often to keep NAT mappings open,
+ * and are given up on once the peer has said nothing for much longer
+ */
+#define UDP_KEEPALIVE    10.0  // s
+#define UDP_PEER_TIMEOUT 60000 // ms
+
+#define UDP_PACING_GAIN 1.25
+
+struct udp_seg {
+	struct udp_seg *prev, *next;
+	uint32_t sn;
+	uint32_t resend_ts;
+	uint32_t rto;
+	uint32_t fastack;
+	uint32_t xmit;
+	size_t len;
+	unsigned char data[];
+};
+
+struct udp_ack {
+	uint32_t sn;
+	uint32_t ts;
+};
+
+struct udp_ctx {
+	struct c2_transport *t;
+	struct network_client *nc;
+	struct ev_timer timer;
+	struct token_bucket pacer;
+
+	uint32_t conv;
+	bool connected;
+	bool established;
+	bool tell_wnd;
+	uint32_t last_recv;
+	uint32_t last_send;
+	uint32_t probe_ts;
+	uint32_t probes;
+
+	/*
+	 * Sending
+	 */
+	struct udp_seg *snd_buf;  // unacknowledged, in order of sn
+	uint32_t snd_una;
+	uint32_t snd_nxt;
+	uint32_t rmt_wnd;
+	uint32_t cwnd;
+	uint32_t cwnd_acked;
+	uint32_t ssthresh;
+
+	/*
+	 * Receiving
+	 */
+	struct udp_seg *rcv_buf;  // out of order, in order of sn
+	uint32_t rcv_count;
+	uint32_t rcv_nxt;
+	struct buffer_queue *rx_stream;
+	struct udp_ack acks[UDP_WND];
+	int ack_count;
+
+	uint32_t srtt;
+	uint32_t rttvar;
+	uint32_t rto;
+
+	/*
+	 * Datagrams being filled for one write
+	 */
+	unsigned char dgrams[BUFFEREV_UDP_BATCH_MAX][UDP_MTU];
+	struct iovec iov[BUFFEREV_UDP_BATCH_MAX];
+	int dgram_count;
+};
+
+static void udp_flush(struct udp_ctx *ctx);
+
+void udp_transport_egress(struct c2_transport *t, struct buffer_queue *egress);
+
+static uint32_t now_ms(struct udp_ctx *ctx)
+{
+	return (uint32_t)(ev_now(c2_transport_loop(ctx->t)) * 1000);
+}
+
+/*
+ * Sequence numbers and timestamps wrap, so they are only ever compared by
+ * their distance
+ */
+static int32_t diff(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b);
+}
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return ntohl(v);
+}
+
+static void free_segs(struct udp_seg **list)
+{
+	struct udp_seg *seg, *tmp;
+	DL_FOREACH_SAFE(*list, seg, tmp) {
+		DL_DELETE(*list, seg);
+		free(seg);
+	}
+}
+
+/*
+ * Back to a fresh connection, dropping anything unacknowledged; with
+ * resumption the c2 sends that again once a link is back
+ */
+static void reset(struct udp_ctx *ctx)
+{
+	free_segs(&ctx->snd_buf);
+	free_segs(&ctx->rcv_buf);
+	buffer_queue_drain_all(ctx->rx_stream);
+	ctx->established = false;
+	ctx->tell_wnd = false;
+	ctx->probes = 0;
+	ctx->snd_una = ctx->snd_nxt = 0;
+	ctx->rcv_nxt = 0;
+	ctx->rcv_count = 0;
+	ctx->ack_count = 0;
+	ctx->rmt_wnd = UDP_WND;
+	ctx->cwnd = UDP_CWND_MIN;
+	ctx->cwnd_acked = 0;
+	ctx->ssthresh = UDP_WND;
+	ctx->srtt = ctx->rttvar = 0;
+	ctx->rto = UDP_RTO_DEF;
+	ctx->dgram_count = 0;
+	token_bucket_set_rate(&ctx->pacer, 0);
+}
+
+static uint16_t wnd_unused(struct udp_ctx *ctx)
+{
+	return ctx->rcv_count < UDP_WND ? UDP_WND - ctx->rcv_count : 0;
+}
+
+static void send_dgrams(struct udp_ctx *ctx)
+{
+	if (ctx->dgram_count == 0) {
+		return;
+	}
+	size_t len = 0;
+	for (int i = 0; i < ctx->dgram_count; i++) {
+		len += ctx->iov[i].iov_len;
+	}
+	network_client_write_msgs(ctx->nc, ctx->iov, ctx->dgram_count);
+	token_bucket_consume(&ctx->pacer, len);
+	ctx->last_send = now_ms(ctx);
+	ctx->dgram_count = 0;
+}
+
+/*
+ * Adds a segment to the datagram being filled, starting another once it
+ * would not fit
+ */
+static void out_seg(struct udp_ctx *ctx, uint8_t cmd, uint32_t ts, uint32_t sn,
+	const void *data, size_t len)
+{
+	struct iovec *iov = &ctx->iov[ctx->dgram_count];
+	if (ctx->dgram_count == 0 || iov[-1].iov_len + UDP_OVERHEAD + len > UDP_MTU) {
+		if (ctx->dgram_count == COUNT_OF(ctx->dgrams)) {
+			send_dgrams(ctx);
+			iov = ctx->iov;
+		}
+		iov->iov_base = ctx->dgrams[ctx->dgram_count++];
+		iov->iov_len = 0;
+	} else {
+		iov--;
+	}
+
+	unsigned char *p = (unsigned char *)iov->iov_base + iov->iov_len;
+	put_u32(p, ctx->conv);
+	p[4] = cmd;
+	p[5] = 0;
+	uint16_t wnd = htons(wnd_unused(ctx));
+	memcpy(p + 6, &wnd, sizeof(wnd));
+	put_u32(p + 8, ts);
+	put_u32(p + 12, sn);
+	put_u32(p + 16, ctx->rcv_nxt);
+	put_u32(p + 20, len);
+	if (len) {
+		memcpy(p + UDP_OVERHEAD, data, len);
+	}
+	iov->iov_len += UDP_OVERHEAD + len;
+}
+
+static void flush_acks(struct udp_ctx *ctx)
+{
+	for (int i = 0; i < ctx->ack_count; i++) {
+		out_seg(ctx, UDP_CMD_ACK, ctx->acks[i].ts, ctx->acks[i].sn, NULL, 0);
+	}
+	ctx->ack_count = 0;
+}
+
+static void ack_push(struct udp_ctx *ctx, uint32_t sn, uint32_t ts)
+{
+	if (ctx->ack_count == COUNT_OF(ctx->acks)) {
+		flush_acks(ctx);
+	}
+	ctx->acks[ctx->ack_count].sn = sn;
+	ctx->acks[ctx->ack_count].ts = ts;
+	ctx->ack_count++;
+}
+
+/*
+ * RFC 6298, in ms
+ */
+static void update_rtt(struct udp_ctx *ctx, uint32_t rtt)
+{
+	if (ctx->srtt == 0) {
+		ctx->srtt = rtt ? rtt : 1;
+		ctx->rttvar = rtt / 2;
+	} else {
+		uint32_t delta = rtt > ctx->srtt ? rtt - ctx->srtt : ctx->srtt - rtt;
+		ctx->rttvar = (3 * ctx->rttvar + delta) / 4;
+		ctx->srtt = (7 * ctx->srtt + rtt) / 8;
+		if (ctx->srtt == 0) {
+			ctx->srtt = 1;
+		}
+	}
+	uint32_t rto = ctx->srtt + TYPESAFE_MAX((uint32_t)tunable_get(TUNABLE_UDP_INTERVAL_MS),
+		4 * ctx->rttvar);
+	ctx->rto = rto < UDP_RTO_MIN ? UDP_RTO_MIN : rto > UDP_RTO_MAX ? UDP_RTO_MAX : rto;
+	c2_transport_sample_rtt(ctx->t, rtt / 1000.0);
+}
+
+/*
+ * Paces a window out over about a round trip, with bursts of no more than
+ * a couple of flushes' worth. The rate is only replaced once it moves by a
+ * quarter, since replacing it refills the bucket.
+ */
+static void update_pacing(struct udp_ctx *ctx)
+{
+	if (ctx->srtt == 0) {
+		return;
+	}
+	uint64_t rate = UDP_PACING_GAIN * ctx->cwnd * UDP_MTU * 1000 / ctx->srtt;
+	uint64_t curr = token_bucket_rate(&ctx->pacer);
+	if (curr == 0 || rate > curr + curr / 4 || rate < curr - curr / 4) {
+		token_bucket_set_rate(&ctx->pacer, rate);
+		token_bucket_set_burst(&ctx->pacer,
+			rate * 2 * tunable_get(TUNABLE_UDP_INTERVAL_MS) / 1000);
+	}
+}
+
+/*
+ * Drops what the peer acknowledged as received
+ */
+static void parse_una(struct udp_ctx *ctx, uint32_t una)
+{
+	struct udp_seg *seg, *tmp;
+	DL_FOREACH_SAFE(ctx->snd_buf, seg, tmp) {
+		if (diff(una, seg->sn) <= 0) {
+			break;
+		}
+		DL_DELETE(ctx->snd_buf, seg);
+		free(seg);
+	}
+	if (diff(una, ctx->snd_una) > 0) {
+		ctx->snd_una = una;
+	}
+}
+
+static void parse_ack(struct udp_ctx *ctx, uint32_t sn)
+{
+	if (diff(sn, ctx->snd_una) < 0 || diff(sn, ctx->snd_nxt) >= 0) {
+		return;
+	}
+	struct udp_seg *seg;
+	DL_FOREACH(ctx->snd_buf, seg) {
+		if (seg->sn == sn) {
+			DL_DELETE(ctx->snd_buf, seg);
+			free(seg);
+			break;
+		}
+		if (diff(seg->sn, sn) > 0) {
+			break;
+		}
+	}
+	ctx->snd_una = ctx->snd_buf ? ctx->snd_buf->sn : ctx->snd_nxt;
+}
+
+/*
+ * Counts how many times each segment was passed over by later acks
+ */
+static void parse_fastack(struct udp_ctx *ctx, uint32_t max_ack)
+{
+	struct udp_seg *seg;
+	DL_FOREACH(ctx->snd_buf, seg) {
+		if (diff(seg->sn, max_ack) >= 0) {
+			break;
+		}
+		seg->fastack++;
+	}
+}
+
+static int parse_data(struct udp_ctx *ctx, uint32_t sn, const void *data, size_t len)
+{
+	if (sn == ctx->rcv_nxt) {
+		if (buffer_queue_add(ctx->rx_stream, (void *)data, len) == -1) {
+			return -1;
+		}
+		ctx->rcv_nxt++;
+		struct udp_seg *seg;
+		while ((seg = ctx->rcv_buf) && seg->sn == ctx->rcv_nxt) {
+			if (buffer_queue_add(ctx->rx_stream, seg->data, seg->len) == -1) {
+				return -1;
+			}
+			DL_DELETE(ctx->rcv_buf, seg);
+			free(seg);
+			ctx->rcv_count--;
+			ctx->rcv_nxt++;
+		}
+		return 0;
+	}
+
+	struct udp_seg *seg;
+	DL_FOREACH(ctx->rcv_buf, seg) {
+		if (seg->sn == sn) {
+			return 0;
+		}
+		if (diff(seg->sn, sn) > 0) {
+			break;
+		}
+	}
+
+	struct udp_seg *n = malloc(sizeof(*n) + len);
+	if (n == NULL) {
+		return 0;
+	}
+	n->sn = sn;
+	n->len = len;
+	memcpy(n->data, data, len);
+	if (seg) {
+		DL_PREPEND_ELEM(ctx->rcv_buf, seg, n);
+	} else {
+		DL_APPEND(ctx->rcv_buf, n);
+	}
+	ctx->rcv_count++;
+	return 0;
+}
+
+/*
+ * Slow start, then a segment more each window acknowledged
+ */
+static void grow_cwnd(struct udp_ctx *ctx, uint32_t acked)
+{
+	if (ctx->cwnd < ctx->ssthresh) {
+		ctx->cwnd += acked;
+	} else {
+		ctx->cwnd_acked += acked;
+		if (ctx->cwnd_acked >= ctx->cwnd) {
+			ctx->cwnd_acked -= ctx->cwnd;
+			ctx->cwnd++;
+		}
+	}
+	if (ctx->cwnd > UDP_WND) {
+		ctx->cwnd = UDP_WND;
+	}
+}
+
+/*
+ * Returns -1 for a datagram that is not ours
+ */
+static int udp_input(struct udp_ctx *ctx, const unsigned char *p, size_t len)
+{
+	uint32_t now = now_ms(ctx);
+	uint32_t prev_una = ctx->snd_una;
+	uint32_t max_ack = 0;
+	bool acked = false;
+
+	while (len >= UDP_OVERHEAD) {
+		uint32_t conv = get_u32(p);
+		uint8_t cmd = p[4];
+		uint16_t wnd;
+		memcpy(&wnd, p + 6, sizeof(wnd));
+		uint32_t ts = get_u32(p + 8);
+		uint32_t sn = get_u32(p + 12);
+		uint32_t una = get_u32(p + 16);
+		uint32_t seg_len = get_u32(p + 20);
+		if (conv != ctx->conv || seg_len > len - UDP_OVERHEAD
+				|| cmd < UDP_CMD_PUSH || cmd > UDP_CMD_WINS) {
+			return -1;
+		}
+		ctx->rmt_wnd = ntohs(wnd);
+		parse_una(ctx, una);
+
+		switch (cmd) {
+		case UDP_CMD_ACK:
+			if (diff(now, ts) >= 0) {
+				update_rtt(ctx, now - ts);
+			}
+			parse_ack(ctx, sn);
+			if (!acked || diff(sn, max_ack) > 0) {
+				max_ack = sn;
+				acked = true;
+			}
+			break;
+		case UDP_CMD_PUSH:
+			if (diff(sn, ctx->rcv_nxt + UDP_WND) < 0) {
+				ack_push(ctx, sn, ts);
+				if (diff(sn, ctx->rcv_nxt) >= 0 &&
+						parse_data(ctx, sn, p + UDP_OVERHEAD, seg_len) == -1) {
+					log_error("dropping udp segment, out of memory");
+				}
+			}
+			break;
+		case UDP_CMD_WASK:
+			ctx->tell_wnd = true;
+			break;
+		case UDP_CMD_WINS:
+			break;
+		}
+		p += UDP_OVERHEAD + seg_len;
+		len -= UDP_OVERHEAD + seg_len;
+	}
+
+	ctx->last_recv = now;
+	if (acked) {
+		parse_fastack(ctx, max_ack);
+	}
+	if (diff(ctx->snd_una, prev_una) > 0) {
+		grow_cwnd(ctx, ctx->snd_una - prev_una);
+		update_pacing(ctx);
+	}
+	return 0;
+}
+
+/*
+ * Sends what is due: acks and window replies, then segments new, timed out
+ * or passed over by later acks, as far as the window and pacing allow
+ */
+static void udp_flush(struct udp_ctx *ctx)
+{
+	if (!ctx->connected) {
+		return;
+	}
+	uint32_t now = now_ms(ctx);
+
+	flush_acks(ctx);
+
+	if (!ctx->established || (ctx->rmt_wnd == 0 && ctx->snd_buf)) {
+		if (diff(now, ctx->probe_ts) >= 0) {
+			out_seg(ctx, UDP_CMD_WASK, now, 0, NULL, 0);
+			ctx->probe_ts = now + ctx->rto;
+			ctx->probes++;
+		}
+	} else {
+		ctx->probes = 0;
+	}
+	if (ctx->tell_wnd) {
+		out_seg(ctx, UDP_CMD_WINS, now, 0, NULL, 0);
+		ctx->tell_wnd = false;
+	}
+
+	uint32_t cwnd = TYPESAFE_MIN(ctx->cwnd, ctx->rmt_wnd);
+	bool lost = false, fast = false, dead = ctx->probes > UDP_DEAD_LINK;
+	struct udp_seg *seg;
+	DL_FOREACH(ctx->snd_buf, seg) {
+		bool send = false;
+		if (seg->xmit == 0) {
+			if (diff(seg->sn, ctx->snd_una) >= (int32_t)cwnd) {
+				break;
+			}
+			seg->rto = ctx->rto;
+			send = true;
+		} else if (diff(now, seg->resend_ts) >= 0) {
+			seg->rto += TYPESAFE_MAX(seg->rto, ctx->rto) / 2;
+			if (seg->rto > UDP_RTO_MAX) {
+				seg->rto = UDP_RTO_MAX;
+			}
+			send = lost = true;
+		} else if (seg->fastack >= UDP_FAST_RESEND && seg->xmit <= UDP_FAST_LIMIT) {
+			send = fast = true;
+		}
+		if (!send) {
+			continue;
+		}
+		if (token_bucket_avail(&ctx->pacer) == 0) {
+			token_bucket_wait(&ctx->pacer);
+			break;
+		}
+		out_seg(ctx, UDP_CMD_PUSH, now, seg->sn, seg->data, seg->len);
+		seg->xmit++;
+		seg->fastack = 0;
+		seg->resend_ts = now + seg->rto;
+		if (seg->xmit >= UDP_DEAD_LINK) {
+			dead = true;
+		}
+	}
+	send_dgrams(ctx);
+
+	/*
+	 * Loss one segment at a time costs half the window, a timeout all but
+	 * the minimum
+	 */
+	if (fast) {
+		ctx->ssthresh = TYPESAFE_MAX((ctx->snd_nxt - ctx->snd_una) / 2, (uint32_t)UDP_CWND_MIN);
+		ctx->cwnd = ctx->ssthresh + UDP_FAST_RESEND;
+		ctx->cwnd_acked = 0;
+	}
+	if (lost) {
+		ctx->ssthresh = TYPESAFE_MAX(ctx->cwnd / 2, (uint32_t)UDP_CWND_MIN);
+		ctx->cwnd = UDP_CWND_MIN;
+		ctx->cwnd_acked = 0;
+	}
+	if (fast || lost) {
+		update_pacing(ctx);
+	}
+
+	if (dead || (ctx->established && diff(now, ctx->last_recv) > UDP_PEER_TIMEOUT)) {
+		log_info("%s: peer stopped answering", c2_transport_uri(ctx->t));
+		ctx->connected = false;
+		c2_transport_unreachable(ctx->t);
+	}
+}
+
+static bool busy(struct udp_ctx *ctx)
+{
+	return !ctx->established || ctx->snd_buf || ctx->ack_count;
+}
+
+/*
+ * Ticks every interval while anything is outstanding, otherwise only for
+ * keepalives, lined up with the other idle timers
+ */
+static void schedule(struct udp_ctx *ctx)
+{
+	struct ev_loop *loop = c2_transport_loop(ctx->t);
+	double interval = tunable_get_secs(TUNABLE_UDP_INTERVAL_MS);
+	if (!ctx->connected) {
+		ev_timer_stop(loop, &ctx->timer);
+	} else if (busy(ctx)) {
+		if (!ev_is_active(&ctx->timer) || ctx->timer.repeat != interval) {
+			ctx->timer.repeat = interval;
+			ev_timer_again(loop, &ctx->timer);
+		}
+	} else if (!ev_is_active(&ctx->timer) || ctx->timer.repeat == interval) {
+		ctx->timer.repeat = c2_transport_timer_delay(ctx->t, UDP_KEEPALIVE);
+		ev_timer_again(loop, &ctx->timer);
+	}
+}
+
+static void udp_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+	struct udp_ctx *ctx = w->data;
+	if (!busy(ctx) && diff(now_ms(ctx), ctx->last_send) >= UDP_KEEPALIVE * 1000) {
+		out_seg(ctx, UDP_CMD_WASK, now_ms(ctx), 0, NULL, 0);
+	}
+	udp_flush(ctx);
+	schedule(ctx);
+}
+
+static void udp_pacer_cb(struct token_bucket *tb, void *arg)
+{
+	struct udp_ctx *ctx = arg;
+	udp_flush(ctx);
+}
+
+static void udp_read_cb(struct bufferev *be, void *arg)
+{
+	struct c2_transport *t = arg;
+	struct udp_ctx *ctx = c2_transport_get_ctx(t);
+	struct bufferev_udp_msg *msg;
+	size_t len;
+
+	while ((msg = bufferev_read_msg(be, &len))) {
+		if (ctx->connected && udp_input(ctx, (unsigned char *)msg->buf, msg->buf_len) == 0
+				&& !ctx->established) {
+			ctx->established = true;
+			log_info("%s: peer answered", c2_transport_uri(t));
+			c2_transport_reachable(t);
+		}
+		free(msg);
+	}
+	if (!ctx->connected) {
+		return;
+	}
+
+	/*
+	 * Answer everything read at once, then hand over what is in order,
+	 * since handling it may well send more
+	 */
+	udp_flush(ctx);
+	schedule(ctx);
+	if (buffer_queue_len(ctx->rx_stream)) {
+		c2_transport_ingress_queue(t, ctx->rx_stream);
+	}
+	if (ctx->established) {
+		udp_transport_egress(t, c2_transport_egress_queue(t));
+	}
+}
+
+static void udp_event_cb(struct bufferev *be, int event, void *arg)
+{
+	struct c2_transport *t = arg;
+	struct udp_ctx *ctx = c2_transport_get_ctx(t);
+
+	reset(ctx);
+	if (event & BEV_CONNECTED) {
+		ctx->conv = (uint32_t)(ev_time() * 1000000) ^ (uint32_t)(uintptr_t)ctx;
+		ctx->connected = true;
+		ctx->probe_ts = ctx->last_recv = ctx->last_send = now_ms(ctx);
+		udp_flush(ctx);
+		schedule(ctx);
+	} else {
+		ctx->connected = false;
+		schedule(ctx);
+		c2_transport_unreachable(t);
+	}
+}
+
+int udp_transport_init(struct c2_transport *t)
+{
+	struct udp_ctx *ctx = calloc(1, sizeof *ctx);
+	if (ctx == NULL) {
+		return -1;
+	}
+	ctx->t = t;
+
+	ctx->rx_stream = buffer_queue_new();
+	ctx->nc = network_client_new(c2_transport_loop(t));
+	if (ctx->rx_stream == NULL || ctx->nc == NULL) {
+		buffer_queue_free(ctx->rx_stream);
+		network_client_free(ctx->nc);
+		free(ctx);
+		return -1;
+	}
+
+	if (network_client_add_uri(ctx->nc, c2_transport_uri(t)) == -1) {
+		buffer_queue_free(ctx->rx_stream);
+		network_client_free(ctx->nc);
+		free(ctx);
+		return -1;
+	}
+	network_client_set_retries(ctx->nc, 0);
+	network_client_set_cbs(ctx->nc, udp_read_cb, NULL, udp_event_cb, t);
+
+	ev_init(&ctx->timer, udp_timer_cb);
+	ctx->timer.data = ctx;
+	token_bucket_init(&ctx->pacer, c2_transport_loop(t), udp_pacer_cb, ctx);
+	reset(ctx);
+	c2_transport_set_ctx(t, ctx);
+	return 0;
+}
+
+void udp_transport_start(struct c2_transport *t)
+{
+	struct udp_ctx *ctx = c2_transport_get_ctx(t);
+	network_client_start(ctx->nc);
+}
+
+/*
+ * Takes as much of the egress queue as the send window has room for, the
+ * rest waiting there for acks to open it
+ */
+void udp_transport_egress(struct c2_transport *t, struct buffer_queue *egress)
+{
+	struct udp_ctx *ctx = c2_transport_get_ctx(t);
+	if (!ctx->established) {
+		return;
+	}
+
+	size_t max;
+	while (ctx->snd_nxt - ctx->snd_una < UDP_WND &&
+			(max = c2_transport_egress_allowance(t)) > 0 &&
+			buffer_queue_len(egress) > 0) {
+		size_t len = TYPESAFE_MIN(TYPESAFE_MIN(buffer_queue_len(egress), max),
+			(size_t)UDP_MSS);
+		struct udp_seg *seg = calloc(1, sizeof(*seg) + len);
+		if (seg == NULL) {
+			break;
+		}
+		seg->len = buffer_queue_remove(egress, seg->data, len);
+		seg->sn = ctx->snd_nxt++;
+		DL_APPEND(ctx->snd_buf, seg);
+		c2_transport_egress_sent(t, seg->len);
+	}
+	udp_flush(ctx);
+	schedule(ctx);
+}
+
+void udp_transport_stop(struct c2_transport *t)
+{
+	struct udp_ctx *ctx = c2_transport_get_ctx(t);
+	network_client_stop(ctx->nc);
+	ctx->connected = false;
+	reset(ctx);
+	schedule(ctx);
+}
+
+void udp_transport_free(struct c2_transport *t)
+{
+	struct udp_ctx *ctx = c2_transport_get_ctx(t);
+	network_client_free(ctx->nc);
+	ev_timer_stop(c2_transport_loop(t), &ctx->timer);
+	token_bucket_stop(&ctx->pacer);
+	free_segs(&ctx->snd_buf);
+	free_segs(&ctx->rcv_buf);
+	buffer_queue_free(ctx->rx_stream);
+	free(ctx);
+	c2_transport_set_ctx(t, NULL);
+}
+
+void c2_register_udp_transports(struct c2 *c2)
+{
+	struct c2_transport_cbs udp_cbs = {
+		.init = udp_transport_init,
+		.start = udp_transport_start,
+		.egress = udp_transport_egress,
+		.stop = udp_transport_stop,
+		.free = udp_transport_free
+	};
+
+	c2_register_transport_type(c2, "udp", &udp_cbs);
+}
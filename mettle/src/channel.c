@@ -3,9 +3,12 @@
 #include "channel.h"
 #include "eio.h"
 #include "log.h"
+#include "mem_acct.h"
 #include "mettle.h"
+#include "probes.h"
 #include "tlv.h"
 #include "uthash.h"
+#include "util.h"
 
 struct channel {
 	uint32_t id;
@@ -18,27 +21,66 @@ struct channel {
 	bool eof;
 	bool shutting_down;
 	bool started;
+	bool queue_full;
+	bool paused;
+
+	/*
+	 * Bytes an interactive channel may still send when windowed
+	 */
+	bool windowed;
+	uint32_t credit;
+
+	/*
+	 * Channels without a flow callback, such as files, are read on demand,
+	 * and an interactive one pushes its source out as fast as its credit
+	 * and the C2 link allow, then sends a close once eof_cb reports the end
+	 */
+	bool pushing;
+	bool push_closed;
+
+	/*
+	 * The values common to every write request, built once
+	 */
+	struct tlv_packet *write_header;
+
+	/*
+	 * Interactive output waiting to be sent as one write request
+	 */
+	struct buffer_queue *coalesced;
+	struct ev_timer coalesce_timer;
+	double coalesce_delay;
+	size_t coalesce_len;
+
+	/*
+	 * A read request waiting on data the channel is still fetching
+	 */
+	struct tlv_handler_ctx *pending_read;
+	uint32_t pending_read_len;
 };
 
 struct channel_type {
 	char *name;
 	UT_hash_handle hh;
 	struct channel_callbacks cbs;
+	enum tlv_lane lane;
 };
 
 struct channelmgr {
 	struct tlv_dispatcher *td;
+	struct ev_loop *loop;
 	struct channel *channels;
 	struct channel_type *types;
 	uint32_t next_channel_id;
+	bool egress_paused;
 };
 
-struct channelmgr * channelmgr_new(struct tlv_dispatcher *td)
+struct channelmgr * channelmgr_new(struct tlv_dispatcher *td, struct ev_loop *loop)
 {
-	struct channelmgr *cm = calloc(1, sizeof(*cm));
+	struct channelmgr *cm = mem_acct_calloc(MEM_TAG_CHANNEL, 1, sizeof(*cm));
 	if (cm) {
 		cm->next_channel_id = 1;
 		cm->td = td;
+		cm->loop = loop;
 	}
 	return cm;
 }
@@ -48,9 +90,62 @@ void channelmgr_free(struct channelmgr *cm)
 	struct channel *c, *tmp;
 	HASH_ITER(hh, cm->channels, c, tmp) {
 		HASH_DEL(cm->channels, c);
-		free(c);
+		mem_acct_free(MEM_TAG_CHANNEL, c);
+	}
+	mem_acct_free(MEM_TAG_CHANNEL, cm);
+}
+
+/*
+ * A channel's source is paused while its own queue is full, or, for
+ * interactive channels that bypass the queue, while the C2 link is or the
+ * channel has run out of credit. Once the channel is at EOF the source may
+ * already be gone.
+ */
+static void send_buffered(struct channel *c);
+
+static void update_flow(struct channel *c)
+{
+	bool paused = c->queue_full || (c->interactive && (c->cm->egress_paused
+		|| (c->windowed && c->credit == 0)));
+	if (paused != c->paused) {
+		c->paused = paused;
+		if (c->type->cbs.flow_cb) {
+			if (c->ctx && !c->eof) {
+				c->type->cbs.flow_cb(c, paused);
+			}
+		} else if (!paused && c->interactive && c->ctx) {
+			send_buffered(c);
+		}
+	}
+}
+
+static void on_queue_watermark(struct buffer_queue *q, bool above, void *arg)
+{
+	struct channel *c = arg;
+	c->queue_full = above;
+	update_flow(c);
+}
+
+void channelmgr_set_egress_paused(struct channelmgr *cm, bool paused)
+{
+	struct channel *c, *tmp;
+	cm->egress_paused = paused;
+	HASH_ITER(hh, cm->channels, c, tmp) {
+		update_flow(c);
+	}
+}
+
+size_t channelmgr_channel_count(struct channelmgr *cm, size_t *queued_bytes)
+{
+	struct channel *c, *tmp;
+	size_t bytes = 0;
+	HASH_ITER(hh, cm->channels, c, tmp) {
+		bytes += buffer_queue_len(c->queue);
+	}
+	if (queued_bytes) {
+		*queued_bytes = bytes;
 	}
-	free(cm);
+	return HASH_COUNT(cm->channels);
 }
 
 struct channel * channelmgr_channel_new(struct channelmgr *cm, char *channel_type)
@@ -61,17 +156,29 @@ struct channel * channelmgr_channel_new(struct channelmgr *cm, char *channel_typ
 		return NULL;
 	}
 
-	struct channel *c = calloc(1, sizeof(*c));
+	/*
+	 * Existing channels keep going at a slower pace over the memory budget,
+	 * but there is no room for more
+	 */
+	if (buffer_queue_over_budget()) {
+		log_error("not opening a %s channel, over the memory budget", channel_type);
+		return NULL;
+	}
+
+	struct channel *c = mem_acct_calloc(MEM_TAG_CHANNEL, 1, sizeof(*c));
 	if (c) {
 		c->id = cm->next_channel_id++;
 		c->type = ct;
 		c->cm = cm;
 		c->queue = buffer_queue_new();
 		if (c->queue == NULL) {
-			free(c);
+			mem_acct_free(MEM_TAG_CHANNEL, c);
 			c = NULL;
 		} else {
+			buffer_queue_set_watermarks(c->queue, CHANNEL_QUEUE_LOW_WATERMARK,
+				CHANNEL_QUEUE_HIGH_WATERMARK, on_queue_watermark, c);
 			HASH_ADD_INT(cm->channels, id, c);
+			METTLE_PROBE(channel__open, c->id, ct->name);
 		}
 	}
 	return c;
@@ -79,9 +186,18 @@ struct channel * channelmgr_channel_new(struct channelmgr *cm, char *channel_typ
 
 void channel_free(struct channel *c)
 {
+	METTLE_PROBE(channel__close, c->id, c->type->name);
 	HASH_DEL(c->cm->channels, c);
+	if (c->coalesced) {
+		ev_timer_stop(c->cm->loop, &c->coalesce_timer);
+		buffer_queue_free(c->coalesced);
+	}
+	if (c->write_header) {
+		tlv_packet_free(c->write_header);
+	}
+	tlv_handler_ctx_free(c->pending_read);
 	buffer_queue_free(c->queue);
-	free(c);
+	mem_acct_free(MEM_TAG_CHANNEL, c);
 }
 
 struct channel *channelmgr_channel_by_id(struct channelmgr *cm, uint32_t id)
@@ -96,6 +212,11 @@ uint32_t channel_get_id(struct channel *c)
 	return c->id;
 }
 
+const char * channel_get_type(struct channel *c)
+{
+	return c->type->name;
+}
+
 void * channel_get_ctx(struct channel *c)
 {
 	return c->ctx;
@@ -104,6 +225,9 @@ void * channel_get_ctx(struct channel *c)
 void channel_set_ctx(struct channel *c, void *ctx)
 {
 	c->ctx = ctx;
+	if (c->paused && ctx && !c->eof && c->type->cbs.flow_cb) {
+		c->type->cbs.flow_cb(c, true);
+	}
 }
 
 void channel_shutdown(struct channel *c)
@@ -134,30 +258,203 @@ static struct tlv_packet * new_request(struct channel *c, const char *method, si
 		p = tlv_packet_add_fmt(p, TLV_TYPE_REQUEST_ID,
 				"channel-req-%d", channel_get_id(c));
 		p = tlv_packet_add_u32(p, TLV_TYPE_CHANNEL_ID, channel_get_id(c));
+		tlv_packet_set_lane(p, c->type->lane);
 	}
 	return p;
 }
 
-static ssize_t send_write_request(struct channel *c, void *buf, size_t buf_len)
+/*
+ * Credit is checked before reading rather than per write, so a source that
+ * already has data in hand may overshoot its window by up to one read.
+ */
+static void consume_credit(struct channel *c, size_t len)
 {
-	if (buf_len == 0) {
-		return 0;
+	if (c->windowed) {
+		c->credit = len < c->credit ? c->credit - len : 0;
+		update_flow(c);
+	}
+}
+
+/*
+ * Copies in the cached request header, rebuilding it if the session UUID
+ * has changed since it was made
+ */
+static struct tlv_packet * new_write_request(struct channel *c, size_t len)
+{
+	METTLE_PROBE(channel__read, c->id, len);
+	size_t uuid_len = 0, header_uuid_len = 0;
+	const char *uuid = tlv_dispatcher_get_uuid(c->cm->td, &uuid_len);
+	if (c->write_header) {
+		void *header_uuid = tlv_packet_get_raw(c->write_header, TLV_TYPE_UUID,
+			&header_uuid_len);
+		if (header_uuid_len != uuid_len
+				|| (uuid_len && memcmp(header_uuid, uuid, uuid_len))) {
+			tlv_packet_free(c->write_header);
+			c->write_header = NULL;
+		}
+	}
+	if (c->write_header == NULL) {
+		c->write_header = new_request(c, "write", 0);
+		if (c->write_header == NULL) {
+			return NULL;
+		}
+	}
+
+	struct tlv_packet *p = tlv_packet_new(TLV_PACKET_TYPE_REQUEST,
+		tlv_packet_len(c->write_header) + len + 2 * TLV_MIN_LEN + sizeof(uint32_t));
+	p = tlv_packet_add_values(p, c->write_header);
+	if (p) {
+		tlv_packet_set_lane(p, c->type->lane);
 	}
-	struct tlv_packet *p = new_request(c, "write", buf_len);
+	return p;
+}
+
+static ssize_t send_write_packet(struct channel *c, void *buf, size_t buf_len)
+{
+	struct tlv_packet *p = new_write_request(c, buf_len);
 	p = tlv_packet_add_raw(p, TLV_TYPE_CHANNEL_DATA, buf, buf_len);
 	p = tlv_packet_add_u32(p, TLV_TYPE_LENGTH, buf_len);
 	return tlv_dispatcher_enqueue_response(c->cm->td, p);
+}
+
+static void flush_coalesced(struct channel *c)
+{
+	if (c->coalesced == NULL) {
+		return;
+	}
+	ev_timer_stop(c->cm->loop, &c->coalesce_timer);
+	size_t len = buffer_queue_len(c->coalesced);
+	if (len) {
+		void *buf = buffer_queue_pullup(c->coalesced, len);
+		if (buf) {
+			send_write_packet(c, buf, len);
+		}
+		buffer_queue_drain(c->coalesced, len);
+	}
+}
+
+static void coalesce_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+	flush_coalesced(w->data);
+}
+
+/*
+ * With coalescing on, the first write after a flush starts the delay and
+ * later ones join it until the delay expires or enough bytes are waiting
+ */
+static ssize_t send_write_request(struct channel *c, void *buf, size_t buf_len)
+{
+	if (buf_len == 0) {
+		return 0;
+	}
+	consume_credit(c, buf_len);
+	if (c->coalesced == NULL) {
+		return send_write_packet(c, buf, buf_len);
+	}
+
+	if (buffer_queue_add(c->coalesced, buf, buf_len) == -1) {
+		return -1;
+	}
+	if (buffer_queue_len(c->coalesced) >= c->coalesce_len) {
+		flush_coalesced(c);
+	} else if (!ev_is_active(&c->coalesce_timer)) {
+		ev_timer_set(&c->coalesce_timer, c->coalesce_delay, 0);
+		ev_timer_start(c->cm->loop, &c->coalesce_timer);
+	}
+	return 0;
 };
 
+int channel_set_coalescing(struct channel *c, uint32_t delay_ms, size_t max_len)
+{
+	if (delay_ms == 0) {
+		flush_coalesced(c);
+		if (c->coalesced) {
+			buffer_queue_free(c->coalesced);
+			c->coalesced = NULL;
+		}
+		return 0;
+	}
+
+	if (c->coalesced == NULL) {
+		c->coalesced = buffer_queue_new();
+		if (c->coalesced == NULL) {
+			return -1;
+		}
+		ev_init(&c->coalesce_timer, coalesce_timer_cb);
+		c->coalesce_timer.data = c;
+	}
+	c->coalesce_delay = delay_ms / 1000.0;
+	c->coalesce_len = max_len ? max_len : CHANNEL_COALESCE_DEFAULT_LEN;
+	return 0;
+}
+
+/*
+ * Sends what the channel has buffered, as far as its credit allows. A
+ * source read on demand stops while the C2 link is congested as well, and
+ * is picked up again from update_flow.
+ */
+static void send_buffered(struct channel *c)
+{
+	struct channel_callbacks *cbs = channel_get_callbacks(c);
+	bool pulled = cbs->flow_cb == NULL;
+	if (c->pushing || c->push_closed || cbs->read_cb == NULL) {
+		return;
+	}
+	c->pushing = true;
+
+	char buf[65535];
+	ssize_t buf_len = 0;
+	do {
+		size_t len = sizeof(buf);
+		if (c->windowed) {
+			if (c->credit == 0) {
+				break;
+			}
+			len = c->credit < len ? c->credit : len;
+		}
+		if (pulled && c->cm->egress_paused) {
+			break;
+		}
+		buf_len = cbs->read_cb(c, buf, len);
+		if (buf_len > 0) {
+			send_write_request(c, buf, buf_len);
+		}
+	} while (buf_len > 0);
+	c->pushing = false;
+
+	if (pulled && ((buf_len == 0 && cbs->eof_cb && cbs->eof_cb(c))
+			|| (buf_len < 0 && errno != EAGAIN))) {
+		if (buf_len < 0) {
+			log_info("channel %u read failed: %s", c->id, strerror(errno));
+		}
+		c->push_closed = true;
+		channel_send_close_request(c);
+	}
+}
+
 ssize_t channel_enqueue_ex(struct channel *c, void *buf, size_t buf_len, struct tlv_packet *extra)
 {
 	if (buf_len == 0) {
 		return 0;
 	}
-	struct tlv_packet *p = new_request(c, "write", buf_len);
+	struct tlv_packet *p = new_write_request(c, buf_len);
 	p = tlv_packet_add_raw(p, TLV_TYPE_CHANNEL_DATA, buf, buf_len);
 	p = tlv_packet_add_u32(p, TLV_TYPE_LENGTH, buf_len);
 	p = tlv_packet_merge_child(p, extra);
+	if (c->interactive) {
+		consume_credit(c, buf_len);
+	}
+	return tlv_dispatcher_enqueue_response(c->cm->td, p);
+}
+
+ssize_t channel_enqueue_values(struct channel *c, struct tlv_packet *values, size_t len)
+{
+	struct tlv_packet *p = new_write_request(c, tlv_packet_len(values));
+	p = tlv_packet_add_u32(p, TLV_TYPE_LENGTH, len);
+	p = tlv_packet_merge_child(p, values);
+	if (c->interactive) {
+		consume_credit(c, len);
+	}
 	return tlv_dispatcher_enqueue_response(c->cm->td, p);
 }
 
@@ -166,7 +463,7 @@ ssize_t channel_enqueue(struct channel *c, void *buf, size_t buf_len)
 	if (c->interactive) {
 		return send_write_request(c, buf, buf_len);
 	} else {
-		return buffer_queue_add(c->queue, buf, buf_len);
+		return buffer_queue_add_stream(c->queue, buf, buf_len);
 	}
 }
 
@@ -174,13 +471,13 @@ ssize_t channel_enqueue_buffer_queue(struct channel *c, struct buffer_queue *q)
 {
 	ssize_t enqueued_bytes = -1;
 	if (c->interactive) {
-		void *buf;
-		ssize_t buf_len = buffer_queue_remove_all(q, &buf);
-		if (buf_len <= 0) {
+		size_t buf_len = buffer_queue_len(q);
+		void *buf = buffer_queue_pullup(q, buf_len);
+		if (buf == NULL) {
 			goto out;
 		}
 		enqueued_bytes = send_write_request(c, buf, buf_len);
-		free(buf);
+		buffer_queue_drain(q, buf_len);
 	} else {
 		enqueued_bytes = buffer_queue_move_all(c->queue, q);
 	}
@@ -200,6 +497,7 @@ size_t channel_queue_len(struct channel *c)
 
 int channel_send_close_request(struct channel *c)
 {
+	flush_coalesced(c);
 	struct tlv_packet *p = new_request(c, "close", 0);
 	return tlv_dispatcher_enqueue_response(c->cm->td, p);
 };
@@ -223,7 +521,7 @@ struct channel_type * channelmgr_type_by_name(struct channelmgr *cm, char *name)
 int channelmgr_add_channel_type(struct channelmgr *cm, char *name,
     struct channel_callbacks *cbs)
 {
-	struct channel_type *ct = calloc(1, sizeof(*ct));
+	struct channel_type *ct = mem_acct_calloc(MEM_TAG_CHANNEL, 1, sizeof(*ct));
 	if (ct == NULL) {
 		return -1;
 	}
@@ -234,6 +532,17 @@ int channelmgr_add_channel_type(struct channelmgr *cm, char *name,
 	return 0;
 }
 
+int channelmgr_set_channel_type_lane(struct channelmgr *cm, char *name,
+    enum tlv_lane lane)
+{
+	struct channel_type *ct = channelmgr_type_by_name(cm, name);
+	if (ct == NULL) {
+		return -1;
+	}
+	ct->lane = lane;
+	return 0;
+}
+
 static struct tlv_packet *channel_open(struct tlv_handler_ctx *ctx)
 {
 	struct mettle *m = ctx->arg;
@@ -278,6 +587,21 @@ static struct tlv_packet *channel_open(struct tlv_handler_ctx *ctx)
 		rc = TLV_RESULT_SUCCESS;
 	}
 
+	/*
+	 * A window on the open request starts the channel pushing its data,
+	 * as core_channel_interact would, once the response is on its way
+	 */
+	uint32_t window = 0;
+	if (cbs->read_cb && cbs->flow_cb == NULL
+			&& tlv_packet_get_u32(ctx->req, TLV_TYPE_CHANNEL_WINDOW, &window) == 0
+			&& window > 0) {
+		tlv_dispatcher_enqueue_response(cm->td, tlv_packet_response_result(ctx, rc));
+		tlv_handler_ctx_free(ctx);
+		channel_set_window(c, true, window);
+		channel_set_interactive(c, true);
+		return NULL;
+	}
+
 out:
 	return tlv_packet_response_result(ctx, rc);
 }
@@ -321,18 +645,29 @@ void channel_set_eof(struct channel *c)
 void channel_set_interactive(struct channel *c, bool enable)
 {
 	if (enable) {
-		struct channel_callbacks *cbs = channel_get_callbacks(c);
-		char buf[65535];
-		size_t buf_len = 0;
-		do {
-			buf_len = cbs->read_cb(c, buf, sizeof(buf));
-			if (buf_len) {
-				send_write_request(c, buf, buf_len);
-			}
-		} while (buf_len > 0);
+		send_buffered(c);
+	} else {
+		flush_coalesced(c);
 	}
 
 	c->interactive = enable;
+	update_flow(c);
+}
+
+void channel_set_window(struct channel *c, bool enable, uint32_t credit)
+{
+	c->windowed = enable;
+	c->credit = credit;
+	update_flow(c);
+}
+
+void channel_grant_credit(struct channel *c, uint32_t credit)
+{
+	c->credit = credit > UINT32_MAX - c->credit ? UINT32_MAX : c->credit + credit;
+	if (c->interactive) {
+		send_buffered(c);
+	}
+	update_flow(c);
 }
 
 bool channel_get_interactive(struct channel *c)
@@ -355,6 +690,23 @@ static struct tlv_packet *channel_interact(struct tlv_handler_ctx *ctx)
 			enable ? TLV_RESULT_FAILURE : TLV_RESULT_SUCCESS);
 	}
 
+	/*
+	 * A window, in bytes, puts the channel under credit-based flow control
+	 */
+	uint32_t window = 0;
+	if (tlv_packet_get_u32(ctx->req, TLV_TYPE_CHANNEL_WINDOW, &window) == 0) {
+		channel_set_window(c, window > 0, window);
+	}
+
+	/*
+	 * and a delay, in milliseconds, merges small writes into fewer requests
+	 */
+	uint32_t delay_ms = 0, max_len = 0;
+	if (tlv_packet_get_u32(ctx->req, TLV_TYPE_CHANNEL_COALESCE_MS, &delay_ms) == 0) {
+		tlv_packet_get_u32(ctx->req, TLV_TYPE_CHANNEL_COALESCE_LEN, &max_len);
+		channel_set_coalescing(c, delay_ms, max_len);
+	}
+
 	channel_set_interactive(c, enable);
 
 	tlv_dispatcher_enqueue_response(c->cm->td,
@@ -365,6 +717,28 @@ static struct tlv_packet *channel_interact(struct tlv_handler_ctx *ctx)
 	return NULL;
 }
 
+/*
+ * Grants a windowed channel more bytes to send
+ */
+static struct tlv_packet *channel_window_update(struct tlv_handler_ctx *ctx)
+{
+	uint32_t credit = 0;
+	struct channel *c = tlv_handler_ctx_channel_by_id(ctx);
+	if (c == NULL || !c->windowed
+			|| tlv_packet_get_u32(ctx->req, TLV_TYPE_CHANNEL_WINDOW, &credit) == -1) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
+	}
+
+	channel_grant_credit(c, credit);
+
+	tlv_dispatcher_enqueue_response(c->cm->td,
+		tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS));
+
+	channel_postcb(c);
+
+	return NULL;
+}
+
 static struct tlv_packet *channel_eof(struct tlv_handler_ctx *ctx)
 {
 	struct channel *c = tlv_handler_ctx_channel_by_id(ctx);
@@ -396,9 +770,20 @@ static struct tlv_packet *channel_seek(struct tlv_handler_ctx *ctx)
 
 	struct channel_callbacks *cbs = channel_get_callbacks(c);
 
-	uint32_t offset, whence;
-	if (tlv_packet_get_u32(ctx->req, TLV_TYPE_SEEK_OFFSET, &offset) == -1 ||
-	    tlv_packet_get_u32(ctx->req, TLV_TYPE_SEEK_WHENCE, &whence) == -1) {
+	/*
+	 * Offsets past 4GB, or negative ones, come as a signed 64-bit value
+	 */
+	uint32_t offset32, whence;
+	uint64_t offset64;
+	ssize_t offset;
+	if (tlv_packet_get_u64(ctx->req, TLV_TYPE_SEEK_OFFSET_64, &offset64) == 0) {
+		offset = (int64_t)offset64;
+	} else if (tlv_packet_get_u32(ctx->req, TLV_TYPE_SEEK_OFFSET, &offset32) == 0) {
+		offset = offset32;
+	} else {
+		return tlv_packet_response_result(ctx, TLV_RESULT_EINVAL);
+	}
+	if (tlv_packet_get_u32(ctx->req, TLV_TYPE_SEEK_WHENCE, &whence) == -1) {
 		return tlv_packet_response_result(ctx, TLV_RESULT_EINVAL);
 	}
 
@@ -435,6 +820,7 @@ static struct tlv_packet *channel_tell(struct tlv_handler_ctx *ctx)
 	if (offset >= 0) {
 		p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
 		p = tlv_packet_add_u32(p, TLV_TYPE_SEEK_POS, offset);
+		p = tlv_packet_add_u64(p, TLV_TYPE_SEEK_POS_64, offset);
 	} else {
 		p = tlv_packet_response_result(ctx, errno);
 	}
@@ -444,6 +830,45 @@ static struct tlv_packet *channel_tell(struct tlv_handler_ctx *ctx)
 	return p;
 }
 
+/*
+ * Answers a read request straight from the channel. Returns -1 with errno
+ * EAGAIN if the channel has nothing ready yet, leaving the request unanswered.
+ */
+static int channel_read_respond(struct channel *c, struct tlv_handler_ctx *ctx, uint32_t len)
+{
+	struct channel_callbacks *cbs = channel_get_callbacks(c);
+
+	/*
+	 * Read straight into the response
+	 */
+	void *buf = NULL;
+	ctx->lane = c->type->lane;
+	struct tlv_packet *p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+	p = tlv_packet_reserve_raw(p, TLV_TYPE_CHANNEL_DATA, len, &buf);
+	if (p == NULL) {
+		p = tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
+		tlv_dispatcher_enqueue_response(c->cm->td, p);
+		return 0;
+	}
+
+	ssize_t bytes_read = cbs->read_cb(c, buf, len);
+	if (bytes_read >= 0) {
+		METTLE_PROBE(channel__read, c->id, bytes_read);
+		p = tlv_packet_commit_raw(p, bytes_read);
+	} else {
+		int err = errno;
+		tlv_packet_free(p);
+		if (err == EAGAIN) {
+			errno = EAGAIN;
+			return -1;
+		}
+		p = tlv_packet_response_result(ctx, err);
+	}
+
+	tlv_dispatcher_enqueue_response(c->cm->td, p);
+	return 0;
+}
+
 static struct tlv_packet *channel_read(struct tlv_handler_ctx *ctx)
 {
 	struct channel *c = tlv_handler_ctx_channel_by_id(ctx);
@@ -458,34 +883,237 @@ static struct tlv_packet *channel_read(struct tlv_handler_ctx *ctx)
 
 	struct channel_callbacks *cbs = channel_get_callbacks(c);
 
-	if (cbs->read_cb == NULL) {
+	if (cbs->read_cb == NULL || c->pending_read) {
 		return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
 	}
 
-	char *buf = calloc(1, len);
-	if (buf == NULL) {
-		return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
+	if (channel_read_respond(c, ctx, len) == -1) {
+		c->pending_read = ctx;
+		c->pending_read_len = len;
+		return NULL;
 	}
+	tlv_handler_ctx_free(ctx);
 
-	ssize_t bytes_read = cbs->read_cb(c, buf, len);
+	if (c->shutting_down) {
+		channel_postcb(c);
+	} else if (c->eof) {
+		channel_send_close_request(c);
+	}
+	return NULL;
+}
+
+void channel_read_ready(struct channel *c)
+{
+	if (c->pending_read) {
+		if (channel_read_respond(c, c->pending_read, c->pending_read_len) == -1) {
+			return;
+		}
+		tlv_handler_ctx_free(c->pending_read);
+		c->pending_read = NULL;
+		if (c->eof) {
+			channel_send_close_request(c);
+		}
+	} else if (c->interactive) {
+		send_buffered(c);
+	}
+}
+
+/*
+ * Reads several channels in one round trip. Each TLV_TYPE_CHANNEL_DATA_GROUP
+ * in the request holds a channel id and length, and is answered by a group
+ * with the channel id, its result and the data read.
+ */
+static struct tlv_packet *channel_read_multi(struct tlv_handler_ctx *ctx)
+{
+	struct mettle *m = ctx->arg;
+	struct channelmgr *cm = mettle_get_channelmgr(m);
+	struct tlv_packet *p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+	struct tlv_iterator i = {
+		.packet = ctx->req,
+		.value_type = TLV_TYPE_CHANNEL_DATA_GROUP,
+	};
+	struct tlv_packet *req;
+
+	while (p && (req = tlv_packet_iterate_group(&i))) {
+		uint32_t id = 0, len = 0;
+		tlv_packet_get_u32(req, TLV_TYPE_CHANNEL_ID, &id);
+		tlv_packet_get_u32(req, TLV_TYPE_LENGTH, &len);
+		tlv_packet_free(req);
+
+		struct channel *c = channelmgr_channel_by_id(cm, id);
+		struct tlv_packet *group = tlv_packet_new(TLV_TYPE_CHANNEL_DATA_GROUP, 0);
+		group = tlv_packet_add_u32(group, TLV_TYPE_CHANNEL_ID, id);
+		if (c == NULL || c->type->cbs.read_cb == NULL) {
+			group = tlv_packet_add_result(group, TLV_RESULT_FAILURE);
+		} else {
+			void *buf = NULL;
+			group = tlv_packet_reserve_raw(group, TLV_TYPE_CHANNEL_DATA, len, &buf);
+			if (group) {
+				ssize_t bytes_read = c->type->cbs.read_cb(c, buf, len);
+				if (bytes_read == -1 && errno == EAGAIN) {
+					bytes_read = 0;
+				}
+				if (bytes_read >= 0) {
+					group = tlv_packet_commit_raw(group, bytes_read);
+					group = tlv_packet_add_result(group, TLV_RESULT_SUCCESS);
+				} else {
+					group = tlv_packet_add_result(group, errno);
+				}
+			}
+		}
+		if (group == NULL) {
+			tlv_packet_free(p);
+			p = NULL;
+			break;
+		}
+		p = tlv_packet_add_child(p, group);
+	}
+
+	if (p == NULL) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_ENOMEM);
+	}
+	tlv_dispatcher_enqueue_response(cm->td, p);
+
+	/*
+	 * Closes go out after the data that preceded them
+	 */
+	i = (struct tlv_iterator) {
+		.packet = ctx->req,
+		.value_type = TLV_TYPE_CHANNEL_DATA_GROUP,
+	};
+	while ((req = tlv_packet_iterate_group(&i))) {
+		uint32_t id = 0;
+		tlv_packet_get_u32(req, TLV_TYPE_CHANNEL_ID, &id);
+		tlv_packet_free(req);
+		struct channel *c = channelmgr_channel_by_id(cm, id);
+		if (c && c->shutting_down) {
+			channel_postcb(c);
+		} else if (c && c->eof) {
+			channel_send_close_request(c);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Writes to several channels in one round trip. Each
+ * TLV_TYPE_CHANNEL_DATA_GROUP holds a channel id and the data for it, and is
+ * answered by a group with the channel id, its result and the length written.
+ */
+static struct tlv_packet *channel_write_multi(struct tlv_handler_ctx *ctx)
+{
+	struct mettle *m = ctx->arg;
+	struct channelmgr *cm = mettle_get_channelmgr(m);
+	struct tlv_packet *p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+	struct tlv_iterator i = {
+		.packet = ctx->req,
+		.value_type = TLV_TYPE_CHANNEL_DATA_GROUP,
+	};
+	struct tlv_packet *req;
+
+	while (p && (req = tlv_packet_iterate_group(&i))) {
+		uint32_t id = 0;
+		size_t len = 0;
+		tlv_packet_get_u32(req, TLV_TYPE_CHANNEL_ID, &id);
+		void *buf = tlv_packet_get_raw(req, TLV_TYPE_CHANNEL_DATA, &len);
+
+		struct channel *c = channelmgr_channel_by_id(cm, id);
+		struct tlv_packet *group = tlv_packet_new(TLV_TYPE_CHANNEL_DATA_GROUP, 0);
+		group = tlv_packet_add_u32(group, TLV_TYPE_CHANNEL_ID, id);
+		if (c == NULL || buf == NULL || c->type->cbs.write_cb == NULL) {
+			group = tlv_packet_add_result(group, TLV_RESULT_FAILURE);
+		} else {
+			ssize_t bytes_written = c->type->cbs.write_cb(c, buf, len);
+			if (len == 0 || bytes_written > 0) {
+				group = tlv_packet_add_result(group, TLV_RESULT_SUCCESS);
+				group = tlv_packet_add_u32(group, TLV_TYPE_LENGTH, bytes_written);
+			} else {
+				group = tlv_packet_add_result(group, errno);
+			}
+			channel_postcb(c);
+		}
+		tlv_packet_free(req);
+		if (group == NULL) {
+			tlv_packet_free(p);
+			p = NULL;
+			break;
+		}
+		p = tlv_packet_add_child(p, group);
+	}
+
+	return p ? p : tlv_packet_response_result(ctx, TLV_RESULT_ENOMEM);
+}
+
+/*
+ * Messages are handed to write_msgs_cb up to CHANNEL_WRITE_MSGS_BATCH at a
+ * time, stopping at the first batch not taken in full
+ */
+#define CHANNEL_WRITE_MSGS_BATCH 64
+
+static struct tlv_packet *channel_write_msgs(struct tlv_handler_ctx *ctx,
+	struct channel *c, struct channel_callbacks *cbs)
+{
+	struct iovec msgs[CHANNEL_WRITE_MSGS_BATCH];
+	struct tlv_iterator i = {
+		.packet = ctx->req,
+		.value_type = TLV_TYPE_CHANNEL_DATA,
+	};
+	ssize_t written = 0, rc = 0;
+	int count;
+
+	do {
+		size_t len = 0, batch_len = 0;
+		void *buf;
+		for (count = 0; count < CHANNEL_WRITE_MSGS_BATCH &&
+				(buf = tlv_packet_iterate(&i, &len)); count++) {
+			msgs[count].iov_base = buf;
+			msgs[count].iov_len = len;
+			batch_len += len;
+		}
+		if (count == 0) {
+			break;
+		}
+		rc = cbs->write_msgs_cb(c, msgs, count);
+		if (rc > 0) {
+			written += rc;
+		}
+		if (rc < (ssize_t)batch_len) {
+			break;
+		}
+	} while (count == CHANNEL_WRITE_MSGS_BATCH);
+
+	METTLE_PROBE(channel__write, c->id, written);
 	struct tlv_packet *p;
-	if (bytes_read >= 0) {
+	if (written > 0 || rc >= 0) {
 		p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
-		p = tlv_packet_add_raw(p, TLV_TYPE_CHANNEL_DATA, buf, bytes_read);
+		p = tlv_packet_add_u32(p, TLV_TYPE_LENGTH, written);
 	} else {
 		p = tlv_packet_response_result(ctx, errno);
 	}
-	free(buf);
-
 	channel_postcb(c);
+	return p;
+}
 
-	tlv_dispatcher_enqueue_response(c->cm->td, p);
-	if (c->eof) {
-		channel_send_close_request(c);
-	}
-	return NULL;
+static bool has_several_msgs(struct tlv_packet *req)
+{
+	size_t len;
+	struct tlv_iterator i = {
+		.packet = req,
+		.value_type = TLV_TYPE_CHANNEL_DATA,
+	};
+	return tlv_packet_iterate(&i, &len) && tlv_packet_iterate(&i, &len);
 }
 
+struct channel_write_req {
+	uint32_t len;
+	struct tlv_raw_value data;
+};
+
+static const struct tlv_field channel_write_schema[] = {
+	TLV_FIELD_REQUIRED(TLV_TYPE_LENGTH, TLV_FIELD_U32, struct channel_write_req, len),
+	TLV_FIELD(TLV_TYPE_CHANNEL_DATA, TLV_FIELD_RAW, struct channel_write_req, data),
+};
+
 static struct tlv_packet *channel_write(struct tlv_handler_ctx *ctx)
 {
 	struct channel *c = tlv_handler_ctx_channel_by_id(ctx);
@@ -493,24 +1121,32 @@ static struct tlv_packet *channel_write(struct tlv_handler_ctx *ctx)
 		return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
 	}
 
-	uint32_t len = 0;
-	if (tlv_packet_get_u32(ctx->req, TLV_TYPE_LENGTH, &len) == -1) {
+	struct channel_write_req req = { 0 };
+	if (tlv_packet_decode(ctx->req, channel_write_schema,
+			COUNT_OF(channel_write_schema), &req) == -1) {
 		return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
 	}
 
 	struct channel_callbacks *cbs = channel_get_callbacks(c);
 
+	if (cbs->write_msgs_cb && has_several_msgs(ctx->req)) {
+		return channel_write_msgs(ctx, c, cbs);
+	}
+
 	if (cbs->write_cb == NULL) {
 		return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
 	}
 
-	size_t buf_len = 0;
-	char *buf = tlv_packet_get_raw(ctx->req, TLV_TYPE_CHANNEL_DATA, &buf_len);
-	if (buf == NULL) {
+	if (req.data.buf == NULL) {
 		return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
 	}
 
-	ssize_t bytes_written = cbs->write_cb(c, buf, len);
+	/*
+	 * The length given may be less than the data sent, never more
+	 */
+	uint32_t len = TYPESAFE_MIN(req.len, (uint32_t)req.data.len);
+	ssize_t bytes_written = cbs->write_cb(c, req.data.buf, len);
+	METTLE_PROBE(channel__write, c->id, bytes_written);
 	struct tlv_packet *p;
 	if (len == 0 || bytes_written > 0) {
 		p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
@@ -529,16 +1165,23 @@ struct channelmgr *channel_get_channelmgr(struct channel *c)
 	return c->cm;
 }
 
+static const struct tlv_handler_def channelapi_handlers[] = {
+	{ "core_channel_open", channel_open },
+	{ "core_channel_eof", channel_eof },
+	{ "core_channel_seek", channel_seek },
+	{ "core_channel_tell", channel_tell },
+	{ "core_channel_read", channel_read },
+	{ "core_channel_write", channel_write },
+	{ "core_channel_read_multi", channel_read_multi },
+	{ "core_channel_write_multi", channel_write_multi },
+	{ "core_channel_close", channel_close },
+	{ "core_channel_interact", channel_interact },
+	{ "core_channel_window_update", channel_window_update },
+};
+
 void tlv_register_channelapi(struct mettle *m)
 {
 	struct tlv_dispatcher *td = mettle_get_tlv_dispatcher(m);
 
-	tlv_dispatcher_add_handler(td, "core_channel_open", channel_open, m);
-	tlv_dispatcher_add_handler(td, "core_channel_eof", channel_eof, m);
-	tlv_dispatcher_add_handler(td, "core_channel_seek", channel_seek, m);
-	tlv_dispatcher_add_handler(td, "core_channel_tell", channel_tell, m);
-	tlv_dispatcher_add_handler(td, "core_channel_read", channel_read, m);
-	tlv_dispatcher_add_handler(td, "core_channel_write", channel_write, m);
-	tlv_dispatcher_add_handler(td, "core_channel_close", channel_close, m);
-	tlv_dispatcher_add_handler(td, "core_channel_interact", channel_interact, m);
+	tlv_dispatcher_add_handlers(td, channelapi_handlers, COUNT_OF(channelapi_handlers), m);
 }
@@ -10,13 +10,16 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 #include "tlv.h"
 
 struct channel;
 struct channelmgr;
 struct tlv_dispatcher;
 
-struct channelmgr * channelmgr_new(struct tlv_dispatcher *td);
+struct ev_loop;
+
+struct channelmgr * channelmgr_new(struct tlv_dispatcher *td, struct ev_loop *loop);
 
 void channelmgr_free(struct channelmgr *cm);
 
@@ -34,26 +37,85 @@ struct channel_callbacks {
 
 	int (*new_async_cb)(struct tlv_handler_ctx *tlv_ctx, struct channel *c);
 
+	/*
+	 * May fail with errno EAGAIN while data is still being fetched; the
+	 * channel then calls channel_read_ready once it has some
+	 */
 	ssize_t (*read_cb)(struct channel *c, void *buf, size_t len);
 
 	ssize_t (*write_cb)(struct channel *c, void *buf, size_t len);
 
+	/*
+	 * Writes each buffer as a message of its own, such as a datagram. A
+	 * core_channel_write carrying several TLV_TYPE_CHANNEL_DATA values is
+	 * handed here, if set, rather than to write_cb.
+	 */
+	ssize_t (*write_msgs_cb)(struct channel *c, struct iovec *msgs, int count);
+
 	bool (*eof_cb)(struct channel *c);
 
+	/*
+	 * Whence is SEEK_SET, SEEK_CUR or SEEK_END as numbered on the wire,
+	 * or one of the CHANNEL_SEEK_ values below
+	 */
 	int (*seek_cb)(struct channel *c, ssize_t offset, int whence);
 
 	ssize_t (*tell_cb)(struct channel *c);
 
 	int (*free_cb)(struct channel *c);
+
+	/*
+	 * Asks the channel to stop (or resume) reading from its source while
+	 * the data it has already produced is backed up
+	 */
+	void (*flow_cb)(struct channel *c, bool paused);
+
+	/*
+	 * Shapes the channel's connection, in bytes per second each way
+	 */
+	void (*rate_cb)(struct channel *c, uint64_t rx_rate, uint64_t tx_rate);
 };
 
+/*
+ * Protocol values for seeking to the next data or hole in a sparse file,
+ * which differ between platforms locally
+ */
+#define CHANNEL_SEEK_DATA 3
+#define CHANNEL_SEEK_HOLE 4
+
+#ifdef METTLE_LOW_MEMORY
+#define CHANNEL_QUEUE_HIGH_WATERMARK (128 * 1024)
+#define CHANNEL_QUEUE_LOW_WATERMARK  (32 * 1024)
+#else
+#define CHANNEL_QUEUE_HIGH_WATERMARK (1024 * 1024)
+#define CHANNEL_QUEUE_LOW_WATERMARK  (256 * 1024)
+#endif
+
+/*
+ * Pause or resume interactive channels while the C2 link is congested
+ */
+void channelmgr_set_egress_paused(struct channelmgr *cm, bool paused);
+
+/*
+ * Returns the number of open channels, and optionally the bytes queued in them
+ */
+size_t channelmgr_channel_count(struct channelmgr *cm, size_t *queued_bytes);
+
 int channelmgr_add_channel_type(struct channelmgr *cm,
 	char *name, struct channel_callbacks *cb);
 
+/*
+ * Set the lane that data read from channels of this type is sent in
+ */
+int channelmgr_set_channel_type_lane(struct channelmgr *cm, char *name,
+	enum tlv_lane lane);
+
 struct channel_type * channelmgr_type_by_name(struct channelmgr *cm, char *name);
 
 uint32_t channel_get_id(struct channel *c);
 
+const char * channel_get_type(struct channel *c);
+
 void * channel_get_ctx(struct channel *c);
 
 void channel_set_ctx(struct channel *c, void *ctx);
@@ -66,6 +128,25 @@ void channel_set_interactive(struct channel *c, bool enable);
 
 bool channel_get_interactive(struct channel *c);
 
+/*
+ * Windowed interactive channels send at most 'credit' more bytes, pausing
+ * their source when it runs out until channel_grant_credit adds more.
+ * Opening a channel without a flow_cb with TLV_TYPE_CHANNEL_WINDOW set makes
+ * it push its data this way, closing once eof_cb reports the end.
+ */
+void channel_set_window(struct channel *c, bool enable, uint32_t credit);
+
+void channel_grant_credit(struct channel *c, uint32_t credit);
+
+#define CHANNEL_COALESCE_DEFAULT_LEN (16 * 1024)
+
+/*
+ * Holds interactive output for up to delay_ms, or until max_len bytes are
+ * waiting, so that small writes are sent as one request. A delay of 0 sends
+ * each write as it comes.
+ */
+int channel_set_coalescing(struct channel *c, uint32_t delay_ms, size_t max_len);
+
 int channel_send_close_request(struct channel *c);
 
 ssize_t channel_enqueue(struct channel *c, void *buf, size_t buf_len);
@@ -75,6 +156,12 @@ ssize_t channel_enqueue_ex(struct channel *c, void *buf, size_t buf_len,
 
 ssize_t channel_enqueue_buffer_queue(struct channel *c, struct buffer_queue *bq);
 
+/*
+ * Sends the values in 'values', such as several datagram groups, as one
+ * write request, counting 'len' bytes of data against the channel's credit
+ */
+ssize_t channel_enqueue_values(struct channel *c, struct tlv_packet *values, size_t len);
+
 ssize_t channel_dequeue(struct channel *c, void *buf, size_t buf_len);
 
 size_t channel_queue_len(struct channel *c);
@@ -83,6 +170,12 @@ void channel_shutdown(struct channel *c);
 
 void channel_opened(struct channel *c);
 
+/*
+ * Answers a read that was waiting on the channel, or sends what it has if
+ * interactive
+ */
+void channel_read_ready(struct channel *c);
+
 struct channelmgr *channel_get_channelmgr(struct channel *c);
 
 void tlv_register_channelapi(struct mettle *m);
@@ -0,0 +1,326 @@
+/**
+ * @brief Numeric command IDs
+ * @file command_ids.h
+ *
+ * The IDs the Metasploit framework gives core and stdapi methods, copied
+ * from its table. They are fixed by the framework: entries may be added as
+ * it adds them, but never renumbered. Methods without one, such as those
+ * only mettle has, are dispatched by name.
+ */
+
+#ifndef _COMMAND_IDS_H_
+#define _COMMAND_IDS_H_
+
+#define EXTENSION_ID_CORE   0
+#define EXTENSION_ID_STDAPI 1000
+
+#define COMMAND_ID_CORE_CHANNEL_CLOSE                        (EXTENSION_ID_CORE + 1)
+#define COMMAND_ID_CORE_CHANNEL_EOF                          (EXTENSION_ID_CORE + 2)
+#define COMMAND_ID_CORE_CHANNEL_INTERACT                     (EXTENSION_ID_CORE + 3)
+#define COMMAND_ID_CORE_CHANNEL_OPEN                         (EXTENSION_ID_CORE + 4)
+#define COMMAND_ID_CORE_CHANNEL_READ                         (EXTENSION_ID_CORE + 5)
+#define COMMAND_ID_CORE_CHANNEL_SEEK                         (EXTENSION_ID_CORE + 6)
+#define COMMAND_ID_CORE_CHANNEL_TELL                         (EXTENSION_ID_CORE + 7)
+#define COMMAND_ID_CORE_CHANNEL_WRITE                        (EXTENSION_ID_CORE + 8)
+#define COMMAND_ID_CORE_CONSOLE_WRITE                        (EXTENSION_ID_CORE + 9)
+#define COMMAND_ID_CORE_ENUMEXTCMD                           (EXTENSION_ID_CORE + 10)
+#define COMMAND_ID_CORE_GET_SESSION_GUID                     (EXTENSION_ID_CORE + 11)
+#define COMMAND_ID_CORE_LOADLIB                              (EXTENSION_ID_CORE + 12)
+#define COMMAND_ID_CORE_MACHINE_ID                           (EXTENSION_ID_CORE + 13)
+#define COMMAND_ID_CORE_MIGRATE                              (EXTENSION_ID_CORE + 14)
+#define COMMAND_ID_CORE_NATIVE_ARCH                          (EXTENSION_ID_CORE + 15)
+#define COMMAND_ID_CORE_NEGOTIATE_TLV_ENCRYPTION             (EXTENSION_ID_CORE + 16)
+#define COMMAND_ID_CORE_PATCH_URL                            (EXTENSION_ID_CORE + 17)
+#define COMMAND_ID_CORE_PIVOT_ADD                            (EXTENSION_ID_CORE + 18)
+#define COMMAND_ID_CORE_PIVOT_REMOVE                         (EXTENSION_ID_CORE + 19)
+#define COMMAND_ID_CORE_PIVOT_SESSION_DIED                   (EXTENSION_ID_CORE + 20)
+#define COMMAND_ID_CORE_SET_SESSION_GUID                     (EXTENSION_ID_CORE + 21)
+#define COMMAND_ID_CORE_SET_UUID                             (EXTENSION_ID_CORE + 22)
+#define COMMAND_ID_CORE_SHUTDOWN                             (EXTENSION_ID_CORE + 23)
+#define COMMAND_ID_CORE_TRANSPORT_ADD                        (EXTENSION_ID_CORE + 24)
+#define COMMAND_ID_CORE_TRANSPORT_CHANGE                     (EXTENSION_ID_CORE + 25)
+#define COMMAND_ID_CORE_TRANSPORT_GETCERTHASH                (EXTENSION_ID_CORE + 26)
+#define COMMAND_ID_CORE_TRANSPORT_LIST                       (EXTENSION_ID_CORE + 27)
+#define COMMAND_ID_CORE_TRANSPORT_NEXT                       (EXTENSION_ID_CORE + 28)
+#define COMMAND_ID_CORE_TRANSPORT_PREV                       (EXTENSION_ID_CORE + 29)
+#define COMMAND_ID_CORE_TRANSPORT_REMOVE                     (EXTENSION_ID_CORE + 30)
+#define COMMAND_ID_CORE_TRANSPORT_SETCERTHASH                (EXTENSION_ID_CORE + 31)
+#define COMMAND_ID_CORE_TRANSPORT_SET_TIMEOUTS               (EXTENSION_ID_CORE + 32)
+#define COMMAND_ID_CORE_TRANSPORT_SLEEP                      (EXTENSION_ID_CORE + 33)
+#define COMMAND_ID_CORE_PIVOT_SESSION_NEW                    (EXTENSION_ID_CORE + 34)
+
+#define COMMAND_ID_STDAPI_FS_CHDIR                           (EXTENSION_ID_STDAPI + 1)
+#define COMMAND_ID_STDAPI_FS_CHMOD                           (EXTENSION_ID_STDAPI + 2)
+#define COMMAND_ID_STDAPI_FS_DELETE_DIR                      (EXTENSION_ID_STDAPI + 3)
+#define COMMAND_ID_STDAPI_FS_DELETE_FILE                     (EXTENSION_ID_STDAPI + 4)
+#define COMMAND_ID_STDAPI_FS_FILE_COPY                       (EXTENSION_ID_STDAPI + 5)
+#define COMMAND_ID_STDAPI_FS_FILE_EXPAND_PATH                (EXTENSION_ID_STDAPI + 6)
+#define COMMAND_ID_STDAPI_FS_FILE_MOVE                       (EXTENSION_ID_STDAPI + 7)
+#define COMMAND_ID_STDAPI_FS_GETWD                           (EXTENSION_ID_STDAPI + 8)
+#define COMMAND_ID_STDAPI_FS_LS                              (EXTENSION_ID_STDAPI + 9)
+#define COMMAND_ID_STDAPI_FS_MD5                             (EXTENSION_ID_STDAPI + 10)
+#define COMMAND_ID_STDAPI_FS_MKDIR                           (EXTENSION_ID_STDAPI + 11)
+#define COMMAND_ID_STDAPI_FS_MOUNT_SHOW                      (EXTENSION_ID_STDAPI + 12)
+#define COMMAND_ID_STDAPI_FS_SEARCH                          (EXTENSION_ID_STDAPI + 13)
+#define COMMAND_ID_STDAPI_FS_SEPARATOR                       (EXTENSION_ID_STDAPI + 14)
+#define COMMAND_ID_STDAPI_FS_SHA1                            (EXTENSION_ID_STDAPI + 15)
+#define COMMAND_ID_STDAPI_FS_STAT                            (EXTENSION_ID_STDAPI + 16)
+#define COMMAND_ID_STDAPI_NET_CONFIG_ADD_ROUTE               (EXTENSION_ID_STDAPI + 17)
+#define COMMAND_ID_STDAPI_NET_CONFIG_GET_ARP_TABLE           (EXTENSION_ID_STDAPI + 18)
+#define COMMAND_ID_STDAPI_NET_CONFIG_GET_INTERFACES          (EXTENSION_ID_STDAPI + 19)
+#define COMMAND_ID_STDAPI_NET_CONFIG_GET_NETSTAT             (EXTENSION_ID_STDAPI + 20)
+#define COMMAND_ID_STDAPI_NET_CONFIG_GET_PROXY               (EXTENSION_ID_STDAPI + 21)
+#define COMMAND_ID_STDAPI_NET_CONFIG_GET_ROUTES              (EXTENSION_ID_STDAPI + 22)
+#define COMMAND_ID_STDAPI_NET_CONFIG_REMOVE_ROUTE            (EXTENSION_ID_STDAPI + 23)
+#define COMMAND_ID_STDAPI_NET_RESOLVE_HOST                   (EXTENSION_ID_STDAPI + 24)
+#define COMMAND_ID_STDAPI_NET_RESOLVE_HOSTS                  (EXTENSION_ID_STDAPI + 25)
+#define COMMAND_ID_STDAPI_NET_SOCKET_TCP_SHUTDOWN            (EXTENSION_ID_STDAPI + 26)
+#define COMMAND_ID_STDAPI_RAILGUN_API                        (EXTENSION_ID_STDAPI + 27)
+#define COMMAND_ID_STDAPI_RAILGUN_API_MULTI                  (EXTENSION_ID_STDAPI + 28)
+#define COMMAND_ID_STDAPI_RAILGUN_MEMREAD                    (EXTENSION_ID_STDAPI + 29)
+#define COMMAND_ID_STDAPI_RAILGUN_MEMWRITE                   (EXTENSION_ID_STDAPI + 30)
+#define COMMAND_ID_STDAPI_REGISTRY_CHECK_KEY_EXISTS          (EXTENSION_ID_STDAPI + 31)
+#define COMMAND_ID_STDAPI_REGISTRY_CLOSE_KEY                 (EXTENSION_ID_STDAPI + 32)
+#define COMMAND_ID_STDAPI_REGISTRY_CREATE_KEY                (EXTENSION_ID_STDAPI + 33)
+#define COMMAND_ID_STDAPI_REGISTRY_DELETE_KEY                (EXTENSION_ID_STDAPI + 34)
+#define COMMAND_ID_STDAPI_REGISTRY_DELETE_VALUE              (EXTENSION_ID_STDAPI + 35)
+#define COMMAND_ID_STDAPI_REGISTRY_ENUM_KEY                  (EXTENSION_ID_STDAPI + 36)
+#define COMMAND_ID_STDAPI_REGISTRY_ENUM_KEY_DIRECT           (EXTENSION_ID_STDAPI + 37)
+#define COMMAND_ID_STDAPI_REGISTRY_ENUM_VALUE                (EXTENSION_ID_STDAPI + 38)
+#define COMMAND_ID_STDAPI_REGISTRY_ENUM_VALUE_DIRECT         (EXTENSION_ID_STDAPI + 39)
+#define COMMAND_ID_STDAPI_REGISTRY_LOAD_KEY                  (EXTENSION_ID_STDAPI + 40)
+#define COMMAND_ID_STDAPI_REGISTRY_OPEN_KEY                  (EXTENSION_ID_STDAPI + 41)
+#define COMMAND_ID_STDAPI_REGISTRY_OPEN_REMOTE_KEY           (EXTENSION_ID_STDAPI + 42)
+#define COMMAND_ID_STDAPI_REGISTRY_QUERY_CLASS               (EXTENSION_ID_STDAPI + 43)
+#define COMMAND_ID_STDAPI_REGISTRY_QUERY_VALUE               (EXTENSION_ID_STDAPI + 44)
+#define COMMAND_ID_STDAPI_REGISTRY_QUERY_VALUE_DIRECT        (EXTENSION_ID_STDAPI + 45)
+#define COMMAND_ID_STDAPI_REGISTRY_SET_VALUE                 (EXTENSION_ID_STDAPI + 46)
+#define COMMAND_ID_STDAPI_REGISTRY_SET_VALUE_DIRECT          (EXTENSION_ID_STDAPI + 47)
+#define COMMAND_ID_STDAPI_REGISTRY_UNLOAD_KEY                (EXTENSION_ID_STDAPI + 48)
+#define COMMAND_ID_STDAPI_SYS_CONFIG_DRIVER_LIST             (EXTENSION_ID_STDAPI + 49)
+#define COMMAND_ID_STDAPI_SYS_CONFIG_DROP_TOKEN              (EXTENSION_ID_STDAPI + 50)
+#define COMMAND_ID_STDAPI_SYS_CONFIG_GETENV                  (EXTENSION_ID_STDAPI + 51)
+#define COMMAND_ID_STDAPI_SYS_CONFIG_GETPRIVS                (EXTENSION_ID_STDAPI + 52)
+#define COMMAND_ID_STDAPI_SYS_CONFIG_GETSID                  (EXTENSION_ID_STDAPI + 53)
+#define COMMAND_ID_STDAPI_SYS_CONFIG_GETUID                  (EXTENSION_ID_STDAPI + 54)
+#define COMMAND_ID_STDAPI_SYS_CONFIG_LOCALTIME               (EXTENSION_ID_STDAPI + 55)
+#define COMMAND_ID_STDAPI_SYS_CONFIG_REV2SELF                (EXTENSION_ID_STDAPI + 56)
+#define COMMAND_ID_STDAPI_SYS_CONFIG_STEAL_TOKEN             (EXTENSION_ID_STDAPI + 57)
+#define COMMAND_ID_STDAPI_SYS_CONFIG_SYSINFO                 (EXTENSION_ID_STDAPI + 58)
+#define COMMAND_ID_STDAPI_SYS_EVENTLOG_CLEAR                 (EXTENSION_ID_STDAPI + 59)
+#define COMMAND_ID_STDAPI_SYS_EVENTLOG_CLOSE                 (EXTENSION_ID_STDAPI + 60)
+#define COMMAND_ID_STDAPI_SYS_EVENTLOG_NUMRECORDS            (EXTENSION_ID_STDAPI + 61)
+#define COMMAND_ID_STDAPI_SYS_EVENTLOG_OLDEST                (EXTENSION_ID_STDAPI + 62)
+#define COMMAND_ID_STDAPI_SYS_EVENTLOG_OPEN                  (EXTENSION_ID_STDAPI + 63)
+#define COMMAND_ID_STDAPI_SYS_EVENTLOG_READ                  (EXTENSION_ID_STDAPI + 64)
+#define COMMAND_ID_STDAPI_SYS_POWER_EXITWINDOWS              (EXTENSION_ID_STDAPI + 65)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_ATTACH                 (EXTENSION_ID_STDAPI + 66)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_CLOSE                  (EXTENSION_ID_STDAPI + 67)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_EXECUTE                (EXTENSION_ID_STDAPI + 68)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_GET_INFO               (EXTENSION_ID_STDAPI + 69)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_GET_PROCESSES          (EXTENSION_ID_STDAPI + 70)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_GETPID                 (EXTENSION_ID_STDAPI + 71)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_IMAGE_GET_IMAGES       (EXTENSION_ID_STDAPI + 72)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_IMAGE_GET_PROC_ADDRESS (EXTENSION_ID_STDAPI + 73)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_IMAGE_LOAD             (EXTENSION_ID_STDAPI + 74)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_IMAGE_UNLOAD           (EXTENSION_ID_STDAPI + 75)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_KILL                   (EXTENSION_ID_STDAPI + 76)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_MEMORY_ALLOCATE        (EXTENSION_ID_STDAPI + 77)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_MEMORY_FREE            (EXTENSION_ID_STDAPI + 78)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_MEMORY_LOCK            (EXTENSION_ID_STDAPI + 79)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_MEMORY_PROTECT         (EXTENSION_ID_STDAPI + 80)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_MEMORY_QUERY           (EXTENSION_ID_STDAPI + 81)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_MEMORY_READ            (EXTENSION_ID_STDAPI + 82)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_MEMORY_UNLOCK          (EXTENSION_ID_STDAPI + 83)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_MEMORY_WRITE           (EXTENSION_ID_STDAPI + 84)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_THREAD_CLOSE           (EXTENSION_ID_STDAPI + 85)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_THREAD_CREATE          (EXTENSION_ID_STDAPI + 86)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_THREAD_GET_THREADS     (EXTENSION_ID_STDAPI + 87)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_THREAD_OPEN            (EXTENSION_ID_STDAPI + 88)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_THREAD_QUERY_REGS      (EXTENSION_ID_STDAPI + 89)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_THREAD_RESUME          (EXTENSION_ID_STDAPI + 90)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_THREAD_SET_REGS        (EXTENSION_ID_STDAPI + 91)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_THREAD_SUSPEND         (EXTENSION_ID_STDAPI + 92)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_THREAD_TERMINATE       (EXTENSION_ID_STDAPI + 93)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_WAIT                   (EXTENSION_ID_STDAPI + 94)
+#define COMMAND_ID_STDAPI_UI_DESKTOP_ENUM                    (EXTENSION_ID_STDAPI + 95)
+#define COMMAND_ID_STDAPI_UI_DESKTOP_GET                     (EXTENSION_ID_STDAPI + 96)
+#define COMMAND_ID_STDAPI_UI_DESKTOP_SCREENSHOT              (EXTENSION_ID_STDAPI + 97)
+#define COMMAND_ID_STDAPI_UI_DESKTOP_SET                     (EXTENSION_ID_STDAPI + 98)
+#define COMMAND_ID_STDAPI_UI_ENABLE_KEYBOARD                 (EXTENSION_ID_STDAPI + 99)
+#define COMMAND_ID_STDAPI_UI_ENABLE_MOUSE                    (EXTENSION_ID_STDAPI + 100)
+#define COMMAND_ID_STDAPI_UI_GET_IDLE_TIME                   (EXTENSION_ID_STDAPI + 101)
+#define COMMAND_ID_STDAPI_UI_GET_KEYS_UTF8                   (EXTENSION_ID_STDAPI + 102)
+#define COMMAND_ID_STDAPI_UI_SEND_KEYEVENT                   (EXTENSION_ID_STDAPI + 103)
+#define COMMAND_ID_STDAPI_UI_SEND_KEYS                       (EXTENSION_ID_STDAPI + 104)
+#define COMMAND_ID_STDAPI_UI_SEND_MOUSE                      (EXTENSION_ID_STDAPI + 105)
+#define COMMAND_ID_STDAPI_UI_START_KEYSCAN                   (EXTENSION_ID_STDAPI + 106)
+#define COMMAND_ID_STDAPI_UI_STOP_KEYSCAN                    (EXTENSION_ID_STDAPI + 107)
+#define COMMAND_ID_STDAPI_UI_UNLOCK_DESKTOP                  (EXTENSION_ID_STDAPI + 108)
+#define COMMAND_ID_STDAPI_WEBCAM_AUDIO_RECORD                (EXTENSION_ID_STDAPI + 109)
+#define COMMAND_ID_STDAPI_WEBCAM_GET_FRAME                   (EXTENSION_ID_STDAPI + 110)
+#define COMMAND_ID_STDAPI_WEBCAM_LIST                        (EXTENSION_ID_STDAPI + 111)
+#define COMMAND_ID_STDAPI_WEBCAM_START                       (EXTENSION_ID_STDAPI + 112)
+#define COMMAND_ID_STDAPI_WEBCAM_STOP                        (EXTENSION_ID_STDAPI + 113)
+#define COMMAND_ID_STDAPI_AUDIO_MIC_START                    (EXTENSION_ID_STDAPI + 114)
+#define COMMAND_ID_STDAPI_AUDIO_MIC_STOP                     (EXTENSION_ID_STDAPI + 115)
+#define COMMAND_ID_STDAPI_AUDIO_MIC_LIST                     (EXTENSION_ID_STDAPI + 116)
+#define COMMAND_ID_STDAPI_SYS_PROCESS_SET_TERM_SIZE          (EXTENSION_ID_STDAPI + 117)
+
+/*
+ * X(id, method) for each of the above, in ID order
+ */
+#define COMMAND_IDS(X) \
+	X(COMMAND_ID_CORE_CHANNEL_CLOSE, "core_channel_close") \
+	X(COMMAND_ID_CORE_CHANNEL_EOF, "core_channel_eof") \
+	X(COMMAND_ID_CORE_CHANNEL_INTERACT, "core_channel_interact") \
+	X(COMMAND_ID_CORE_CHANNEL_OPEN, "core_channel_open") \
+	X(COMMAND_ID_CORE_CHANNEL_READ, "core_channel_read") \
+	X(COMMAND_ID_CORE_CHANNEL_SEEK, "core_channel_seek") \
+	X(COMMAND_ID_CORE_CHANNEL_TELL, "core_channel_tell") \
+	X(COMMAND_ID_CORE_CHANNEL_WRITE, "core_channel_write") \
+	X(COMMAND_ID_CORE_CONSOLE_WRITE, "core_console_write") \
+	X(COMMAND_ID_CORE_ENUMEXTCMD, "core_enumextcmd") \
+	X(COMMAND_ID_CORE_GET_SESSION_GUID, "core_get_session_guid") \
+	X(COMMAND_ID_CORE_LOADLIB, "core_loadlib") \
+	X(COMMAND_ID_CORE_MACHINE_ID, "core_machine_id") \
+	X(COMMAND_ID_CORE_MIGRATE, "core_migrate") \
+	X(COMMAND_ID_CORE_NATIVE_ARCH, "core_native_arch") \
+	X(COMMAND_ID_CORE_NEGOTIATE_TLV_ENCRYPTION, "core_negotiate_tlv_encryption") \
+	X(COMMAND_ID_CORE_PATCH_URL, "core_patch_url") \
+	X(COMMAND_ID_CORE_PIVOT_ADD, "core_pivot_add") \
+	X(COMMAND_ID_CORE_PIVOT_REMOVE, "core_pivot_remove") \
+	X(COMMAND_ID_CORE_PIVOT_SESSION_DIED, "core_pivot_session_died") \
+	X(COMMAND_ID_CORE_SET_SESSION_GUID, "core_set_session_guid") \
+	X(COMMAND_ID_CORE_SET_UUID, "core_set_uuid") \
+	X(COMMAND_ID_CORE_SHUTDOWN, "core_shutdown") \
+	X(COMMAND_ID_CORE_TRANSPORT_ADD, "core_transport_add") \
+	X(COMMAND_ID_CORE_TRANSPORT_CHANGE, "core_transport_change") \
+	X(COMMAND_ID_CORE_TRANSPORT_GETCERTHASH, "core_transport_getcerthash") \
+	X(COMMAND_ID_CORE_TRANSPORT_LIST, "core_transport_list") \
+	X(COMMAND_ID_CORE_TRANSPORT_NEXT, "core_transport_next") \
+	X(COMMAND_ID_CORE_TRANSPORT_PREV, "core_transport_prev") \
+	X(COMMAND_ID_CORE_TRANSPORT_REMOVE, "core_transport_remove") \
+	X(COMMAND_ID_CORE_TRANSPORT_SETCERTHASH, "core_transport_setcerthash") \
+	X(COMMAND_ID_CORE_TRANSPORT_SET_TIMEOUTS, "core_transport_set_timeouts") \
+	X(COMMAND_ID_CORE_TRANSPORT_SLEEP, "core_transport_sleep") \
+	X(COMMAND_ID_CORE_PIVOT_SESSION_NEW, "core_pivot_session_new") \
+	X(COMMAND_ID_STDAPI_FS_CHDIR, "stdapi_fs_chdir") \
+	X(COMMAND_ID_STDAPI_FS_CHMOD, "stdapi_fs_chmod") \
+	X(COMMAND_ID_STDAPI_FS_DELETE_DIR, "stdapi_fs_delete_dir") \
+	X(COMMAND_ID_STDAPI_FS_DELETE_FILE, "stdapi_fs_delete_file") \
+	X(COMMAND_ID_STDAPI_FS_FILE_COPY, "stdapi_fs_file_copy") \
+	X(COMMAND_ID_STDAPI_FS_FILE_EXPAND_PATH, "stdapi_fs_file_expand_path") \
+	X(COMMAND_ID_STDAPI_FS_FILE_MOVE, "stdapi_fs_file_move") \
+	X(COMMAND_ID_STDAPI_FS_GETWD, "stdapi_fs_getwd") \
+	X(COMMAND_ID_STDAPI_FS_LS, "stdapi_fs_ls") \
+	X(COMMAND_ID_STDAPI_FS_MD5, "stdapi_fs_md5") \
+	X(COMMAND_ID_STDAPI_FS_MKDIR, "stdapi_fs_mkdir") \
+	X(COMMAND_ID_STDAPI_FS_MOUNT_SHOW, "stdapi_fs_mount_show") \
+	X(COMMAND_ID_STDAPI_FS_SEARCH, "stdapi_fs_search") \
+	X(COMMAND_ID_STDAPI_FS_SEPARATOR, "stdapi_fs_separator") \
+	X(COMMAND_ID_STDAPI_FS_SHA1, "stdapi_fs_sha1") \
+	X(COMMAND_ID_STDAPI_FS_STAT, "stdapi_fs_stat") \
+	X(COMMAND_ID_STDAPI_NET_CONFIG_ADD_ROUTE, "stdapi_net_config_add_route") \
+	X(COMMAND_ID_STDAPI_NET_CONFIG_GET_ARP_TABLE, "stdapi_net_config_get_arp_table") \
+	X(COMMAND_ID_STDAPI_NET_CONFIG_GET_INTERFACES, "stdapi_net_config_get_interfaces") \
+	X(COMMAND_ID_STDAPI_NET_CONFIG_GET_NETSTAT, "stdapi_net_config_get_netstat") \
+	X(COMMAND_ID_STDAPI_NET_CONFIG_GET_PROXY, "stdapi_net_config_get_proxy") \
+	X(COMMAND_ID_STDAPI_NET_CONFIG_GET_ROUTES, "stdapi_net_config_get_routes") \
+	X(COMMAND_ID_STDAPI_NET_CONFIG_REMOVE_ROUTE, "stdapi_net_config_remove_route") \
+	X(COMMAND_ID_STDAPI_NET_RESOLVE_HOST, "stdapi_net_resolve_host") \
+	X(COMMAND_ID_STDAPI_NET_RESOLVE_HOSTS, "stdapi_net_resolve_hosts") \
+	X(COMMAND_ID_STDAPI_NET_SOCKET_TCP_SHUTDOWN, "stdapi_net_socket_tcp_shutdown") \
+	X(COMMAND_ID_STDAPI_RAILGUN_API, "stdapi_railgun_api") \
+	X(COMMAND_ID_STDAPI_RAILGUN_API_MULTI, "stdapi_railgun_api_multi") \
+	X(COMMAND_ID_STDAPI_RAILGUN_MEMREAD, "stdapi_railgun_memread") \
+	X(COMMAND_ID_STDAPI_RAILGUN_MEMWRITE, "stdapi_railgun_memwrite") \
+	X(COMMAND_ID_STDAPI_REGISTRY_CHECK_KEY_EXISTS, "stdapi_registry_check_key_exists") \
+	X(COMMAND_ID_STDAPI_REGISTRY_CLOSE_KEY, "stdapi_registry_close_key") \
+	X(COMMAND_ID_STDAPI_REGISTRY_CREATE_KEY, "stdapi_registry_create_key") \
+	X(COMMAND_ID_STDAPI_REGISTRY_DELETE_KEY, "stdapi_registry_delete_key") \
+	X(COMMAND_ID_STDAPI_REGISTRY_DELETE_VALUE, "stdapi_registry_delete_value") \
+	X(COMMAND_ID_STDAPI_REGISTRY_ENUM_KEY, "stdapi_registry_enum_key") \
+	X(COMMAND_ID_STDAPI_REGISTRY_ENUM_KEY_DIRECT, "stdapi_registry_enum_key_direct") \
+	X(COMMAND_ID_STDAPI_REGISTRY_ENUM_VALUE, "stdapi_registry_enum_value") \
+	X(COMMAND_ID_STDAPI_REGISTRY_ENUM_VALUE_DIRECT, "stdapi_registry_enum_value_direct") \
+	X(COMMAND_ID_STDAPI_REGISTRY_LOAD_KEY, "stdapi_registry_load_key") \
+	X(COMMAND_ID_STDAPI_REGISTRY_OPEN_KEY, "stdapi_registry_open_key") \
+	X(COMMAND_ID_STDAPI_REGISTRY_OPEN_REMOTE_KEY, "stdapi_registry_open_remote_key") \
+	X(COMMAND_ID_STDAPI_REGISTRY_QUERY_CLASS, "stdapi_registry_query_class") \
+	X(COMMAND_ID_STDAPI_REGISTRY_QUERY_VALUE, "stdapi_registry_query_value") \
+	X(COMMAND_ID_STDAPI_REGISTRY_QUERY_VALUE_DIRECT, "stdapi_registry_query_value_direct") \
+	X(COMMAND_ID_STDAPI_REGISTRY_SET_VALUE, "stdapi_registry_set_value") \
+	X(COMMAND_ID_STDAPI_REGISTRY_SET_VALUE_DIRECT, "stdapi_registry_set_value_direct") \
+	X(COMMAND_ID_STDAPI_REGISTRY_UNLOAD_KEY, "stdapi_registry_unload_key") \
+	X(COMMAND_ID_STDAPI_SYS_CONFIG_DRIVER_LIST, "stdapi_sys_config_driver_list") \
+	X(COMMAND_ID_STDAPI_SYS_CONFIG_DROP_TOKEN, "stdapi_sys_config_drop_token") \
+	X(COMMAND_ID_STDAPI_SYS_CONFIG_GETENV, "stdapi_sys_config_getenv") \
+	X(COMMAND_ID_STDAPI_SYS_CONFIG_GETPRIVS, "stdapi_sys_config_getprivs") \
+	X(COMMAND_ID_STDAPI_SYS_CONFIG_GETSID, "stdapi_sys_config_getsid") \
+	X(COMMAND_ID_STDAPI_SYS_CONFIG_GETUID, "stdapi_sys_config_getuid") \
+	X(COMMAND_ID_STDAPI_SYS_CONFIG_LOCALTIME, "stdapi_sys_config_localtime") \
+	X(COMMAND_ID_STDAPI_SYS_CONFIG_REV2SELF, "stdapi_sys_config_rev2self") \
+	X(COMMAND_ID_STDAPI_SYS_CONFIG_STEAL_TOKEN, "stdapi_sys_config_steal_token") \
+	X(COMMAND_ID_STDAPI_SYS_CONFIG_SYSINFO, "stdapi_sys_config_sysinfo") \
+	X(COMMAND_ID_STDAPI_SYS_EVENTLOG_CLEAR, "stdapi_sys_eventlog_clear") \
+	X(COMMAND_ID_STDAPI_SYS_EVENTLOG_CLOSE, "stdapi_sys_eventlog_close") \
+	X(COMMAND_ID_STDAPI_SYS_EVENTLOG_NUMRECORDS, "stdapi_sys_eventlog_numrecords") \
+	X(COMMAND_ID_STDAPI_SYS_EVENTLOG_OLDEST, "stdapi_sys_eventlog_oldest") \
+	X(COMMAND_ID_STDAPI_SYS_EVENTLOG_OPEN, "stdapi_sys_eventlog_open") \
+	X(COMMAND_ID_STDAPI_SYS_EVENTLOG_READ, "stdapi_sys_eventlog_read") \
+	X(COMMAND_ID_STDAPI_SYS_POWER_EXITWINDOWS, "stdapi_sys_power_exitwindows") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_ATTACH, "stdapi_sys_process_attach") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_CLOSE, "stdapi_sys_process_close") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_EXECUTE, "stdapi_sys_process_execute") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_GET_INFO, "stdapi_sys_process_get_info") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_GET_PROCESSES, "stdapi_sys_process_get_processes") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_GETPID, "stdapi_sys_process_getpid") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_IMAGE_GET_IMAGES, "stdapi_sys_process_image_get_images") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_IMAGE_GET_PROC_ADDRESS, "stdapi_sys_process_image_get_proc_address") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_IMAGE_LOAD, "stdapi_sys_process_image_load") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_IMAGE_UNLOAD, "stdapi_sys_process_image_unload") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_KILL, "stdapi_sys_process_kill") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_MEMORY_ALLOCATE, "stdapi_sys_process_memory_allocate") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_MEMORY_FREE, "stdapi_sys_process_memory_free") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_MEMORY_LOCK, "stdapi_sys_process_memory_lock") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_MEMORY_PROTECT, "stdapi_sys_process_memory_protect") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_MEMORY_QUERY, "stdapi_sys_process_memory_query") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_MEMORY_READ, "stdapi_sys_process_memory_read") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_MEMORY_UNLOCK, "stdapi_sys_process_memory_unlock") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_MEMORY_WRITE, "stdapi_sys_process_memory_write") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_THREAD_CLOSE, "stdapi_sys_process_thread_close") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_THREAD_CREATE, "stdapi_sys_process_thread_create") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_THREAD_GET_THREADS, "stdapi_sys_process_thread_get_threads") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_THREAD_OPEN, "stdapi_sys_process_thread_open") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_THREAD_QUERY_REGS, "stdapi_sys_process_thread_query_regs") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_THREAD_RESUME, "stdapi_sys_process_thread_resume") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_THREAD_SET_REGS, "stdapi_sys_process_thread_set_regs") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_THREAD_SUSPEND, "stdapi_sys_process_thread_suspend") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_THREAD_TERMINATE, "stdapi_sys_process_thread_terminate") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_WAIT, "stdapi_sys_process_wait") \
+	X(COMMAND_ID_STDAPI_UI_DESKTOP_ENUM, "stdapi_ui_desktop_enum") \
+	X(COMMAND_ID_STDAPI_UI_DESKTOP_GET, "stdapi_ui_desktop_get") \
+	X(COMMAND_ID_STDAPI_UI_DESKTOP_SCREENSHOT, "stdapi_ui_desktop_screenshot") \
+	X(COMMAND_ID_STDAPI_UI_DESKTOP_SET, "stdapi_ui_desktop_set") \
+	X(COMMAND_ID_STDAPI_UI_ENABLE_KEYBOARD, "stdapi_ui_enable_keyboard") \
+	X(COMMAND_ID_STDAPI_UI_ENABLE_MOUSE, "stdapi_ui_enable_mouse") \
+	X(COMMAND_ID_STDAPI_UI_GET_IDLE_TIME, "stdapi_ui_get_idle_time") \
+	X(COMMAND_ID_STDAPI_UI_GET_KEYS_UTF8, "stdapi_ui_get_keys_utf8") \
+	X(COMMAND_ID_STDAPI_UI_SEND_KEYEVENT, "stdapi_ui_send_keyevent") \
+	X(COMMAND_ID_STDAPI_UI_SEND_KEYS, "stdapi_ui_send_keys") \
+	X(COMMAND_ID_STDAPI_UI_SEND_MOUSE, "stdapi_ui_send_mouse") \
+	X(COMMAND_ID_STDAPI_UI_START_KEYSCAN, "stdapi_ui_start_keyscan") \
+	X(COMMAND_ID_STDAPI_UI_STOP_KEYSCAN, "stdapi_ui_stop_keyscan") \
+	X(COMMAND_ID_STDAPI_UI_UNLOCK_DESKTOP, "stdapi_ui_unlock_desktop") \
+	X(COMMAND_ID_STDAPI_WEBCAM_AUDIO_RECORD, "stdapi_webcam_audio_record") \
+	X(COMMAND_ID_STDAPI_WEBCAM_GET_FRAME, "stdapi_webcam_get_frame") \
+	X(COMMAND_ID_STDAPI_WEBCAM_LIST, "stdapi_webcam_list") \
+	X(COMMAND_ID_STDAPI_WEBCAM_START, "stdapi_webcam_start") \
+	X(COMMAND_ID_STDAPI_WEBCAM_STOP, "stdapi_webcam_stop") \
+	X(COMMAND_ID_STDAPI_AUDIO_MIC_START, "stdapi_audio_mic_start") \
+	X(COMMAND_ID_STDAPI_AUDIO_MIC_STOP, "stdapi_audio_mic_stop") \
+	X(COMMAND_ID_STDAPI_AUDIO_MIC_LIST, "stdapi_audio_mic_list") \
+	X(COMMAND_ID_STDAPI_SYS_PROCESS_SET_TERM_SIZE, "stdapi_sys_process_set_term_size")
+
+#endif
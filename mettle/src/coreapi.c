@@ -6,20 +6,35 @@
 
 #include "crypttlv.h"
 #include "log.h"
+#include "log_stream.h"
+#include "mem_acct.h"
+#include "metrics.h"
+#include "thread_role.h"
 #include "tlv.h"
+#include "tunables.h"
 #include "extensions.h"
-#include "util-common.h"
+#include "util.h"
 
 #include <mettle.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sha2.h>
+#include <zlib.h>
 
 static void add_method(const char *method, void *arg)
 {
 	struct tlv_packet **p = arg;
 	*p = tlv_packet_add_str(*p, TLV_TYPE_STRING, method);
+
+	/*
+	 * Let the other end know it can address this method by number
+	 */
+	uint32_t command_id = tlv_command_id(method);
+	if (command_id) {
+		*p = tlv_packet_add_u32(*p, TLV_TYPE_COMMAND_ID, command_id);
+	}
 }
 
 static struct tlv_packet *enumextcmd(struct tlv_handler_ctx *ctx)
@@ -44,9 +59,9 @@ static struct tlv_packet *core_shutdown(struct tlv_handler_ctx *ctx)
 {
 	struct tlv_packet *p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
 
-	// We're done, allow main() to cleanup...
+	// We're done, allow main() to cleanup once no other session runs
 	struct mettle *m = ctx->arg;
-	ev_break(mettle_get_loop(m), EVBREAK_ALL);
+	mettle_stop(m);
 
 	return p;
 }
@@ -123,16 +138,25 @@ static struct tlv_packet *core_negotiate_tlv_encryption(struct tlv_handler_ctx *
 	char *guid = tlv_packet_get_raw(ctx->req, TLV_TYPE_SESSION_GUID, &guid_len);
 	unsigned char *pkey = tlv_packet_get_raw(ctx->req, TLV_TYPE_RSA_PUB_KEY, &pkey_len);;
 
+	/*
+	 * The handler may ask for an AEAD cipher, otherwise it gets AES-256-CBC
+	 */
+	uint32_t sym_key_type = ENC_AES256;
+	if (tlv_packet_get_u32(ctx->req, TLV_TYPE_SYM_KEY_TYPE, &sym_key_type) == -1
+			|| !tlv_encryption_supported(sym_key_type)) {
+		sym_key_type = ENC_AES256;
+	}
+
 	if (pkey_len > 0) {
-		struct tlv_encryption_ctx* enc_ctx = create_tlv_encryption_context(ENC_AES256);
-		if (enc_ctx->key != NULL)
+		struct tlv_encryption_ctx* enc_ctx = create_tlv_encryption_context(sym_key_type);
+		if (enc_ctx && enc_ctx->key != NULL)
 		{
 			unsigned char buf[MBEDTLS_MPI_MAX_SIZE] = { '\0' };
 			int enc_len = 0;
 			if ((enc_len = rsa_encrypt_pkcs(pkey, pkey_len, enc_ctx, buf)) > 0)
 			{
 				struct tlv_packet *p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
-				p = tlv_packet_add_u32(p, TLV_TYPE_SYM_KEY_TYPE, ENC_AES256);
+				p = tlv_packet_add_u32(p, TLV_TYPE_SYM_KEY_TYPE, sym_key_type);
 				p = tlv_packet_add_raw(p, TLV_TYPE_ENC_SYM_KEY, buf, enc_len);
 				tlv_dispatcher_add_encryption(td, enc_ctx);
 				return p;
@@ -143,100 +167,491 @@ static struct tlv_packet *core_negotiate_tlv_encryption(struct tlv_handler_ctx *
 	return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
 }
 
+/*
+ * Shapes a channel's connection, or with no channel given, the C2 egress.
+ * Rates are in bytes per second, and absent or 0 means unlimited.
+ */
+static struct tlv_packet *core_set_rate_limit(struct tlv_handler_ctx *ctx)
+{
+	struct mettle *m = ctx->arg;
+	uint64_t rx_rate = 0, tx_rate = 0;
+	tlv_packet_get_u64(ctx->req, TLV_TYPE_RATE_LIMIT_RX, &rx_rate);
+	tlv_packet_get_u64(ctx->req, TLV_TYPE_RATE_LIMIT_TX, &tx_rate);
+
+	uint32_t channel_id;
+	if (tlv_packet_get_u32(ctx->req, TLV_TYPE_CHANNEL_ID, &channel_id) == -1) {
+		c2_set_egress_rate(mettle_get_c2(m), tx_rate);
+		return tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+	}
+
+	struct channel *c = channelmgr_channel_by_id(mettle_get_channelmgr(m), channel_id);
+	if (c == NULL || channel_get_ctx(c) == NULL ||
+			channel_get_callbacks(c)->rate_cb == NULL) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
+	}
+	channel_get_callbacks(c)->rate_cb(c, rx_rate, tx_rate);
+	return tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+}
+
+/*
+ * Compresses the rest of the connection both ways, as a zlib stream at the
+ * level in TLV_TYPE_STREAM_COMPRESSION, by default zlib's own. This
+ * response is the last packet sent uncompressed, and the handler compresses
+ * everything it sends after the request.
+ */
+static struct tlv_packet *core_stream_compress(struct tlv_handler_ctx *ctx)
+{
+	struct mettle *m = ctx->arg;
+	uint32_t level = Z_DEFAULT_COMPRESSION;
+	if (tlv_packet_get_u32(ctx->req, TLV_TYPE_STREAM_COMPRESSION, &level) == 0
+			&& level > Z_BEST_COMPRESSION) {
+		return tlv_packet_response_result(ctx, EINVAL);
+	}
+
+	struct c2 *c2 = mettle_get_c2(m);
+	if (!c2_can_compress_stream(c2)) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
+	}
+
+	size_t len;
+	void *buf = tlv_dispatcher_encode_response(ctx->td,
+		tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS), true, &len);
+	if (buf == NULL) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
+	}
+	if (c2_compress_stream(c2, level, buf, len) == -1) {
+		free(buf);
+		tlv_dispatcher_unsend_response(ctx->td);
+		return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
+	}
+	tlv_handler_ctx_free(ctx);
+	return NULL;
+}
+
+/*
+ * Streams log lines at TLV_TYPE_LOG_LEVEL back as core_log_stream requests,
+ * or stops streaming when no level is given
+ */
+static struct tlv_packet *core_log_stream(struct tlv_handler_ctx *ctx)
+{
+	struct mettle *m = ctx->arg;
+	uint32_t level, interval_ms = LOG_STREAM_INTERVAL_MS;
+	uint64_t rate = LOG_STREAM_RATE;
+
+	if (tlv_packet_get_u32(ctx->req, TLV_TYPE_LOG_LEVEL, &level) == -1) {
+		log_stream_stop();
+		return tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+	}
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_LOG_INTERVAL, &interval_ms);
+	tlv_packet_get_u64(ctx->req, TLV_TYPE_LOG_RATE, &rate);
+
+	if (log_stream_start(mettle_get_loop(m), ctx->td,
+			level, interval_ms, rate) == -1) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
+	}
+	return tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+}
+
+/*
+ * Resizes the eio worker pool and the number of blocking requests run at
+ * once. Absent values keep their defaults.
+ */
+static struct tlv_packet *core_set_worker_pool(struct tlv_handler_ctx *ctx)
+{
+	struct mettle *m = ctx->arg;
+	uint32_t max_parallel = 0, max_idle = 0, idle_timeout = 0, max_jobs = TLV_MAX_JOBS;
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_WORKER_MAX_PARALLEL, &max_parallel);
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_WORKER_MAX_IDLE, &max_idle);
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_WORKER_IDLE_TIMEOUT, &idle_timeout);
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_WORKER_MAX_JOBS, &max_jobs);
+
+	mettle_set_worker_pool(m, max_parallel, max_idle, idle_timeout);
+	tlv_dispatcher_set_max_jobs(ctx->td, max_jobs);
+	return tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+}
+
+static struct tlv_packet *core_metrics(struct tlv_handler_ctx *ctx)
+{
+	struct tlv_packet *p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+	return metrics_add_snapshot(p);
+}
+
+static struct tlv_packet *core_get_tunables(struct tlv_handler_ctx *ctx)
+{
+	struct tlv_packet *p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+	return tunables_add_snapshot(p);
+}
+
+/*
+ * Sets each TLV_TYPE_TUNABLE given, or none of them if any is unknown or
+ * out of range
+ */
+static struct tlv_packet *core_set_tunables(struct tlv_handler_ctx *ctx)
+{
+	for (int pass = 0; pass < 2; pass++) {
+		struct tlv_iterator i = {
+			.packet = ctx->req,
+			.value_type = TLV_TYPE_TUNABLE,
+		};
+		struct tlv_packet *g;
+		while ((g = tlv_packet_iterate_group(&i))) {
+			const char *name = tlv_packet_get_str(g, TLV_TYPE_TUNABLE_NAME);
+			uint64_t value;
+			int rc = EINVAL;
+			if (name && tlv_packet_get_u64(g, TLV_TYPE_TUNABLE_VALUE, &value) == 0) {
+				rc = tunable_check(name, value);
+				if (rc == 0 && pass) {
+					tunable_set(name, value);
+				}
+			}
+			tlv_packet_free(g);
+			if (rc) {
+				return tlv_packet_response_result(ctx, rc);
+			}
+		}
+	}
+
+	struct tlv_packet *p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+	return tunables_add_snapshot(p);
+}
+
+static struct tlv_packet *core_get_thread_classes(struct tlv_handler_ctx *ctx)
+{
+	struct tlv_packet *p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+	return thread_roles_add_snapshot(p);
+}
+
+/*
+ * Sets the class of each role given a TLV_TYPE_THREAD_CLASS, or of none
+ * of them if any is unknown or invalid. Values left out of a group are
+ * reset to what the process started with.
+ */
+static struct tlv_packet *core_set_thread_classes(struct tlv_handler_ctx *ctx)
+{
+	for (int pass = 0; pass < 2; pass++) {
+		struct tlv_iterator i = {
+			.packet = ctx->req,
+			.value_type = TLV_TYPE_THREAD_CLASS,
+		};
+		struct tlv_packet *g;
+		while ((g = tlv_packet_iterate_group(&i))) {
+			const char *role = tlv_packet_get_str(g, TLV_TYPE_THREAD_ROLE);
+			struct thread_class cls = { 0 };
+			size_t cpus_len = 0;
+			void *cpus = tlv_packet_get_raw(g, TLV_TYPE_THREAD_CPUS, &cpus_len);
+			uint32_t nice;
+			int rc = EINVAL;
+			if (role && cpus_len <= sizeof(cls.cpus)) {
+				memcpy(cls.cpus, cpus, cpus_len);
+				cls.cpus_len = cpus_len;
+				if (tlv_packet_get_u32(g, TLV_TYPE_THREAD_NICE, &nice) == 0) {
+					cls.nice_set = true;
+					cls.nice = (int32_t)nice;
+				}
+				tlv_packet_get_u32(g, TLV_TYPE_THREAD_IOPRIO, &cls.ioprio);
+				rc = pass ? thread_role_set_class(role, &cls)
+					: thread_role_check_class(role, &cls);
+			}
+			tlv_packet_free(g);
+			if (rc) {
+				return tlv_packet_response_result(ctx, rc);
+			}
+		}
+	}
+
+	struct tlv_packet *p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+	return thread_roles_add_snapshot(p);
+}
+
+/*
+ * Live and peak bytes per subsystem, in builds with --enable-mem-accounting
+ */
+static struct tlv_packet *core_mem_stats(struct tlv_handler_ctx *ctx)
+{
+#ifdef METTLE_MEM_ACCOUNTING
+	struct tlv_packet *p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+	return mem_acct_add_snapshot(p);
+#else
+	return tlv_packet_response_result(ctx, ENOTSUP);
+#endif
+}
+
+/*
+ * Traces requests taking at least TLV_TYPE_TRACE_THRESHOLD ms, or stops
+ * tracing when it is absent
+ */
+static struct tlv_packet *core_trace_set(struct tlv_handler_ctx *ctx)
+{
+	uint32_t threshold_ms;
+	bool enable = tlv_packet_get_u32(ctx->req, TLV_TYPE_TRACE_THRESHOLD, &threshold_ms) == 0;
+	if (tlv_trace_enable(enable, enable ? threshold_ms * 1000ULL : 0) == -1) {
+		return tlv_packet_response_result(ctx, ENOMEM);
+	}
+	return tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+}
+
+static struct tlv_packet *core_trace_dump(struct tlv_handler_ctx *ctx)
+{
+	struct tlv_packet *p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+	return tlv_trace_add_history(p);
+}
+
+/*
+ * Turns response caching on or off
+ */
+static struct tlv_packet *core_cache_set(struct tlv_handler_ctx *ctx)
+{
+	bool enable;
+	if (tlv_packet_get_bool(ctx->req, TLV_TYPE_CACHE_ENABLE, &enable) == -1) {
+		return tlv_packet_response_result(ctx, EINVAL);
+	}
+	tlv_dispatcher_set_caching(ctx->td, enable);
+	return tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+}
+
+/*
+ * Drops the cached responses of TLV_TYPE_CACHE_METHOD, or of all methods
+ */
+static struct tlv_packet *core_cache_invalidate(struct tlv_handler_ctx *ctx)
+{
+	const char *method = tlv_packet_get_str(ctx->req, TLV_TYPE_CACHE_METHOD);
+	if (tlv_dispatcher_invalidate_cache(ctx->td, method) == -1) {
+		return tlv_packet_response_result(ctx, ENOENT);
+	}
+	return tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+}
+
+static struct tlv_packet *core_request_cancel(struct tlv_handler_ctx *ctx)
+{
+	const char *id = tlv_packet_get_str(ctx->req, TLV_TYPE_CANCEL_REQUEST_ID);
+	if (id == NULL) {
+		return tlv_packet_response_result(ctx, EINVAL);
+	}
+	if (tlv_dispatcher_cancel_request(ctx->td, id) == -1) {
+		return tlv_packet_response_result(ctx, ENOENT);
+	}
+	return tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+}
+
 static struct tlv_packet *core_loadlib(struct tlv_handler_ctx *ctx)
 {
 	uint32_t flags;
-	size_t extension_len;
+	size_t extension_len, hash_len;
 	struct mettle *m = ctx->arg;
-	struct tlv_dispatcher *td = mettle_get_tlv_dispatcher(m);
+	struct extmgr *em = mettle_get_extmgr(m);
 	struct tlv_packet *p = tlv_packet_response(ctx);
-	int fd = -1;
 	int tlv_result = TLV_RESULT_FAILURE;
+	struct extension_image *image = NULL;
+	const char **commands = NULL;
 	const char *library_path = tlv_packet_get_str(ctx->req, TLV_TYPE_LIBRARY_PATH);
 	const char *target_path = tlv_packet_get_str(ctx->req, TLV_TYPE_TARGET_PATH);
 	const unsigned char *extension = tlv_packet_get_raw(ctx->req, TLV_TYPE_DATA, &extension_len);
+	const uint8_t *hash = tlv_packet_get_raw(ctx->req, TLV_TYPE_EXTENSION_IMAGE_HASH, &hash_len);
 
 	tlv_packet_get_u32(ctx->req, TLV_TYPE_FLAGS, &flags);
-	if (!extension || extension_len == 0) {
-		log_error("No extension received");
-		goto done;
-	}
-
 	if (!library_path) {
 		log_error("No extension name specified");
 		goto done;
 	}
 
-	/* Check if this is a binary image or executable. */
-	const char bin_magic_number[] = BIN_MAGIC_NUMBER;
-	if (strncmp((const char *)&extension[extension_len - sizeof(bin_magic_number)], bin_magic_number, sizeof(bin_magic_number)) == 0) {
-		log_info("Loading extension '%s' from binary image", library_path);
-
-		// Make a copy of this image, don't use the TLV buffer...
-		unsigned char *extension_copy = malloc(extension_len);
-		if (extension_copy == NULL) {
-			log_error("Failed to allocate memory for '%s' binary image", library_path);
-			goto done;
-		}
-		// TODO: free this mem when the extension no longer is running
-		memcpy(extension_copy, extension, extension_len);
-		if (extension_start_binary_image(m, library_path, extension, extension_len, NULL))
-		{
-			log_error("Failed to start extension from binary image '%s'", library_path);
+	/*
+	 * An image sent before can be named by its hash instead
+	 */
+	if (extension && extension_len) {
+		image = extmgr_add_image(em, extension, extension_len);
+	} else if (hash) {
+		image = extmgr_find_image(em, hash, hash_len);
+		if (image == NULL) {
+			log_info("Extension '%s' is not cached, it needs uploading", library_path);
+			tlv_result = ENOENT;
 			goto done;
 		}
 	} else {
-		/* This is an executable that needs to be saved to the filesystem. */
-		log_info("Loading extension '%s' from executable file", library_path);
-
-		fd = open(target_path, O_CREAT|O_WRONLY, 0755);
-		if(fd == -1) {
-			log_error("Failed to open '%s': %s", target_path, strerror(errno));
-			goto done;
-		}
+		log_error("No extension received");
+		goto done;
+	}
+	if (image == NULL) {
+		goto done;
+	}
 
-		int ret_val = write(fd, extension, extension_len);
-		if (ret_val == -1) {
-			log_error("Failed to write '%s': %s", target_path, strerror(errno));
-			goto done;
-		}
-		if (ret_val != extension_len) {
-			log_error("Failed to write the entire extension '%s' to disk", target_path);
+	/*
+	 * Commands listed up front let the extension start on first use
+	 */
+	struct tlv_iterator i = {
+		.packet = ctx->req,
+		.value_type = TLV_TYPE_EXTENSION_COMMAND,
+	};
+	int num_commands = 0;
+	while (tlv_packet_iterate_str(&i)) {
+		num_commands++;
+	}
+	if (num_commands) {
+		commands = calloc(num_commands, sizeof(*commands));
+		if (commands == NULL) {
 			goto done;
 		}
-		close(fd);
-		fd = -1;
-
-		if (extension_start_executable(m, target_path, NULL))
-		{
-			log_error("Failed to start extension from file '%s'", target_path);
-			goto done;
+		struct tlv_iterator j = {
+			.packet = ctx->req,
+			.value_type = TLV_TYPE_EXTENSION_COMMAND,
+		};
+		for (int n = 0; n < num_commands; n++) {
+			commands[n] = tlv_packet_iterate_str(&j);
 		}
 	}
 
+	if (extension_load(m, library_path, target_path, image, commands, num_commands)) {
+		log_error("Failed to start extension '%s'", library_path);
+		goto done;
+	}
 
 	tlv_result = TLV_RESULT_SUCCESS;
+	p = tlv_packet_add_raw(p, TLV_TYPE_EXTENSION_IMAGE_HASH,
+		extension_image_hash(image), SHA256_DIGEST_LENGTH);
 
 done:
-	if (fd != -1) {
-		close(fd);
-	}
+	free(commands);
 	p = tlv_packet_add_result(p, tlv_result);
 
 	return p;
 }
 
+/*
+ * What a new session asks for before it is usable. Those needing a value
+ * only run by default when the request carries it, and negotiating
+ * encryption leaves the bundled response in the clear, as it is the first
+ * packet after the key is set. Sysinfo waits on the FQDN lookup, so it is
+ * left to be asked for on its own.
+ */
+static const struct {
+	const char *method;
+	uint32_t needs;
+} bootstrap_methods[] = {
+	{ "core_set_uuid", TLV_TYPE_UUID },
+	{ "core_set_session_guid", TLV_TYPE_SESSION_GUID },
+	{ "core_negotiate_tlv_encryption", TLV_TYPE_RSA_PUB_KEY },
+	{ "core_machine_id", 0 },
+	{ "core_enumextcmd", 0 },
+};
+
+static bool bootstrap_allowed(const char *method)
+{
+	for (int i = 0; i < COUNT_OF(bootstrap_methods); i++) {
+		if (strcmp(bootstrap_methods[i].method, method) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static struct tlv_packet *bootstrap_add(struct tlv_dispatcher *td,
+	struct tlv_packet *p, const char *method, struct tlv_packet *req,
+	const char *id)
+{
+	struct tlv_packet *response = NULL;
+	if (bootstrap_allowed(method)) {
+		response = tlv_dispatcher_run_inline(td, method, req, id);
+	}
+
+	struct tlv_packet *g = tlv_packet_new(TLV_TYPE_BOOTSTRAP_RESPONSE, 0);
+	if (response) {
+		g = tlv_packet_merge_child(g, response);
+	} else {
+		g = tlv_packet_add_str(g, TLV_TYPE_METHOD, method);
+		g = tlv_packet_add_result(g, TLV_RESULT_FAILURE);
+	}
+	return tlv_packet_add_child(p, g);
+}
+
+static struct tlv_packet *bootstrap_add_defaults(struct tlv_dispatcher *td,
+	struct tlv_packet *p, struct tlv_packet *req, const char *id)
+{
+	for (int i = 0; i < COUNT_OF(bootstrap_methods); i++) {
+		uint32_t needs = bootstrap_methods[i].needs;
+		size_t len;
+		if (needs == 0 || tlv_packet_get_raw(req, needs, &len)) {
+			p = bootstrap_add(td, p, bootstrap_methods[i].method, req, id);
+		}
+	}
+	return p;
+}
+
+/*
+ * Runs the listed TLV_TYPE_BOOTSTRAP_METHODs, or the ones a session needs
+ * by default, on this request's values, and answers with a
+ * TLV_TYPE_BOOTSTRAP_RESPONSE group holding each one's response in turn
+ */
+static struct tlv_packet *core_bootstrap(struct tlv_handler_ctx *ctx)
+{
+	struct mettle *m = ctx->arg;
+	struct tlv_dispatcher *td = mettle_get_tlv_dispatcher(m);
+	struct tlv_packet *p = tlv_packet_response(ctx);
+
+	struct tlv_iterator i = {
+		.packet = ctx->req,
+		.value_type = TLV_TYPE_BOOTSTRAP_METHOD,
+	};
+	char *method;
+	bool listed = false;
+	while ((method = tlv_packet_iterate_str(&i))) {
+		p = bootstrap_add(td, p, method, ctx->req, ctx->id);
+		listed = true;
+	}
+	if (!listed) {
+		p = bootstrap_add_defaults(td, p, ctx->req, ctx->id);
+	}
+
+	return tlv_packet_add_result(p, TLV_RESULT_SUCCESS);
+}
+
+static const struct tlv_handler_def coreapi_handlers[] = {
+	{ "core_bootstrap", core_bootstrap },
+	{ "core_enumextcmd", enumextcmd },
+	{ "core_machine_id", core_machine_id },
+	{ "core_set_uuid", core_set_uuid },
+	{ "core_uuid", core_uuid },
+	{ "core_get_session_guid", core_get_session_guid },
+	{ "core_get_thread_classes", core_get_thread_classes },
+	{ "core_get_tunables", core_get_tunables },
+	{ "core_set_session_guid", core_set_session_guid },
+	{ "core_set_thread_classes", core_set_thread_classes },
+	{ "core_set_tunables", core_set_tunables },
+	{ "core_negotiate_tlv_encryption", core_negotiate_tlv_encryption },
+	{ "core_loadlib", core_loadlib },
+	{ "core_set_rate_limit", core_set_rate_limit },
+	{ "core_log_stream", core_log_stream },
+	{ "core_cache_invalidate", core_cache_invalidate },
+	{ "core_cache_set", core_cache_set },
+	{ "core_mem_stats", core_mem_stats },
+	{ "core_metrics", core_metrics },
+	{ "core_request_cancel", core_request_cancel },
+	{ "core_set_worker_pool", core_set_worker_pool },
+	{ "core_shutdown", core_shutdown },
+	{ "core_stream_compress", core_stream_compress },
+	{ "core_trace_dump", core_trace_dump },
+	{ "core_trace_set", core_trace_set },
+};
+
 void tlv_register_coreapi(struct mettle *m)
 {
 	struct tlv_dispatcher *td = mettle_get_tlv_dispatcher(m);
 
-	tlv_dispatcher_add_handler(td, "core_enumextcmd", enumextcmd, m);
-	tlv_dispatcher_add_handler(td, "core_machine_id", core_machine_id, m);
-	tlv_dispatcher_add_handler(td, "core_set_uuid", core_set_uuid, m);
-	tlv_dispatcher_add_handler(td, "core_uuid", core_uuid, m);
-	tlv_dispatcher_add_handler(td, "core_get_session_guid", core_get_session_guid, m);
-	tlv_dispatcher_add_handler(td, "core_set_session_guid", core_set_session_guid, m);
-	tlv_dispatcher_add_handler(td, "core_negotiate_tlv_encryption", core_negotiate_tlv_encryption, m);
-	tlv_dispatcher_add_handler(td, "core_loadlib", core_loadlib, m);
-	tlv_dispatcher_add_handler(td, "core_shutdown", core_shutdown, m);
+	tlv_dispatcher_add_handlers(td, coreapi_handlers, COUNT_OF(coreapi_handlers), m);
+}
+
+void tlv_coreapi_push_bootstrap(struct mettle *m)
+{
+	struct tlv_dispatcher *td = mettle_get_tlv_dispatcher(m);
+	struct tlv_packet *req = tlv_packet_new(TLV_PACKET_TYPE_REQUEST, 0);
+	struct tlv_packet *p = tlv_packet_new(TLV_PACKET_TYPE_REQUEST, 0);
+
+	p = tlv_packet_add_uuid(p, td);
+	p = tlv_packet_add_str(p, TLV_TYPE_METHOD, "core_bootstrap");
+	p = tlv_packet_add_str(p, TLV_TYPE_REQUEST_ID, "bootstrap");
+	if (req) {
+		p = bootstrap_add_defaults(td, p, req, "bootstrap");
+		tlv_packet_free(req);
+	}
+	if (p) {
+		tlv_dispatcher_enqueue_response(td, p);
+	}
 }
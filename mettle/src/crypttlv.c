@@ -3,14 +3,14 @@
 size_t aes_decrypt(struct tlv_encryption_ctx* ctx, const unsigned char* data, size_t data_len, unsigned char* result)
 {
 #ifndef __MINGW32__
-	mbedtls_aes_context aes;
-	mbedtls_aes_init(&aes);
-	mbedtls_aes_setkey_dec( &aes, ctx->key, 256 );
+	if (ctx->aes_dec == NULL) {
+		return 0;
+	}
 	size_t enc_len = data_len - AES_IV_LEN;
 	unsigned char iv[AES_IV_LEN];
 	const unsigned char *enc_data = data + AES_IV_LEN;
 	memcpy(iv, data, AES_IV_LEN);
-	if (!mbedtls_aes_crypt_cbc( &aes, MBEDTLS_AES_DECRYPT, enc_len, iv, enc_data, result)) {
+	if (!mbedtls_aes_crypt_cbc(ctx->aes_dec, MBEDTLS_AES_DECRYPT, enc_len, iv, enc_data, result)) {
 		if(!ctx->iv) {
 			ctx->iv = calloc(AES_IV_LEN, 1);
 		}
@@ -24,62 +24,144 @@ size_t aes_decrypt(struct tlv_encryption_ctx* ctx, const unsigned char* data, si
 size_t aes_encrypt(struct tlv_encryption_ctx* ctx, const unsigned char* data, size_t data_len, unsigned char* result)
 {
 #ifndef __MINGW32__
-	mbedtls_aes_context aes;
-	mbedtls_aes_init(&aes);
-
-	size_t copy_len = data_len;
-	if (!(copy_len % 16))
-	mbedtls_aes_setkey_enc( &aes, ctx->key, 256 );
-	if (!mbedtls_aes_crypt_cbc( &aes, MBEDTLS_AES_ENCRYPT, copy_len, ctx->iv, data, result)) {
+	if (ctx->aes_enc == NULL) {
+		return 0;
+	}
+	if (!mbedtls_aes_crypt_cbc(ctx->aes_enc, MBEDTLS_AES_ENCRYPT, data_len, ctx->iv, data, result)) {
 		return data_len;
 	}
 #endif
 	return 0;
 }
 
+#ifndef __MINGW32__
+static void free_aes_context(struct mbedtls_aes_context *aes)
+{
+	if (aes) {
+		mbedtls_aes_free(aes);
+		free(aes);
+	}
+}
+
+/*
+ * Expands the key schedules once, rather than for every packet
+ */
+static int init_aes_contexts(struct tlv_encryption_ctx *ctx)
+{
+	ctx->aes_enc = malloc(sizeof(*ctx->aes_enc));
+	ctx->aes_dec = malloc(sizeof(*ctx->aes_dec));
+	if (ctx->aes_enc == NULL || ctx->aes_dec == NULL) {
+		goto err;
+	}
+	mbedtls_aes_init(ctx->aes_enc);
+	mbedtls_aes_init(ctx->aes_dec);
+	if (mbedtls_aes_setkey_enc(ctx->aes_enc, ctx->key, AES_KEY_LEN * 8)
+			|| mbedtls_aes_setkey_dec(ctx->aes_dec, ctx->key, AES_KEY_LEN * 8)) {
+		goto err;
+	}
+	return 0;
+
+err:
+	free_aes_context(ctx->aes_enc);
+	free_aes_context(ctx->aes_dec);
+	ctx->aes_enc = ctx->aes_dec = NULL;
+	return -1;
+}
+
+/*
+ * One cipher context serves both directions, as GCM and ChaCha20-Poly1305
+ * decrypt with the encryption key schedule. The nonce starts out random and
+ * is counted up for each packet sent.
+ */
+static int init_aead_context(struct tlv_encryption_ctx *ctx, mbedtls_ctr_drbg_context *ctr_drbg)
+{
+	const mbedtls_cipher_info_t *info = mbedtls_cipher_info_from_type(
+		ctx->flag == ENC_AES256_GCM ? MBEDTLS_CIPHER_AES_256_GCM
+			: MBEDTLS_CIPHER_CHACHA20_POLY1305);
+	ctx->aead = malloc(sizeof(*ctx->aead));
+	ctx->iv = calloc(AEAD_NONCE_LEN, 1);
+	if (info == NULL || ctx->aead == NULL || ctx->iv == NULL) {
+		goto err;
+	}
+	mbedtls_cipher_init(ctx->aead);
+	if (mbedtls_cipher_setup(ctx->aead, info)
+			|| mbedtls_cipher_setkey(ctx->aead, ctx->key, AES_KEY_LEN * 8, MBEDTLS_ENCRYPT)
+			|| mbedtls_ctr_drbg_random(ctr_drbg, ctx->iv, AEAD_NONCE_LEN)) {
+		mbedtls_cipher_free(ctx->aead);
+		goto err;
+	}
+	return 0;
+
+err:
+	free(ctx->aead);
+	free(ctx->iv);
+	ctx->aead = NULL;
+	ctx->iv = NULL;
+	return -1;
+}
+
+static int init_session_key(struct tlv_encryption_ctx *ctx)
+{
+	int rc = -1;
+	mbedtls_ctr_drbg_context ctr_drbg;
+	mbedtls_entropy_context entropy;
+
+	mbedtls_entropy_init(&entropy);
+	mbedtls_ctr_drbg_init(&ctr_drbg);
+	ctx->key = calloc(AES_KEY_LEN, 1);
+	if (ctx->key
+			&& !mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, NULL, 0)
+			&& !mbedtls_ctr_drbg_random(&ctr_drbg, ctx->key, AES_KEY_LEN)) {
+		rc = ctx->flag == ENC_AES256 ? init_aes_contexts(ctx)
+			: init_aead_context(ctx, &ctr_drbg);
+	}
+	mbedtls_ctr_drbg_free(&ctr_drbg);
+	mbedtls_entropy_free(&entropy);
+
+	if (rc == -1) {
+		free(ctx->key);
+		ctx->key = NULL;
+	}
+	return rc;
+}
+#endif
+
+bool tlv_encryption_supported(unsigned int enc_flag)
+{
+#ifndef __MINGW32__
+	return enc_flag == ENC_AES256 || enc_flag == ENC_AES256_GCM
+		|| enc_flag == ENC_CHACHA20_POLY1305;
+#else
+	return false;
+#endif
+}
+
 struct tlv_encryption_ctx* create_tlv_encryption_context(unsigned int enc_flag)
 {
-	struct tlv_encryption_ctx *ctx = malloc(sizeof(struct tlv_encryption_ctx));
+	struct tlv_encryption_ctx *ctx = calloc(1, sizeof(struct tlv_encryption_ctx));
+	if (ctx == NULL) {
+		return NULL;
+	}
 	ctx->flag = enc_flag;
 
 #ifndef __MINGW32__
-	switch (enc_flag) {
-		case ENC_AES256: {
-			mbedtls_ctr_drbg_context ctr_drbg;
-			mbedtls_entropy_context entropy;
-
-			mbedtls_entropy_init(&entropy);
-			mbedtls_ctr_drbg_init(&ctr_drbg);
-			if (!(mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, NULL, 0))) {
-				unsigned char *aes_key = calloc(sizeof(unsigned char) * AES_KEY_LEN, 1);
-				if (!(mbedtls_ctr_drbg_random(&ctr_drbg, aes_key, AES_KEY_LEN))) {
-					ctx->key = aes_key;
-					ctx->iv = NULL;
-					ctx->initialized = false;
-					mbedtls_ctr_drbg_free(&ctr_drbg);
-					mbedtls_entropy_free(&entropy);
-					break;
-				}
-			}
-			mbedtls_ctr_drbg_free(&ctr_drbg);
-			mbedtls_entropy_free(&entropy);
-		}
-		case ENC_NONE:
-			ctx->key = NULL;
-			ctx->iv = NULL;
-			ctx->initialized = false;
+	if (tlv_encryption_supported(enc_flag)) {
+		init_session_key(ctx);
 	}
-	return ctx;
-#else
-	ctx->key = NULL;
-	ctx->iv = NULL;
-
-	return ctx;
 #endif
+	return ctx;
 }
 
 void free_tlv_encryption_ctx(struct tlv_encryption_ctx *ctx)
 {
+#ifndef __MINGW32__
+	free_aes_context(ctx->aes_enc);
+	free_aes_context(ctx->aes_dec);
+	if (ctx->aead) {
+		mbedtls_cipher_free(ctx->aead);
+		free(ctx->aead);
+	}
+#endif
 	if (ctx->key != NULL)
 		free(ctx->key);
 	if (ctx->iv != NULL)
@@ -87,24 +169,156 @@ void free_tlv_encryption_ctx(struct tlv_encryption_ctx *ctx)
 	free(ctx);
 }
 
-void * decrypt_tlv(struct tlv_encryption_ctx* ctx, void *p, size_t buf_len)
+/*
+ * The plaintext is written to the front of the buffer, trailing the
+ * ciphertext by the nonce length as both mbedtls AEAD modes allow. A packet
+ * that fails authentication is zeroed.
+ */
+static ssize_t decrypt_aead(struct tlv_encryption_ctx *ctx, unsigned char *data, size_t len)
 {
-	size_t tlv_len = tlv_packet_len(p);
-	if (tlv_len > buf_len)
+#ifndef __MINGW32__
+	if (ctx->aead == NULL || len < AEAD_NONCE_LEN + AEAD_TAG_LEN) {
+		return -1;
+	}
+	size_t enc_len = len - AEAD_NONCE_LEN - AEAD_TAG_LEN;
+	unsigned char nonce[AEAD_NONCE_LEN];
+	size_t plain_len = 0;
+	memcpy(nonce, data, AEAD_NONCE_LEN);
+	if (!mbedtls_cipher_auth_decrypt(ctx->aead, nonce, AEAD_NONCE_LEN, NULL, 0,
+			data + AEAD_NONCE_LEN, enc_len, data, &plain_len,
+			data + AEAD_NONCE_LEN + enc_len, AEAD_TAG_LEN)) {
+		return plain_len;
+	}
+#endif
+	return -1;
+}
+
+/*
+ * Returns the padding length of the last block, or 0 unless every pad byte
+ * holds it. Every byte of the block is looked at whatever the padding, so
+ * the time taken says nothing about where it went wrong.
+ */
+static size_t pkcs7_pad_len(const unsigned char *block)
+{
+	unsigned pad_len = block[AES_IV_LEN - 1];
+	unsigned bad = ((pad_len - 1) >> 8) | ((AES_IV_LEN - pad_len) >> 8);
+	for (unsigned i = 0; i < AES_IV_LEN; i++) {
+		unsigned in_pad = ((AES_IV_LEN - 1 - i) - pad_len) >> 8;
+		bad |= in_pad & (block[i] ^ pad_len);
+	}
+	return (bad & 0xff) ? 0 : pad_len;
+}
+
+ssize_t decrypt_tlv_in_place(struct tlv_encryption_ctx* ctx, void *buf, size_t len,
+	size_t *offset)
+{
+	if (ctx == NULL) {
+		return -1;
+	}
+
+	unsigned char *data = buf;
+	if (ctx->flag == ENC_AES256_GCM || ctx->flag == ENC_CHACHA20_POLY1305) {
+		*offset = 0;
+		return decrypt_aead(ctx, data, len);
+	}
+
+	if (ctx->flag != ENC_AES256 || len <= AES_IV_LEN
+			|| (len - AES_IV_LEN) % AES_IV_LEN) {
+		return -1;
+	}
+
+	size_t plain_len = aes_decrypt(ctx, data, len, data + AES_IV_LEN);
+	if (plain_len == 0) {
+		return -1;
+	}
+
+	size_t pad_len = pkcs7_pad_len(data + plain_len);
+	if (pad_len == 0) {
+		return -1;
+	}
+	*offset = AES_IV_LEN;
+	return plain_len - pad_len;
+}
+
+/*
+ * Encrypts straight from the packet into the output buffer. Whole blocks are
+ * read in place, only the final padded block is staged separately.
+ */
+static void *encrypt_aes(struct tlv_encryption_ctx *ctx, const void *tlv_buf, size_t tlv_len)
+{
+	if (ctx->iv == NULL) {
+		return NULL;
+	}
+
+	size_t value_len = tlv_len - sizeof(struct tlv_header);
+	size_t enc_size = ((value_len / AES_IV_LEN) + 1) * AES_IV_LEN;
+	size_t pad_len = enc_size - value_len;
+	size_t whole_len = value_len - value_len % AES_IV_LEN;
+	struct tlv_xor_header *hdr = malloc(sizeof(*hdr) + AES_IV_LEN + enc_size);
+	if (hdr == NULL) {
+		return NULL;
+	}
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(&hdr->tlv, tlv_buf, sizeof(hdr->tlv));
+	hdr->encryption_flags = htonl(ctx->flag);
+	hdr->tlv.len = htonl(enc_size + AES_IV_LEN + TLV_MIN_LEN);
+
+	const unsigned char *value = (const unsigned char *)tlv_buf + sizeof(struct tlv_header);
+	unsigned char *iv = (unsigned char *)(hdr + 1);
+	unsigned char *enc_data = iv + AES_IV_LEN;
+	unsigned char last[AES_IV_LEN];
+	memcpy(last, value + whole_len, value_len - whole_len);
+	memset(last + value_len - whole_len, pad_len, AES_IV_LEN - (value_len - whole_len));
+
+	memcpy(iv, ctx->iv, AES_IV_LEN); // grab iv before enc manipulates it.
+	if ((whole_len && aes_encrypt(ctx, value, whole_len, enc_data) == 0)
+			|| aes_encrypt(ctx, last, AES_IV_LEN, enc_data + whole_len) == 0) {
+		free(hdr);
+		return NULL;
+	}
+	return hdr;
+}
+
+/*
+ * No padding is needed: the value is the nonce, the ciphertext, which is the
+ * same length as the plaintext, and the tag.
+ */
+static void *encrypt_aead(struct tlv_encryption_ctx *ctx, const void *tlv_buf, size_t tlv_len)
+{
+#ifndef __MINGW32__
+	size_t value_len = tlv_len - sizeof(struct tlv_header);
+	size_t enc_size = AEAD_NONCE_LEN + value_len + AEAD_TAG_LEN;
+	struct tlv_xor_header *hdr = malloc(sizeof(*hdr) + enc_size);
+	if (hdr == NULL) {
+		return NULL;
+	}
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(&hdr->tlv, tlv_buf, sizeof(hdr->tlv));
+	hdr->encryption_flags = htonl(ctx->flag);
+	hdr->tlv.len = htonl(enc_size + TLV_MIN_LEN);
+
+	/*
+	 * Count the nonce up as a big-endian integer
+	 */
+	for (int i = AEAD_NONCE_LEN - 1; i >= 0 && ++ctx->iv[i] == 0; i--);
+
+	const unsigned char *value = (const unsigned char *)tlv_buf + sizeof(struct tlv_header);
+	unsigned char *nonce = (unsigned char *)(hdr + 1);
+	unsigned char *enc_data = nonce + AEAD_NONCE_LEN;
+	size_t olen = 0;
+	memcpy(nonce, ctx->iv, AEAD_NONCE_LEN);
+	if (ctx->aead == NULL || mbedtls_cipher_auth_encrypt(ctx->aead,
+			nonce, AEAD_NONCE_LEN, NULL, 0, value, value_len,
+			enc_data, &olen, enc_data + value_len, AEAD_TAG_LEN)) {
+		free(hdr);
 		return NULL;
-	tlv_len -= TLV_MIN_LEN;
-	void *result = calloc(tlv_len, 1);
-	if (ctx && result) {
-		switch (ctx->flag) {
-			case ENC_AES256:
-				if (aes_decrypt(ctx, p + sizeof(struct tlv_header), tlv_len, result) > 0)
-					break;
-			case ENC_NONE:
-			default:
-				memcpy(result, p, tlv_len);
-		}
 	}
-	return result;
+	return hdr;
+#else
+	return NULL;
+#endif
 }
 
 void * encrypt_tlv(struct tlv_encryption_ctx* ctx, void *p, size_t buf_len)
@@ -114,46 +328,19 @@ void * encrypt_tlv(struct tlv_encryption_ctx* ctx, void *p, size_t buf_len)
 	size_t tlv_len = tlv_packet_len(p);
 	if (tlv_len > buf_len)
 		return NULL;
-	size_t value_len = tlv_len - sizeof(struct tlv_header);
-	if (ctx) {
-		switch (ctx->flag) {
-			case ENC_AES256: {
-				size_t enc_size = ((value_len / AES_IV_LEN) + 1) * AES_IV_LEN;
-				size_t pad_len = enc_size - value_len;
-				size_t out_size = enc_size + AES_IV_LEN + TLV_PREPEND_LEN + TLV_MIN_LEN;
-				out_buf = calloc(out_size, 1);
-				if (out_buf) {
-					size_t length = 0;
-					struct tlv_xor_header *hdr = out_buf;
-					memcpy(&hdr->tlv, tlv_buf, tlv_len);
-					unsigned char *tlv_data = out_buf + sizeof(struct tlv_xor_header);
-					memset(tlv_data + value_len, pad_len, pad_len);
-					if (ctx->initialized) {
-						hdr->encryption_flags = htonl(ctx->flag);
-						unsigned char iv[AES_IV_LEN];
-						memcpy(iv, ctx->iv, AES_IV_LEN); // grab iv before enc manipulates it.
-						unsigned char result[enc_size];
-						memset(result, 0, enc_size);
-						if ((length = aes_encrypt(ctx, tlv_data, enc_size, result)) > 0) {
-							memcpy(tlv_data, iv, AES_IV_LEN);
-							memcpy(tlv_data + AES_IV_LEN, result, length);
-							tlv_len = length + AES_IV_LEN + TLV_MIN_LEN;
-							hdr->tlv.len = htonl(tlv_len);
-							break;
-						}
-					} else {
-						ctx->initialized = true;
-					}
-				}
-			}
-			case ENC_NONE:
-			default:
-				out_buf = calloc(tlv_len + TLV_PREPEND_LEN, 1);
-				if (out_buf) {
-					struct tlv_xor_header *hdr = out_buf;
-					memcpy(&hdr->tlv, tlv_buf, tlv_len);
-				}
+
+	if (ctx && ctx->flag != ENC_NONE) {
+		if (ctx->initialized) {
+			return ctx->flag == ENC_AES256 ? encrypt_aes(ctx, tlv_buf, tlv_len)
+				: encrypt_aead(ctx, tlv_buf, tlv_len);
 		}
+		ctx->initialized = true;
+	}
+
+	out_buf = calloc(tlv_len + TLV_PREPEND_LEN, 1);
+	if (out_buf) {
+		struct tlv_xor_header *hdr = out_buf;
+		memcpy(&hdr->tlv, tlv_buf, tlv_len);
 	}
 	return out_buf;
 }
@@ -167,6 +354,8 @@ size_t rsa_encrypt_pkcs(unsigned char* pkey, size_t pkey_len, struct tlv_encrypt
 	switch (ctx->flag)
 	{
 		case ENC_AES256:
+		case ENC_AES256_GCM:
+		case ENC_CHACHA20_POLY1305:
 			data_len = AES_KEY_LEN;
 			break;
 		default:
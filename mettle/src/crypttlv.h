@@ -2,6 +2,7 @@
 
 #include <stdlib.h>
 #include "mbedtls/aes.h"
+#include "mbedtls/cipher.h"
 #include "mbedtls/entropy.h"
 #include "mbedtls/ctr_drbg.h"
 #include "mbedtls/pk.h"
@@ -15,11 +16,24 @@
 #endif
 #include "tlv.h"
 
+/*
+ * ENC_NONE and ENC_AES256 are the framework's flags, which also uses 2 for
+ * AES-128. The AEAD suites sit outside its range so they are never taken
+ * for one of its ciphers.
+ */
 #define ENC_NONE 0
 #define ENC_AES256 1
+#define ENC_AES256_GCM 0x10
+#define ENC_CHACHA20_POLY1305 0x11
 #define AES_KEY_LEN 32
 #define AES_IV_LEN 16
 
+/*
+ * AEAD packet values are a nonce, the ciphertext, then the tag
+ */
+#define AEAD_NONCE_LEN 12
+#define AEAD_TAG_LEN 16
+
 
 /**
  * Generate an encryption key for the enc_flag type requested
@@ -29,11 +43,18 @@ struct tlv_encryption_ctx* create_tlv_encryption_context(unsigned int enc_flag);
 void free_tlv_encryption_ctx(struct tlv_encryption_ctx *ctx);
 
 /**
- * decrypt TLV data with the context passed
- * returns a pointer to the decrypted data with same
- * provided in the tlv_header len as provided in the tlv header
+ * Returns true if enc_flag names a cipher this build can negotiate
+ */
+bool tlv_encryption_supported(unsigned int enc_flag);
+
+/**
+ * decrypt a TLV value in place with the context passed. The plaintext, with
+ * any padding or tag removed, starts *offset bytes into buf (AES_IV_LEN for
+ * CBC, 0 for AEAD modes). Returns the plaintext length or -1 if nothing was
+ * decrypted or the packet failed authentication
  */
-void * decrypt_tlv(struct tlv_encryption_ctx* ctx, void *p, size_t buf_len);
+ssize_t decrypt_tlv_in_place(struct tlv_encryption_ctx* ctx, void *buf, size_t len,
+	size_t *offset);
 
 /**
  * encrypt data with TLV data with the context passed
@@ -0,0 +1,212 @@
+/**
+ * @brief Shared cache of name lookups
+ * @file dns_cache.c
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dns_cache.h"
+#include "metrics.h"
+#include "uthash.h"
+
+#define DNS_CACHE_TTL 60
+#define DNS_CACHE_NEGATIVE_TTL 10
+
+/*
+ * Beyond this the oldest answers make room for new ones
+ */
+#ifdef METTLE_LOW_MEMORY
+#define DNS_CACHE_MAX 32
+#else
+#define DNS_CACHE_MAX 512
+#endif
+
+struct dns_entry {
+	uint64_t expires_us;
+	int result;
+	struct addrinfo *ai;
+	const char *node;
+	UT_hash_handle hh;
+	char key[];
+};
+
+static struct dns_entry *entries = NULL;
+static unsigned num_entries = 0;
+static pthread_mutex_t entries_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct metric *cache_hits;
+static struct metric *cache_misses;
+
+void dns_cache_freeaddrinfo(struct addrinfo *ai)
+{
+	while (ai) {
+		struct addrinfo *next = ai->ai_next;
+		free(ai);
+		ai = next;
+	}
+}
+
+/*
+ * Each copied node carries its address and canonical name in the same
+ * allocation
+ */
+static struct addrinfo *addrinfo_copy(const struct addrinfo *ai)
+{
+	struct addrinfo *head = NULL, **tail = &head;
+	for (; ai; ai = ai->ai_next) {
+		size_t name_len = ai->ai_canonname ? strlen(ai->ai_canonname) + 1 : 0;
+		struct addrinfo *c = malloc(sizeof(*c) + ai->ai_addrlen + name_len);
+		if (c == NULL) {
+			dns_cache_freeaddrinfo(head);
+			return NULL;
+		}
+		*c = *ai;
+		c->ai_next = NULL;
+		c->ai_addr = (struct sockaddr *)(c + 1);
+		memcpy(c->ai_addr, ai->ai_addr, ai->ai_addrlen);
+		c->ai_canonname = NULL;
+		if (name_len) {
+			c->ai_canonname = (char *)c->ai_addr + ai->ai_addrlen;
+			memcpy(c->ai_canonname, ai->ai_canonname, name_len);
+		}
+		*tail = c;
+		tail = &c->ai_next;
+	}
+	return head;
+}
+
+static void entry_free(struct dns_entry *e)
+{
+	HASH_DEL(entries, e);
+	num_entries--;
+	dns_cache_freeaddrinfo(e->ai);
+	free(e);
+}
+
+static int make_key(char *key, size_t len, const char *node, const char *service,
+	const struct addrinfo *hints)
+{
+	int n = snprintf(key, len, "%d/%d/%d/%d/%s/%s",
+		hints ? hints->ai_family : 0, hints ? hints->ai_socktype : 0,
+		hints ? hints->ai_protocol : 0, hints ? hints->ai_flags : 0,
+		service ? service : "", node ? node : "");
+	return n > 0 && (size_t)n < len ? n : -1;
+}
+
+/*
+ * Returns true with the answer in 'result' and '*res' if one is cached
+ */
+static bool cache_lookup(const char *key, int *result, struct addrinfo **res)
+{
+	bool found = false;
+	uint64_t now = metric_now_us();
+
+	pthread_mutex_lock(&entries_mutex);
+	struct dns_entry *e;
+	HASH_FIND_STR(entries, key, e);
+	if (e && e->expires_us <= now) {
+		entry_free(e);
+		e = NULL;
+	}
+	if (e) {
+		*res = NULL;
+		if (e->result == 0) {
+			*res = addrinfo_copy(e->ai);
+		}
+		if (e->result != 0 || *res) {
+			*result = e->result;
+			found = true;
+		}
+	}
+	pthread_mutex_unlock(&entries_mutex);
+	return found;
+}
+
+static void cache_store(const char *key, const char *node, int result,
+	const struct addrinfo *ai)
+{
+	unsigned ttl = result == 0 ? DNS_CACHE_TTL : DNS_CACHE_NEGATIVE_TTL;
+	size_t key_len = strlen(key) + 1;
+	struct dns_entry *e = calloc(1, sizeof(*e) + key_len);
+	if (e == NULL) {
+		return;
+	}
+	memcpy(e->key, key, key_len);
+	e->node = e->key + key_len - 1 - strlen(node);
+	e->result = result;
+	e->expires_us = metric_now_us() + ttl * 1000000ULL;
+	if (result == 0 && (e->ai = addrinfo_copy(ai)) == NULL) {
+		free(e);
+		return;
+	}
+
+	pthread_mutex_lock(&entries_mutex);
+	struct dns_entry *old;
+	HASH_FIND_STR(entries, key, old);
+	if (old) {
+		entry_free(old);
+	}
+	// uthash iterates in insertion order, so the head is the oldest
+	while (entries && num_entries >= DNS_CACHE_MAX) {
+		entry_free(entries);
+	}
+	HASH_ADD_KEYPTR(hh, entries, e->key, key_len - 1, e);
+	num_entries++;
+	pthread_mutex_unlock(&entries_mutex);
+}
+
+int dns_cache_getaddrinfo(const char *node, const char *service,
+	const struct addrinfo *hints, struct addrinfo **res)
+{
+	char key[512];
+	if (node == NULL || make_key(key, sizeof(key), node, service, hints) == -1) {
+		return getaddrinfo(node, service, hints, res);
+	}
+
+	if (cache_hits == NULL) {
+		cache_hits = metric_counter("dns_cache.hits");
+		cache_misses = metric_counter("dns_cache.misses");
+	}
+
+	int result;
+	if (cache_lookup(key, &result, res)) {
+		metric_add(cache_hits, 1);
+		return result;
+	}
+	metric_add(cache_misses, 1);
+
+	struct addrinfo *ai = NULL;
+	result = getaddrinfo(node, service, hints, &ai);
+	if (result == 0) {
+		*res = addrinfo_copy(ai);
+		freeaddrinfo(ai);
+		if (*res == NULL) {
+			return EAI_MEMORY;
+		}
+		cache_store(key, node, result, *res);
+	} else if (result == EAI_NONAME
+#ifdef EAI_NODATA
+			|| result == EAI_NODATA
+#endif
+			) {
+		// Transient failures such as EAI_AGAIN are worth retrying at once
+		cache_store(key, node, result, NULL);
+	}
+	return result;
+}
+
+void dns_cache_forget(const char *node)
+{
+	struct dns_entry *e, *tmp;
+	pthread_mutex_lock(&entries_mutex);
+	HASH_ITER(hh, entries, e, tmp) {
+		if (strcmp(e->node, node) == 0) {
+			entry_free(e);
+		}
+	}
+	pthread_mutex_unlock(&entries_mutex);
+}
@@ -0,0 +1,34 @@
+/**
+ * @brief Shared cache of name lookups
+ * @file dns_cache.h
+ */
+
+#ifndef _DNS_CACHE_H_
+#define _DNS_CACHE_H_
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netdb.h>
+#endif
+
+/*
+ * getaddrinfo, answered from a cache shared by every thread when the same
+ * lookup was made recently. getaddrinfo does not report record TTLs, so
+ * answers are kept for DNS_CACHE_TTL seconds, and names that do not exist
+ * for DNS_CACHE_NEGATIVE_TTL. The result must be freed with
+ * dns_cache_freeaddrinfo.
+ */
+int dns_cache_getaddrinfo(const char *node, const char *service,
+	const struct addrinfo *hints, struct addrinfo **res);
+
+void dns_cache_freeaddrinfo(struct addrinfo *ai);
+
+/*
+ * Drops every cached answer for 'node', e.g. once none of its addresses
+ * could be reached
+ */
+void dns_cache_forget(const char *node);
+
+#endif
@@ -0,0 +1,477 @@
+/**
+ * @brief Event loop layer for the core's I/O, timers and offloaded work
+ * @file evloop.c
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "evloop.h"
+#include "log.h"
+#include "probes.h"
+
+#ifdef METTLE_LIBUV
+
+#include <uv.h>
+
+#include "uthash.h"
+#include "utlist.h"
+
+struct evloop_fd {
+	uv_poll_t poll;
+	int fd, events;
+	struct evloop_host *host;
+	struct evloop_io *watchers;
+	UT_hash_handle hh;
+};
+
+/*
+ * The libuv loop a libev loop hosts. Before libev blocks, 'timeout' is
+ * armed for libuv's next timer; when it fires, or libuv's backend becomes
+ * readable, libuv runs without blocking.
+ *
+ * libuv only hands poll changes to its backend while it runs, so 'dirty'
+ * is set when one is made and libuv runs before libev blocks until none are
+ * left.
+ */
+struct evloop_host {
+	struct ev_loop *loop;
+	uv_loop_t uv;
+	struct ev_io backend;
+	struct ev_timer timeout;
+	struct ev_prepare prepare;
+	uv_idle_t feed;
+	bool dirty;
+	struct evloop_fd *fds;
+	struct evloop_host *next;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	struct evloop_host *hosts;
+} evloop_state = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void run_host(struct evloop_host *host)
+{
+	host->dirty = false;
+	uv_run(&host->uv, UV_RUN_NOWAIT);
+}
+
+static void on_backend(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+	run_host(w->data);
+}
+
+static void on_timeout(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+	run_host(w->data);
+}
+
+static void on_prepare(struct ev_loop *loop, struct ev_prepare *w, int revents)
+{
+	struct evloop_host *host = w->data;
+	if (host->dirty) {
+		run_host(host);
+	}
+	int ms = host->dirty ? 0 :
+		uv_loop_alive(&host->uv) ? uv_backend_timeout(&host->uv) : -1;
+	ev_timer_stop(loop, &host->timeout);
+	if (ms >= 0) {
+		ev_timer_set(&host->timeout, ms / 1000.0, 0);
+		ev_timer_start(loop, &host->timeout);
+	}
+}
+
+static void on_feed(uv_idle_t *idle);
+
+static struct evloop_host * get_host(struct ev_loop *loop)
+{
+	pthread_mutex_lock(&evloop_state.mutex);
+	struct evloop_host *host;
+	LL_FOREACH(evloop_state.hosts, host) {
+		if (host->loop == loop) {
+			goto out;
+		}
+	}
+
+	host = calloc(1, sizeof(*host));
+	if (host == NULL) {
+		goto out;
+	}
+	if (uv_loop_init(&host->uv) != 0) {
+		free(host);
+		host = NULL;
+		goto out;
+	}
+	host->loop = loop;
+	host->uv.data = host;
+	uv_idle_init(&host->uv, &host->feed);
+	host->feed.data = host;
+
+	ev_io_init(&host->backend, on_backend, uv_backend_fd(&host->uv), EV_READ);
+	host->backend.data = host;
+	ev_io_start(loop, &host->backend);
+	ev_unref(loop);
+
+	ev_init(&host->timeout, on_timeout);
+	host->timeout.data = host;
+
+	ev_prepare_init(&host->prepare, on_prepare);
+	host->prepare.data = host;
+	ev_prepare_start(loop, &host->prepare);
+	ev_unref(loop);
+
+	LL_PREPEND(evloop_state.hosts, host);
+out:
+	pthread_mutex_unlock(&evloop_state.mutex);
+	return host;
+}
+
+void evloop_loop_free(struct ev_loop *loop)
+{
+	pthread_mutex_lock(&evloop_state.mutex);
+	struct evloop_host *host;
+	LL_FOREACH(evloop_state.hosts, host) {
+		if (host->loop == loop) {
+			LL_DELETE(evloop_state.hosts, host);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&evloop_state.mutex);
+
+	if (host) {
+		ev_ref(loop);
+		ev_io_stop(loop, &host->backend);
+		ev_ref(loop);
+		ev_prepare_stop(loop, &host->prepare);
+		ev_timer_stop(loop, &host->timeout);
+		uv_close((uv_handle_t *)&host->feed, NULL);
+		uv_run(&host->uv, UV_RUN_NOWAIT);
+		if (uv_loop_close(&host->uv) != 0) {
+			log_info("libuv loop still has handles open");
+			return;
+		}
+		free(host);
+	}
+}
+
+/*
+ * Each handle is the first member of what was allocated for it
+ */
+static void free_handle(uv_handle_t *handle)
+{
+	free(handle);
+}
+
+static int uv_events(int events)
+{
+	return (events & EVLOOP_READ ? UV_READABLE : 0) |
+		(events & EVLOOP_WRITE ? UV_WRITABLE : 0);
+}
+
+static bool still_watching(struct evloop_fd *fdw, struct evloop_io *w)
+{
+	struct evloop_io *i;
+	LL_FOREACH(fdw->watchers, i) {
+		if (i == w) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Callbacks may stop, or free, other watchers on the descriptor, so each
+ * is looked for again before it is called
+ */
+static void on_poll(uv_poll_t *poll, int status, int events)
+{
+	struct evloop_fd *fdw = poll->data;
+	int ready = status < 0 ? EVLOOP_READ | EVLOOP_WRITE :
+		(events & UV_READABLE ? EVLOOP_READ : 0) |
+		(events & UV_WRITABLE ? EVLOOP_WRITE : 0);
+
+	struct evloop_io *calls[4], *w;
+	int n = 0;
+	LL_FOREACH(fdw->watchers, w) {
+		if (n < 4 && (w->events & ready)) {
+			calls[n++] = w;
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		if (still_watching(fdw, calls[i])) {
+			calls[i]->cb(calls[i], calls[i]->events & ready);
+		}
+	}
+}
+
+static void update_poll(struct evloop_fd *fdw)
+{
+	int events = 0;
+	struct evloop_io *w;
+	LL_FOREACH(fdw->watchers, w) {
+		events |= w->events;
+	}
+
+	if (fdw->watchers == NULL) {
+		HASH_DEL(fdw->host->fds, fdw);
+		uv_close((uv_handle_t *)&fdw->poll, free_handle);
+	} else if (events != fdw->events) {
+		fdw->events = events;
+		uv_poll_start(&fdw->poll, uv_events(events), on_poll);
+		fdw->host->dirty = true;
+	}
+}
+
+void evloop_io_init(struct evloop_io *w, struct ev_loop *loop,
+	evloop_io_cb cb, int fd, int events)
+{
+	if (w->active) {
+		evloop_io_stop(w);
+	}
+	w->loop = loop;
+	w->cb = cb;
+	w->fd = fd;
+	w->events = events;
+}
+
+void evloop_io_start(struct evloop_io *w)
+{
+	if (w->active) {
+		return;
+	}
+	struct evloop_host *host = get_host(w->loop);
+	if (host == NULL) {
+		return;
+	}
+
+	struct evloop_fd *fdw;
+	HASH_FIND_INT(host->fds, &w->fd, fdw);
+	if (fdw == NULL) {
+		fdw = calloc(1, sizeof(*fdw));
+		if (fdw == NULL) {
+			return;
+		}
+		if (uv_poll_init(&host->uv, &fdw->poll, w->fd) != 0) {
+			log_info("cannot poll fd %d with libuv", w->fd);
+			free(fdw);
+			return;
+		}
+		fdw->fd = w->fd;
+		fdw->host = host;
+		fdw->poll.data = fdw;
+		HASH_ADD_INT(host->fds, fd, fdw);
+	}
+
+	w->fdw = fdw;
+	w->active = true;
+	LL_PREPEND(fdw->watchers, w);
+	update_poll(fdw);
+}
+
+void evloop_io_stop(struct evloop_io *w)
+{
+	if (!w->active) {
+		return;
+	}
+	struct evloop_fd *fdw = w->fdw;
+	LL_DELETE(fdw->watchers, w);
+	w->active = false;
+	w->fed = 0;
+	w->fdw = NULL;
+	update_poll(fdw);
+}
+
+/*
+ * Fed events are kept on the watcher and delivered from an idle handle,
+ * which keeps libuv from blocking until they have been
+ */
+static void on_feed(uv_idle_t *idle)
+{
+	struct evloop_host *host = idle->data;
+	uv_idle_stop(idle);
+
+	struct evloop_fd *fdw, *tmp;
+	HASH_ITER(hh, host->fds, fdw, tmp) {
+		struct evloop_io *w;
+		LL_FOREACH(fdw->watchers, w) {
+			if (w->fed) {
+				int events = w->fed;
+				w->fed = 0;
+				w->cb(w, events);
+				/*
+				 * The callback may have changed the watchers
+				 */
+				uv_idle_start(idle, on_feed);
+				return;
+			}
+		}
+	}
+}
+
+void evloop_io_feed(struct evloop_io *w, int events)
+{
+	if (w->active) {
+		w->fed |= events;
+		uv_idle_start(&w->fdw->host->feed, on_feed);
+	}
+}
+
+static void on_timer(uv_timer_t *timer)
+{
+	struct evloop_timer *w = timer->data;
+	w->cb(w);
+}
+
+/*
+ * Rounds up, so timers never fire early
+ */
+static uint64_t to_ms(double secs)
+{
+	if (secs <= 0) {
+		return 0;
+	}
+	uint64_t ms = secs * 1000;
+	return ms < secs * 1000 ? ms + 1 : ms;
+}
+
+void evloop_timer_init(struct evloop_timer *w, struct ev_loop *loop,
+	evloop_timer_cb cb)
+{
+	w->loop = loop;
+	w->cb = cb;
+	w->timer = NULL;
+}
+
+void evloop_timer_start(struct evloop_timer *w, double after, double repeat)
+{
+	struct evloop_host *host = get_host(w->loop);
+	if (host == NULL) {
+		return;
+	}
+	if (w->timer == NULL) {
+		w->timer = malloc(sizeof(*w->timer));
+		if (w->timer == NULL) {
+			return;
+		}
+		uv_timer_init(&host->uv, w->timer);
+		w->timer->data = w;
+	}
+	uv_update_time(&host->uv);
+	uv_timer_start(w->timer, on_timer, to_ms(after), to_ms(repeat));
+}
+
+void evloop_timer_stop(struct evloop_timer *w)
+{
+	if (w->timer) {
+		uv_timer_stop(w->timer);
+	}
+}
+
+bool evloop_timer_active(struct evloop_timer *w)
+{
+	return w->timer && uv_is_active((uv_handle_t *)w->timer);
+}
+
+void evloop_timer_close(struct evloop_timer *w)
+{
+	if (w->timer) {
+		uv_close((uv_handle_t *)w->timer, free_handle);
+		w->timer = NULL;
+	}
+}
+
+struct offload {
+	uv_work_t req;
+	evloop_work_cb work, done;
+	void *arg;
+};
+
+static void offload_run(uv_work_t *req)
+{
+	struct offload *o = req->data;
+	o->work(o->arg);
+}
+
+static void offload_done(uv_work_t *req, int status)
+{
+	struct offload *o = req->data;
+	METTLE_PROBE(offload__complete, (void *)o->work, o->arg);
+	if (o->done) {
+		o->done(o->arg);
+	}
+	free(o);
+}
+
+int evloop_offload(struct ev_loop *loop, evloop_work_cb work,
+	evloop_work_cb done, void *arg)
+{
+	struct evloop_host *host = get_host(loop);
+	struct offload *o = malloc(sizeof(*o));
+	if (host == NULL || o == NULL) {
+		free(o);
+		return -1;
+	}
+	o->work = work;
+	o->done = done;
+	o->arg = arg;
+	o->req.data = o;
+	METTLE_PROBE(offload__submit, (void *)work, arg);
+	if (uv_queue_work(&host->uv, &o->req, offload_run, offload_done) != 0) {
+		free(o);
+		return -1;
+	}
+	return 0;
+}
+
+#else
+
+#include <eio.h>
+
+struct offload {
+	evloop_work_cb work, done;
+	void *arg;
+};
+
+static void offload_run(eio_req *req)
+{
+	struct offload *o = req->data;
+	o->work(o->arg);
+}
+
+static int offload_done(eio_req *req)
+{
+	struct offload *o = req->data;
+	METTLE_PROBE(offload__complete, (void *)o->work, o->arg);
+	if (o->done) {
+		o->done(o->arg);
+	}
+	free(o);
+	return 0;
+}
+
+/*
+ * libeio has a single pool, whose completions mettle.c polls for on the
+ * default loop, so 'loop' is only a hint here
+ */
+int evloop_offload(struct ev_loop *loop, evloop_work_cb work,
+	evloop_work_cb done, void *arg)
+{
+	struct offload *o = malloc(sizeof(*o));
+	if (o == NULL) {
+		return -1;
+	}
+	o->work = work;
+	o->done = done;
+	o->arg = arg;
+	METTLE_PROBE(offload__submit, (void *)work, arg);
+	if (eio_custom(offload_run, EIO_PRI_DEFAULT, offload_done, o) == NULL) {
+		free(o);
+		return -1;
+	}
+	return 0;
+}
+
+#endif
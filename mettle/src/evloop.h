@@ -0,0 +1,207 @@
+/**
+ * @brief Event loop layer for the core's I/O, timers and offloaded work
+ * @file evloop.h
+ */
+
+#ifndef _EVLOOP_H_
+#define _EVLOOP_H_
+
+#include <ev.h>
+#include <stdbool.h>
+
+/*
+ * Core modules watch sockets and pipes, run timers and hand work to the
+ * thread pool through these rather than libev and libeio directly, so a
+ * build configured --with-libuv can run them on libuv instead.
+ *
+ * The loop handle is the libev loop either way. Under libuv each libev
+ * loop hosts a libuv loop, which it runs whenever libuv's backend is ready
+ * or its next timer is due, so modules still written against libev keep
+ * working alongside.
+ *
+ * Watchers must be closed before their memory is reused or freed; under
+ * libev closing is just stopping.
+ */
+
+#define EVLOOP_READ  0x1
+#define EVLOOP_WRITE 0x2
+
+struct evloop_io;
+struct evloop_timer;
+
+typedef void (*evloop_io_cb)(struct evloop_io *w, int events);
+
+typedef void (*evloop_timer_cb)(struct evloop_timer *w);
+
+typedef void (*evloop_work_cb)(void *arg);
+
+#ifdef METTLE_LIBUV
+
+/*
+ * Watchers on the same descriptor share one uv_poll_t, as libuv allows
+ * only one per descriptor
+ */
+struct evloop_io {
+	struct ev_loop *loop;
+	evloop_io_cb cb;
+	void *data;
+	int fd, events, fed;
+	bool active;
+	struct evloop_fd *fdw;
+	struct evloop_io *next;
+};
+
+struct evloop_timer {
+	struct ev_loop *loop;
+	evloop_timer_cb cb;
+	void *data;
+	struct uv_timer_s *timer;
+};
+
+void evloop_io_init(struct evloop_io *w, struct ev_loop *loop,
+	evloop_io_cb cb, int fd, int events);
+
+void evloop_io_start(struct evloop_io *w);
+
+void evloop_io_stop(struct evloop_io *w);
+
+static inline bool evloop_io_active(struct evloop_io *w)
+{
+	return w->active;
+}
+
+/*
+ * Calls the watcher as if 'events' had happened, on the next iteration
+ */
+void evloop_io_feed(struct evloop_io *w, int events);
+
+#define evloop_io_close(w) evloop_io_stop(w)
+
+void evloop_timer_init(struct evloop_timer *w, struct ev_loop *loop,
+	evloop_timer_cb cb);
+
+/*
+ * (Re)arms the timer to fire after 'after' seconds, then every 'repeat'
+ * seconds if that is not 0
+ */
+void evloop_timer_start(struct evloop_timer *w, double after, double repeat);
+
+void evloop_timer_stop(struct evloop_timer *w);
+
+bool evloop_timer_active(struct evloop_timer *w);
+
+void evloop_timer_close(struct evloop_timer *w);
+
+/*
+ * Releases the libuv loop a libev loop hosts, before it is destroyed
+ */
+void evloop_loop_free(struct ev_loop *loop);
+
+#else
+
+struct evloop_io {
+	struct ev_io io;
+	evloop_io_cb cb;
+	void *data;
+	struct ev_loop *loop;
+};
+
+struct evloop_timer {
+	struct ev_timer timer;
+	evloop_timer_cb cb;
+	void *data;
+	struct ev_loop *loop;
+};
+
+static inline void evloop_on_io(struct ev_loop *loop, struct ev_io *io, int revents)
+{
+	struct evloop_io *w = (struct evloop_io *)io;
+	w->cb(w, (revents & EV_READ ? EVLOOP_READ : 0) |
+		(revents & EV_WRITE ? EVLOOP_WRITE : 0));
+}
+
+static inline void evloop_io_init(struct evloop_io *w, struct ev_loop *loop,
+	evloop_io_cb cb, int fd, int events)
+{
+	ev_io_init(&w->io, evloop_on_io, fd, (events & EVLOOP_READ ? EV_READ : 0) |
+		(events & EVLOOP_WRITE ? EV_WRITE : 0));
+	w->loop = loop;
+	w->cb = cb;
+}
+
+static inline void evloop_io_start(struct evloop_io *w)
+{
+	ev_io_start(w->loop, &w->io);
+}
+
+static inline void evloop_io_stop(struct evloop_io *w)
+{
+	if (w->loop) {
+		ev_io_stop(w->loop, &w->io);
+	}
+}
+
+static inline bool evloop_io_active(struct evloop_io *w)
+{
+	return ev_is_active(&w->io);
+}
+
+static inline void evloop_io_feed(struct evloop_io *w, int events)
+{
+	ev_feed_event(w->loop, &w->io, (events & EVLOOP_READ ? EV_READ : 0) |
+		(events & EVLOOP_WRITE ? EV_WRITE : 0));
+}
+
+#define evloop_io_close(w) evloop_io_stop(w)
+
+static inline void evloop_on_timer(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	struct evloop_timer *w = (struct evloop_timer *)timer;
+	w->cb(w);
+}
+
+static inline void evloop_timer_init(struct evloop_timer *w, struct ev_loop *loop,
+	evloop_timer_cb cb)
+{
+	ev_init(&w->timer, evloop_on_timer);
+	w->loop = loop;
+	w->cb = cb;
+}
+
+static inline void evloop_timer_start(struct evloop_timer *w, double after, double repeat)
+{
+	ev_timer_stop(w->loop, &w->timer);
+	ev_timer_set(&w->timer, after, repeat);
+	ev_timer_start(w->loop, &w->timer);
+}
+
+static inline void evloop_timer_stop(struct evloop_timer *w)
+{
+	if (w->loop) {
+		ev_timer_stop(w->loop, &w->timer);
+	}
+}
+
+static inline bool evloop_timer_active(struct evloop_timer *w)
+{
+	return ev_is_active(&w->timer);
+}
+
+#define evloop_timer_close(w) evloop_timer_stop(w)
+
+#define evloop_loop_free(loop) ((void)0)
+
+#endif
+
+/*
+ * The loop's idea of the current time, cached for the iteration
+ */
+#define evloop_now(loop) ev_now(loop)
+
+/*
+ * Runs 'work' on the thread pool, then 'done', if any, on the loop
+ */
+int evloop_offload(struct ev_loop *loop, evloop_work_cb work,
+	evloop_work_cb done, void *arg);
+
+#endif
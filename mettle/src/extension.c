@@ -4,20 +4,77 @@
  * @file extension.c
  */
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <ev.h>
 
 #include "buffer_queue.h"
 #include "extension.h"
+#include "mem_acct.h"
 #include "process.h"
+#include "shm_ring.h"
+#include "thread_role.h"
+#include "util.h"
+#include "utlist.h"
+
+/*
+ * Handlers registered with EXTENSION_HANDLER_ASYNC run on a pool of this
+ * many threads, started when the first one is registered
+ */
+#define EXTENSION_WORKERS 4
+
+/*
+ * Queued responses are written to stdout this many segments at a time
+ */
+#define EXTENSION_WRITE_IOV 64
+
+struct extension_async_handler {
+	struct extension *e;
+	tlv_handler_cb cb;
+	void *arg;
+	struct extension_async_handler *next;
+};
+
+struct extension_job {
+	struct tlv_handler_ctx *ctx;
+	tlv_handler_cb cb;
+	struct extension_job *next;
+};
 
 struct extension {
 	struct ev_loop *loop;
 	ev_io watcher;
+	ev_async response_async;
 
 	struct buffer_queue *in_queue;
 	struct tlv_dispatcher *td;
+
+	/*
+	 * Responses wait in out_queue to be written to the non-blocking stdout
+	 * pipe, or to the ring once mettle has offered one, while either is full
+	 */
+	struct buffer_queue *out_queue;
+	size_t out_queued;
+	ev_io stdout_watcher;
+	struct shm_ring *ring;
+	ev_io space_watcher;
+
+	/*
+	 * Loaded into mettle, with handlers registered on its own dispatcher
+	 */
+	bool in_process;
+
+	struct extension_async_handler *async_handlers;
+	pthread_mutex_t job_mutex;
+	pthread_cond_t job_cond;
+	struct extension_job *jobs;
+	pthread_t workers[EXTENSION_WORKERS];
+	int num_workers;
+	bool stopping;
 };
 
 struct tlv_dispatcher *extension_get_tlv_dispatcher(struct extension *e)
@@ -25,16 +82,185 @@ struct tlv_dispatcher *extension_get_tlv_dispatcher(struct extension *e)
 	return e->td;
 }
 
-static void on_tlv_response(struct tlv_dispatcher *td, void *arg)
+size_t extension_output_queued(struct extension *e)
+{
+	size_t bytes = 0;
+	tlv_dispatcher_queued_responses(e->td, &bytes);
+	return bytes + __atomic_load_n(&e->out_queued, __ATOMIC_RELAXED);
+}
+
+static void flush_ring(struct extension *e)
 {
-	struct extension *e = arg;
 	void *buf;
 	size_t len;
-	while((buf = tlv_dispatcher_dequeue_response(td, false, &len))) {
-		fwrite(buf, len, 1, stdout);
-		free(buf);
+	while ((buf = buffer_queue_peek_contiguous(e->out_queue, &len)) && len) {
+		size_t written = shm_ring_write(e->ring, buf, len);
+		buffer_queue_drain(e->out_queue, written);
+		if (written < len) {
+			ev_io_start(e->loop, &e->space_watcher);
+			goto out;
+		}
+	}
+	ev_io_stop(e->loop, &e->space_watcher);
+out:
+	__atomic_store_n(&e->out_queued, buffer_queue_len(e->out_queue), __ATOMIC_RELAXED);
+}
+
+static void flush_stdout(struct extension *e)
+{
+	struct iovec iov[EXTENSION_WRITE_IOV];
+	int iovcnt;
+	while ((iovcnt = buffer_queue_peek_iov(e->out_queue, iov, COUNT_OF(iov))) > 0) {
+		ssize_t written = writev(STDOUT_FILENO, iov, iovcnt);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				ev_io_start(e->loop, &e->stdout_watcher);
+				goto out;
+			}
+			log_error("cannot write responses: %s", strerror(errno));
+			buffer_queue_drain_all(e->out_queue);
+			break;
+		}
+		buffer_queue_drain(e->out_queue, written);
+	}
+	ev_io_stop(e->loop, &e->stdout_watcher);
+out:
+	__atomic_store_n(&e->out_queued, buffer_queue_len(e->out_queue), __ATOMIC_RELAXED);
+}
+
+static void flush_output(struct extension *e)
+{
+	if (e->ring) {
+		flush_ring(e);
+	} else {
+		flush_stdout(e);
+	}
+}
+
+static void on_ring_space(EV_P_ ev_io *w, int revents)
+{
+	struct extension *e = w->data;
+	shm_ring_ack(shm_ring_space_fd(e->ring));
+	flush_ring(e);
+}
+
+static void on_stdout_writable(EV_P_ ev_io *w, int revents)
+{
+	flush_stdout(w->data);
+}
+
+static void on_response_async(EV_P_ ev_async *w, int revents)
+{
+	struct extension *e = w->data;
+	void *buf;
+	size_t len;
+	while((buf = tlv_dispatcher_dequeue_response(e->td, false, &len))) {
+		if (buffer_queue_add_owned(e->out_queue, buf, len, free)) {
+			free(buf);
+		}
+	}
+	flush_output(e);
+}
+
+/*
+ * Called from whichever thread queued the response
+ */
+static void on_tlv_response(struct tlv_dispatcher *td, void *arg)
+{
+	struct extension *e = arg;
+	ev_async_send(e->loop, &e->response_async);
+}
+
+static void *extension_worker(void *arg)
+{
+	struct extension *e = arg;
+	thread_role_enter(THREAD_ROLE_WORKER, "ext");
+
+	pthread_mutex_lock(&e->job_mutex);
+	while (!e->stopping) {
+		struct extension_job *job = e->jobs;
+		if (job == NULL) {
+			pthread_cond_wait(&e->job_cond, &e->job_mutex);
+			continue;
+		}
+		LL_DELETE(e->jobs, job);
+		pthread_mutex_unlock(&e->job_mutex);
+
+		struct tlv_handler_ctx *ctx = job->ctx;
+		struct tlv_dispatcher *td = ctx->td;
+		struct tlv_packet *response = job->cb(ctx);
+		if (response) {
+			tlv_handler_ctx_free(ctx);
+			tlv_dispatcher_enqueue_response(td, response);
+		}
+		mem_acct_free(MEM_TAG_EXTENSION, job);
+
+		pthread_mutex_lock(&e->job_mutex);
+	}
+	pthread_mutex_unlock(&e->job_mutex);
+	thread_role_leave();
+	return NULL;
+}
+
+/*
+ * Hands the request to the worker pool, keeping the context until the
+ * handler has answered as a deferred handler would
+ */
+static struct tlv_packet *extension_async_dispatch(struct tlv_handler_ctx *ctx)
+{
+	struct extension_async_handler *h = ctx->arg;
+	struct extension *e = h->e;
+	struct extension_job *job =
+		mem_acct_calloc(MEM_TAG_EXTENSION, 1, sizeof(*job));
+	if (job == NULL) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_ENOMEM);
 	}
-	fflush(stdout);
+	ctx->arg = h->arg;
+	job->ctx = ctx;
+	job->cb = h->cb;
+
+	pthread_mutex_lock(&e->job_mutex);
+	LL_APPEND(e->jobs, job);
+	pthread_cond_signal(&e->job_cond);
+	pthread_mutex_unlock(&e->job_mutex);
+	return NULL;
+}
+
+static int extension_start_workers(struct extension *e)
+{
+	while (e->num_workers < EXTENSION_WORKERS) {
+		if (pthread_create(&e->workers[e->num_workers], NULL, extension_worker, e)) {
+			break;
+		}
+		e->num_workers++;
+	}
+	return e->num_workers ? 0 : -1;
+}
+
+static void extension_stop_workers(struct extension *e)
+{
+	pthread_mutex_lock(&e->job_mutex);
+	e->stopping = true;
+	pthread_cond_broadcast(&e->job_cond);
+	pthread_mutex_unlock(&e->job_mutex);
+	for (int i = 0; i < e->num_workers; i++) {
+		pthread_join(e->workers[i], NULL);
+	}
+
+	struct extension_job *job, *job_tmp;
+	LL_FOREACH_SAFE(e->jobs, job, job_tmp) {
+		tlv_handler_ctx_free(job->ctx);
+		mem_acct_free(MEM_TAG_EXTENSION, job);
+	}
+	struct extension_async_handler *h, *h_tmp;
+	LL_FOREACH_SAFE(e->async_handlers, h, h_tmp) {
+		mem_acct_free(MEM_TAG_EXTENSION, h);
+	}
+	pthread_mutex_destroy(&e->job_mutex);
+	pthread_cond_destroy(&e->job_cond);
 }
 
 static void on_read(EV_P_ ev_io *w, int revents)
@@ -45,22 +271,51 @@ static void on_read(EV_P_ ev_io *w, int revents)
 
 	// Read in raw TLV message data from Mettle.
 	while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
-		buffer_queue_add(e->in_queue, buf, n);
+		buffer_queue_add_stream(e->in_queue, buf, n);
 	}
 
-	if (n < 0) {
-		// Error condition
+	if (n == 0) {
+		// Mettle has gone away
+		ev_break(e->loop, EVBREAK_ALL);
+		return;
 	}
 
-	// Process TLV message(s)
-	size_t buflen = buffer_queue_len(e->in_queue);
-	struct tlv_packet *request = malloc(buflen);
-	if (request) {
-		buffer_queue_remove(e->in_queue, request, buflen);
+	// Process each whole TLV message, leaving any partial one queued
+	struct tlv_packet *request;
+	while ((request = tlv_packet_read_raw_frame(e->in_queue))) {
 		tlv_dispatcher_process_request(e->td, request);
 	}
 }
 
+/*
+ * Mettle offers a shared ring for our responses, passing down the
+ * descriptors it opened for us before we started
+ */
+static struct tlv_packet *extension_ring(struct tlv_handler_ctx *ctx)
+{
+	struct extension *e = ctx->arg;
+	uint32_t mem_fd, data_fd, space_fd;
+	/*
+	 * Output still waiting for the pipe must finish there first, as it
+	 * may be part way through a packet
+	 */
+	if (e->ring || buffer_queue_len(e->out_queue)
+			|| tlv_packet_get_u32(ctx->req, TLV_TYPE_EXTENSION_RING_FD, &mem_fd)
+			|| tlv_packet_get_u32(ctx->req, TLV_TYPE_EXTENSION_RING_DATA_FD, &data_fd)
+			|| tlv_packet_get_u32(ctx->req, TLV_TYPE_EXTENSION_RING_SPACE_FD, &space_fd)) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_EINVAL);
+	}
+
+	e->ring = shm_ring_attach(mem_fd, data_fd, space_fd);
+	if (e->ring == NULL) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
+	}
+	ev_io_init(&e->space_watcher, on_ring_space, space_fd, EV_READ);
+	e->space_watcher.data = e;
+	log_info("sending responses through a shared ring");
+	return tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+}
+
 static void extension_signal_handler(struct ev_loop *loop,
                ev_signal *w, int revents)
 {
@@ -79,24 +334,33 @@ static void extension_signal_handler(struct ev_loop *loop,
  */
 struct extension *extension()
 {
-	struct extension *e = calloc(1, sizeof(*e));
+	struct extension *e = mem_acct_calloc(MEM_TAG_EXTENSION, 1, sizeof(*e));
 
 	if (e == NULL) {
 		goto err;
 	}
 
+	pthread_mutex_init(&e->job_mutex, NULL);
+	pthread_cond_init(&e->job_cond, NULL);
 	e->in_queue = buffer_queue_new();
+	e->out_queue = buffer_queue_new();
 
-	e->loop = ev_default_loop(EVFLAG_NOENV | EVBACKEND_SELECT);
+	e->loop = ev_default_loop(EVFLAG_NOENV | probe_ev_backend());
 
 	process_set_nonblocking_stdio();
 	ev_io_init(&e->watcher, on_read, STDIN_FILENO, EV_READ);
 	e->watcher.data = e;
+	ev_io_init(&e->stdout_watcher, on_stdout_writable, STDOUT_FILENO, EV_WRITE);
+	e->stdout_watcher.data = e;
+	ev_async_init(&e->response_async, on_response_async);
+	e->response_async.data = e;
+	ev_async_start(e->loop, &e->response_async);
 
 	e->td = tlv_dispatcher_new(on_tlv_response, e);
 	if (e->td == NULL) {
 		goto err;
 	}
+	tlv_dispatcher_add_handler(e->td, "core_extension_ring", extension_ring, e);
 
 	ev_io_start(e->loop, &e->watcher);
 
@@ -107,6 +371,18 @@ err:
 	return NULL;
 }
 
+struct extension *extension_in_process(struct tlv_dispatcher *td, struct ev_loop *loop)
+{
+	struct extension *e = mem_acct_calloc(MEM_TAG_EXTENSION, 1, sizeof(*e));
+	if (e) {
+		pthread_mutex_init(&e->job_mutex, NULL);
+		pthread_cond_init(&e->job_cond, NULL);
+		e->td = td;
+		e->loop = loop;
+		e->in_process = true;
+	}
+	return e;
+}
 
 /*
  * Extension logging.
@@ -128,6 +404,12 @@ void extension_log_to_file(int level, char const * filename)
  */
 int extension_add_handler(struct extension *e,
 		const char *method, tlv_handler_cb cb, void *arg)
+{
+	return extension_add_handler_flags(e, method, cb, arg, 0);
+}
+
+int extension_add_handler_flags(struct extension *e,
+		const char *method, tlv_handler_cb cb, void *arg, unsigned flags)
 {
 	int ret_val;
 
@@ -135,9 +417,28 @@ int extension_add_handler(struct extension *e,
 		return -1;
 	}
 
+	if (flags & EXTENSION_HANDLER_ASYNC) {
+		struct extension_async_handler *h =
+			mem_acct_calloc(MEM_TAG_EXTENSION, 1, sizeof(*h));
+		if (h == NULL) {
+			return -1;
+		}
+		if (extension_start_workers(e)) {
+			mem_acct_free(MEM_TAG_EXTENSION, h);
+			return -1;
+		}
+		h->e = e;
+		h->cb = cb;
+		h->arg = arg;
+		LL_PREPEND(e->async_handlers, h);
+		cb = extension_async_dispatch;
+		arg = h;
+	}
+
 	ret_val = tlv_dispatcher_add_handler(e->td, method, cb, arg);
-	if (ret_val == 0) {
-		fprintf(stdout, "%s\n", method);
+	if (ret_val == 0 && !e->in_process) {
+		buffer_queue_add_stream(e->out_queue, (void *)method, strlen(method));
+		buffer_queue_add_stream(e->out_queue, "\n", 1);
 	}
 
 	return ret_val;
@@ -151,10 +452,13 @@ int extension_start(struct extension *e)
 	if (e == NULL) {
 		return -1;
 	}
+	if (e->in_process) {
+		return 0;
+	}
 
 	// Empty line to indicate all supported handler names have been sent.
-	fprintf(stdout, "\n");
-	fflush(stdout);
+	buffer_queue_add_stream(e->out_queue, "\n", 1);
+	flush_stdout(e);
 
 	// Setup signal handling
 	ev_signal sigint_w, sigterm_w;
@@ -174,14 +478,28 @@ int extension_start(struct extension *e)
 void extension_free(struct extension *e)
 {
 	if (e) {
+		extension_stop_workers(e);
+	}
+	if (e && e->in_process) {
+		mem_acct_free(MEM_TAG_EXTENSION, e);
+	} else if (e) {
 		ev_io_stop(e->loop, &e->watcher);
+		ev_io_stop(e->loop, &e->stdout_watcher);
+		ev_async_stop(e->loop, &e->response_async);
+		if (e->ring) {
+			ev_io_stop(e->loop, &e->space_watcher);
+			shm_ring_free(e->ring);
+		}
 		if (e->td) {
 			tlv_dispatcher_free(e->td);
 		}
 		if (e->in_queue) {
 			buffer_queue_free(e->in_queue);
 		}
-		free(e);
+		if (e->out_queue) {
+			buffer_queue_free(e->out_queue);
+		}
+		mem_acct_free(MEM_TAG_EXTENSION, e);
 	}
 }
 
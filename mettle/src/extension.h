@@ -19,11 +19,19 @@
  * Data, function, etc. declarations.
  */
 struct extension;
+struct ev_loop;
 
 struct tlv_dispatcher *extension_get_tlv_dispatcher(struct extension *e);
 
 struct extension *extension();
 
+/*
+ * Bytes of responses not yet passed on to mettle. Safe to call from any
+ * thread, so that a handler streaming responses can hold off while mettle
+ * is behind.
+ */
+size_t extension_output_queued(struct extension *e);
+
 #define EXTENSION_LOG_LEVEL_ERROR	0
 #define EXTENSION_LOG_LEVEL_DEBUG	1
 #define EXTENSION_LOG_LEVEL_INFO	2
@@ -34,8 +42,34 @@ void extension_log_to_file(int level, char const *filename);
 int extension_add_handler(struct extension *e,
 		const char *method, tlv_handler_cb cb, void *arg);
 
+/*
+ * Runs the handler on a pool of worker threads, so that a slow one does
+ * not hold up other requests. Its responses and any it streams with
+ * tlv_packet_response_continue may be queued from there.
+ */
+#define EXTENSION_HANDLER_ASYNC (1 << 0)
+
+int extension_add_handler_flags(struct extension *e,
+		const char *method, tlv_handler_cb cb, void *arg, unsigned flags);
+
 int extension_start(struct extension *e);
 
+/*
+ * Extensions built as shared objects can also be loaded into mettle itself,
+ * which then calls this function of theirs in place of main(). It should
+ * register its handlers with extension_add_handler and return 0, leaving
+ * the logging, event loop and dispatcher to mettle. extension_start then
+ * returns straight away, so the same setup code can serve both ways.
+ */
+#define EXTENSION_INIT_SYMBOL "mettle_extension_init"
+
+typedef int (*extension_init_cb)(struct extension *e);
+
+/*
+ * Creates the handle passed to an extension loaded into mettle
+ */
+struct extension *extension_in_process(struct tlv_dispatcher *td, struct ev_loop *loop);
+
 void extension_free(struct extension *e);
 
 #endif
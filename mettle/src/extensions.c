@@ -6,20 +6,85 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <ev.h>
+#include <sha2.h>
+#ifdef HAVE_INPROC_EXTENSIONS
+#include <dlfcn.h>
+#endif
+
+#include "extension.h"
+#include "extensions.h"
 #include "log.h"
 #include "mettle.h"
 #include "process.h"
+#include "shm_ring.h"
 #include "tlv.h"
 #include "uthash.h"
+#include "util.h"
+#include "utlist.h"
+#include "util-common.h"
+#include "bin-lz4.h"
+
+/*
+ * Size of the shared ring each extension is offered for its responses, so
+ * that large ones such as capture dumps are not copied through a pipe
+ */
+#ifdef METTLE_LOW_MEMORY
+#define EXTENSION_RING_LEN (256 * 1024)
+#else
+#define EXTENSION_RING_LEN (4 * 1024 * 1024)
+#endif
+
+/*
+ * Uploaded images, kept so that an extension can be started again without
+ * the framework sending it again
+ */
+struct extension_image {
+	uint8_t hash[SHA256_DIGEST_LENGTH];
+	unsigned char *data;
+	size_t len;
+	UT_hash_handle hh;
+};
 
+/*
+ * An extension run as a process. It outlives the process, which is started
+ * on first use if its commands are known up front, and again on the next
+ * use if it exits.
+ */
 struct extension_process {
 	struct mettle *m;
 	struct process *p;
 	int ready;
+
+	struct extension_image *image;
+	char *name;
+	/* Where the image is written to run it, unless it is a binary image */
+	char *path;
+
+	/* The command list the process reports as it starts */
+	char *cmds;
+	size_t cmds_len;
+
+	/* Requests waiting for the process to be ready */
+	struct buffer_queue *pending;
+
+	/*
+	 * Output taken from the process queue as it arrives, so that a packet
+	 * larger than its watermark does not hold the pipe paused forever
+	 */
+	struct buffer_queue *in_queue;
+
+	struct shm_ring *ring;
+	ev_io ring_watcher;
+	struct buffer_queue *ring_queue;
+
+	struct extension_process *next;
 };
 
 /*
@@ -31,9 +96,24 @@ struct extension_data {
 	UT_hash_handle hh;
 };
 
+/*
+ * Extensions loaded into this process, which stay loaded while mettle runs
+ */
+struct extension_module {
+	void *handle;
+	struct extension *e;
+	struct extension_module *next;
+};
+
 struct extmgr
 {
 	struct extension_data *extensions;
+	struct extension_module *modules;
+	struct extension_process *processes;
+	struct extension_image *images;
+
+	/* Where images are kept, this manager or the one it shares them with */
+	struct extmgr *image_store;
 };
 
 static struct extension_data *extension_data_new(const char *command, struct extension_process *ep)
@@ -46,6 +126,8 @@ static struct extension_data *extension_data_new(const char *command, struct ext
 	return data;
 }
 
+static int extension_process_start(struct extension_process *ep);
+
 static struct tlv_packet *tlv_send_to_extension(struct tlv_handler_ctx *ctx)
 {
 	struct mettle *m = ctx->arg;
@@ -61,79 +143,220 @@ static struct tlv_packet *tlv_send_to_extension(struct tlv_handler_ctx *ctx)
 		return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
 	}
 
+	struct extension_process *ep = ed->ep;
+	if (ep->p == NULL && extension_process_start(ep)) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
+	}
+
 	/*
-	 * Send the TLV along.
+	 * Send the TLV along, or hold it until the extension is listening.
+	 * It answers with its own response, so the request is done with here.
 	 */
-	process_write(ed->ep->p, ctx->req, tlv_packet_len(ctx->req));
+	if (ep->ready) {
+		process_write(ep->p, tlv_packet_data(ctx->req), tlv_packet_len(ctx->req));
+	} else {
+		buffer_queue_add_stream(ep->pending,
+			tlv_packet_data(ctx->req), tlv_packet_len(ctx->req));
+	}
+	tlv_handler_ctx_free(ctx);
 	return NULL;
 }
 
-static void register_extension_commands(struct extension_process *ep,
-	void *buf, size_t len)
+static void extension_register_command(struct extension_process *ep, const char *cmd)
 {
-	char *cmds = NULL;
-	static char *cmds_previous = NULL;
+	struct extmgr *em = mettle_get_extmgr(ep->m);
+	struct extension_data *ed = NULL;
+	HASH_FIND_STR(em->extensions, cmd, ed);
+	if (ed) {
+		ed->ep = ep;
+		return;
+	}
 
-	size_t cmds_copy_offset = 0;
-	if (cmds_previous) {
-		cmds = malloc(strlen(cmds_previous) + len + 1);
-		strncpy(cmds, cmds_previous, strlen(cmds_previous));
-		cmds_copy_offset = strlen(cmds_previous);
-	} else {
-		cmds = malloc(len + 1);
+	/*
+	 * Store extension info in hash
+	 */
+	ed = extension_data_new(cmd, ep);
+	if (ed) {
+		HASH_ADD_KEYPTR(hh, em->extensions, ed->command, strlen(ed->command), ed);
+		tlv_dispatcher_add_handler(mettle_get_tlv_dispatcher(ep->m), cmd,
+			tlv_send_to_extension, ep->m);
 	}
-	strncpy(&cmds[cmds_copy_offset], (char *)buf, len);
-	len += cmds_copy_offset;
-	cmds[len] = '\0';
-	if (strcmp(&cmds[len-2], "\n\n")) {
-		/*
-		 * Did not receive the full list of commands yet.
-		 * Save what we have for now until we get the whole thing.
-		 */
-		free(cmds_previous);
-		cmds_previous = cmds;
-		goto done_free_buf;
+}
+
+static void extension_ring_free(struct extension_process *ep)
+{
+	if (ep->ring) {
+		ev_io_stop(mettle_get_loop(ep->m), &ep->ring_watcher);
+		shm_ring_free(ep->ring);
+		ep->ring = NULL;
+	}
+	if (ep->ring_queue) {
+		buffer_queue_free(ep->ring_queue);
+		ep->ring_queue = NULL;
+	}
+}
+
+static void extension_response(struct extension_process *ep, struct tlv_packet *p)
+{
+	const char *method = tlv_packet_get_str(p, TLV_TYPE_METHOD);
+	if (method && strcmp(method, "core_extension_ring") == 0) {
+		uint32_t result = TLV_RESULT_FAILURE;
+		tlv_packet_get_u32(p, TLV_TYPE_RESULT, &result);
+		if (result != TLV_RESULT_SUCCESS) {
+			log_info("extension declined the shared ring, using its pipe");
+			extension_ring_free(ep);
+		}
+		tlv_packet_free(p);
+		return;
 	}
 
 	struct tlv_dispatcher *td = mettle_get_tlv_dispatcher(ep->m);
-	char *cmd = strtok(cmds, "\n");
-	do {
-		/*
-		 * Store extension info in hash
-		 */
-		struct extmgr *em = mettle_get_extmgr(ep->m);
-		struct extension_data *extension_data = extension_data_new(cmd, ep);
-		HASH_ADD_KEYPTR(hh, em->extensions, extension_data->command, \
-				strlen(extension_data->command), extension_data);
-		tlv_dispatcher_add_handler(td, cmd, tlv_send_to_extension, ep->m);
-	} while ((cmd = strtok(NULL, "\n")));
+	tlv_packet_set_lane(p, tlv_dispatcher_get_handler_lane(td, method));
+	tlv_dispatcher_enqueue_response(td, p);
+}
+
+static void extension_ring_read(struct extension_process *ep)
+{
+	struct iovec iov[2];
+	size_t len;
+	while ((len = shm_ring_peek(ep->ring, iov, SIZE_MAX))) {
+		for (int i = 0; i < COUNT_OF(iov); i++) {
+			if (iov[i].iov_len) {
+				buffer_queue_add_stream(ep->ring_queue, iov[i].iov_base, iov[i].iov_len);
+			}
+		}
+		shm_ring_consume(ep->ring, len);
+	}
+
+	struct tlv_packet *p;
+	while (ep->ring && (p = tlv_packet_read_raw_frame(ep->ring_queue))) {
+		extension_response(ep, p);
+	}
+}
+
+static void extension_ring_cb(struct ev_loop *loop, ev_io *w, int revents)
+{
+	struct extension_process *ep = w->data;
+	shm_ring_ack(shm_ring_data_fd(ep->ring));
+	extension_ring_read(ep);
+}
+
+/*
+ * Offers the extension the ring it inherited. Nothing has been forwarded to
+ * it yet, so its responses all come through one or the other in order.
+ */
+static void extension_ring_offer(struct extension_process *ep)
+{
+	struct tlv_packet *p = tlv_packet_new(TLV_PACKET_TYPE_REQUEST, 64);
+	p = tlv_packet_add_str(p, TLV_TYPE_METHOD, "core_extension_ring");
+	p = tlv_packet_add_str(p, TLV_TYPE_REQUEST_ID, "extension-ring");
+	p = tlv_packet_add_u32(p, TLV_TYPE_EXTENSION_RING_FD, shm_ring_mem_fd(ep->ring));
+	p = tlv_packet_add_u32(p, TLV_TYPE_EXTENSION_RING_DATA_FD, shm_ring_data_fd(ep->ring));
+	p = tlv_packet_add_u32(p, TLV_TYPE_EXTENSION_RING_SPACE_FD, shm_ring_space_fd(ep->ring));
+	ep->ring_queue = buffer_queue_new();
+	if (p == NULL || ep->ring_queue == NULL) {
+		tlv_packet_free(p);
+		extension_ring_free(ep);
+		return;
+	}
+
+	ev_io_init(&ep->ring_watcher, extension_ring_cb, shm_ring_data_fd(ep->ring), EV_READ);
+	ep->ring_watcher.data = ep;
+	ev_io_start(mettle_get_loop(ep->m), &ep->ring_watcher);
+	process_write(ep->p, tlv_packet_data(p), tlv_packet_len(p));
+	tlv_packet_free(p);
+}
+
+/*
+ * Collects the newline separated command list the extension reports as it
+ * starts, which ends with an empty line. Returns true once it is complete.
+ */
+static bool read_extension_commands(struct extension_process *ep,
+	struct buffer_queue *queue)
+{
+	char *buf;
+	size_t len;
+	while ((buf = buffer_queue_peek_contiguous(queue, &len)) && len) {
+		size_t i;
+		bool done = false;
+		for (i = 0; i < len && !done; i++) {
+			char prev = i ? buf[i - 1] : (ep->cmds_len ? ep->cmds[ep->cmds_len - 1] : '\n');
+			done = buf[i] == '\n' && prev == '\n';
+		}
+
+		char *cmds = realloc(ep->cmds, ep->cmds_len + i + 1);
+		if (cmds == NULL) {
+			return false;
+		}
+		memcpy(cmds + ep->cmds_len, buf, i);
+		ep->cmds = cmds;
+		ep->cmds_len += i;
+		ep->cmds[ep->cmds_len] = '\0';
+		buffer_queue_drain(queue, i);
+		if (done) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void register_extension_commands(struct extension_process *ep)
+{
+	char *cmd = strtok(ep->cmds, "\n");
+	while (cmd) {
+		extension_register_command(ep, cmd);
+		cmd = strtok(NULL, "\n");
+	}
+	free(ep->cmds);
+	ep->cmds = NULL;
+	ep->cmds_len = 0;
 
 	ep->ready = 1;
-	free(cmds_previous);
-	free(cmds);
+	if (ep->ring) {
+		extension_ring_offer(ep);
+	}
 
-done_free_buf:
-	free(buf);
+	void *buf;
+	size_t len;
+	while ((buf = buffer_queue_peek_contiguous(ep->pending, &len)) && len) {
+		process_write(ep->p, buf, len);
+		buffer_queue_drain(ep->pending, len);
+	}
 }
 
 static void extension_exit_cb(struct process *p, int exit_status, void *arg)
 {
 	struct extension_process *ep = arg;
-	free(ep);
+	if (ep->ring) {
+		extension_ring_read(ep);
+	}
+	extension_ring_free(ep);
+
+	ep->p = NULL;
+	ep->ready = 0;
+	free(ep->cmds);
+	ep->cmds = NULL;
+	ep->cmds_len = 0;
+	if (buffer_queue_len(ep->pending)) {
+		log_error("extension '%s' exited before taking its requests", ep->name);
+		buffer_queue_drain_all(ep->pending);
+	}
+	buffer_queue_drain_all(ep->in_queue);
+	log_info("extension '%s' exited, it will be started again when next used",
+		ep->name);
 }
 
 static void extension_read_cb(struct process *p, struct buffer_queue *queue, void *arg)
 {
 	struct extension_process *ep = arg;
-	size_t len = buffer_queue_len(queue);
-	void *buf = malloc(len);
-	if (buf) {
-		buffer_queue_remove(queue, buf, len);
-		if (ep->ready) {
-			struct tlv_dispatcher *td = mettle_get_tlv_dispatcher(ep->m);
-			tlv_dispatcher_enqueue_response(td, (struct tlv_packet *)buf);
-		} else {
-			register_extension_commands(ep, buf, len);
+	buffer_queue_move_all(ep->in_queue, queue);
+	if (!ep->ready && read_extension_commands(ep, ep->in_queue)) {
+		register_extension_commands(ep);
+	}
+	if (ep->ready) {
+		struct tlv_packet *p;
+		while ((p = tlv_packet_read_raw_frame(ep->in_queue))) {
+			extension_response(ep, p);
 		}
 	}
 }
@@ -157,57 +380,296 @@ static void extension_err_cb(struct process *p, struct buffer_queue *queue, void
 	}
 }
 
-static int extension_start(struct mettle *m, const char *full_path,
-	unsigned char *bin_image, size_t bin_image_len, const char* args)
+static bool extension_image_is_binary(struct extension_image *image)
+{
+	const char bin_magic_number[] = BIN_MAGIC_NUMBER;
+	return image->len >= sizeof(bin_magic_number)
+		&& memcmp(&image->data[image->len - sizeof(bin_magic_number)],
+			bin_magic_number, sizeof(bin_magic_number)) == 0;
+}
+
+static int extension_write_image(const char *path, struct extension_image *image)
+{
+	int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0755);
+	if (fd == -1) {
+		log_error("Failed to open '%s': %s", path, strerror(errno));
+		return -1;
+	}
+
+	size_t written = 0;
+	while (written < image->len) {
+		ssize_t n = write(fd, image->data + written, image->len - written);
+		if (n <= 0) {
+			log_error("Failed to write '%s': %s", path, strerror(errno));
+			close(fd);
+			return -1;
+		}
+		written += n;
+	}
+	close(fd);
+	return 0;
+}
+
+static int extension_process_start(struct extension_process *ep)
 {
-	int ret_val = -1;
-	struct procmgr *pm = mettle_get_procmgr(m);
+	struct procmgr *pm = mettle_get_procmgr(ep->m);
 	struct process_options opts = {
-		.process_name = full_path,
-		.args = args,
+		.process_name = ep->path ? ep->path : ep->name,
+		.args = NULL,
 		.env = NULL,
 		.cwd = NULL,
 		.user = NULL,
 	};
 
-	struct extension_process *ep = calloc(1, sizeof(*ep));
-	if (ep == NULL) {
+	/*
+	 * The written copy may have gone since the extension last ran
+	 */
+	if (ep->path && access(ep->path, X_OK)
+			&& extension_write_image(ep->path, ep->image)) {
 		return -1;
 	}
 
-	if (bin_image) {
-		ep->p = process_create_from_binary_image(pm, bin_image, bin_image_len, &opts, 0);
+	/*
+	 * The ring's descriptors are inherited by the extension, and by nothing
+	 * started after it
+	 */
+	ep->ring = shm_ring_new(EXTENSION_RING_LEN);
+	if (ep->path) {
+		ep->p = process_create_from_executable(pm, ep->path, &opts, 0);
 	} else {
-		ep->p = process_create_from_executable(pm, full_path, &opts, 0);
+		ep->p = process_create_from_binary_image(pm,
+			ep->image->data, ep->image->len, &opts, 0);
+	}
+	if (ep->ring) {
+		shm_ring_set_cloexec(ep->ring);
 	}
 	if (ep->p == NULL) {
-		log_error("Failed to start extension '%s'", full_path);
-		free(ep);
-		goto done;
+		log_error("Failed to start extension '%s'", ep->name);
+		extension_ring_free(ep);
+		return -1;
 	}
-	ep->m = m;
 
 	process_set_callbacks(ep->p,
 		extension_read_cb,
 		extension_err_cb,
 		extension_exit_cb, ep);
+	return 0;
+}
 
-	ret_val = 0;
+static void extension_process_free(struct extension_process *ep)
+{
+	extension_ring_free(ep);
+	if (ep->pending) {
+		buffer_queue_free(ep->pending);
+	}
+	if (ep->in_queue) {
+		buffer_queue_free(ep->in_queue);
+	}
+	free(ep->cmds);
+	free(ep->name);
+	free(ep->path);
+	free(ep);
+}
 
-done:
-	return ret_val;
+#ifdef HAVE_INPROC_EXTENSIONS
+int extension_load_in_process(struct mettle *m, const char *full_path)
+{
+	struct extension_module *mod = calloc(1, sizeof(*mod));
+	if (mod == NULL) {
+		return -1;
+	}
+
+	mod->handle = dlopen(full_path, RTLD_NOW | RTLD_LOCAL);
+	if (mod->handle == NULL) {
+		log_info("cannot load '%s' in process: %s", full_path, dlerror());
+		goto err;
+	}
+
+	extension_init_cb init = (extension_init_cb)dlsym(mod->handle, EXTENSION_INIT_SYMBOL);
+	if (init == NULL) {
+		log_info("'%s' has no %s", full_path, EXTENSION_INIT_SYMBOL);
+		goto err;
+	}
+
+	mod->e = extension_in_process(mettle_get_tlv_dispatcher(m), mettle_get_loop(m));
+	if (mod->e == NULL || init(mod->e)) {
+		/*
+		 * Handlers it registered before failing may point into it, so
+		 * leave it loaded
+		 */
+		log_error("extension '%s' failed to initialize", full_path);
+		free(mod->e);
+		free(mod);
+		return -1;
+	}
+
+	LL_PREPEND(mettle_get_extmgr(m)->modules, mod);
+	log_info("loaded extension '%s' in process", full_path);
+	return 0;
+
+err:
+	if (mod->handle) {
+		// Deferred log lines may point at the extension's format strings.
+		log_flush_buffer();
+		dlclose(mod->handle);
+	}
+	free(mod);
+	return -1;
 }
+#else
+int extension_load_in_process(struct mettle *m, const char *full_path)
+{
+	return -1;
+}
+#endif
 
-int extension_start_executable(struct mettle *m, const char *full_path,
-	const char* args)
+int extension_load(struct mettle *m, const char *name, const char *target_path,
+	struct extension_image *image, const char **commands, int num_commands)
 {
-	return extension_start(m, full_path, NULL, 0, args);
+	bool binary = extension_image_is_binary(image);
+	if (binary) {
+		log_info("Loading extension '%s' from binary image", name);
+	} else {
+		log_info("Loading extension '%s' from executable file", name);
+		if (target_path == NULL || extension_write_image(target_path, image)) {
+			return -1;
+		}
+		if (extension_load_in_process(m, target_path) == 0) {
+			return 0;
+		}
+	}
+
+	struct extension_process *ep = calloc(1, sizeof(*ep));
+	if (ep == NULL) {
+		return -1;
+	}
+	ep->m = m;
+	ep->image = image;
+	ep->name = strdup(name);
+	ep->path = binary ? NULL : strdup(target_path);
+	ep->pending = buffer_queue_new();
+	ep->in_queue = buffer_queue_new();
+	if (ep->name == NULL || (!binary && ep->path == NULL)
+			|| ep->pending == NULL || ep->in_queue == NULL) {
+		extension_process_free(ep);
+		return -1;
+	}
+
+	if (num_commands == 0 && extension_process_start(ep)) {
+		extension_process_free(ep);
+		return -1;
+	}
+	for (int i = 0; i < num_commands; i++) {
+		extension_register_command(ep, commands[i]);
+	}
+	if (num_commands) {
+		log_info("extension '%s' will start when first used", name);
+	}
+
+	struct extmgr *em = mettle_get_extmgr(m);
+	LL_PREPEND(em->processes, ep);
+	return 0;
+}
+
+/*
+ * Binary images compressed by 'elf2bin -z' are unpacked a block at a time,
+ * as a stage loader would while they arrive. The hash stays that of what
+ * was sent, so the framework can name the image the same way later.
+ */
+static int extension_image_unpack(struct extension_image *image,
+	const unsigned char *data, size_t len)
+{
+	const char lz4_magic_number[] = BIN_LZ4_MAGIC_NUMBER;
+	const struct bin_lz4_header *hdr = (const struct bin_lz4_header *)data;
+
+	if (len < sizeof(*hdr) || memcmp(hdr->magic_number, lz4_magic_number,
+			sizeof(lz4_magic_number)) != 0) {
+		image->data = malloc(len);
+		if (image->data == NULL) {
+			return -1;
+		}
+		memcpy(image->data, data, len);
+		image->len = len;
+		return 0;
+	}
+
+	size_t image_len = bin_lz4_get32(hdr->image_len);
+	image->data = malloc(image_len);
+	if (image->data == NULL) {
+		return -1;
+	}
+
+	const unsigned char *in = data + sizeof(*hdr);
+	const unsigned char *end = data + len;
+	size_t pos = 0;
+	while (pos < image_len) {
+		if (end - in < 4) {
+			goto corrupt;
+		}
+		uint32_t block_len = bin_lz4_get32(in);
+		in += 4;
+		if ((size_t)(end - in) < (block_len & ~BIN_LZ4_STORED)) {
+			goto corrupt;
+		}
+		long next = bin_lz4_decode_block(in, block_len, image->data, pos, image_len);
+		if (next <= (long)pos) {
+			goto corrupt;
+		}
+		in += block_len & ~BIN_LZ4_STORED;
+		pos = next;
+	}
+	image->len = image_len;
+	log_info("unpacked %zu byte image to %zu", len, image_len);
+	return 0;
+
+corrupt:
+	log_error("compressed image is corrupt at %zu", pos);
+	free(image->data);
+	image->data = NULL;
+	return -1;
+}
+
+struct extension_image *extmgr_add_image(struct extmgr *mgr,
+	const unsigned char *data, size_t len)
+{
+	SHA2_CTX ctx;
+	uint8_t hash[SHA256_DIGEST_LENGTH];
+	SHA256Init(&ctx);
+	SHA256Update(&ctx, data, len);
+	SHA256Final(hash, &ctx);
+
+	struct extension_image *image = extmgr_find_image(mgr, hash, sizeof(hash));
+	if (image) {
+		return image;
+	}
+	mgr = mgr->image_store;
+
+	image = calloc(1, sizeof(*image));
+	if (image == NULL) {
+		return NULL;
+	}
+	if (extension_image_unpack(image, data, len) == -1) {
+		free(image);
+		return NULL;
+	}
+	memcpy(image->hash, hash, sizeof(hash));
+	HASH_ADD(hh, mgr->images, hash, sizeof(image->hash), image);
+	return image;
 }
 
-int extension_start_binary_image(struct mettle *m, const char *name,
-	unsigned char *bin_image, size_t bin_image_len, const char* args)
+struct extension_image *extmgr_find_image(struct extmgr *mgr,
+	const uint8_t *hash, size_t hash_len)
 {
-	return extension_start(m, name, bin_image, bin_image_len, args);
+	struct extension_image *image = NULL;
+	if (hash_len == SHA256_DIGEST_LENGTH) {
+		HASH_FIND(hh, mgr->image_store->images, hash, hash_len, image);
+	}
+	return image;
+}
+
+const uint8_t *extension_image_hash(struct extension_image *image)
+{
+	return image->hash;
 }
 
 void extmgr_free(struct extmgr *mgr)
@@ -220,10 +682,38 @@ void extmgr_free(struct extmgr *mgr)
 			free(extension);
 		}
 	}
+	struct extension_module *mod, *tmp;
+	LL_FOREACH_SAFE(mgr->modules, mod, tmp) {
+		extension_free(mod->e);
+		free(mod);
+	}
+	struct extension_process *ep, *ep_tmp;
+	LL_FOREACH_SAFE(mgr->processes, ep, ep_tmp) {
+		extension_process_free(ep);
+	}
+	struct extension_image *image, *image_tmp;
+	HASH_ITER(hh, mgr->images, image, image_tmp) {
+		HASH_DEL(mgr->images, image);
+		free(image->data);
+		free(image);
+	}
 	free(mgr);
 }
 
 struct extmgr *extmgr_new()
 {
-	return calloc(1, sizeof(struct extmgr));
+	struct extmgr *mgr = calloc(1, sizeof(struct extmgr));
+	if (mgr) {
+		mgr->image_store = mgr;
+	}
+	return mgr;
+}
+
+struct extmgr *extmgr_new_sharing_images(struct extmgr *images_from)
+{
+	struct extmgr *mgr = calloc(1, sizeof(struct extmgr));
+	if (mgr) {
+		mgr->image_store = images_from->image_store;
+	}
+	return mgr;
 }
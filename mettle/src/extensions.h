@@ -5,15 +5,50 @@
 #ifndef _EXTENSIONS_H_
 #define _EXTENSIONS_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 struct mettle;
 
 struct extmgr *extmgr_new();
 
-int extension_start_executable(struct mettle *m, const char *full_path,
-	const char* args);
+/*
+ * A manager with extensions of its own that keeps uploaded images with
+ * those of 'images_from', which must outlive it
+ */
+struct extmgr *extmgr_new_sharing_images(struct extmgr *images_from);
+
+/*
+ * Loads an extension built as a shared object into this process, so that
+ * its handlers are called directly rather than through pipes. Fails where
+ * mettle cannot load shared objects or the file is not such an extension;
+ * it can then still be started as a process.
+ */
+int extension_load_in_process(struct mettle *m, const char *full_path);
+
+/*
+ * Uploaded images are kept by their SHA-256, so that reloading one needs
+ * only the hash. Adding an image that is already kept returns that copy.
+ */
+struct extension_image;
+
+struct extension_image *extmgr_add_image(struct extmgr *mgr,
+	const unsigned char *data, size_t len);
+
+struct extension_image *extmgr_find_image(struct extmgr *mgr,
+	const uint8_t *hash, size_t hash_len);
 
-int extension_start_binary_image(struct mettle *m, const char *name,
-	const unsigned char *bin_image, size_t bin_image_len, const char* args);
+const uint8_t *extension_image_hash(struct extension_image *image);
+
+/*
+ * Runs the extension in 'image', written to 'target_path' unless it is a
+ * binary image. When its commands are given they are registered now and
+ * the process is only started when one of them is first called, otherwise
+ * it is started straight away and registers the commands it reports. Either
+ * way it is started again on next use if it exits.
+ */
+int extension_load(struct mettle *m, const char *name, const char *target_path,
+	struct extension_image *image, const char **commands, int num_commands);
 
 void extmgr_free(struct extmgr *mgr);
 
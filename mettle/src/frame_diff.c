@@ -0,0 +1,153 @@
+/**
+ * @brief Tile based frame differencing for video streams
+ * @file frame_diff.c
+ */
+
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "frame_diff.h"
+
+struct frame_diff {
+	unsigned width, height, bpp;
+	size_t stride;
+	unsigned tiles_x, tiles_y;
+	size_t bitmap_len;
+
+	// The frame as last encoded, rows packed without padding
+	uint8_t *prev;
+	bool have_prev;
+
+	uint8_t *tiles;
+	uint8_t *out;
+	size_t out_len;
+};
+
+struct frame_diff * frame_diff_new(unsigned width, unsigned height,
+	unsigned bytes_per_pixel, size_t stride)
+{
+	if (width == 0 || height == 0 || width > UINT16_MAX || height > UINT16_MAX
+			|| bytes_per_pixel == 0 || stride < (size_t)width * bytes_per_pixel) {
+		return NULL;
+	}
+
+	struct frame_diff *fd = calloc(1, sizeof(*fd));
+	if (fd == NULL) {
+		return NULL;
+	}
+
+	fd->width = width;
+	fd->height = height;
+	fd->bpp = bytes_per_pixel;
+	fd->stride = stride;
+	fd->tiles_x = (width + FRAME_DIFF_TILE - 1) / FRAME_DIFF_TILE;
+	fd->tiles_y = (height + FRAME_DIFF_TILE - 1) / FRAME_DIFF_TILE;
+	fd->bitmap_len = (fd->tiles_x * fd->tiles_y + 7) / 8;
+
+	size_t frame_len = (size_t)width * height * bytes_per_pixel;
+	fd->out_len = sizeof(struct frame_diff_hdr) + fd->bitmap_len
+		+ compressBound(frame_len);
+	fd->prev = malloc(frame_len);
+	fd->tiles = malloc(frame_len);
+	fd->out = malloc(fd->out_len);
+	if (fd->prev == NULL || fd->tiles == NULL || fd->out == NULL) {
+		frame_diff_free(fd);
+		return NULL;
+	}
+	return fd;
+}
+
+/*
+ * Compares a tile against the previous frame and, when it differs, copies
+ * it both there and to the end of the tile data. memcmp on whole rows is
+ * vectorised by libc, which beats comparing by hand.
+ */
+static bool tile_update(struct frame_diff *fd, const uint8_t *frame,
+	unsigned tx, unsigned ty, bool force, size_t *tiles_len)
+{
+	size_t row_len = (size_t)fd->width * fd->bpp;
+	unsigned x = tx * FRAME_DIFF_TILE, y = ty * FRAME_DIFF_TILE;
+	unsigned w = fd->width - x < FRAME_DIFF_TILE ? fd->width - x : FRAME_DIFF_TILE;
+	unsigned h = fd->height - y < FRAME_DIFF_TILE ? fd->height - y : FRAME_DIFF_TILE;
+	size_t span = (size_t)w * fd->bpp;
+	const uint8_t *src = frame + y * fd->stride + (size_t)x * fd->bpp;
+	uint8_t *ref = fd->prev + y * row_len + (size_t)x * fd->bpp;
+
+	unsigned row = 0;
+	if (!force) {
+		while (row < h && memcmp(src + row * fd->stride, ref + row * row_len, span) == 0) {
+			row++;
+		}
+		if (row == h) {
+			return false;
+		}
+	}
+
+	for (row = 0; row < h; row++) {
+		memcpy(ref + row * row_len, src + row * fd->stride, span);
+		memcpy(fd->tiles + *tiles_len, src + row * fd->stride, span);
+		*tiles_len += span;
+	}
+	return true;
+}
+
+ssize_t frame_diff_encode(struct frame_diff *fd, const void *frame, const void **out)
+{
+	struct frame_diff_hdr *hdr = (struct frame_diff_hdr *)fd->out;
+	uint8_t *bitmap = fd->out + sizeof(*hdr);
+	bool key = !fd->have_prev;
+	size_t tiles_len = 0;
+	unsigned tile = 0;
+
+	memset(bitmap, 0, fd->bitmap_len);
+	for (unsigned ty = 0; ty < fd->tiles_y; ty++) {
+		for (unsigned tx = 0; tx < fd->tiles_x; tx++, tile++) {
+			if (tile_update(fd, frame, tx, ty, key, &tiles_len)) {
+				bitmap[tile / 8] |= 0x80 >> (tile % 8);
+			}
+		}
+	}
+	fd->have_prev = true;
+
+	if (tiles_len == 0) {
+		return 0;
+	}
+
+	uLongf comp_len = fd->out_len - sizeof(*hdr) - fd->bitmap_len;
+	if (compress2(bitmap + fd->bitmap_len, &comp_len, fd->tiles, tiles_len,
+				Z_BEST_SPEED) != Z_OK) {
+		// The receiver no longer has what prev holds
+		fd->have_prev = false;
+		return -1;
+	}
+
+	hdr->width = htons(fd->width);
+	hdr->height = htons(fd->height);
+	hdr->tile = FRAME_DIFF_TILE;
+	hdr->bytes_per_pixel = fd->bpp;
+	hdr->flags = key ? FRAME_DIFF_KEY : 0;
+	hdr->reserved = 0;
+	hdr->tiles_len = htonl(tiles_len);
+
+	*out = fd->out;
+	return sizeof(*hdr) + fd->bitmap_len + comp_len;
+}
+
+void frame_diff_reset(struct frame_diff *fd)
+{
+	fd->have_prev = false;
+}
+
+void frame_diff_free(struct frame_diff *fd)
+{
+	if (fd) {
+		free(fd->prev);
+		free(fd->tiles);
+		free(fd->out);
+		free(fd);
+	}
+}
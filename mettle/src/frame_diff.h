@@ -0,0 +1,60 @@
+/**
+ * @brief Tile based frame differencing for video streams
+ * @file frame_diff.h
+ */
+
+#ifndef _FRAME_DIFF_H_
+#define _FRAME_DIFF_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Splits raw frames into FRAME_DIFF_TILE square tiles and encodes each
+ * frame as the tiles that changed since the one before, zlib compressed.
+ * An encoded frame is a struct frame_diff_hdr, then a bitmap with a bit
+ * per tile in raster order (most significant bit first) marking the tiles
+ * that follow, then a zlib stream of those tiles' pixels, row by row. Tiles
+ * on the right and bottom edges are clipped to the frame. The first frame,
+ * and any after frame_diff_reset, has every tile set and FRAME_DIFF_KEY in
+ * its flags.
+ */
+#define FRAME_DIFF_TILE 16
+
+#define FRAME_DIFF_KEY 0x01
+
+struct frame_diff_hdr {
+	uint16_t width;         // In pixels, network order
+	uint16_t height;
+	uint8_t tile;
+	uint8_t bytes_per_pixel;
+	uint8_t flags;
+	uint8_t reserved;
+	uint32_t tiles_len;     // Bytes of tile data once inflated, network order
+} __attribute__((packed));
+
+struct frame_diff;
+
+/*
+ * 'stride' is the distance in bytes between rows of the frames to encode
+ */
+struct frame_diff * frame_diff_new(unsigned width, unsigned height,
+	unsigned bytes_per_pixel, size_t stride);
+
+/*
+ * Encodes 'frame' against the previous one, pointing 'out' at the result,
+ * which stays valid until the next call. Returns its length, 0 if nothing
+ * changed (and nothing needs sending), or -1 on error, after which the next
+ * frame is a key frame.
+ */
+ssize_t frame_diff_encode(struct frame_diff *fd, const void *frame, const void **out);
+
+/*
+ * Makes the next frame a key frame
+ */
+void frame_diff_reset(struct frame_diff *fd);
+
+void frame_diff_free(struct frame_diff *fd);
+
+#endif
@@ -1,30 +1,95 @@
 #include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <curl/curl.h>
-#include <eio.h>
 #include <zlib.h>
 
 #include "buffer_queue.h"
 #include "http_client.h"
 #include "log.h"
+#include "mem_acct.h"
+#include "tunables.h"
+#include "utlist.h"
+
+/*
+ * Requests run on a curl multi handle driven from the event loop. The multi
+ * handle's connection cache gives keep-alive and TLS session reuse between
+ * requests, and finished easy handles are kept for the next request with
+ * their invariant options already set.
+ */
+#define HTTP_CLIENT_POOL_SIZE 8
+
+/*
+ * Request header lists are built once per distinct body content type,
+ * content encoding and transfer encoding, rather than for every request
+ */
+#define HTTP_CLIENT_HEADER_LISTS 4
+
+/*
+ * Bodies smaller than this rarely shrink enough to pay for the gzip header
+ */
+#define HTTP_COMPRESS_MIN_LEN 256
+
+/*
+ * Bytes sampled to judge whether a body is worth compressing
+ */
+#define HTTP_COMPRESS_SAMPLE_LEN 1024
 
 struct http_conn {
+	struct http_conn *next;
+	struct http_client *client;
 	CURL *easy_handle;
 	CURLcode res;
-	char *url;
 	char error[CURL_ERROR_SIZE];
 	void (*cb)(struct http_conn *, void *arg);
+	void (*body_cb)(struct http_conn *, void *arg);
 	void *cb_arg;
+	bool body_ready;
 
 	void *content;
 	size_t content_len;
 
-	struct curl_slist *request_headers;
+	/*
+	 * A streamed body and, if it is being gzipped, the deflate state
+	 */
+	struct buffer_queue *body;
+	z_stream strm;
+	bool deflating;
+	bool deflated;
+
 	struct curl_slist *response_headers;
 	struct buffer_queue *response;
 };
 
+struct http_socket {
+	struct ev_io io;
+	struct http_socket *prev, *next;
+	struct http_client *client;
+};
+
+struct http_header_list {
+	char *content_type;
+	bool gzip;
+	bool chunked;
+	struct curl_slist *list;
+};
+
+struct http_client {
+	struct ev_loop *loop;
+	CURLM *multi;
+	struct ev_timer timer;
+	struct http_socket *sockets;
+	struct http_conn *active, *idle;
+	int num_idle;
+
+	char * const *headers;
+	int num_headers;
+	struct http_header_list header_lists[HTTP_CLIENT_HEADER_LISTS];
+};
+
 struct buffer_queue * http_conn_response_queue(struct http_conn *conn)
 {
 	return conn->response;
@@ -54,6 +119,13 @@ int http_conn_response_code(struct http_conn *conn)
 	return code;
 }
 
+double http_conn_total_time(struct http_conn *conn)
+{
+	double total = 0;
+	curl_easy_getinfo(conn->easy_handle, CURLINFO_TOTAL_TIME, &total);
+	return total;
+}
+
 const char *http_conn_header_value(struct http_conn *conn, const char *key)
 {
     if (conn->response_headers == NULL) {
@@ -77,25 +149,33 @@ const char *http_conn_header_value(struct http_conn *conn, const char *key)
     return NULL;
 }
 
-void http_conn_free(struct http_conn *conn)
+static void release_body(struct http_conn *conn)
+{
+	if (conn->body) {
+		buffer_queue_free(conn->body);
+		conn->body = NULL;
+	}
+	if (conn->deflating) {
+		deflateEnd(&conn->strm);
+		conn->deflating = false;
+	}
+	conn->deflated = false;
+}
+
+static void http_conn_free(struct http_conn *conn)
 {
 	if (conn) {
-		free(conn->url);
+		release_body(conn);
 		if (conn->response) {
 			buffer_queue_free(conn->response);
 		}
-		if (conn->request_headers) {
-			curl_slist_free_all(conn->request_headers);
-		}
 		if (conn->response_headers) {
 			curl_slist_free_all(conn->response_headers);
 		}
 		if (conn->easy_handle) {
 			curl_easy_cleanup(conn->easy_handle);
 		}
-		if (conn->content) {
-			free(conn->content);
-		}
+		free(conn->content);
 		free(conn);
 	}
 }
@@ -104,7 +184,47 @@ static size_t write_cb(void *buf, size_t size, size_t nmemb, void *arg)
 {
 	size_t len = size * nmemb;
 	struct http_conn *conn = arg;
-	return (buffer_queue_add(conn->response, buf, len) == 0) ? len : 0;
+	if (buffer_queue_add_stream(conn->response, buf, len) != 0) {
+		return 0;
+	}
+	conn->body_ready = true;
+	return len;
+}
+
+/*
+ * Hands curl the next piece of a streamed body, deflating as much of the
+ * queue as fits when it is being gzipped. Returning 0 ends the body.
+ */
+static size_t read_cb(char *buf, size_t size, size_t nitems, void *arg)
+{
+	size_t len = size * nitems;
+	struct http_conn *conn = arg;
+	if (conn->body == NULL) {
+		return 0;
+	}
+	if (!conn->deflating) {
+		return buffer_queue_remove(conn->body, buf, len);
+	}
+
+	z_stream *strm = &conn->strm;
+	strm->next_out = (Bytef *)buf;
+	strm->avail_out = len;
+	while (strm->avail_out > 0 && !conn->deflated) {
+		size_t in_len = 0;
+		void *in = buffer_queue_peek_contiguous(conn->body, &in_len);
+		strm->next_in = (Bytef *)in;
+		strm->avail_in = in ? in_len : 0;
+		int result = deflate(strm, in ? Z_NO_FLUSH : Z_FINISH);
+		if (in) {
+			buffer_queue_drain(conn->body, in_len - strm->avail_in);
+		}
+		if (result == Z_STREAM_END) {
+			conn->deflated = true;
+		} else if (result != Z_OK && result != Z_BUF_ERROR) {
+			return CURL_READFUNC_ABORT;
+		}
+	}
+	return len - strm->avail_out;
 }
 
 static size_t header_cb(void *buf, size_t size, size_t nmemb, void *arg)
@@ -134,230 +254,629 @@ static size_t header_cb(void *buf, size_t size, size_t nmemb, void *arg)
     return len;
 }
 
-static int request_done(struct eio_req *req)
+static struct http_conn *http_conn_new(struct http_client *hc)
 {
-	struct http_conn *conn = req->data;
-	if (conn->cb) {
-		conn->cb(conn, conn->cb_arg);
+	struct http_conn *conn = calloc(1, sizeof *conn);
+	if (conn == NULL) {
+		return NULL;
+	}
+
+	conn->client = hc;
+	conn->response = buffer_queue_new();
+	conn->easy_handle = curl_easy_init();
+	if (conn->response == NULL || conn->easy_handle == NULL) {
+		http_conn_free(conn);
+		return NULL;
+	}
+
+	curl_easy_setopt(conn->easy_handle, CURLOPT_HEADERFUNCTION, header_cb);
+	curl_easy_setopt(conn->easy_handle, CURLOPT_HEADERDATA, conn);
+	curl_easy_setopt(conn->easy_handle, CURLOPT_WRITEFUNCTION, write_cb);
+	curl_easy_setopt(conn->easy_handle, CURLOPT_WRITEDATA, conn);
+	curl_easy_setopt(conn->easy_handle, CURLOPT_READFUNCTION, read_cb);
+	curl_easy_setopt(conn->easy_handle, CURLOPT_READDATA, conn);
+	curl_easy_setopt(conn->easy_handle, CURLOPT_ERRORBUFFER, conn->error);
+	curl_easy_setopt(conn->easy_handle, CURLOPT_PRIVATE, conn);
+	curl_easy_setopt(conn->easy_handle, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(conn->easy_handle, CURLOPT_NOSIGNAL, 1L);
+
+	/*
+	 * Offer every encoding curl can decode; bodies reach write_cb decoded
+	 */
+	curl_easy_setopt(conn->easy_handle, CURLOPT_ACCEPT_ENCODING, "");
+
+	curl_easy_setopt(conn->easy_handle, CURLOPT_LOW_SPEED_LIMIT, 1L);
+
+	return conn;
+}
+
+static struct http_conn *get_conn(struct http_client *hc)
+{
+	struct http_conn *conn = hc->idle;
+	if (conn) {
+		LL_DELETE(hc->idle, conn);
+		hc->num_idle--;
+	} else {
+		conn = http_conn_new(hc);
 	}
-	http_conn_free(conn);
+	return conn;
+}
+
+static void put_conn(struct http_client *hc, struct http_conn *conn)
+{
+	buffer_queue_drain_all(conn->response);
+	if (conn->response_headers) {
+		curl_slist_free_all(conn->response_headers);
+		conn->response_headers = NULL;
+	}
+	free(conn->content);
+	conn->content = NULL;
+	conn->content_len = 0;
+	release_body(conn);
+	conn->cb = NULL;
+	conn->body_cb = NULL;
+	conn->body_ready = false;
+	conn->error[0] = '\0';
+
+	if (hc->num_idle < HTTP_CLIENT_POOL_SIZE) {
+		LL_PREPEND(hc->idle, conn);
+		hc->num_idle++;
+	} else {
+		http_conn_free(conn);
+	}
+}
+
+static void check_done(struct http_client *hc)
+{
+	CURLMsg *msg;
+	int pending;
+	while ((msg = curl_multi_info_read(hc->multi, &pending))) {
+		if (msg->msg != CURLMSG_DONE) {
+			continue;
+		}
+		struct http_conn *conn = NULL;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&conn);
+		conn->res = msg->data.result;
+		if (conn->res != CURLE_OK) {
+			log_debug("http request failed: %s", conn->error[0] ?
+				conn->error : curl_easy_strerror(conn->res));
+		}
+		curl_multi_remove_handle(hc->multi, conn->easy_handle);
+		LL_DELETE(hc->active, conn);
+		if (conn->cb) {
+			conn->cb(conn, conn->cb_arg);
+		}
+		put_conn(hc, conn);
+	}
+}
+
+/*
+ * Hands partial response bodies on once curl has returned, since its write
+ * callback may not start new requests on the multi handle
+ */
+static void deliver_bodies(struct http_client *hc)
+{
+	struct http_conn *conn, *tmp;
+	LL_FOREACH_SAFE(hc->active, conn, tmp) {
+		if (conn->body_ready && conn->body_cb) {
+			conn->body_ready = false;
+			conn->body_cb(conn, conn->cb_arg);
+		}
+	}
+}
+
+static void on_socket(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+	struct http_socket *s = w->data;
+	struct http_client *hc = s->client;
+	int running;
+	int flags = (revents & EV_READ ? CURL_CSELECT_IN : 0)
+		| (revents & EV_WRITE ? CURL_CSELECT_OUT : 0);
+	curl_multi_socket_action(hc->multi, w->fd, flags, &running);
+	deliver_bodies(hc);
+	check_done(hc);
+}
+
+static void on_timeout(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+	struct http_client *hc = w->data;
+	int running;
+	curl_multi_socket_action(hc->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+	deliver_bodies(hc);
+	check_done(hc);
+}
+
+static int socket_cb(CURL *e, curl_socket_t fd, int what, void *arg, void *sockp)
+{
+	struct http_client *hc = arg;
+	struct http_socket *s = sockp;
+
+	if (what == CURL_POLL_REMOVE) {
+		if (s) {
+			ev_io_stop(hc->loop, &s->io);
+			DL_DELETE(hc->sockets, s);
+			free(s);
+		}
+		return 0;
+	}
+
+	if (s == NULL) {
+		s = calloc(1, sizeof(*s));
+		if (s == NULL) {
+			return -1;
+		}
+		s->client = hc;
+		DL_APPEND(hc->sockets, s);
+		curl_multi_assign(hc->multi, fd, s);
+	} else {
+		ev_io_stop(hc->loop, &s->io);
+	}
+
+	int events = (what & CURL_POLL_IN ? EV_READ : 0)
+		| (what & CURL_POLL_OUT ? EV_WRITE : 0);
+	ev_io_init(&s->io, on_socket, fd, events);
+	s->io.data = s;
+	ev_io_start(hc->loop, &s->io);
 	return 0;
 }
 
-static void request(struct eio_req *req)
+static int timer_cb(CURLM *multi, long timeout_ms, void *arg)
 {
-	struct http_conn *conn = req->data;
-	conn->res = curl_easy_perform(conn->easy_handle);
+	struct http_client *hc = arg;
+	ev_timer_stop(hc->loop, &hc->timer);
+	if (timeout_ms >= 0) {
+		ev_timer_set(&hc->timer, timeout_ms / 1000.0, 0);
+		ev_timer_start(hc->loop, &hc->timer);
+	}
+	return 0;
 }
 
-static void *compress_content(const void *content, size_t content_len, size_t *compressed_len)
+#ifdef METTLE_MEM_ACCOUNTING
+/*
+ * libcurl's own allocations, counted under MEM_TAG_HTTP
+ */
+static void *curl_acct_malloc(size_t len)
 {
-	int result;
-	z_stream strm = { 0 };
+	return mem_acct_malloc(MEM_TAG_HTTP, len);
+}
+
+static void curl_acct_free(void *ptr)
+{
+	mem_acct_free(MEM_TAG_HTTP, ptr);
+}
+
+static void *curl_acct_realloc(void *ptr, size_t len)
+{
+	return mem_acct_realloc(MEM_TAG_HTTP, ptr, len);
+}
+
+static char *curl_acct_strdup(const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *dup = mem_acct_malloc(MEM_TAG_HTTP, len);
+	if (dup) {
+		memcpy(dup, str, len);
+	}
+	return dup;
+}
+
+static void *curl_acct_calloc(size_t count, size_t len)
+{
+	return mem_acct_calloc(MEM_TAG_HTTP, count, len);
+}
+
+static CURLcode http_global_init(void)
+{
+	return curl_global_init_mem(CURL_GLOBAL_DEFAULT, curl_acct_malloc,
+		curl_acct_free, curl_acct_realloc, curl_acct_strdup, curl_acct_calloc);
+}
+#else
+static CURLcode http_global_init(void)
+{
+	return curl_global_init(CURL_GLOBAL_DEFAULT);
+}
+#endif
+
+struct http_client * http_client_new(struct ev_loop *loop)
+{
+	struct http_client *hc = calloc(1, sizeof(*hc));
+	if (hc == NULL) {
+		return NULL;
+	}
+
+	if (http_global_init() != 0) {
+		free(hc);
+		return NULL;
+	}
+
+	hc->loop = loop;
+	ev_init(&hc->timer, on_timeout);
+	hc->timer.data = hc;
+
+	hc->multi = curl_multi_init();
+	if (hc->multi == NULL) {
+		http_client_free(hc);
+		return NULL;
+	}
+	curl_multi_setopt(hc->multi, CURLMOPT_SOCKETFUNCTION, socket_cb);
+	curl_multi_setopt(hc->multi, CURLMOPT_SOCKETDATA, hc);
+	curl_multi_setopt(hc->multi, CURLMOPT_TIMERFUNCTION, timer_cb);
+	curl_multi_setopt(hc->multi, CURLMOPT_TIMERDATA, hc);
+	curl_multi_setopt(hc->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+	return hc;
+}
+
+bool http_client_http2_supported(void)
+{
+	curl_version_info_data *info = curl_version_info(CURLVERSION_NOW);
+	return info && (info->features & CURL_VERSION_HTTP2);
+}
+
+static void free_header_lists(struct http_client *hc)
+{
+	for (int i = 0; i < HTTP_CLIENT_HEADER_LISTS; i++) {
+		struct http_header_list *hl = &hc->header_lists[i];
+		free(hl->content_type);
+		if (hl->list) {
+			curl_slist_free_all(hl->list);
+		}
+		memset(hl, 0, sizeof(*hl));
+	}
+}
+
+/*
+ * Outstanding requests are abandoned without calling back
+ */
+void http_client_free(struct http_client *hc)
+{
+	if (hc) {
+		struct http_conn *conn, *tmp;
+		LL_FOREACH_SAFE(hc->active, conn, tmp) {
+			curl_multi_remove_handle(hc->multi, conn->easy_handle);
+			http_conn_free(conn);
+		}
+		LL_FOREACH_SAFE(hc->idle, conn, tmp) {
+			http_conn_free(conn);
+		}
+		if (hc->multi) {
+			curl_multi_cleanup(hc->multi);
+		}
+		struct http_socket *s, *stmp;
+		DL_FOREACH_SAFE(hc->sockets, s, stmp) {
+			ev_io_stop(hc->loop, &s->io);
+			free(s);
+		}
+		ev_timer_stop(hc->loop, &hc->timer);
+		free_header_lists(hc);
+		curl_global_cleanup();
+		free(hc);
+	}
+}
+
+/*
+ * Returns the request header list for this body type, building it the first
+ * time. Returns NULL if building fails, sending without the extra headers.
+ */
+static struct curl_slist *get_header_list(struct http_client *hc,
+	struct http_request_data *data, const char *content_type, bool gzip,
+	bool chunked)
+{
+	if (data->headers != hc->headers || data->num_headers != hc->num_headers) {
+		free_header_lists(hc);
+		hc->headers = data->headers;
+		hc->num_headers = data->num_headers;
+	}
+
+	struct http_header_list *hl = NULL;
+	for (int i = 0; i < HTTP_CLIENT_HEADER_LISTS; i++) {
+		hl = &hc->header_lists[i];
+		if (hl->list == NULL) {
+			break;
+		}
+		if (hl->gzip == gzip && hl->chunked == chunked && ((hl->content_type == NULL && content_type == NULL) ||
+				(hl->content_type && content_type &&
+				 strcmp(hl->content_type, content_type) == 0))) {
+			return hl->list;
+		}
+	}
+	if (hl->list) {
+		curl_slist_free_all(hl->list);
+		free(hl->content_type);
+		memset(hl, 0, sizeof(*hl));
+	}
+
+	struct curl_slist *list = NULL;
+	for (int i = 0; i < data->num_headers; i++) {
+		list = curl_slist_append(list, data->headers[i]);
+	}
+	if (content_type) {
+		char *header = NULL;
+		if (asprintf(&header, "Content-Type: %s", content_type) > 0) {
+			list = curl_slist_append(list, header);
+			free(header);
+		}
+	}
+	if (gzip) {
+		list = curl_slist_append(list, "Content-Encoding: gzip");
+	}
 
 	/*
-	 * Avoid diminishing returns
+	 * curl only chunks a POST of unknown length when asked to, and leaves
+	 * the header out over HTTP/2, which has no need of it
 	 */
-	if (content_len < 256) {
+	if (chunked) {
+		list = curl_slist_append(list, "Transfer-Encoding: chunked");
+	}
+	if (list == NULL) {
 		return NULL;
 	}
 
-	size_t comp_len = compressBound(content_len);
-	void *buf = malloc(comp_len);
+	hl->content_type = content_type ? strdup(content_type) : NULL;
+	hl->gzip = gzip;
+	hl->chunked = chunked;
+	hl->list = list;
+	return list;
+}
 
-	if (buf == NULL) {
-		return NULL;
+/*
+ * Estimates whether data is already compressed or encrypted from the byte
+ * coincidence rate of a sample spread across it. For uniformly random
+ * bytes two picks match 1/256 of the time, far below any text or binary
+ * that deflate can do something with.
+ */
+static bool looks_incompressible(const uint8_t *content, size_t content_len)
+{
+	uint32_t counts[256] = { 0 };
+	size_t n = content_len < HTTP_COMPRESS_SAMPLE_LEN ? content_len : HTTP_COMPRESS_SAMPLE_LEN;
+	size_t stride = content_len / n;
+	for (size_t i = 0; i < n; i++) {
+		counts[content[i * stride]]++;
 	}
 
-	result = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS | 16,
+	uint64_t matches = 0;
+	for (int i = 0; i < 256; i++) {
+		if (counts[i] > 1) {
+			matches += (uint64_t)counts[i] * (counts[i] - 1);
+		}
+	}
+
+	/*
+	 * Below 1.5/256 is as good as random
+	 */
+	return matches * 256 * 2 < (uint64_t)n * (n - 1) * 3;
+}
+
+static int compress_init(struct http_request_data *data, z_stream *strm)
+{
+	int level = data->compress.level ? data->compress.level : Z_DEFAULT_COMPRESSION;
+	return deflateInit2(strm, level, Z_DEFLATED, MAX_WBITS | 16,
 		MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+}
+
+static void *compress_content(struct http_request_data *data, size_t *compressed_len)
+{
+	int result;
+	z_stream strm = { 0 };
+	size_t min_len = data->compress.min_len ? data->compress.min_len : HTTP_COMPRESS_MIN_LEN;
+
+	if (data->content_len < min_len || looks_incompressible(data->content, data->content_len)) {
+		return NULL;
+	}
+
+	result = compress_init(data, &strm);
 
 	if (result != Z_OK) {
-		switch (result) {
-			case Z_MEM_ERROR:
-			case Z_BUF_ERROR:
-				break;
-		}
-		free(buf);
-		buf = NULL;
-		goto out;
+		return NULL;
 	}
 
-	strm.next_in = (Bytef *)content;
-	strm.avail_in = content_len;
+	size_t comp_len = deflateBound(&strm, data->content_len);
+	void *buf = malloc(comp_len);
+
+	if (buf == NULL) {
+		deflateEnd(&strm);
+		return NULL;
+	}
+
+	strm.next_in = (Bytef *)data->content;
+	strm.avail_in = data->content_len;
 	strm.next_out = (Bytef *)buf;
-	strm.avail_out = content_len;
+	strm.avail_out = comp_len;
 
 	result = deflate(&strm, Z_FINISH);
 
-	if (result != Z_STREAM_END) {
+	/*
+	 * Send it as it is if compression didn't help
+	 */
+	if (result != Z_STREAM_END || strm.total_out >= data->content_len) {
 		free(buf);
 		buf = NULL;
 	} else {
 		*compressed_len = strm.total_out;
 	}
 
-out:
 	deflateEnd(&strm);
 	return buf;
 }
 
-int http_request(const char *url, enum http_request req,
-	void (*cb)(struct http_conn *, void *arg), void *cb_arg,
-	struct http_request_data *data, struct http_request_opts *opts)
+/*
+ * Sets up a queued body to be read by read_cb. Whether it is worth gzipping
+ * is judged from the front of the queue, as the whole of it cannot be
+ * compressed first to see.
+ */
+static bool stream_content(struct http_conn *conn, struct http_request_data *data)
 {
-	struct http_conn *conn = calloc(1, sizeof *conn);
-	if (conn == NULL) {
-		return -1;
+	conn->body = data->content_queue;
+	if (!(data->flags & HTTP_DATA_COMPRESS)) {
+		return false;
 	}
 
-	conn->url = strdup(url);
-	if (conn->url == NULL) {
-		goto err;
+	size_t min_len = data->compress.min_len ? data->compress.min_len : HTTP_COMPRESS_MIN_LEN;
+	size_t len = 0;
+	void *front = buffer_queue_peek_contiguous(conn->body, &len);
+	if (buffer_queue_len(conn->body) < min_len || front == NULL ||
+			looks_incompressible(front, len)) {
+		return false;
 	}
 
-	conn->response = buffer_queue_new();
-	if (conn->response == NULL) {
-		goto err;
+	memset(&conn->strm, 0, sizeof(conn->strm));
+	conn->deflating = compress_init(data, &conn->strm) == Z_OK;
+	return conn->deflating;
+}
+
+int http_request(struct http_client *hc, const char *url, enum http_request req,
+	void (*cb)(struct http_conn *, void *arg), void *cb_arg,
+	struct http_request_data *data, struct http_request_opts *opts)
+{
+	struct http_conn *conn = get_conn(hc);
+	if (conn == NULL) {
+		if (data && (data->flags & HTTP_DATA_CONTENT_OWNED)) {
+			free(data->content);
+		}
+		if (data && data->content_queue) {
+			buffer_queue_free(data->content_queue);
+		}
+		return -1;
 	}
 
 	conn->cb = cb;
 	conn->cb_arg = cb_arg;
 
-	conn->easy_handle = curl_easy_init();
-	if (conn->easy_handle == NULL) {
-		goto err;
-	}
-
-	curl_easy_setopt(conn->easy_handle, CURLOPT_URL, conn->url);
-	curl_easy_setopt(conn->easy_handle, CURLOPT_HEADERFUNCTION, header_cb);
-	curl_easy_setopt(conn->easy_handle, CURLOPT_HEADERDATA, conn);
-	curl_easy_setopt(conn->easy_handle, CURLOPT_WRITEFUNCTION, write_cb);
-	curl_easy_setopt(conn->easy_handle, CURLOPT_WRITEDATA, conn);
-	curl_easy_setopt(conn->easy_handle, CURLOPT_ERRORBUFFER, conn->error);
-	curl_easy_setopt(conn->easy_handle, CURLOPT_PRIVATE, conn);
-	curl_easy_setopt(conn->easy_handle, CURLOPT_FOLLOWLOCATION, 1L);
+	CURL *easy = conn->easy_handle;
+	curl_easy_setopt(easy, CURLOPT_URL, url);
 
 	/*
-	 * Timeout after 60 seconds running < 1 byte/sec
+	 * Pooled handles keep the last request's method, so always set it
 	 */
-	curl_easy_setopt(conn->easy_handle, CURLOPT_LOW_SPEED_TIME, 60L);
-	curl_easy_setopt(conn->easy_handle, CURLOPT_LOW_SPEED_LIMIT, 1L);
-
 	switch (req) {
 		case http_request_get:
+			curl_easy_setopt(easy, CURLOPT_HTTPGET, 1L);
+			curl_easy_setopt(easy, CURLOPT_CUSTOMREQUEST, NULL);
 			break;
 		case http_request_post:
-			curl_easy_setopt(conn->easy_handle, CURLOPT_POST, 1L);
+			curl_easy_setopt(easy, CURLOPT_POST, 1L);
+			curl_easy_setopt(easy, CURLOPT_CUSTOMREQUEST, NULL);
+			curl_easy_setopt(easy, CURLOPT_POSTFIELDS, "");
+			curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE, 0L);
 			break;
 		case http_request_put:
-			curl_easy_setopt(conn->easy_handle, CURLOPT_PUT, 1L);
+			curl_easy_setopt(easy, CURLOPT_PUT, 1L);
+			curl_easy_setopt(easy, CURLOPT_CUSTOMREQUEST, NULL);
 			break;
 		case http_request_delete:
-			curl_easy_setopt(conn->easy_handle, CURLOPT_CUSTOMREQUEST, "DELETE");
+			curl_easy_setopt(easy, CURLOPT_HTTPGET, 1L);
+			curl_easy_setopt(easy, CURLOPT_CUSTOMREQUEST, "DELETE");
 			break;
 	}
 
+	struct curl_slist *headers = NULL;
 	if (data) {
-		for (int i = 0; i < data->num_headers; i++) {
-			conn->request_headers =
-				curl_slist_append(conn->request_headers, data->headers[i]);
-		}
-
+		conn->body_cb = data->body_cb;
 		if (data->cookie_list) {
-			curl_easy_setopt(conn->easy_handle, CURLOPT_COOKIEFILE, "");
-			curl_easy_setopt(conn->easy_handle, CURLOPT_COOKIELIST, data->cookie_list);
+			curl_easy_setopt(easy, CURLOPT_COOKIEFILE, "");
+			curl_easy_setopt(easy, CURLOPT_COOKIELIST, data->cookie_list);
 		}
 
-		if (data->referer) {
-			curl_easy_setopt(conn->easy_handle, CURLOPT_REFERER, data->referer);
-		}
+		curl_easy_setopt(easy, CURLOPT_REFERER, data->referer);
+		curl_easy_setopt(easy, CURLOPT_USERAGENT, data->ua);
 
-		if (data->ua) {
-			curl_easy_setopt(conn->easy_handle, CURLOPT_USERAGENT, data->ua);
-		}
+		const char *content_type = NULL;
+		bool gzip = false;
+		if (data->content_queue) {
+			content_type = data->content_type ? data->content_type : "application/json";
+			gzip = stream_content(conn, data);
 
-		if (data->content) {
-			char *content_type = NULL;
-			int rc = asprintf(&content_type, "Content-Type: %s",
-					data->content_type ? data->content_type : "application/json");
-			if (rc > 0) {
-				conn->request_headers = curl_slist_append(conn->request_headers, content_type);
-			}
+			/*
+			 * With no size given curl reads the body from read_cb
+			 */
+			curl_easy_setopt(easy, CURLOPT_POSTFIELDS, NULL);
+			curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE, -1L);
+		} else if (data->content) {
+			content_type = data->content_type ? data->content_type : "application/json";
 
 			if (data->flags & HTTP_DATA_COMPRESS) {
-				conn->content = compress_content(data->content,
-						data->content_len, &conn->content_len);
-				if (conn->content) {
-					conn->request_headers = curl_slist_append(conn->request_headers,
-								"Content-Encoding: gzip");
-				}
+				conn->content = compress_content(data, &conn->content_len);
+				gzip = conn->content != NULL;
 			}
 
-			if (conn->content == NULL) {
+			if (conn->content == NULL && (data->flags & HTTP_DATA_CONTENT_OWNED)) {
+				conn->content = data->content;
+				conn->content_len = data->content_len;
+			} else if (conn->content == NULL) {
 				conn->content = malloc(data->content_len);
 				if (conn->content) {
 					memcpy(conn->content, data->content, data->content_len);
 					conn->content_len = data->content_len;
 				}
+			} else if (data->flags & HTTP_DATA_CONTENT_OWNED) {
+				free(data->content);
 			}
 
 			if (conn->content) {
-				curl_easy_setopt(conn->easy_handle, CURLOPT_POSTFIELDS, conn->content);
-				curl_easy_setopt(conn->easy_handle, CURLOPT_POSTFIELDSIZE, (long)conn->content_len);
+				curl_easy_setopt(easy, CURLOPT_POSTFIELDS, conn->content);
+				curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE, (long)conn->content_len);
 			}
 		}
+		headers = get_header_list(hc, data, content_type, gzip,
+			data->content_queue != NULL);
 	}
+	curl_easy_setopt(easy, CURLOPT_HTTPHEADER, headers);
+
+	curl_easy_setopt(easy, CURLOPT_TIMEOUT, opts ? opts->timeout : 0L);
 
+	/*
+	 * Timeout after the low speed time running < 1 byte/sec
+	 */
+	curl_easy_setopt(easy, CURLOPT_LOW_SPEED_TIME,
+		(long)tunable_get(TUNABLE_HTTP_LOW_SPEED_TIME_S));
 	if (opts) {
 		if (opts->ca_type == http_ca_type_path) {
-			curl_easy_setopt(conn->easy_handle, CURLOPT_CAPATH, opts->ca);
+			curl_easy_setopt(easy, CURLOPT_CAPATH, opts->ca);
 		} else if (opts->ca_type == http_ca_type_bundle) {
-			curl_easy_setopt(conn->easy_handle, CURLOPT_CAINFO, opts->ca);
+			curl_easy_setopt(easy, CURLOPT_CAINFO, opts->ca);
 		}
 
 		if (opts->proxy.type != http_proxy_none) {
-			curl_easy_setopt(conn->easy_handle, CURLOPT_PROXY, opts->proxy.hostname);
-			curl_easy_setopt(conn->easy_handle, CURLOPT_PROXYPORT, opts->proxy.port);
-
+			curl_easy_setopt(easy, CURLOPT_PROXY, opts->proxy.hostname);
+			curl_easy_setopt(easy, CURLOPT_PROXYPORT, opts->proxy.port);
 			if (opts->proxy.auth_type != http_auth_none) {
 				char *userpwd = NULL;
-				int rc = asprintf(&userpwd, "%s:%s",
+				if (asprintf(&userpwd, "%s:%s",
 						opts->proxy.auth_user ? opts->proxy.auth_user : "",
-						opts->proxy.auth_pass ? opts->proxy.auth_pass : "");
-				if (rc > 0) {
-					curl_easy_setopt(conn->easy_handle, CURLOPT_PROXYUSERPWD, userpwd);
+						opts->proxy.auth_pass ? opts->proxy.auth_pass : "") > 0) {
+					curl_easy_setopt(easy, CURLOPT_PROXYUSERPWD, userpwd);
+					free(userpwd);
 					if (opts->proxy.auth_type == http_auth_basic) {
-						curl_easy_setopt(conn->easy_handle, CURLOPT_PROXYAUTH, CURLAUTH_BASIC);
+						curl_easy_setopt(easy, CURLOPT_PROXYAUTH, CURLAUTH_BASIC);
 					} else if (opts->proxy.auth_type == http_auth_digest) {
-						curl_easy_setopt(conn->easy_handle, CURLOPT_PROXYAUTH, CURLAUTH_DIGEST);
+						curl_easy_setopt(easy, CURLOPT_PROXYAUTH, CURLAUTH_DIGEST);
 					}
-					free(userpwd);
 				}
 			}
 		}
 
-		if (opts->flags & HTTP_OPTS_VERBOSE) {
-			curl_easy_setopt(conn->easy_handle, CURLOPT_VERBOSE, 1L);
+		/*
+		 * Wait for an HTTP/2 connection in progress rather than opening a
+		 * second one, so concurrent requests become streams on it
+		 */
+		if ((opts->flags & HTTP_OPTS_HTTP2) && http_client_http2_supported()) {
+			curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+			curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
 		}
+
+		curl_easy_setopt(easy, CURLOPT_VERBOSE, opts->flags & HTTP_OPTS_VERBOSE ? 1L : 0L);
 		if (opts->flags & HTTP_OPTS_SKIP_TLS_VALIDATION) {
-			curl_easy_setopt(conn->easy_handle, CURLOPT_SSL_VERIFYPEER, 0L);
-			curl_easy_setopt(conn->easy_handle, CURLOPT_SSL_VERIFYHOST, 0L);
+			curl_easy_setopt(easy, CURLOPT_SSL_VERIFYPEER, 0L);
+			curl_easy_setopt(easy, CURLOPT_SSL_VERIFYHOST, 0L);
 		} else {
-			curl_easy_setopt(conn->easy_handle, CURLOPT_SSL_VERIFYPEER, 1L);
-			curl_easy_setopt(conn->easy_handle, CURLOPT_SSL_VERIFYHOST, 2L);
+			curl_easy_setopt(easy, CURLOPT_SSL_VERIFYPEER, 1L);
+			curl_easy_setopt(easy, CURLOPT_SSL_VERIFYHOST, 2L);
 		}
 	}
 
-	if (conn->request_headers) {
-		curl_easy_setopt(conn->easy_handle, CURLOPT_HTTPHEADER, conn->request_headers);
+	if (curl_multi_add_handle(hc->multi, easy) != CURLM_OK) {
+		put_conn(hc, conn);
+		return -1;
 	}
-
-	eio_custom(request, 0, request_done, conn);
-
+	LL_PREPEND(hc->active, conn);
 	return 0;
-
-err:
-	http_conn_free(conn);
-	return -1;
 }
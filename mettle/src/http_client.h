@@ -2,6 +2,7 @@
 #define METTLE_HTTP_CLIENT_H
 
 #include <ev.h>
+#include <stdbool.h>
 
 enum http_request {
 	http_request_get,
@@ -28,6 +29,8 @@ enum http_proxy_type {
 	http_proxy_socks5
 };
 
+struct http_conn;
+
 struct http_request_data {
 
 	char * const *headers;
@@ -38,10 +41,38 @@ struct http_request_data {
 	char *ua;
 
 #define HTTP_DATA_COMPRESS (1 << 0)
+/* The request takes ownership of 'content', which must come from malloc */
+#define HTTP_DATA_CONTENT_OWNED (1 << 1)
 	unsigned int flags;
 	const char *content_type;
 	void *content;
 	size_t content_len;
+
+	/*
+	 * Instead of 'content', a body may be given as a queue, which the
+	 * request takes ownership of. It is sent with chunked transfer encoding
+	 * as curl asks for it, and with HTTP_DATA_COMPRESS it is gzipped a slab
+	 * at a time on the way, so the body is never held whole a second time.
+	 */
+	struct buffer_queue *content_queue;
+
+	/*
+	 * With HTTP_DATA_COMPRESS, bodies of at least 'min_len' bytes are
+	 * gzipped at zlib level 'level' unless they look incompressible. Zero
+	 * selects the defaults for either.
+	 */
+	struct {
+		int level;
+		size_t min_len;
+	} compress;
+
+	/*
+	 * If set, called from the event loop whenever more of the response body
+	 * has arrived, before the request completes. It may take what is in
+	 * http_conn_response_queue so far; whatever it leaves is still there
+	 * for the completion callback.
+	 */
+	void (*body_cb)(struct http_conn *, void *arg);
 };
 
 struct http_request_opts {
@@ -60,16 +91,35 @@ struct http_request_opts {
 
 #define HTTP_OPTS_VERBOSE             (1 << 0)
 #define HTTP_OPTS_SKIP_TLS_VALIDATION (1 << 1)
+/* Multiplex https requests over one HTTP/2 connection where the server allows */
+#define HTTP_OPTS_HTTP2               (1 << 2)
 	unsigned int flags;
 
 	enum http_auth_type auth_type;
 	const char *auth_user;
 	const char *auth_pass;
+
+	/* Give up on the whole request after this many seconds, 0 for never */
+	long timeout;
 };
 
-struct http_conn;
+/*
+ * A client runs its requests on the event loop and keeps connections alive
+ * between them. Callbacks for requests outstanding when it is freed are
+ * never called.
+ */
+struct http_client;
+
+struct http_client * http_client_new(struct ev_loop *loop);
+
+void http_client_free(struct http_client *hc);
 
-int http_request(const char *url, enum http_request req,
+/*
+ * Whether the curl linked in was built with HTTP/2 support
+ */
+bool http_client_http2_supported(void);
+
+int http_request(struct http_client *hc, const char *url, enum http_request req,
 	void (*cb)(struct http_conn *, void *arg), void *cb_arg,
 	struct http_request_data *data, struct http_request_opts *opts);
 
@@ -81,6 +131,11 @@ void *http_conn_response_raw(struct http_conn *conn, ssize_t *len);
 
 int http_conn_response_code(struct http_conn *conn);
 
+/*
+ * Seconds the request took from start to finish
+ */
+double http_conn_total_time(struct http_conn *conn);
+
 const char *http_conn_header_value(struct http_conn *conn, const char *key);
 
 #endif
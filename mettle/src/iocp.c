@@ -0,0 +1,218 @@
+/**
+ * @brief Overlapped I/O through a completion port
+ * @file iocp.c
+ */
+
+#ifdef _WIN32
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <windows.h>
+
+#include "iocp.h"
+#include "log.h"
+#include "util.h"
+
+/*
+ * Completed ops for one event loop, queued by the completion thread and
+ * run from the loop's async watcher
+ */
+struct iocp {
+	struct ev_loop *loop;
+	struct ev_async async;
+	pthread_mutex_t mutex;
+	struct iocp_op *done, **done_tail;
+	struct iocp *next;
+};
+
+/*
+ * One port and one thread waiting on it serve every loop
+ */
+static struct {
+	pthread_mutex_t mutex;
+	HANDLE port;
+	pthread_t thread;
+	struct iocp *loops;
+} iocp_state = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void on_completed(struct ev_loop *loop, struct ev_async *w, int revents)
+{
+	struct iocp *iocp = w->data;
+
+	pthread_mutex_lock(&iocp->mutex);
+	struct iocp_op *op = iocp->done;
+	iocp->done = NULL;
+	iocp->done_tail = &iocp->done;
+	pthread_mutex_unlock(&iocp->mutex);
+
+	while (op) {
+		struct iocp_op *next = op->next;
+		op->cb(op, op->bytes, op->err);
+		op = next;
+	}
+}
+
+static void complete(struct iocp_op *op, size_t bytes, int err)
+{
+	op->bytes = bytes;
+	op->err = err;
+	op->next = NULL;
+
+	struct iocp *iocp = op->iocp;
+	pthread_mutex_lock(&iocp->mutex);
+	*iocp->done_tail = op;
+	iocp->done_tail = &op->next;
+	pthread_mutex_unlock(&iocp->mutex);
+	ev_async_send(iocp->loop, &iocp->async);
+}
+
+static void * completion_thread(void *arg)
+{
+	for (;;) {
+		DWORD bytes = 0;
+		ULONG_PTR key;
+		OVERLAPPED *ov = NULL;
+		BOOL ok = GetQueuedCompletionStatus(iocp_state.port, &bytes, &key, &ov, INFINITE);
+		if (ov == NULL) {
+			if (!ok) {
+				log_error("completion port wait failed: %lu", GetLastError());
+				return NULL;
+			}
+			continue;
+		}
+
+		complete((struct iocp_op *)ov, bytes, ok ? 0 : GetLastError());
+	}
+	return NULL;
+}
+
+/*
+ * Finds or sets up the completion queue for a loop, starting the port and
+ * its thread the first time. Called with iocp_state.mutex held.
+ */
+static struct iocp * get_iocp(struct ev_loop *loop)
+{
+	struct iocp *iocp;
+	for (iocp = iocp_state.loops; iocp; iocp = iocp->next) {
+		if (iocp->loop == loop) {
+			return iocp;
+		}
+	}
+
+	if (iocp_state.port == NULL) {
+		iocp_state.port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+		if (iocp_state.port == NULL) {
+			return NULL;
+		}
+		if (pthread_create(&iocp_state.thread, NULL, completion_thread, NULL)) {
+			CloseHandle(iocp_state.port);
+			iocp_state.port = NULL;
+			return NULL;
+		}
+	}
+
+	iocp = calloc(1, sizeof(*iocp));
+	if (iocp == NULL) {
+		return NULL;
+	}
+	iocp->loop = loop;
+	iocp->done_tail = &iocp->done;
+	pthread_mutex_init(&iocp->mutex, NULL);
+	ev_async_init(&iocp->async, on_completed);
+	iocp->async.data = iocp;
+	ev_async_start(loop, &iocp->async);
+
+	iocp->next = iocp_state.loops;
+	iocp_state.loops = iocp;
+	return iocp;
+}
+
+int iocp_op_init(struct iocp_op *op, struct ev_loop *loop, iocp_cb cb, void *arg)
+{
+	pthread_mutex_lock(&iocp_state.mutex);
+	op->iocp = get_iocp(loop);
+	pthread_mutex_unlock(&iocp_state.mutex);
+	if (op->iocp == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	op->cb = cb;
+	op->arg = arg;
+	return 0;
+}
+
+int iocp_attach_handle(HANDLE h)
+{
+	if (CreateIoCompletionPort(h, iocp_state.port, 0, 0) == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+int iocp_attach(int sock)
+{
+	return iocp_attach_handle((HANDLE)(uintptr_t)sock);
+}
+
+void iocp_notify(struct iocp_op *op, size_t bytes, int err)
+{
+	complete(op, bytes, err);
+}
+
+/*
+ * An op that fails to post completes with the error all the same, so the
+ * owner sees it from the loop rather than from inside its own call
+ */
+static void posted(struct iocp_op *op, int rc)
+{
+	if (rc != 0) {
+		int err = WSAGetLastError();
+		if (err != WSA_IO_PENDING) {
+			complete(op, 0, err);
+		}
+	}
+}
+
+void iocp_recv(struct iocp_op *op, int sock, void *buf, size_t len)
+{
+	WSABUF wsabuf = {
+		.len = len,
+		.buf = buf,
+	};
+	DWORD flags = 0;
+	memset(&op->ov, 0, sizeof(op->ov));
+	posted(op, WSARecv(sock, &wsabuf, 1, NULL, &flags, &op->ov, NULL));
+}
+
+void iocp_send(struct iocp_op *op, int sock, struct iovec *iov, int iovcnt)
+{
+	WSABUF wsabufs[64];
+	iovcnt = TYPESAFE_MIN(iovcnt, (int)COUNT_OF(wsabufs));
+	for (int i = 0; i < iovcnt; i++) {
+		wsabufs[i].len = iov[i].iov_len;
+		wsabufs[i].buf = iov[i].iov_base;
+	}
+	memset(&op->ov, 0, sizeof(op->ov));
+	posted(op, WSASend(sock, wsabufs, iovcnt, NULL, 0, &op->ov, NULL));
+}
+
+void iocp_read(struct iocp_op *op, HANDLE h, void *buf, size_t len)
+{
+	memset(&op->ov, 0, sizeof(op->ov));
+	if (!ReadFile(h, buf, len, NULL, &op->ov)) {
+		DWORD err = GetLastError();
+		if (err != ERROR_IO_PENDING) {
+			complete(op, 0, err);
+		}
+	}
+}
+
+#endif
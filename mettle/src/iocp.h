@@ -0,0 +1,68 @@
+/**
+ * @brief Overlapped I/O through a completion port
+ * @file iocp.h
+ */
+
+#ifndef _IOCP_H_
+#define _IOCP_H_
+
+#ifdef _WIN32
+
+#include <ev.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <winsock2.h>
+#include <windows.h>
+
+struct iocp_op;
+
+/*
+ * Called on the loop the op was set up with once it completes. 'err' is 0
+ * or the Windows error the operation failed with.
+ */
+typedef void (*iocp_cb)(struct iocp_op *op, size_t bytes, int err);
+
+/*
+ * One outstanding read, write or notification. The OVERLAPPED comes first, so the
+ * completion thread gets the op back from what the port hands it.
+ */
+struct iocp_op {
+	OVERLAPPED ov;
+	struct iocp *iocp;
+	iocp_cb cb;
+	void *arg;
+	size_t bytes;
+	int err;
+	struct iocp_op *next;
+};
+
+int iocp_op_init(struct iocp_op *op, struct ev_loop *loop, iocp_cb cb, void *arg);
+
+/*
+ * Associates a socket or an overlapped file handle, such as a named pipe,
+ * with the completion port. It stays associated until closed.
+ */
+int iocp_attach(int sock);
+
+int iocp_attach_handle(HANDLE h);
+
+/*
+ * Post an overlapped receive or send. The callback is called once it
+ * completes or fails, even if it fails right away, and the buffers must
+ * stay put until then.
+ */
+void iocp_recv(struct iocp_op *op, int sock, void *buf, size_t len);
+
+void iocp_send(struct iocp_op *op, int sock, struct iovec *iov, int iovcnt);
+
+void iocp_read(struct iocp_op *op, HANDLE h, void *buf, size_t len);
+
+/*
+ * Completes an op by hand, from any thread, as when a registered wait
+ * fires
+ */
+void iocp_notify(struct iocp_op *op, size_t bytes, int err);
+
+#endif
+
+#endif
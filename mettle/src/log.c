@@ -7,8 +7,12 @@
 
 #include <ctype.h>
 #include <libgen.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/time.h>
@@ -17,63 +21,214 @@
 #include <pthread.h>
 
 #include "log.h"
+#include "spsc_ring.h"
+#include "thread_role.h"
+#include "util.h"
 
 static FILE *zlog_fout = NULL;
-
-static char _zlog_buffer[LOG_BUFFER_SIZE][LOG_BUFFER_STR_MAX_LEN];
-static int _zlog_buffer_size = 0;
 int _zlog_level = 0;
 
-static pthread_mutex_t _zlog_buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * Flushed lines are also handed to the sink, if one is set. It is only
+ * called with _zlog_flush_mutex held.
+ */
+static zlog_sink_cb zlog_sink = NULL;
+static void *zlog_sink_arg = NULL;
 
-static inline void _zlog_buffer_lock()
+static inline bool zlog_has_output(void)
 {
-	pthread_mutex_lock(&_zlog_buffer_mutex);
+	return zlog_fout != NULL || __atomic_load_n(&zlog_sink, __ATOMIC_RELAXED) != NULL;
 }
 
-static inline void _zlog_buffer_unlock()
+/*
+ * A line is either text, or a format string with the raw arguments for it,
+ * formatted when it is flushed. Deferred entries with no format string are
+ * one line of a hex dump.
+ */
+#define ZLOG_DEFERRED_ARGS_LEN (LOG_BUFFER_STR_MAX_LEN - 48)
+
+struct zlog_deferred {
+	const char *fmt;
+	const char *filename;
+	int line;
+	struct timeval tv;
+	uint8_t args[ZLOG_DEFERRED_ARGS_LEN];
+};
+
+struct zlog_entry {
+	bool deferred;
+	union {
+		char text[LOG_BUFFER_STR_MAX_LEN];
+		struct zlog_deferred d;
+	};
+};
+
+/*
+ * Each logging thread writes lines into a ring of its own, which only the
+ * flushing side reads, under _zlog_flush_mutex, so logging never waits on
+ * other threads or on I/O while the flush thread runs. Rings are never
+ * freed: when a thread exits, its ring is left on the list for the next new
+ * thread to take over.
+ */
+struct zlog_ring {
+	struct zlog_ring *next;
+	struct spsc_ring *entries;
+	unsigned dropped;
+	int in_use;
+};
+
+static struct zlog_ring *_zlog_rings = NULL;
+static pthread_key_t _zlog_ring_key;
+static pthread_once_t _zlog_ring_once = PTHREAD_ONCE_INIT;
+static int _zlog_flush_thread_running = 0;
+static int _zlog_idle = 0;
+static int _zlog_flush_parked = 0;
+
+static size_t zlog_format_deferred(char *out, size_t size, struct zlog_deferred *d);
+
+static pthread_mutex_t _zlog_flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _zlog_flush_cv = PTHREAD_COND_INITIALIZER;
+
+static void _zlog_ring_release(void *arg)
 {
-	pthread_mutex_unlock(&_zlog_buffer_mutex);
+	struct zlog_ring *r = arg;
+	__atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
 }
 
-static void _zlog_flush_buffer()
+static void _zlog_ring_key_init(void)
+{
+	pthread_key_create(&_zlog_ring_key, _zlog_ring_release);
+}
+
+static struct zlog_ring *_zlog_ring_get(void)
+{
+	pthread_once(&_zlog_ring_once, _zlog_ring_key_init);
+	struct zlog_ring *r = pthread_getspecific(_zlog_ring_key);
+	if (r) {
+		return r;
+	}
+
+	for (r = __atomic_load_n(&_zlog_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		int unused = 0;
+		if (__atomic_compare_exchange_n(&r->in_use, &unused, 1, false,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			goto found;
+		}
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		return NULL;
+	}
+	r->entries = spsc_ring_new(LOG_BUFFER_SIZE, sizeof(struct zlog_entry));
+	if (r->entries == NULL) {
+		free(r);
+		return NULL;
+	}
+	r->in_use = 1;
+	r->next = __atomic_load_n(&_zlog_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&_zlog_rings, &r->next, r, true,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+found:
+	pthread_setspecific(_zlog_ring_key, r);
+	return r;
+}
+
+static void _zlog_output(const char *text)
 {
 	if (zlog_fout != NULL) {
-		int i = 0;
-		for (i = 0; i < _zlog_buffer_size; i++) {
-			fprintf(zlog_fout, "%s", _zlog_buffer[i]);
+		fputs(text, zlog_fout);
+	}
+	if (zlog_sink != NULL) {
+		zlog_sink(text, strlen(text), zlog_sink_arg);
+	}
+}
+
+/*
+ * Write out every ring, with _zlog_flush_mutex held
+ */
+static void _zlog_flush_buffer()
+{
+	struct zlog_ring *r;
+	for (r = __atomic_load_n(&_zlog_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		// At most a ring's worth, so a busy thread cannot keep us here
+		size_t left = spsc_ring_count(r->entries);
+		struct zlog_entry *e;
+		size_t n;
+		while (left && (n = spsc_ring_peek(r->entries, left, (void **)&e))) {
+			for (size_t i = 0; i < n && zlog_has_output(); i++) {
+				if (e[i].deferred) {
+					char text[LOG_BUFFER_STR_MAX_LEN];
+					zlog_format_deferred(text, sizeof(text), &e[i].d);
+					_zlog_output(text);
+				} else {
+					_zlog_output(e[i].text);
+				}
+			}
+			spsc_ring_release(r->entries, n);
+			left -= n;
 		}
+
+		unsigned dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+		if (dropped && zlog_has_output()) {
+			char text[64];
+			snprintf(text, sizeof(text), "[%u log lines dropped]\n", dropped);
+			_zlog_output(text);
+		}
+	}
+	if (zlog_fout != NULL) {
 		fflush(zlog_fout);
 	}
-	_zlog_buffer_size = 0;
 }
 
 /*
  * first zlog_get_buffer, write to @return
  * then zlog_finish_buffer
  *
- * zlog_get_buffer may flush the buffer, which require I/O ops
+ * Without a flush thread, zlog_get_buffer flushes a full ring itself, which
+ * requires I/O ops. With one, a full ring drops the line instead.
  */
-static inline char *zlog_get_buffer()
+static inline struct zlog_entry *zlog_get_buffer()
 {
-	_zlog_buffer_lock();
-	if (_zlog_buffer_size == LOG_BUFFER_SIZE) {
-		_zlog_flush_buffer();
+	struct zlog_ring *r = _zlog_ring_get();
+	if (r == NULL) {
+		return NULL;
 	}
 
-	/*
-	 * allocate buffer
-	 */
-	_zlog_buffer_size++;
-	return _zlog_buffer[_zlog_buffer_size - 1];
+	struct zlog_entry *e;
+	if (spsc_ring_reserve(r->entries, 1, (void **)&e) == 0) {
+		if (__atomic_load_n(&_zlog_flush_thread_running, __ATOMIC_RELAXED)) {
+			__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+		zlog_flush_buffer();
+		if (spsc_ring_reserve(r->entries, 1, (void **)&e) == 0) {
+			return NULL;
+		}
+	}
+	return e;
 }
 
 static inline void zlog_finish_buffer()
 {
+	struct zlog_ring *r = pthread_getspecific(_zlog_ring_key);
+	spsc_ring_commit(r->entries, 1);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&_zlog_flush_parked, __ATOMIC_SEQ_CST)) {
+		// The flush thread holds the mutex until it is waiting
+		pthread_mutex_lock(&_zlog_flush_mutex);
+		pthread_cond_signal(&_zlog_flush_cv);
+		pthread_mutex_unlock(&_zlog_flush_mutex);
+		return;
+	}
 #ifdef LOG_FORCE_FLUSH_BUFFER
-	_zlog_flush_buffer();
+	if (__atomic_load_n(&_zlog_flush_thread_running, __ATOMIC_RELAXED)) {
+		pthread_cond_signal(&_zlog_flush_cv);
+	} else {
+		zlog_flush_buffer();
+	}
 #endif
-	_zlog_buffer_unlock();
 }
 
 void zlog_init(char const *log_file)
@@ -86,45 +241,95 @@ void zlog_init_file(FILE * out)
 	zlog_fout = out;
 }
 
+/*
+ * Whether any ring has lines to flush, with _zlog_flush_mutex held
+ */
+static int _zlog_pending()
+{
+	struct zlog_ring *r;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (r = __atomic_load_n(&_zlog_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		if (spsc_ring_used(r->entries)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
 void *zlog_buffer_flush_thread(void *arg)
 {
 	struct timeval tv;
-	time_t lasttime;
-	time_t curtime;
-
-	gettimeofday(&tv, NULL);
-
-	lasttime = tv.tv_sec;
+	struct timespec deadline;
 
+	thread_role_enter(THREAD_ROLE_LOG, "log");
+	pthread_mutex_lock(&_zlog_flush_mutex);
 	do {
-		sleep(LOG_SLEEP_TIME_SEC);
-		gettimeofday(&tv, NULL);
-		curtime = tv.tv_sec;
-		if ((curtime - lasttime) >= LOG_FLUSH_INTERVAL_SEC) {
-			zlog_flush_buffer();
-			lasttime = curtime;
-		} else {
-			_zlog_buffer_lock();
-			if (_zlog_buffer_size >= LOG_BUFFER_FLUSH_SIZE) {
-				_zlog_flush_buffer();
+		_zlog_flush_buffer();
+
+		/*
+		 * Idle, sleep until a logging thread finds us parked after adding
+		 * a line. Parking is published before checking the rings, so one
+		 * side or the other sees the line.
+		 */
+		if (__atomic_load_n(&_zlog_idle, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&_zlog_flush_parked, 1, __ATOMIC_SEQ_CST);
+			if (!_zlog_pending()) {
+				pthread_cond_wait(&_zlog_flush_cv, &_zlog_flush_mutex);
 			}
-			_zlog_buffer_unlock();
+			__atomic_store_n(&_zlog_flush_parked, 0, __ATOMIC_RELAXED);
+			continue;
 		}
+
+		// Woken early for each line when logging immediately.
+		gettimeofday(&tv, NULL);
+		uint64_t ns = tv.tv_usec * 1000ULL + LOG_FLUSH_INTERVAL_MS * 1000000ULL;
+		deadline.tv_sec = tv.tv_sec + ns / 1000000000;
+		deadline.tv_nsec = ns % 1000000000;
+		pthread_cond_timedwait(&_zlog_flush_cv, &_zlog_flush_mutex, &deadline);
 	} while (1);
 	return NULL;
 }
 
 void zlog_init_flush_thread()
 {
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 	pthread_t thr;
-	pthread_create(&thr, NULL, zlog_buffer_flush_thread, NULL);
+
+	// Both the logger and log sinks may ask for it, only start one.
+	pthread_mutex_lock(&lock);
+	if (!__atomic_load_n(&_zlog_flush_thread_running, __ATOMIC_RELAXED)
+			&& pthread_create(&thr, NULL, zlog_buffer_flush_thread, NULL) == 0) {
+		__atomic_store_n(&_zlog_flush_thread_running, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void zlog_set_idle(int idle)
+{
+	__atomic_store_n(&_zlog_idle, idle, __ATOMIC_RELAXED);
+	if (!idle) {
+		pthread_mutex_lock(&_zlog_flush_mutex);
+		pthread_cond_signal(&_zlog_flush_cv);
+		pthread_mutex_unlock(&_zlog_flush_mutex);
+	}
+}
+
+void zlog_set_sink(zlog_sink_cb cb, void *arg)
+{
+	pthread_mutex_lock(&_zlog_flush_mutex);
+	if (cb == NULL) {
+		_zlog_flush_buffer();
+	}
+	zlog_sink_arg = arg;
+	__atomic_store_n(&zlog_sink, cb, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&_zlog_flush_mutex);
 }
 
 void zlog_flush_buffer()
 {
-	_zlog_buffer_lock();
+	pthread_mutex_lock(&_zlog_flush_mutex);
 	_zlog_flush_buffer();
-	_zlog_buffer_unlock();
+	pthread_mutex_unlock(&_zlog_flush_mutex);
 }
 
 void zlog_finish()
@@ -145,44 +350,380 @@ static const char *short_filename(const char *filename)
 	return src;
 }
 
-void zlog_time(const char *filename, int line, char const *fmt, ...)
+static size_t zlog_prefix(char *buf, size_t size, const struct timeval *tv,
+	const char *filename, int line)
 {
-	va_list va;
-	char *buffer = NULL;
 	char timebuf[64];
 	char usecbuf[16];
+	time_t curtime = tv->tv_sec;
+	struct tm tm;
+
+	strftime(timebuf, 64, "%m-%d-%Y %H:%M:%S", localtime_r(&curtime, &tm));
+	snprintf(usecbuf, 16, "%.03f", tv->tv_usec / 1000000.0);
+	int len = snprintf(buf, size, "[%s%ss] [%s:%d] ",
+		timebuf, usecbuf + 1, short_filename(filename), line);
+	return len < 0 ? 0 : TYPESAFE_MIN((size_t)len, size - 1);
+}
+
+/*
+ * One printf conversion, as far as deferred logging needs to understand it
+ */
+enum {
+	ZLOG_ARG_NONE,
+	ZLOG_ARG_INT,
+	ZLOG_ARG_UINT,
+	ZLOG_ARG_CHAR,
+	ZLOG_ARG_PTR,
+	ZLOG_ARG_STR,
+	ZLOG_ARG_DOUBLE,
+	ZLOG_ARG_UNSUPPORTED
+};
+
+struct zlog_spec {
+	const char *start;	// the '%'
+	const char *length;	// any length modifier
+	const char *end;	// just past the conversion
+	int stars;		// '*' widths and precisions, each taking an int
+	int precision;		// -1 if none, -2 if taken from the last '*'
+	int type;
+};
+
+static const char *zlog_parse_spec(const char *p, struct zlog_spec *s)
+{
+	s->start = p++;
+	s->stars = 0;
+	while (*p && strchr("-+ #0'", *p)) {
+		p++;
+	}
+	if (*p == '*') {
+		s->stars++;
+		p++;
+	}
+	while (isdigit((unsigned char)*p)) {
+		p++;
+	}
+	s->precision = -1;
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			s->stars++;
+			s->precision = -2;
+			p++;
+		} else {
+			s->precision = 0;
+		}
+		while (isdigit((unsigned char)*p)) {
+			if (s->precision < INT_MAX / 10) {
+				s->precision = s->precision * 10 + (*p - '0');
+			}
+			p++;
+		}
+	}
+
+	s->length = p;
+	int longs = 0, shorts = 0;
+	bool size = false, other = false;
+	for (; *p && strchr("hlzjtLq", *p); p++) {
+		if (*p == 'h') {
+			shorts++;
+		} else if (*p == 'l') {
+			longs++;
+		} else if (*p == 'z') {
+			size = true;
+		} else {
+			other = true;
+		}
+	}
+
+	char conv = *p;
+	s->end = conv ? p + 1 : p;
+	if (other || (s->end - s->start) > 24) {
+		s->type = ZLOG_ARG_UNSUPPORTED;
+	} else if (conv == 'd' || conv == 'i') {
+		s->type = ZLOG_ARG_INT;
+	} else if (strchr("uxXo", conv) && conv) {
+		s->type = ZLOG_ARG_UINT;
+	} else if (conv == 'c' && longs == 0) {
+		s->type = ZLOG_ARG_CHAR;
+	} else if (conv == 'p') {
+		s->type = ZLOG_ARG_PTR;
+	} else if (conv == 's' && longs == 0) {
+		s->type = ZLOG_ARG_STR;
+	} else if (strchr("feEgGaA", conv) && conv && shorts == 0) {
+		s->type = ZLOG_ARG_DOUBLE;
+	} else if (conv == '%') {
+		s->type = ZLOG_ARG_NONE;
+	} else {
+		s->type = ZLOG_ARG_UNSUPPORTED;
+	}
+
+	/*
+	 * Integers are stored widened to 64 bits, already cut down to the size
+	 * the modifier names so that they print the same
+	 */
+	if (s->type == ZLOG_ARG_INT || s->type == ZLOG_ARG_UINT) {
+		s->type |= (longs << 4) | (shorts << 8) | (size << 12);
+	}
+	return s->end;
+}
+
+static int zlog_put(uint8_t **a, uint8_t *end, const void *v, size_t len)
+{
+	if ((size_t)(end - *a) < len) {
+		return -1;
+	}
+	memcpy(*a, v, len);
+	*a += len;
+	return 0;
+}
+
+/*
+ * Keep a log call's arguments to be formatted by whoever flushes it. Returns
+ * -1 if the format has anything not understood here, or the arguments don't
+ * fit, for the caller to format the line itself.
+ */
+static int zlog_defer(struct zlog_deferred *d, const char *fmt, va_list va)
+{
+	uint8_t *a = d->args, *end = d->args + sizeof(d->args);
+	struct zlog_spec s;
+
+	d->fmt = fmt;
+	for (const char *p = fmt; (p = strchr(p, '%')); p = s.end) {
+		zlog_parse_spec(p, &s);
+		int star = 0;
+		for (int i = 0; i < s.stars; i++) {
+			star = va_arg(va, int);
+			if (zlog_put(&a, end, &star, sizeof(star))) {
+				return -1;
+			}
+		}
+		int precision = s.precision == -2 ? star : s.precision;
+
+		int64_t i64;
+		uint64_t u64;
+		int c;
+		void *ptr;
+		double dbl;
+		int longs = (s.type >> 4) & 0xf, shorts = (s.type >> 8) & 0xf;
+		bool size = (s.type >> 12) & 0xf;
+		switch (s.type & 0xf) {
+			case ZLOG_ARG_NONE:
+				break;
+			case ZLOG_ARG_INT:
+				if (size) {
+					i64 = va_arg(va, ssize_t);
+				} else if (longs == 2) {
+					i64 = va_arg(va, long long);
+				} else if (longs == 1) {
+					i64 = va_arg(va, long);
+				} else {
+					int v = va_arg(va, int);
+					i64 = shorts == 2 ? (signed char)v : shorts == 1 ? (short)v : v;
+				}
+				if (zlog_put(&a, end, &i64, sizeof(i64))) {
+					return -1;
+				}
+				break;
+			case ZLOG_ARG_UINT:
+				if (size) {
+					u64 = va_arg(va, size_t);
+				} else if (longs == 2) {
+					u64 = va_arg(va, unsigned long long);
+				} else if (longs == 1) {
+					u64 = va_arg(va, unsigned long);
+				} else {
+					unsigned v = va_arg(va, unsigned);
+					u64 = shorts == 2 ? (unsigned char)v : shorts == 1 ? (unsigned short)v : v;
+				}
+				if (zlog_put(&a, end, &u64, sizeof(u64))) {
+					return -1;
+				}
+				break;
+			case ZLOG_ARG_CHAR:
+				c = va_arg(va, int);
+				if (zlog_put(&a, end, &c, sizeof(c))) {
+					return -1;
+				}
+				break;
+			case ZLOG_ARG_PTR:
+				ptr = va_arg(va, void *);
+				if (zlog_put(&a, end, &ptr, sizeof(ptr))) {
+					return -1;
+				}
+				break;
+			case ZLOG_ARG_STR:
+				/*
+				 * Strings may not outlive the call, so they are copied,
+				 * and with a precision may not be terminated within it
+				 */
+				ptr = va_arg(va, char *);
+				if (ptr == NULL) {
+					ptr = "(null)";
+				}
+				size_t len = precision >= 0 ? strnlen(ptr, precision) : strlen(ptr);
+				if (zlog_put(&a, end, ptr, len) || zlog_put(&a, end, "", 1)) {
+					return -1;
+				}
+				break;
+			case ZLOG_ARG_DOUBLE:
+				dbl = va_arg(va, double);
+				if (zlog_put(&a, end, &dbl, sizeof(dbl))) {
+					return -1;
+				}
+				break;
+			default:
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static void zlog_hex_line(char *out, size_t size, size_t offset,
+	const unsigned char *p, size_t len);
+
+static size_t zlog_format_deferred(char *out, size_t size, struct zlog_deferred *d)
+{
+	size_t off = zlog_prefix(out, size, &d->tv, d->filename, d->line);
+	const uint8_t *a = d->args;
+
+	if (d->fmt == NULL) {
+		size_t offset;
+		memcpy(&offset, a, sizeof(offset));
+		zlog_hex_line(out + off, size - off, offset, a + sizeof(offset) + 1,
+			a[sizeof(offset)]);
+		return strlen(out);
+	}
+
+	const char *p = d->fmt;
+	while (*p && off < size - 1) {
+		const char *pct = strchr(p, '%');
+		size_t lit = pct ? (size_t)(pct - p) : strlen(p);
+		lit = TYPESAFE_MIN(lit, size - 1 - off);
+		memcpy(out + off, p, lit);
+		off += lit;
+		out[off] = '\0';
+		if (pct == NULL || off == size - 1) {
+			break;
+		}
+
+		struct zlog_spec s;
+		p = zlog_parse_spec(pct, &s);
+		int star[2] = { 0, 0 };
+		for (int i = 0; i < s.stars; i++) {
+			memcpy(&star[i], a, sizeof(int));
+			a += sizeof(int);
+		}
+
+		// Rebuild the conversion, widening any integer to long long.
+		char spec[32];
+		size_t spec_len = s.length - s.start;
+		memcpy(spec, s.start, spec_len);
+		int type = s.type & 0xf;
+		if (type == ZLOG_ARG_INT || type == ZLOG_ARG_UINT) {
+			spec[spec_len++] = 'l';
+			spec[spec_len++] = 'l';
+		}
+		spec[spec_len++] = s.end[-1];
+		spec[spec_len] = '\0';
+
+#define ZLOG_EMIT(v) (s.stars == 0 ? snprintf(out + off, size - off, spec, v) : \
+		s.stars == 1 ? snprintf(out + off, size - off, spec, star[0], v) : \
+		snprintf(out + off, size - off, spec, star[0], star[1], v))
+		int len = 0;
+		int64_t i64;
+		int c;
+		void *ptr;
+		double dbl;
+		switch (type) {
+			case ZLOG_ARG_NONE:
+				len = snprintf(out + off, size - off, "%%");
+				break;
+			case ZLOG_ARG_INT:
+			case ZLOG_ARG_UINT:
+				memcpy(&i64, a, sizeof(i64));
+				a += sizeof(i64);
+				len = ZLOG_EMIT((long long)i64);
+				break;
+			case ZLOG_ARG_CHAR:
+				memcpy(&c, a, sizeof(c));
+				a += sizeof(c);
+				len = ZLOG_EMIT(c);
+				break;
+			case ZLOG_ARG_PTR:
+				memcpy(&ptr, a, sizeof(ptr));
+				a += sizeof(ptr);
+				len = ZLOG_EMIT(ptr);
+				break;
+			case ZLOG_ARG_STR:
+				len = ZLOG_EMIT((const char *)a);
+				a += strlen((const char *)a) + 1;
+				break;
+			case ZLOG_ARG_DOUBLE:
+				memcpy(&dbl, a, sizeof(dbl));
+				a += sizeof(dbl);
+				len = ZLOG_EMIT(dbl);
+				break;
+		}
+#undef ZLOG_EMIT
+		if (len > 0) {
+			off = TYPESAFE_MIN(off + len, size - 1);
+		}
+	}
+	return off;
+}
+
+void zlog_time(const char *filename, int line, char const *fmt, ...)
+{
+	va_list va;
+	struct zlog_entry *e;
 	struct timeval tv;
-	time_t curtime;
 
-	if (zlog_fout) {
-		gettimeofday(&tv, NULL);
-		curtime = tv.tv_sec;
-		strftime(timebuf, 64, "%m-%d-%Y %H:%M:%S", localtime(&curtime));
-		snprintf(usecbuf, 16, "%.03f", tv.tv_usec / 1000000.0);
+	if (!zlog_has_output()) {
+		return;
+	}
 
-		buffer = zlog_get_buffer();
-		snprintf(buffer, LOG_BUFFER_STR_MAX_LEN, "[%s%ss] [%s:%d] ",
-			timebuf, usecbuf + 1, short_filename(filename), line);
-		buffer += strlen(buffer);
+	gettimeofday(&tv, NULL);
+	e = zlog_get_buffer();
+	if (e == NULL) {
+		return;
+	}
 
-		va_start(va, fmt);
-		vsnprintf(buffer, LOG_BUFFER_STR_MAX_LEN, fmt, va);
-		zlog_finish_buffer();
-		va_end(va);
+	va_start(va, fmt);
+#ifdef LOG_DEFERRED_FORMAT
+	va_list args;
+	va_copy(args, va);
+	e->deferred = zlog_defer(&e->d, fmt, args) == 0;
+	va_end(args);
+	if (e->deferred) {
+		e->d.filename = filename;
+		e->d.line = line;
+		e->d.tv = tv;
+	} else
+#endif
+	{
+		e->deferred = false;
+		size_t off = zlog_prefix(e->text, sizeof(e->text), &tv, filename, line);
+		vsnprintf(e->text + off, sizeof(e->text) - off, fmt, va);
 	}
+	va_end(va);
+	zlog_finish_buffer();
 }
 
 void zlog(const char *filename, int line, char const *fmt, ...)
 {
 	va_list va;
-	char *buffer = NULL;
+	struct zlog_entry *e;
 
-	if (zlog_fout) {
-		buffer = zlog_get_buffer();
-		snprintf(buffer, LOG_BUFFER_STR_MAX_LEN, "[%s:%d]",
+	if (zlog_has_output()) {
+		e = zlog_get_buffer();
+		if (e == NULL) {
+			return;
+		}
+		e->deferred = false;
+		snprintf(e->text, LOG_BUFFER_STR_MAX_LEN, "[%s:%d]",
 			short_filename(filename), line);
 		va_start(va, fmt);
-		vsnprintf(buffer, LOG_BUFFER_STR_MAX_LEN, fmt, va);
+		vsnprintf(e->text, LOG_BUFFER_STR_MAX_LEN, fmt, va);
 		zlog_finish_buffer();
 		va_end(va);
 	}
@@ -191,25 +732,17 @@ void zlog(const char *filename, int line, char const *fmt, ...)
 /*
  * hex dump from http://sws.dett.de/mini/hexdump-c/
  */
-void zlog_hex(const char *filename, int line, const void *buf, size_t len)
+static void zlog_hex_line(char *out, size_t size, size_t offset,
+	const unsigned char *p, size_t len)
 {
-	const unsigned char *p = buf;
 	unsigned char c;
 	char bytestr[4] = { 0 };
 	char addrstr[10] = { 0 };
 	char hexstr[16 * 3 + 5] = { 0 };
 	char charstr[16 * 1 + 5] = { 0 };
 
+	snprintf(addrstr, sizeof(addrstr), "0x%02x", (int)offset);
 	for (size_t n = 1; n <= len; n++) {
-
-		if (n % 16 == 1) {
-			/*
-			 * store address for this line
-			 */
-			snprintf(addrstr, sizeof(addrstr), "0x%02x",
-				(int)((size_t) p - (size_t) buf));
-		}
-
 		c = *p;
 		if (!isprint(c)) {
 			c = '.';
@@ -227,15 +760,7 @@ void zlog_hex(const char *filename, int line, const void *buf, size_t len)
 		snprintf(bytestr, sizeof(bytestr), "%c", c);
 		strncat(charstr, bytestr, sizeof(charstr) - strlen(charstr) - 1);
 
-		if (n % 16 == 0) {
-			/*
-			 * line completed
-			 */
-			zlog_time(filename, line, "[%4.4s]   %-50.50s  %s\n", addrstr,
-				hexstr, charstr);
-			hexstr[0] = 0;
-			charstr[0] = 0;
-		} else if (n % 8 == 0) {
+		if (n % 8 == 0 && n != 16) {
 			/*
 			 * half line: add whitespaces
 			 */
@@ -244,12 +769,40 @@ void zlog_hex(const char *filename, int line, const void *buf, size_t len)
 		}
 		p++;
 	}
+	snprintf(out, size, "[%4.4s]   %-50.50s  %s\n", addrstr, hexstr, charstr);
+}
 
-	if (strlen(hexstr) > 0) {
-		/*
-		 * print rest of buffer if not empty
-		 */
-		zlog_time(filename, line, "[%4.4s]   %-50.50s  %s\n", addrstr, hexstr,
-			charstr);
+void zlog_hex(const char *filename, int line, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	for (size_t offset = 0; offset < len; offset += 16) {
+		uint8_t n = TYPESAFE_MIN(len - offset, 16);
+#ifdef LOG_DEFERRED_FORMAT
+		// Keep the raw bytes of each line, they are formatted when flushed.
+		struct timeval tv;
+		struct zlog_entry *e;
+		if (!zlog_has_output()) {
+			return;
+		}
+		gettimeofday(&tv, NULL);
+		e = zlog_get_buffer();
+		if (e == NULL) {
+			continue;
+		}
+		e->deferred = true;
+		e->d.fmt = NULL;
+		e->d.filename = filename;
+		e->d.line = line;
+		e->d.tv = tv;
+		memcpy(e->d.args, &offset, sizeof(offset));
+		e->d.args[sizeof(offset)] = n;
+		memcpy(e->d.args + sizeof(offset) + 1, p + offset, n);
+		zlog_finish_buffer();
+#else
+		char hexline[LOG_BUFFER_STR_MAX_LEN];
+		zlog_hex_line(hexline, sizeof(hexline), offset, p + offset, n);
+		zlog_time(filename, line, "%s", hexline);
+#endif
 	}
 }
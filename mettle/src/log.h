@@ -15,17 +15,31 @@
  */
 #define LOG_FORCE_FLUSH_BUFFER
 
+/*
+ * Keep format strings and raw arguments, formatting lines when they are
+ * flushed rather than on the logging thread
+ */
+#define LOG_DEFERRED_FORMAT
+
 #define LOG_BUFFER_STR_MAX_LEN 128
-#define LOG_BUFFER_SIZE 256
+#ifdef METTLE_LOW_MEMORY
+#define LOG_BUFFER_SIZE 32	// lines buffered per logging thread
+#else
+#define LOG_BUFFER_SIZE 256	// lines buffered per logging thread
+#endif
 #define LOG_REAL_WORLD_TIME 1
 
-#define LOG_FLUSH_INTERVAL_SEC 1
-#define LOG_SLEEP_TIME_SEC 1
+#define LOG_FLUSH_INTERVAL_MS 100
 
 /*
- * In practice: flush size < .8 * BUFFER_SIZE
+ * Log sites more verbose than this are compiled out: 0 keeps only errors,
+ * 1 adds debug, 2 (the default) adds info and -1 removes them all
  */
-#define LOG_BUFFER_FLUSH_SIZE (0.8 * LOG_BUFFER_SIZE)
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 2
+#endif
+
+#define LOG_ENABLED(level) (LOG_MIN_LEVEL >= (level) && _zlog_level >= (level))
 
 extern int _zlog_level;
 static inline void
@@ -49,27 +63,29 @@ log_set_level(int level)
 #define log_init(log_file)
 #define log_init_file(file_hdl)
 #define log_init_flush_thread
+#define log_set_idle(idle)
 #define log_finish
 #define log_flush_buffer
 
 #else
 
 #define log_error(format, ...) \
-	if (_zlog_level >= 0) zlog_time(ZLOG_LOC, format "\n", ##__VA_ARGS__)
+	if (LOG_ENABLED(0)) zlog_time(ZLOG_LOC, format "\n", ##__VA_ARGS__)
 #define log_error_hex(buf, len) \
-	if (_zlog_level >= 0) zlog_hex(ZLOG_LOC, buf, len)
+	if (LOG_ENABLED(0)) zlog_hex(ZLOG_LOC, buf, len)
 #define log_debug(format, ...) \
-	if (_zlog_level >= 1) zlog_time(ZLOG_LOC, format "\n", ##__VA_ARGS__)
+	if (LOG_ENABLED(1)) zlog_time(ZLOG_LOC, format "\n", ##__VA_ARGS__)
 #define log_debug_hex(buf, len) \
-	if (_zlog_level >= 1) zlog_hex(ZLOG_LOC, buf, len)
+	if (LOG_ENABLED(1)) zlog_hex(ZLOG_LOC, buf, len)
 #define log_info(format, ...) \
-	if (_zlog_level >= 2) zlog_time(ZLOG_LOC, format "\n", ##__VA_ARGS__)
+	if (LOG_ENABLED(2)) zlog_time(ZLOG_LOC, format "\n", ##__VA_ARGS__)
 #define log_info_hex(buf, len) \
-	if (_zlog_level >= 2) zlog_hex(ZLOG_LOC, buf, len)
+	if (LOG_ENABLED(2)) zlog_hex(ZLOG_LOC, buf, len)
 
 #define log_init(log_file) zlog_init(log_file)
 #define log_init_file(file_hdl) zlog_init_file(file_hdl)
 #define log_init_flush_thread zlog_init_flush_thread
+#define log_set_idle zlog_set_idle
 #define log_finish zlog_finish
 #define log_flush_buffer zlog_flush_buffer
 
@@ -88,11 +104,17 @@ void zlog_init(char const *log_file);
 void zlog_init_file(FILE * out);
 // creating a flushing thread
 void zlog_init_flush_thread();
+// while idle, the flushing thread sleeps until there is something to flush
+void zlog_set_idle(int idle);
 // finish using the zlog; clean up
 void zlog_finish();
 // explicitely flush the buffer in memory
 void zlog_flush_buffer();
 
+// also hand each flushed line to 'cb', on the flushing thread; NULL stops it
+typedef void (*zlog_sink_cb)(const char *line, size_t len, void *arg);
+void zlog_set_sink(zlog_sink_cb cb, void *arg);
+
 // log an entry; using the printf format
 void zlogf(char const *fmt, ...)
 	__attribute__ ((format(printf, 1, 2)));
@@ -0,0 +1,158 @@
+/**
+ * @brief Log streaming to the framework
+ * @file log_stream.c
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer_queue.h"
+#include "log.h"
+#include "log_stream.h"
+#include "tlv.h"
+
+/*
+ * Smallest batch allowed, so slow rates still move whole lines
+ */
+#define LOG_STREAM_MIN_BATCH 4096
+
+struct log_stream {
+	struct ev_loop *loop;
+	struct tlv_dispatcher *td;
+	struct ev_timer timer;
+	size_t batch_max;
+	int prev_level;
+	uint32_t seq;
+
+	/*
+	 * Filled by the log flushing thread, drained by the timer
+	 */
+	pthread_mutex_t lock;
+	struct buffer_queue *lines;
+	uint32_t dropped;
+};
+
+static struct log_stream *stream = NULL;
+
+/*
+ * Called on the log flushing thread, so it must not log itself
+ */
+static void log_stream_sink(const char *line, size_t len, void *arg)
+{
+	struct log_stream *s = arg;
+	pthread_mutex_lock(&s->lock);
+	if (buffer_queue_len(s->lines) + len > LOG_STREAM_BACKLOG
+			|| buffer_queue_add(s->lines, (void *)line, len) == -1) {
+		s->dropped++;
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void log_stream_send(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+	struct log_stream *s = w->data;
+	size_t queued;
+
+	// Hold off while earlier batches, or anything else, are still waiting.
+	tlv_dispatcher_queued_responses(s->td, &queued);
+	if (queued > LOG_STREAM_BACKLOG) {
+		return;
+	}
+
+	char *buf = malloc(s->batch_max);
+	if (buf == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	size_t len = buffer_queue_copy(s->lines, buf, s->batch_max);
+	if (len < buffer_queue_len(s->lines)) {
+		// Send whole lines, unless one is longer than a batch.
+		size_t end = len;
+		while (end && buf[end - 1] != '\n') {
+			end--;
+		}
+		if (end) {
+			len = end;
+		}
+	}
+	buffer_queue_drain(s->lines, len);
+	uint32_t dropped = s->dropped;
+	s->dropped = 0;
+	pthread_mutex_unlock(&s->lock);
+
+	if (len || dropped) {
+		struct tlv_packet *p = tlv_packet_new(TLV_PACKET_TYPE_REQUEST, len + 128);
+		if (p) {
+			p = tlv_packet_add_uuid(p, s->td);
+			p = tlv_packet_add_str(p, TLV_TYPE_METHOD, "core_log_stream");
+			p = tlv_packet_add_fmt(p, TLV_TYPE_REQUEST_ID, "log-%u", s->seq++);
+			p = tlv_packet_add_raw(p, TLV_TYPE_LOG_DATA, buf, len);
+			if (dropped) {
+				p = tlv_packet_add_u32(p, TLV_TYPE_LOG_DROPPED, dropped);
+			}
+			tlv_packet_set_lane(p, TLV_LANE_BULK);
+			tlv_dispatcher_enqueue_response(s->td, p);
+		}
+	}
+	free(buf);
+}
+
+int log_stream_start(struct ev_loop *loop, struct tlv_dispatcher *td,
+	int level, uint32_t interval_ms, uint64_t rate)
+{
+	struct log_stream *s = stream;
+	if (s == NULL) {
+		s = calloc(1, sizeof(*s));
+		if (s == NULL) {
+			return -1;
+		}
+		s->lines = buffer_queue_new();
+		if (s->lines == NULL) {
+			free(s);
+			return -1;
+		}
+		pthread_mutex_init(&s->lock, NULL);
+		s->loop = loop;
+		s->td = td;
+		s->prev_level = _zlog_level;
+		ev_init(&s->timer, log_stream_send);
+		s->timer.data = s;
+		stream = s;
+		zlog_set_sink(log_stream_sink, s);
+		log_init_flush_thread();
+	}
+
+	if (interval_ms == 0) {
+		interval_ms = LOG_STREAM_INTERVAL_MS;
+	}
+	s->batch_max = LOG_STREAM_BACKLOG;
+	if (rate) {
+		uint64_t batch = rate * interval_ms / 1000;
+		s->batch_max = batch < LOG_STREAM_MIN_BATCH ? LOG_STREAM_MIN_BATCH :
+			batch < LOG_STREAM_BACKLOG ? batch : LOG_STREAM_BACKLOG;
+	}
+	ev_timer_stop(loop, &s->timer);
+	ev_timer_set(&s->timer, interval_ms / 1000.0, interval_ms / 1000.0);
+	ev_timer_start(loop, &s->timer);
+	log_set_level(level);
+	return 0;
+}
+
+void log_stream_stop(void)
+{
+	struct log_stream *s = stream;
+	if (s == NULL) {
+		return;
+	}
+
+	// Once the sink is cleared, the flushing thread no longer touches it.
+	zlog_set_sink(NULL, NULL);
+	log_set_level(s->prev_level);
+	ev_timer_stop(s->loop, &s->timer);
+	buffer_queue_free(s->lines);
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+	stream = NULL;
+}
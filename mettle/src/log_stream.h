@@ -0,0 +1,34 @@
+/**
+ * @brief Log streaming to the framework
+ * @file log_stream.h
+ */
+
+#ifndef _LOG_STREAM_H_
+#define _LOG_STREAM_H_
+
+#include <ev.h>
+#include <stdint.h>
+
+struct tlv_dispatcher;
+
+/*
+ * Log lines are batched and sent as core_log_stream requests every
+ * 'interval_ms', in the bulk lane and at no more than 'rate' bytes per
+ * second (0 for unlimited). Batches are compressed by the dispatcher like
+ * any other large value. Lines that don't fit the backlog while the
+ * stream is held back are dropped, and the count sent with the next batch.
+ */
+#define LOG_STREAM_INTERVAL_MS 1000
+#define LOG_STREAM_RATE        (16 * 1024)
+#define LOG_STREAM_BACKLOG     (256 * 1024)
+
+/*
+ * Starts streaming at 'level', or changes the settings of the running
+ * stream. The previous log level is restored when it stops.
+ */
+int log_stream_start(struct ev_loop *loop, struct tlv_dispatcher *td,
+	int level, uint32_t interval_ms, uint64_t rate);
+
+void log_stream_stop(void);
+
+#endif
@@ -7,15 +7,18 @@
 #include <getopt.h>
 #include <libgen.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "argv_split.h"
+#include "buffer_queue.h"
 #include "log.h"
 #include "mettle.h"
 #include "service.h"
+#include "tlv.h"
 
 static void usage(const char *name)
 {
@@ -28,6 +31,12 @@ static void usage(const char *name)
 	printf("  -b, --background <0|1> start as a background service (0 disable, 1 enable)\n");
 	printf("  -p, --persist [none|install|uninstall] manage persistence\n");
 	printf("  -n, --name <name>      name to start as\n");
+	printf("  -S, --stripe           send over all connection URIs at once\n");
+	printf("  -T, --transport-thread run connections on a thread of their own\n");
+	printf("  -R, --resume           resend unacknowledged packets after reconnecting\n");
+	printf("  -M, --memory-budget <KB> slow down and refuse new channels past this much buffered\n");
+	printf("  -B, --bootstrap        send session details unasked once connected\n");
+	printf("  -N, --session          start another session, which the options after it apply to\n");
 	printf("\n");
 	exit(1);
 }
@@ -58,9 +67,15 @@ static int parse_cmdline(int argc, char * const argv[], struct mettle *m, int fl
 		{"background", required_argument, NULL, 'b'},
 		{"persist", required_argument, NULL, 'p'},
 		{"name", required_argument, NULL, 'n'},
+		{"stripe", no_argument, NULL, 'S'},
+		{"transport-thread", no_argument, NULL, 'T'},
+		{"resume", no_argument, NULL, 'R'},
+		{"memory-budget", required_argument, NULL, 'M'},
+		{"bootstrap", no_argument, NULL, 'B'},
+		{"session", no_argument, NULL, 'N'},
 		{ 0, 0, NULL, 0 }
 	};
-	const char *short_options = "hu:U:G:d:o:b:p:n:";
+	const char *short_options = "hu:U:G:d:o:b:p:n:STRM:BN";
 	const char *out = NULL;
 	char *name = strdup("mettle");
 	bool name_flag = false;
@@ -69,6 +84,11 @@ static int parse_cmdline(int argc, char * const argv[], struct mettle *m, int fl
 	enum persist_type persist = persist_none;
 	int log_level = 0;
 
+	/*
+	 * Connection options apply to the latest session
+	 */
+	struct mettle *session = m;
+
 	/*
 	 * This needs to be initialized to 1 in order for consistent behavior from
 	 * getopt_long when called multiple times.
@@ -77,13 +97,20 @@ static int parse_cmdline(int argc, char * const argv[], struct mettle *m, int fl
 	while ((c = getopt_long(argc, argv, short_options, options, &index)) != -1) {
 		switch (c) {
 		case 'u':
-			c2_add_transport_uri(mettle_get_c2(m), optarg);
+			c2_add_transport_uri(mettle_get_c2(session), optarg);
 			break;
 		case 'U':
-			mettle_set_uuid_base64(m, optarg);
+			mettle_set_uuid_base64(session, optarg);
 			break;
 		case 'G':
-			mettle_set_session_guid_base64(m, optarg);
+			mettle_set_session_guid_base64(session, optarg);
+			break;
+		case 'N':
+			session = mettle_session_new(m);
+			if (session == NULL) {
+				fprintf(stderr, "could not add a session\n");
+				return -1;
+			}
 			break;
 		case 'n':
 			free(name);
@@ -125,6 +152,31 @@ static int parse_cmdline(int argc, char * const argv[], struct mettle *m, int fl
 		case 'o':
 			out = optarg;
 			break;
+		case 'S':
+			c2_set_striping(mettle_get_c2(session), true);
+			tlv_dispatcher_set_sequencing(mettle_get_tlv_dispatcher(session), true);
+			break;
+		case 'T':
+			c2_set_transport_thread(mettle_get_c2(session), true);
+			break;
+		case 'R':
+			c2_set_resumption(mettle_get_c2(session), C2_RESUME_MAX_BYTES);
+			tlv_dispatcher_set_resumption(mettle_get_tlv_dispatcher(session), true);
+			break;
+		case 'B':
+			mettle_set_bootstrap(session, true);
+			break;
+		case 'M':
+			{
+				const char *errstr = NULL;
+				long long kb = strtonum(optarg, 0, SIZE_MAX / 1024, &errstr);
+				if (errstr != NULL) {
+					fprintf(stderr, "invalid memory budget '%s': %s\n", optarg, errstr);
+					return -1;
+				}
+				buffer_queue_set_budget(kb * 1024);
+			}
+			break;
 		case 'h':
 		default:
 			usage("mettle");
@@ -158,6 +210,12 @@ static int parse_cmdline(int argc, char * const argv[], struct mettle *m, int fl
 				}
 				free(args);
 				args = new_args;
+			} else if (c == 'S' || c == 'R' || c == 'B' || c == 'N') {
+				if (asprintf(&new_args, "%s -%c", args, c) == -1) {
+					return -1;
+				}
+				free(args);
+				args = new_args;
 			}
 		}
 		start_service(name, argv[0], args, persist);
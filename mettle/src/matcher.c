@@ -0,0 +1,242 @@
+/**
+ * @brief Searching buffers for one or more byte strings
+ * @file matcher.c
+ *
+ * A single pattern is found by comparing its first and last bytes against
+ * 16 positions at a time, only checking the rest where both agree. Several
+ * patterns are found in one pass with an Aho-Corasick automaton, built out
+ * into a full transition table so each input byte costs one lookup.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "matcher.h"
+
+/*
+ * Bounds the transition table at 4MB
+ */
+#define MATCHER_MAX_STATES 4096
+
+struct pattern {
+	unsigned char *data;
+	size_t len;
+};
+
+struct matcher {
+	struct pattern *patterns;
+	size_t num_patterns;
+	size_t max_len;
+
+	/*
+	 * Automaton, state 0 is the root. out is the pattern ending at a state,
+	 * and dict the next state down the failure chain that ends one.
+	 */
+	int32_t (*next)[256];
+	int32_t *out;
+	int32_t *dict;
+	int32_t *report;
+	size_t num_states;
+};
+
+static const unsigned char *
+find_one(const unsigned char *h, size_t hlen, const unsigned char *n, size_t nlen)
+{
+	if (nlen > hlen) {
+		return NULL;
+	}
+#ifdef __SSE2__
+	size_t i = 0;
+	if (nlen > 1) {
+		__m128i first = _mm_set1_epi8(n[0]);
+		__m128i last = _mm_set1_epi8(n[nlen - 1]);
+		for (; i + nlen - 1 + 16 <= hlen; i += 16) {
+			__m128i bf = _mm_loadu_si128((const __m128i *)(h + i));
+			__m128i bl = _mm_loadu_si128((const __m128i *)(h + i + nlen - 1));
+			unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+				_mm_cmpeq_epi8(first, bf), _mm_cmpeq_epi8(last, bl)));
+			while (mask) {
+				unsigned bit = __builtin_ctz(mask);
+				if (memcmp(h + i + bit + 1, n + 1, nlen - 2) == 0) {
+					return h + i + bit;
+				}
+				mask &= mask - 1;
+			}
+		}
+	}
+	return memmem(h + i, hlen - i, n, nlen);
+#else
+	return memmem(h, hlen, n, nlen);
+#endif
+}
+
+struct matcher * matcher_new(void)
+{
+	return calloc(1, sizeof(struct matcher));
+}
+
+int matcher_add(struct matcher *m, const void *pattern, size_t len)
+{
+	size_t total = 1;
+	for (size_t i = 0; i < m->num_patterns; i++) {
+		total += m->patterns[i].len;
+	}
+	if (len == 0 || total + len > MATCHER_MAX_STATES) {
+		return -1;
+	}
+
+	struct pattern *patterns = realloc(m->patterns,
+		(m->num_patterns + 1) * sizeof(*patterns));
+	if (patterns == NULL) {
+		return -1;
+	}
+	m->patterns = patterns;
+
+	struct pattern *p = &m->patterns[m->num_patterns];
+	p->data = malloc(len);
+	if (p->data == NULL) {
+		return -1;
+	}
+	memcpy(p->data, pattern, len);
+	p->len = len;
+	if (len > m->max_len) {
+		m->max_len = len;
+	}
+	return m->num_patterns++;
+}
+
+size_t matcher_max_len(struct matcher *m)
+{
+	return m->max_len;
+}
+
+int matcher_compile(struct matcher *m)
+{
+	if (m->num_patterns < 2) {
+		return m->num_patterns ? 0 : -1;
+	}
+
+	size_t max_states = 1;
+	for (size_t i = 0; i < m->num_patterns; i++) {
+		max_states += m->patterns[i].len;
+	}
+	m->next = calloc(max_states, sizeof(*m->next));
+	m->out = malloc(max_states * sizeof(*m->out));
+	m->dict = malloc(max_states * sizeof(*m->dict));
+	m->report = malloc(max_states * sizeof(*m->report));
+	int32_t *queue = malloc(max_states * sizeof(*queue));
+	if (m->next == NULL || m->out == NULL || m->dict == NULL
+			|| m->report == NULL || queue == NULL) {
+		free(queue);
+		return -1;
+	}
+
+	/*
+	 * Trie of the patterns; 0 marks a missing child, since nothing
+	 * transitions back to the root while it is being built
+	 */
+	m->num_states = 1;
+	m->out[0] = -1;
+	for (size_t i = 0; i < m->num_patterns; i++) {
+		struct pattern *p = &m->patterns[i];
+		int32_t s = 0;
+		for (size_t j = 0; j < p->len; j++) {
+			int32_t *t = &m->next[s][p->data[j]];
+			if (*t == 0) {
+				*t = m->num_states++;
+				m->out[*t] = -1;
+			}
+			s = *t;
+		}
+		if (m->out[s] == -1) {
+			m->out[s] = i;
+		}
+	}
+
+	/*
+	 * Breadth first, each state's failure link is already known when its
+	 * children are reached, so missing transitions are copied from it
+	 */
+	int32_t *fail = m->report;
+	size_t head = 0, tail = 0;
+	m->dict[0] = -1;
+	for (int c = 0; c < 256; c++) {
+		int32_t t = m->next[0][c];
+		if (t) {
+			fail[t] = 0;
+			m->dict[t] = -1;
+			queue[tail++] = t;
+		}
+	}
+	while (head < tail) {
+		int32_t s = queue[head++];
+		for (int c = 0; c < 256; c++) {
+			int32_t t = m->next[s][c];
+			int32_t f = m->next[fail[s]][c];
+			if (t == 0) {
+				m->next[s][c] = f;
+				continue;
+			}
+			fail[t] = f;
+			m->dict[t] = m->out[f] != -1 ? f : m->dict[f];
+			queue[tail++] = t;
+		}
+	}
+	free(queue);
+
+	for (size_t s = 0; s < m->num_states; s++) {
+		m->report[s] = m->out[s] != -1 ? (int32_t)s : m->dict[s];
+	}
+	return 0;
+}
+
+int matcher_scan(struct matcher *m, const void *buf, size_t len,
+	matcher_cb cb, void *arg)
+{
+	const unsigned char *data = buf;
+
+	if (m->num_patterns == 1) {
+		struct pattern *p = &m->patterns[0];
+		const unsigned char *at = data;
+		while ((at = find_one(at, len - (at - data), p->data, p->len))) {
+			if (cb(0, at - data, p->len, arg)) {
+				return 1;
+			}
+			at++;
+		}
+		return 0;
+	}
+
+	int32_t s = 0;
+	for (size_t i = 0; i < len; i++) {
+		s = m->next[s][data[i]];
+		for (int32_t t = m->report[s]; t != -1; t = m->dict[t]) {
+			size_t pat = m->out[t];
+			size_t pat_len = m->patterns[pat].len;
+			if (cb(pat, i + 1 - pat_len, pat_len, arg)) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+void matcher_free(struct matcher *m)
+{
+	if (m) {
+		for (size_t i = 0; i < m->num_patterns; i++) {
+			free(m->patterns[i].data);
+		}
+		free(m->patterns);
+		free(m->next);
+		free(m->out);
+		free(m->dict);
+		free(m->report);
+		free(m);
+	}
+}
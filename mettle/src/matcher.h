@@ -0,0 +1,40 @@
+/**
+ * @brief Searching buffers for one or more byte strings
+ * @file matcher.h
+ */
+
+#ifndef _MATCHER_H_
+#define _MATCHER_H_
+
+#include <stddef.h>
+
+struct matcher;
+
+/*
+ * Called for each match with the index of the pattern, in the order added,
+ * and the offset and length of the match. Returning non-zero stops the scan.
+ */
+typedef int (*matcher_cb)(size_t pattern, size_t offset, size_t len, void *arg);
+
+struct matcher * matcher_new(void);
+
+/*
+ * Returns the index of the new pattern, or -1 if it is empty or would make
+ * the pattern set too large
+ */
+int matcher_add(struct matcher *m, const void *pattern, size_t len);
+
+int matcher_compile(struct matcher *m);
+
+size_t matcher_max_len(struct matcher *m);
+
+/*
+ * Reports every match that lies entirely within buf, overlapping ones
+ * included. Returns non-zero if the callback stopped the scan.
+ */
+int matcher_scan(struct matcher *m, const void *buf, size_t len,
+	matcher_cb cb, void *arg);
+
+void matcher_free(struct matcher *m);
+
+#endif
@@ -0,0 +1,131 @@
+/**
+ * @brief Per-subsystem allocation accounting
+ * @file mem_acct.c
+ */
+
+#ifdef METTLE_MEM_ACCOUNTING
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#define alloc_size(ptr) malloc_size(ptr)
+#elif defined(_WIN32)
+#include <malloc.h>
+#define alloc_size(ptr) _msize(ptr)
+#else
+#include <malloc.h>
+#define alloc_size(ptr) malloc_usable_size(ptr)
+#endif
+
+#include "mem_acct.h"
+#include "tlv.h"
+
+static const char *tag_names[MEM_TAG_COUNT] = {
+	[MEM_TAG_BUFFER_QUEUE] = "buffer_queue",
+	[MEM_TAG_TLV_PACKET] = "tlv_packet",
+	[MEM_TAG_CHANNEL] = "channel",
+	[MEM_TAG_PROCESS] = "process",
+	[MEM_TAG_EXTENSION] = "extension",
+	[MEM_TAG_HTTP] = "http",
+};
+
+/*
+ * Updated with atomics, allocations happening on worker threads too
+ */
+static struct {
+	uint64_t live;
+	uint64_t peak;
+	uint64_t allocs;
+} tags[MEM_TAG_COUNT];
+
+static void add_bytes(enum mem_tag tag, size_t len)
+{
+	uint64_t live = __atomic_add_fetch(&tags[tag].live, len, __ATOMIC_RELAXED);
+	uint64_t peak = __atomic_load_n(&tags[tag].peak, __ATOMIC_RELAXED);
+	while (live > peak && !__atomic_compare_exchange_n(&tags[tag].peak,
+			&peak, live, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+void mem_acct_add(enum mem_tag tag, size_t len)
+{
+	if (tag != MEM_TAG_NONE) {
+		add_bytes(tag, len);
+		__atomic_add_fetch(&tags[tag].allocs, 1, __ATOMIC_RELAXED);
+	}
+}
+
+void mem_acct_sub(enum mem_tag tag, size_t len)
+{
+	if (tag != MEM_TAG_NONE) {
+		__atomic_sub_fetch(&tags[tag].live, len, __ATOMIC_RELAXED);
+	}
+}
+
+void *mem_acct_malloc(enum mem_tag tag, size_t len)
+{
+	void *ptr = malloc(len);
+	if (ptr) {
+		mem_acct_add(tag, alloc_size(ptr));
+	}
+	return ptr;
+}
+
+void *mem_acct_calloc(enum mem_tag tag, size_t count, size_t len)
+{
+	void *ptr = calloc(count, len);
+	if (ptr) {
+		mem_acct_add(tag, alloc_size(ptr));
+	}
+	return ptr;
+}
+
+void *mem_acct_realloc(enum mem_tag tag, void *ptr, size_t len)
+{
+	size_t old_len = ptr ? alloc_size(ptr) : 0;
+	void *new_ptr = realloc(ptr, len);
+	if (new_ptr) {
+		mem_acct_sub(tag, old_len);
+		mem_acct_add(tag, alloc_size(new_ptr));
+	}
+	return new_ptr;
+}
+
+void mem_acct_free(enum mem_tag tag, void *ptr)
+{
+	if (ptr) {
+		mem_acct_sub(tag, alloc_size(ptr));
+		free(ptr);
+	}
+}
+
+void mem_acct_retag(void *ptr, enum mem_tag from, enum mem_tag to)
+{
+	if (ptr && from != to) {
+		size_t len = alloc_size(ptr);
+		mem_acct_sub(from, len);
+		if (to != MEM_TAG_NONE) {
+			add_bytes(to, len);
+		}
+	}
+}
+
+struct tlv_packet * mem_acct_add_snapshot(struct tlv_packet *p)
+{
+	for (int i = 0; i < MEM_TAG_COUNT; i++) {
+		struct tlv_packet *g = tlv_packet_new(TLV_TYPE_MEM_TAG, 0);
+		g = tlv_packet_add_str(g, TLV_TYPE_MEM_TAG_NAME, tag_names[i]);
+		g = tlv_packet_add_u64(g, TLV_TYPE_MEM_LIVE,
+			__atomic_load_n(&tags[i].live, __ATOMIC_RELAXED));
+		g = tlv_packet_add_u64(g, TLV_TYPE_MEM_PEAK,
+			__atomic_load_n(&tags[i].peak, __ATOMIC_RELAXED));
+		g = tlv_packet_add_u64(g, TLV_TYPE_MEM_ALLOCS,
+			__atomic_load_n(&tags[i].allocs, __ATOMIC_RELAXED));
+		p = tlv_packet_add_child(p, g);
+	}
+	return p;
+}
+
+#endif
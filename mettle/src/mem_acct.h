@@ -0,0 +1,72 @@
+/**
+ * @brief Per-subsystem allocation accounting
+ * @file mem_acct.h
+ */
+
+#ifndef _MEM_ACCT_H_
+#define _MEM_ACCT_H_
+
+#include <stddef.h>
+#include <stdlib.h>
+
+struct tlv_packet;
+
+/*
+ * Subsystems whose allocations are counted. MEM_TAG_NONE is memory nobody
+ * is counting, as when a buffer is handed to code that frees it with free().
+ */
+enum mem_tag {
+	MEM_TAG_NONE = -1,
+	MEM_TAG_BUFFER_QUEUE,
+	MEM_TAG_TLV_PACKET,
+	MEM_TAG_CHANNEL,
+	MEM_TAG_PROCESS,
+	MEM_TAG_EXTENSION,
+	MEM_TAG_HTTP,
+	MEM_TAG_COUNT
+};
+
+/*
+ * Building with METTLE_MEM_ACCOUNTING counts the live and peak bytes of
+ * each tag, as the allocator reports them. Without it these are the plain
+ * allocator calls and the bookkeeping compiles away.
+ *
+ * Memory allocated under a tag must be freed under the same tag, so code
+ * handing an allocation across moves it with mem_acct_retag. Memory the
+ * caller sizes itself, such as objects cached in a mem_pool, is counted
+ * with mem_acct_add and mem_acct_sub.
+ */
+#ifdef METTLE_MEM_ACCOUNTING
+
+void *mem_acct_malloc(enum mem_tag tag, size_t len);
+
+void *mem_acct_calloc(enum mem_tag tag, size_t count, size_t len);
+
+void *mem_acct_realloc(enum mem_tag tag, void *ptr, size_t len);
+
+void mem_acct_free(enum mem_tag tag, void *ptr);
+
+void mem_acct_retag(void *ptr, enum mem_tag from, enum mem_tag to);
+
+void mem_acct_add(enum mem_tag tag, size_t len);
+
+void mem_acct_sub(enum mem_tag tag, size_t len);
+
+/*
+ * Adds a TLV_TYPE_MEM_TAG group for each tag
+ */
+struct tlv_packet * mem_acct_add_snapshot(struct tlv_packet *p);
+
+#else
+
+#define mem_acct_malloc(tag, len) malloc(len)
+#define mem_acct_calloc(tag, count, len) calloc(count, len)
+#define mem_acct_realloc(tag, ptr, len) realloc(ptr, len)
+#define mem_acct_free(tag, ptr) free(ptr)
+#define mem_acct_retag(ptr, from, to) ((void)0)
+#define mem_acct_add(tag, len) ((void)0)
+#define mem_acct_sub(tag, len) ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,87 @@
+/**
+ * @brief Fixed-size object freelists
+ * @file mem_pool.c
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem_pool.h"
+
+void *mem_pool_alloc(struct mem_pool *pool)
+{
+	void *obj = NULL;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->allocs++;
+#ifdef HAVE_POOLS
+	obj = pool->free_list;
+	if (obj) {
+		pool->free_list = *(void **)obj;
+		pool->num_free--;
+		pool->hits++;
+	}
+#endif
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (obj == NULL) {
+		obj = malloc(pool->size);
+	}
+	return obj;
+}
+
+void *mem_pool_calloc(struct mem_pool *pool)
+{
+	void *obj = mem_pool_alloc(pool);
+	if (obj) {
+		memset(obj, 0, pool->size);
+	}
+	return obj;
+}
+
+void mem_pool_free(struct mem_pool *pool, void *obj)
+{
+	if (obj == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->frees++;
+#ifdef HAVE_POOLS
+	if (pool->num_free < pool->max_free) {
+		*(void **)obj = pool->free_list;
+		pool->free_list = obj;
+		pool->num_free++;
+		obj = NULL;
+	}
+#endif
+	pthread_mutex_unlock(&pool->mutex);
+
+	free(obj);
+}
+
+void mem_pool_get_stats(struct mem_pool *pool, struct mem_pool_stats *stats)
+{
+	pthread_mutex_lock(&pool->mutex);
+	stats->size = pool->size;
+	stats->cached = pool->num_free;
+	stats->allocs = pool->allocs;
+	stats->hits = pool->hits;
+	stats->frees = pool->frees;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+void mem_pool_trim(struct mem_pool *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	void *obj = pool->free_list;
+	pool->free_list = NULL;
+	pool->num_free = 0;
+	pthread_mutex_unlock(&pool->mutex);
+
+	while (obj) {
+		void *next = *(void **)obj;
+		free(obj);
+		obj = next;
+	}
+}
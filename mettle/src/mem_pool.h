@@ -0,0 +1,57 @@
+/**
+ * @brief Fixed-size object freelists
+ * @file mem_pool.h
+ */
+
+#ifndef _MEM_POOL_H_
+#define _MEM_POOL_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A thread-safe cache of up to 'max_free' freed objects of 'size' bytes,
+ * handed back out before falling back to malloc. Building without
+ * HAVE_POOLS turns the pools into plain malloc/free, keeping the counters.
+ */
+struct mem_pool {
+	pthread_mutex_t mutex;
+	size_t size;
+	size_t max_free;
+	size_t num_free;
+	void *free_list;
+
+	uint64_t allocs;
+	uint64_t hits;
+	uint64_t frees;
+};
+
+#define MEM_POOL_INITIALIZER(obj_size, max) { \
+	.mutex = PTHREAD_MUTEX_INITIALIZER, \
+	.size = (obj_size) < sizeof(void *) ? sizeof(void *) : (obj_size), \
+	.max_free = (max), \
+}
+
+struct mem_pool_stats {
+	size_t size;
+	size_t cached;
+	uint64_t allocs;
+	uint64_t hits;
+	uint64_t frees;
+};
+
+void *mem_pool_alloc(struct mem_pool *pool);
+
+void *mem_pool_calloc(struct mem_pool *pool);
+
+void mem_pool_free(struct mem_pool *pool, void *obj);
+
+void mem_pool_get_stats(struct mem_pool *pool, struct mem_pool_stats *stats);
+
+/*
+ * Releases all cached objects back to the system
+ */
+void mem_pool_trim(struct mem_pool *pool);
+
+#endif
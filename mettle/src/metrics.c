@@ -0,0 +1,231 @@
+/**
+ * @brief Runtime metrics
+ * @file metrics.c
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "tlv.h"
+#include "utlist.h"
+
+/*
+ * Four buckets per power of two, up to 2^40 us (about 12 days)
+ */
+#define METRIC_HISTOGRAM_BUCKETS 160
+
+struct metric_histogram {
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[METRIC_HISTOGRAM_BUCKETS];
+};
+
+struct metric {
+	struct metric *next;
+	enum metric_type type;
+	uint64_t value;
+	metric_gauge_cb cb;
+	void *cb_arg;
+	struct metric_histogram *hist;
+	char name[];
+};
+
+/*
+ * Metrics are only ever added, so readers can walk the list without the
+ * lock once they have loaded its head
+ */
+static struct metric *metrics = NULL;
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct metric * metric_get(const char *name, enum metric_type type)
+{
+	struct metric *m;
+
+	pthread_mutex_lock(&metrics_mutex);
+	LL_FOREACH(metrics, m) {
+		if (strcmp(m->name, name) == 0) {
+			goto out;
+		}
+	}
+
+	m = calloc(1, sizeof(*m) + strlen(name) + 1);
+	if (m == NULL) {
+		goto out;
+	}
+	strcpy(m->name, name);
+	m->type = type;
+	if (type == METRIC_HISTOGRAM) {
+		m->hist = calloc(1, sizeof(*m->hist));
+		if (m->hist == NULL) {
+			free(m);
+			m = NULL;
+			goto out;
+		}
+	}
+	m->next = metrics;
+	__atomic_store_n(&metrics, m, __ATOMIC_RELEASE);
+
+out:
+	pthread_mutex_unlock(&metrics_mutex);
+	return m && m->type == type ? m : NULL;
+}
+
+struct metric * metric_counter(const char *name)
+{
+	return metric_get(name, METRIC_COUNTER);
+}
+
+struct metric * metric_gauge(const char *name)
+{
+	return metric_get(name, METRIC_GAUGE);
+}
+
+struct metric * metric_histogram(const char *name)
+{
+	return metric_get(name, METRIC_HISTOGRAM);
+}
+
+struct metric * metric_gauge_fn(const char *name, metric_gauge_cb cb, void *arg)
+{
+	struct metric *m = metric_get(name, METRIC_GAUGE);
+	if (m) {
+		pthread_mutex_lock(&metrics_mutex);
+		m->cb_arg = arg;
+		m->cb = cb;
+		pthread_mutex_unlock(&metrics_mutex);
+	}
+	return m;
+}
+
+void metric_add(struct metric *m, uint64_t n)
+{
+	if (m) {
+		__atomic_add_fetch(&m->value, n, __ATOMIC_RELAXED);
+	}
+}
+
+void metric_sub(struct metric *m, uint64_t n)
+{
+	if (m) {
+		__atomic_sub_fetch(&m->value, n, __ATOMIC_RELAXED);
+	}
+}
+
+void metric_set(struct metric *m, uint64_t value)
+{
+	if (m) {
+		__atomic_store_n(&m->value, value, __ATOMIC_RELAXED);
+	}
+}
+
+static unsigned histogram_bucket(uint64_t value)
+{
+	if (value < 4) {
+		return value;
+	}
+	unsigned msb = 63 - __builtin_clzll(value);
+	unsigned bucket = (msb - 1) * 4 + ((value >> (msb - 2)) & 3);
+	return bucket < METRIC_HISTOGRAM_BUCKETS ? bucket : METRIC_HISTOGRAM_BUCKETS - 1;
+}
+
+/*
+ * The largest value that falls in 'bucket'
+ */
+static uint64_t histogram_bucket_max(unsigned bucket)
+{
+	if (bucket < 4) {
+		return bucket;
+	}
+	unsigned shift = bucket / 4 - 1;
+	return ((uint64_t)(4 + bucket % 4 + 1) << shift) - 1;
+}
+
+void metric_observe(struct metric *m, uint64_t value)
+{
+	if (m == NULL || m->hist == NULL) {
+		return;
+	}
+
+	struct metric_histogram *h = m->hist;
+	__atomic_add_fetch(&h->buckets[histogram_bucket(value)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->sum, value, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&m->value, 1, __ATOMIC_RELAXED);
+
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while (value > max && !__atomic_compare_exchange_n(&h->max, &max, value,
+			true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+uint64_t metric_now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static struct tlv_packet * add_histogram(struct tlv_packet *p, struct metric *m)
+{
+	static const struct {
+		uint32_t type;
+		unsigned permille;
+	} percentiles[] = {
+		{ TLV_TYPE_METRIC_P50, 500 },
+		{ TLV_TYPE_METRIC_P90, 900 },
+		{ TLV_TYPE_METRIC_P99, 990 },
+	};
+	struct metric_histogram *h = m->hist;
+	uint64_t buckets[METRIC_HISTOGRAM_BUCKETS];
+	uint64_t count = 0;
+
+	for (unsigned i = 0; i < METRIC_HISTOGRAM_BUCKETS; i++) {
+		buckets[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+		count += buckets[i];
+	}
+
+	p = tlv_packet_add_u64(p, TLV_TYPE_METRIC_VALUE, count);
+	p = tlv_packet_add_u64(p, TLV_TYPE_METRIC_SUM,
+		__atomic_load_n(&h->sum, __ATOMIC_RELAXED));
+	p = tlv_packet_add_u64(p, TLV_TYPE_METRIC_MAX,
+		__atomic_load_n(&h->max, __ATOMIC_RELAXED));
+
+	uint64_t seen = 0;
+	unsigned bucket = 0, i = 0;
+	while (i < sizeof(percentiles) / sizeof(percentiles[0]) && count) {
+		uint64_t rank = (count * percentiles[i].permille + 999) / 1000;
+		while (seen + buckets[bucket] < rank) {
+			seen += buckets[bucket++];
+		}
+		p = tlv_packet_add_u64(p, percentiles[i].type, histogram_bucket_max(bucket));
+		i++;
+	}
+	return p;
+}
+
+struct tlv_packet * metrics_add_snapshot(struct tlv_packet *p)
+{
+	struct metric *m;
+	for (m = __atomic_load_n(&metrics, __ATOMIC_ACQUIRE); m; m = m->next) {
+		struct tlv_packet *g = tlv_packet_new(TLV_TYPE_METRIC, 0);
+		g = tlv_packet_add_str(g, TLV_TYPE_METRIC_NAME, m->name);
+		g = tlv_packet_add_u32(g, TLV_TYPE_METRIC_TYPE, m->type);
+
+		pthread_mutex_lock(&metrics_mutex);
+		metric_gauge_cb cb = m->cb;
+		void *cb_arg = m->cb_arg;
+		pthread_mutex_unlock(&metrics_mutex);
+
+		if (m->type == METRIC_HISTOGRAM) {
+			g = add_histogram(g, m);
+		} else if (cb) {
+			g = tlv_packet_add_u64(g, TLV_TYPE_METRIC_VALUE, cb(cb_arg));
+		} else {
+			g = tlv_packet_add_u64(g, TLV_TYPE_METRIC_VALUE,
+				__atomic_load_n(&m->value, __ATOMIC_RELAXED));
+		}
+		p = tlv_packet_add_child(p, g);
+	}
+	return p;
+}
@@ -0,0 +1,58 @@
+/**
+ * @brief Runtime metrics
+ * @file metrics.h
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+
+struct tlv_packet;
+
+/*
+ * Metrics are registered by name once and updated with atomics, so they
+ * can be bumped from any thread. Every function accepts a NULL metric, as
+ * returned when registration fails, and does nothing with it.
+ *
+ * Histograms hold microsecond samples in buckets of a quarter of a power
+ * of two, so percentiles read from them are within 25%.
+ */
+enum metric_type {
+	METRIC_COUNTER,
+	METRIC_GAUGE,
+	METRIC_HISTOGRAM
+};
+
+struct metric;
+
+typedef uint64_t (*metric_gauge_cb)(void *arg);
+
+/*
+ * Returns the metric of that name, creating it if needed
+ */
+struct metric * metric_counter(const char *name);
+struct metric * metric_gauge(const char *name);
+struct metric * metric_histogram(const char *name);
+
+/*
+ * A gauge read by calling 'cb' when a snapshot is taken, on that thread
+ */
+struct metric * metric_gauge_fn(const char *name, metric_gauge_cb cb, void *arg);
+
+void metric_add(struct metric *m, uint64_t n);
+void metric_sub(struct metric *m, uint64_t n);
+void metric_set(struct metric *m, uint64_t value);
+void metric_observe(struct metric *m, uint64_t value);
+
+/*
+ * Monotonic clock for timing histogram samples
+ */
+uint64_t metric_now_us(void);
+
+/*
+ * Adds a TLV_TYPE_METRIC group for each registered metric
+ */
+struct tlv_packet * metrics_add_snapshot(struct tlv_packet *p);
+
+#endif
@@ -4,6 +4,7 @@
  * @file mettle.c
  */
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,15 +14,60 @@
 
 #include "base64.h"
 #include "c2.h"
+#include "evloop.h"
 #include "extensions.h"
 #include "log.h"
+#include "metrics.h"
 #include "mettle.h"
 #include "process.h"
+#include "thread_role.h"
 #include "tlv.h"
+#include "tunables.h"
+#include "util.h"
+#include "utlist.h"
 
-#define EV_LOOP_FLAGS  (EVFLAG_NOENV | EVBACKEND_SELECT | EVFLAG_FORKCHECK)
+#define EV_LOOP_FLAGS  (EVFLAG_NOENV | EVFLAG_FORKCHECK)
 
+/*
+ * Default response batching: flush everything pending once per loop
+ * iteration, handing at most this many bytes to the transport at a time
+ */
+#define METTLE_FLUSH_MAX_BYTES (256 * 1024)
+#define METTLE_FLUSH_LATENCY   0.0
+
+#define METTLE_URING_ENTRIES   256
+
+/*
+ * eio worker pool. It is larger than TLV_MAX_JOBS, so C2 work such as
+ * resolving hosts still finds a worker while blocking requests fill theirs.
+ */
+#define METTLE_EIO_MAX_PARALLEL 6
+#define METTLE_EIO_MAX_IDLE     2
+#define METTLE_EIO_IDLE_TIMEOUT 10
+
+/*
+ * Bytes all buffer queues may hold together before producers are slowed,
+ * 0 for no limit
+ */
+#ifdef METTLE_LOW_MEMORY
+#define METTLE_MEMORY_BUDGET   (4 * 1024 * 1024)
+#else
+#define METTLE_MEMORY_BUDGET   0
+#endif
+
+/*
+ * One process can host several sessions, each with its own c2, dispatcher
+ * and channels. The first is the host: the others share its loop, worker
+ * pool, io_uring, sigar handle, process manager, host details and
+ * extension images, and are listed on it.
+ */
 struct mettle {
+	struct mettle *host;
+	struct mettle *sessions;
+	struct mettle *next;
+	bool stopped;
+	struct ev_timer stop_timer;
+
 	struct channelmgr *cm;
 	struct extmgr *em;
 	struct procmgr *pm;
@@ -30,10 +76,23 @@ struct mettle {
 	struct tlv_dispatcher *td;
 
 	sigar_t *sigar;
+	pthread_mutex_t host_info_mutex;
+	bool host_info_ready;
 	sigar_sys_info_t sysinfo;
 	char fqdn[SIGAR_MAXDOMAINNAMELEN];
 	struct ev_loop *loop;
+	struct uring *uring;
 	struct ev_timer heartbeat;
+	struct ev_timer idle_timer;
+	bool idle;
+
+	struct ev_async response_async;
+	struct ev_timer flush_timer;
+	size_t flush_max_bytes;
+	double flush_latency;
+
+	bool bootstrap_push;
+	bool bootstrap_sent;
 };
 
 static struct ev_idle eio_idle_watcher;
@@ -50,10 +109,10 @@ eio_idle_cb(struct ev_loop *loop, struct ev_idle *w, int revents)
 static void
 eio_async_cb(struct ev_loop *loop, struct ev_async *w, int revents)
 {
+	thread_role_place_workers();
 	if (eio_poll() == -1) {
 		ev_idle_start(loop, &eio_idle_watcher);
 	}
-	ev_async_start(ev_default_loop(EV_LOOP_FLAGS), &eio_async_watcher);
 }
 
 static void
@@ -62,10 +121,14 @@ eio_want_poll(void)
 	ev_async_send(ev_default_loop(EV_LOOP_FLAGS), &eio_async_watcher);
 }
 
+/*
+ * The async watcher stays started: restarting it clears a send made by a
+ * worker in the meantime, and eio only asks again once it has been polled
+ */
 static void
 eio_done_poll(void)
 {
-	ev_async_stop(ev_default_loop(EV_LOOP_FLAGS), &eio_async_watcher);
+	ev_idle_stop(ev_default_loop(EV_LOOP_FLAGS), &eio_idle_watcher);
 }
 
 static void
@@ -82,6 +145,57 @@ int start_heartbeat(struct mettle *m)
 	return 0;
 }
 
+/*
+ * A session without traffic for the idle.after_s tunable goes idle: the
+ * heartbeat stops, the c2 lines its timers up on the idle tick and the log
+ * flush thread sleeps until there is something to write. Any traffic
+ * brings it back.
+ */
+static void set_idle(struct mettle *m, bool idle)
+{
+	if (m->idle == idle) {
+		return;
+	}
+	m->idle = idle;
+	if (m->c2) {
+		c2_set_idle_tick(m->c2, idle ? tunable_get(TUNABLE_IDLE_TICK_MS) : 0);
+	}
+
+	/*
+	 * The heartbeat and log flushing belong to the process, which is idle
+	 * once all of its sessions are
+	 */
+	struct mettle *host = m->host ? m->host : m, *s;
+	if (idle) {
+		LL_FOREACH(host->sessions, s) {
+			if (!s->idle && !s->stopped) {
+				return;
+			}
+		}
+		if (!host->idle && !host->stopped) {
+			return;
+		}
+		log_info("going idle");
+		ev_timer_stop(host->loop, &host->heartbeat);
+	} else {
+		ev_timer_start(host->loop, &host->heartbeat);
+	}
+	log_set_idle(idle);
+}
+
+static void idle_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+	ev_timer_stop(loop, w);
+	set_idle(w->data, true);
+}
+
+static void note_activity(struct mettle *m)
+{
+	set_idle(m, false);
+	m->idle_timer.repeat = tunable_get(TUNABLE_IDLE_AFTER_S);
+	ev_timer_again(m->loop, &m->idle_timer);
+}
+
 struct c2 * mettle_get_c2(struct mettle *m)
 {
 	return m->c2;
@@ -92,14 +206,55 @@ struct ev_loop * mettle_get_loop(struct mettle *m)
 	return m->loop;
 }
 
+struct uring * mettle_get_uring(struct mettle *m)
+{
+	return m->uring;
+}
+
+/*
+ * Looking up the FQDN can block on DNS for seconds, so host details are
+ * gathered on a worker once the loop starts, or on first use if that comes
+ * sooner. The worker uses a sigar handle of its own.
+ */
+static void gather_host_info(struct mettle *m)
+{
+	if (m->host) {
+		m = m->host;
+	}
+	pthread_mutex_lock(&m->host_info_mutex);
+	if (!m->host_info_ready) {
+		sigar_t *sigar;
+		if (sigar_open(&sigar) == SIGAR_OK) {
+			sigar_fqdn_get(sigar, m->fqdn, sizeof(m->fqdn));
+			sigar_sys_info_get(sigar, &m->sysinfo);
+			sigar_close(sigar);
+		}
+		m->host_info_ready = true;
+	}
+	pthread_mutex_unlock(&m->host_info_mutex);
+}
+
+static void gather_host_info_req(void *arg)
+{
+	gather_host_info(arg);
+}
+
 const char *mettle_get_fqdn(struct mettle *m)
 {
-	return m->fqdn;
+	gather_host_info(m);
+	return m->host ? m->host->fqdn : m->fqdn;
 }
 
 const char *mettle_get_machine_id(struct mettle *m)
 {
-	return m->sysinfo.uuid;
+	gather_host_info(m);
+	return m->host ? m->host->sysinfo.uuid : m->sysinfo.uuid;
+}
+
+const sigar_sys_info_t *mettle_get_sysinfo(struct mettle *m)
+{
+	gather_host_info(m);
+	return m->host ? &m->host->sysinfo : &m->sysinfo;
 }
 
 int mettle_set_uuid_base64(struct mettle *m, char *uuid_b64)
@@ -151,17 +306,55 @@ struct procmgr * mettle_get_procmgr(struct mettle *m)
 	return m->pm;
 }
 
+void mettle_set_worker_pool(struct mettle *m, unsigned max_parallel,
+	unsigned max_idle, unsigned idle_timeout)
+{
+	eio_set_max_parallel(max_parallel ? max_parallel : METTLE_EIO_MAX_PARALLEL);
+	eio_set_max_idle(max_idle);
+	eio_set_idle_timeout(idle_timeout ? idle_timeout : METTLE_EIO_IDLE_TIMEOUT);
+}
+
+void mettle_set_response_batching(struct mettle *m, size_t max_bytes, double latency)
+{
+	m->flush_max_bytes = max_bytes ? max_bytes : METTLE_FLUSH_MAX_BYTES;
+	m->flush_latency = latency;
+}
+
+void mettle_set_bootstrap(struct mettle *m, bool enable)
+{
+	m->bootstrap_push = enable;
+}
+
+/*
+ * Frees what a session has of its own
+ */
+static void free_session(struct mettle *m)
+{
+	ev_async_stop(m->loop, &m->response_async);
+	ev_timer_stop(m->loop, &m->flush_timer);
+	ev_timer_stop(m->loop, &m->idle_timer);
+	ev_timer_stop(m->loop, &m->stop_timer);
+	if (m->c2)
+		c2_free(m->c2);
+	if (m->cm)
+		channelmgr_free(m->cm);
+	if (m->td)
+		tlv_dispatcher_free(m->td);
+}
+
 void mettle_free(struct mettle *m)
 {
 	if (m) {
+		struct mettle *s, *tmp;
+		LL_FOREACH_SAFE(m->sessions, s, tmp) {
+			LL_DELETE(m->sessions, s);
+			free_session(s);
+			free(s);
+		}
 		if (m->pm)
 			procmgr_free(m->pm);
-		if (m->c2)
-			c2_free(m->c2);
-		if (m->cm)
-			channelmgr_free(m->cm);
-		if (m->td)
-			tlv_dispatcher_free(m->td);
+		free_session(m);
+		uring_free(m->uring);
 		free(m);
 	}
 }
@@ -179,22 +372,81 @@ static void mettle_signal_handler(struct ev_loop *loop,
 	}
 }
 
-static void on_tlv_response(struct tlv_dispatcher *td, void *arg)
+static void flush_responses(struct mettle *m)
 {
-	struct mettle *m = arg;
 	void *buf;
-	size_t len;
+	size_t len, batch = 0;
+
+	ev_timer_stop(m->loop, &m->flush_timer);
+	while ((buf = tlv_dispatcher_dequeue_response(m->td, true, &len))) {
+		/*
+		 * Work a stopped session had running still finishes
+		 */
+		if (m->c2 == NULL) {
+			free(buf);
+			continue;
+		}
+		c2_enqueue(m->c2, buf, len);
+		batch += len;
+		if (batch >= m->flush_max_bytes) {
+			c2_flush(m->c2);
+			batch = 0;
+		}
+		note_activity(m);
+	}
+	if (m->c2) {
+		c2_flush(m->c2);
+	}
+}
+
+static void flush_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+	flush_responses(w->data);
+}
 
-	while ((buf = tlv_dispatcher_dequeue_response(td, true, &len))) {
-		c2_write(m->c2, buf, len);
-		free(buf);
+/*
+ * Responses are written out from the loop, once per iteration rather than
+ * once per response. With a flush latency set, small batches are held back
+ * for up to that long to gather more.
+ */
+static void response_async_cb(struct ev_loop *loop, struct ev_async *w, int revents)
+{
+	struct mettle *m = w->data;
+
+	if (m->flush_latency > 0) {
+		size_t bytes;
+		tlv_dispatcher_queued_responses(m->td, &bytes);
+		if (bytes < m->flush_max_bytes) {
+			if (!ev_is_active(&m->flush_timer)) {
+				ev_timer_set(&m->flush_timer, m->flush_latency, 0);
+				ev_timer_start(loop, &m->flush_timer);
+			}
+			return;
+		}
 	}
+	flush_responses(m);
+}
+
+/*
+ * Called from whichever thread queued the response
+ */
+static void on_tlv_response(struct tlv_dispatcher *td, void *arg)
+{
+	struct mettle *m = arg;
+	ev_async_send(m->loop, &m->response_async);
 }
 
 static void on_c2_event(struct c2 *c2, int event, void *arg)
 {
 	struct mettle *m = arg;
 	if (event & C2_REACHABLE) {
+		if (m->bootstrap_push && !m->bootstrap_sent) {
+			m->bootstrap_sent = true;
+			tlv_coreapi_push_bootstrap(m);
+		}
+	}
+	if (m->cm && (event & (C2_EGRESS_FULL | C2_EGRESS_DRAINED))) {
+		channelmgr_set_egress_paused(m->cm, event & C2_EGRESS_FULL);
 	}
 }
 
@@ -206,8 +458,151 @@ static void on_c2_read(struct c2 *c2, void *arg)
 
 	// need td here to pass into the reader
 	while ((request = tlv_packet_read_buffer_queue(m->td, q))) {
+		uint32_t ack;
+		if (tlv_packet_get_u32(request, TLV_TYPE_PACKET_ACK, &ack) == 0) {
+			c2_acknowledge(c2, ack);
+		}
 		tlv_dispatcher_process_request(m->td, request);
+		note_activity(m);
+	}
+}
+
+/*
+ * Queue depths and worker pool occupancy, read when metrics are requested
+ */
+static uint64_t metric_responses_queued(void *arg)
+{
+	struct mettle *m = arg;
+	return tlv_dispatcher_queued_responses(m->td, NULL);
+}
+
+static uint64_t metric_responses_queued_bytes(void *arg)
+{
+	struct mettle *m = arg;
+	size_t bytes;
+	tlv_dispatcher_queued_responses(m->td, &bytes);
+	return bytes;
+}
+
+static uint64_t metric_c2_ingress_bytes(void *arg)
+{
+	struct mettle *m = arg;
+	return m->c2 ? buffer_queue_len(c2_ingress_queue(m->c2)) : 0;
+}
+
+static uint64_t metric_c2_egress_bytes(void *arg)
+{
+	struct mettle *m = arg;
+	return m->c2 ? c2_egress_len(m->c2) : 0;
+}
+
+static uint64_t metric_channels(void *arg)
+{
+	struct mettle *m = arg;
+	return channelmgr_channel_count(m->cm, NULL);
+}
+
+static uint64_t metric_channels_queued_bytes(void *arg)
+{
+	struct mettle *m = arg;
+	size_t bytes;
+	channelmgr_channel_count(m->cm, &bytes);
+	return bytes;
+}
+
+static uint64_t metric_queued_bytes(void *arg)
+{
+	return buffer_queue_total_bytes();
+}
+
+static uint64_t metric_eio(void *arg)
+{
+	unsigned (*fn)(void) = arg;
+	return fn();
+}
+
+static void register_metrics(struct mettle *m)
+{
+	metric_gauge_fn("tlv.responses_queued", metric_responses_queued, m);
+	metric_gauge_fn("tlv.responses_queued_bytes", metric_responses_queued_bytes, m);
+	metric_gauge_fn("c2.ingress_bytes", metric_c2_ingress_bytes, m);
+	metric_gauge_fn("c2.egress_bytes", metric_c2_egress_bytes, m);
+	metric_gauge_fn("channels.open", metric_channels, m);
+	metric_gauge_fn("channels.queued_bytes", metric_channels_queued_bytes, m);
+	metric_gauge_fn("buffer_queue.bytes", metric_queued_bytes, m);
+	metric_gauge_fn("eio.requests", metric_eio, eio_nreqs);
+	metric_gauge_fn("eio.ready", metric_eio, eio_nready);
+	metric_gauge_fn("eio.pending", metric_eio, eio_npending);
+	metric_gauge_fn("eio.threads", metric_eio, eio_nthreads);
+}
+
+/*
+ * Ends a session once the loop has had the chance to send what it queued,
+ * such as the reply to core_shutdown. The process exits with its last
+ * session. A stopped session keeps its channels until then, as processes
+ * and file operations it started may still call back into them.
+ */
+static void stop_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+	struct mettle *m = w->data;
+	struct mettle *host = m->host ? m->host : m, *s;
+
+	m->stopped = true;
+	bool running = !host->stopped;
+	LL_FOREACH(host->sessions, s) {
+		running |= !s->stopped;
 	}
+	if (!running) {
+		ev_break(loop, EVBREAK_ALL);
+		return;
+	}
+
+	log_info("session stopped, others still running");
+	flush_responses(m);
+	c2_free(m->c2);
+	m->c2 = NULL;
+}
+
+void mettle_stop(struct mettle *m)
+{
+	ev_timer_start(m->loop, &m->stop_timer);
+}
+
+/*
+ * Sets up what each session has of its own
+ */
+static int init_session(struct mettle *m)
+{
+	ev_async_init(&m->response_async, response_async_cb);
+	m->response_async.data = m;
+	ev_async_start(m->loop, &m->response_async);
+	ev_timer_init(&m->flush_timer, flush_timer_cb, 0, 0);
+	m->flush_timer.data = m;
+	mettle_set_response_batching(m, METTLE_FLUSH_MAX_BYTES, METTLE_FLUSH_LATENCY);
+
+	ev_timer_init(&m->stop_timer, stop_timer_cb, 0, 0);
+	m->stop_timer.data = m;
+
+	m->c2 = c2_new(m->loop);
+	if (m->c2 == NULL) {
+		return -1;
+	}
+	c2_set_cbs(m->c2, on_c2_read, NULL, on_c2_event, m);
+
+	ev_timer_init(&m->idle_timer, idle_timer_cb, 0, 0);
+	m->idle_timer.data = m;
+	note_activity(m);
+
+	m->td = tlv_dispatcher_new(on_tlv_response, m);
+	if (m->td == NULL) {
+		return -1;
+	}
+
+	m->cm = channelmgr_new(m->td, m->loop);
+	if (m->cm == NULL) {
+		return -1;
+	}
+	return 0;
 }
 
 struct mettle *mettle(void)
@@ -217,28 +612,26 @@ struct mettle *mettle(void)
 	if (m == NULL) {
 		return NULL;
 	}
+	pthread_mutex_init(&m->host_info_mutex, NULL);
+	buffer_queue_set_budget(METTLE_MEMORY_BUDGET);
 
 	/*
-	 * TODO: let libev choose the backend instead of demanding select. On Linux
-	 * 2.6.22 we get the following with the epoll backend (compiled with much
-	 * more recent headers):
-	 *
-	 * (libev) epoll_wait: Bad file descriptor
-	 * Abort
+	 * Use epoll or kqueue where they work, select otherwise. On Linux 2.6.22
+	 * epoll fails with EBADF when built against much more recent headers.
 	 */
-	m->loop = ev_default_loop(EV_LOOP_FLAGS);
+	m->loop = ev_default_loop(EV_LOOP_FLAGS | probe_ev_backend());
+	log_info("event backend: %#x", ev_backend(m->loop));
 
 	ev_idle_init(&eio_idle_watcher, eio_idle_cb);
 	ev_async_init(&eio_async_watcher, eio_async_cb);
+	ev_async_start(m->loop, &eio_async_watcher);
 	eio_init(eio_want_poll, eio_done_poll);
+	mettle_set_worker_pool(m, METTLE_EIO_MAX_PARALLEL, METTLE_EIO_MAX_IDLE,
+		METTLE_EIO_IDLE_TIMEOUT);
 
-	start_heartbeat(m);
+	m->uring = uring_new(m->loop, METTLE_URING_ENTRIES);
 
-	m->c2 = c2_new(m->loop);
-	if (m->c2 == NULL) {
-		goto err;
-	}
-	c2_set_cbs(m->c2, on_c2_read, NULL, on_c2_event, m);
+	start_heartbeat(m);
 
 	if (sigar_open(&m->sigar) == -1) {
 		goto err;
@@ -248,20 +641,11 @@ struct mettle *mettle(void)
 
 	m->em = extmgr_new();
 
-	sigar_fqdn_get(m->sigar, m->fqdn, sizeof(m->fqdn));
-
-	sigar_sys_info_get(m->sigar, &m->sysinfo);
-
-	m->td = tlv_dispatcher_new(on_tlv_response, m);
-	if (m->td == NULL) {
-		goto err;
-	}
-
-	m->cm = channelmgr_new(m->td);
-	if (m->cm == NULL) {
+	if (init_session(m) == -1) {
 		goto err;
 	}
 
+	register_metrics(m);
 	return m;
 
 err:
@@ -269,6 +653,40 @@ err:
 	return NULL;
 }
 
+struct mettle *mettle_session_new(struct mettle *host)
+{
+	struct mettle *m = calloc(1, sizeof(*m));
+	if (m == NULL) {
+		return NULL;
+	}
+	m->host = host;
+	m->loop = host->loop;
+	m->uring = host->uring;
+	m->sigar = host->sigar;
+	m->pm = host->pm;
+	m->em = extmgr_new_sharing_images(host->em);
+	if (m->em == NULL || init_session(m) == -1) {
+		free_session(m);
+		if (m->em)
+			extmgr_free(m->em);
+		free(m);
+		return NULL;
+	}
+	LL_APPEND(host->sessions, m);
+	return m;
+}
+
+static void start_session(struct mettle *m)
+{
+	tlv_register_coreapi(m);
+
+	tlv_register_channelapi(m);
+
+	tlv_register_stdapi(m);
+
+	c2_start(m->c2);
+}
+
 int mettle_start(struct mettle *m)
 {
 	ev_signal sigint_w, sigterm_w;
@@ -278,15 +696,29 @@ int mettle_start(struct mettle *m)
 	ev_signal_init(&sigterm_w, mettle_signal_handler, SIGTERM);
 	ev_signal_start(m->loop, &sigterm_w);
 
-	tlv_register_coreapi(m);
+	/*
+	 * Connect while host details are still being gathered
+	 */
+	evloop_offload(m->loop, gather_host_info_req, NULL, m);
 
-	tlv_register_channelapi(m);
+	start_session(m);
+	struct mettle *s;
+	LL_FOREACH(m->sessions, s) {
+		start_session(s);
+	}
 
-	tlv_register_stdapi(m);
+	thread_role_enter(THREAD_ROLE_LOOP, NULL);
+	int rc = ev_run(m->loop, 0);
+	thread_role_leave();
 
-	c2_start(m->c2);
-
-	ev_async_start(m->loop, &eio_async_watcher);
+	/*
+	 * Send anything queued as the loop was stopped, such as the reply to
+	 * core_shutdown
+	 */
+	flush_responses(m);
+	LL_FOREACH(m->sessions, s) {
+		flush_responses(s);
+	}
 
-	return ev_run(m->loop, 0);
+	return rc;
 }
@@ -10,18 +10,38 @@
 #include "c2.h"
 #include "channel.h"
 #include "process.h"
+#include "uring.h"
 
 #include <ev.h>
 #include <sigar.h>
 
 struct mettle * mettle(void);
 
+/*
+ * Adds a session to the process 'host' runs in, with a c2, dispatcher and
+ * channels of its own. It shares the host's loop, worker pool, io_uring,
+ * sigar handle, process manager, host details and extension images, starts
+ * with it and is freed with it.
+ */
+struct mettle * mettle_session_new(struct mettle *host);
+
 int mettle_start(struct mettle *m);
 
+/*
+ * Stops the session on the next loop iteration, and the process with its
+ * last one
+ */
+void mettle_stop(struct mettle *m);
+
 const char *mettle_get_fqdn(struct mettle *m);
 
 const char *mettle_get_machine_id(struct mettle *m);
 
+/*
+ * The host's OS details, gathered with the FQDN
+ */
+const sigar_sys_info_t *mettle_get_sysinfo(struct mettle *m);
+
 int mettle_set_uuid_base64(struct mettle *m, char *uuid_b64);
 
 int mettle_set_session_guid_base64(struct mettle *m, char *uuid_b64);
@@ -30,8 +50,35 @@ sigar_t *mettle_get_sigar(struct mettle *m);
 
 struct ev_loop * mettle_get_loop(struct mettle *m);
 
+/*
+ * Returns NULL when io_uring is not available, in which case file I/O goes
+ * through eio
+ */
+struct uring * mettle_get_uring(struct mettle *m);
+
 struct tlv_dispatcher *mettle_get_tlv_dispatcher(struct mettle *m);
 
+/*
+ * Flush queued responses to the transport in batches of up to 'max_bytes',
+ * holding small batches back for up to 'latency' seconds (0 flushes once per
+ * loop iteration)
+ */
+void mettle_set_response_batching(struct mettle *m, size_t max_bytes, double latency);
+
+/*
+ * Sends a core_bootstrap request with the session's machine ID and commands
+ * as soon as the C2 first connects, for handlers that expect one
+ */
+void mettle_set_bootstrap(struct mettle *m, bool enable);
+
+/*
+ * Sizes the eio worker pool: at most 'max_parallel' threads, keeping up to
+ * 'max_idle' of them for 'idle_timeout' seconds once idle. Zero keeps the
+ * default for 'max_parallel' and 'idle_timeout'.
+ */
+void mettle_set_worker_pool(struct mettle *m, unsigned max_parallel,
+	unsigned max_idle, unsigned idle_timeout);
+
 void mettle_free(struct mettle *);
 
 struct c2 * mettle_get_c2(struct mettle *m);
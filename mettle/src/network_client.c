@@ -10,6 +10,7 @@
 #include <string.h>
 #include <strings.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -19,22 +20,41 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 
 #include "bufferev.h"
 #include "buffer_queue.h"
+#include "dns_cache.h"
 #include "log.h"
 #include "network_client.h"
 #include "util.h"
 
+/*
+ * Addresses are raced as in RFC 8305: attempts start a connection attempt
+ * delay apart, or as soon as one fails, alternating address families from
+ * the one resolved first, and the first to connect is kept. A black-holed
+ * IPv6 route then costs a quarter second rather than a connect timeout.
+ */
+#define NETWORK_CLIENT_ATTEMPT_DELAY   0.25
+#define NETWORK_CLIENT_CONNECT_TIMEOUT 1.0
+#define NETWORK_CLIENT_MAX_ADDRS       8
+
+/*
+ * A unix:// server is a stream socket path rather than a host to resolve.
+ * A path starting with '@' is in the abstract namespace.
+ */
 struct network_client_server {
 	char *uri;
 	enum network_proto proto;
 	char *host;
 	char *service;
+	bool local;
 };
 
 struct network_client {
 	struct ev_timer connect_timer;
+	struct ev_async resolved;
+	int resolve_result;
 	struct ev_loop *loop;
 	struct network_client_server *servers;
 	int num_servers;
@@ -43,8 +63,21 @@ struct network_client {
 	uint64_t connect_time_s;
 
 	struct bufferev *be;
-	struct addrinfo *addrinfo, *dst;
+	struct bufferev_tls_session *tls_session;
+	struct addrinfo *addrinfo;
 	struct addrinfo *src;
+	struct addrinfo local_ai;
+	struct sockaddr_un local_addr;
+
+	/*
+	 * The addresses being raced, in the order they are tried, and the
+	 * attempts still connecting
+	 */
+	struct ev_timer attempt_timer;
+	struct addrinfo *addrs[NETWORK_CLIENT_MAX_ADDRS];
+	int num_addrs, next_addr;
+	struct bufferev *attempts[NETWORK_CLIENT_MAX_ADDRS];
+	bool attempt_started;
 	char *src_addr;
 	uint16_t src_port;
 
@@ -56,6 +89,9 @@ struct network_client {
 	} state;
 
 	int max_retries, retries;
+	bool read_paused;
+	uint64_t rx_rate, tx_rate;
+	enum bufferev_sock_profile sock_profile;
 
 	bufferev_data_cb read_cb;
 	bufferev_data_cb write_cb;
@@ -116,6 +152,18 @@ int server_init(struct network_client_server *srv, const char *uri)
 		goto out;
 	}
 
+	if (strcmp(proto, "unix") == 0) {
+		if (*host == '\0' || strlen(host) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+			log_error("invalid socket path: %s", uri);
+			goto out;
+		}
+		srv->host = strdup(host);
+		srv->proto = network_proto_tcp;
+		srv->local = true;
+		rc = srv->host ? 0 : -1;
+		goto out;
+	}
+
 	if (*host == '[') {
 		host++;
 		char *ipv6_end = host;
@@ -149,6 +197,8 @@ int server_init(struct network_client_server *srv, const char *uri)
 		srv->proto = network_proto_udp;
 	} else if (strcmp(proto, "tcp") == 0) {
 		srv->proto = network_proto_tcp;
+	} else if (strcmp(proto, "tls") == 0) {
+		srv->proto = network_proto_tls;
 	} else {
 		log_error("unsupported protocol '%s'", proto);
 		goto out;
@@ -239,9 +289,44 @@ ssize_t network_client_write(struct network_client *nc, void *buf, size_t buflen
 	return nc->be ? bufferev_write(nc->be, buf, buflen) : 0;
 }
 
+ssize_t network_client_writev(struct network_client *nc, struct iovec *iov, int iovcnt)
+{
+	return nc->be ? bufferev_writev(nc->be, iov, iovcnt) : 0;
+}
+
+ssize_t network_client_write_msgs(struct network_client *nc, struct iovec *msgs, int count)
+{
+	return nc->be ? bufferev_write_msgs(nc->be, msgs, count) : 0;
+}
+
+size_t network_client_bytes_pending(struct network_client *nc)
+{
+	return nc->be ? bufferev_bytes_pending(nc->be) : 0;
+}
+
+/*
+ * Abandons every attempt but 'keep', and the addresses left to try
+ */
+static void stop_attempts(struct network_client *nc, struct bufferev *keep)
+{
+	ev_timer_stop(nc->loop, &nc->attempt_timer);
+	for (int i = 0; i < nc->num_addrs; i++) {
+		if (nc->attempts[i] && nc->attempts[i] != keep) {
+			bufferev_free(nc->attempts[i]);
+		}
+		nc->attempts[i] = NULL;
+	}
+	nc->num_addrs = nc->next_addr = 0;
+	if (nc->addrinfo) {
+		dns_cache_freeaddrinfo(nc->addrinfo);
+		nc->addrinfo = NULL;
+	}
+}
+
 static void set_closed(struct network_client *nc)
 {
 	nc->state = network_client_closed;
+	stop_attempts(nc, NULL);
 
 	if (nc->be) {
 		bufferev_free(nc->be);
@@ -251,6 +336,10 @@ static void set_closed(struct network_client *nc)
 
 int network_client_stop(struct network_client *nc)
 {
+	/*
+	 * A stopped client stays down until started again
+	 */
+	ev_timer_stop(nc->loop, &nc->connect_timer);
 	if (nc->state != network_client_connected) {
 		return -1;
 	}
@@ -270,6 +359,33 @@ void network_client_set_cbs(struct network_client *nc,
     nc->cb_arg = cb_arg;
 }
 
+void network_client_set_read_paused(struct network_client *nc, bool paused)
+{
+	nc->read_paused = paused;
+	if (nc->be) {
+		bufferev_set_read_paused(nc->be, paused);
+	}
+}
+
+void network_client_set_rate_limit(struct network_client *nc,
+	uint64_t rx_rate, uint64_t tx_rate)
+{
+	nc->rx_rate = rx_rate;
+	nc->tx_rate = tx_rate;
+	if (nc->be) {
+		bufferev_set_rate_limit(nc->be, rx_rate, tx_rate);
+	}
+}
+
+void network_client_set_sock_profile(struct network_client *nc,
+	enum bufferev_sock_profile profile)
+{
+	nc->sock_profile = profile;
+	if (nc->be) {
+		bufferev_set_sock_profile(nc->be, profile);
+	}
+}
+
 static void
 client_connected(struct network_client *nc)
 {
@@ -287,6 +403,15 @@ static void on_read(struct bufferev *be, void *arg)
 	}
 }
 
+static void on_write(struct bufferev *be, void *arg)
+{
+	struct network_client *nc = arg;
+
+	if (nc->write_cb) {
+		nc->write_cb(be, nc->cb_arg);
+	}
+}
+
 static void connection_failed(struct network_client *nc)
 {
 	struct network_client_server *srv = get_curr_server(nc);
@@ -303,10 +428,62 @@ static void connection_failed(struct network_client *nc)
 	}
 }
 
+static int find_attempt(struct network_client *nc, struct bufferev *be)
+{
+	for (int i = 0; i < nc->num_addrs; i++) {
+		if (nc->attempts[i] == be) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int start_attempt(struct network_client *nc);
+
+/*
+ * A failed attempt makes way for the next address straight away. Once none
+ * are left connecting the round has failed.
+ */
+static void attempt_failed(struct network_client *nc, int i)
+{
+	bufferev_free(nc->attempts[i]);
+	nc->attempts[i] = NULL;
+
+	if (start_attempt(nc) == 0) {
+		return;
+	}
+	for (i = 0; i < nc->num_addrs; i++) {
+		if (nc->attempts[i]) {
+			return;
+		}
+	}
+
+	struct network_client_server *srv = get_curr_server(nc);
+	// None of the cached addresses would even start connecting
+	if (!nc->attempt_started && !srv->local) {
+		dns_cache_forget(srv->host);
+	}
+	connection_failed(nc);
+}
+
 static void on_event(struct bufferev *be, int event, void *arg)
 {
 	struct network_client *nc = arg;
 
+	if (nc->state == network_client_connecting) {
+		int i = find_attempt(nc, be);
+		if (i == -1) {
+			return;
+		}
+		if (event & BEV_CONNECTED) {
+			stop_attempts(nc, be);
+			nc->be = be;
+		} else if (event & BEV_ERROR) {
+			attempt_failed(nc, i);
+			return;
+		}
+	}
+
 	if (event & BEV_CONNECTED) {
 		client_connected(nc);
 		if (nc->event_cb) {
@@ -317,10 +494,6 @@ static void on_event(struct bufferev *be, int event, void *arg)
 		if (nc->event_cb) {
 			nc->event_cb(be, event, nc->cb_arg);
 		}
-	} else if (event & BEV_ERROR) {
-		if (nc->state == network_client_connecting) {
-			connection_failed(nc);
-		}
 	}
 }
 
@@ -330,7 +503,11 @@ log_addrinfo(const char *msg, struct addrinfo *ai)
 	char host[INET6_ADDRSTRLEN] = { 0 };
 	uint16_t port = 0;
 	const char *proto = ai->ai_protocol == IPPROTO_UDP ? "udp" : "tcp";
-	if (ai->ai_family == AF_INET) {
+	if (ai->ai_family == AF_UNIX) {
+		struct sockaddr_un *s = (struct sockaddr_un *)ai->ai_addr;
+		log_info("%s unix://%s%s", msg, s->sun_path[0] ? "" : "@", s->sun_path + !s->sun_path[0]);
+		return;
+	} else if (ai->ai_family == AF_INET) {
 		struct sockaddr_in *s = (struct sockaddr_in *)ai->ai_addr;
 		port = ntohs(s->sin_port);
 		inet_ntop(AF_INET, &s->sin_addr, host, INET6_ADDRSTRLEN);
@@ -346,50 +523,133 @@ log_addrinfo(const char *msg, struct addrinfo *ai)
 	}
 }
 
+/*
+ * The TLS session is kept for the life of the client so reconnects can
+ * resume it rather than doing a full handshake
+ */
 static int
-on_resolve(struct eio_req *req)
+enable_tls(struct network_client *nc, struct bufferev *be,
+	struct network_client_server *srv)
 {
-	struct network_client *nc = req->data;
-	struct network_client_server *srv = get_curr_server(nc);
+	if (nc->tls_session == NULL) {
+		nc->tls_session = bufferev_tls_session_new();
+		if (nc->tls_session == NULL) {
+			return -1;
+		}
+	}
+	return bufferev_enable_tls(be, srv->host, nc->tls_session);
+}
 
-	if (req->result != 0) {
-		log_info("could not resolve '%s': %s",
-			srv->uri, gai_strerror(req->result));
-		nc->state = network_client_closed;
-		return 0;
+/*
+ * Interleaves the address families, starting with the first resolved, as
+ * getaddrinfo has already sorted the addresses by preference
+ */
+static void order_addrs(struct network_client *nc)
+{
+	struct addrinfo *first[NETWORK_CLIENT_MAX_ADDRS], *other[NETWORK_CLIENT_MAX_ADDRS];
+	int num_first = 0, num_other = 0;
+	for (struct addrinfo *ai = nc->addrinfo; ai; ai = ai->ai_next) {
+		if (ai->ai_family == nc->addrinfo->ai_family) {
+			if (num_first < NETWORK_CLIENT_MAX_ADDRS) {
+				first[num_first++] = ai;
+			}
+		} else if (num_other < NETWORK_CLIENT_MAX_ADDRS) {
+			other[num_other++] = ai;
+		}
 	}
 
-	if (nc->dst == NULL) {
-		nc->dst = nc->addrinfo;
+	nc->num_addrs = nc->next_addr = 0;
+	for (int i = 0; nc->num_addrs < NETWORK_CLIENT_MAX_ADDRS
+			&& (i < num_first || i < num_other); i++) {
+		if (i < num_first) {
+			nc->addrs[nc->num_addrs++] = first[i];
+		}
+		if (i < num_other && nc->num_addrs < NETWORK_CLIENT_MAX_ADDRS) {
+			nc->addrs[nc->num_addrs++] = other[i];
+		}
 	}
+}
 
-	bool failed = true;
-	while (nc->dst) {
-		log_addrinfo("connecting to", nc->dst);
+/*
+ * Starts connecting to the next address that will, and restarts the delay
+ * before the one after. Returns -1 once there are none left to try.
+ */
+static int start_attempt(struct network_client *nc)
+{
+	struct network_client_server *srv = get_curr_server(nc);
 
-		nc->state = network_client_connecting;
-		nc->be = bufferev_new(nc->loop);
-		if (nc->be) {
-			bufferev_set_cbs(nc->be, on_read, NULL, on_event, nc);
-			if (bufferev_connect_addrinfo(nc->be, nc->src, nc->dst, 1.0) == 0) {
-				nc->dst = nc->dst->ai_next;
-				failed = false;
-				break;
+	ev_timer_stop(nc->loop, &nc->attempt_timer);
+	while (nc->next_addr < nc->num_addrs) {
+		int i = nc->next_addr++;
+		log_addrinfo("connecting to", nc->addrs[i]);
+
+		struct bufferev *be = bufferev_new(nc->loop);
+		if (be == NULL) {
+			continue;
+		}
+		bufferev_set_cbs(be, on_read, on_write, on_event, nc);
+		bufferev_set_read_paused(be, nc->read_paused);
+		bufferev_set_rate_limit(be, nc->rx_rate, nc->tx_rate);
+		bufferev_set_sock_profile(be, nc->sock_profile);
+		if (srv->proto == network_proto_tls && enable_tls(nc, be, srv) == -1) {
+			bufferev_free(be);
+			continue;
+		}
+		if (bufferev_connect_addrinfo(be, srv->local ? NULL : nc->src, nc->addrs[i],
+				NETWORK_CLIENT_CONNECT_TIMEOUT) == 0) {
+			nc->attempts[i] = be;
+			nc->attempt_started = true;
+			if (nc->next_addr < nc->num_addrs) {
+				ev_timer_set(&nc->attempt_timer, NETWORK_CLIENT_ATTEMPT_DELAY, 0);
+				ev_timer_start(nc->loop, &nc->attempt_timer);
 			}
-			bufferev_free(nc->be);
-			nc->be = NULL;
+			return 0;
 		}
-		nc->dst = nc->dst->ai_next;
+		bufferev_free(be);
 	}
+	return -1;
+}
 
-	if (nc->dst == NULL) {
-		freeaddrinfo(nc->addrinfo);
-		nc->addrinfo = NULL;
+static void
+attempt_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+	start_attempt(w->data);
+}
+
+static void
+resolved_cb(struct ev_loop *loop, struct ev_async *w, int revents)
+{
+	struct network_client *nc = w->data;
+	struct network_client_server *srv = get_curr_server(nc);
+
+	if (nc->resolve_result != 0) {
+		log_info("could not resolve '%s': %s",
+			srv->uri, gai_strerror(nc->resolve_result));
+		nc->state = network_client_closed;
+		return;
 	}
 
-	if (failed) {
+	nc->state = network_client_connecting;
+	nc->attempt_started = false;
+	order_addrs(nc);
+	if (start_attempt(nc) == -1) {
+		if (!nc->attempt_started) {
+			dns_cache_forget(srv->host);
+		}
 		connection_failed(nc);
 	}
+}
+
+/*
+ * eio calls back on the thread polling it, which need not be the one
+ * running the client's loop, so the result is passed on to that loop
+ */
+static int
+on_resolve(struct eio_req *req)
+{
+	struct network_client *nc = req->data;
+	nc->resolve_result = req->result;
+	ev_async_send(nc->loop, &nc->resolved);
 	return 0;
 }
 
@@ -432,7 +692,10 @@ int network_client_add_tcp_sock(struct network_client *nc, int sock)
 	if (nc->be == NULL) {
 		nc->be = bufferev_new(nc->loop);
 		if (nc->be) {
-			bufferev_set_cbs(nc->be, on_read, NULL, on_event, nc);
+			bufferev_set_cbs(nc->be, on_read, on_write, on_event, nc);
+			bufferev_set_read_paused(nc->be, nc->read_paused);
+			bufferev_set_rate_limit(nc->be, nc->rx_rate, nc->tx_rate);
+			bufferev_set_sock_profile(nc->be, nc->sock_profile);
 			bufferev_connect_tcp_sock(nc->be, sock);
 			client_connected(nc);
 		}
@@ -445,10 +708,6 @@ static void
 resolve(struct eio_req *req)
 {
 	struct network_client *nc = req->data;
-	if (nc->dst) {
-		return;
-	}
-
 	struct network_client_server *srv = get_curr_server(nc);
 
 	struct addrinfo hints = {
@@ -467,7 +726,7 @@ resolve(struct eio_req *req)
 	log_info("resolving '%s'", srv->uri);
 
 	nc->state = network_client_resolving;
-	req->result = getaddrinfo(srv->host, srv->service, &hints, &nc->addrinfo);
+	req->result = dns_cache_getaddrinfo(srv->host, srv->service, &hints, &nc->addrinfo);
 
 	if ((nc->src_addr || nc->src_port) && nc->src == NULL) {
 		char *port = NULL;
@@ -480,6 +739,37 @@ resolve(struct eio_req *req)
 	}
 }
 
+/*
+ * Socket paths need no resolving, and go straight to a single attempt
+ */
+static void
+connect_local(struct network_client *nc, struct network_client_server *srv)
+{
+	memset(&nc->local_addr, 0, sizeof(nc->local_addr));
+	nc->local_addr.sun_family = AF_UNIX;
+	size_t len = strlen(srv->host);
+	memcpy(nc->local_addr.sun_path, srv->host, len);
+	if (srv->host[0] == '@') {
+		nc->local_addr.sun_path[0] = '\0';
+	}
+
+	memset(&nc->local_ai, 0, sizeof(nc->local_ai));
+	nc->local_ai.ai_family = AF_UNIX;
+	nc->local_ai.ai_socktype = SOCK_STREAM;
+	nc->local_ai.ai_addr = (struct sockaddr *)&nc->local_addr;
+	nc->local_ai.ai_addrlen = offsetof(struct sockaddr_un, sun_path) + len +
+		(srv->host[0] != '@');
+
+	nc->state = network_client_connecting;
+	nc->attempt_started = false;
+	nc->addrs[0] = &nc->local_ai;
+	nc->num_addrs = 1;
+	nc->next_addr = 0;
+	if (start_attempt(nc) == -1) {
+		connection_failed(nc);
+	}
+}
+
 static void
 reconnect_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
 {
@@ -489,12 +779,17 @@ reconnect_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
 		return;
 	}
 
-	choose_next_server(nc);
-	eio_custom(resolve, 0, on_resolve, nc);
+	struct network_client_server *srv = choose_next_server(nc);
+	if (srv->local) {
+		connect_local(nc, srv);
+		return;
+	}
+	eio_custom(resolve, EIO_PRI_MAX, on_resolve, nc);
 }
 
 int network_client_start(struct network_client *nc)
 {
+	ev_timer_set(&nc->connect_timer, 0, 1.0);
 	ev_timer_start(nc->loop, &nc->connect_timer);
 	return 0;
 }
@@ -512,15 +807,15 @@ void network_client_free(struct network_client *nc)
 			nc->be = NULL;
 		}
 		ev_timer_stop(nc->loop, &nc->connect_timer);
+		ev_async_stop(nc->loop, &nc->resolved);
 		network_client_stop(nc);
+		stop_attempts(nc, NULL);
 		network_client_remove_servers(nc);
 		free(nc->src_addr);
 		if (nc->src) {
 			freeaddrinfo(nc->src);
 		}
-		if (nc->addrinfo) {
-			freeaddrinfo(nc->addrinfo);
-		}
+		bufferev_tls_session_free(nc->tls_session);
 		free(nc);
 	}
 }
@@ -534,6 +829,11 @@ struct network_client * network_client_new(struct ev_loop *loop)
 		nc->max_retries = -1;
 		ev_timer_init(&nc->connect_timer, reconnect_cb, 0, 1.0);
 		nc->connect_timer.data = nc;
+		ev_timer_init(&nc->attempt_timer, attempt_timer_cb, 0, 0);
+		nc->attempt_timer.data = nc;
+		ev_async_init(&nc->resolved, resolved_cb);
+		nc->resolved.data = nc;
+		ev_async_start(loop, &nc->resolved);
 	}
 	return nc;
 }
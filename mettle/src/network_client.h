@@ -29,12 +29,35 @@ void network_client_set_cbs(struct network_client *be,
 
 void network_client_set_retries(struct network_client *nc, int retries);
 
+/*
+ * Stop or resume reading; carried over to reconnections
+ */
+void network_client_set_read_paused(struct network_client *nc, bool paused);
+
+/*
+ * Bytes per second each way, 0 for unlimited; also carried over
+ */
+void network_client_set_rate_limit(struct network_client *nc,
+	uint64_t rx_rate, uint64_t tx_rate);
+
+/*
+ * Socket options for each connection made, see bufferev_set_sock_profile
+ */
+void network_client_set_sock_profile(struct network_client *nc,
+	enum bufferev_sock_profile profile);
+
 ssize_t network_client_read(struct network_client *nc, void *buf, size_t buflen);
 
 void * network_client_read_msg(struct network_client *nc, size_t *buflen);
 
 ssize_t network_client_write(struct network_client *nc, void *buf, size_t buflen);
 
+ssize_t network_client_writev(struct network_client *nc, struct iovec *iov, int iovcnt);
+
+ssize_t network_client_write_msgs(struct network_client *nc, struct iovec *msgs, int count);
+
+size_t network_client_bytes_pending(struct network_client *nc);
+
 int network_client_stop(struct network_client *nc);
 
 void network_client_free(struct network_client *nc);
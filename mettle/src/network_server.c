@@ -25,10 +25,26 @@
 #include "network_server.h"
 #include "util.h"
 
+/*
+ * Connections accepted per readiness event before yielding to the loop
+ */
+#define NETWORK_SERVER_ACCEPT_BATCH 64
+
+/*
+ * How long to stop accepting after running out of file descriptors
+ */
+#define NETWORK_SERVER_EMFILE_DELAY 0.1
+
+struct network_server_listener {
+	int fd;
+	struct ev_io connect_event;
+};
+
 struct network_server {
 	struct ev_loop *loop;
-	int listener;
-	struct ev_io connect_event;
+	struct network_server_listener listeners[NETWORK_SERVER_LISTENERS_MAX];
+	int num_listeners;
+	struct ev_timer resume_timer;
 	struct sockaddr_in6 sin;
 
 	char *host;
@@ -40,22 +56,75 @@ struct network_server {
 	void *cb_arg;
 };
 
-void connect_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+static int accept_sock(int listener)
 {
-	struct network_server *ns = w->data;
 	struct sockaddr_storage sockaddr;
-	socklen_t slen;
-	int fd = accept(ns->listener, (struct sockaddr *)&sockaddr, &slen);
-	if (fd < 0) {
-		log_error("could not accept: %s", strerror(errno));
-	} else if (fd > FD_SETSIZE) {
-		close(fd);
-	} else {
+	socklen_t slen = sizeof(sockaddr);
+#ifdef __linux__
+	return accept4(listener, (struct sockaddr *)&sockaddr, &slen,
+		SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	int fd = accept(listener, (struct sockaddr *)&sockaddr, &slen);
+	if (fd >= 0) {
 		make_socket_nonblocking(fd);
+	}
+	return fd;
+#endif
+}
+
+static void listeners_set_active(struct network_server *ns, bool active)
+{
+	for (int i = 0; i < ns->num_listeners; i++) {
+		if (active) {
+			ev_io_start(ns->loop, &ns->listeners[i].connect_event);
+		} else {
+			ev_io_stop(ns->loop, &ns->listeners[i].connect_event);
+		}
+	}
+}
+
+static void resume_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+	struct network_server *ns = w->data;
+	listeners_set_active(ns, true);
+}
+
+void connect_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+	struct network_server *ns = w->data;
+
+	/*
+	 * Drain the backlog, since a burst of connections otherwise costs a
+	 * loop iteration each, but leave the rest for the next iteration
+	 * after a batch so other watchers are not starved
+	 */
+	for (int i = 0; i < NETWORK_SERVER_ACCEPT_BATCH; i++) {
+		int fd = accept_sock(w->fd);
+		if (fd < 0) {
+			if (errno == EMFILE || errno == ENFILE) {
+				// Level triggered, so back off rather than spin
+				log_error("could not accept: %s", strerror(errno));
+				listeners_set_active(ns, false);
+				ev_timer_set(&ns->resume_timer, NETWORK_SERVER_EMFILE_DELAY, 0);
+				ev_timer_start(loop, &ns->resume_timer);
+			} else if (errno != EAGAIN && errno != EWOULDBLOCK
+					&& errno != EINTR && errno != ECONNABORTED) {
+				log_error("could not accept: %s", strerror(errno));
+			}
+			break;
+		}
+
+		if (fd >= FD_SETSIZE && ev_backend(loop) == EVBACKEND_SELECT) {
+			close(fd);
+			continue;
+		}
+
 		struct bufferev *be = bufferev_new(loop);
 		if (be) {
 			bufferev_set_cbs(be, ns->read_cb, ns->write_cb, ns->event_cb, ns->cb_arg);
 			bufferev_connect_tcp_sock(be, fd);
+		} else {
+			close(fd);
 		}
 	}
 }
@@ -72,14 +141,79 @@ void network_server_setcbs(struct network_server *ns,
     ns->cb_arg = cb_arg;
 }
 
+static int listener_new(struct network_server *ns, bool reuseport)
+{
+	int fd = socket(AF_INET6, SOCK_STREAM, 0);
+	if (fd == -1) {
+		return -1;
+	}
+	make_socket_nonblocking(fd);
+
+	/*
+	 * SO_REUSEADDR means something different in windows
+	 */
+#ifndef _WIN32
+	int yes = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&yes, sizeof(yes));
+#endif
+
+	/*
+	 * Lets the kernel spread incoming connections over several
+	 * listeners bound to the same port
+	 */
+#ifdef SO_REUSEPORT
+	if (reuseport) {
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&yes, sizeof(yes));
+	}
+#endif
+
+	/*
+	 * Override system default and allow socket to accept IPv4 and IPv6
+	 */
+#ifdef IPV6_V6ONLY
+	int no = 0;
+	setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (void *)&no, sizeof(no));
+#endif
+
+	if (bind(fd, (struct sockaddr *)&ns->sin, sizeof(ns->sin)) == -1
+			|| listen(fd, SOMAXCONN) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	// An ephemeral port is shared by the listeners that follow
+	if (ns->sin.sin6_port == 0) {
+		socklen_t slen = sizeof(ns->sin);
+		getsockname(fd, (struct sockaddr *)&ns->sin, &slen);
+		ns->port = ntohs(ns->sin.sin6_port);
+	}
+
+	struct network_server_listener *l = &ns->listeners[ns->num_listeners++];
+	l->fd = fd;
+	ev_io_init(&l->connect_event, connect_cb, fd, EV_READ);
+	l->connect_event.data = ns;
+	ev_io_start(ns->loop, &l->connect_event);
+	return 0;
+}
+
 struct network_server * network_server_new(struct ev_loop *loop,
 		const char *host, uint16_t port)
+{
+	return network_server_new_shared(loop, host, port, 1);
+}
+
+struct network_server * network_server_new_shared(struct ev_loop *loop,
+		const char *host, uint16_t port, int listeners)
 {
 	struct network_server *ns = calloc(1, sizeof(*ns));
 	if (ns == NULL) {
 		return NULL;
 	}
 
+	ns->loop = loop;
+	ev_init(&ns->resume_timer, resume_cb);
+	ns->resume_timer.data = ns;
+
 	ns->sin.sin6_family = AF_INET6;
 	ns->sin.sin6_port = htons((uint16_t)port);
 	ns->port = port;
@@ -93,40 +227,16 @@ struct network_server * network_server_new(struct ev_loop *loop,
 		ns->host = strdup(host);
 	}
 
-	ns->listener = socket(AF_INET6, SOCK_STREAM, 0);
-	if (ns->listener == -1) {
-		goto err;
-	}
-	make_socket_nonblocking(ns->listener);
-
-	/*
-	 * SO_REUSEADDR means something different in windows
-	 */
-#ifndef _WIN32
-	int yes = 1;
-	setsockopt(ns->listener, SOL_SOCKET, SO_REUSEADDR, (void *)&yes, sizeof(yes));
-#endif
-
-	/*
-	 * Override system default and allow socket to accept IPv4 and IPv6
-	 */
-#ifdef IPV6_V6ONLY
-	int no = 0;
-	setsockopt(ns->listener, IPPROTO_IPV6, IPV6_V6ONLY, (void *)&no, sizeof(no));
+#ifndef SO_REUSEPORT
+	listeners = 1;
 #endif
-
-	if (bind(ns->listener, (struct sockaddr *)&ns->sin, sizeof(ns->sin)) == -1) {
-		goto err;
-	}
-
-	if (listen(ns->listener, 16) == -1) {
-		goto err;
+	listeners = TYPESAFE_MAX(1, TYPESAFE_MIN(listeners, NETWORK_SERVER_LISTENERS_MAX));
+	for (int i = 0; i < listeners; i++) {
+		if (listener_new(ns, listeners > 1) == -1) {
+			goto err;
+		}
 	}
 
-	ev_io_init(&ns->connect_event, connect_cb, ns->listener, EV_READ);
-	ns->connect_event.data = ns;
-	ev_io_start(loop, &ns->connect_event);
-
 	return ns;
 err:
 	network_server_free(ns);
@@ -146,9 +256,11 @@ uint16_t network_server_get_port(struct network_server *ns)
 void network_server_free(struct network_server *ns)
 {
 	if (ns) {
-		if (ns->listener) {
-			close(ns->listener);
+		for (int i = 0; i < ns->num_listeners; i++) {
+			ev_io_stop(ns->loop, &ns->listeners[i].connect_event);
+			close(ns->listeners[i].fd);
 		}
+		ev_timer_stop(ns->loop, &ns->resume_timer);
 		free(ns->host);
 		free(ns);
 	}
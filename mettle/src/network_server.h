@@ -12,9 +12,19 @@
 
 struct network_server;
 
+#define NETWORK_SERVER_LISTENERS_MAX 16
+
 struct network_server * network_server_new(struct ev_loop *loop,
 		const char *host, uint16_t port);
 
+/*
+ * Listens with several SO_REUSEPORT sockets on the same port, so that
+ * the kernel balances bursts of connections over separate accept queues.
+ * Where SO_REUSEPORT is unavailable this is the same as network_server_new.
+ */
+struct network_server * network_server_new_shared(struct ev_loop *loop,
+		const char *host, uint16_t port, int listeners);
+
 void network_server_setcbs(struct network_server *be,
 	bufferev_data_cb read_cb,
 	bufferev_data_cb write_cb,
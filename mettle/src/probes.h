@@ -0,0 +1,47 @@
+/**
+ * @brief Static tracepoints for perf and bpftrace
+ * @file probes.h
+ */
+
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+/*
+ * Where <sys/sdt.h> is available each probe is a USDT probe in provider
+ * 'mettle': a single nop in place, with its arguments described in an ELF
+ * note so that tools can attach to a running binary. Probe names use '__'
+ * for the '-' tools show, so METTLE_PROBE(packet__in, ...) is
+ * usdt:mettle:packet-in.
+ *
+ * Arguments are evaluated even when nothing is attached, so they should be
+ * values already at hand rather than anything worked out for the probe.
+ *
+ *   packet__in           (size_t len)
+ *   packet__out          (size_t len, int lane)
+ *   handler__entry       (const char *method, const char *id, void *ctx)
+ *   handler__exit        (const char *method, void *ctx, size_t response_len)
+ *   job__submit          (const char *method, void *ctx, int pri)
+ *   job__complete        (const char *method, void *ctx, size_t response_len)
+ *   offload__submit      (void *work, void *arg)
+ *   offload__complete    (void *work, void *arg)
+ *   channel__open        (uint32_t id, const char *type)
+ *   channel__close       (uint32_t id, const char *type)
+ *   channel__read        (uint32_t id, size_t len)
+ *   channel__write       (uint32_t id, size_t len)
+ *   transport__start     (const char *uri)
+ *   transport__stop      (const char *uri)
+ *   transport__reachable (const char *uri, uint64_t srtt_us)
+ *   transport__unreachable (const char *uri, unsigned failures)
+ *
+ * 'ctx' only pairs up the probes of one request: a handler may free it
+ * before returning.
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define METTLE_PROBE(name, ...) STAP_PROBEV(mettle, name, ##__VA_ARGS__)
+#else
+#define METTLE_PROBE(name, ...) do { } while (0)
+#endif
+
+#endif
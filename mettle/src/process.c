@@ -9,6 +9,9 @@
 #include <signal.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef HAVE_POSIX_SPAWN
+#include <spawn.h>
+#endif
 
 #include <sys/param.h>
 #include <sys/types.h>
@@ -16,17 +19,31 @@
 
 #include "argv_split.h"
 #include "log.h"
+#include "mem_acct.h"
 #include "process.h"
 #include "buffer_queue.h"
+#include "evloop.h"
+#include "tunables.h"
 #include "uthash.h"
 #include "util.h"
 #include "../util/util-common.h"
 
 struct process_queue {
-	struct ev_io w;
+	struct evloop_io w;
+	int fd;
 	struct buffer_queue *queue;
+	size_t read_len;
+	bool full;
 };
 
+/*
+ * Output is read straight into queue slabs, in reads that grow while the
+ * child keeps its pipe full and shrink again as it goes quiet, up to the
+ * process.read_max tunable. On Linux the pipes are enlarged so a busy
+ * child fills a slab per read.
+ */
+#define PROCESS_READ_MIN BUFFER_QUEUE_SLAB_LEN
+
 struct process {
 	struct procmgr *mgr;
 
@@ -40,6 +57,7 @@ struct process {
 	process_exit_cb_t exit_cb;
 
 	void *cb_arg;
+	bool read_paused;
 
 	UT_hash_handle hh;
 	pid_t pid;
@@ -52,6 +70,19 @@ struct procmgr {
 
 extern char **environ;
 
+static const char *default_path = \
+		"/usr/local/sbin:"
+		"/usr/local/bin:"
+		"/usr/sbin:"
+		"/usr/bin:"
+		"/sbin:"
+		"/bin:"
+		"/usr/games:"
+		"/usr/local/games:"
+		"/system/bin:"
+		"/system/sbin:"
+		"/system/xbin";
+
 pid_t process_get_pid(struct process *process)
 {
 	return process->pid;
@@ -59,9 +90,9 @@ pid_t process_get_pid(struct process *process)
 
 static void free_process_queue(struct ev_loop *loop, struct process_queue *pipe)
 {
-	if (pipe->w.fd >= 0) {
-		close(pipe->w.fd);
-		ev_io_stop(loop, &pipe->w);
+	if (pipe->fd >= 0) {
+		close(pipe->fd);
+		evloop_io_close(&pipe->w);
 	}
 
 	if (pipe->queue) {
@@ -77,7 +108,7 @@ static void free_process(struct process *process)
 	close(process->err_fd);
 	free_process_queue(process->mgr->loop, &process->out);
 	free_process_queue(process->mgr->loop, &process->err);
-	free(process);
+	mem_acct_free(MEM_TAG_PROCESS, process);
 }
 
 static int switch_user(const char *user)
@@ -156,26 +187,13 @@ static void exec_child(struct procmgr *mgr,
 	}
 
 	const char *path = getenv("PATH");
-	const char *def_path = \
-			"/usr/local/sbin:"
-			"/usr/local/bin:"
-			"/usr/sbin:"
-			"/usr/bin:"
-			"/sbin:"
-			"/bin:"
-			"/usr/games:"
-			"/usr/local/games:"
-			"/system/bin:"
-			"/system/sbin:"
-			"/system/xbin";
-
 	if (path != NULL) {
 		char *new_path;
-		if (asprintf(&new_path, "%s:%s", path, def_path)) {
+		if (asprintf(&new_path, "%s:%s", path, default_path)) {
 			setenv("PATH", new_path, 1);
 		}
 	} else {
-		setenv("PATH", def_path, 1);
+		setenv("PATH", default_path, 1);
 	}
 
 	if (opts && opts->args) {
@@ -203,6 +221,241 @@ static void exec_child(struct procmgr *mgr,
 	abort();
 }
 
+#ifdef HAVE_POSIX_SPAWN
+/*
+ * posix_spawn starts the child without copying the page tables of a
+ * large session (glibc and musl use vfork semantics), and works where
+ * overcommit limits make fork fail. It cannot change user in the child,
+ * so only exec_child can do that, along with starting in another
+ * directory where the libc has no spawn action for it.
+ */
+static bool process_can_spawn(struct process_options *opts)
+{
+	if (opts == NULL) {
+		return true;
+	}
+#ifndef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+	if (opts->cwd != NULL) {
+		return false;
+	}
+#endif
+	return opts->user == NULL;
+}
+
+static const char *spawn_getenv(char **envp, size_t envc, const char *name)
+{
+	size_t name_len = strlen(name);
+	for (size_t i = 0; i < envc; i++) {
+		if (strncmp(envp[i], name, name_len) == 0 && envp[i][name_len] == '=') {
+			return envp[i] + name_len + 1;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Sets a variable in the child environment as exec_child would with setenv
+ */
+static int spawn_setenv(char ***envp, size_t *envc,
+	const char *name, const char *value, bool replace)
+{
+	size_t name_len = strlen(name);
+	size_t i;
+	for (i = 0; i < *envc; i++) {
+		if (strncmp((*envp)[i], name, name_len) == 0 && (*envp)[i][name_len] == '=') {
+			if (!replace) {
+				return 0;
+			}
+			break;
+		}
+	}
+
+	char *var;
+	if (asprintf(&var, "%s=%s", name, value) == -1) {
+		return -1;
+	}
+	if (i == *envc) {
+		char **env = reallocarray(*envp, *envc + 2, sizeof(char *));
+		if (env == NULL) {
+			free(var);
+			return -1;
+		}
+		*envp = env;
+		env[++(*envc)] = NULL;
+	} else {
+		free((*envp)[i]);
+	}
+	(*envp)[i] = var;
+	return 0;
+}
+
+/*
+ * Finds the file on the child's PATH, as execvp would after exec_child
+ * has set it up
+ */
+static char *spawn_find(const char *file, const char *path)
+{
+	if (strchr(file, '/')) {
+		return strdup(file);
+	}
+
+	char *dirs = strdup(path ? path : default_path);
+	char *exe = NULL, *save = NULL;
+	for (char *dir = dirs ? strtok_r(dirs, ":", &save) : NULL; dir;
+			dir = strtok_r(NULL, ":", &save)) {
+		if (asprintf(&exe, "%s/%s", dir, file) == -1) {
+			exe = NULL;
+			break;
+		}
+		if (access(exe, X_OK) == 0) {
+			break;
+		}
+		free(exe);
+		exe = NULL;
+	}
+	free(dirs);
+	if (exe == NULL) {
+		errno = ENOENT;
+	}
+	return exe;
+}
+
+/*
+ * Does what exec_child does, from the parent. Returns the child pid, or -1
+ * if it could not be started.
+ */
+static pid_t spawn_child(const char *file, struct process_options *opts,
+	unsigned int flags, int stdin_pair[2], int stdout_pair[2], int stderr_pair[2])
+{
+	pid_t pid = -1;
+	char **envp = NULL, **argv = NULL;
+	size_t envc = 0, argc = 0;
+	char *args = NULL, *exe = NULL, *new_path = NULL;
+
+	posix_spawn_file_actions_t actions;
+	if ((errno = posix_spawn_file_actions_init(&actions))) {
+		return -1;
+	}
+
+	char **env = (opts && opts->env) ? opts->env : environ;
+	envp = calloc(1, sizeof(char *));
+	for (; envp && env && *env; env++) {
+		char **e = reallocarray(envp, envc + 2, sizeof(char *));
+		if (e == NULL || (e[envc] = strdup(*env)) == NULL) {
+			envp = e ? e : envp;
+			goto out;
+		}
+		envp = e;
+		envp[++envc] = NULL;
+	}
+	if (envp == NULL) {
+		goto out;
+	}
+
+	struct passwd *pwd = getpwuid(geteuid());
+	const char *path = spawn_getenv(envp, envc, "PATH");
+	if (path) {
+		if (asprintf(&new_path, "%s:%s", path, default_path) == -1) {
+			new_path = NULL;
+			goto out;
+		}
+	}
+	if (spawn_setenv(&envp, &envc, "LANG", "C", false) == -1
+			|| spawn_setenv(&envp, &envc, "USER", pwd ? pwd->pw_name : "nobody", false) == -1
+			|| spawn_setenv(&envp, &envc, "HOME", pwd ? pwd->pw_dir : "/", false) == -1
+			|| spawn_setenv(&envp, &envc, "PATH", new_path ? new_path : default_path, true) == -1) {
+		goto out;
+	}
+
+	const char *process_name = (opts && opts->process_name) ? opts->process_name : file;
+	if (opts && opts->args) {
+		if (asprintf(&args, "%s %s", process_name, opts->args) == -1) {
+			args = NULL;
+			goto out;
+		}
+	} else if ((args = strdup(process_name)) == NULL) {
+		goto out;
+	}
+
+	if (flags & PROCESS_CREATE_SUBSHELL) {
+		const char *sh = shell_path();
+		argv = calloc(4, sizeof(char *));
+		if (sh == NULL || argv == NULL || (exe = strdup(sh)) == NULL) {
+			errno = sh ? ENOMEM : ENOENT;
+			goto out;
+		}
+		argv[0] = exe;
+		argv[1] = "-c";
+		argv[2] = args;
+	} else {
+		argv = argv_split(args, argv, &argc);
+		if (argv == NULL || argc == 0) {
+			errno = EINVAL;
+			goto out;
+		}
+		if (argv[0][0] == '/' && access(argv[0], X_OK)) {
+			argv[0] = basename(argv[0]);
+		}
+		exe = spawn_find(file, spawn_getenv(envp, envc, "PATH"));
+		if (exe == NULL) {
+			goto out;
+		}
+	}
+
+	int child_fds[] = {stdin_pair[0], stdout_pair[1], stderr_pair[1]};
+	int fds[] = {stdin_pair[0], stdin_pair[1], stdout_pair[0],
+		stdout_pair[1], stderr_pair[0], stderr_pair[1]};
+	int rc = 0;
+	for (int i = 0; rc == 0 && i < COUNT_OF(child_fds); i++) {
+		rc = posix_spawn_file_actions_adddup2(&actions, child_fds[i], i);
+	}
+	for (int i = 0; rc == 0 && i < COUNT_OF(fds); i++) {
+		if (fds[i] > STDERR_FILENO) {
+			rc = posix_spawn_file_actions_addclose(&actions, fds[i]);
+		}
+	}
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+	if (rc == 0 && opts && opts->cwd) {
+		rc = posix_spawn_file_actions_addchdir_np(&actions, opts->cwd);
+	}
+#endif
+	if (rc == 0) {
+		rc = posix_spawn(&pid, exe, &actions, NULL, argv, envp);
+	}
+	if (rc) {
+		errno = rc;
+		pid = -1;
+	}
+
+out:
+	if (pid == -1) {
+		log_info("could not spawn '%s': %s", file, strerror(errno));
+	}
+	posix_spawn_file_actions_destroy(&actions);
+	for (size_t i = 0; envp && i < envc; i++) {
+		free(envp[i]);
+	}
+	free(envp);
+	free(argv);
+	free(args);
+	free(exe);
+	free(new_path);
+	return pid;
+}
+#else
+static bool process_can_spawn(struct process_options *opts)
+{
+	return false;
+}
+
+static pid_t spawn_child(const char *file, struct process_options *opts,
+	unsigned int flags, int stdin_pair[2], int stdout_pair[2], int stderr_pair[2])
+{
+	errno = ENOSYS;
+	return -1;
+}
+#endif
+
 static void exec_image(struct procmgr *mgr,
 	const unsigned char *image, size_t image_len,
 	struct process_options *opts, unsigned int flags)
@@ -243,23 +496,105 @@ static void exec_image(struct procmgr *mgr,
 	abort();
 }
 
-static size_t read_fd_into_queue(int fd, struct buffer_queue *queue)
+/*
+ * Stops reading once the queue is over its high watermark, unless the
+ * child has exited and we are collecting whatever it left behind
+ */
+static size_t read_fd_into_queue(struct process_queue *pipe, bool to_eof)
 {
-	char buf[8192];
-	ssize_t n;
 	size_t len = 0;
+	size_t read_max = tunable_get(TUNABLE_PROCESS_READ_MAX);
 
-	while ((n = read(fd, buf, sizeof(buf))) > 0) {
-		buffer_queue_add(queue, buf, n);
+	while (to_eof || !pipe->full) {
+		struct iovec iov[2];
+		int iovcnt = buffer_queue_reserve_iov(pipe->queue, pipe->read_len, iov);
+		if (iovcnt == -1) {
+			break;
+		}
+		size_t room = iov[0].iov_len + (iovcnt > 1 ? iov[1].iov_len : 0);
+		ssize_t n = readv(pipe->fd, iov, iovcnt);
+		if (n <= 0) {
+			break;
+		}
+		buffer_queue_commit(pipe->queue, n);
 		len += n;
+
+		if ((size_t)n == room && pipe->read_len < read_max) {
+			pipe->read_len = TYPESAFE_MIN(pipe->read_len * 2, read_max);
+		} else if (pipe->read_len > read_max) {
+			pipe->read_len = read_max;
+		} else if ((size_t)n < pipe->read_len / 4 && pipe->read_len > PROCESS_READ_MIN) {
+			pipe->read_len /= 2;
+		}
 	}
 	if (len == 0) {
-		log_debug("nothing on fd %d: %s", fd, strerror(errno));
+		log_debug("nothing on fd %d: %s", pipe->fd, strerror(errno));
 	}
 
 	return len;
 }
 
+static void update_process_queue(struct process *process, struct process_queue *pipe)
+{
+	if (pipe->fd < 0) {
+		return;
+	}
+
+	if (process->read_paused || pipe->full) {
+		evloop_io_stop(&pipe->w);
+	} else {
+		evloop_io_start(&pipe->w);
+	}
+}
+
+static void on_queue_watermark(struct buffer_queue *q, bool above, void *arg)
+{
+	struct process_queue *pipe = arg;
+	pipe->full = above;
+	update_process_queue(pipe->w.data, pipe);
+}
+
+void process_set_read_paused(struct process *process, bool paused)
+{
+	process->read_paused = paused;
+	update_process_queue(process, &process->out);
+	update_process_queue(process, &process->err);
+}
+
+/*
+ * Output nobody is reading is dropped, so the child never blocks on a full
+ * pipe
+ */
+static void deliver_output(struct process *process, struct process_queue *pipe,
+	process_read_cb_t cb)
+{
+	if (cb) {
+		cb(process, pipe->queue, process->cb_arg);
+	} else {
+		buffer_queue_drain_all(pipe->queue);
+	}
+}
+
+/*
+ * Only output with a consumer may fill up and stop the reads, as only a
+ * consumer drains it
+ */
+static void set_output_consumer(struct process *process, struct process_queue *pipe,
+	bool attached)
+{
+	if (pipe->queue == NULL) {
+		return;
+	}
+	if (attached) {
+		buffer_queue_set_watermarks(pipe->queue, PROCESS_QUEUE_LOW_WATERMARK,
+			PROCESS_QUEUE_HIGH_WATERMARK, on_queue_watermark, pipe);
+	} else {
+		buffer_queue_set_watermarks(pipe->queue, 0, 0, NULL, NULL);
+		pipe->full = false;
+		update_process_queue(process, pipe);
+	}
+}
+
 static void child_cb(struct ev_loop *loop, struct ev_child *w, int revents)
 {
 	struct process *process = w->data;
@@ -271,16 +606,12 @@ static void child_cb(struct ev_loop *loop, struct ev_child *w, int revents)
 	/*
 	 * Read remaining data into the queue
 	 */
-	if (read_fd_into_queue(process->out_fd, process->out.queue) > 0) {
-		if (process->out_cb) {
-			process->out_cb(process, process->out.queue, process->cb_arg);
-		}
+	if (read_fd_into_queue(&process->out, true) > 0) {
+		deliver_output(process, &process->out, process->out_cb);
 	}
 
-	if (read_fd_into_queue(process->err_fd, process->err.queue) > 0) {
-		if (process->err_cb) {
-			process->err_cb(process, process->err.queue, process->cb_arg);
-		}
+	if (read_fd_into_queue(&process->err, true) > 0) {
+		deliver_output(process, &process->err, process->err_cb);
 	}
 
 	ev_child_stop(loop, w);
@@ -292,25 +623,21 @@ static void child_cb(struct ev_loop *loop, struct ev_child *w, int revents)
 	free_process(process);
 }
 
-static void stdout_cb(struct ev_loop *loop, struct ev_io *w, int events)
+static void stdout_cb(struct evloop_io *w, int events)
 {
 	struct process *process = w->data;
 
-	if (read_fd_into_queue(w->fd, process->out.queue) > 0) {
-		if (process->out_cb) {
-			process->out_cb(process, process->out.queue, process->cb_arg);
-		}
+	if (read_fd_into_queue(&process->out, false) > 0) {
+		deliver_output(process, &process->out, process->out_cb);
 	}
 }
 
-static void stderr_cb(struct ev_loop *loop, struct ev_io *w, int events)
+static void stderr_cb(struct evloop_io *w, int events)
 {
 	struct process *process = w->data;
 
-	if (read_fd_into_queue(w->fd, process->err.queue) > 0) {
-		if (process->err_cb) {
-			process->err_cb(process, process->err.queue, process->cb_arg);
-		}
+	if (read_fd_into_queue(&process->err, false) > 0) {
+		deliver_output(process, &process->err, process->err_cb);
 	}
 }
 
@@ -324,6 +651,8 @@ void process_set_callbacks(struct process *p,
 	p->err_cb = stderr_cb;
 	p->exit_cb = exit_cb;
 	p->cb_arg = cb_arg;
+	set_output_consumer(p, &p->out, stdout_cb != NULL);
+	set_output_consumer(p, &p->err, stderr_cb != NULL);
 }
 
 static struct process * process_create(struct procmgr *mgr,
@@ -346,13 +675,19 @@ static struct process * process_create(struct procmgr *mgr,
 		return NULL;
 	}
 
-	struct process *p = calloc(1, sizeof(*p));
+	struct process *p = mem_acct_calloc(MEM_TAG_PROCESS, 1, sizeof(*p));
 	if (p == NULL) {
 		return NULL;
 	}
 
-	pid_t pid = fork();
-	if (pid == 0) {
+	/*
+	 * The in-memory image loader runs in the forked copy of this process,
+	 * so it always needs fork
+	 */
+	pid_t pid;
+	if (bin_image == NULL && process_can_spawn(opts)) {
+		pid = spawn_child(file, opts, flags, stdin_pair, stdout_pair, stderr_pair);
+	} else if ((pid = fork()) == 0) {
 		dup2(stdin_pair[0], STDIN_FILENO);
 		dup2(stdout_pair[1], STDOUT_FILENO);
 		dup2(stderr_pair[1], STDERR_FILENO);
@@ -370,15 +705,16 @@ static struct process * process_create(struct procmgr *mgr,
 			exec_child(mgr, file, opts, flags);
 		}
 		return NULL;
+	}
 
-	} else if (pid == -1) {
+	if (pid == -1) {
 		close(stdin_pair[1]);
 		close(stdin_pair[0]);
 		close(stdout_pair[1]);
 		close(stdout_pair[0]);
 		close(stderr_pair[1]);
 		close(stderr_pair[0]);
-		free(p);
+		mem_acct_free(MEM_TAG_PROCESS, p);
 		return NULL;
 	}
 	p->pid = pid;
@@ -405,25 +741,35 @@ static struct process * process_create(struct procmgr *mgr,
 	fcntl(stdin_pair[1], F_SETFL, O_NONBLOCK);
 	p->in_fd = stdin_pair[1];
 
+#ifdef F_SETPIPE_SZ
+	int pipe_len = tunable_get(TUNABLE_PROCESS_READ_MAX);
+	fcntl(stdout_pair[0], F_SETPIPE_SZ, pipe_len);
+	fcntl(stderr_pair[0], F_SETPIPE_SZ, pipe_len);
+#endif
+
 	/*
 	 * Register stdout watcher
 	 */
 	p->out_fd = stdout_pair[0];
+	p->out.read_len = PROCESS_READ_MIN;
 	fcntl(stdout_pair[0], F_SETFL, O_NONBLOCK);
 	p->out.queue = buffer_queue_new();
+	p->out.fd = stdout_pair[0];
+	evloop_io_init(&p->out.w, mgr->loop, stdout_cb, stdout_pair[0], EVLOOP_READ);
 	p->out.w.data = p;
-	ev_io_init(&p->out.w, stdout_cb, stdout_pair[0], EV_READ);
-	ev_io_start(mgr->loop, &p->out.w);
+	evloop_io_start(&p->out.w);
 
 	/*
 	 * Register stderr watcher
 	 */
 	p->err_fd = stderr_pair[0];
+	p->err.read_len = PROCESS_READ_MIN;
 	fcntl(stderr_pair[0], F_SETFL, O_NONBLOCK);
 	p->err.queue = buffer_queue_new();
+	p->err.fd = stderr_pair[0];
+	evloop_io_init(&p->err.w, mgr->loop, stderr_cb, stderr_pair[0], EVLOOP_READ);
 	p->err.w.data = p;
-	ev_io_init(&p->err.w, stderr_cb, stderr_pair[0], EV_READ);
-	ev_io_start(mgr->loop, &p->err.w);
+	evloop_io_start(&p->err.w);
 
 	log_debug("IO started on fds %d %d", p->out_fd, p->err_fd);
 
@@ -523,12 +869,12 @@ void procmgr_free(struct procmgr *mgr)
 			free_process(process);
 		}
 	}
-	free(mgr);
+	mem_acct_free(MEM_TAG_PROCESS, mgr);
 }
 
 struct procmgr *procmgr_new(struct ev_loop *loop)
 {
-	struct procmgr *mgr = calloc(1, sizeof(*mgr));
+	struct procmgr *mgr = mem_acct_calloc(MEM_TAG_PROCESS, 1, sizeof(*mgr));
 	if (mgr) {
 		mgr->loop = loop;
 	}
@@ -44,6 +44,22 @@ void process_set_callbacks(struct process *p,
 	process_exit_cb_t exit_cb,
 	void *cb_arg);
 
+/*
+ * Stop or resume reading the process stdout/stderr, e.g. while the consumer
+ * of its output is backed up. Reading also stops by itself while a queue
+ * with a read callback holds more than PROCESS_QUEUE_HIGH_WATERMARK bytes;
+ * output without one is dropped as it is read.
+ */
+void process_set_read_paused(struct process *p, bool paused);
+
+#ifdef METTLE_LOW_MEMORY
+#define PROCESS_QUEUE_HIGH_WATERMARK (128 * 1024)
+#define PROCESS_QUEUE_LOW_WATERMARK  (32 * 1024)
+#else
+#define PROCESS_QUEUE_HIGH_WATERMARK (1024 * 1024)
+#define PROCESS_QUEUE_LOW_WATERMARK  (256 * 1024)
+#endif
+
 /*
  * Write to the process stdin
  */
@@ -12,30 +12,52 @@
 #include <sys/types.h>
 
 #include "argv_split.h"
+#include "iocp.h"
 #include "log.h"
+#include "mem_acct.h"
 #include "process.h"
 #include "buffer_queue.h"
+#include "tunables.h"
 #include "uthash.h"
 #include "util.h"
 
+/*
+ * Output comes through overlapped named pipes, with one ReadFile
+ * outstanding per pipe that completes through the completion port into the
+ * queue's spare slab. Reads grow and shrink as on POSIX, up to the
+ * process.read_max tunable, and none is posted while the queue is over its
+ * high watermark or reading is paused.
+ */
+#define PROCESS_READ_MIN BUFFER_QUEUE_SLAB_LEN
+
 struct process_queue {
-	struct ev_io w;
+	struct iocp_op op;
+	HANDLE pipe;
 	struct buffer_queue *queue;
+	size_t read_len;
+	bool full, posted, eof;
 };
 
+/*
+ * The wait registered on the process handle completes 'exit_op' from a
+ * thread pool thread. The process is freed once that and both pipes have
+ * come back.
+ */
 struct process {
 	struct procmgr *mgr;
 
 	struct process_queue out, err;
 	process_read_cb_t out_cb, err_cb;
-	int in_fd;
-	int out_fd;
-	int err_fd;
+	HANDLE in_pipe;
 
-	struct ev_child cw;
+	HANDLE handle;
+	HANDLE wait;
+	struct iocp_op exit_op;
+	bool exit_posted, exit_signalled, exited, freed;
 	process_exit_cb_t exit_cb;
 
 	void *cb_arg;
+	bool read_paused;
 
 	UT_hash_handle hh;
 	pid_t pid;
@@ -46,101 +68,191 @@ struct procmgr {
 	struct process *processes;
 };
 
-extern char **environ;
+static void post_read(struct process *process, struct process_queue *pipe);
 
 pid_t process_get_pid(struct process *process)
 {
 	return process->pid;
 }
 
-static void free_process_queue(struct ev_loop *loop, struct process_queue *pipe)
+static void close_handle(HANDLE *h)
 {
-	if (pipe->w.fd >= 0) {
-		close(pipe->w.fd);
-		ev_io_stop(loop, &pipe->w);
-	}
-
-	if (pipe->queue) {
-		buffer_queue_free(pipe->queue);
-		pipe->queue = NULL;
+	if (*h != NULL && *h != INVALID_HANDLE_VALUE) {
+		CloseHandle(*h);
 	}
+	*h = NULL;
 }
 
-static void free_process(struct process *process)
-{
-	close(process->in_fd);
-	close(process->out_fd);
-	close(process->err_fd);
-	free_process_queue(process->mgr->loop, &process->out);
-	free_process_queue(process->mgr->loop, &process->err);
-	free(process);
-}
-
-static int switch_user(const char *user)
+static void release_process(struct process *process)
 {
-	return 0;
+	if (process->out.posted || process->err.posted || process->exit_posted) {
+		return;
+	}
+	buffer_queue_free(process->out.queue);
+	buffer_queue_free(process->err.queue);
+	mem_acct_free(MEM_TAG_PROCESS, process);
 }
 
-static char *shell_path(void)
+/*
+ * Closing the pipes aborts their outstanding reads, which still complete
+ * into the queues, so those outlive this call until they have
+ */
+static void free_process(struct process *process)
 {
-	char * shells[] = { "/bin/sh", "/system/bin/sh", "/bin/bash", "/usr/local/bin/bash" };
-	for (int i = 0; i < COUNT_OF(shells); i++) {
-		if (access(shells[i], X_OK) == 0) {
-			return shells[i];
+	if (process->wait) {
+		/*
+		 * Waits for a callback already running. One that never ran will
+		 * not complete the exit op.
+		 */
+		UnregisterWaitEx(process->wait, INVALID_HANDLE_VALUE);
+		process->wait = NULL;
+		if (!__atomic_load_n(&process->exit_signalled, __ATOMIC_ACQUIRE)) {
+			process->exit_posted = false;
 		}
 	}
-	return NULL;
+	close_handle(&process->in_pipe);
+	close_handle(&process->out.pipe);
+	close_handle(&process->err.pipe);
+	close_handle(&process->handle);
+	process->freed = true;
+	release_process(process);
 }
 
-static void child_cb(struct ev_loop *loop, struct ev_child *w, int revents)
+/*
+ * Reports the exit once the child has gone and both pipes have hit EOF, so
+ * the owner sees all of the output first
+ */
+static void maybe_finish(struct process *process)
 {
-	struct process *process = w->data;
-	struct procmgr *mgr = process->mgr;
+	if (!process->exited || !process->out.eof || !process->err.eof) {
+		return;
+	}
 
-	//log_debug("child pid %u exited status %u", w->pid, w->rstatus);
 	HASH_DEL(process->mgr->processes, process);
 
-	//ev_child_stop(loop, w);
+	DWORD status = 0;
+	GetExitCodeProcess(process->handle, &status);
+	log_debug("child pid %lu exited status %lu", (unsigned long)process->pid, status);
+
 	if (process->exit_cb) {
-		process->exit_cb(process, w->rstatus, process->cb_arg);
+		process->exit_cb(process, status, process->cb_arg);
 	}
 
 	free_process(process);
 }
 
-static size_t read_fd_into_queue(int fd, struct buffer_queue *queue)
+static void on_exit_op(struct iocp_op *op, size_t bytes, int err)
 {
-	char buf[8192];
-	ssize_t n;
-	size_t len = 0;
+	struct process *process = op->arg;
+	process->exit_posted = false;
+	if (process->freed) {
+		release_process(process);
+		return;
+	}
 
-	while ((n = read(fd, buf, sizeof(buf))) > 0) {
-		buffer_queue_add(queue, buf, n);
-		len += n;
+	process->exited = true;
+	/*
+	 * Collect whatever it left behind, even past the watermarks
+	 */
+	post_read(process, &process->out);
+	post_read(process, &process->err);
+	maybe_finish(process);
+}
+
+static void CALLBACK on_exit_wait(void *arg, BOOLEAN timed_out)
+{
+	struct process *process = arg;
+	__atomic_store_n(&process->exit_signalled, true, __ATOMIC_RELEASE);
+	iocp_notify(&process->exit_op, 0, 0);
+}
+
+static void post_read(struct process *process, struct process_queue *pipe)
+{
+	if (pipe->posted || pipe->eof || pipe->pipe == NULL) {
+		return;
+	}
+	if (!process->exited && (process->read_paused || pipe->full)) {
+		return;
 	}
 
-	return len;
+	size_t size;
+	void *buf = buffer_queue_reserve_slab(pipe->queue, pipe->read_len, &size);
+	if (buf == NULL) {
+		return;
+	}
+	pipe->posted = true;
+	iocp_read(&pipe->op, pipe->pipe, buf, TYPESAFE_MIN(size, pipe->read_len));
 }
 
-static void stdout_cb(struct ev_loop *loop, struct ev_io *w, int events)
+static void on_read_op(struct iocp_op *op, size_t bytes, int err)
 {
-	struct process *process = w->data;
+	struct process *process = op->arg;
+	struct process_queue *pipe = (struct process_queue *)op;
+	pipe->posted = false;
+	if (process->freed) {
+		release_process(process);
+		return;
+	}
 
-	if (read_fd_into_queue(w->fd, process->out.queue) > 0) {
-		if (process->out_cb) {
-			process->out_cb(process, process->out.queue, process->cb_arg);
+	if (err || bytes == 0) {
+		if (err != ERROR_BROKEN_PIPE && err != ERROR_OPERATION_ABORTED) {
+			log_debug("pipe read failed: %d", err);
 		}
+		pipe->eof = true;
+		maybe_finish(process);
+		return;
+	}
+
+	buffer_queue_commit_slab(pipe->queue, bytes);
+
+	size_t read_max = tunable_get(TUNABLE_PROCESS_READ_MAX);
+	if (bytes == pipe->read_len && pipe->read_len < read_max) {
+		pipe->read_len = TYPESAFE_MIN(pipe->read_len * 2, read_max);
+	} else if (pipe->read_len > read_max) {
+		pipe->read_len = read_max;
+	} else if (bytes < pipe->read_len / 4 && pipe->read_len > PROCESS_READ_MIN) {
+		pipe->read_len /= 2;
+	}
+
+	post_read(process, pipe);
+
+	/*
+	 * Output nobody is reading is dropped, so the child never blocks on a
+	 * full pipe
+	 */
+	process_read_cb_t cb = pipe == &process->out ? process->out_cb : process->err_cb;
+	if (cb) {
+		cb(process, pipe->queue, process->cb_arg);
+	} else {
+		buffer_queue_drain_all(pipe->queue);
 	}
 }
 
-static void stderr_cb(struct ev_loop *loop, struct ev_io *w, int events)
+static void on_queue_watermark(struct buffer_queue *q, bool above, void *arg)
 {
-	struct process *process = w->data;
+	struct process *process = arg;
+	struct process_queue *pipe = q == process->out.queue ? &process->out : &process->err;
+	pipe->full = above;
+	post_read(process, pipe);
+}
 
-	if (read_fd_into_queue(w->fd, process->err.queue) > 0) {
-		if (process->err_cb) {
-			process->err_cb(process, process->err.queue, process->cb_arg);
-		}
+/*
+ * Only output with a consumer may fill up and stop the reads, as only a
+ * consumer drains it
+ */
+static void set_output_consumer(struct process *p, struct process_queue *pipe,
+	bool attached)
+{
+	if (pipe->queue == NULL) {
+		return;
+	}
+	if (attached) {
+		buffer_queue_set_watermarks(pipe->queue, PROCESS_QUEUE_LOW_WATERMARK,
+			PROCESS_QUEUE_HIGH_WATERMARK, on_queue_watermark, p);
+	} else {
+		buffer_queue_set_watermarks(pipe->queue, 0, 0, NULL, NULL);
+		pipe->full = false;
+		post_read(p, pipe);
 	}
 }
 
@@ -154,72 +266,207 @@ void process_set_callbacks(struct process *p,
 	p->err_cb = stderr_cb;
 	p->exit_cb = exit_cb;
 	p->cb_arg = cb_arg;
+	set_output_consumer(p, &p->out, stdout_cb != NULL);
+	set_output_consumer(p, &p->err, stderr_cb != NULL);
 }
 
-struct process * process_create(struct procmgr *mgr,
-	const char *file,
-	const unsigned char *bin_image, size_t bin_image_len,
-	struct process_options *opts, int flags)
+/*
+ * A read already posted cannot be taken back, it just is not followed by
+ * another
+ */
+void process_set_read_paused(struct process *p, bool paused)
 {
-	struct process *p = calloc(1, sizeof(*p));
-	if (p == NULL) {
-		return NULL;
+	p->read_paused = paused;
+	post_read(p, &p->out);
+	post_read(p, &p->err);
+}
+
+/*
+ * Anonymous pipes cannot be overlapped, so output goes through a uniquely
+ * named pipe whose read end is ours and write end the child's
+ */
+static int output_pipe(HANDLE *ours, HANDLE *theirs)
+{
+	static volatile long serial;
+	char name[64];
+	snprintf(name, sizeof(name), "\\\\.\\pipe\\mettle.%lu.%ld",
+		GetCurrentProcessId(), InterlockedIncrement(&serial));
+
+	size_t pipe_len = tunable_get(TUNABLE_PROCESS_READ_MAX);
+	*ours = CreateNamedPipeA(name, PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED |
+		FILE_FLAG_FIRST_PIPE_INSTANCE, PIPE_TYPE_BYTE | PIPE_WAIT, 1,
+		pipe_len, pipe_len, 0, NULL);
+	if (*ours == INVALID_HANDLE_VALUE) {
+		*ours = NULL;
+		return -1;
 	}
 
-	/*
-	pid_t pid = fork();
-	p->pid = pid;
-	*/
+	SECURITY_ATTRIBUTES sa = {
+		.nLength = sizeof(sa),
+		.bInheritHandle = TRUE,
+	};
+	*theirs = CreateFileA(name, GENERIC_WRITE, 0, &sa, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+	if (*theirs == INVALID_HANDLE_VALUE) {
+		close_handle(ours);
+		*theirs = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static char *command_line(const char *file, struct process_options *opts,
+	unsigned int flags)
+{
+	const char *args = opts && opts->args ? opts->args : "";
+	char *cmd = NULL;
+	if (flags & PROCESS_CREATE_SUBSHELL) {
+		asprintf(&cmd, "cmd.exe /c %s %s", file, args);
+	} else {
+		asprintf(&cmd, "\"%s\" %s", file, args);
+	}
+	return cmd;
+}
+
+/*
+ * Packs a NULL-terminated environment into the double NUL-terminated block
+ * CreateProcess takes
+ */
+static char *environment_block(char **env)
+{
+	size_t len = 1;
+	for (int i = 0; env[i]; i++) {
+		len += strlen(env[i]) + 1;
+	}
+	char *block = malloc(len);
+	if (block) {
+		char *p = block;
+		for (int i = 0; env[i]; i++) {
+			size_t n = strlen(env[i]) + 1;
+			memcpy(p, env[i], n);
+			p += n;
+		}
+		*p = '\0';
+	}
+	return block;
+}
+
+static int init_process_queue(struct process *p, struct process_queue *pipe,
+	HANDLE h)
+{
+	pipe->pipe = h;
+	pipe->read_len = PROCESS_READ_MIN;
+	pipe->queue = buffer_queue_new();
+	if (pipe->queue == NULL ||
+			iocp_op_init(&pipe->op, p->mgr->loop, on_read_op, p) == -1 ||
+			iocp_attach_handle(h) == -1) {
+		return -1;
+	}
+	return 0;
+}
 
+static struct process * process_create(struct procmgr *mgr,
+	const char *file,
+	const unsigned char *bin_image, size_t bin_image_len,
+	struct process_options *opts, unsigned int flags)
+{
 	/*
-	 * Add to the hash before starting the signal watcher
+	 * There is no fork to run an in-memory image loader from
 	 */
+	if (bin_image || file == NULL) {
+		errno = ENOSYS;
+		return NULL;
+	}
+
+	struct process *p = mem_acct_calloc(MEM_TAG_PROCESS, 1, sizeof(*p));
+	if (p == NULL) {
+		return NULL;
+	}
 	p->mgr = mgr;
-	HASH_ADD_INT(mgr->processes, pid, p);
 
-	//log_debug("child pid %u started", p->pid);
+	SECURITY_ATTRIBUTES sa = {
+		.nLength = sizeof(sa),
+		.bInheritHandle = TRUE,
+	};
+	HANDLE child_in = NULL, child_out = NULL, child_err = NULL;
+	char *cmd = NULL, *env = NULL;
+	if (!CreatePipe(&child_in, &p->in_pipe, &sa, 0) ||
+			output_pipe(&p->out.pipe, &child_out) == -1 ||
+			output_pipe(&p->err.pipe, &child_err) == -1) {
+		goto err;
+	}
+	SetHandleInformation(p->in_pipe, HANDLE_FLAG_INHERIT, 0);
 
-	/*
-	 * Register exit handler
-	 */
-	p->cw.data = p;
-	ev_child_init(&p->cw, child_cb, p->pid, 0);
-	//ev_child_start(mgr->loop, &p->cw);
+	cmd = command_line(file, opts, flags);
+	if (cmd == NULL) {
+		goto err;
+	}
+	if (opts && opts->env) {
+		env = environment_block(opts->env);
+	}
 
-	/*
-	 * Setup stdin
-	 */
-	/*
-	close(stdin_pair[0]);
-	fcntl(stdin_pair[1], F_SETFL, O_NONBLOCK);
-	p->in_fd = stdin_pair[1];
-	*/
+	STARTUPINFOA si = {
+		.cb = sizeof(si),
+		.dwFlags = STARTF_USESTDHANDLES | STARTF_USESHOWWINDOW,
+		.wShowWindow = SW_HIDE,
+		.hStdInput = child_in,
+		.hStdOutput = child_out,
+		.hStdError = child_err,
+	};
+	PROCESS_INFORMATION pi;
+	if (!CreateProcessA(NULL, cmd, NULL, NULL, TRUE, CREATE_NO_WINDOW, env,
+			opts ? opts->cwd : NULL, &si, &pi)) {
+		log_info("could not start '%s': %lu", cmd, GetLastError());
+		goto err;
+	}
+	free(cmd);
+	free(env);
+	close_handle(&child_in);
+	close_handle(&child_out);
+	close_handle(&child_err);
+	CloseHandle(pi.hThread);
+	p->handle = pi.hProcess;
+	p->pid = pi.dwProcessId;
 
-	/*
-	 * Register stdout watcher
-	 */
-	/*
-	p->out_fd = stdout_pair[1];
-	fcntl(stdout_pair[0], F_SETFL, O_NONBLOCK);
-	p->out.queue = buffer_queue_new();
-	p->out.w.data = p;
-	ev_io_init(&p->out.w, stdout_cb, stdout_pair[0], EV_READ);
-	ev_io_start(mgr->loop, &p->out.w);
-	*/
+	HASH_ADD_INT(mgr->processes, pid, p);
+	log_debug("child pid %lu started", (unsigned long)p->pid);
+
+	if (init_process_queue(p, &p->out, p->out.pipe) == -1 ||
+			init_process_queue(p, &p->err, p->err.pipe) == -1 ||
+			iocp_op_init(&p->exit_op, mgr->loop, on_exit_op, p) == -1) {
+		TerminateProcess(p->handle, 1);
+		HASH_DEL(mgr->processes, p);
+		free_process(p);
+		return NULL;
+	}
 
 	/*
-	 * Register stderr watcher
+	 * Register exit handler
 	 */
-	/*
-	p->err_fd = stderr_pair[1];
-	fcntl(stderr_pair[0], F_SETFL, O_NONBLOCK);
-	p->err.queue = buffer_queue_new();
-	p->err.w.data = p;
-	ev_io_init(&p->err.w, stderr_cb, stderr_pair[0], EV_READ);
-	ev_io_start(mgr->loop, &p->err.w);
-	*/
+	p->exit_posted = true;
+	if (!RegisterWaitForSingleObject(&p->wait, p->handle, on_exit_wait, p,
+			INFINITE, WT_EXECUTEONLYONCE)) {
+		p->exit_posted = false;
+		p->wait = NULL;
+		TerminateProcess(p->handle, 1);
+		HASH_DEL(mgr->processes, p);
+		free_process(p);
+		return NULL;
+	}
+
+	post_read(p, &p->out);
+	post_read(p, &p->err);
 
 	return p;
+
+err:
+	free(cmd);
+	free(env);
+	close_handle(&child_in);
+	close_handle(&child_out);
+	close_handle(&child_err);
+	free_process(p);
+	return NULL;
 }
 
 struct process * process_create_from_executable(struct procmgr *mgr,
@@ -239,12 +486,16 @@ struct process * process_create_from_binary_image(struct procmgr *mgr,
 
 int process_kill(struct process* process)
 {
-	if (process && process->pid) {
-		//return kill(process->pid, SIGINT);
+	if (process && process->handle) {
+		return TerminateProcess(process->handle, 1) ? 0 : -1;
 	}
 	return -1;
 }
 
+void process_set_nonblocking_stdio(void)
+{
+}
+
 struct process * process_by_pid(struct procmgr *mgr, pid_t pid)
 {
 	struct process *p;
@@ -274,18 +525,14 @@ ssize_t process_read(struct process *process, void *buf, size_t buf_len)
 
 ssize_t process_write(struct process *process, const void *buf, size_t buf_len)
 {
-	if (process == NULL) {
+	if (process == NULL || process->in_pipe == NULL) {
 		return -1;
 	}
 
 	ssize_t len;
 	for (len = 0; len < buf_len;) {
-		ssize_t n;
-		do {
-			n = write(process->in_fd, buf + len, buf_len - len);
-		} while (n == -1 && errno == EINTR);
-
-		if (n < 0) {
+		DWORD n;
+		if (!WriteFile(process->in_pipe, buf + len, buf_len - len, &n, NULL)) {
 			break;
 		}
 		len += n;
@@ -300,16 +547,15 @@ void procmgr_free(struct procmgr *mgr)
 		HASH_ITER(hh, mgr->processes, process, tmp) {
 			process_kill(process);
 			HASH_DEL(mgr->processes, process);
-			//ev_child_stop(mgr->loop, &process->cw);
 			free_process(process);
 		}
 	}
-	free(mgr);
+	mem_acct_free(MEM_TAG_PROCESS, mgr);
 }
 
 struct procmgr *procmgr_new(struct ev_loop *loop)
 {
-	struct procmgr *mgr = calloc(1, sizeof(*mgr));
+	struct procmgr *mgr = mem_acct_calloc(MEM_TAG_PROCESS, 1, sizeof(*mgr));
 	if (mgr) {
 		mgr->loop = loop;
 	}
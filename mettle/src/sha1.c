@@ -18,6 +18,8 @@
 #include <string.h>
 #include <sha1.h>
 
+#include "sha_hw.h"
+
 #define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
 
 /*
@@ -130,6 +132,7 @@ SHA1Update(SHA1_CTX *context, const uint8_t *data, size_t len)
 	if ((j + len) > 63) {
 		(void)memcpy(&context->buffer[j], data, (i = 64-j));
 		SHA1Transform(context->state, context->buffer);
+		i += 64 * sha1_hw_blocks(context->state, &data[i], (len - i) / 64);
 		for ( ; i + 63 < len; i += 64)
 			SHA1Transform(context->state, (uint8_t *)&data[i]);
 		j = 0;
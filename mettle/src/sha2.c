@@ -39,6 +39,8 @@
 #include <string.h>
 #include <sha2.h>
 
+#include "sha_hw.h"
+
 /*
  * UNROLLED TRANSFORM LOOP NOTE:
  * You can define SHA2_UNROLL_TRANSFORM to use the unrolled transform
@@ -275,7 +277,11 @@ static const u_int64_t sha512_initial_hash_value[8] = {
 	0x5be0cd19137e2179ULL
 };
 
-#if !defined(SHA2_SMALL)
+/*
+ * SHA-224 and SHA-384 share code with SHA-256 and SHA-512 through symbol
+ * aliases, which are left out where MAKE_CLONE is not provided
+ */
+#if !defined(SHA2_SMALL) && defined(MAKE_CLONE)
 /* Initial hash value H for SHA-384 */
 static const u_int64_t sha384_initial_hash_value[8] = {
 	0xcbbb9d5dc1059ed8ULL,
@@ -491,7 +497,7 @@ SHA256Transform(u_int32_t state[8], const u_int8_t data[SHA256_BLOCK_LENGTH])
 void
 SHA256Update(SHA2_CTX *context, const u_int8_t *data, size_t len)
 {
-	size_t	freespace, usedspace;
+	size_t	freespace, usedspace, hwlen;
 
 	/* Calling with no data is valid (we do nothing) */
 	if (len == 0)
@@ -518,6 +524,12 @@ SHA256Update(SHA2_CTX *context, const u_int8_t *data, size_t len)
 			return;
 		}
 	}
+	/* Let the CPU's SHA instructions take what they can */
+	hwlen = sha256_hw_blocks(context->state.st32, data,
+	    len / SHA256_BLOCK_LENGTH) * SHA256_BLOCK_LENGTH;
+	context->bitcount[0] += hwlen << 3;
+	len -= hwlen;
+	data += hwlen;
 	while (len >= SHA256_BLOCK_LENGTH) {
 		/* Process as many complete blocks as we can */
 		SHA256Transform(context->state.st32, data);
@@ -870,7 +882,7 @@ SHA512Final(u_int8_t digest[SHA512_DIGEST_LENGTH], SHA2_CTX *context)
 	explicit_bzero(context, sizeof(*context));
 }
 
-#if !defined(SHA2_SMALL)
+#if !defined(SHA2_SMALL) && defined(MAKE_CLONE)
 
 /*** SHA-384: *********************************************************/
 void
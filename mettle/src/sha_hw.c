@@ -0,0 +1,270 @@
+/**
+ * @brief SHA-1 and SHA-256 block functions using CPU SHA instructions
+ * @file sha_hw.c
+ *
+ * x86 SHA extensions are detected at runtime, since generic builds cannot
+ * assume them. The ARMv8 instructions are used when the target being built
+ * for has them.
+ */
+
+#include "sha_hw.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SHA_HW_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2)
+#define SHA_HW_ARM
+#include <arm_neon.h>
+#endif
+
+#if defined(SHA_HW_X86) || defined(SHA_HW_ARM)
+static const uint32_t K256[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+#endif
+
+#ifdef SHA_HW_X86
+
+#define SHA_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+
+static int sha_ni_supported = -1;
+
+static int sha_ni_check(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	int supported = 0;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)
+			&& (ecx & bit_SSSE3) && (ecx & bit_SSE4_1)
+			&& __get_cpuid_max(0, NULL) >= 7) {
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		supported = (ebx >> 29) & 1;
+	}
+	sha_ni_supported = supported;
+	return supported;
+}
+
+static inline int sha_ni(void)
+{
+	return sha_ni_supported == -1 ? sha_ni_check() : sha_ni_supported;
+}
+
+/*
+ * Four rounds of SHA-1, with the message schedule for later rounds worked
+ * on alongside. 'f' picks the round function and must be a constant.
+ */
+#define SHA1_NI_ROUNDS(g, f) do { \
+	if ((g) < 4) { \
+		msg[(g)] = _mm_shuffle_epi8(_mm_loadu_si128( \
+			(const __m128i *)(data + 16 * (g))), mask); \
+	} \
+	if ((g) == 0) { \
+		e[0] = _mm_add_epi32(e[0], msg[0]); \
+	} else { \
+		e[(g) & 1] = _mm_sha1nexte_epu32(e[(g) & 1], msg[(g) & 3]); \
+	} \
+	e[((g) + 1) & 1] = abcd; \
+	if ((g) >= 3 && (g) <= 18) { \
+		msg[((g) + 1) & 3] = _mm_sha1msg2_epu32(msg[((g) + 1) & 3], msg[(g) & 3]); \
+	} \
+	abcd = _mm_sha1rnds4_epu32(abcd, e[(g) & 1], (f)); \
+	if ((g) >= 1 && (g) <= 16) { \
+		msg[((g) - 1) & 3] = _mm_sha1msg1_epu32(msg[((g) - 1) & 3], msg[(g) & 3]); \
+	} \
+	if ((g) >= 2 && (g) <= 17) { \
+		msg[((g) - 2) & 3] = _mm_xor_si128(msg[((g) - 2) & 3], msg[(g) & 3]); \
+	} \
+} while (0)
+
+SHA_TARGET
+static void sha1_ni(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1b);
+	__m128i e[2] = { _mm_set_epi32(state[4], 0, 0, 0), _mm_setzero_si128() };
+	__m128i msg[4];
+
+	for (; blocks; blocks--, data += 64) {
+		__m128i abcd_save = abcd;
+		__m128i e_save = e[0];
+
+		SHA1_NI_ROUNDS(0, 0);  SHA1_NI_ROUNDS(1, 0);  SHA1_NI_ROUNDS(2, 0);
+		SHA1_NI_ROUNDS(3, 0);  SHA1_NI_ROUNDS(4, 0);  SHA1_NI_ROUNDS(5, 1);
+		SHA1_NI_ROUNDS(6, 1);  SHA1_NI_ROUNDS(7, 1);  SHA1_NI_ROUNDS(8, 1);
+		SHA1_NI_ROUNDS(9, 1);  SHA1_NI_ROUNDS(10, 2); SHA1_NI_ROUNDS(11, 2);
+		SHA1_NI_ROUNDS(12, 2); SHA1_NI_ROUNDS(13, 2); SHA1_NI_ROUNDS(14, 2);
+		SHA1_NI_ROUNDS(15, 3); SHA1_NI_ROUNDS(16, 3); SHA1_NI_ROUNDS(17, 3);
+		SHA1_NI_ROUNDS(18, 3); SHA1_NI_ROUNDS(19, 3);
+
+		e[0] = _mm_sha1nexte_epu32(e[0], e_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+
+	_mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1b));
+	state[4] = _mm_extract_epi32(e[0], 3);
+}
+
+SHA_TARGET
+static void sha256_ni(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+	__m128i msg[4];
+
+	for (; blocks; blocks--, data += 64) {
+		__m128i abef_save = state0;
+		__m128i cdgh_save = state1;
+
+		for (int g = 0; g < 16; g++) {
+			if (g < 4) {
+				msg[g] = _mm_shuffle_epi8(_mm_loadu_si128(
+					(const __m128i *)(data + 16 * g)), mask);
+			} else {
+				msg[g & 3] = _mm_sha256msg2_epu32(
+					_mm_add_epi32(_mm_sha256msg1_epu32(msg[g & 3], msg[(g + 1) & 3]),
+						_mm_alignr_epi8(msg[(g + 3) & 3], msg[(g + 2) & 3], 4)),
+					msg[(g + 3) & 3]);
+			}
+			__m128i wk = _mm_add_epi32(msg[g & 3],
+				_mm_loadu_si128((const __m128i *)&K256[4 * g]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(wk, 0x0e));
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b);
+	state1 = _mm_shuffle_epi32(state1, 0xb1);
+	_mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xf0));
+	_mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+size_t sha1_hw_blocks(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+	if (!sha_ni()) {
+		return 0;
+	}
+	sha1_ni(state, data, blocks);
+	return blocks;
+}
+
+size_t sha256_hw_blocks(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+	if (!sha_ni()) {
+		return 0;
+	}
+	sha256_ni(state, data, blocks);
+	return blocks;
+}
+
+#elif defined(SHA_HW_ARM)
+
+static inline uint32x4_t load_be32x4(const uint8_t *data)
+{
+	return vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data)));
+}
+
+size_t sha1_hw_blocks(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+	static const uint32_t k[4] = { 0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6 };
+	uint32x4_t abcd = vld1q_u32(state);
+	uint32_t e = state[4];
+
+	for (size_t n = blocks; n; n--, data += 64) {
+		uint32x4_t abcd_save = abcd;
+		uint32_t e_save = e;
+		uint32x4_t msg[4];
+
+		for (int g = 0; g < 20; g++) {
+			if (g < 4) {
+				msg[g] = load_be32x4(data + 16 * g);
+			} else {
+				msg[g & 3] = vsha1su1q_u32(vsha1su0q_u32(msg[g & 3],
+					msg[(g + 1) & 3], msg[(g + 2) & 3]), msg[(g + 3) & 3]);
+			}
+			uint32x4_t wk = vaddq_u32(msg[g & 3], vdupq_n_u32(k[g / 5]));
+			uint32_t e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+			if (g < 5) {
+				abcd = vsha1cq_u32(abcd, e, wk);
+			} else if (g >= 10 && g < 15) {
+				abcd = vsha1mq_u32(abcd, e, wk);
+			} else {
+				abcd = vsha1pq_u32(abcd, e, wk);
+			}
+			e = e_next;
+		}
+
+		abcd = vaddq_u32(abcd, abcd_save);
+		e += e_save;
+	}
+
+	vst1q_u32(state, abcd);
+	state[4] = e;
+	return blocks;
+}
+
+size_t sha256_hw_blocks(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+	uint32x4_t state0 = vld1q_u32(&state[0]);
+	uint32x4_t state1 = vld1q_u32(&state[4]);
+
+	for (size_t n = blocks; n; n--, data += 64) {
+		uint32x4_t save0 = state0, save1 = state1;
+		uint32x4_t msg[4];
+
+		for (int g = 0; g < 16; g++) {
+			if (g < 4) {
+				msg[g] = load_be32x4(data + 16 * g);
+			} else {
+				msg[g & 3] = vsha256su1q_u32(vsha256su0q_u32(msg[g & 3],
+					msg[(g + 1) & 3]), msg[(g + 2) & 3], msg[(g + 3) & 3]);
+			}
+			uint32x4_t wk = vaddq_u32(msg[g & 3], vld1q_u32(&K256[4 * g]));
+			uint32x4_t tmp = state0;
+			state0 = vsha256hq_u32(state0, state1, wk);
+			state1 = vsha256h2q_u32(state1, tmp, wk);
+		}
+
+		state0 = vaddq_u32(state0, save0);
+		state1 = vaddq_u32(state1, save1);
+	}
+
+	vst1q_u32(&state[0], state0);
+	vst1q_u32(&state[4], state1);
+	return blocks;
+}
+
+#else
+
+size_t sha1_hw_blocks(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+	return 0;
+}
+
+size_t sha256_hw_blocks(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+	return 0;
+}
+
+#endif
@@ -0,0 +1,20 @@
+/**
+ * @brief SHA-1 and SHA-256 block functions using CPU SHA instructions
+ * @file sha_hw.h
+ */
+
+#ifndef _SHA_HW_H_
+#define _SHA_HW_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Each hashes as many whole 64-byte blocks as it can and returns how many
+ * that was, which is 0 when the CPU has no SHA instructions
+ */
+size_t sha1_hw_blocks(uint32_t state[5], const uint8_t *data, size_t blocks);
+
+size_t sha256_hw_blocks(uint32_t state[8], const uint8_t *data, size_t blocks);
+
+#endif
@@ -0,0 +1,278 @@
+/**
+ * @brief Single-producer, single-consumer byte ring in shared memory
+ * @file shm_ring.c
+ *
+ * This is the same FIFO as ringbuf.c, but laid out for two processes: a
+ * header page with the head and tail counters is followed by a power of two
+ * sized data area, all in one memfd mapping. The counters only ever grow,
+ * and are masked to find a position, so the whole of the area can be used
+ * and no locking is needed as long as each side only advances its own
+ * counter. An eventfd in each direction replaces polling.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "shm_ring.h"
+#include "util.h"
+
+#if defined(__linux__) && defined(HAVE_MEMFD_CREATE)
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#define SHM_RING_HEADER_LEN 4096
+
+struct shm_ring_header {
+	uint64_t len;
+	/* Written by the producer */
+	uint64_t head __attribute__((aligned(64)));
+	/* Written by the consumer */
+	uint64_t tail __attribute__((aligned(64)));
+	uint32_t producer_waiting;
+};
+
+struct shm_ring {
+	int mem_fd;
+	int data_fd;
+	int space_fd;
+	struct shm_ring_header *h;
+	unsigned char *data;
+	size_t len;
+};
+
+static void signal_fd(int fd)
+{
+	uint64_t one = 1;
+	if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		log_debug("could not signal ring: %s", strerror(errno));
+	}
+}
+
+void shm_ring_ack(int fd)
+{
+	uint64_t count;
+	while (read(fd, &count, sizeof(count)) > 0);
+}
+
+static int shm_ring_map(struct shm_ring *r, size_t len)
+{
+	void *map = mmap(NULL, SHM_RING_HEADER_LEN + len, PROT_READ | PROT_WRITE,
+		MAP_SHARED, r->mem_fd, 0);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+	r->h = map;
+	r->data = (unsigned char *)map + SHM_RING_HEADER_LEN;
+	r->len = len;
+	return 0;
+}
+
+struct shm_ring * shm_ring_new(size_t len)
+{
+	size_t ring_len = 4096;
+	while (ring_len < len) {
+		ring_len *= 2;
+	}
+
+	struct shm_ring *r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		return NULL;
+	}
+	r->data_fd = r->space_fd = -1;
+
+	r->mem_fd = memfd_create("ring", 0);
+	if (r->mem_fd < 0 || ftruncate(r->mem_fd, SHM_RING_HEADER_LEN + ring_len)) {
+		goto err;
+	}
+	r->data_fd = eventfd(0, EFD_NONBLOCK);
+	r->space_fd = eventfd(0, EFD_NONBLOCK);
+	if (r->data_fd < 0 || r->space_fd < 0 || shm_ring_map(r, ring_len)) {
+		goto err;
+	}
+	r->h->len = ring_len;
+	return r;
+
+err:
+	log_info("could not create shared ring: %s", strerror(errno));
+	shm_ring_free(r);
+	return NULL;
+}
+
+struct shm_ring * shm_ring_attach(int mem_fd, int data_fd, int space_fd)
+{
+	struct shm_ring *r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		return NULL;
+	}
+	r->mem_fd = mem_fd;
+	r->data_fd = data_fd;
+	r->space_fd = space_fd;
+
+	struct shm_ring_header h;
+	if (pread(mem_fd, &h, sizeof(h), 0) != sizeof(h)
+			|| h.len == 0 || (h.len & (h.len - 1))
+			|| shm_ring_map(r, h.len)) {
+		log_info("could not attach to shared ring");
+		shm_ring_free(r);
+		return NULL;
+	}
+	fcntl(data_fd, F_SETFL, O_NONBLOCK);
+	fcntl(space_fd, F_SETFL, O_NONBLOCK);
+	shm_ring_set_cloexec(r);
+	return r;
+}
+
+void shm_ring_free(struct shm_ring *r)
+{
+	if (r) {
+		if (r->h) {
+			munmap(r->h, SHM_RING_HEADER_LEN + r->len);
+		}
+		int fds[] = {r->mem_fd, r->data_fd, r->space_fd};
+		for (int i = 0; i < COUNT_OF(fds); i++) {
+			if (fds[i] >= 0) {
+				close(fds[i]);
+			}
+		}
+		free(r);
+	}
+}
+
+int shm_ring_mem_fd(struct shm_ring *r)
+{
+	return r->mem_fd;
+}
+
+int shm_ring_data_fd(struct shm_ring *r)
+{
+	return r->data_fd;
+}
+
+int shm_ring_space_fd(struct shm_ring *r)
+{
+	return r->space_fd;
+}
+
+void shm_ring_set_cloexec(struct shm_ring *r)
+{
+	fcntl(r->mem_fd, F_SETFD, FD_CLOEXEC);
+	fcntl(r->data_fd, F_SETFD, FD_CLOEXEC);
+	fcntl(r->space_fd, F_SETFD, FD_CLOEXEC);
+}
+
+size_t shm_ring_write(struct shm_ring *r, const void *buf, size_t len)
+{
+	uint64_t head = r->h->head;
+	uint64_t tail = __atomic_load_n(&r->h->tail, __ATOMIC_ACQUIRE);
+	size_t room = r->len - (head - tail);
+
+	if (len > room) {
+		/*
+		 * Ask for a signal before checking again, so that room the
+		 * consumer makes in between is not missed
+		 */
+		__atomic_store_n(&r->h->producer_waiting, 1, __ATOMIC_SEQ_CST);
+		tail = __atomic_load_n(&r->h->tail, __ATOMIC_SEQ_CST);
+		room = r->len - (head - tail);
+		len = TYPESAFE_MIN(len, room);
+	}
+
+	size_t off = head & (r->len - 1);
+	size_t first = TYPESAFE_MIN(len, r->len - off);
+	memcpy(r->data + off, buf, first);
+	memcpy(r->data, (const unsigned char *)buf + first, len - first);
+
+	if (len) {
+		__atomic_store_n(&r->h->head, head + len, __ATOMIC_RELEASE);
+		signal_fd(r->data_fd);
+	}
+	return len;
+}
+
+size_t shm_ring_peek(struct shm_ring *r, struct iovec iov[2], size_t len)
+{
+	uint64_t tail = r->h->tail;
+	uint64_t head = __atomic_load_n(&r->h->head, __ATOMIC_ACQUIRE);
+	size_t used = head - tail;
+
+	len = TYPESAFE_MIN(len, used);
+	size_t off = tail & (r->len - 1);
+	size_t first = TYPESAFE_MIN(len, r->len - off);
+	iov[0].iov_base = r->data + off;
+	iov[0].iov_len = first;
+	iov[1].iov_base = r->data;
+	iov[1].iov_len = len - first;
+	return used;
+}
+
+void shm_ring_consume(struct shm_ring *r, size_t len)
+{
+	__atomic_store_n(&r->h->tail, r->h->tail + len, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->h->producer_waiting, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&r->h->producer_waiting, 0, __ATOMIC_SEQ_CST);
+		signal_fd(r->space_fd);
+	}
+}
+
+#else
+
+struct shm_ring * shm_ring_new(size_t len)
+{
+	return NULL;
+}
+
+struct shm_ring * shm_ring_attach(int mem_fd, int data_fd, int space_fd)
+{
+	return NULL;
+}
+
+void shm_ring_free(struct shm_ring *r)
+{
+}
+
+int shm_ring_mem_fd(struct shm_ring *r)
+{
+	return -1;
+}
+
+int shm_ring_data_fd(struct shm_ring *r)
+{
+	return -1;
+}
+
+int shm_ring_space_fd(struct shm_ring *r)
+{
+	return -1;
+}
+
+void shm_ring_set_cloexec(struct shm_ring *r)
+{
+}
+
+size_t shm_ring_write(struct shm_ring *r, const void *buf, size_t len)
+{
+	return 0;
+}
+
+size_t shm_ring_peek(struct shm_ring *r, struct iovec iov[2], size_t len)
+{
+	return 0;
+}
+
+void shm_ring_consume(struct shm_ring *r, size_t len)
+{
+}
+
+void shm_ring_ack(int fd)
+{
+}
+
+#endif
@@ -0,0 +1,72 @@
+/**
+ * @brief Single-producer, single-consumer byte ring in shared memory
+ * @file shm_ring.h
+ */
+
+#ifndef _SHM_RING_H_
+#define _SHM_RING_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct shm_ring;
+
+/*
+ * Creates a ring of at least 'len' bytes, rounded up to a power of two,
+ * along with the eventfds used to signal it. The descriptors are left
+ * inheritable so that a child can attach to it. Returns NULL where shared
+ * memory or eventfds are unavailable.
+ */
+struct shm_ring * shm_ring_new(size_t len);
+
+/*
+ * Maps a ring created by another process, from the descriptors it passed
+ * down. The ring takes ownership of them.
+ */
+struct shm_ring * shm_ring_attach(int mem_fd, int data_fd, int space_fd);
+
+void shm_ring_free(struct shm_ring *r);
+
+int shm_ring_mem_fd(struct shm_ring *r);
+
+/*
+ * Readable when the producer has written to the ring
+ */
+int shm_ring_data_fd(struct shm_ring *r);
+
+/*
+ * Readable when the consumer has made room in a ring the producer found full
+ */
+int shm_ring_space_fd(struct shm_ring *r);
+
+/*
+ * Marks the ring's descriptors close-on-exec, once any children that were
+ * meant to inherit them have been started
+ */
+void shm_ring_set_cloexec(struct shm_ring *r);
+
+/*
+ * Producer side. Copies in as much of 'buf' as fits, returning the number
+ * of bytes written, and signals the consumer. A short write arranges for
+ * the space descriptor to be signalled when the consumer makes room.
+ */
+size_t shm_ring_write(struct shm_ring *r, const void *buf, size_t len);
+
+/*
+ * Consumer side. Returns the bytes waiting, with the first 'len' of them
+ * in up to two segments in place in the ring.
+ */
+size_t shm_ring_peek(struct shm_ring *r, struct iovec iov[2], size_t len);
+
+/*
+ * Releases 'len' bytes returned by shm_ring_peek back to the producer
+ */
+void shm_ring_consume(struct shm_ring *r, size_t len);
+
+/*
+ * Clears a pending signal on either descriptor
+ */
+void shm_ring_ack(int fd);
+
+#endif
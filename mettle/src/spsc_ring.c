@@ -0,0 +1,166 @@
+/**
+ * @brief Lock-free single-producer, single-consumer ring between threads
+ * @file spsc_ring.c
+ *
+ * The same free running counters as shm_ring.c, within one process. The
+ * producer writes only 'head' and the consumer only 'tail', each in a cache
+ * line of its own along with the copy it keeps of the other side's counter,
+ * which it only reloads once that copy says the ring is full or empty. The
+ * sides then touch each other's line roughly once a batch rather than once
+ * a slot.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spsc_ring.h"
+#include "util.h"
+
+#define SPSC_RING_CACHE_LINE 64
+
+struct spsc_ring {
+	/* Written by the producer */
+	struct {
+		size_t head;
+		size_t tail_seen;
+	} p __attribute__((aligned(SPSC_RING_CACHE_LINE)));
+
+	/* Written by the consumer */
+	struct {
+		size_t tail;
+		size_t head_seen;
+	} c __attribute__((aligned(SPSC_RING_CACHE_LINE)));
+
+	size_t mask __attribute__((aligned(SPSC_RING_CACHE_LINE)));
+	size_t slot_len;
+	unsigned char *slots;
+};
+
+struct spsc_ring * spsc_ring_new(size_t count, size_t slot_len)
+{
+	size_t ring_count = 1;
+	while (ring_count < count) {
+		ring_count *= 2;
+	}
+
+	struct spsc_ring *r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		return NULL;
+	}
+	r->slots = calloc(ring_count, slot_len);
+	if (r->slots == NULL) {
+		free(r);
+		return NULL;
+	}
+	r->mask = ring_count - 1;
+	r->slot_len = slot_len;
+	return r;
+}
+
+void spsc_ring_free(struct spsc_ring *r)
+{
+	if (r) {
+		free(r->slots);
+		free(r);
+	}
+}
+
+size_t spsc_ring_count(struct spsc_ring *r)
+{
+	return r->mask + 1;
+}
+
+static void *slot(struct spsc_ring *r, size_t pos)
+{
+	return r->slots + (pos & r->mask) * r->slot_len;
+}
+
+/*
+ * The most of 'n' slots from 'pos' that are available and do not wrap
+ */
+static size_t contiguous(struct spsc_ring *r, size_t pos, size_t avail, size_t n)
+{
+	size_t to_end = r->mask + 1 - (pos & r->mask);
+	return TYPESAFE_MIN(n, TYPESAFE_MIN(avail, to_end));
+}
+
+size_t spsc_ring_reserve(struct spsc_ring *r, size_t n, void **slots)
+{
+	size_t head = r->p.head;
+	size_t room = r->mask + 1 - (head - r->p.tail_seen);
+	if (room < n) {
+		r->p.tail_seen = __atomic_load_n(&r->c.tail, __ATOMIC_ACQUIRE);
+		room = r->mask + 1 - (head - r->p.tail_seen);
+	}
+	n = contiguous(r, head, room, n);
+	*slots = slot(r, head);
+	return n;
+}
+
+void spsc_ring_commit(struct spsc_ring *r, size_t n)
+{
+	if (n) {
+		__atomic_store_n(&r->p.head, r->p.head + n, __ATOMIC_RELEASE);
+	}
+}
+
+size_t spsc_ring_push(struct spsc_ring *r, const void *src, size_t n)
+{
+	size_t done = 0;
+	while (done < n) {
+		void *slots;
+		size_t got = spsc_ring_reserve(r, n - done, &slots);
+		if (got == 0) {
+			break;
+		}
+		memcpy(slots, (const unsigned char *)src + done * r->slot_len,
+			got * r->slot_len);
+		spsc_ring_commit(r, got);
+		done += got;
+	}
+	return done;
+}
+
+size_t spsc_ring_peek(struct spsc_ring *r, size_t n, void **slots)
+{
+	size_t tail = r->c.tail;
+	size_t ready = r->c.head_seen - tail;
+	if (ready < n) {
+		r->c.head_seen = __atomic_load_n(&r->p.head, __ATOMIC_ACQUIRE);
+		ready = r->c.head_seen - tail;
+	}
+	n = contiguous(r, tail, ready, n);
+	*slots = slot(r, tail);
+	return n;
+}
+
+void spsc_ring_release(struct spsc_ring *r, size_t n)
+{
+	if (n) {
+		__atomic_store_n(&r->c.tail, r->c.tail + n, __ATOMIC_RELEASE);
+	}
+}
+
+size_t spsc_ring_pop(struct spsc_ring *r, void *dst, size_t n)
+{
+	size_t done = 0;
+	while (done < n) {
+		void *slots;
+		size_t got = spsc_ring_peek(r, n - done, &slots);
+		if (got == 0) {
+			break;
+		}
+		memcpy((unsigned char *)dst + done * r->slot_len, slots,
+			got * r->slot_len);
+		spsc_ring_release(r, got);
+		done += got;
+	}
+	return done;
+}
+
+size_t spsc_ring_used(struct spsc_ring *r)
+{
+	return __atomic_load_n(&r->p.head, __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&r->c.tail, __ATOMIC_ACQUIRE);
+}
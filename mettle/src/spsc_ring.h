@@ -0,0 +1,79 @@
+/**
+ * @brief Lock-free single-producer, single-consumer ring between threads
+ * @file spsc_ring.h
+ */
+
+#ifndef _SPSC_RING_H_
+#define _SPSC_RING_H_
+
+#include <stddef.h>
+
+/*
+ * Unlike ringbuf_t, which one thread owns, this ring hands fixed size slots
+ * from one thread to another with no locking. Each side reserves a batch
+ * of slots in place, fills or drains it and then publishes it with a
+ * single counter update, so handing over many slots costs one cache line
+ * transfer rather than one per slot.
+ *
+ * Batches are contiguous, so one ending at the end of the ring may be
+ * shorter than asked for; calling again continues from the start.
+ */
+
+struct spsc_ring;
+
+/*
+ * Creates a ring of at least 'count' slots, rounded up to a power of two,
+ * of 'slot_len' bytes each
+ */
+struct spsc_ring * spsc_ring_new(size_t count, size_t slot_len);
+
+void spsc_ring_free(struct spsc_ring *r);
+
+/*
+ * The number of slots the ring holds
+ */
+size_t spsc_ring_count(struct spsc_ring *r);
+
+/*
+ * Producer side. Returns up to 'n' free slots, the first in '*slots', to be
+ * filled then published with spsc_ring_commit. Returns 0 if the ring is
+ * full.
+ */
+size_t spsc_ring_reserve(struct spsc_ring *r, size_t n, void **slots);
+
+/*
+ * Publishes the first 'n' slots of the last reservation to the consumer
+ */
+void spsc_ring_commit(struct spsc_ring *r, size_t n);
+
+/*
+ * Producer side. Copies in up to 'n' slots from 'src', returning how many
+ * fit.
+ */
+size_t spsc_ring_push(struct spsc_ring *r, const void *src, size_t n);
+
+/*
+ * Consumer side. Returns up to 'n' filled slots, the first in '*slots',
+ * which stay valid until handed back with spsc_ring_release. Returns 0 if
+ * the ring is empty.
+ */
+size_t spsc_ring_peek(struct spsc_ring *r, size_t n, void **slots);
+
+/*
+ * Hands the first 'n' slots of the last peek back to the producer
+ */
+void spsc_ring_release(struct spsc_ring *r, size_t n);
+
+/*
+ * Consumer side. Copies out up to 'n' slots into 'dst', returning how many
+ * were waiting.
+ */
+size_t spsc_ring_pop(struct spsc_ring *r, void *dst, size_t n);
+
+/*
+ * Slots published and not yet released. Exact on either side for its own
+ * counter; the other side's may have moved on by the time it returns.
+ */
+size_t spsc_ring_used(struct spsc_ring *r);
+
+#endif
@@ -1,14 +1,73 @@
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sound/asound.h>
 
+#include <ev.h>
+#include <mettle.h>
+
+#include "channel.h"
+#include "log.h"
 #include "mic.h"
+#include "ringbuf.h"
+#include "thread_role.h"
+
+/*
+ * Capture talks to the kernel's ALSA PCM interface directly, so there is
+ * neither a libasound dependency nor an arecord process. A thread reads
+ * a period at a time from the hw device, mixes down to mono, resamples to
+ * the requested rate (what plughw did for arecord), optionally encodes as
+ * IMA ADPCM and appends to a ring buffer. The channel's read_cb only takes
+ * what is buffered, and the thread wakes a pending read through the loop.
+ * When the reader falls behind, the oldest audio is overwritten.
+ *
+ * The ADPCM stream is headerless: it starts with a predictor and step
+ * index of 0 and packs two samples per byte, the earlier in the low nibble.
+ */
+#define MIC_RATE_DEFAULT 11025
+#define MIC_PERIOD_MS 20
+
+#ifdef METTLE_LOW_MEMORY
+#define MIC_BUFFER_MS 1000
+#else
+#define MIC_BUFFER_MS 4000
+#endif
+
+struct linux_mic {
+    int fd;
+    unsigned channels, hw_rate, rate, period;
+    uint32_t encoding;
+
+    // Resampler position in 16.16 fixed point, and the last input sample
+    uint32_t step, pos;
+    int16_t last;
+
+    // IMA ADPCM state, and a sample waiting for its partner nibble
+    int predictor, index;
+    int half;
 
-FILE *arecord;
+    pthread_t thread;
+    bool running, stop;
+    pthread_mutex_t mutex;
+    ringbuf_t rb;
+    struct ev_loop *loop;
+    struct ev_async ready_async;
+    struct channel *channel;
+};
+
+static struct linux_mic *mic;
 
 // Read all lines in `/proc/asound/pcm` if one has the `capture` mode enabled, send it
 struct tlv_packet *audio_mic_list(struct tlv_handler_ctx *ctx) {
     struct tlv_packet *p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
-    
+
     char *sound_device = NULL;
     size_t len = 0;
     ssize_t read = 0;
@@ -22,38 +81,364 @@ struct tlv_packet *audio_mic_list(struct tlv_handler_ctx *ctx) {
 	    p = tlv_packet_add_str(p, TLV_TYPE_AUDIO_INTERFACE_NAME, sound_device);
 	}
     }
+    free(sound_device);
+    fclose(proc_asound_pcm);
 
     return p;
 }
 
-// Simply launch `arecord` on the given card ID, send sound to stdout
+static struct snd_interval *hw_interval(struct snd_pcm_hw_params *p, int n)
+{
+    return &p->intervals[n - SNDRV_PCM_HW_PARAM_FIRST_INTERVAL];
+}
+
+static void hw_set_mask(struct snd_pcm_hw_params *p, int n, unsigned bit)
+{
+    struct snd_mask *m = &p->masks[n - SNDRV_PCM_HW_PARAM_FIRST_MASK];
+    memset(m->bits, 0, sizeof(m->bits));
+    m->bits[bit >> 5] |= 1U << (bit & 31);
+}
+
+static void hw_set_range(struct snd_pcm_hw_params *p, int n,
+    unsigned min, unsigned max)
+{
+    struct snd_interval *i = hw_interval(p, n);
+    i->min = min;
+    i->max = max;
+}
+
+static void hw_params_any(struct snd_pcm_hw_params *p)
+{
+    memset(p, 0, sizeof(*p));
+    for (int n = SNDRV_PCM_HW_PARAM_FIRST_MASK; n <= SNDRV_PCM_HW_PARAM_LAST_MASK; n++) {
+	struct snd_mask *m = &p->masks[n - SNDRV_PCM_HW_PARAM_FIRST_MASK];
+	memset(m->bits, 0xff, sizeof(m->bits));
+    }
+    for (int n = SNDRV_PCM_HW_PARAM_FIRST_INTERVAL; n <= SNDRV_PCM_HW_PARAM_LAST_INTERVAL; n++) {
+	hw_set_range(p, n, 0, UINT_MAX);
+    }
+    p->rmask = ~0U;
+    p->info = ~0U;
+    hw_set_mask(p, SNDRV_PCM_HW_PARAM_ACCESS, SNDRV_PCM_ACCESS_RW_INTERLEAVED);
+    hw_set_mask(p, SNDRV_PCM_HW_PARAM_FORMAT, SNDRV_PCM_FORMAT_S16_LE);
+    hw_set_mask(p, SNDRV_PCM_HW_PARAM_SUBFORMAT, SNDRV_PCM_SUBFORMAT_STD);
+    hw_set_range(p, SNDRV_PCM_HW_PARAM_CHANNELS, 1, 2);
+}
+
+/*
+ * Settles on mono if the device can, and the supported rate nearest the
+ * one asked for, leaving the kernel to choose the rest
+ */
+static int mic_configure(struct linux_mic *m)
+{
+    struct snd_pcm_hw_params p;
+
+    hw_params_any(&p);
+    if (ioctl(m->fd, SNDRV_PCM_IOCTL_HW_REFINE, &p) == -1) {
+	return -1;
+    }
+
+    unsigned channels = hw_interval(&p, SNDRV_PCM_HW_PARAM_CHANNELS)->min;
+    struct snd_interval *rates = hw_interval(&p, SNDRV_PCM_HW_PARAM_RATE);
+    unsigned rate = m->rate;
+    rate = rate < rates->min ? rates->min : rate > rates->max ? rates->max : rate;
+
+    hw_params_any(&p);
+    hw_set_range(&p, SNDRV_PCM_HW_PARAM_CHANNELS, channels, channels);
+    hw_set_range(&p, SNDRV_PCM_HW_PARAM_RATE, rate, rate);
+    hw_set_range(&p, SNDRV_PCM_HW_PARAM_PERIOD_TIME,
+	MIC_PERIOD_MS * 1000 / 2, MIC_PERIOD_MS * 1000 * 2);
+    if (ioctl(m->fd, SNDRV_PCM_IOCTL_HW_PARAMS, &p) == -1) {
+	// Some devices only offer a rate range in steps, or odd periods
+	hw_params_any(&p);
+	hw_set_range(&p, SNDRV_PCM_HW_PARAM_CHANNELS, channels, channels);
+	hw_set_range(&p, SNDRV_PCM_HW_PARAM_RATE, rate, UINT_MAX);
+	if (ioctl(m->fd, SNDRV_PCM_IOCTL_HW_PARAMS, &p) == -1) {
+	    return -1;
+	}
+    }
+
+    m->channels = hw_interval(&p, SNDRV_PCM_HW_PARAM_CHANNELS)->min;
+    m->hw_rate = hw_interval(&p, SNDRV_PCM_HW_PARAM_RATE)->min;
+    m->period = hw_interval(&p, SNDRV_PCM_HW_PARAM_PERIOD_SIZE)->min;
+    if (m->channels == 0 || m->hw_rate == 0 || m->period == 0) {
+	return -1;
+    }
+    m->step = (uint32_t)(((uint64_t)m->hw_rate << 16) / m->rate);
+
+    if (ioctl(m->fd, SNDRV_PCM_IOCTL_PREPARE) == -1) {
+	return -1;
+    }
+    log_info("capturing %u channel(s) at %u Hz, sending %u Hz",
+	m->channels, m->hw_rate, m->rate);
+    return 0;
+}
+
+static const int ima_index_table[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static const int ima_step_table[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37,
+    41, 45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173,
+    190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658,
+    724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484,
+    7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818,
+    18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static uint8_t ima_encode(struct linux_mic *m, int16_t sample)
+{
+    int step = ima_step_table[m->index];
+    int diff = sample - m->predictor;
+    uint8_t nibble = 0;
+
+    if (diff < 0) {
+	nibble = 8;
+	diff = -diff;
+    }
+    int delta = step >> 3;
+    if (diff >= step) {
+	nibble |= 4;
+	diff -= step;
+	delta += step;
+    }
+    step >>= 1;
+    if (diff >= step) {
+	nibble |= 2;
+	diff -= step;
+	delta += step;
+    }
+    step >>= 1;
+    if (diff >= step) {
+	nibble |= 1;
+	delta += step;
+    }
+
+    m->predictor += (nibble & 8) ? -delta : delta;
+    m->predictor = m->predictor > 32767 ? 32767 : m->predictor < -32768 ? -32768 : m->predictor;
+    m->index += ima_index_table[nibble];
+    m->index = m->index < 0 ? 0 : m->index > 88 ? 88 : m->index;
+    return nibble;
+}
+
+/*
+ * Turns a period of interleaved frames into the output stream, returning
+ * its length in bytes
+ */
+static size_t mic_process(struct linux_mic *m, const int16_t *frames, size_t count,
+    void *dst)
+{
+    int16_t *out = dst;
+    uint8_t *packed = dst;
+    size_t samples = 0, bytes = 0;
+
+    for (size_t i = 0; i < count; i++) {
+	int sample = frames[i * m->channels];
+	if (m->channels > 1) {
+	    sample = (sample + frames[i * m->channels + 1]) / 2;
+	}
+
+	// Linear interpolation from the last input sample to this one
+	while (m->pos < 0x10000) {
+	    int16_t s = m->last + (((sample - m->last) * (int64_t)m->pos) >> 16);
+	    m->pos += m->step;
+	    if (m->encoding == AUDIO_ENCODING_IMA_ADPCM) {
+		uint8_t nibble = ima_encode(m, s);
+		if (m->half == -1) {
+		    m->half = nibble;
+		} else {
+		    packed[bytes++] = m->half | nibble << 4;
+		    m->half = -1;
+		}
+	    } else {
+		out[samples++] = htole16(s);
+	    }
+	}
+	m->pos -= 0x10000;
+	m->last = sample;
+    }
+    return m->encoding == AUDIO_ENCODING_IMA_ADPCM ? bytes : samples * sizeof(int16_t);
+}
+
+static void *mic_thread(void *arg)
+{
+    struct linux_mic *m = arg;
+    int16_t *buf = malloc(m->period * m->channels * sizeof(int16_t));
+
+    // Upsampling makes more samples than were read
+    size_t out_len = ((size_t)m->period * m->rate / m->hw_rate + 2) * sizeof(int16_t);
+    void *out = malloc(out_len);
+    if (buf == NULL || out == NULL) {
+	free(buf);
+	free(out);
+	return NULL;
+    }
+
+    thread_role_enter(THREAD_ROLE_BULK, "mic");
+    while (1) {
+	pthread_mutex_lock(&m->mutex);
+	bool stop = m->stop;
+	pthread_mutex_unlock(&m->mutex);
+	if (stop) {
+	    break;
+	}
+
+	struct snd_xferi x = {
+	    .buf = buf,
+	    .frames = m->period,
+	};
+	if (ioctl(m->fd, SNDRV_PCM_IOCTL_READI_FRAMES, &x) == -1) {
+	    if (errno == EPIPE) {
+		// Overrun, start over
+		ioctl(m->fd, SNDRV_PCM_IOCTL_PREPARE);
+		continue;
+	    } else if (errno == EINTR || errno == EAGAIN) {
+		continue;
+	    }
+	    // Dropped by audio_mic_stop, or the device went away
+	    break;
+	}
+
+	size_t len = mic_process(m, buf, x.result, out);
+	if (len) {
+	    pthread_mutex_lock(&m->mutex);
+	    ringbuf_memcpy_into(m->rb, out, len);
+	    pthread_mutex_unlock(&m->mutex);
+	    ev_async_send(m->loop, &m->ready_async);
+	}
+    }
+    free(buf);
+    free(out);
+    thread_role_leave();
+    return NULL;
+}
+
+static void mic_ready_cb(struct ev_loop *loop, struct ev_async *w, int revents)
+{
+    struct linux_mic *m = w->data;
+    if (m->channel) {
+	channel_read_ready(m->channel);
+    }
+}
+
+static void mic_free(struct linux_mic *m)
+{
+    if (m->running) {
+	pthread_mutex_lock(&m->mutex);
+	m->stop = true;
+	pthread_mutex_unlock(&m->mutex);
+	// Fails the read the thread is blocked in
+	ioctl(m->fd, SNDRV_PCM_IOCTL_DROP);
+	pthread_join(m->thread, NULL);
+    }
+    ev_async_stop(m->loop, &m->ready_async);
+    pthread_mutex_destroy(&m->mutex);
+    if (m->fd != -1) {
+	close(m->fd);
+    }
+    if (m->rb) {
+	ringbuf_free(&m->rb);
+    }
+    free(m);
+}
+
 struct tlv_packet *audio_mic_start(struct tlv_handler_ctx *ctx) {
-    uint32_t device;
+    struct mettle *mettle = ctx->arg;
+    uint32_t device = 1, rate = MIC_RATE_DEFAULT, encoding = AUDIO_ENCODING_PCM;
+    char dev_name[64];
+
+    if (mic != NULL) {
+	return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
+    }
+
     tlv_packet_get_u32(ctx->req, TLV_TYPE_AUDIO_INTERFACE_ID, &device);
-    device--;
+    tlv_packet_get_u32(ctx->req, TLV_TYPE_AUDIO_SAMPLE_RATE, &rate);
+    tlv_packet_get_u32(ctx->req, TLV_TYPE_AUDIO_ENCODING, &encoding);
+    if (rate < 4000 || rate > 96000 || encoding > AUDIO_ENCODING_IMA_ADPCM) {
+	return tlv_packet_response_result(ctx, EINVAL);
+    }
+
+    struct linux_mic *m = calloc(1, sizeof(*m));
+    if (m == NULL) {
+	return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
+    }
+    m->rate = rate;
+    m->encoding = encoding;
+    m->half = -1;
+    m->loop = mettle_get_loop(mettle);
+    pthread_mutex_init(&m->mutex, NULL);
+    ev_async_init(&m->ready_async, mic_ready_cb);
+    m->ready_async.data = m;
+    ev_async_start(m->loop, &m->ready_async);
 
-    int rc = TLV_RESULT_FAILURE;
+    snprintf(dev_name, sizeof(dev_name), "/dev/snd/pcmC%uD0c", device - 1);
+    m->fd = open(dev_name, O_RDONLY | O_CLOEXEC);
+    if (m->fd == -1) {
+	log_info("could not open %s: %s", dev_name, strerror(errno));
+	goto err;
+    }
+
+    if (mic_configure(m) == -1) {
+	log_info("could not configure %s: %s", dev_name, strerror(errno));
+	goto err;
+    }
+
+    m->rb = ringbuf_new((size_t)rate * sizeof(int16_t) * MIC_BUFFER_MS / 1000);
+    if (m->rb == NULL) {
+	goto err;
+    }
 
-    char cmd[100];
-    sprintf(cmd, "arecord -D plughw:%d -q -f cd -t raw -r 11025 -c 1", device);
-    arecord = popen(cmd, "r");
-    if (arecord != NULL) {
-	rc = TLV_RESULT_SUCCESS;
+    if (pthread_create(&m->thread, NULL, mic_thread, m)) {
+	goto err;
     }
+    m->running = true;
+    mic = m;
 
-    return tlv_packet_response_result(ctx, rc);
+    return tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+
+err:
+    mic_free(m);
+    return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
 }
 
-// Kill the `arecord` process
 struct tlv_packet *audio_mic_stop(struct tlv_handler_ctx *ctx) {
-    if (arecord != NULL) {
-    	pclose(arecord);
-	arecord = NULL; // So we don't try to `pclose` it again, put here as a safeguard
+    if (mic != NULL) {
+	mic_free(mic);
+	mic = NULL;
     }
     return tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
 }
 
-// Read `arecord` stdout and send it
+int audio_mic_channel_new(struct tlv_handler_ctx *ctx, struct channel *c) {
+    if (mic != NULL) {
+	mic->channel = c;
+    }
+    return 0;
+}
+
+int audio_mic_channel_free(struct channel *c) {
+    if (mic != NULL && mic->channel == c) {
+	mic->channel = NULL;
+    }
+    return 0;
+}
+
+// Hand over whatever the capture thread has buffered, never waiting for more
 ssize_t audio_mic_read(struct channel *c, void *buf, size_t len) {
-    return fread(buf, 1, len, arecord);
+    if (mic == NULL) {
+	return 0;
+    }
+
+    pthread_mutex_lock(&mic->mutex);
+    size_t used = ringbuf_bytes_used(mic->rb);
+    len = len < used ? len : used;
+    if (mic->encoding == AUDIO_ENCODING_PCM) {
+	// Whole samples only
+	len &= ~(size_t)1;
+    }
+    ringbuf_memcpy_from(buf, mic->rb, len);
+    pthread_mutex_unlock(&mic->mutex);
+    return len;
 }
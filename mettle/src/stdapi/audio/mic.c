@@ -28,7 +28,11 @@ void audio_mic_register_handlers(struct mettle *m)
     tlv_dispatcher_add_handler(td, "audio_mic_stop", audio_mic_stop, m);
 
     struct channel_callbacks cbs = {
-                .read_cb = audio_mic_read
+                .read_cb = audio_mic_read,
+#ifdef __linux__
+                .new_cb = audio_mic_channel_new,
+                .free_cb = audio_mic_channel_free,
+#endif
     };
     channelmgr_add_channel_type(cm, "audio_mic", &cbs);
 #endif
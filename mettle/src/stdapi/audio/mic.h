@@ -7,10 +7,24 @@
 #define TLV_TYPE_AUDIO_DATA            ((TLV_META_TYPE_RAW    | TLV_EXTENSIONS) + 11)
 #define TLV_TYPE_AUDIO_INTERFACE_ID    ((TLV_META_TYPE_UINT   | TLV_EXTENSIONS) + 12)
 #define TLV_TYPE_AUDIO_INTERFACE_NAME  ((TLV_META_TYPE_STRING | TLV_EXTENSIONS) + 13)
+#define TLV_TYPE_AUDIO_SAMPLE_RATE     ((TLV_META_TYPE_UINT   | TLV_EXTENSIONS) + 14)
+#define TLV_TYPE_AUDIO_ENCODING        ((TLV_META_TYPE_UINT   | TLV_EXTENSIONS) + 15)
+
+/*
+ * Values of TLV_TYPE_AUDIO_ENCODING: 16-bit little endian mono samples,
+ * the default, or IMA ADPCM at a quarter of their size
+ */
+#define AUDIO_ENCODING_PCM       0
+#define AUDIO_ENCODING_IMA_ADPCM 1
 
 struct tlv_packet *audio_mic_list(struct tlv_handler_ctx *ctx);
 struct tlv_packet *audio_mic_start(struct tlv_handler_ctx *ctx);
 struct tlv_packet *audio_mic_stop(struct tlv_handler_ctx *ctx);
 
 ssize_t audio_mic_read(struct channel *c, void *buf, size_t len);
+
+#ifdef __linux__
+int audio_mic_channel_new(struct tlv_handler_ctx *ctx, struct channel *c);
+int audio_mic_channel_free(struct channel *c);
+#endif
 #endif
@@ -0,0 +1,664 @@
+/**
+ * Copyright 2016 Rapid7
+ * @brief Archive download channel
+ * @file archive.c
+ *
+ * Streams a set of files and directory trees as one tar archive, optionally
+ * gzip compressed, so a tree comes down over a single channel instead of one
+ * per file. Reading the files and compressing what was read are separate
+ * eio requests that run at the same time, one chunk apart, so neither the
+ * disk nor the compressor waits on the other.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <eio.h>
+#include <mettle.h>
+#include <zlib.h>
+
+#include "buffer_queue.h"
+#include "channel.h"
+#include "log.h"
+#include "tlv.h"
+#include "util.h"
+#include "utlist.h"
+
+#define ARCHIVE_CHUNK_LEN (256 * 1024)
+
+/*
+ * Room past a full chunk for the headers of one entry and the end of the
+ * archive, so neither is ever split
+ */
+#define ARCHIVE_CHUNK_SLACK (16 * 1024)
+
+#define ARCHIVE_MAX_CHUNKS 2
+#define ARCHIVE_MAX_BUFFERED (1024 * 1024)
+
+#define TAR_BLOCK 512
+#define TAR_RECORD (20 * TAR_BLOCK)
+
+enum archive_compression {
+	ARCHIVE_COMPRESSION_NONE = 0,
+	ARCHIVE_COMPRESSION_GZIP = 1,
+};
+
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+struct archive_chunk {
+	unsigned char *data;
+	size_t len;
+	bool last;
+	struct archive_chunk *next;
+};
+
+struct archive_dir {
+	DIR *dir;
+	char *path;
+	char *name;
+	struct archive_dir *next;
+};
+
+/*
+ * Only ever used by the one read request in flight
+ */
+struct archive_walk {
+	char **paths;
+	size_t num_paths, next_path;
+	struct archive_dir *dirs;
+	int fd;
+	uint64_t remaining;
+	size_t pad;
+	uint64_t total;
+	bool done;
+};
+
+struct archive {
+	struct channel *channel;
+	enum archive_compression compression;
+	z_stream zs;
+	struct archive_walk walk;
+
+	struct archive_chunk *raw;
+	size_t num_raw;
+	struct archive_chunk *reading, *compressing;
+	unsigned char *compressed;
+	size_t compressed_len;
+
+	struct buffer_queue *out;
+	bool finished;
+	int err;
+};
+
+static void tar_number(char *field, size_t len, uint64_t val)
+{
+	/*
+	 * Values too large for the octal field use the GNU base-256 form
+	 */
+	if (val >> (3 * (len - 1))) {
+		memset(field, 0, len);
+		for (size_t i = len - 1; i > 0; i--) {
+			field[i] = val & 0xff;
+			val >>= 8;
+		}
+		field[0] = (char)0x80;
+	} else {
+		snprintf(field, len, "%0*" PRIo64, (int)len - 1, val);
+	}
+}
+
+static void tar_add(struct archive_chunk *c, const void *data, size_t len)
+{
+	memcpy(c->data + c->len, data, len);
+	c->len += len;
+	size_t pad = (TAR_BLOCK - len % TAR_BLOCK) % TAR_BLOCK;
+	memset(c->data + c->len, 0, pad);
+	c->len += pad;
+}
+
+static void tar_add_header(struct archive_chunk *c, const char *name,
+	char type, struct stat *st, uint64_t size, const char *link)
+{
+	/*
+	 * Names that do not fit go first as GNU long name records
+	 */
+	size_t name_len = strlen(name);
+	size_t link_len = link ? strlen(link) : 0;
+	if (name_len > sizeof(((struct tar_header *)0)->name)) {
+		tar_add_header(c, "././@LongLink", 'L', st, name_len + 1, NULL);
+		tar_add(c, name, name_len + 1);
+	}
+	if (link_len > sizeof(((struct tar_header *)0)->linkname)) {
+		tar_add_header(c, "././@LongLink", 'K', st, link_len + 1, NULL);
+		tar_add(c, link, link_len + 1);
+	}
+
+	struct tar_header *h = (struct tar_header *)(c->data + c->len);
+	memset(h, 0, sizeof(*h));
+	strncpy(h->name, name, sizeof(h->name));
+	if (link) {
+		strncpy(h->linkname, link, sizeof(h->linkname));
+	}
+	tar_number(h->mode, sizeof(h->mode), st->st_mode & 07777);
+	tar_number(h->uid, sizeof(h->uid), st->st_uid);
+	tar_number(h->gid, sizeof(h->gid), st->st_gid);
+	tar_number(h->size, sizeof(h->size), size);
+	tar_number(h->mtime, sizeof(h->mtime), st->st_mtime > 0 ? st->st_mtime : 0);
+	h->typeflag = type;
+	memcpy(h->magic, "ustar ", sizeof(h->magic));
+	memcpy(h->version, " ", sizeof(h->version));
+
+	unsigned sum = 0;
+	memset(h->chksum, ' ', sizeof(h->chksum));
+	for (size_t i = 0; i < sizeof(*h); i++) {
+		sum += ((unsigned char *)h)[i];
+	}
+	snprintf(h->chksum, sizeof(h->chksum), "%06o", sum);
+	c->len += sizeof(*h);
+}
+
+static char *archive_join(const char *parent, const char *name)
+{
+	char *path;
+	size_t len = strlen(parent);
+	if (asprintf(&path, "%s%s%s", parent,
+			len == 0 || parent[len - 1] == '/' ? "" : "/", name) == -1) {
+		return NULL;
+	}
+	return path;
+}
+
+static void archive_add_entry(struct archive_walk *w, struct archive_chunk *c,
+	const char *path, const char *name)
+{
+	struct stat st;
+	if (strlen(name) >= PATH_MAX) {
+		log_info("skipping %s: name too long", path);
+		return;
+	}
+	if (lstat(path, &st) == -1) {
+		log_info("skipping %s: %s", path, strerror(errno));
+		return;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		struct archive_dir *d = calloc(1, sizeof(*d));
+		if (d == NULL || (d->dir = opendir(path)) == NULL
+				|| (d->path = strdup(path)) == NULL
+				|| (d->name = strdup(name)) == NULL) {
+			log_info("skipping %s: %s", path, strerror(errno));
+			if (d) {
+				if (d->dir) {
+					closedir(d->dir);
+				}
+				free(d->path);
+				free(d);
+			}
+			return;
+		}
+		char *dir_name;
+		if (name[0] && asprintf(&dir_name, "%s/", name) != -1) {
+			tar_add_header(c, dir_name, '5', &st, 0, NULL);
+			free(dir_name);
+		}
+		LL_PREPEND(w->dirs, d);
+
+	} else if (S_ISREG(st.st_mode)) {
+		int fd = open(path, O_RDONLY | O_NONBLOCK);
+		if (fd == -1) {
+			log_info("skipping %s: %s", path, strerror(errno));
+			return;
+		}
+#ifdef POSIX_FADV_SEQUENTIAL
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+		tar_add_header(c, name, '0', &st, st.st_size, NULL);
+		w->fd = fd;
+		w->remaining = st.st_size;
+		w->pad = (TAR_BLOCK - st.st_size % TAR_BLOCK) % TAR_BLOCK;
+
+	} else if (S_ISLNK(st.st_mode)) {
+		char link[PATH_MAX];
+		ssize_t len = readlink(path, link, sizeof(link) - 1);
+		if (len >= 0) {
+			link[len] = '\0';
+			tar_add_header(c, name, '2', &st, 0, link);
+		}
+	}
+}
+
+/*
+ * Copies the current file into the chunk. A file that shrinks while it is
+ * read is padded with zeros to the size already written in its header, and
+ * one that grows is cut off at it.
+ */
+static void archive_add_data(struct archive_walk *w, struct archive_chunk *c)
+{
+	if (w->remaining) {
+		size_t want = TYPESAFE_MIN(w->remaining, (uint64_t)(ARCHIVE_CHUNK_LEN - c->len));
+		ssize_t n = read(w->fd, c->data + c->len, want);
+		if (n <= 0) {
+			memset(c->data + c->len, 0, want);
+			n = want;
+		}
+		c->len += n;
+		w->remaining -= n;
+		return;
+	}
+
+	memset(c->data + c->len, 0, w->pad);
+	c->len += w->pad;
+	close(w->fd);
+	w->fd = -1;
+}
+
+static void archive_fill(struct archive_walk *w, struct archive_chunk *c)
+{
+	size_t start = c->len;
+
+	while (c->len < ARCHIVE_CHUNK_LEN && !w->done) {
+		if (w->fd != -1) {
+			archive_add_data(w, c);
+
+		} else if (w->dirs) {
+			struct archive_dir *d = w->dirs;
+			struct dirent *ent = readdir(d->dir);
+			if (ent == NULL) {
+				LL_DELETE(w->dirs, d);
+				closedir(d->dir);
+				free(d->path);
+				free(d->name);
+				free(d);
+				continue;
+			}
+			if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+				continue;
+			}
+			char *path = archive_join(d->path, ent->d_name);
+			char *name = d->name[0] ? archive_join(d->name, ent->d_name) : strdup(ent->d_name);
+			if (path && name) {
+				archive_add_entry(w, c, path, name);
+			}
+			free(path);
+			free(name);
+
+		} else if (w->next_path < w->num_paths) {
+			const char *path = w->paths[w->next_path++];
+			char *copy = strdup(path);
+			if (copy) {
+				size_t len = strlen(copy);
+				while (len > 1 && copy[len - 1] == '/') {
+					copy[--len] = '\0';
+				}
+				const char *name = strrchr(copy, '/');
+				name = name ? name + 1 : copy;
+				archive_add_entry(w, c, path, name);
+				free(copy);
+			}
+
+		} else {
+			/*
+			 * Two zero blocks end the archive, padded out to a whole
+			 * record as tar itself writes them
+			 */
+			size_t end = 2 * TAR_BLOCK;
+			uint64_t total = w->total + (c->len - start) + end;
+			end += (TAR_RECORD - total % TAR_RECORD) % TAR_RECORD;
+			memset(c->data + c->len, 0, end);
+			c->len += end;
+			w->done = true;
+			c->last = true;
+		}
+	}
+	w->total += c->len - start;
+}
+
+static void archive_walk_free(struct archive_walk *w)
+{
+	struct archive_dir *d, *tmp;
+	LL_FOREACH_SAFE(w->dirs, d, tmp) {
+		LL_DELETE(w->dirs, d);
+		closedir(d->dir);
+		free(d->path);
+		free(d->name);
+		free(d);
+	}
+	if (w->fd != -1) {
+		close(w->fd);
+	}
+	for (size_t i = 0; i < w->num_paths; i++) {
+		free(w->paths[i]);
+	}
+	free(w->paths);
+}
+
+static void archive_chunk_free(struct archive_chunk *c)
+{
+	if (c) {
+		free(c->data);
+		free(c);
+	}
+}
+
+static void archive_free(struct archive *a)
+{
+	struct archive_chunk *c, *tmp;
+	LL_FOREACH_SAFE(a->raw, c, tmp) {
+		LL_DELETE(a->raw, c);
+		archive_chunk_free(c);
+	}
+	archive_walk_free(&a->walk);
+	if (a->compression == ARCHIVE_COMPRESSION_GZIP) {
+		deflateEnd(&a->zs);
+	}
+	buffer_queue_free(a->out);
+	free(a);
+}
+
+static void archive_read_async(eio_req *req)
+{
+	struct archive *a = req->data;
+	archive_fill(&a->walk, a->reading);
+}
+
+static void archive_compress_async(eio_req *req)
+{
+	struct archive *a = req->data;
+	struct archive_chunk *in = a->compressing;
+	z_stream *zs = &a->zs;
+
+	size_t cap = deflateBound(zs, in->len);
+	unsigned char *out = malloc(cap);
+	if (out == NULL) {
+		return;
+	}
+
+	zs->next_in = in->data;
+	zs->avail_in = in->len;
+	size_t len = 0;
+	int rc;
+	do {
+		if (len == cap) {
+			unsigned char *bigger = realloc(out, cap * 2);
+			if (bigger == NULL) {
+				free(out);
+				return;
+			}
+			out = bigger;
+			cap *= 2;
+		}
+		zs->next_out = out + len;
+		zs->avail_out = cap - len;
+		rc = deflate(zs, in->last ? Z_FINISH : Z_NO_FLUSH);
+		len = cap - zs->avail_out;
+	} while (rc != Z_STREAM_ERROR
+		&& (in->last ? rc != Z_STREAM_END : zs->avail_in > 0));
+
+	if (rc == Z_STREAM_ERROR) {
+		free(out);
+		return;
+	}
+	a->compressed = out;
+	a->compressed_len = len;
+}
+
+static int archive_read_cb(eio_req *req);
+static int archive_compress_cb(eio_req *req);
+
+/*
+ * Keeps one chunk being read and one being compressed while the output
+ * stays under its limit
+ */
+static void archive_pump(struct archive *a)
+{
+	if (a->channel == NULL || a->err) {
+		return;
+	}
+
+	while (a->raw && a->compressing == NULL
+			&& buffer_queue_len(a->out) < ARCHIVE_MAX_BUFFERED) {
+		struct archive_chunk *c = a->raw;
+		LL_DELETE(a->raw, c);
+		a->num_raw--;
+
+		if (a->compression == ARCHIVE_COMPRESSION_NONE) {
+			if (c->len && buffer_queue_add_owned(a->out, c->data, c->len, free) == -1) {
+				archive_chunk_free(c);
+				a->err = ENOMEM;
+				break;
+			}
+			a->finished = c->last;
+			free(c);
+			continue;
+		}
+
+		a->compressing = c;
+		if (eio_custom(archive_compress_async, EIO_PRI_MIN, archive_compress_cb, a) == NULL) {
+			a->compressing = NULL;
+			archive_chunk_free(c);
+			a->err = EIO;
+		}
+	}
+
+	if (a->reading == NULL && !a->walk.done && a->num_raw < ARCHIVE_MAX_CHUNKS
+			&& buffer_queue_len(a->out) < ARCHIVE_MAX_BUFFERED) {
+		struct archive_chunk *c = calloc(1, sizeof(*c));
+		if (c == NULL || (c->data = malloc(ARCHIVE_CHUNK_LEN + ARCHIVE_CHUNK_SLACK)) == NULL) {
+			free(c);
+			a->err = ENOMEM;
+		} else {
+			a->reading = c;
+			if (eio_custom(archive_read_async, EIO_PRI_MIN, archive_read_cb, a) == NULL) {
+				a->reading = NULL;
+				archive_chunk_free(c);
+				a->err = EIO;
+			}
+		}
+	}
+
+	if (a->err || (a->finished && buffer_queue_len(a->out) == 0)) {
+		channel_read_ready(a->channel);
+	}
+}
+
+static void archive_job_done(struct archive *a)
+{
+	if (a->channel == NULL) {
+		if (a->reading == NULL && a->compressing == NULL) {
+			archive_free(a);
+		}
+		return;
+	}
+	archive_pump(a);
+}
+
+static int archive_read_cb(eio_req *req)
+{
+	struct archive *a = req->data;
+	struct archive_chunk *c = a->reading;
+	a->reading = NULL;
+	LL_APPEND(a->raw, c);
+	a->num_raw++;
+	archive_job_done(a);
+	return 0;
+}
+
+static int archive_compress_cb(eio_req *req)
+{
+	struct archive *a = req->data;
+	struct archive_chunk *c = a->compressing;
+	a->compressing = NULL;
+
+	if (a->compressed == NULL) {
+		a->err = ENOMEM;
+	} else if (a->compressed_len && buffer_queue_add_owned(a->out,
+			a->compressed, a->compressed_len, free) == -1) {
+		free(a->compressed);
+		a->err = ENOMEM;
+	} else {
+		if (a->compressed_len == 0) {
+			free(a->compressed);
+		}
+		a->finished = c->last;
+		if (a->channel) {
+			channel_read_ready(a->channel);
+		}
+	}
+	a->compressed = NULL;
+	archive_chunk_free(c);
+	archive_job_done(a);
+	return 0;
+}
+
+static int archive_new(struct tlv_handler_ctx *ctx, struct channel *c)
+{
+	struct archive *a = calloc(1, sizeof(*a));
+	if (a == NULL) {
+		return -1;
+	}
+	a->walk.fd = -1;
+	a->out = buffer_queue_new();
+	if (a->out == NULL) {
+		goto err;
+	}
+
+	struct tlv_iterator i = {
+		.packet = ctx->req,
+		.value_type = TLV_TYPE_FILE_PATH,
+	};
+	char *path;
+	while ((path = tlv_packet_iterate_str(&i))) {
+		struct stat st;
+		if (lstat(path, &st) == -1) {
+			log_info("cannot archive %s: %s", path, strerror(errno));
+			goto err;
+		}
+		char **paths = realloc(a->walk.paths, (a->walk.num_paths + 1) * sizeof(*paths));
+		if (paths == NULL) {
+			goto err;
+		}
+		a->walk.paths = paths;
+		if ((paths[a->walk.num_paths] = strdup(path)) == NULL) {
+			goto err;
+		}
+		a->walk.num_paths++;
+	}
+	if (a->walk.num_paths == 0) {
+		goto err;
+	}
+
+	uint32_t compression = ARCHIVE_COMPRESSION_GZIP;
+	uint32_t level = Z_DEFAULT_COMPRESSION;
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_ARCHIVE_COMPRESSION, &compression);
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_ARCHIVE_LEVEL, &level);
+	switch (compression) {
+		case ARCHIVE_COMPRESSION_NONE:
+			break;
+		case ARCHIVE_COMPRESSION_GZIP:
+			/*
+			 * 16 more window bits asks zlib for a gzip wrapper
+			 */
+			if (deflateInit2(&a->zs, level > 9 ? Z_DEFAULT_COMPRESSION : (int)level,
+					Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+				goto err;
+			}
+			break;
+		default:
+			log_info("unsupported archive compression %u", compression);
+			goto err;
+	}
+	a->compression = compression;
+
+	a->channel = c;
+	channel_set_ctx(c, a);
+	archive_pump(a);
+	return 0;
+
+err:
+	archive_free(a);
+	return -1;
+}
+
+static ssize_t archive_read(struct channel *c, void *buf, size_t len)
+{
+	struct archive *a = channel_get_ctx(c);
+
+	if (buffer_queue_len(a->out)) {
+		size_t n = buffer_queue_remove(a->out, buf, len);
+		archive_pump(a);
+		return n;
+	}
+	if (a->err) {
+		errno = a->err;
+		return -1;
+	}
+	if (a->finished) {
+		return 0;
+	}
+
+	archive_pump(a);
+	errno = EAGAIN;
+	return -1;
+}
+
+static bool archive_eof(struct channel *c)
+{
+	struct archive *a = channel_get_ctx(c);
+	return a->finished && buffer_queue_len(a->out) == 0;
+}
+
+static int archive_channel_free(struct channel *c)
+{
+	struct archive *a = channel_get_ctx(c);
+	channel_set_ctx(c, NULL);
+
+	/*
+	 * Requests still in flight own parts of the archive, so the last of
+	 * them frees it
+	 */
+	a->channel = NULL;
+	if (a->reading == NULL && a->compressing == NULL) {
+		archive_free(a);
+	}
+	return 0;
+}
+
+void archive_register_handlers(struct mettle *m)
+{
+	struct channelmgr *cm = mettle_get_channelmgr(m);
+
+	struct channel_callbacks cbs = {
+		.new_cb = archive_new,
+		.read_cb = archive_read,
+		.eof_cb = archive_eof,
+		.free_cb = archive_channel_free,
+	};
+	channelmgr_add_channel_type(cm, "stdapi_fs_archive", &cbs);
+	channelmgr_set_channel_type_lane(cm, "stdapi_fs_archive", TLV_LANE_BULK);
+}
@@ -6,23 +6,53 @@
 
 #include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/stat.h>
+#include <dirent.h>
+#ifndef _WIN32
+#include <fnmatch.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_FALLOCATE
+#include <linux/falloc.h>
+#endif
 
 #include <dnet.h>
 #include <eio.h>
+#include <ev.h>
 #include <mettle.h>
 #include <md5.h>
 #include <sha1.h>
+#include <sha2.h>
 
 #include <libgen.h>
 
+#include "buffer_queue.h"
 #include "channel.h"
 #include "log.h"
+#include "matcher.h"
 #include "tlv.h"
+#include "util.h"
+#include "utlist.h"
 
 #ifdef __APPLE__
 #define st_mtim st_mtimespec
@@ -65,14 +95,145 @@ add_stat(struct tlv_packet *p, EIO_STRUCT_STAT *s)
 	return tlv_packet_add_raw(p, TLV_TYPE_STAT_BUF, &ms, sizeof(ms));
 }
 
+#ifndef _WIN32
+
+/*
+ * Reads directory entries in large batches straight from the kernel where
+ * it allows, so nothing is collected or sorted up front
+ */
+struct dir_reader {
+	int fd;
+#ifdef __linux__
+	char buf[64 * 1024];
+	long pos, len;
+#else
+	DIR *dir;
+#endif
+};
+
+#ifdef __linux__
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#endif
+
+static int dir_reader_open(struct dir_reader *r, const char *path)
+{
+	r->fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (r->fd == -1) {
+		return -1;
+	}
+#ifdef __linux__
+	r->pos = r->len = 0;
+#else
+	r->dir = fdopendir(r->fd);
+	if (r->dir == NULL) {
+		close(r->fd);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+static const char *dir_reader_next(struct dir_reader *r, unsigned char *type)
+{
+#ifdef __linux__
+	if (r->pos >= r->len) {
+		r->len = syscall(SYS_getdents64, r->fd, r->buf, sizeof(r->buf));
+		r->pos = 0;
+		if (r->len <= 0) {
+			return NULL;
+		}
+	}
+	struct linux_dirent64 *ent = (struct linux_dirent64 *)(r->buf + r->pos);
+	r->pos += ent->d_reclen;
+	*type = ent->d_type;
+	return ent->d_name;
+#else
+	struct dirent *ent = readdir(r->dir);
+	if (ent == NULL) {
+		return NULL;
+	}
+	*type = ent->d_type;
+	return ent->d_name;
+#endif
+}
+
+static void dir_reader_close(struct dir_reader *r)
+{
+#ifdef __linux__
+	close(r->fd);
+#else
+	closedir(r->dir);
+#endif
+}
+
+#endif
+
 #ifdef HAVE_GLOB
 
 #include <glob.h>
 
-static void
-fs_ls_async(eio_req *req)
+/*
+ * Lists a directory without a wildcard, stat'ing each entry relative to the
+ * directory unless the request asked for names only. Entries go out in
+ * pages as they are read, for clients that take streamed responses.
+ */
+static struct tlv_packet *
+fs_ls_dir(struct tlv_handler_ctx *ctx, const char *path)
+{
+	bool no_stat = false;
+	tlv_packet_get_bool(ctx->req, TLV_TYPE_DIRECTORY_NO_STAT, &no_stat);
+
+	struct dir_reader *r = tlv_handler_ctx_alloc(ctx, sizeof(*r));
+	if (r == NULL) {
+		return tlv_packet_response_result(ctx, ENOMEM);
+	}
+	if (dir_reader_open(r, path) == -1) {
+		return tlv_packet_response_result(ctx, errno);
+	}
+
+	char fq_path[PATH_MAX];
+	size_t dir_len = strlen(path);
+	while (dir_len > 1 && path[dir_len - 1] == '/') {
+		dir_len--;
+	}
+	if (dir_len + 2 >= sizeof(fq_path)) {
+		dir_reader_close(r);
+		return tlv_packet_response_result(ctx, ENAMETOOLONG);
+	}
+	memcpy(fq_path, path, dir_len);
+	if (fq_path[dir_len - 1] != '/') {
+		fq_path[dir_len++] = '/';
+	}
+
+	struct tlv_packet *p = tlv_packet_response(ctx);
+	const char *name;
+	unsigned char type;
+	while (p && (name = dir_reader_next(r, &type))) {
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+			continue;
+		}
+		snprintf(fq_path + dir_len, sizeof(fq_path) - dir_len, "%s", name);
+		p = tlv_packet_add_str(p, TLV_TYPE_FILE_PATH, fq_path);
+		struct stat buf;
+		if (!no_stat && fstatat(r->fd, name, &buf, 0) == 0) {
+			p = add_stat(p, &buf);
+		}
+		p = tlv_packet_add_str(p, TLV_TYPE_FILE_NAME, name);
+		p = tlv_packet_response_continue(ctx, p);
+	}
+
+	dir_reader_close(r);
+	return tlv_packet_add_result(p, TLV_RESULT_SUCCESS);
+}
+
+struct tlv_packet *fs_ls(struct tlv_handler_ctx *ctx)
 {
-	struct tlv_handler_ctx *ctx = req->data;
 	struct tlv_packet *p;
 	char *path = tlv_packet_get_str(ctx->req, TLV_TYPE_DIRECTORY_PATH);
 	if (path == NULL) {
@@ -80,6 +241,15 @@ fs_ls_async(eio_req *req)
 		goto out;
 	}
 
+	/*
+	 * Plain directories are read directly; glob is left for wildcards and
+	 * home directory expansion
+	 */
+	if (strchr(path, '*') == NULL && path[0] != '~') {
+		p = fs_ls_dir(ctx, path);
+		goto out;
+	}
+
 	// If there is no wildcard, add one in order to list the directory
 	char search_path[PATH_MAX];
 	if (strchr(path, '*') == NULL) {
@@ -100,7 +270,7 @@ fs_ls_async(eio_req *req)
 	if (ret != 0) {
 		p = tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
 	} else {
-		p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+		p = tlv_packet_response(ctx);
 		for(size_t i = 0; i < glob_result.gl_pathc; ++i) {
 			char *name = glob_result.gl_pathv[i];
 			p = tlv_packet_add_str(p, TLV_TYPE_FILE_PATH, name);
@@ -109,20 +279,14 @@ fs_ls_async(eio_req *req)
 				p = add_stat(p, &buf);
 			}
 			p = tlv_packet_add_str(p, TLV_TYPE_FILE_NAME, basename(name));
+			p = tlv_packet_response_continue(ctx, p);
 		}
+		p = tlv_packet_add_result(p, TLV_RESULT_SUCCESS);
 	}
 
 	globfree(&glob_result);
 out:
-
-	tlv_dispatcher_enqueue_response(ctx->td, p);
-	tlv_handler_ctx_free(ctx);
-}
-
-struct tlv_packet *fs_ls(struct tlv_handler_ctx *ctx)
-{
-	eio_custom(fs_ls_async, 0, NULL, ctx);
-	return NULL;
+	return p;
 }
 
 #else
@@ -138,7 +302,7 @@ fs_ls_cb(eio_req *req)
 		p = tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
 	} else {
 		const char *path = tlv_packet_get_str(ctx->req, TLV_TYPE_DIRECTORY_PATH);
-		p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+		p = tlv_packet_response(ctx);
 		struct eio_dirent *ents = (struct eio_dirent *)req->ptr1;
 		char *names = (char *)req->ptr2;
 
@@ -156,7 +320,9 @@ fs_ls_cb(eio_req *req)
 				p = add_stat(p, &buf);
 #endif
 			}
+			p = tlv_packet_response_continue(ctx, p);
 		}
+		p = tlv_packet_add_result(p, TLV_RESULT_SUCCESS);
 	}
 
 	tlv_dispatcher_enqueue_response(ctx->td, p);
@@ -181,33 +347,223 @@ struct tlv_packet *fs_ls(struct tlv_handler_ctx *ctx)
 }
 #endif
 
-static int
-fs_stat_cb(eio_req *req)
+static void
+fs_stat_done(struct tlv_handler_ctx *ctx, EIO_STRUCT_STAT *st)
 {
-	struct tlv_handler_ctx *ctx = req->data;
 	struct tlv_packet *p;
 
-	if (req->result < 0) {
+	if (st == NULL) {
 		p = tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
 	} else {
 		p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
-		p = add_stat(p, (EIO_STRUCT_STAT *)req->ptr2);
+		p = add_stat(p, st);
 	}
 
 	tlv_dispatcher_enqueue_response(ctx->td, p);
 	tlv_handler_ctx_free(ctx);
+}
+
+static int
+fs_stat_cb(eio_req *req)
+{
+	fs_stat_done(req->data, req->result < 0 ? NULL : (EIO_STRUCT_STAT *)req->ptr2);
+	return 0;
+}
+
+#ifndef _WIN32
+struct fs_stat_uring {
+	struct tlv_handler_ctx *ctx;
+	struct stat st;
+};
+
+static void
+fs_stat_uring_cb(int res, void *arg)
+{
+	struct fs_stat_uring *s = arg;
+	// 's' lives in the ctx arena, so goes with it
+	fs_stat_done(s->ctx, res < 0 ? NULL : &s->st);
+}
+#endif
+
+/*
+ * A request with several paths has them stat'ed in parallel, up to
+ * FS_STAT_BATCH_INFLIGHT at a time, and gets a TLV_TYPE_STAT_RESULT group
+ * for each in the order they finish, holding the path, its own result and,
+ * on success, its stat buffer
+ */
+#define FS_STAT_BATCH_INFLIGHT 32
+
+struct fs_stat_batch {
+	struct tlv_handler_ctx *ctx;
+	struct tlv_iterator paths;
+	struct tlv_packet *p;
+#ifndef _WIN32
+	struct uring *uring;
+#endif
+	unsigned inflight;
+	bool queued;
+};
+
+struct fs_stat_item {
+	struct fs_stat_batch *b;
+	const char *path;
+	struct stat st;
+};
+
+static void fs_stat_batch_run(struct fs_stat_batch *b);
+
+static void
+fs_stat_batch_add(struct fs_stat_batch *b, const char *path, int rc,
+	EIO_STRUCT_STAT *st)
+{
+	if (b->p == NULL) {
+		return;
+	}
+	struct tlv_packet *g = tlv_packet_new(TLV_TYPE_STAT_RESULT, 0);
+	g = tlv_packet_add_str(g, TLV_TYPE_FILE_PATH, path);
+	g = tlv_packet_add_result(g, rc);
+	if (st) {
+		g = add_stat(g, st);
+	}
+	if (g) {
+		b->p = tlv_packet_add_child(b->p, g);
+		b->p = tlv_packet_response_continue(b->ctx, b->p);
+	}
+}
+
+static void
+fs_stat_item_done(struct fs_stat_item *s, int rc, EIO_STRUCT_STAT *st)
+{
+	struct fs_stat_batch *b = s->b;
+	fs_stat_batch_add(b, s->path, rc, st);
+	free(s);
+	b->inflight--;
+	fs_stat_batch_run(b);
+}
 
+static int
+fs_stat_item_cb(eio_req *req)
+{
+	fs_stat_item_done(req->data, req->result < 0 ? req->errorno : 0,
+		req->result < 0 ? NULL : (EIO_STRUCT_STAT *)req->ptr2);
 	return 0;
 }
 
+#ifndef _WIN32
+static void
+fs_stat_item_uring_cb(int res, void *arg)
+{
+	struct fs_stat_item *s = arg;
+	fs_stat_item_done(s, res < 0 ? -res : 0, res < 0 ? NULL : &s->st);
+}
+#endif
+
+static void
+fs_stat_batch_run(struct fs_stat_batch *b)
+{
+	while (!b->queued && b->inflight < FS_STAT_BATCH_INFLIGHT) {
+		size_t len;
+		void *val = tlv_packet_iterate(&b->paths, &len);
+		if (val == NULL) {
+			b->queued = true;
+			break;
+		}
+		const char *path = tlv_packet_get_buf_str(val, len);
+		if (path == NULL) {
+			fs_stat_batch_add(b, "", TLV_RESULT_EINVAL, NULL);
+			continue;
+		}
+
+		struct fs_stat_item *s = calloc(1, sizeof(*s));
+		if (s == NULL) {
+			fs_stat_batch_add(b, path, ENOMEM, NULL);
+			continue;
+		}
+		s->b = b;
+		s->path = path;
+		b->inflight++;
+#ifndef _WIN32
+		if (b->uring && uring_stat(b->uring, path, &s->st,
+				fs_stat_item_uring_cb, s) == 0) {
+			continue;
+		}
+#endif
+		if (eio_stat(path, 0, fs_stat_item_cb, s) == NULL) {
+			b->inflight--;
+			fs_stat_batch_add(b, path, errno, NULL);
+			free(s);
+		}
+	}
+
+	if (b->queued && b->inflight == 0) {
+		struct tlv_handler_ctx *ctx = b->ctx;
+		struct tlv_packet *p = tlv_packet_add_result(b->p, TLV_RESULT_SUCCESS);
+		if (p) {
+			tlv_dispatcher_enqueue_response(ctx->td, p);
+		}
+		// 'b' lives in the ctx arena, so goes with it
+		tlv_handler_ctx_free(ctx);
+	}
+}
+
+static struct tlv_packet *
+fs_stat_batch(struct tlv_handler_ctx *ctx)
+{
+	struct fs_stat_batch *b = tlv_handler_ctx_alloc(ctx, sizeof(*b));
+	if (b == NULL) {
+		return tlv_packet_response_result(ctx, ENOMEM);
+	}
+	b->ctx = ctx;
+	b->paths.packet = ctx->req;
+	b->paths.value_type = TLV_TYPE_FILE_PATH;
+#ifndef _WIN32
+	b->uring = mettle_get_uring(ctx->arg);
+#endif
+	b->p = tlv_packet_response(ctx);
+	if (b->p == NULL) {
+		return tlv_packet_response_result(ctx, ENOMEM);
+	}
+	fs_stat_batch_run(b);
+	return NULL;
+}
+
+static bool
+fs_stat_has_several_paths(struct tlv_packet *req)
+{
+	struct tlv_iterator i = {
+		.packet = req,
+		.value_type = TLV_TYPE_FILE_PATH,
+	};
+	size_t len;
+	return tlv_packet_iterate(&i, &len) && tlv_packet_iterate(&i, &len);
+}
+
 struct tlv_packet *
 fs_stat(struct tlv_handler_ctx *ctx)
 {
+	struct mettle *m = ctx->arg;
+	if (fs_stat_has_several_paths(ctx->req)) {
+		return fs_stat_batch(ctx);
+	}
+
 	const char *path = tlv_packet_get_str(ctx->req, TLV_TYPE_FILE_PATH);
 	if (path == NULL) {
 		return tlv_packet_response_result(ctx, TLV_RESULT_EINVAL);
 	}
 
+#ifndef _WIN32
+	struct uring *u = mettle_get_uring(m);
+	if (u) {
+		struct fs_stat_uring *s = tlv_handler_ctx_alloc(ctx, sizeof(*s));
+		if (s) {
+			s->ctx = ctx;
+			if (uring_stat(u, path, &s->st, fs_stat_uring_cb, s) == 0) {
+				return NULL;
+			}
+		}
+	}
+#endif
+
 	eio_stat(path, 0, fs_stat_cb, ctx);
 	return NULL;
 }
@@ -290,58 +646,207 @@ struct tlv_packet *fs_file_move(struct tlv_handler_ctx *ctx)
 	return NULL;
 }
 
-static void
-fs_file_copy_async(struct eio_req *req)
+#ifdef METTLE_LOW_MEMORY
+#define COPY_BUF_LEN (64 * 1024)
+#else
+#define COPY_BUF_LEN (1024 * 1024)
+#endif
+#define COPY_CHUNK_LEN (16 * 1024 * 1024)
+#define COPY_PROGRESS_SECS 5
+
+enum copy_method {
+	COPY_FILE_RANGE,
+	COPY_SENDFILE,
+	COPY_BUFFER,
+};
+
+/*
+ * Copies up to 'len' bytes at 'off' with the best method that still works,
+ * stepping down to the next one when the kernel or filesystem refuses
+ */
+static ssize_t
+copy_chunk(int in, int out, off_t off, size_t len, enum copy_method *method, char **buf)
 {
-	struct tlv_handler_ctx *ctx = req->data;
-	struct tlv_packet *p;
-	int rc = TLV_RESULT_SUCCESS;
-	const char *src = tlv_packet_get_str(ctx->req, TLV_TYPE_FILE_NAME);
-	const char *dst = tlv_packet_get_str(ctx->req, TLV_TYPE_FILE_PATH);
-
-	if (src == NULL || dst == NULL) {
-		rc = EINVAL;
-		goto out;
+#ifdef HAVE_COPY_FILE_RANGE
+	if (*method == COPY_FILE_RANGE) {
+		off_t in_off = off, out_off = off;
+		ssize_t n = copy_file_range(in, &in_off, out, &out_off, len, 0);
+		if (n != -1 || (errno != EXDEV && errno != EINVAL
+				&& errno != ENOSYS && errno != EOPNOTSUPP)) {
+			return n;
+		}
+		*method = COPY_SENDFILE;
 	}
-
-	FILE* f1 = fopen(src, "rb");
-	if (f1 == NULL) {
-		rc = EINVAL;
-		goto out;
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+	if (*method <= COPY_SENDFILE) {
+		off_t in_off = off;
+		if (lseek(out, off, SEEK_SET) == -1) {
+			return -1;
+		}
+		ssize_t n = sendfile(out, in, &in_off, len);
+		if (n != -1 || (errno != EINVAL && errno != ENOSYS)) {
+			return n;
+		}
 	}
+#endif
+	*method = COPY_BUFFER;
 
-	FILE* f2 = fopen(dst, "wb");
-	if (f2 == NULL) {
-		fclose(f1);
-		rc = EINVAL;
-		goto out;
+	if (*buf == NULL && posix_memalign((void **)buf, 4096, COPY_BUF_LEN)) {
+		*buf = NULL;
+		errno = ENOMEM;
+		return -1;
+	}
+	ssize_t n = pread(in, *buf, TYPESAFE_MIN(len, COPY_BUF_LEN), off);
+	for (ssize_t done = 0; done < n; ) {
+		ssize_t w = pwrite(out, *buf + done, n - done, off + done);
+		if (w == -1) {
+			return -1;
+		}
+		done += w;
 	}
+	return n;
+}
 
-	char buffer[4096];
-	size_t n;
-	while ((n = fread(buffer, sizeof(char), sizeof(buffer), f1)) > 0)
-	{
-		if (fwrite(buffer, sizeof(char), n, f2) != n) {
-			fclose(f1);
-			fclose(f2);
-			rc = EINVAL;
-			goto out;
+/*
+ * Copies only the data regions of 'in', so holes stay holes, then sizes the
+ * copy to match
+ */
+static int
+copy_file_data(struct tlv_handler_ctx *ctx, int in, int out, off_t size, const char *src)
+{
+	enum copy_method method = COPY_FILE_RANGE;
+	char *buf = NULL;
+	uint64_t copied = 0;
+	time_t last_report = time(NULL);
+	off_t off = 0;
+	int rc = 0;
+
+	while (off < size) {
+		off_t data = off, hole = size;
+#ifdef SEEK_DATA
+		data = lseek(in, off, SEEK_DATA);
+		if (data == -1 && errno == ENXIO) {
+			break;
+		} else if (data == -1) {
+			data = off;
+		} else {
+			hole = lseek(in, data, SEEK_HOLE);
+			if (hole == -1) {
+				hole = size;
+			}
+		}
+#endif
+		while (data < hole) {
+			if (tlv_handler_ctx_cancelled(ctx)) {
+				errno = ECANCELED;
+				rc = -1;
+				goto out;
+			}
+			ssize_t n = copy_chunk(in, out, data,
+				TYPESAFE_MIN(hole - data, COPY_CHUNK_LEN), &method, &buf);
+			if (n == -1) {
+				rc = -1;
+				goto out;
+			}
+			if (n == 0) {
+				goto out;
+			}
+			data += n;
+			copied += n;
+
+			time_t now = time(NULL);
+			if (now - last_report >= COPY_PROGRESS_SECS) {
+				log_info("copying %s: %" PRIu64 " of %" PRIu64 " bytes",
+					src, copied, (uint64_t)size);
+				last_report = now;
+			}
 		}
+		off = hole;
 	}
 
-	fclose(f1);
-	fclose(f2);
+	if (ftruncate(out, size) == -1) {
+		rc = -1;
+	}
 
 out:
-	p = tlv_packet_response_result(ctx, rc);
-	tlv_dispatcher_enqueue_response(ctx->td, p);
-	tlv_handler_ctx_free(ctx);
+	free(buf);
+	return rc;
+}
+
+/*
+ * Copies the open file 'in', named 'src', into 'out' from its current
+ * offset, closing 'out' and returning 0 or an errno
+ */
+static int
+copy_fd(struct tlv_handler_ctx *ctx, int in, int out, const char *src)
+{
+	int rc = 0;
+	struct stat st;
+
+	/*
+	 * Filesystems that can share extents copy without moving any data
+	 */
+#ifdef FICLONE
+	if (ioctl(out, FICLONE, in) == 0) {
+		goto done;
+	}
+#endif
+
+	if (fstat(in, &st) == -1 || copy_file_data(ctx, in, out, st.st_size, src) == -1) {
+		rc = errno ? errno : EINVAL;
+	}
+
+#ifdef FICLONE
+done:
+#endif
+	if (close(out) == -1 && rc == 0) {
+		rc = errno;
+	}
+	return rc;
+}
+
+/*
+ * Copies 'src' to a new or truncated 'dst', returning 0 or an errno
+ */
+static int
+copy_file(struct tlv_handler_ctx *ctx, const char *src, const char *dst, mode_t mode)
+{
+	int in = open(src, O_RDONLY);
+	if (in == -1) {
+		return EINVAL;
+	}
+
+	int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, mode);
+	if (out == -1) {
+		close(in);
+		return EINVAL;
+	}
+
+	int rc = copy_fd(ctx, in, out, src);
+	close(in);
+	return rc;
 }
 
+struct fs_file_copy_req {
+	const char *src;
+	const char *dst;
+};
+
+static const struct tlv_field fs_file_copy_schema[] = {
+	TLV_FIELD_REQUIRED(TLV_TYPE_FILE_NAME, TLV_FIELD_STR, struct fs_file_copy_req, src),
+	TLV_FIELD_REQUIRED(TLV_TYPE_FILE_PATH, TLV_FIELD_STR, struct fs_file_copy_req, dst),
+};
+
 struct tlv_packet *fs_file_copy(struct tlv_handler_ctx *ctx)
 {
-	eio_custom(fs_file_copy_async, 0, NULL, ctx);
-	return NULL;
+	struct fs_file_copy_req req;
+	if (tlv_packet_decode(ctx->req, fs_file_copy_schema,
+			COUNT_OF(fs_file_copy_schema), &req) == -1) {
+		return tlv_packet_response_result(ctx, EINVAL);
+	}
+
+	return tlv_packet_response_result(ctx, copy_file(ctx, req.src, req.dst, 0666));
 }
 
 struct tlv_packet *fs_chmod(struct tlv_handler_ctx *ctx)
@@ -384,167 +889,1972 @@ struct tlv_packet *fs_chdir(struct tlv_handler_ctx *ctx)
 	return tlv_packet_response_result(ctx, rc);
 }
 
+#define FS_HASH_MD5    (1 << 0)
+#define FS_HASH_SHA1   (1 << 1)
+#define FS_HASH_SHA256 (1 << 2)
+#define FS_HASH_ALL    (FS_HASH_MD5 | FS_HASH_SHA1 | FS_HASH_SHA256)
+
+#define FS_HASH_READ_LEN (256 * 1024)
+
+struct file_hash {
+	struct tlv_handler_ctx *ctx;
+	struct fs_hash_job *job;
+	const char *path;
+	uint32_t algs;
+	int rc;
+	unsigned char md5[MD5_DIGEST_LENGTH];
+	unsigned char sha1[SHA1_DIGEST_LENGTH];
+	unsigned char sha256[SHA256_DIGEST_LENGTH];
+};
+
+/*
+ * Computes every digest asked for in a single pass over the open file
+ */
 static void
-fs_md5_async(struct eio_req *req)
+hash_fd(struct file_hash *h, int fd)
 {
-	struct tlv_handler_ctx *ctx = req->data;
-	struct tlv_packet *p;
-	const char *path = tlv_packet_get_str(ctx->req, TLV_TYPE_FILE_PATH);
-	int rc = 0;
-	unsigned char digest[16] = {0};
-	if (path == NULL) {
-		rc = EINVAL;
-		goto out;
-	}
+	MD5_CTX md5;
+	SHA1_CTX sha1;
+	SHA2_CTX sha256;
+	unsigned char *buf = NULL;
+	ssize_t buf_len;
 
-	FILE *f = fopen(path, "rb");
-	if (f == NULL) {
-		rc = errno;
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	buf = malloc(FS_HASH_READ_LEN);
+	if (buf == NULL) {
+		h->rc = ENOMEM;
 		goto out;
 	}
 
-	MD5_CTX md5;
 	MD5Init(&md5);
-	unsigned char buf[8096];
-	size_t buf_len = 0;
-	while ((buf_len = fread(buf, 1, sizeof(buf), f)) > 0) {
-		MD5Update(&md5, buf, buf_len);
+	SHA1Init(&sha1);
+	SHA256Init(&sha256);
+	while ((buf_len = read(fd, buf, FS_HASH_READ_LEN)) > 0) {
+		if (tlv_handler_ctx_cancelled(h->ctx)) {
+			h->rc = ECANCELED;
+			goto out;
+		}
+		if (h->algs & FS_HASH_MD5) {
+			MD5Update(&md5, buf, buf_len);
+		}
+		if (h->algs & FS_HASH_SHA1) {
+			SHA1Update(&sha1, buf, buf_len);
+		}
+		if (h->algs & FS_HASH_SHA256) {
+			SHA256Update(&sha256, buf, buf_len);
+		}
 	}
-	MD5Final(digest, &md5);
-
-	fclose(f);
+	if (buf_len == -1) {
+		h->rc = errno;
+		goto out;
+	}
+	MD5Final(h->md5, &md5);
+	SHA1Final(h->sha1, &sha1);
+	SHA256Final(h->sha256, &sha256);
+	h->rc = 0;
 
 out:
-	p = tlv_packet_response_result(ctx, rc);
-	if (rc == 0) {
-		p = tlv_packet_add_raw(p, TLV_TYPE_FILE_HASH, digest, sizeof(digest));
+	free(buf);
+}
+
+static void
+hash_file(struct file_hash *h)
+{
+	int fd = open(h->path, O_RDONLY);
+	if (fd == -1) {
+		h->rc = errno;
+		return;
 	}
-	tlv_dispatcher_enqueue_response(ctx->td, p);
-	tlv_handler_ctx_free(ctx);
+	hash_fd(h, fd);
+	close(fd);
 }
 
 struct tlv_packet *fs_md5(struct tlv_handler_ctx *ctx)
 {
-	eio_custom(fs_md5_async, 0, NULL, ctx);
+	struct tlv_packet *p;
+	struct file_hash h = {
+		.ctx = ctx,
+		.path = tlv_packet_get_str(ctx->req, TLV_TYPE_FILE_PATH),
+		.algs = FS_HASH_MD5,
+		.rc = EINVAL,
+	};
+
+	if (h.path) {
+		hash_file(&h);
+	}
+
+	p = tlv_packet_response_result(ctx, h.rc);
+	if (h.rc == 0) {
+		p = tlv_packet_add_raw(p, TLV_TYPE_FILE_HASH, h.md5, sizeof(h.md5));
+	}
+	return p;
+}
+
+struct tlv_packet *fs_sha1(struct tlv_handler_ctx *ctx)
+{
+	struct tlv_packet *p;
+	struct file_hash h = {
+		.ctx = ctx,
+		.path = tlv_packet_get_str(ctx->req, TLV_TYPE_FILE_PATH),
+		.algs = FS_HASH_SHA1,
+		.rc = EINVAL,
+	};
+
+	if (h.path) {
+		hash_file(&h);
+	}
+
+	p = tlv_packet_response_result(ctx, h.rc);
+	if (h.rc == 0) {
+		p = tlv_packet_add_raw(p, TLV_TYPE_FILE_HASH, h.sha1, sizeof(h.sha1));
+	}
+	return p;
+}
+
+/*
+ * Content store for files uploaded again and again, such as tools. Files
+ * are kept by SHA-256 under TLV_TYPE_DIRECTORY_PATH, or FS_STORE_DIR in
+ * the temporary directory.
+ */
+#define FS_STORE_DIR ".mettle-store"
+
+static int
+store_path(struct tlv_handler_ctx *ctx, const unsigned char *hash,
+	char *dir, char *path, size_t len)
+{
+	const char *store = tlv_packet_get_str(ctx->req, TLV_TYPE_DIRECTORY_PATH);
+	int n;
+	if (store) {
+		n = snprintf(dir, len, "%s", store);
+	} else {
+		const char *tmp = getenv("TMPDIR");
+		n = snprintf(dir, len, "%s/%s", tmp ? tmp : "/tmp", FS_STORE_DIR);
+	}
+	if (n < 0 || n >= len) {
+		return -1;
+	}
+
+	char hex[SHA256_DIGEST_LENGTH * 2 + 1];
+	for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+		snprintf(hex + i * 2, 3, "%02x", hash[i]);
+	}
+	n = snprintf(path, len, "%s/%s", dir, hex);
+	return n < 0 || n >= len ? -1 : 0;
+}
+
+/*
+ * The store usually lives in a shared temporary directory, so it is only
+ * trusted when it is a real directory of ours that nobody else can touch
+ */
+static int
+store_dir_check(const char *dir)
+{
+#ifndef _WIN32
+	struct stat st;
+	if (lstat(dir, &st) == -1) {
+		return errno;
+	}
+	if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 077)) {
+		log_error("ignoring content store '%s', it is not private", dir);
+		return EPERM;
+	}
+#endif
+	return 0;
+}
+
+/*
+ * Adds a file already on the target, once its hash checks out, so later
+ * uploads of the same content are copies
+ */
+static int
+store_add(struct tlv_handler_ctx *ctx, const char *src, const unsigned char *hash,
+	const char *dir, const char *path)
+{
+	struct file_hash h = {
+		.ctx = ctx,
+		.path = src,
+		.algs = FS_HASH_SHA256,
+	};
+	hash_file(&h);
+	if (h.rc != 0) {
+		return h.rc;
+	}
+	if (memcmp(h.sha256, hash, SHA256_DIGEST_LENGTH) != 0) {
+		return EINVAL;
+	}
+
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+		return errno;
+	}
+	int rc = store_dir_check(dir);
+	if (rc != 0) {
+		return rc;
+	}
+
+	/*
+	 * Renamed into place, so a half-written copy is never found
+	 */
+	char tmp[PATH_MAX];
+	int n = snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	if (n < 0 || n >= sizeof(tmp)) {
+		return ENAMETOOLONG;
+	}
+	int in = open(src, O_RDONLY);
+	if (in == -1) {
+		return errno;
+	}
+	int out = mkstemp(tmp);
+	if (out == -1) {
+		rc = errno;
+		close(in);
+		return rc;
+	}
+	rc = copy_fd(ctx, in, out, src);
+	close(in);
+	if (rc == 0 && rename(tmp, path) == -1) {
+		rc = errno;
+	}
+	if (rc != 0) {
+		unlink(tmp);
+	}
+	return rc;
+}
+
+/*
+ * Copies the stored file to 'dst' if it still has the hash it is stored
+ * under, evicting it when it does not
+ */
+static int
+store_get(struct tlv_handler_ctx *ctx, const unsigned char *hash,
+	const char *dir, const char *path, const char *dst)
+{
+	int rc = store_dir_check(dir);
+	if (rc != 0) {
+		return rc;
+	}
+
+#ifdef O_NOFOLLOW
+	int in = open(path, O_RDONLY | O_NOFOLLOW);
+#else
+	int in = open(path, O_RDONLY);
+#endif
+	if (in == -1) {
+		return errno;
+	}
+
+	struct file_hash h = {
+		.ctx = ctx,
+		.path = path,
+		.algs = FS_HASH_SHA256,
+	};
+	hash_fd(&h, in);
+	rc = h.rc;
+	if (rc == 0 && memcmp(h.sha256, hash, SHA256_DIGEST_LENGTH) != 0) {
+		log_error("evicting '%s' from the content store, its hash changed", path);
+		unlink(path);
+		rc = ENOENT;
+	}
+	if (rc == 0 && lseek(in, 0, SEEK_SET) == -1) {
+		rc = errno;
+	}
+	if (rc == 0) {
+		int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		rc = out == -1 ? EINVAL : copy_fd(ctx, in, out, path);
+	}
+	close(in);
+	return rc;
+}
+
+/*
+ * With TLV_TYPE_FILE_PATH, materializes the stored file with the given
+ * hash there, failing with ENOENT when there is none, or it no longer has
+ * that hash, so the file is uploaded instead. With TLV_TYPE_FILE_NAME,
+ * stores that file.
+ */
+struct tlv_packet *fs_put_by_hash(struct tlv_handler_ctx *ctx)
+{
+	size_t hash_len;
+	const unsigned char *hash = tlv_packet_get_raw(ctx->req,
+		TLV_TYPE_FILE_HASH_SHA256, &hash_len);
+	const char *src = tlv_packet_get_str(ctx->req, TLV_TYPE_FILE_NAME);
+	const char *dst = tlv_packet_get_str(ctx->req, TLV_TYPE_FILE_PATH);
+	char dir[PATH_MAX], path[PATH_MAX];
+	int rc;
+
+	if (hash == NULL || hash_len != SHA256_DIGEST_LENGTH || (src == NULL) == (dst == NULL)
+			|| store_path(ctx, hash, dir, path, sizeof(path)) == -1) {
+		return tlv_packet_response_result(ctx, EINVAL);
+	}
+
+	if (src) {
+		rc = store_add(ctx, src, hash, dir, path);
+	} else {
+		rc = store_get(ctx, hash, dir, path, dst);
+	}
+	return tlv_packet_response_result(ctx, rc);
+}
+
+/*
+ * A stdapi_fs_hash request hashes each of its paths as a separate eio
+ * request, so files are hashed in parallel, and answers once all are done
+ */
+struct fs_hash_job {
+	struct tlv_handler_ctx *ctx;
+	size_t count, remaining;
+	struct file_hash files[];
+};
+
+static void
+fs_hash_file_async(struct eio_req *req)
+{
+	hash_file(req->data);
+}
+
+static void
+fs_hash_respond(struct fs_hash_job *job)
+{
+	struct tlv_handler_ctx *ctx = job->ctx;
+	struct tlv_packet *p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+
+	for (size_t i = 0; i < job->count; i++) {
+		struct file_hash *h = &job->files[i];
+		struct tlv_packet *g = tlv_packet_new(TLV_TYPE_FILE_HASH_GROUP, 0);
+		g = tlv_packet_add_str(g, TLV_TYPE_FILE_PATH, h->path);
+		g = tlv_packet_add_result(g, h->rc);
+		if (h->rc == 0 && (h->algs & FS_HASH_MD5)) {
+			g = tlv_packet_add_raw(g, TLV_TYPE_FILE_HASH_MD5, h->md5, sizeof(h->md5));
+		}
+		if (h->rc == 0 && (h->algs & FS_HASH_SHA1)) {
+			g = tlv_packet_add_raw(g, TLV_TYPE_FILE_HASH_SHA1, h->sha1, sizeof(h->sha1));
+		}
+		if (h->rc == 0 && (h->algs & FS_HASH_SHA256)) {
+			g = tlv_packet_add_raw(g, TLV_TYPE_FILE_HASH_SHA256, h->sha256, sizeof(h->sha256));
+		}
+		p = tlv_packet_add_child(p, g);
+	}
+
+	tlv_dispatcher_enqueue_response(ctx->td, p);
+	tlv_handler_ctx_free(ctx);
+	free(job);
+}
+
+static int
+fs_hash_file_cb(eio_req *req)
+{
+	struct file_hash *h = req->data;
+	struct fs_hash_job *job = h->job;
+	if (--job->remaining == 0) {
+		fs_hash_respond(job);
+	}
+	return 0;
+}
+
+struct tlv_packet *fs_hash(struct tlv_handler_ctx *ctx)
+{
+	uint32_t algs = FS_HASH_ALL;
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_FILE_HASH_TYPE, &algs);
+	algs &= FS_HASH_ALL;
+	if (algs == 0) {
+		return tlv_packet_response_result(ctx, EINVAL);
+	}
+
+	size_t count = 0;
+	struct tlv_iterator i = {
+		.packet = ctx->req,
+		.value_type = TLV_TYPE_FILE_PATH,
+	};
+	while (tlv_packet_iterate_str(&i)) {
+		count++;
+	}
+	if (count == 0) {
+		return tlv_packet_response_result(ctx, EINVAL);
+	}
+
+	struct fs_hash_job *job = calloc(1, sizeof(*job) + count * sizeof(job->files[0]));
+	if (job == NULL) {
+		return tlv_packet_response_result(ctx, ENOMEM);
+	}
+	job->ctx = ctx;
+	job->count = count;
+
+	i = (struct tlv_iterator) {
+		.packet = ctx->req,
+		.value_type = TLV_TYPE_FILE_PATH,
+	};
+	for (size_t n = 0; n < count; n++) {
+		struct file_hash *h = &job->files[n];
+		h->ctx = ctx;
+		h->job = job;
+		h->path = tlv_packet_iterate_str(&i);
+		h->algs = algs;
+		h->rc = EIO;
+	}
+
+	/*
+	 * Queued below normal priority so a large sweep does not hold up
+	 * other filesystem requests
+	 */
+	job->remaining = count;
+	for (size_t n = 0; n < count; n++) {
+		if (eio_custom(fs_hash_file_async, EIO_PRI_MIN, fs_hash_file_cb, &job->files[n]) == NULL
+				&& --job->remaining == 0) {
+			fs_hash_respond(job);
+			break;
+		}
+	}
 	return NULL;
 }
 
+/*
+ * Block signatures for resuming and patching transfers, as rsync uses them:
+ * a weak rolling checksum that can be slid along a file a byte at a time,
+ * and a strong digest to confirm a weak match. The client compares them
+ * against its own copy and moves only the blocks that differ, seeking the
+ * file channel to each.
+ */
+#define FS_BLOCK_SIZE_DEFAULT (1024 * 1024)
+#define FS_BLOCK_SIZE_MIN 512
+#define FS_BLOCK_SIZE_MAX (16 * 1024 * 1024)
+
+static uint32_t
+rolling_checksum(const unsigned char *buf, size_t len)
+{
+	uint32_t a = 0, b = 0;
+	for (size_t i = 0; i < len; i++) {
+		a += buf[i];
+		b += (len - i) * buf[i];
+	}
+	return (a & 0xffff) | (b << 16);
+}
+
 static void
-fs_sha1_async(struct eio_req *req)
+fs_block_hashes_async(struct eio_req *req)
 {
 	struct tlv_handler_ctx *ctx = req->data;
-	struct tlv_packet *p;
 	const char *path = tlv_packet_get_str(ctx->req, TLV_TYPE_FILE_PATH);
-	int rc = 0;
-	unsigned char digest[20] = {0};
-	if (path == NULL) {
-		rc = EINVAL;
+	uint32_t block_size = FS_BLOCK_SIZE_DEFAULT;
+	uint32_t algs = FS_HASH_MD5;
+	uint32_t max_blocks = 0;
+	uint64_t offset = 0;
+	unsigned char *buf = NULL;
+	struct tlv_packet *p = NULL;
+	int fd = -1;
+	int rc = EINVAL;
+
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_FILE_BLOCK_SIZE, &block_size);
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_FILE_HASH_TYPE, &algs);
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_FILE_BLOCK_COUNT, &max_blocks);
+	tlv_packet_get_u64(ctx->req, TLV_TYPE_FILE_BLOCK_OFFSET, &offset);
+	if (path == NULL || block_size < FS_BLOCK_SIZE_MIN || block_size > FS_BLOCK_SIZE_MAX
+			|| (algs != FS_HASH_MD5 && algs != FS_HASH_SHA1)) {
 		goto out;
 	}
+	offset -= offset % block_size;
 
-	FILE *f = fopen(path, "rb");
-	if (f == NULL) {
+	fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
 		rc = errno;
 		goto out;
 	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
-	SHA1_CTX sha1;
-	SHA1Init(&sha1);
-	unsigned char buf[8096];
-	size_t buf_len = 0;
-	while ((buf_len = fread(buf, 1, sizeof(buf), f)) > 0) {
-		SHA1Update(&sha1, buf, buf_len);
+	buf = malloc(block_size);
+	if (buf == NULL) {
+		rc = ENOMEM;
+		goto out;
 	}
-	SHA1Final(digest, &sha1);
 
-	fclose(f);
+	p = tlv_packet_response(ctx);
+	p = tlv_packet_add_u64(p, TLV_TYPE_FILE_TOTAL_SIZE, st.st_size);
+	p = tlv_packet_add_u32(p, TLV_TYPE_FILE_BLOCK_SIZE, block_size);
+	p = tlv_packet_add_u64(p, TLV_TYPE_FILE_BLOCK_OFFSET, offset);
+
+	/*
+	 * Each block is its weak checksum, big endian, then its digest. The
+	 * last block may be short; its length follows from the file size.
+	 */
+	for (uint32_t n = 0; p && (max_blocks == 0 || n < max_blocks); n++) {
+		ssize_t len = pread(fd, buf, block_size, offset);
+		if (len <= 0) {
+			if (len == -1) {
+				rc = errno;
+				goto out;
+			}
+			break;
+		}
+
+		unsigned char sig[4 + SHA1_DIGEST_LENGTH];
+		uint32_t weak = htonl(rolling_checksum(buf, len));
+		memcpy(sig, &weak, sizeof(weak));
+		size_t sig_len = sizeof(weak);
+		if (algs == FS_HASH_MD5) {
+			MD5_CTX md5;
+			MD5Init(&md5);
+			MD5Update(&md5, buf, len);
+			MD5Final(sig + sig_len, &md5);
+			sig_len += MD5_DIGEST_LENGTH;
+		} else {
+			SHA1_CTX sha1;
+			SHA1Init(&sha1);
+			SHA1Update(&sha1, buf, len);
+			SHA1Final(sig + sig_len, &sha1);
+			sig_len += SHA1_DIGEST_LENGTH;
+		}
+		p = tlv_packet_add_raw(p, TLV_TYPE_FILE_BLOCK_HASH, sig, sig_len);
+		p = tlv_packet_response_continue(ctx, p);
+		offset += len;
+	}
+	rc = p ? TLV_RESULT_SUCCESS : ENOMEM;
 
 out:
-	p = tlv_packet_response_result(ctx, rc);
-	if (rc == 0) {
-		p = tlv_packet_add_raw(p, TLV_TYPE_FILE_HASH, digest, sizeof(digest));
+	if (fd != -1) {
+		close(fd);
+	}
+	free(buf);
+	if (rc == TLV_RESULT_SUCCESS) {
+		p = tlv_packet_add_result(p, rc);
+	} else {
+		if (p) {
+			tlv_packet_free(p);
+		}
+		p = tlv_packet_response_result(ctx, rc);
 	}
 	tlv_dispatcher_enqueue_response(ctx->td, p);
 	tlv_handler_ctx_free(ctx);
 }
 
-struct tlv_packet *fs_sha1(struct tlv_handler_ctx *ctx)
+struct tlv_packet *fs_block_hashes(struct tlv_handler_ctx *ctx)
 {
-	eio_custom(fs_sha1_async, 0, NULL, ctx);
+	eio_custom(fs_block_hashes_async, EIO_PRI_MIN, NULL, ctx);
 	return NULL;
 }
 
-int file_new(struct tlv_handler_ctx *ctx, struct channel *c)
+#ifndef _WIN32
+
+/*
+ * stdapi_fs_search walks the tree one directory per eio request. The loop
+ * keeps a stack of directories still to read and hands them to up to
+ * FS_SEARCH_WORKERS requests at once, so whichever worker finishes first
+ * takes the next one and a single deep branch does not serialize the walk.
+ * Workers only touch their own task; matches and subdirectories are merged
+ * back on the loop, so nothing needs locking.
+ */
+#define FS_SEARCH_WORKERS 4
+
+/*
+ * Content searches read files in windows this large, overlapping by enough
+ * to catch matches and context that straddle two windows
+ */
+#define FS_GREP_WINDOW (1024 * 1024)
+#define FS_GREP_MAX_CONTEXT 4096
+
+struct search_dir {
+	char *path;
+	uint32_t depth;
+	struct search_dir *next;
+};
+
+struct fs_search {
+	struct tlv_handler_ctx *ctx;
+	struct tlv_packet *p;
+	const char *glob;
+	uint32_t id;
+	uint32_t max_depth;
+	uint64_t min_size, max_size;
+	uint32_t start_date, end_date;
+	struct matcher *matcher;
+	uint32_t context;
+	uint32_t max_matches;
+	volatile bool cancelled;
+	int rc;
+	unsigned running;
+	struct search_dir *pending;
+	struct fs_search *prev, *next;
+};
+
+struct search_task {
+	struct fs_search *search;
+	struct search_dir *dir;
+	struct search_dir *subdirs;
+	struct tlv_packet *found;
+	unsigned char *buf;
+	int rc;
+};
+
+static struct fs_search *searches;
+
+static void search_dir_free(struct search_dir *d)
+{
+	free(d->path);
+	free(d);
+}
+
+static struct search_dir *search_dir_new(const char *parent, const char *name,
+	uint32_t depth)
 {
-	char *path = tlv_packet_get_str(ctx->req, TLV_TYPE_FILE_PATH);
-	char *mode = tlv_packet_get_str(ctx->req, TLV_TYPE_FILE_MODE);
-	if (mode == NULL) {
-		mode = "rb";
+	struct search_dir *d = calloc(1, sizeof(*d));
+	if (d == NULL) {
+		return NULL;
+	}
+	size_t len = strlen(parent);
+	if (asprintf(&d->path, "%s%s%s", parent,
+			len && parent[len - 1] == '/' ? "" : "/", name) == -1) {
+		free(d);
+		return NULL;
 	}
+	d->depth = depth;
+	return d;
+}
 
-	FILE *f = fopen(path, mode);
-	if (!f) {
-		return -1;
+static bool search_filter(struct fs_search *s, struct stat *st)
+{
+	if (st->st_size < s->min_size || st->st_size > s->max_size) {
+		return false;
 	}
-	channel_set_ctx(c, f);
-	return 0;
+	if (st->st_mtime < s->start_date || (s->end_date && st->st_mtime > s->end_date)) {
+		return false;
+	}
+	return true;
 }
 
-ssize_t file_read(struct channel *c, void *buf, size_t len)
+static void search_add_result(struct search_task *t, const char *name,
+	struct stat *st, uint64_t offset, const void *context, size_t context_len)
 {
-	FILE *f = channel_get_ctx(c);
-	return fread(buf, 1, len, f);
+	if (t->found == NULL) {
+		t->found = tlv_packet_new(0, 0);
+	}
+	struct tlv_packet *g = tlv_packet_new(TLV_TYPE_SEARCH_RESULTS, 0);
+	g = tlv_packet_add_str(g, TLV_TYPE_FILE_PATH, t->dir->path);
+	g = tlv_packet_add_str(g, TLV_TYPE_FILE_NAME, name);
+	g = tlv_packet_add_u32(g, TLV_TYPE_FILE_SIZE, st->st_size);
+	if (context) {
+		g = tlv_packet_add_u64(g, TLV_TYPE_SEARCH_OFFSET, offset);
+		g = tlv_packet_add_raw(g, TLV_TYPE_SEARCH_CONTEXT, context, context_len);
+	}
+	t->found = tlv_packet_add_child(t->found, g);
 }
 
-ssize_t file_write(struct channel *c, void *buf, size_t len)
+struct grep_file {
+	struct search_task *task;
+	const char *name;
+	struct stat *st;
+	uint64_t base;
+	size_t len;
+	uint64_t report_from, report_to;
+	uint32_t matches;
+};
+
+static int grep_match_cb(size_t pattern, size_t offset, size_t len, void *arg)
 {
-	FILE *f = channel_get_ctx(c);
-	return fwrite(buf, 1, len, f);
+	struct grep_file *g = arg;
+	struct fs_search *s = g->task->search;
+
+	uint64_t start = g->base + offset;
+	if (start < g->report_from || start >= g->report_to) {
+		return 0;
+	}
+
+	size_t from = offset > s->context ? offset - s->context : 0;
+	size_t to = TYPESAFE_MIN(offset + len + s->context, g->len);
+	search_add_result(g->task, g->name, g->st, start, g->task->buf + from, to - from);
+	return ++g->matches >= s->max_matches || s->cancelled;
 }
 
-int file_seek(struct channel *c, ssize_t offset, int whence)
+/*
+ * Reads rather than maps the file, since a log truncated under a mapping
+ * would fault the whole process
+ */
+static void grep_file(struct search_task *t, int dir_fd, const char *name,
+	struct stat *st)
 {
-	FILE *f = channel_get_ctx(c);
-	return fseek(f, offset, whence);
+	struct fs_search *s = t->search;
+	if (t->buf == NULL && (t->buf = malloc(FS_GREP_WINDOW)) == NULL) {
+		return;
+	}
+
+	int fd = openat(dir_fd, name, O_RDONLY | O_NONBLOCK);
+	if (fd == -1) {
+		return;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	struct grep_file g = {
+		.task = t,
+		.name = name,
+		.st = st,
+	};
+	size_t max_len = matcher_max_len(s->matcher);
+	size_t overlap = max_len + s->context;
+
+	while (!s->cancelled && g.matches < s->max_matches) {
+		g.base = g.report_from > overlap ? g.report_from - overlap : 0;
+		ssize_t len = pread(fd, t->buf, FS_GREP_WINDOW, g.base);
+		if (len <= 0) {
+			break;
+		}
+		g.len = len;
+		bool last = g.len < FS_GREP_WINDOW;
+		g.report_to = last ? g.base + g.len : g.base + g.len - (max_len - 1);
+		if (matcher_scan(s->matcher, t->buf, g.len, grep_match_cb, &g) || last) {
+			break;
+		}
+		g.report_from = g.report_to;
+	}
+	close(fd);
 }
 
-ssize_t file_tell(struct channel *c)
+static void fs_search_dir_async(eio_req *req)
+{
+	struct search_task *t = req->data;
+	struct fs_search *s = t->search;
+	struct search_dir *dir = t->dir;
+
+	struct dir_reader *r = malloc(sizeof(*r));
+	if (r == NULL) {
+		t->rc = ENOMEM;
+		return;
+	}
+	if (dir_reader_open(r, dir->path) == -1) {
+		t->rc = errno;
+		free(r);
+		return;
+	}
+
+	bool descend = dir->depth < s->max_depth;
+	const char *name;
+	unsigned char type;
+	while (!s->cancelled && (name = dir_reader_next(r, &type))) {
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+			continue;
+		}
+
+		/*
+		 * The entry type saves a stat for anything that is neither a
+		 * directory nor a name match
+		 */
+		bool match = fnmatch(s->glob, name, 0) == 0;
+		struct stat st;
+		if (type == DT_DIR) {
+			st.st_mode = S_IFDIR;
+		} else if (!match && type != DT_UNKNOWN) {
+			continue;
+		} else if (fstatat(r->fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			if (descend) {
+				struct search_dir *d = search_dir_new(dir->path, name, dir->depth + 1);
+				if (d) {
+					LL_PREPEND(t->subdirs, d);
+				}
+			}
+			continue;
+		}
+
+		/*
+		 * Symlinks are reported by what they point to, but never
+		 * descended into, so a link cycle cannot trap the walk
+		 */
+		if (!match || (S_ISLNK(st.st_mode)
+				&& (fstatat(r->fd, name, &st, 0) == -1 || S_ISDIR(st.st_mode)))
+				|| !search_filter(s, &st)) {
+			continue;
+		}
+
+		if (s->matcher == NULL) {
+			search_add_result(t, name, &st, 0, NULL, 0);
+		} else if (S_ISREG(st.st_mode)) {
+			grep_file(t, r->fd, name, &st);
+		}
+	}
+
+	dir_reader_close(r);
+	free(r);
+}
+
+static void fs_search_done(struct fs_search *s)
 {
-	FILE *f = channel_get_ctx(c);
-	return ftell(f);
+	DL_DELETE(searches, s);
+
+	struct tlv_handler_ctx *ctx = s->ctx;
+	struct tlv_packet *p = tlv_packet_add_result(s->p,
+		s->cancelled ? ECANCELED : s->rc);
+	if (p) {
+		tlv_dispatcher_enqueue_response(ctx->td, p);
+	}
+	tlv_handler_ctx_free(ctx);
+	matcher_free(s->matcher);
+	free(s);
 }
 
-bool file_eof(struct channel *c)
+static int fs_search_dir_cb(eio_req *req);
+
+static void fs_search_run(struct fs_search *s)
 {
-	FILE *f = channel_get_ctx(c);
-	return feof(f);
+	while (!s->cancelled && s->pending && s->running < FS_SEARCH_WORKERS) {
+		struct search_dir *d = s->pending;
+		LL_DELETE(s->pending, d);
+
+		struct search_task *t = calloc(1, sizeof(*t));
+		if (t == NULL) {
+			search_dir_free(d);
+			s->rc = ENOMEM;
+			continue;
+		}
+		t->search = s;
+		t->dir = d;
+
+		/*
+		 * Low priority, so a big walk leaves room for other filesystem
+		 * requests between directories
+		 */
+		if (eio_custom(fs_search_dir_async, EIO_PRI_MIN, fs_search_dir_cb, t) == NULL) {
+			search_dir_free(d);
+			free(t);
+			s->rc = errno;
+			continue;
+		}
+		s->running++;
+	}
+
+	if (s->cancelled) {
+		struct search_dir *d, *tmp;
+		LL_FOREACH_SAFE(s->pending, d, tmp) {
+			LL_DELETE(s->pending, d);
+			search_dir_free(d);
+		}
+	}
+
+	if (s->running == 0) {
+		fs_search_done(s);
+	}
 }
 
-int file_free(struct channel *c)
+static int fs_search_dir_cb(eio_req *req)
+{
+	struct search_task *t = req->data;
+	struct fs_search *s = t->search;
+	s->running--;
+
+	/*
+	 * Only a failure to read the root fails the search; unreadable
+	 * directories further down are skipped
+	 */
+	if (t->rc && t->dir->depth == 0) {
+		s->rc = t->rc;
+	}
+
+	if (t->found) {
+		s->p = tlv_packet_merge_child(s->p, t->found);
+		s->p = tlv_packet_response_continue(s->ctx, s->p);
+		if (s->p == NULL) {
+			s->cancelled = true;
+		}
+	}
+
+	if (t->subdirs) {
+		LL_CONCAT(t->subdirs, s->pending);
+		s->pending = t->subdirs;
+	}
+
+	search_dir_free(t->dir);
+	free(t->buf);
+	free(t);
+	fs_search_run(s);
+	return 0;
+}
+
+static struct tlv_packet *
+fs_search_start(struct tlv_handler_ctx *ctx, struct matcher *matcher)
+{
+	const char *root = tlv_packet_get_str(ctx->req, TLV_TYPE_SEARCH_ROOT);
+	if (root == NULL || root[0] == '\0') {
+		root = ".";
+	}
+
+	struct fs_search *s = calloc(1, sizeof(*s));
+	struct search_dir *d = calloc(1, sizeof(*d));
+	if (s == NULL || d == NULL || (d->path = strdup(root)) == NULL) {
+		free(s);
+		free(d);
+		matcher_free(matcher);
+		return tlv_packet_response_result(ctx, ENOMEM);
+	}
+	size_t len = strlen(d->path);
+	while (len > 1 && d->path[len - 1] == '/') {
+		d->path[--len] = '\0';
+	}
+
+	s->ctx = ctx;
+	s->glob = tlv_packet_get_str(ctx->req, TLV_TYPE_SEARCH_GLOB);
+	if (s->glob == NULL || s->glob[0] == '\0') {
+		s->glob = "*";
+	}
+
+	bool recurse = true;
+	tlv_packet_get_bool(ctx->req, TLV_TYPE_SEARCH_RECURSE, &recurse);
+	s->max_depth = recurse ? UINT32_MAX : 0;
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_SEARCH_DEPTH, &s->max_depth);
+	s->max_size = UINT64_MAX;
+	tlv_packet_get_u64(ctx->req, TLV_TYPE_SEARCH_MIN_SIZE, &s->min_size);
+	tlv_packet_get_u64(ctx->req, TLV_TYPE_SEARCH_MAX_SIZE, &s->max_size);
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_SEARCH_M_START_DATE, &s->start_date);
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_SEARCH_M_END_DATE, &s->end_date);
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_SEARCH_ID, &s->id);
+
+	s->matcher = matcher;
+	s->context = 32;
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_SEARCH_CONTEXT_LEN, &s->context);
+	s->context = TYPESAFE_MIN(s->context, FS_GREP_MAX_CONTEXT);
+	s->max_matches = 100;
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_SEARCH_MAX_MATCHES, &s->max_matches);
+	if (s->max_matches == 0) {
+		s->max_matches = UINT32_MAX;
+	}
+
+	s->p = tlv_packet_response(ctx);
+	s->pending = d;
+	DL_APPEND(searches, s);
+	fs_search_run(s);
+	return NULL;
+}
+
+struct tlv_packet *fs_search(struct tlv_handler_ctx *ctx)
 {
-	FILE *f = channel_get_ctx(c);
-	return fclose(f);
+	return fs_search_start(ctx, NULL);
 }
 
+/*
+ * Searches file contents for any of the SEARCH_PATTERN byte strings,
+ * answering with the offset of each match and the bytes around it
+ */
+struct tlv_packet *fs_grep(struct tlv_handler_ctx *ctx)
+{
+	struct matcher *m = matcher_new();
+	if (m == NULL) {
+		return tlv_packet_response_result(ctx, ENOMEM);
+	}
+
+	struct tlv_iterator i = {
+		.packet = ctx->req,
+		.value_type = TLV_TYPE_SEARCH_PATTERN,
+	};
+	void *pattern;
+	size_t len;
+	bool any = false;
+	while ((pattern = tlv_packet_iterate(&i, &len))) {
+		if (matcher_add(m, pattern, len) == -1) {
+			matcher_free(m);
+			return tlv_packet_response_result(ctx, EINVAL);
+		}
+		any = true;
+	}
+	if (!any || matcher_compile(m) == -1) {
+		matcher_free(m);
+		return tlv_packet_response_result(ctx, any ? ENOMEM : EINVAL);
+	}
+
+	return fs_search_start(ctx, m);
+}
+
+/*
+ * Stops the search with the given id, or every search when no id is given.
+ * Results found so far are still sent, ending with ECANCELED.
+ */
+struct tlv_packet *fs_search_cancel(struct tlv_handler_ctx *ctx)
+{
+	uint32_t id;
+	bool all = tlv_packet_get_u32(ctx->req, TLV_TYPE_SEARCH_ID, &id) == -1;
+	int rc = ENOENT;
+
+	struct fs_search *s, *tmp;
+	DL_FOREACH_SAFE(searches, s, tmp) {
+		if (all || s->id == id) {
+			s->cancelled = true;
+			rc = TLV_RESULT_SUCCESS;
+		}
+	}
+	return tlv_packet_response_result(ctx, rc);
+}
+
+#endif
+
+/*
+ * File channels read on eio threads with pread, or through io_uring where
+ * the kernel has it, so a slow disk only delays its own channel. Once
+ * reads look sequential, the next window of the file is fetched ahead of
+ * the requests for it.
+ */
+struct file_channel {
+	struct channel *channel;
+	int fd;
+	bool append;
+	struct uring *uring;
+
+	/*
+	 * 'ra' holds the file from 'pos' onward
+	 */
+	off_t pos;
+	struct buffer_queue *ra;
+	size_t window;
+	unsigned sequential;
+
+	bool fetching;
+	off_t fetch_pos;
+	size_t fetch_len;
+	void *fetch_buf;
+
+	bool regular;
+	bool eof;
+	int err;
+
+	/*
+	 * Writes collect in 'wb', which holds the file from 'wb_pos' onward,
+	 * and go out as a queue of flushes written in order by eio. An error
+	 * from a flush is kept for the next write or the close.
+	 */
+	struct buffer_queue *wb;
+	off_t wb_pos;
+	size_t wb_flush;
+	struct file_flush *flushes;
+	size_t flush_bytes;
+	off_t write_end;
+	bool flushing;
+	bool read_waiting;
+	int werr;
+};
+
+struct file_flush {
+	char *buf;
+	size_t len, done;
+	off_t pos;
+	struct file_flush *next;
+};
+
+#define FILE_READAHEAD_DEFAULT (256 * 1024)
+#define FILE_READAHEAD_MAX (8 * 1024 * 1024)
+
+#define FILE_WRITE_BUFFER_DEFAULT (1024 * 1024)
+#define FILE_WRITE_BUFFER_MAX (16 * 1024 * 1024)
+
+/*
+ * Flushes end on a boundary this size where they can, and past this many
+ * buffers' worth of backlog the rest is written without waiting
+ */
+#define FILE_WRITE_ALIGN 4096
+#define FILE_WRITE_BACKLOG 8
+
+/*
+ * Reads in a row at the current position before fetching ahead
+ */
+#define FILE_SEQUENTIAL_READS 2
+
+static int file_open_flags(const char *mode, bool *append)
+{
+	int flags;
+	*append = false;
+	switch (mode[0]) {
+		case 'r':
+			flags = O_RDONLY;
+			break;
+		case 'w':
+			flags = O_WRONLY | O_CREAT | O_TRUNC;
+			break;
+		case 'a':
+			flags = O_WRONLY | O_CREAT | O_APPEND;
+			*append = true;
+			break;
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+	if (strchr(mode, '+')) {
+		flags = (flags & ~(O_RDONLY | O_WRONLY)) | O_RDWR;
+	}
+#ifdef O_BINARY
+	flags |= O_BINARY;
+#endif
+	return flags;
+}
+
+static void file_channel_free(struct file_channel *fc)
+{
+	struct file_flush *f, *tmp;
+	LL_FOREACH_SAFE(fc->flushes, f, tmp) {
+		LL_DELETE(fc->flushes, f);
+		free(f->buf);
+		free(f);
+	}
+	buffer_queue_free(fc->wb);
+	buffer_queue_free(fc->ra);
+	close(fc->fd);
+	free(fc);
+}
+
+/*
+ * Once the channel is gone, the last outstanding request frees it
+ */
+static void file_channel_release(struct file_channel *fc)
+{
+	if (fc->channel == NULL && !fc->fetching && !fc->flushing && fc->flushes == NULL) {
+		file_channel_free(fc);
+	}
+}
+
+static void file_advise(struct file_channel *fc, bool sequential)
+{
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fc->fd, 0, 0, sequential ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_RANDOM);
+#endif
+}
+
+static void file_fetch(struct file_channel *fc, size_t len);
+
+static void file_fetch_done(struct file_channel *fc, ssize_t result, int err)
+{
+	void *buf = fc->fetch_buf;
+	fc->fetch_buf = NULL;
+	fc->fetching = false;
+
+	if (fc->channel == NULL) {
+		free(buf);
+		file_channel_release(fc);
+		return;
+	}
+
+	/*
+	 * A seek since the fetch started makes its data useless
+	 */
+	if (fc->fetch_pos != fc->pos + (off_t)buffer_queue_len(fc->ra)) {
+		free(buf);
+	} else if (result < 0) {
+		free(buf);
+		fc->err = err;
+	} else if (result == 0) {
+		free(buf);
+		fc->eof = true;
+	} else if (buffer_queue_add_owned(fc->ra, buf, result, free) == -1) {
+		free(buf);
+		fc->err = ENOMEM;
+	} else if (fc->regular && (size_t)result < fc->fetch_len) {
+		/*
+		 * A short read of a regular file is its end
+		 */
+		fc->eof = true;
+	}
+
+	channel_read_ready(fc->channel);
+}
+
+static int file_fetch_cb(eio_req *req)
+{
+	file_fetch_done(req->data, req->result, req->errorno);
+	return 0;
+}
+
+static void file_fetch_uring_cb(int res, void *arg)
+{
+	file_fetch_done(arg, res, -res);
+}
+
+static void file_fetch(struct file_channel *fc, size_t len)
+{
+	if (fc->fetching || fc->eof || fc->err) {
+		return;
+	}
+
+	void *buf = malloc(len);
+	if (buf == NULL) {
+		fc->err = ENOMEM;
+		return;
+	}
+
+	fc->fetch_pos = fc->pos + buffer_queue_len(fc->ra);
+	fc->fetch_len = len;
+	fc->fetch_buf = buf;
+	if ((fc->uring == NULL || uring_read(fc->uring, fc->fd, buf, len, fc->fetch_pos,
+				file_fetch_uring_cb, fc) == -1)
+			&& eio_read(fc->fd, buf, len, fc->fetch_pos, 0, file_fetch_cb, fc) == NULL) {
+		fc->fetch_buf = NULL;
+		free(buf);
+		fc->err = EIO;
+		return;
+	}
+	fc->fetching = true;
+}
+
+/*
+ * Keeps at least half a window buffered ahead of a sequential reader
+ */
+static void file_readahead(struct file_channel *fc)
+{
+	size_t buffered = buffer_queue_len(fc->ra);
+	if (fc->sequential >= FILE_SEQUENTIAL_READS && buffered < fc->window / 2) {
+		file_fetch(fc, fc->window - buffered);
+	}
+}
+
+/*
+ * Forgets anything read ahead, for seeks and writes that move or change
+ * the data under it
+ */
+static void file_discard(struct file_channel *fc)
+{
+	buffer_queue_drain_all(fc->ra);
+	fc->eof = false;
+	fc->err = 0;
+	if (fc->sequential >= FILE_SEQUENTIAL_READS) {
+		file_advise(fc, false);
+	}
+	fc->sequential = 0;
+}
+
+static void file_flush_next(struct file_channel *fc);
+
+static void file_flush_done(struct file_channel *fc, struct file_flush *f)
+{
+	LL_DELETE(fc->flushes, f);
+	fc->flush_bytes -= f->len;
+	free(f->buf);
+	free(f);
+}
+
+static void file_flush_result(struct file_channel *fc, ssize_t result, int err)
+{
+	struct file_flush *f = fc->flushes;
+	fc->flushing = false;
+
+	if (result <= 0) {
+		fc->werr = result ? err : EIO;
+		log_info("file write failed: %s", strerror(fc->werr));
+		file_flush_done(fc, f);
+	} else if ((f->done += result) == f->len) {
+		file_flush_done(fc, f);
+	}
+
+	file_flush_next(fc);
+	if (fc->channel == NULL) {
+		file_channel_release(fc);
+	} else if (fc->read_waiting && fc->flushes == NULL) {
+		fc->read_waiting = false;
+		channel_read_ready(fc->channel);
+	}
+}
+
+static int file_flush_cb(eio_req *req)
+{
+	file_flush_result(req->data, req->result, req->errorno);
+	return 0;
+}
+
+static void file_flush_uring_cb(int res, void *arg)
+{
+	file_flush_result(arg, res, -res);
+}
+
+static void file_flush_next(struct file_channel *fc)
+{
+	struct file_flush *f = fc->flushes;
+	if (fc->flushing || f == NULL) {
+		return;
+	}
+
+	/*
+	 * Appends keep to eio, which writes them with write() at the end
+	 */
+	if ((f->pos == -1 || fc->uring == NULL || uring_write(fc->uring, fc->fd,
+				f->buf + f->done, f->len - f->done, f->pos + (off_t)f->done,
+				file_flush_uring_cb, fc) == -1)
+			&& eio_write(fc->fd, f->buf + f->done, f->len - f->done,
+			f->pos == -1 ? -1 : f->pos + (off_t)f->done, 0, file_flush_cb, fc) == NULL) {
+		fc->werr = EIO;
+		file_flush_done(fc, f);
+		file_flush_next(fc);
+		return;
+	}
+	fc->flushing = true;
+}
+
+/*
+ * Moves the first 'len' bytes of the write buffer to the flush queue
+ */
+static void file_flush_queue(struct file_channel *fc, size_t len)
+{
+	if (len == 0) {
+		return;
+	}
+	struct file_flush *f = calloc(1, sizeof(*f));
+	if (f == NULL || (f->buf = malloc(len)) == NULL) {
+		free(f);
+		buffer_queue_drain(fc->wb, len);
+		fc->wb_pos += len;
+		fc->werr = ENOMEM;
+		return;
+	}
+	f->len = buffer_queue_remove(fc->wb, f->buf, len);
+	f->pos = fc->append ? -1 : fc->wb_pos;
+	fc->wb_pos += f->len;
+	fc->flush_bytes += f->len;
+	LL_APPEND(fc->flushes, f);
+	file_flush_next(fc);
+}
+
+/*
+ * Writes out the backlog behind the flush in progress on the loop, so a
+ * disk slower than the link cannot buffer without limit. A queued range
+ * that overlaps the one in progress has to wait for it.
+ */
+static void file_flush_backlog(struct file_channel *fc)
+{
+	struct file_flush *current = fc->flushes;
+	while (current && current->next) {
+		struct file_flush *f = current->next;
+		if (f->pos == -1 || current->pos == -1 || (f->pos < current->pos + (off_t)current->len
+				&& current->pos < f->pos + (off_t)f->len)) {
+			break;
+		}
+		ssize_t n = pwrite(fc->fd, f->buf + f->done, f->len - f->done, f->pos + f->done);
+		if (n <= 0) {
+			fc->werr = n ? errno : EIO;
+			file_flush_done(fc, f);
+			continue;
+		}
+		if ((f->done += n) == f->len) {
+			file_flush_done(fc, f);
+		}
+	}
+}
+
+/*
+ * Queues the write buffer, and says whether anything is still to be written
+ */
+static bool file_flush_all(struct file_channel *fc)
+{
+	file_flush_queue(fc, buffer_queue_len(fc->wb));
+	return fc->flushes != NULL;
+}
+
+static ssize_t file_write_through(struct file_channel *fc, void *buf, size_t len)
+{
+	ssize_t n = fc->append ? write(fc->fd, buf, len) : pwrite(fc->fd, buf, len, fc->pos);
+	if (n > 0) {
+		fc->pos = fc->append ? lseek(fc->fd, 0, SEEK_CUR) : fc->pos + n;
+	}
+	return n;
+}
+
+/*
+ * Reserves space for an upload of known size, so it is laid out in one
+ * piece. On Linux the file keeps its size until written, so an upload cut
+ * short still shows how far it got.
+ */
+static void file_preallocate(struct file_channel *fc, uint64_t total)
+{
+	int rc = 0;
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+	rc = fallocate(fc->fd, FALLOC_FL_KEEP_SIZE, 0, total) == 0 ? 0 : errno;
+#elif defined(HAVE_POSIX_FALLOCATE)
+	rc = posix_fallocate(fc->fd, 0, total);
+#endif
+	if (rc) {
+		log_info("could not preallocate %" PRIu64 " bytes: %s", total, strerror(rc));
+	}
+}
+
+struct file_new_req {
+	char *path;
+	char *mode;
+	uint32_t window;
+	uint32_t wb_flush;
+	uint64_t total;
+};
+
+static const struct tlv_field file_new_schema[] = {
+	TLV_FIELD_REQUIRED(TLV_TYPE_FILE_PATH, TLV_FIELD_STR, struct file_new_req, path),
+	TLV_FIELD(TLV_TYPE_FILE_MODE, TLV_FIELD_STR, struct file_new_req, mode),
+	TLV_FIELD(TLV_TYPE_FILE_READAHEAD, TLV_FIELD_U32, struct file_new_req, window),
+	TLV_FIELD(TLV_TYPE_FILE_WRITE_BUFFER, TLV_FIELD_U32, struct file_new_req, wb_flush),
+	TLV_FIELD(TLV_TYPE_FILE_TOTAL_SIZE, TLV_FIELD_U64, struct file_new_req, total),
+};
+
+int file_new(struct tlv_handler_ctx *ctx, struct channel *c)
+{
+	struct file_new_req req = {
+		.mode = "rb",
+		.window = FILE_READAHEAD_DEFAULT,
+		.wb_flush = FILE_WRITE_BUFFER_DEFAULT,
+	};
+	if (tlv_packet_decode(ctx->req, file_new_schema,
+			COUNT_OF(file_new_schema), &req) == -1) {
+		return -1;
+	}
+
+	struct file_channel *fc = calloc(1, sizeof(*fc));
+	if (fc == NULL) {
+		return -1;
+	}
+
+	int flags = file_open_flags(req.mode, &fc->append);
+	fc->fd = flags == -1 ? -1 : open(req.path, flags, 0666);
+	if (fc->fd == -1) {
+		free(fc);
+		return -1;
+	}
+
+	fc->ra = buffer_queue_new();
+	if (fc->ra == NULL) {
+		close(fc->fd);
+		free(fc);
+		return -1;
+	}
+
+	struct stat st;
+	fc->regular = fstat(fc->fd, &st) == 0 && S_ISREG(st.st_mode);
+	fc->channel = c;
+	fc->uring = mettle_get_uring(ctx->arg);
+	fc->window = TYPESAFE_MIN(req.window, FILE_READAHEAD_MAX);
+
+	if ((flags & O_ACCMODE) != O_RDONLY && fc->regular) {
+		if (req.wb_flush) {
+			fc->wb = buffer_queue_new();
+			fc->wb_flush = TYPESAFE_MIN(req.wb_flush, FILE_WRITE_BUFFER_MAX);
+		}
+		if (req.total) {
+			file_preallocate(fc, req.total);
+		}
+	}
+
+	channel_set_ctx(c, fc);
+	return 0;
+}
+
+ssize_t file_read(struct channel *c, void *buf, size_t len)
+{
+	struct file_channel *fc = channel_get_ctx(c);
+
+	/*
+	 * Reads see what was written, so wait for it to reach the file
+	 */
+	if (fc->wb && file_flush_all(fc)) {
+		fc->read_waiting = true;
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if (buffer_queue_len(fc->ra)) {
+		size_t n = buffer_queue_remove(fc->ra, buf, len);
+		fc->pos += n;
+		if (fc->sequential++ == FILE_SEQUENTIAL_READS) {
+			file_advise(fc, true);
+		}
+		file_readahead(fc);
+		return n;
+	}
+
+	if (fc->err) {
+		errno = fc->err;
+		fc->err = 0;
+		return -1;
+	}
+	if (fc->eof) {
+		return 0;
+	}
+
+	/*
+	 * Nothing buffered yet, so fetch at least what was asked for and
+	 * answer once it arrives
+	 */
+	file_fetch(fc, TYPESAFE_MAX(len, fc->sequential >= FILE_SEQUENTIAL_READS ? fc->window : 0));
+	if (fc->err) {
+		errno = fc->err;
+		fc->err = 0;
+		return -1;
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+ssize_t file_write(struct channel *c, void *buf, size_t len)
+{
+	struct file_channel *fc = channel_get_ctx(c);
+	if (buffer_queue_len(fc->ra) || fc->fetching) {
+		file_discard(fc);
+		fc->fetch_pos = -1;
+	}
+
+	if (fc->werr) {
+		errno = fc->werr;
+		fc->werr = 0;
+		return -1;
+	}
+	if (fc->wb == NULL) {
+		return file_write_through(fc, buf, len);
+	}
+
+	/*
+	 * A write somewhere other than the end of the buffer starts a new run
+	 */
+	size_t buffered = buffer_queue_len(fc->wb);
+	if (buffered && !fc->append && fc->pos != fc->wb_pos + (off_t)buffered) {
+		file_flush_queue(fc, buffered);
+		buffered = 0;
+	}
+	if (buffered == 0) {
+		fc->wb_pos = fc->pos;
+	}
+	if (buffer_queue_add(fc->wb, buf, len) == -1) {
+		errno = ENOMEM;
+		return -1;
+	}
+	fc->pos += len;
+	fc->write_end = TYPESAFE_MAX(fc->write_end, fc->pos);
+
+	buffered += len;
+	if (buffered >= fc->wb_flush) {
+		size_t cut = buffered;
+		if (!fc->append) {
+			off_t end = fc->wb_pos + buffered;
+			size_t tail = end % FILE_WRITE_ALIGN;
+			if (tail < buffered) {
+				cut -= tail;
+			}
+		}
+		file_flush_queue(fc, cut);
+		if (fc->flush_bytes > FILE_WRITE_BACKLOG * fc->wb_flush) {
+			file_flush_backlog(fc);
+		}
+	}
+	return len;
+}
+
+int file_seek(struct channel *c, ssize_t offset, int whence)
+{
+	struct file_channel *fc = channel_get_ctx(c);
+	off_t pos;
+
+	switch (whence) {
+		case SEEK_SET:
+			pos = offset;
+			break;
+		case SEEK_CUR:
+			pos = fc->pos + offset;
+			break;
+		case SEEK_END: {
+			struct stat st;
+			if (fstat(fc->fd, &st) == -1) {
+				return -1;
+			}
+			pos = TYPESAFE_MAX(st.st_size, fc->write_end) + offset;
+			break;
+		}
+#ifdef SEEK_DATA
+		case CHANNEL_SEEK_DATA:
+		case CHANNEL_SEEK_HOLE:
+			/*
+			 * Finds the next data or hole from the offset given, as the
+			 * file stands on disk
+			 */
+			pos = lseek(fc->fd, offset, whence == CHANNEL_SEEK_DATA ? SEEK_DATA : SEEK_HOLE);
+			if (pos == -1) {
+				return -1;
+			}
+			break;
+#endif
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+	if (pos < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/*
+	 * Seeking forward within what was read ahead keeps the rest of it
+	 */
+	size_t buffered = buffer_queue_len(fc->ra);
+	if (pos >= fc->pos && pos - fc->pos <= (off_t)buffered) {
+		buffer_queue_drain(fc->ra, pos - fc->pos);
+		fc->pos = pos;
+	} else {
+		file_discard(fc);
+		fc->pos = pos;
+	}
+	return 0;
+}
+
+ssize_t file_tell(struct channel *c)
+{
+	struct file_channel *fc = channel_get_ctx(c);
+	return fc->pos;
+}
+
+bool file_eof(struct channel *c)
+{
+	struct file_channel *fc = channel_get_ctx(c);
+	return fc->eof && buffer_queue_len(fc->ra) == 0;
+}
+
+int file_free(struct channel *c)
+{
+	struct file_channel *fc = channel_get_ctx(c);
+	channel_set_ctx(c, NULL);
+
+	/*
+	 * What is left of the write buffer is written now if nothing else is,
+	 * so its error can still be reported. Otherwise it joins the queue,
+	 * and the outstanding requests own the descriptor until they finish.
+	 */
+	int rc = 0;
+	if (fc->wb && buffer_queue_len(fc->wb) && !fc->flushing) {
+		void *buf = NULL;
+		ssize_t len = buffer_queue_remove_all(fc->wb, &buf);
+		if (len == -1 || (fc->append ? write(fc->fd, buf, len)
+				: pwrite(fc->fd, buf, len, fc->wb_pos)) != len) {
+			fc->werr = len == -1 ? ENOMEM : errno;
+		}
+		free(buf);
+	} else if (fc->wb) {
+		file_flush_all(fc);
+	}
+	if (fc->werr) {
+		errno = fc->werr;
+		rc = -1;
+	}
+
+	fc->channel = NULL;
+	file_channel_release(fc);
+	return rc;
+}
+
+/*
+ * Lists the holes in a file, by path or by an open file channel, as pairs
+ * of big endian 64-bit offset and length, so a download can skip them and
+ * the client can punch them back out of its copy. Without SEEK_HOLE there
+ * are never any holes.
+ */
+static void
+fs_sparse_map_async(struct eio_req *req)
+{
+	struct tlv_handler_ctx *ctx = req->data;
+	int fd = req->int1;
+	struct tlv_packet *p;
+	struct stat st;
+
+	if (fd == -1) {
+		const char *path = tlv_packet_get_str(ctx->req, TLV_TYPE_FILE_PATH);
+		if (path == NULL) {
+			p = tlv_packet_response_result(ctx, EINVAL);
+			goto out;
+		}
+		fd = open(path, O_RDONLY);
+	}
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		p = tlv_packet_response_result(ctx, errno);
+		goto out;
+	}
+
+	p = tlv_packet_response(ctx);
+	p = tlv_packet_add_u64(p, TLV_TYPE_FILE_TOTAL_SIZE, st.st_size);
+#ifdef SEEK_HOLE
+	off_t off = 0;
+	while (p && off < st.st_size) {
+		off_t hole = lseek(fd, off, SEEK_HOLE);
+		if (hole == -1 || hole >= st.st_size) {
+			break;
+		}
+		off_t data = lseek(fd, hole, SEEK_DATA);
+		if (data == -1) {
+			data = st.st_size;
+		}
+		uint64_t extent[2] = {
+			htobe64(hole), htobe64(data - hole),
+		};
+		p = tlv_packet_add_raw(p, TLV_TYPE_FILE_HOLE, extent, sizeof(extent));
+		p = tlv_packet_response_continue(ctx, p);
+		off = data;
+	}
+#endif
+	p = p ? tlv_packet_add_result(p, TLV_RESULT_SUCCESS)
+		: tlv_packet_response_result(ctx, ENOMEM);
+
+out:
+	if (fd != -1) {
+		close(fd);
+	}
+	tlv_dispatcher_enqueue_response(ctx->td, p);
+	tlv_handler_ctx_free(ctx);
+}
+
+struct tlv_packet *fs_sparse_map(struct tlv_handler_ctx *ctx)
+{
+	/*
+	 * A channel's descriptor is duplicated, so closing the channel
+	 * meanwhile does not pull it out from under the request
+	 */
+	int fd = -1;
+	uint32_t channel_id;
+	if (tlv_packet_get_u32(ctx->req, TLV_TYPE_CHANNEL_ID, &channel_id) == 0) {
+		struct channel *c = tlv_handler_ctx_channel_by_id(ctx);
+		if (c == NULL || strcmp(channel_get_type(c), "stdapi_fs_file")) {
+			return tlv_packet_response_result(ctx, EINVAL);
+		}
+		struct file_channel *fc = channel_get_ctx(c);
+		if ((fd = dup(fc->fd)) == -1) {
+			return tlv_packet_response_result(ctx, errno);
+		}
+	}
+
+	eio_req *req = eio_custom(fs_sparse_map_async, 0, NULL, ctx);
+	if (req == NULL) {
+		if (fd != -1) {
+			close(fd);
+		}
+		return tlv_packet_response_result(ctx, ENOMEM);
+	}
+	req->int1 = fd;
+	return NULL;
+}
+
+/*
+ * Reads a range of a file, by path or open file channel, with several
+ * preads in flight on eio workers at once. Each chunk is sent as soon as
+ * it is read, as a partial response carrying its FILE_BLOCK_OFFSET, so
+ * chunks arrive out of order and the client places them by offset. New
+ * reads wait while the responses already queued are more than the link
+ * is draining.
+ */
+#define FILE_RANGE_CHUNK_DEFAULT (256 * 1024)
+#define FILE_RANGE_CHUNK_MAX (1024 * 1024)
+#define FILE_RANGE_READERS_DEFAULT 4
+#define FILE_RANGE_READERS_MAX 16
+#define FILE_RANGE_QUEUE_MAX (4 * 1024 * 1024)
+#define FILE_RANGE_RETRY_S 0.01
+
+struct file_range {
+	struct tlv_handler_ctx *ctx;
+	struct ev_loop *loop;
+	struct ev_timer retry;
+	int fd;
+	off_t next, end;
+	size_t chunk;
+	unsigned readers, inflight;
+	int err;
+};
+
+struct file_range_read {
+	struct file_range *fr;
+	off_t pos;
+	size_t len;
+	void *buf;
+};
+
+static void file_range_finish(struct file_range *fr)
+{
+	struct tlv_handler_ctx *ctx = fr->ctx;
+	int rc = fr->err;
+	if (rc == 0 && tlv_handler_ctx_cancelled(ctx)) {
+		rc = ECANCELED;
+	}
+	tlv_dispatcher_enqueue_response(ctx->td, tlv_packet_response_result(ctx, rc));
+	tlv_handler_ctx_free(ctx);
+	ev_timer_stop(fr->loop, &fr->retry);
+	close(fr->fd);
+	free(fr);
+}
+
+static int file_range_read_cb(eio_req *req);
+
+static void file_range_issue(struct file_range *fr)
+{
+	bool stopped = fr->err || tlv_handler_ctx_cancelled(fr->ctx);
+	while (!stopped && fr->inflight < fr->readers && fr->next < fr->end) {
+		size_t queued = 0;
+		tlv_dispatcher_queued_responses(fr->ctx->td, &queued);
+		if (queued >= FILE_RANGE_QUEUE_MAX) {
+			if (fr->inflight == 0) {
+				ev_timer_set(&fr->retry, FILE_RANGE_RETRY_S, 0);
+				ev_timer_start(fr->loop, &fr->retry);
+			}
+			return;
+		}
+
+		struct file_range_read *rr = calloc(1, sizeof(*rr));
+		size_t len = TYPESAFE_MIN((off_t)fr->chunk, fr->end - fr->next);
+		if (rr == NULL || (rr->buf = malloc(len)) == NULL) {
+			free(rr);
+			fr->err = ENOMEM;
+			break;
+		}
+		rr->fr = fr;
+		rr->pos = fr->next;
+		rr->len = len;
+		if (eio_read(fr->fd, rr->buf, len, rr->pos, 0, file_range_read_cb, rr) == NULL) {
+			free(rr->buf);
+			free(rr);
+			fr->err = EIO;
+			break;
+		}
+		fr->next += len;
+		fr->inflight++;
+	}
+
+	if (fr->inflight == 0) {
+		file_range_finish(fr);
+	}
+}
+
+static void file_range_retry_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+	file_range_issue(w->data);
+}
+
+static int file_range_read_cb(eio_req *req)
+{
+	struct file_range_read *rr = req->data;
+	struct file_range *fr = rr->fr;
+	ssize_t result = req->result;
+	fr->inflight--;
+
+	if (result < 0) {
+		fr->err = req->errorno;
+	} else if ((size_t)result < rr->len) {
+		/*
+		 * The file ends here, so nothing past it is read
+		 */
+		fr->end = TYPESAFE_MIN(fr->end, rr->pos + (off_t)result);
+		fr->next = TYPESAFE_MIN(fr->next, fr->end);
+	}
+
+	if (result > 0 && !fr->err) {
+		struct tlv_packet *p = tlv_packet_response(fr->ctx);
+		p = tlv_packet_add_u64(p, TLV_TYPE_FILE_BLOCK_OFFSET, rr->pos);
+		p = tlv_packet_add_raw(p, TLV_TYPE_FILE_RANGE_DATA, rr->buf, result);
+		p = tlv_packet_add_bool(p, TLV_TYPE_CONTINUATION, true);
+		if (p == NULL || tlv_dispatcher_enqueue_response(fr->ctx->td, p) == -1) {
+			fr->err = ENOMEM;
+		}
+	}
+	free(rr->buf);
+	free(rr);
+
+	file_range_issue(fr);
+	return 0;
+}
+
+struct tlv_packet *fs_read_ranges(struct tlv_handler_ctx *ctx)
+{
+	uint64_t offset = 0, length = UINT64_MAX;
+	uint32_t chunk = FILE_RANGE_CHUNK_DEFAULT;
+	uint32_t readers = FILE_RANGE_READERS_DEFAULT;
+	tlv_packet_get_u64(ctx->req, TLV_TYPE_FILE_BLOCK_OFFSET, &offset);
+	tlv_packet_get_u64(ctx->req, TLV_TYPE_FILE_RANGE_LENGTH, &length);
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_FILE_BLOCK_SIZE, &chunk);
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_FILE_RANGE_READERS, &readers);
+	if (!tlv_handler_ctx_can_stream(ctx) || chunk == 0 || readers == 0
+			|| offset > INT64_MAX) {
+		return tlv_packet_response_result(ctx, EINVAL);
+	}
+
+	int fd = -1;
+	uint32_t channel_id;
+	if (tlv_packet_get_u32(ctx->req, TLV_TYPE_CHANNEL_ID, &channel_id) == 0) {
+		struct channel *c = tlv_handler_ctx_channel_by_id(ctx);
+		if (c == NULL || strcmp(channel_get_type(c), "stdapi_fs_file")) {
+			return tlv_packet_response_result(ctx, EINVAL);
+		}
+		struct file_channel *fc = channel_get_ctx(c);
+		fd = dup(fc->fd);
+	} else {
+		const char *path = tlv_packet_get_str(ctx->req, TLV_TYPE_FILE_PATH);
+		if (path == NULL) {
+			return tlv_packet_response_result(ctx, EINVAL);
+		}
+		fd = open(path, O_RDONLY);
+	}
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		int rc = errno;
+		if (fd != -1) {
+			close(fd);
+		}
+		return tlv_packet_response_result(ctx, rc);
+	}
+
+	struct file_range *fr = calloc(1, sizeof(*fr));
+	if (fr == NULL) {
+		close(fd);
+		return tlv_packet_response_result(ctx, ENOMEM);
+	}
+	fr->ctx = ctx;
+	fr->loop = mettle_get_loop(ctx->arg);
+	fr->fd = fd;
+	fr->next = offset;
+	fr->end = length > (uint64_t)(INT64_MAX - offset) ? INT64_MAX : (off_t)(offset + length);
+	if (S_ISREG(st.st_mode)) {
+		fr->end = TYPESAFE_MIN(fr->end, st.st_size);
+	}
+	fr->chunk = TYPESAFE_MIN(chunk, FILE_RANGE_CHUNK_MAX);
+	fr->readers = TYPESAFE_MIN(readers, FILE_RANGE_READERS_MAX);
+	ev_init(&fr->retry, file_range_retry_cb);
+	fr->retry.data = fr;
+
+	/*
+	 * The total size goes first, so the client can size its copy
+	 */
+	struct tlv_packet *p = tlv_packet_response(ctx);
+	p = tlv_packet_add_u64(p, TLV_TYPE_FILE_TOTAL_SIZE, st.st_size);
+	p = tlv_packet_add_bool(p, TLV_TYPE_CONTINUATION, true);
+	if (p == NULL || tlv_dispatcher_enqueue_response(ctx->td, p) == -1) {
+		fr->err = ENOMEM;
+	}
+
+	file_range_issue(fr);
+	return NULL;
+}
+
+static const struct tlv_handler_def file_handlers[] = {
+	{ "stdapi_fs_chdir", fs_chdir },
+	{ "stdapi_fs_delete_file", fs_delete_file },
+	{ "stdapi_fs_file_expand_path", fs_expand_path },
+	{ "stdapi_fs_file_move", fs_file_move },
+	{ "stdapi_fs_file_copy", fs_file_copy },
+	{ "stdapi_fs_chmod", fs_chmod },
+	{ "stdapi_fs_getwd", fs_getwd },
+	{ "stdapi_fs_mkdir", fs_mkdir },
+	{ "stdapi_fs_delete_dir", fs_rmdir },
+	{ "stdapi_fs_ls", fs_ls },
+	{ "stdapi_fs_separator", fs_separator },
+	{ "stdapi_fs_stat", fs_stat },
+	{ "stdapi_fs_md5", fs_md5 },
+	{ "stdapi_fs_put_by_hash", fs_put_by_hash },
+	{ "stdapi_fs_sha1", fs_sha1 },
+	{ "stdapi_fs_hash", fs_hash },
+	{ "stdapi_fs_block_hashes", fs_block_hashes },
+	{ "stdapi_fs_sparse_map", fs_sparse_map },
+	{ "stdapi_fs_read_ranges", fs_read_ranges },
+#ifndef _WIN32
+	{ "stdapi_fs_search", fs_search },
+	{ "stdapi_fs_search_cancel", fs_search_cancel },
+	{ "stdapi_fs_grep", fs_grep },
+#endif
+};
+
 void file_register_handlers(struct mettle *m)
 {
 	struct tlv_dispatcher *td = mettle_get_tlv_dispatcher(m);
 	struct channelmgr *cm = mettle_get_channelmgr(m);
 
-	tlv_dispatcher_add_handler(td, "stdapi_fs_chdir", fs_chdir, m);
-	tlv_dispatcher_add_handler(td, "stdapi_fs_delete_file", fs_delete_file, m);
-	tlv_dispatcher_add_handler(td, "stdapi_fs_file_expand_path", fs_expand_path, m);
-	tlv_dispatcher_add_handler(td, "stdapi_fs_file_move", fs_file_move, m);
-	tlv_dispatcher_add_handler(td, "stdapi_fs_file_copy", fs_file_copy, m);
-	tlv_dispatcher_add_handler(td, "stdapi_fs_chmod", fs_chmod, m);
-	tlv_dispatcher_add_handler(td, "stdapi_fs_getwd", fs_getwd, m);
-	tlv_dispatcher_add_handler(td, "stdapi_fs_mkdir", fs_mkdir, m);
-	tlv_dispatcher_add_handler(td, "stdapi_fs_delete_dir", fs_rmdir, m);
-	tlv_dispatcher_add_handler(td, "stdapi_fs_ls", fs_ls, m);
-	tlv_dispatcher_add_handler(td, "stdapi_fs_separator", fs_separator, m);
-	tlv_dispatcher_add_handler(td, "stdapi_fs_stat", fs_stat, m);
-	tlv_dispatcher_add_handler(td, "stdapi_fs_md5", fs_md5, m);
-	tlv_dispatcher_add_handler(td, "stdapi_fs_sha1", fs_sha1, m);
+	tlv_dispatcher_add_handlers(td, file_handlers, COUNT_OF(file_handlers), m);
 
 	struct channel_callbacks cbs = {
 		.new_cb = file_new,
@@ -552,7 +2862,9 @@ void file_register_handlers(struct mettle *m)
 		.write_cb = file_write,
 		.eof_cb = file_eof,
 		.seek_cb = file_seek,
+		.tell_cb = file_tell,
 		.free_cb = file_free,
 	};
 	channelmgr_add_channel_type(cm, "stdapi_fs_file", &cbs);
+	channelmgr_set_channel_type_lane(cm, "stdapi_fs_file", TLV_LANE_BULK);
 }
@@ -0,0 +1,627 @@
+/**
+ * @brief Filesystem change watch channel
+ * @file watch.c
+ *
+ * A "stdapi_fs_watch" channel watches a path and pushes what changes under
+ * it, so the client need not list the tree again to find out. Changes are
+ * merged by path over a short delay and sent as TLV_TYPE_WATCH_EVENT
+ * groups in channel writes, each path relative to the one watched.
+ * Directories are watched with inotify, down the tree up to a limit, or
+ * when asked and allowed, the whole filesystem at once with a fanotify mark
+ * that reports names.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#endif
+
+#include <ev.h>
+#include <mettle.h>
+
+#include "channel.h"
+#include "log.h"
+#include "tlv.h"
+#include "util.h"
+#include "uthash.h"
+
+#ifdef __linux__
+
+#define WATCH_MAX_DEFAULT 8192
+#define WATCH_MAX_LIMIT 65536
+#define WATCH_DELAY_DEFAULT_MS 200
+#define WATCH_DELAY_MAX_MS 60000
+
+/*
+ * Most paths held between sends, and sent per channel write
+ */
+#define WATCH_PENDING_MAX 16384
+#define WATCH_BATCH_MAX 1024
+
+#define WATCH_READ_LEN 16384
+
+#define WATCH_INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB \
+	| IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE_SELF \
+	| IN_MOVE_SELF | IN_EXCL_UNLINK)
+
+struct watch_dir {
+	int wd;
+	char *path;
+	UT_hash_handle hh;
+};
+
+struct watch_event {
+	uint32_t flags;
+	UT_hash_handle hh;
+	char path[];
+};
+
+struct fs_watch {
+	struct channel *channel;
+	struct ev_loop *loop;
+	char *root;
+	size_t root_len;
+	bool recursive;
+	uint32_t max_watches;
+
+	int fd;
+	bool fanotify;
+	int mount_fd;
+	struct watch_dir *dirs;
+	struct ev_io read_event;
+
+	/*
+	 * Changes seen since the last send, by path, sent once the delay
+	 * has passed since the first of them
+	 */
+	struct watch_event *pending;
+	uint32_t num_pending;
+	uint32_t dropped;
+	bool overflow;
+	double delay;
+	struct ev_timer delay_timer;
+};
+
+/*
+ * 'name' under 'base', either of which may be empty
+ */
+static char *watch_join(const char *base, const char *name)
+{
+	char *path;
+	size_t len = strlen(base);
+	const char *sep = len && base[len - 1] != '/' && *name ? "/" : "";
+	if (asprintf(&path, "%s%s%s", base, sep, name) == -1) {
+		return NULL;
+	}
+	return path;
+}
+
+/*
+ * Where a path is below the root, or NULL if it is not
+ */
+static const char *watch_relative(struct fs_watch *w, const char *path)
+{
+	if (strncmp(path, w->root, w->root_len)) {
+		return NULL;
+	}
+	if (w->root[w->root_len - 1] == '/') {
+		return path + w->root_len;
+	}
+	if (path[w->root_len] == '\0') {
+		return path + w->root_len;
+	}
+	if (path[w->root_len] == '/') {
+		return path + w->root_len + 1;
+	}
+	return NULL;
+}
+
+static void watch_flush(struct fs_watch *w);
+
+static void watch_arm(struct fs_watch *w)
+{
+	if (!ev_is_active(&w->delay_timer)) {
+		ev_timer_set(&w->delay_timer, w->delay, 0);
+		ev_timer_start(w->loop, &w->delay_timer);
+	}
+}
+
+static void watch_note(struct fs_watch *w, const char *path, uint32_t flags)
+{
+	struct watch_event *e;
+	HASH_FIND_STR(w->pending, path, e);
+	if (e) {
+		e->flags |= flags;
+		return;
+	}
+
+	size_t len = strlen(path);
+	if (w->num_pending == WATCH_PENDING_MAX
+			|| (e = malloc(sizeof(*e) + len + 1)) == NULL) {
+		w->dropped++;
+		w->overflow = true;
+	} else {
+		e->flags = flags;
+		memcpy(e->path, path, len + 1);
+		HASH_ADD(hh, w->pending, path, len, e);
+		w->num_pending++;
+	}
+	watch_arm(w);
+}
+
+static struct tlv_packet *watch_add_event(struct tlv_packet *p,
+	const char *path, uint32_t flags)
+{
+	struct tlv_packet *g = tlv_packet_new(TLV_TYPE_WATCH_EVENT, 0);
+	g = tlv_packet_add_str(g, TLV_TYPE_FILE_PATH, path);
+	g = tlv_packet_add_u32(g, TLV_TYPE_WATCH_FLAGS, flags);
+	return tlv_packet_add_child(p, g);
+}
+
+static void watch_send(struct fs_watch *w, struct tlv_packet *values)
+{
+	channel_enqueue_values(w->channel, values, tlv_packet_len(values));
+}
+
+/*
+ * Sends what is pending, in writes of up to WATCH_BATCH_MAX events. Lost
+ * events are reported first, as an overflow of the root with the count in
+ * TLV_TYPE_WATCH_DROPPED.
+ */
+static void watch_flush(struct fs_watch *w)
+{
+	struct tlv_packet *values = tlv_packet_new(0, 0);
+	uint32_t count = 0;
+	if (w->overflow) {
+		values = watch_add_event(values, "", WATCH_OVERFLOW);
+		if (w->dropped) {
+			values = tlv_packet_add_u32(values, TLV_TYPE_WATCH_DROPPED, w->dropped);
+		}
+		w->overflow = false;
+		w->dropped = 0;
+		count++;
+	}
+
+	struct watch_event *e, *tmp;
+	HASH_ITER(hh, w->pending, e, tmp) {
+		HASH_DEL(w->pending, e);
+		values = watch_add_event(values, e->path, e->flags);
+		free(e);
+		if (++count == WATCH_BATCH_MAX) {
+			watch_send(w, values);
+			values = tlv_packet_new(0, 0);
+			count = 0;
+		}
+	}
+	w->num_pending = 0;
+
+	if (count) {
+		watch_send(w, values);
+	} else {
+		tlv_packet_free(values);
+	}
+}
+
+static void watch_delay_cb(struct ev_loop *loop, struct ev_timer *t, int revents)
+{
+	watch_flush(t->data);
+}
+
+/*
+ * Watches one directory, noting it as unwatched once past the limit
+ */
+static int watch_add_dir(struct fs_watch *w, const char *rel)
+{
+	if (HASH_COUNT(w->dirs) >= w->max_watches) {
+		watch_note(w, rel, WATCH_UNWATCHED | WATCH_DIRECTORY);
+		errno = ENOSPC;
+		return -1;
+	}
+
+	char *path = *rel ? watch_join(w->root, rel) : strdup(w->root);
+	if (path == NULL) {
+		return -1;
+	}
+	int wd = inotify_add_watch(w->fd, path, WATCH_INOTIFY_MASK);
+	free(path);
+	if (wd == -1) {
+		if (errno == ENOSPC) {
+			// Out of the kernel's max_user_watches
+			watch_note(w, rel, WATCH_UNWATCHED | WATCH_DIRECTORY);
+		}
+		return -1;
+	}
+
+	// A directory moved back in keeps its descriptor
+	struct watch_dir *d;
+	HASH_FIND_INT(w->dirs, &wd, d);
+	if (d == NULL) {
+		if ((d = calloc(1, sizeof(*d))) == NULL) {
+			inotify_rm_watch(w->fd, wd);
+			return -1;
+		}
+		d->wd = wd;
+		HASH_ADD_INT(w->dirs, wd, d);
+	}
+	free(d->path);
+	d->path = strdup(rel);
+	return 0;
+}
+
+/*
+ * Watches a directory and, when recursive, those below it. Anything found
+ * under a new directory is reported as created, as it may have appeared
+ * before the watch was in place.
+ */
+static void watch_add_tree(struct fs_watch *w, const char *rel, bool created)
+{
+	if (watch_add_dir(w, rel) == -1 || !w->recursive) {
+		return;
+	}
+
+	char *path = *rel ? watch_join(w->root, rel) : strdup(w->root);
+	DIR *dir = path ? opendir(path) : NULL;
+	if (dir == NULL) {
+		free(path);
+		return;
+	}
+
+	struct dirent *de;
+	while ((de = readdir(dir))) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+			continue;
+		}
+		char *child = watch_join(rel, de->d_name);
+		if (child == NULL) {
+			continue;
+		}
+		bool is_dir = de->d_type == DT_DIR;
+		if (de->d_type == DT_UNKNOWN) {
+			struct stat st;
+			is_dir = fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+				&& S_ISDIR(st.st_mode);
+		}
+		if (created) {
+			watch_note(w, child, WATCH_CREATED | (is_dir ? WATCH_DIRECTORY : 0));
+		}
+		if (is_dir) {
+			watch_add_tree(w, child, created);
+		}
+		free(child);
+	}
+	closedir(dir);
+	free(path);
+}
+
+/*
+ * Stops watching a directory moved away and those below it
+ */
+static void watch_remove_tree(struct fs_watch *w, const char *rel)
+{
+	size_t len = strlen(rel);
+	struct watch_dir *d, *tmp;
+	HASH_ITER(hh, w->dirs, d, tmp) {
+		if (strncmp(d->path, rel, len) == 0
+				&& (d->path[len] == '\0' || d->path[len] == '/')) {
+			inotify_rm_watch(w->fd, d->wd);
+			HASH_DEL(w->dirs, d);
+			free(d->path);
+			free(d);
+		}
+	}
+}
+
+static uint32_t watch_inotify_flags(uint32_t mask)
+{
+	return (mask & IN_CREATE ? WATCH_CREATED : 0)
+		| (mask & IN_MODIFY ? WATCH_MODIFIED : 0)
+		| (mask & (IN_DELETE | IN_DELETE_SELF) ? WATCH_DELETED : 0)
+		| (mask & (IN_MOVED_FROM | IN_MOVE_SELF) ? WATCH_MOVED_FROM : 0)
+		| (mask & IN_MOVED_TO ? WATCH_MOVED_TO : 0)
+		| (mask & IN_ATTRIB ? WATCH_ATTRIB : 0)
+		| (mask & IN_CLOSE_WRITE ? WATCH_CLOSE_WRITE : 0);
+}
+
+static void watch_inotify_event(struct fs_watch *w, const struct inotify_event *ev)
+{
+	if (ev->mask & IN_Q_OVERFLOW) {
+		w->overflow = true;
+		watch_arm(w);
+		return;
+	}
+
+	struct watch_dir *d;
+	HASH_FIND_INT(w->dirs, &ev->wd, d);
+	if (d == NULL) {
+		return;
+	}
+	if (ev->mask & IN_IGNORED) {
+		HASH_DEL(w->dirs, d);
+		free(d->path);
+		free(d);
+		return;
+	}
+
+	char *path = ev->len ? watch_join(d->path, ev->name) : strdup(d->path);
+	if (path == NULL) {
+		w->dropped++;
+		w->overflow = true;
+		watch_arm(w);
+		return;
+	}
+	uint32_t flags = watch_inotify_flags(ev->mask);
+	if (flags) {
+		watch_note(w, path, flags | (ev->mask & IN_ISDIR ? WATCH_DIRECTORY : 0));
+	}
+	if (w->recursive && ev->len && (ev->mask & IN_ISDIR)) {
+		if (ev->mask & IN_MOVED_FROM) {
+			watch_remove_tree(w, path);
+		}
+		if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+			watch_add_tree(w, path, true);
+		}
+	}
+	free(path);
+}
+
+#ifdef FAN_REPORT_DFID_NAME
+
+#define WATCH_FANOTIFY_MASK (FAN_CREATE | FAN_DELETE | FAN_MODIFY | FAN_ATTRIB \
+	| FAN_MOVED_FROM | FAN_MOVED_TO | FAN_CLOSE_WRITE | FAN_ONDIR)
+
+/*
+ * One mark covers the filesystem the root is on, with no limit to reach,
+ * and events outside the root are left out. It needs CAP_SYS_ADMIN, and
+ * the directory handles it reports need CAP_DAC_READ_SEARCH to resolve.
+ */
+static int watch_fanotify_open(struct fs_watch *w)
+{
+	int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME
+		| FAN_NONBLOCK | FAN_CLOEXEC, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+	if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+			WATCH_FANOTIFY_MASK, AT_FDCWD, w->root) == -1
+			|| (w->mount_fd = open(w->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+		close(fd);
+		return -1;
+	}
+	w->fd = fd;
+	w->fanotify = true;
+	return 0;
+}
+
+static uint32_t watch_fanotify_flags(uint64_t mask)
+{
+	return (mask & FAN_CREATE ? WATCH_CREATED : 0)
+		| (mask & FAN_MODIFY ? WATCH_MODIFIED : 0)
+		| (mask & FAN_DELETE ? WATCH_DELETED : 0)
+		| (mask & FAN_MOVED_FROM ? WATCH_MOVED_FROM : 0)
+		| (mask & FAN_MOVED_TO ? WATCH_MOVED_TO : 0)
+		| (mask & FAN_ATTRIB ? WATCH_ATTRIB : 0)
+		| (mask & FAN_CLOSE_WRITE ? WATCH_CLOSE_WRITE : 0)
+		| (mask & FAN_ONDIR ? WATCH_DIRECTORY : 0);
+}
+
+static void watch_fanotify_event(struct fs_watch *w, struct fanotify_event_metadata *md)
+{
+	if (md->mask & FAN_Q_OVERFLOW) {
+		w->overflow = true;
+		watch_arm(w);
+		return;
+	}
+
+	struct fanotify_event_info_fid *fid = (void *)((char *)md + md->metadata_len);
+	if (md->event_len < md->metadata_len + sizeof(*fid)
+			|| fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+		return;
+	}
+	struct file_handle *fh = (struct file_handle *)fid->handle;
+	const char *name = (const char *)fh->f_handle + fh->handle_bytes;
+
+	/*
+	 * The directory is named by its handle, so its path is what the
+	 * kernel gives for a descriptor opened from it
+	 */
+	int dfd = open_by_handle_at(w->mount_fd, fh, O_PATH | O_CLOEXEC);
+	if (dfd == -1) {
+		// Gone already
+		return;
+	}
+	char link[64], dir[PATH_MAX];
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", dfd);
+	ssize_t len = readlink(link, dir, sizeof(dir) - 1);
+	close(dfd);
+	if (len <= 0) {
+		return;
+	}
+	dir[len] = '\0';
+
+	const char *rel = watch_relative(w, dir);
+	if (rel == NULL || (!w->recursive && *rel)) {
+		return;
+	}
+	char *path = strcmp(name, ".") ? watch_join(rel, name) : strdup(rel);
+	if (path) {
+		watch_note(w, path, watch_fanotify_flags(md->mask));
+		free(path);
+	}
+}
+#endif
+
+static void watch_read_cb(struct ev_loop *loop, struct ev_io *io, int revents)
+{
+	struct fs_watch *w = io->data;
+	char buf[WATCH_READ_LEN] __attribute__((aligned(8)));
+	ssize_t n;
+
+	while ((n = read(w->fd, buf, sizeof(buf))) > 0) {
+#ifdef FAN_REPORT_DFID_NAME
+		if (w->fanotify) {
+			struct fanotify_event_metadata *md = (void *)buf;
+			for (; FAN_EVENT_OK(md, n); md = FAN_EVENT_NEXT(md, n)) {
+				watch_fanotify_event(w, md);
+				if (md->fd >= 0) {
+					close(md->fd);
+				}
+			}
+			continue;
+		}
+#endif
+		for (char *p = buf; p < buf + n; ) {
+			struct inotify_event *ev = (void *)p;
+			watch_inotify_event(w, ev);
+			p += sizeof(*ev) + ev->len;
+		}
+	}
+}
+
+static void watch_free(struct fs_watch *w)
+{
+	ev_io_stop(w->loop, &w->read_event);
+	ev_timer_stop(w->loop, &w->delay_timer);
+
+	struct watch_dir *d, *dtmp;
+	HASH_ITER(hh, w->dirs, d, dtmp) {
+		HASH_DEL(w->dirs, d);
+		free(d->path);
+		free(d);
+	}
+	struct watch_event *e, *etmp;
+	HASH_ITER(hh, w->pending, e, etmp) {
+		HASH_DEL(w->pending, e);
+		free(e);
+	}
+	if (w->fd != -1) {
+		close(w->fd);
+	}
+	if (w->mount_fd != -1) {
+		close(w->mount_fd);
+	}
+	free(w->root);
+	free(w);
+}
+
+static int watch_new(struct tlv_handler_ctx *ctx, struct channel *c)
+{
+	struct mettle *m = ctx->arg;
+	char *path = tlv_packet_get_str(ctx->req, TLV_TYPE_FILE_PATH);
+	if (path == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct fs_watch *w = calloc(1, sizeof(*w));
+	if (w == NULL) {
+		return -1;
+	}
+	w->channel = c;
+	w->loop = mettle_get_loop(m);
+	w->fd = w->mount_fd = -1;
+	ev_io_init(&w->read_event, watch_read_cb, -1, EV_READ);
+	w->read_event.data = w;
+	ev_timer_init(&w->delay_timer, watch_delay_cb, 0, 0);
+	w->delay_timer.data = w;
+
+	uint32_t max_watches = WATCH_MAX_DEFAULT, delay_ms = WATCH_DELAY_DEFAULT_MS;
+	bool use_fanotify = false;
+	tlv_packet_get_bool(ctx->req, TLV_TYPE_WATCH_RECURSIVE, &w->recursive);
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_WATCH_MAX, &max_watches);
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_WATCH_DELAY, &delay_ms);
+	tlv_packet_get_bool(ctx->req, TLV_TYPE_WATCH_FANOTIFY, &use_fanotify);
+	w->max_watches = TYPESAFE_MAX(TYPESAFE_MIN(max_watches, WATCH_MAX_LIMIT), 1);
+	w->delay = TYPESAFE_MIN(delay_ms, WATCH_DELAY_MAX_MS) / 1000.0;
+
+	// Paths are matched against what the kernel reports, so start from its own
+	struct stat st;
+	if ((w->root = realpath(path, NULL)) == NULL || stat(w->root, &st) == -1) {
+		goto err;
+	}
+	w->root_len = strlen(w->root);
+
+#ifdef FAN_REPORT_DFID_NAME
+	if (use_fanotify && S_ISDIR(st.st_mode) && watch_fanotify_open(w) == -1) {
+		log_info("fanotify unavailable for %s (%s), using inotify",
+			w->root, strerror(errno));
+	}
+#endif
+	if (!w->fanotify) {
+		if ((w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+			goto err;
+		}
+		/*
+		 * The tree is walked here, at most max_watches directories of it,
+		 * so that no change is missed once the channel is open
+		 */
+		watch_add_tree(w, "", false);
+		if (HASH_COUNT(w->dirs) == 0) {
+			goto err;
+		}
+	}
+
+	ev_io_set(&w->read_event, w->fd, EV_READ);
+	ev_io_start(w->loop, &w->read_event);
+	channel_set_ctx(c, w);
+	channel_set_interactive(c, true);
+	return 0;
+
+err:
+	{
+		int err = errno;
+		watch_free(w);
+		errno = err;
+	}
+	return -1;
+}
+
+/*
+ * While the link is backed up events are left with the kernel, which
+ * reports an overflow once its queue fills
+ */
+static void watch_flow(struct channel *c, bool paused)
+{
+	struct fs_watch *w = channel_get_ctx(c);
+	if (w == NULL) {
+		return;
+	}
+	if (paused) {
+		ev_io_stop(w->loop, &w->read_event);
+	} else {
+		ev_io_start(w->loop, &w->read_event);
+	}
+}
+
+static int watch_channel_free(struct channel *c)
+{
+	struct fs_watch *w = channel_get_ctx(c);
+	if (w) {
+		watch_free(w);
+	}
+	return 0;
+}
+#endif
+
+void fs_watch_register_handlers(struct mettle *m)
+{
+#ifdef __linux__
+	struct channelmgr *cm = mettle_get_channelmgr(m);
+
+	struct channel_callbacks cbs = {
+		.new_cb = watch_new,
+		.free_cb = watch_channel_free,
+		.flow_cb = watch_flow,
+	};
+	channelmgr_add_channel_type(cm, "stdapi_fs_watch", &cbs);
+#endif
+}
@@ -103,6 +103,16 @@ tcp_client_new(struct tlv_handler_ctx *ctx, struct channel *c)
 
 	tlv_packet_get_u32(ctx->req, TLV_TYPE_CONNECT_RETRIES, &retries);
 
+	/*
+	 * Forwarded connections are taken to be interactive unless the
+	 * client says they carry bulk data
+	 */
+	uint32_t profile = BUFFEREV_SOCK_INTERACTIVE;
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_SOCKET_PROFILE, &profile);
+	if (profile > BUFFEREV_SOCK_C2) {
+		profile = BUFFEREV_SOCK_DEFAULT;
+	}
+
 	struct tcp_client_channel *tcc = calloc(1, sizeof(*tcc));
 	if (tcc == NULL) {
 		goto err;
@@ -129,6 +139,7 @@ tcp_client_new(struct tlv_handler_ctx *ctx, struct channel *c)
 		network_client_set_src(tcc->nc, src_host, src_port);
 	}
 	network_client_set_retries(tcc->nc, tcc->retries);
+	network_client_set_sock_profile(tcc->nc, profile);
 	network_client_start(tcc->nc);
 
 	channel_set_ctx(c, tcc);
@@ -168,6 +179,20 @@ tcp_client_free(struct channel *c)
 	return 0;
 }
 
+static void
+tcp_client_flow(struct channel *c, bool paused)
+{
+	struct tcp_client_channel *tcc = channel_get_ctx(c);
+	network_client_set_read_paused(tcc->nc, paused);
+}
+
+static void
+tcp_client_rate(struct channel *c, uint64_t rx_rate, uint64_t tx_rate)
+{
+	struct tcp_client_channel *tcc = channel_get_ctx(c);
+	network_client_set_rate_limit(tcc->nc, rx_rate, tx_rate);
+}
+
 static struct tlv_packet *
 tcp_shutdown(struct tlv_handler_ctx *ctx)
 {
@@ -187,10 +212,20 @@ tcp_shutdown(struct tlv_handler_ctx *ctx)
 	return tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
 }
 
+/*
+ * With TLV_TYPE_DATAGRAM_BATCH set when the channel opens, received
+ * datagrams are sent up to that many per write request, each in a
+ * TLV_TYPE_DATAGRAM group, and a request is cut short past
+ * UDP_CLIENT_BATCH_LEN bytes
+ */
+#define UDP_CLIENT_BATCH_MAX 256
+#define UDP_CLIENT_BATCH_LEN (64 * 1024)
+
 struct udp_client_channel {
 	struct channel *channel;
 	struct network_client *nc;
 	struct tlv_handler_ctx *tlv_ctx;
+	uint32_t batch;
 };
 
 static void
@@ -204,12 +239,56 @@ udp_client_channel_free(struct udp_client_channel *ucc)
 	}
 }
 
+static void
+udp_client_channel_read_batched(struct udp_client_channel *ucc, struct bufferev *be)
+{
+	struct tlv_packet *values = NULL;
+	size_t len, values_len = 0;
+	uint32_t count = 0;
+	struct bufferev_udp_msg *msg;
+
+	while ((msg = bufferev_read_msg(be, &len))) {
+		uint16_t peer_port = 0;
+		char * peer_host = bufferev_get_udp_msg_peer_addr(msg, &peer_port);
+
+		if (peer_host) {
+			if (values == NULL) {
+				values = tlv_packet_new(0, 0);
+			}
+			struct tlv_packet *p = tlv_packet_new(TLV_TYPE_DATAGRAM, msg->buf_len + 64);
+			p = tlv_packet_add_raw(p, TLV_TYPE_CHANNEL_DATA, msg->buf, msg->buf_len);
+			p = tlv_packet_add_str(p, TLV_TYPE_PEER_HOST, peer_host);
+			p = tlv_packet_add_u32(p, TLV_TYPE_PEER_PORT, peer_port);
+			values = tlv_packet_add_child(values, p);
+			values_len += msg->buf_len;
+			count++;
+		}
+		free(peer_host);
+		free(msg);
+
+		if (values && (count == ucc->batch || values_len >= UDP_CLIENT_BATCH_LEN)) {
+			channel_enqueue_values(ucc->channel, values, values_len);
+			values = NULL;
+			values_len = count = 0;
+		}
+	}
+	if (values) {
+		channel_enqueue_values(ucc->channel, values, values_len);
+	}
+}
+
 static void
 udp_client_channel_read_cb(struct bufferev *be, void *arg)
 {
 	struct udp_client_channel *ucc = arg;
 	size_t len;
 	struct bufferev_udp_msg *msg;
+
+	if (ucc->batch > 1) {
+		udp_client_channel_read_batched(ucc, be);
+		return;
+	}
+
 	while ((msg = bufferev_read_msg(be, &len))) {
 		uint16_t peer_port = 0;
 		char * peer_host = bufferev_get_udp_msg_peer_addr(msg, &peer_port);
@@ -221,6 +300,7 @@ udp_client_channel_read_cb(struct bufferev *be, void *arg)
 			channel_enqueue_ex(ucc->channel, msg->buf, msg->buf_len, p);
 		}
 		free(peer_host);
+		free(msg);
 	}
 }
 
@@ -278,6 +358,10 @@ udp_client_new(struct tlv_handler_ctx *ctx, struct channel *c)
 
 	uc->tlv_ctx = ctx;
 	uc->channel = c;
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_DATAGRAM_BATCH, &uc->batch);
+	if (uc->batch > UDP_CLIENT_BATCH_MAX) {
+		uc->batch = UDP_CLIENT_BATCH_MAX;
+	}
 
 	uc->nc = network_client_new(mettle_get_loop(m));
 	if (uc->nc == NULL) {
@@ -330,6 +414,17 @@ udp_client_write(struct channel *c, void *buf, size_t len)
 			TYPESAFE_MIN(len, IP_LEN_MAX - IP_HDR_LEN - UDP_HDR_LEN));
 }
 
+static ssize_t
+udp_client_write_msgs(struct channel *c, struct iovec *msgs, int count)
+{
+	struct udp_client_channel *ucc = channel_get_ctx(c);
+	for (int i = 0; i < count; i++) {
+		msgs[i].iov_len = TYPESAFE_MIN(msgs[i].iov_len,
+				IP_LEN_MAX - IP_HDR_LEN - UDP_HDR_LEN);
+	}
+	return network_client_write_msgs(ucc->nc, msgs, count);
+}
+
 static int
 udp_client_free(struct channel *c)
 {
@@ -341,6 +436,20 @@ udp_client_free(struct channel *c)
 	return 0;
 }
 
+static void
+udp_client_flow(struct channel *c, bool paused)
+{
+	struct udp_client_channel *ucc = channel_get_ctx(c);
+	network_client_set_read_paused(ucc->nc, paused);
+}
+
+static void
+udp_client_rate(struct channel *c, uint64_t rx_rate, uint64_t tx_rate)
+{
+	struct udp_client_channel *ucc = channel_get_ctx(c);
+	network_client_set_rate_limit(ucc->nc, rx_rate, tx_rate);
+}
+
 void net_client_register_handlers(struct mettle *m)
 {
 	struct tlv_dispatcher *td = mettle_get_tlv_dispatcher(m);
@@ -351,6 +460,8 @@ void net_client_register_handlers(struct mettle *m)
 		.read_cb = tcp_client_read,
 		.write_cb = tcp_client_write,
 		.free_cb = tcp_client_free,
+		.flow_cb = tcp_client_flow,
+		.rate_cb = tcp_client_rate,
 	};
 	channelmgr_add_channel_type(cm, "stdapi_net_tcp_client", &tcp_client_cbs);
 	tlv_dispatcher_add_handler(td, "stdapi_net_socket_tcp_shutdown", tcp_shutdown, m);
@@ -359,7 +470,10 @@ void net_client_register_handlers(struct mettle *m)
 		.new_async_cb = udp_client_new,
 		.read_cb = udp_client_read,
 		.write_cb = udp_client_write,
+		.write_msgs_cb = udp_client_write_msgs,
 		.free_cb = udp_client_free,
+		.flow_cb = udp_client_flow,
+		.rate_cb = udp_client_rate,
 	};
 	channelmgr_add_channel_type(cm, "stdapi_net_udp_client", &udp_client_cbs);
 }
@@ -79,15 +79,6 @@ static int add_intf_info(const struct intf_entry *entry, void *arg)
 	return 0;
 }
 
-struct tlv_packet *net_config_get_interfaces(struct tlv_handler_ctx *ctx)
-{
-	struct tlv_packet *p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
-	intf_t *i = intf_open();
-	intf_loop(i, add_intf_info, &p);
-	intf_close(i);
-	return p;
-}
-
 static bool is_link_local_route(const struct addr *a)
 {
 	return a->addr_type == ADDR_TYPE_IP6 &&
@@ -116,9 +107,432 @@ static int add_route_info(const struct route_entry *entry, void *arg)
 	return 0;
 }
 
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "metrics.h"
+
+/*
+ * On Linux, interfaces and routes are dumped over rtnetlink, and the groups
+ * built from a dump are kept until the kernel announces a link, address or
+ * route change. The loop only drains those announcements and bumps
+ * rtnl_generation; the serial handlers rebuild on the next request after.
+ */
+#define RTNL_BUF_LEN (32 * 1024)
+
+static unsigned rtnl_generation;
+static bool rtnl_watching;
+static ev_io rtnl_watcher;
+
+struct rtnl_cache {
+	pthread_mutex_t mutex;
+	struct tlv_packet *groups;
+	unsigned generation;
+};
+
+static struct rtnl_cache intf_cache = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+static struct rtnl_cache route_cache = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static struct metric *rtnl_hits, *rtnl_dumps;
+
+static void *grow_array(void *array, size_t *max, size_t size)
+{
+	size_t new_max = *max ? *max * 2 : 256;
+	void *new_array = reallocarray(array, new_max, size);
+	if (new_array) {
+		*max = new_max;
+	}
+	return new_array;
+}
+
+/*
+ * Sends a dump request for 'type' and hands each message of the reply to
+ * 'cb'. Returns -1 if the dump could not be had or 'cb' failed.
+ */
+static int rtnl_dump(int type, int (*cb)(struct nlmsghdr *h, void *arg), void *arg)
+{
+	int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd == -1) {
+		return -1;
+	}
+
+	struct {
+		struct nlmsghdr nlh;
+		struct rtgenmsg g;
+	} msg = {
+		.nlh = {
+			.nlmsg_len = sizeof(msg),
+			.nlmsg_type = type,
+			.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+			.nlmsg_seq = 1,
+		},
+		.g = { .rtgen_family = AF_UNSPEC },
+	};
+	struct sockaddr_nl nladdr = { .nl_family = AF_NETLINK };
+	int rc = -1;
+	char *buf = NULL;
+	if (sendto(fd, &msg, sizeof(msg), 0,
+			(struct sockaddr *)&nladdr, sizeof(nladdr)) == -1) {
+		goto out;
+	}
+
+	buf = malloc(RTNL_BUF_LEN);
+	if (buf == NULL) {
+		goto out;
+	}
+
+	metric_add(rtnl_dumps, 1);
+	for (;;) {
+		ssize_t len = recv(fd, buf, RTNL_BUF_LEN, 0);
+		if (len <= 0) {
+			goto out;
+		}
+		for (struct nlmsghdr *h = (struct nlmsghdr *)buf; NLMSG_OK(h, len);
+				h = NLMSG_NEXT(h, len)) {
+			if (h->nlmsg_type == NLMSG_DONE) {
+				rc = 0;
+				goto out;
+			}
+			if (h->nlmsg_type == NLMSG_ERROR || cb(h, arg) == -1) {
+				goto out;
+			}
+		}
+	}
+out:
+	free(buf);
+	close(fd);
+	return rc;
+}
+
+static void rtnl_addr(struct addr *a, int family, const void *data, uint16_t bits)
+{
+	memset(a, 0, sizeof(*a));
+	if (family == AF_INET) {
+		a->addr_type = ADDR_TYPE_IP;
+		if (data) {
+			memcpy(&a->addr_ip, data, IP_ADDR_LEN);
+		}
+	} else {
+		a->addr_type = ADDR_TYPE_IP6;
+		if (data) {
+			memcpy(&a->addr_ip6, data, IP6_ADDR_LEN);
+		}
+	}
+	a->addr_bits = bits;
+}
+
+/*
+ * Links are turned into the same intf_entry libdnet fills in, aliases and
+ * all, so that add_intf_info responds exactly as it does through libdnet
+ */
+struct rtnl_links {
+	struct intf_entry **entries;
+	size_t num_entries, max_entries;
+};
+
+static struct intf_entry **rtnl_find_link(struct rtnl_links *l, uint32_t index)
+{
+	for (size_t i = 0; i < l->num_entries; i++) {
+		if (l->entries[i]->intf_index == index) {
+			return &l->entries[i];
+		}
+	}
+	return NULL;
+}
+
+static void rtnl_free_links(struct rtnl_links *l)
+{
+	for (size_t i = 0; i < l->num_entries; i++) {
+		free(l->entries[i]);
+	}
+	free(l->entries);
+}
+
+static uint16_t rtnl_intf_flags(unsigned flags)
+{
+	uint16_t intf_flags = 0;
+	if (flags & IFF_UP)
+		intf_flags |= INTF_FLAG_UP;
+	if (flags & IFF_LOOPBACK)
+		intf_flags |= INTF_FLAG_LOOPBACK;
+	if (flags & IFF_POINTOPOINT)
+		intf_flags |= INTF_FLAG_POINTOPOINT;
+	if (flags & IFF_NOARP)
+		intf_flags |= INTF_FLAG_NOARP;
+	if (flags & IFF_BROADCAST)
+		intf_flags |= INTF_FLAG_BROADCAST;
+	if (flags & IFF_MULTICAST)
+		intf_flags |= INTF_FLAG_MULTICAST;
+	return intf_flags;
+}
+
+static int rtnl_add_link(struct nlmsghdr *h, void *arg)
+{
+	struct rtnl_links *l = arg;
+	if (h->nlmsg_type != RTM_NEWLINK) {
+		return 0;
+	}
+
+	if (l->num_entries == l->max_entries) {
+		void *entries = grow_array(l->entries, &l->max_entries,
+			sizeof(struct intf_entry *));
+		if (entries == NULL) {
+			return -1;
+		}
+		l->entries = entries;
+	}
+	struct intf_entry *e = calloc(1, sizeof(*e));
+	if (e == NULL) {
+		return -1;
+	}
+	l->entries[l->num_entries++] = e;
+
+	struct ifinfomsg *ifi = NLMSG_DATA(h);
+	e->intf_len = sizeof(*e);
+	e->intf_index = ifi->ifi_index;
+	e->intf_flags = rtnl_intf_flags(ifi->ifi_flags);
+
+	int len = IFLA_PAYLOAD(h);
+	for (struct rtattr *a = IFLA_RTA(ifi); RTA_OK(a, len); a = RTA_NEXT(a, len)) {
+		if (a->rta_type == IFLA_IFNAME) {
+			strlcpy(e->intf_name, RTA_DATA(a), sizeof(e->intf_name));
+		} else if (a->rta_type == IFLA_MTU && RTA_PAYLOAD(a) >= sizeof(uint32_t)) {
+			memcpy(&e->intf_mtu, RTA_DATA(a), sizeof(uint32_t));
+		} else if (a->rta_type == IFLA_ADDRESS && RTA_PAYLOAD(a) == ETH_ADDR_LEN) {
+			e->intf_link_addr.addr_type = ADDR_TYPE_ETH;
+			e->intf_link_addr.addr_bits = ETH_ADDR_BITS;
+			memcpy(&e->intf_link_addr.addr_eth, RTA_DATA(a), ETH_ADDR_LEN);
+		}
+	}
+	return 0;
+}
+
+static int rtnl_add_intf_addr(struct nlmsghdr *h, void *arg)
+{
+	struct rtnl_links *l = arg;
+	if (h->nlmsg_type != RTM_NEWADDR) {
+		return 0;
+	}
+
+	struct ifaddrmsg *ifa = NLMSG_DATA(h);
+	struct intf_entry **link = rtnl_find_link(l, ifa->ifa_index);
+	if (link == NULL ||
+			(ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6)) {
+		return 0;
+	}
+
+	struct rtattr *local = NULL, *address = NULL;
+	int len = IFA_PAYLOAD(h);
+	for (struct rtattr *a = IFA_RTA(ifa); RTA_OK(a, len); a = RTA_NEXT(a, len)) {
+		if (a->rta_type == IFA_LOCAL) {
+			local = a;
+		} else if (a->rta_type == IFA_ADDRESS) {
+			address = a;
+		}
+	}
+	// On point to point links IFA_ADDRESS is the peer's
+	struct rtattr *a = local ? local : address;
+	if (a == NULL) {
+		return 0;
+	}
+	struct addr addr;
+	rtnl_addr(&addr, ifa->ifa_family, RTA_DATA(a), ifa->ifa_prefixlen);
+
+	// The dump has IPv4 addresses first, so one of them is the primary
+	struct intf_entry *e = *link;
+	if (e->intf_addr.addr_type == ADDR_TYPE_NONE) {
+		e->intf_addr = addr;
+		return 0;
+	}
+	size_t entry_len = sizeof(*e) + (e->intf_alias_num + 1) * sizeof(struct addr);
+	e = realloc(e, entry_len);
+	if (e == NULL) {
+		return -1;
+	}
+	*link = e;
+	e->intf_alias_addrs[e->intf_alias_num++] = addr;
+	e->intf_len = entry_len;
+	return 0;
+}
+
+static int rtnl_build_interfaces(struct tlv_packet **groups)
+{
+	struct rtnl_links l = { 0 };
+	int rc = -1;
+	if (rtnl_dump(RTM_GETLINK, rtnl_add_link, &l) == 0 &&
+			rtnl_dump(RTM_GETADDR, rtnl_add_intf_addr, &l) == 0) {
+		for (size_t i = 0; i < l.num_entries; i++) {
+			add_intf_info(l.entries[i], groups);
+		}
+		rc = 0;
+	}
+	rtnl_free_links(&l);
+	return rc;
+}
+
+struct rtnl_routes {
+	struct rtnl_links links;
+	struct tlv_packet **groups;
+};
+
+static int rtnl_add_route(struct nlmsghdr *h, void *arg)
+{
+	struct rtnl_routes *r = arg;
+	if (h->nlmsg_type != RTM_NEWROUTE) {
+		return 0;
+	}
+
+	// Only what libdnet reads from /proc: unicast routes of the main table
+	struct rtmsg *rtm = NLMSG_DATA(h);
+	if (rtm->rtm_type != RTN_UNICAST ||
+			(rtm->rtm_family != AF_INET && rtm->rtm_family != AF_INET6)) {
+		return 0;
+	}
+
+	struct route_entry entry = { 0 };
+	uint16_t addr_bits = rtm->rtm_family == AF_INET ? IP_ADDR_BITS : IP6_ADDR_BITS;
+	rtnl_addr(&entry.route_dst, rtm->rtm_family, NULL, rtm->rtm_dst_len);
+	rtnl_addr(&entry.route_gw, rtm->rtm_family, NULL, addr_bits);
+
+	uint32_t table = rtm->rtm_table, oif = 0;
+	int len = RTM_PAYLOAD(h);
+	for (struct rtattr *a = RTM_RTA(rtm); RTA_OK(a, len); a = RTA_NEXT(a, len)) {
+		if (a->rta_type == RTA_DST) {
+			rtnl_addr(&entry.route_dst, rtm->rtm_family, RTA_DATA(a), rtm->rtm_dst_len);
+		} else if (a->rta_type == RTA_GATEWAY) {
+			rtnl_addr(&entry.route_gw, rtm->rtm_family, RTA_DATA(a), addr_bits);
+		} else if (a->rta_type == RTA_OIF) {
+			memcpy(&oif, RTA_DATA(a), sizeof(oif));
+		} else if (a->rta_type == RTA_PRIORITY) {
+			memcpy(&entry.metric, RTA_DATA(a), sizeof(entry.metric));
+		} else if (a->rta_type == RTA_TABLE) {
+			memcpy(&table, RTA_DATA(a), sizeof(table));
+		}
+	}
+	if (table != RT_TABLE_MAIN) {
+		return 0;
+	}
+
+	struct intf_entry **link = rtnl_find_link(&r->links, oif);
+	if (link) {
+		strlcpy(entry.intf_name, (*link)->intf_name, sizeof(entry.intf_name));
+	}
+	add_route_info(&entry, r->groups);
+	return 0;
+}
+
+static int rtnl_build_routes(struct tlv_packet **groups)
+{
+	struct rtnl_routes r = { .groups = groups };
+	int rc = -1;
+	if (rtnl_dump(RTM_GETLINK, rtnl_add_link, &r.links) == 0 &&
+			rtnl_dump(RTM_GETROUTE, rtnl_add_route, &r) == 0) {
+		rc = 0;
+	}
+	rtnl_free_links(&r.links);
+	return rc;
+}
+
+/*
+ * Adds the cached groups to 'p', dumping them again first if the kernel has
+ * announced a change since, or every time if nothing is watching for one.
+ * Returns false, having added nothing, if rtnetlink could not be dumped.
+ */
+static bool rtnl_add_cached(struct rtnl_cache *c,
+	int (*build)(struct tlv_packet **groups), struct tlv_packet **p)
+{
+	bool added = false;
+	pthread_mutex_lock(&c->mutex);
+
+	// Read before dumping, so that a change racing the dump forces another
+	unsigned generation = __atomic_load_n(&rtnl_generation, __ATOMIC_ACQUIRE);
+	if (c->groups == NULL || c->generation != generation || !rtnl_watching) {
+		struct tlv_packet *groups = tlv_packet_new(0, 0);
+		if (build(&groups) == -1 || groups == NULL) {
+			tlv_packet_free(groups);
+			goto out;
+		}
+		tlv_packet_free(c->groups);
+		c->groups = groups;
+		c->generation = generation;
+	} else {
+		metric_add(rtnl_hits, 1);
+	}
+
+	*p = tlv_packet_add_values(*p, c->groups);
+	added = true;
+out:
+	pthread_mutex_unlock(&c->mutex);
+	return added;
+}
+
+static void rtnl_changed_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+	char buf[4096];
+
+	// What changed does not matter, and messages lost to ENOBUFS are changes too
+	while (recv(w->fd, buf, sizeof(buf), MSG_DONTWAIT) > 0 || errno == ENOBUFS);
+	__atomic_add_fetch(&rtnl_generation, 1, __ATOMIC_RELEASE);
+}
+
+static void rtnl_watch(struct ev_loop *loop)
+{
+	/*
+	 * Sessions hosted by one process share the caches
+	 */
+	if (rtnl_watching) {
+		return;
+	}
+	rtnl_hits = metric_counter("net_config.cache_hits");
+	rtnl_dumps = metric_counter("net_config.rtnl_dumps");
+
+	int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+		NETLINK_ROUTE);
+	if (fd == -1) {
+		return;
+	}
+	struct sockaddr_nl nladdr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR |
+			RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE,
+	};
+	if (bind(fd, (struct sockaddr *)&nladdr, sizeof(nladdr)) == -1) {
+		log_debug("cannot watch rtnetlink, not caching: %s", strerror(errno));
+		close(fd);
+		return;
+	}
+	ev_io_init(&rtnl_watcher, rtnl_changed_cb, fd, EV_READ);
+	ev_io_start(loop, &rtnl_watcher);
+	rtnl_watching = true;
+}
+#endif
+
+struct tlv_packet *net_config_get_interfaces(struct tlv_handler_ctx *ctx)
+{
+	struct tlv_packet *p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+#ifdef __linux__
+	if (rtnl_add_cached(&intf_cache, rtnl_build_interfaces, &p)) {
+		return p;
+	}
+#endif
+	intf_t *i = intf_open();
+	intf_loop(i, add_intf_info, &p);
+	intf_close(i);
+	return p;
+}
+
 struct tlv_packet *net_config_get_routes(struct tlv_handler_ctx *ctx)
 {
 	struct tlv_packet *p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+#ifdef __linux__
+	if (rtnl_add_cached(&route_cache, rtnl_build_routes, &p)) {
+		return p;
+	}
+#endif
 	route_t *r = route_open();
 	route_loop(r, add_route_info, &p);
 	route_close(r);
@@ -151,13 +565,28 @@ typedef enum {
 	UPDATE_ROUTE_REMOVE
 } update_route_action_t;
 
+struct update_route_req {
+	const char *subnet;
+	const char *netmask;
+	const char *gateway;
+};
+
+static const struct tlv_field update_route_schema[] = {
+	TLV_FIELD_REQUIRED(TLV_TYPE_SUBNET_STRING, TLV_FIELD_STR, struct update_route_req, subnet),
+	TLV_FIELD(TLV_TYPE_NETMASK_STRING, TLV_FIELD_STR, struct update_route_req, netmask),
+	TLV_FIELD_REQUIRED(TLV_TYPE_GATEWAY_STRING, TLV_FIELD_STR, struct update_route_req, gateway),
+};
+
 static
 int update_route(struct tlv_packet *p, update_route_action_t action)
 {
+	struct update_route_req req = { 0 };
+	if (tlv_packet_decode(p, update_route_schema,
+			COUNT_OF(update_route_schema), &req) == -1) {
+		return TLV_RESULT_EINVAL;
+	}
+
 	int ret_val = TLV_RESULT_SUCCESS;
-	const char *subnet_str = tlv_packet_get_str(p, TLV_TYPE_SUBNET_STRING);
-	const char *netmask_str = tlv_packet_get_str(p, TLV_TYPE_NETMASK_STRING);
-	const char *gateway_str = tlv_packet_get_str(p, TLV_TYPE_GATEWAY_STRING);
 
 	route_t *r = route_open();
 	if (!r) {
@@ -167,24 +596,24 @@ int update_route(struct tlv_packet *p, update_route_action_t action)
 
 	struct route_entry entry;
 	memset(&entry, 0, sizeof(entry));
-	if (addr_pton(subnet_str, &entry.route_dst)) {
+	if (addr_pton(req.subnet, &entry.route_dst)) {
 		ret_val = TLV_RESULT_EINVAL;
 		goto done;
 	}
-	if (netmask_str && strlen(netmask_str)) {
+	if (req.netmask && strlen(req.netmask)) {
 		if (entry.route_dst.addr_type == ADDR_TYPE_IP) {
 			ip_addr_t mask;
-			if (ip_pton(netmask_str, &mask) == 0) {
+			if (ip_pton(req.netmask, &mask) == 0) {
 				addr_mtob(&mask, sizeof(mask), &entry.route_dst.addr_bits);
 			}
 		} else if (entry.route_dst.addr_type == ADDR_TYPE_IP6) {
 			ip6_addr_t mask;
-			if (ip6_pton(netmask_str, &mask) == 0) {
+			if (ip6_pton(req.netmask, &mask) == 0) {
 				addr_mtob(&mask, sizeof(mask), &entry.route_dst.addr_bits);
 			}
 		}
 	}
-	if (addr_pton(gateway_str, &entry.route_gw)) {
+	if (addr_pton(req.gateway, &entry.route_gw)) {
 		ret_val = TLV_RESULT_EINVAL;
 		goto done;
 	}
@@ -239,14 +668,327 @@ const char * const udp_connection_states[] = {
    "", "ESTABLISHED", "", "", "", "", "", "", "", "", "", "", "UNKNOWN"
 };
 
-static
-void get_netstat_async(struct eio_req *req)
+/*
+ * TLV_TYPE_NETSTAT_STATES optionally limits TCP sockets to those in the
+ * states set as (1 << state) bits, using the numbering of the tables above
+ */
+static bool netstat_state_wanted(uint32_t states, bool tcp, unsigned state)
+{
+	return !tcp || state >= 32 || (states & (1U << state));
+}
+
+static struct tlv_packet *netstat_entry(struct addr *local_addr,
+	struct addr *remote_addr, unsigned local_port, unsigned remote_port,
+	bool tcp, unsigned state, uint32_t uid)
+{
+	struct tlv_packet *p = tlv_packet_new(TLV_TYPE_NETSTAT_ENTRY, 0);
+
+	if (local_addr->addr_type) {
+		p = tlv_packet_add_addr(p, TLV_TYPE_LOCAL_HOST_RAW, 0, 0, local_addr);
+		p = tlv_packet_add_addr(p, TLV_TYPE_PEER_HOST_RAW, 0, 0, remote_addr);
+	}
+
+	p = tlv_packet_add_u32(p, TLV_TYPE_LOCAL_PORT, local_port);
+	p = tlv_packet_add_u32(p, TLV_TYPE_PEER_PORT, remote_port);
+
+	if (tcp) {
+		p = tlv_packet_add_str(p, TLV_TYPE_MAC_NAME, "tcp");
+		if (state && state < COUNT_OF(tcp_connection_states)) {
+			p = tlv_packet_add_str(p, TLV_TYPE_SUBNET_STRING,
+					tcp_connection_states[state]);
+		}
+	} else {
+		p = tlv_packet_add_str(p, TLV_TYPE_MAC_NAME, "udp");
+		if (state && state < COUNT_OF(udp_connection_states)) {
+			p = tlv_packet_add_str(p, TLV_TYPE_SUBNET_STRING,
+					udp_connection_states[state]);
+		}
+	}
+
+	/*
+	 * The framework reads the owner's uid from TLV_TYPE_PID, the inode
+	 * from TLV_TYPE_ROUTE_METRIC and "pid/name" from TLV_TYPE_PROCESS_NAME
+	 */
+	p = tlv_packet_add_u32(p, TLV_TYPE_PID, uid);
+	return p;
+}
+
+#ifdef __linux__
+#include <dirent.h>
+#include <linux/inet_diag.h>
+#include <linux/sock_diag.h>
+
+/*
+ * Socket inodes mapped to their owning processes by scanning /proc/<pid>/fd,
+ * kept sorted for bsearch and rescanned once older than NETSTAT_OWNERS_TTL.
+ * Only the serial netstat handler touches it.
+ */
+#define NETSTAT_OWNERS_TTL_US (5 * 1000000ULL)
+
+struct socket_owner {
+	uint32_t inode;
+	uint32_t pid;
+};
+
+struct process_name {
+	uint32_t pid;
+	char name[16];
+};
+
+static struct {
+	struct socket_owner *owners;
+	size_t num_owners, max_owners;
+	struct process_name *names;
+	size_t num_names, max_names;
+	uint64_t scanned_us;
+} netstat_owners;
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void scan_process_fds(uint32_t pid)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%u/fd", pid);
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		return;
+	}
+
+	bool has_sockets = false;
+	struct dirent *ent;
+	while ((ent = readdir(dir))) {
+		char link[64];
+		ssize_t len = readlinkat(dirfd(dir), ent->d_name, link, sizeof(link) - 1);
+		if (len <= 8 || strncmp(link, "socket:[", 8) != 0) {
+			continue;
+		}
+		link[len] = '\0';
+
+		if (netstat_owners.num_owners == netstat_owners.max_owners) {
+			void *owners = grow_array(netstat_owners.owners,
+				&netstat_owners.max_owners, sizeof(struct socket_owner));
+			if (owners == NULL) {
+				break;
+			}
+			netstat_owners.owners = owners;
+		}
+		struct socket_owner *o = &netstat_owners.owners[netstat_owners.num_owners++];
+		o->inode = strtoul(link + 8, NULL, 10);
+		o->pid = pid;
+		has_sockets = true;
+	}
+	closedir(dir);
+
+	if (!has_sockets) {
+		return;
+	}
+	if (netstat_owners.num_names == netstat_owners.max_names) {
+		void *names = grow_array(netstat_owners.names,
+			&netstat_owners.max_names, sizeof(struct process_name));
+		if (names == NULL) {
+			return;
+		}
+		netstat_owners.names = names;
+	}
+	struct process_name *n = &netstat_owners.names[netstat_owners.num_names++];
+	n->pid = pid;
+	n->name[0] = '\0';
+	snprintf(path, sizeof(path), "/proc/%u/comm", pid);
+	FILE *f = fopen(path, "r");
+	if (f) {
+		if (fgets(n->name, sizeof(n->name), f)) {
+			n->name[strcspn(n->name, "\n")] = '\0';
+		}
+		fclose(f);
+	}
+}
+
+static void scan_socket_owners(void)
+{
+	uint64_t now = metric_now_us();
+	if (netstat_owners.scanned_us &&
+			now - netstat_owners.scanned_us < NETSTAT_OWNERS_TTL_US) {
+		return;
+	}
+	netstat_owners.num_owners = netstat_owners.num_names = 0;
+	netstat_owners.scanned_us = now;
+
+	DIR *proc = opendir("/proc");
+	if (proc == NULL) {
+		return;
+	}
+	struct dirent *ent;
+	while ((ent = readdir(proc))) {
+		char *end;
+		unsigned long pid = strtoul(ent->d_name, &end, 10);
+		if (*end == '\0' && pid) {
+			scan_process_fds(pid);
+		}
+	}
+	closedir(proc);
+
+	// Both start with the key they are looked up by
+	qsort(netstat_owners.owners, netstat_owners.num_owners,
+		sizeof(struct socket_owner), compare_u32);
+	qsort(netstat_owners.names, netstat_owners.num_names,
+		sizeof(struct process_name), compare_u32);
+}
+
+static struct tlv_packet *add_socket_owner(struct tlv_packet *p, uint32_t inode)
+{
+	p = tlv_packet_add_u32(p, TLV_TYPE_ROUTE_METRIC, inode);
+
+	struct socket_owner *o = inode ? bsearch(&inode, netstat_owners.owners,
+		netstat_owners.num_owners, sizeof(*o), compare_u32) : NULL;
+	if (o == NULL) {
+		return p;
+	}
+	struct process_name *n = bsearch(&o->pid, netstat_owners.names,
+		netstat_owners.num_names, sizeof(*n), compare_u32);
+	return tlv_packet_add_fmt(p, TLV_TYPE_PROCESS_NAME, "%u/%s",
+		o->pid, n ? n->name : "");
+}
+
+static void diag_addr(struct addr *a, int family, const __be32 *words)
+{
+	memset(a, 0, sizeof(*a));
+	if (family == AF_INET) {
+		a->addr_type = ADDR_TYPE_IP;
+		a->addr_bits = IP_ADDR_BITS;
+		memcpy(&a->addr_ip, words, IP_ADDR_LEN);
+	} else {
+		a->addr_type = ADDR_TYPE_IP6;
+		a->addr_bits = IP6_ADDR_BITS;
+		memcpy(&a->addr_ip6, words, IP6_ADDR_LEN);
+	}
+}
+
+/*
+ * Dumps one family and protocol through NETLINK_SOCK_DIAG, the kernel
+ * leaving out TCP sockets in states not wanted. Returns the number of
+ * sockets added, or -1 if the dump could not be had.
+ */
+static ssize_t sock_diag_dump(struct tlv_handler_ctx *ctx,
+	struct tlv_packet **response, int family, int protocol, uint32_t states)
+{
+	int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+	if (fd == -1) {
+		return -1;
+	}
+
+	struct {
+		struct nlmsghdr nlh;
+		struct inet_diag_req_v2 req;
+	} msg = {
+		.nlh = {
+			.nlmsg_len = sizeof(msg),
+			.nlmsg_type = SOCK_DIAG_BY_FAMILY,
+			.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+			.nlmsg_seq = 1,
+		},
+		.req = {
+			.sdiag_family = family,
+			.sdiag_protocol = protocol,
+			.idiag_states = protocol == IPPROTO_TCP ? states : UINT32_MAX,
+		},
+	};
+	struct sockaddr_nl nladdr = { .nl_family = AF_NETLINK };
+	if (sendto(fd, &msg, sizeof(msg), 0,
+			(struct sockaddr *)&nladdr, sizeof(nladdr)) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	char *buf = tlv_handler_ctx_alloc(ctx, 32 * 1024);
+	if (buf == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	ssize_t count = 0;
+	bool tcp = protocol == IPPROTO_TCP;
+	while (!tlv_handler_ctx_cancelled(ctx)) {
+		ssize_t len = recv(fd, buf, 32 * 1024, 0);
+		if (len <= 0) {
+			count = -1;
+			break;
+		}
+		for (struct nlmsghdr *h = (struct nlmsghdr *)buf; NLMSG_OK(h, len);
+				h = NLMSG_NEXT(h, len)) {
+			if (h->nlmsg_type == NLMSG_DONE) {
+				goto done;
+			}
+			if (h->nlmsg_type == NLMSG_ERROR) {
+				count = count ? count : -1;
+				goto done;
+			}
+			struct inet_diag_msg *d = NLMSG_DATA(h);
+			struct addr local_addr, remote_addr;
+			diag_addr(&local_addr, d->idiag_family, d->id.idiag_src);
+			diag_addr(&remote_addr, d->idiag_family, d->id.idiag_dst);
+			struct tlv_packet *p = netstat_entry(&local_addr, &remote_addr,
+				ntohs(d->id.idiag_sport), ntohs(d->id.idiag_dport),
+				tcp, d->idiag_state, d->idiag_uid);
+			p = add_socket_owner(p, d->idiag_inode);
+			*response = tlv_packet_add_child(*response, p);
+			*response = tlv_packet_response_continue(ctx, *response);
+			count++;
+		}
+	}
+done:
+	close(fd);
+	return count;
+}
+
+/*
+ * Returns -1, having added nothing, if sock_diag is not available
+ */
+static int netstat_sock_diag(struct tlv_handler_ctx *ctx,
+	struct tlv_packet **response, uint32_t states)
+{
+	static const struct {
+		int family;
+		int protocol;
+	} dumps[] = {
+		{ AF_INET, IPPROTO_TCP },
+		{ AF_INET6, IPPROTO_TCP },
+		{ AF_INET, IPPROTO_UDP },
+		{ AF_INET6, IPPROTO_UDP },
+	};
+
+	scan_socket_owners();
+	for (int i = 0; i < COUNT_OF(dumps); i++) {
+		ssize_t count = sock_diag_dump(ctx, response,
+			dumps[i].family, dumps[i].protocol, states);
+		// IPv6 may be compiled out, but IPv4 TCP has to work
+		if (count == -1 && i == 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+#endif
+
+struct tlv_packet *net_config_get_netstat(struct tlv_handler_ctx *ctx)
 {
-	struct tlv_handler_ctx *ctx = req->data;
 	sigar_t *sigar = mettle_get_sigar(ctx->arg);
 	struct tlv_packet *p_response = tlv_packet_response(ctx);
 	int ret_val = TLV_RESULT_SUCCESS;
 
+	uint32_t states = UINT32_MAX;
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_NETSTAT_STATES, &states);
+
+#ifdef __linux__
+	if (netstat_sock_diag(ctx, &p_response, states) == 0) {
+		return tlv_packet_add_result(p_response, ret_val);
+	}
+	log_debug("sock_diag unavailable, falling back to /proc: %s", strerror(errno));
+#endif
+
 	sigar_net_connection_list_t connections;
 	int status = sigar_net_connection_list_get(sigar, &connections,
 			SIGAR_NETCONN_TCP | SIGAR_NETCONN_UDP | \
@@ -262,7 +1004,11 @@ void get_netstat_async(struct eio_req *req)
 		sigar_net_connection_t *connection = &connections.data[i];
 		struct addr local_addr = { 0 };
 		struct addr remote_addr = { 0 };
-		struct tlv_packet *p = tlv_packet_new(TLV_TYPE_NETSTAT_ENTRY, 0);
+		bool tcp = connection->type == SIGAR_NETCONN_TCP;
+
+		if (!netstat_state_wanted(states, tcp, connection->state)) {
+			continue;
+		}
 
 		if (connection->local_address.family == SIGAR_AF_INET) {
 			local_addr.addr_type = remote_addr.addr_type = ADDR_TYPE_IP;
@@ -276,55 +1022,35 @@ void get_netstat_async(struct eio_req *req)
 					sizeof(remote_addr.addr_ip6));
 		}
 
-		if (local_addr.addr_type) {
-			p = tlv_packet_add_addr(p, TLV_TYPE_LOCAL_HOST_RAW, 0, 0, &local_addr);
-			p = tlv_packet_add_addr(p, TLV_TYPE_PEER_HOST_RAW, 0, 0, &remote_addr);
-		}
-
-		p = tlv_packet_add_u32(p, TLV_TYPE_LOCAL_PORT, connection->local_port);
-		p = tlv_packet_add_u32(p, TLV_TYPE_PEER_PORT, connection->remote_port);
-
-		if (connection->type == SIGAR_NETCONN_TCP) {
-			p = tlv_packet_add_str(p, TLV_TYPE_MAC_NAME, "tcp");
-			if (connection->state && connection->state < COUNT_OF(tcp_connection_states)) {
-				p = tlv_packet_add_str(p, TLV_TYPE_SUBNET_STRING,
-						tcp_connection_states[connection->state]);
-			}
-		} else if (connection->type == SIGAR_NETCONN_UDP) {
-			p = tlv_packet_add_str(p, TLV_TYPE_MAC_NAME, "udp");
-			if (connection->state && connection->state < COUNT_OF(udp_connection_states)) {
-				p = tlv_packet_add_str(p, TLV_TYPE_SUBNET_STRING,
-						udp_connection_states[connection->state]);
-			}
-		}
-		p = tlv_packet_add_u32(p, TLV_TYPE_PID, connection->uid);
-
+		struct tlv_packet *p = netstat_entry(&local_addr, &remote_addr,
+				connection->local_port, connection->remote_port,
+				tcp, connection->state, connection->uid);
+		p = tlv_packet_add_u32(p, TLV_TYPE_ROUTE_METRIC, connection->inode);
 		p_response = tlv_packet_add_child(p_response, p);
+		p_response = tlv_packet_response_continue(ctx, p_response);
 	}
 
 	sigar_net_connection_list_destroy(sigar, &connections);
 done:
-	tlv_packet_add_result(p_response, ret_val);
-	tlv_dispatcher_enqueue_response(ctx->td, p_response);
-	tlv_handler_ctx_free(ctx);
+	return tlv_packet_add_result(p_response, ret_val);
 }
 
-struct tlv_packet *net_config_get_netstat(struct tlv_handler_ctx *ctx)
-{
-	struct mettle *m = ctx->arg;
-	eio_custom(get_netstat_async, 0, NULL, ctx);
-	return NULL;
-}
+static const struct tlv_handler_def net_config_handlers[] = {
+	{ "stdapi_net_config_get_interfaces", net_config_get_interfaces },
+	{ "stdapi_net_config_get_routes", net_config_get_routes },
+	{ "stdapi_net_config_add_route", net_config_add_route },
+	{ "stdapi_net_config_remove_route", net_config_remove_route },
+	{ "stdapi_net_config_get_arp_table", net_config_get_arp_table },
+	{ "stdapi_net_config_get_proxy", net_config_get_proxy },
+	{ "stdapi_net_config_get_netstat", net_config_get_netstat },
+};
 
 void net_config_register_handlers(struct mettle *m)
 {
 	struct tlv_dispatcher *td = mettle_get_tlv_dispatcher(m);
 
-	tlv_dispatcher_add_handler(td, "stdapi_net_config_get_interfaces", net_config_get_interfaces, m);
-	tlv_dispatcher_add_handler(td, "stdapi_net_config_get_routes", net_config_get_routes, m);
-	tlv_dispatcher_add_handler(td, "stdapi_net_config_add_route", net_config_add_route, m);
-	tlv_dispatcher_add_handler(td, "stdapi_net_config_remove_route", net_config_remove_route, m);
-	tlv_dispatcher_add_handler(td, "stdapi_net_config_get_arp_table", net_config_get_arp_table, m);
-	tlv_dispatcher_add_handler(td, "stdapi_net_config_get_proxy", net_config_get_proxy, m);
-	tlv_dispatcher_add_handler(td, "stdapi_net_config_get_netstat", net_config_get_netstat, m);
+	tlv_dispatcher_add_handlers(td, net_config_handlers, COUNT_OF(net_config_handlers), m);
+#ifdef __linux__
+	rtnl_watch(mettle_get_loop(m));
+#endif
 }
@@ -0,0 +1,331 @@
+/**
+ * Copyright 2016 Rapid7
+ * @brief Multiplexed TCP stream channel
+ * @file mux.c
+ *
+ * A mux channel carries many TCP streams inside a single mettle channel, so
+ * a SOCKS style pivot pays neither a channel open nor a per-write TLV header
+ * for every connection it forwards. The channel data in both directions is
+ * a sequence of frames, each an 8 byte header followed by its payload:
+ *
+ *   32-bit stream id | 8-bit type | 8-bit flags (zero) | 16-bit payload length
+ *
+ * with every field in network order. Stream ids are chosen by the client.
+ *
+ *   MUX_FRAME_OPEN    client -> target: connect the stream; the payload is
+ *                     the 16-bit port followed by the host name or address
+ *   MUX_FRAME_OPENED  target -> client: the connection is up
+ *   MUX_FRAME_DATA    either way: stream data, which the client may send
+ *                     before OPENED arrives
+ *   MUX_FRAME_CLOSE   either way: the stream is gone
+ *
+ * The target sends exactly one CLOSE for each stream it was asked to open,
+ * whether the connection failed, the peer hung up or the client closed it
+ * first, and the client may reuse the stream id once it has seen that CLOSE.
+ */
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mettle.h>
+
+#include "buffer_queue.h"
+#include "channel.h"
+#include "log.h"
+#include "network_client.h"
+#include "tlv.h"
+#include "util.h"
+#include "uthash.h"
+
+#define MUX_FRAME_OPEN   1
+#define MUX_FRAME_OPENED 2
+#define MUX_FRAME_DATA   3
+#define MUX_FRAME_CLOSE  4
+
+#define MUX_PAYLOAD_MAX 0xffff
+
+#ifdef METTLE_LOW_MEMORY
+#define MUX_STREAMS_MAX 256
+#else
+#define MUX_STREAMS_MAX 4096
+#endif
+
+struct mux_frame_hdr {
+	uint32_t stream_id;
+	uint8_t type;
+	uint8_t flags;
+	uint16_t len;
+} __attribute__((packed));
+
+struct mux_channel;
+
+struct mux_stream {
+	uint32_t id;
+	struct mux_channel *mux;
+	struct network_client *nc;
+	struct buffer_queue *pending;
+	bool connected;
+	UT_hash_handle hh;
+};
+
+struct mux_channel {
+	struct channel *channel;
+	struct ev_loop *loop;
+	struct mux_stream *streams;
+	unsigned num_streams;
+	struct buffer_queue *rx;
+	bool paused;
+	char buf[sizeof(struct mux_frame_hdr) + MUX_PAYLOAD_MAX];
+};
+
+static void mux_send_frame(struct mux_channel *mux, uint32_t id, uint8_t type,
+	void *payload, uint16_t len)
+{
+	struct mux_frame_hdr hdr = {
+		.stream_id = htonl(id),
+		.type = type,
+		.len = htons(len),
+	};
+	memcpy(mux->buf, &hdr, sizeof(hdr));
+	if (len && payload != mux->buf + sizeof(hdr)) {
+		memcpy(mux->buf + sizeof(hdr), payload, len);
+	}
+	channel_enqueue(mux->channel, mux->buf, sizeof(hdr) + len);
+}
+
+static void mux_stream_free(struct mux_stream *s)
+{
+	struct mux_channel *mux = s->mux;
+	HASH_DEL(mux->streams, s);
+	mux->num_streams--;
+	network_client_free(s->nc);
+	buffer_queue_free(s->pending);
+	free(s);
+}
+
+static void mux_stream_close(struct mux_stream *s)
+{
+	mux_send_frame(s->mux, s->id, MUX_FRAME_CLOSE, NULL, 0);
+	mux_stream_free(s);
+}
+
+static void mux_stream_read_cb(struct bufferev *be, void *arg)
+{
+	struct mux_stream *s = arg;
+	struct mux_channel *mux = s->mux;
+	char *payload = mux->buf + sizeof(struct mux_frame_hdr);
+	ssize_t len;
+
+	while ((len = network_client_read(s->nc, payload, MUX_PAYLOAD_MAX)) > 0) {
+		mux_send_frame(mux, s->id, MUX_FRAME_DATA, payload, len);
+	}
+}
+
+static void mux_stream_event_cb(struct bufferev *be, int event, void *arg)
+{
+	struct mux_stream *s = arg;
+
+	if (event & BEV_CONNECTED) {
+		s->connected = true;
+		mux_send_frame(s->mux, s->id, MUX_FRAME_OPENED, NULL, 0);
+		void *data;
+		ssize_t len = buffer_queue_remove_all(s->pending, &data);
+		if (len > 0) {
+			network_client_write(s->nc, data, len);
+			free(data);
+		}
+		if (s->mux->paused) {
+			network_client_set_read_paused(s->nc, true);
+		}
+	} else if (event & (BEV_EOF | BEV_ERROR)) {
+		mux_stream_close(s);
+	}
+}
+
+static void mux_stream_open(struct mux_channel *mux, uint32_t id,
+	char *payload, uint16_t len)
+{
+	struct mux_stream *s = NULL;
+	char *host = NULL, *uri = NULL;
+
+	HASH_FIND(hh, mux->streams, &id, sizeof(id), s);
+	if (s) {
+		log_error("mux stream %u is already open", id);
+		return;
+	}
+
+	if (len < 3 || mux->num_streams >= MUX_STREAMS_MAX) {
+		goto err;
+	}
+
+	uint16_t port = ntohs(*(uint16_t *)payload);
+	host = strndup(payload + 2, len - 2);
+	if (host == NULL) {
+		goto err;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL) {
+		goto err;
+	}
+	s->id = id;
+	s->mux = mux;
+	s->pending = buffer_queue_new();
+	s->nc = network_client_new(mux->loop);
+	if (s->pending == NULL || s->nc == NULL) {
+		goto err;
+	}
+
+	const char *uri_fmt = strchr(host, ':') ? "tcp://[%s]:%u" : "tcp://%s:%u";
+	if (asprintf(&uri, uri_fmt, host, port) == -1) {
+		uri = NULL;
+		goto err;
+	}
+	if (network_client_add_uri(s->nc, uri) == -1) {
+		goto err;
+	}
+
+	network_client_set_cbs(s->nc, mux_stream_read_cb, NULL, mux_stream_event_cb, s);
+	network_client_set_retries(s->nc, 0);
+	HASH_ADD(hh, mux->streams, id, sizeof(s->id), s);
+	mux->num_streams++;
+	network_client_start(s->nc);
+
+	free(host);
+	free(uri);
+	return;
+
+err:
+	if (s) {
+		network_client_free(s->nc);
+		buffer_queue_free(s->pending);
+		free(s);
+	}
+	free(host);
+	free(uri);
+	mux_send_frame(mux, id, MUX_FRAME_CLOSE, NULL, 0);
+}
+
+static void mux_handle_frame(struct mux_channel *mux, uint32_t id, uint8_t type,
+	char *payload, uint16_t len)
+{
+	struct mux_stream *s = NULL;
+
+	if (type == MUX_FRAME_OPEN) {
+		mux_stream_open(mux, id, payload, len);
+		return;
+	}
+
+	HASH_FIND(hh, mux->streams, &id, sizeof(id), s);
+	if (s == NULL) {
+		// The target closed it first, so the client has a CLOSE coming
+		return;
+	}
+
+	if (type == MUX_FRAME_DATA) {
+		if (s->connected) {
+			network_client_write(s->nc, payload, len);
+		} else {
+			buffer_queue_add(s->pending, payload, len);
+		}
+	} else if (type == MUX_FRAME_CLOSE) {
+		mux_stream_close(s);
+	}
+}
+
+/*
+ * Frames queue up in the channel while it is not interactive
+ */
+static ssize_t mux_read(struct channel *c, void *buf, size_t len)
+{
+	return channel_dequeue(c, buf, len);
+}
+
+static ssize_t mux_write(struct channel *c, void *buf, size_t len)
+{
+	struct mux_channel *mux = channel_get_ctx(c);
+	struct mux_frame_hdr hdr;
+
+	if (buffer_queue_add(mux->rx, buf, len) == -1) {
+		return -1;
+	}
+
+	/*
+	 * Frames need not line up with channel writes, so only whole ones
+	 * are taken off the queue
+	 */
+	while (buffer_queue_copy(mux->rx, &hdr, sizeof(hdr)) == sizeof(hdr)) {
+		uint16_t payload_len = ntohs(hdr.len);
+		if (buffer_queue_len(mux->rx) < sizeof(hdr) + payload_len) {
+			break;
+		}
+		char *frame = buffer_queue_pullup(mux->rx, sizeof(hdr) + payload_len);
+		mux_handle_frame(mux, ntohl(hdr.stream_id), hdr.type,
+			frame + sizeof(hdr), payload_len);
+		buffer_queue_drain(mux->rx, sizeof(hdr) + payload_len);
+	}
+	return len;
+}
+
+static void mux_flow(struct channel *c, bool paused)
+{
+	struct mux_channel *mux = channel_get_ctx(c);
+	struct mux_stream *s, *tmp;
+
+	mux->paused = paused;
+	HASH_ITER(hh, mux->streams, s, tmp) {
+		if (s->connected) {
+			network_client_set_read_paused(s->nc, paused);
+		}
+	}
+}
+
+static int mux_free(struct channel *c)
+{
+	struct mux_channel *mux = channel_get_ctx(c);
+	if (mux) {
+		struct mux_stream *s, *tmp;
+		channel_set_ctx(c, NULL);
+		HASH_ITER(hh, mux->streams, s, tmp) {
+			mux_stream_free(s);
+		}
+		buffer_queue_free(mux->rx);
+		free(mux);
+	}
+	return 0;
+}
+
+static int mux_new(struct tlv_handler_ctx *ctx, struct channel *c)
+{
+	struct mettle *m = ctx->arg;
+	struct mux_channel *mux = calloc(1, sizeof(*mux));
+	if (mux == NULL) {
+		return -1;
+	}
+
+	mux->rx = buffer_queue_new();
+	if (mux->rx == NULL) {
+		free(mux);
+		return -1;
+	}
+	mux->channel = c;
+	mux->loop = mettle_get_loop(m);
+	channel_set_ctx(c, mux);
+	channel_set_interactive(c, true);
+	return 0;
+}
+
+void net_mux_register_handlers(struct mettle *m)
+{
+	struct channelmgr *cm = mettle_get_channelmgr(m);
+
+	struct channel_callbacks mux_cbs = {
+		.new_cb = mux_new,
+		.read_cb = mux_read,
+		.write_cb = mux_write,
+		.free_cb = mux_free,
+		.flow_cb = mux_flow,
+	};
+	channelmgr_add_channel_type(cm, "stdapi_net_mux", &mux_cbs);
+}
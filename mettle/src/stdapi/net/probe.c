@@ -0,0 +1,500 @@
+/**
+ * @brief Batched TCP connect prober
+ * @file probe.c
+ *
+ * Tries a TCP connect to every target and port asked for, keeping up to a
+ * given number of non-blocking connects in flight on the loop, and streams
+ * the outcome of each back as the response grows. Names among the targets
+ * are looked up on a worker first; addresses and IPv4 CIDR ranges are
+ * used as they are.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include <dnet.h>
+#include <eio.h>
+#include <ev.h>
+#include <mettle.h>
+
+#include "dns_cache.h"
+#include "log.h"
+#include "metrics.h"
+#include "tlv.h"
+#include "util.h"
+
+#ifdef METTLE_LOW_MEMORY
+#define PROBE_MAX_CONCURRENCY 128
+#else
+#define PROBE_MAX_CONCURRENCY 1024
+#endif
+#define PROBE_DEFAULT_CONCURRENCY 64
+#define PROBE_DEFAULT_TIMEOUT_MS 1000
+
+/*
+ * The largest IPv4 range a single target may expand to, a /16
+ */
+#define PROBE_MAX_RANGE_BITS 16
+
+struct probe_target {
+	const char *host;
+	struct addr first;
+	uint32_t count;
+};
+
+struct connect_probe;
+
+struct probe_slot {
+	struct connect_probe *probe;
+	int sock;
+	struct addr addr;
+	uint16_t port;
+	uint64_t started_us;
+	struct ev_io connect_event;
+	struct ev_timer timer;
+};
+
+struct connect_probe {
+	struct tlv_handler_ctx *ctx;
+	struct ev_loop *loop;
+	struct tlv_packet *response;
+	struct probe_target *targets;
+	size_t num_targets;
+	uint16_t *ports;
+	size_t num_ports;
+	bool open_only;
+	float timeout_s;
+
+	/*
+	 * The next attempt: every target for one port, then the next port, so
+	 * the connects in flight are spread across hosts
+	 */
+	size_t port_idx, target_idx;
+	uint32_t host_idx;
+
+	unsigned active;
+	bool starting;
+	unsigned num_slots;
+	struct probe_slot slots[];
+};
+
+static int probe_parse_target(struct probe_target *t, const char *host)
+{
+	char buf[64];
+	t->host = host;
+	t->count = 1;
+
+	// Only numeric forms here, hostnames are looked up on a worker
+	strlcpy(buf, host, sizeof(buf));
+	char *slash = strchr(buf, '/');
+	if (slash) {
+		*slash++ = '\0';
+	}
+
+	memset(&t->first, 0, sizeof(t->first));
+	if (ip_pton(buf, &t->first.addr_ip) == 0) {
+		t->first.addr_type = ADDR_TYPE_IP;
+		t->first.addr_bits = IP_ADDR_BITS;
+		if (slash) {
+			char *end;
+			unsigned long bits = strtoul(slash, &end, 10);
+			if (*end || bits > IP_ADDR_BITS ||
+					IP_ADDR_BITS - bits > PROBE_MAX_RANGE_BITS) {
+				return -1;
+			}
+			uint32_t mask = bits ? htonl(~0U << (IP_ADDR_BITS - bits)) : 0;
+			t->first.addr_ip &= mask;
+			t->count = 1U << (IP_ADDR_BITS - bits);
+		}
+		return 0;
+	}
+	if (slash == NULL && ip6_pton(buf, &t->first.addr_ip6) == 0) {
+		t->first.addr_type = ADDR_TYPE_IP6;
+		t->first.addr_bits = IP6_ADDR_BITS;
+		return 0;
+	}
+	if (slash) {
+		return -1;
+	}
+
+	t->first.addr_type = ADDR_TYPE_NONE;
+	return 0;
+}
+
+static void probe_resolve(struct eio_req *req)
+{
+	struct connect_probe *probe = req->data;
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_protocol = IPPROTO_TCP,
+	};
+
+	for (size_t i = 0; i < probe->num_targets; i++) {
+		struct probe_target *t = &probe->targets[i];
+		if (t->first.addr_type != ADDR_TYPE_NONE) {
+			continue;
+		}
+		if (tlv_handler_ctx_cancelled(probe->ctx)) {
+			t->count = 0;
+			continue;
+		}
+		struct addrinfo *res = NULL;
+		int rc = dns_cache_getaddrinfo(t->host, NULL, &hints, &res);
+		if (rc != 0) {
+			log_info("could not resolve probe target '%s': %s",
+				t->host, gai_strerror(rc));
+			t->count = 0;
+			continue;
+		}
+		if (addr_ston(res->ai_addr, &t->first) != 0) {
+			t->count = 0;
+		}
+		dns_cache_freeaddrinfo(res);
+	}
+}
+
+static void probe_add_result(struct connect_probe *probe, struct probe_slot *slot, int err)
+{
+	if (probe->open_only && err) {
+		return;
+	}
+
+	char host[INET6_ADDRSTRLEN];
+	addr_ntop(&slot->addr, host, sizeof(host));
+
+	struct tlv_packet *p = tlv_packet_new(TLV_TYPE_PROBE_RESULT, 0);
+	p = tlv_packet_add_str(p, TLV_TYPE_PEER_HOST, host);
+	p = tlv_packet_add_u32(p, TLV_TYPE_PEER_PORT, slot->port);
+	p = tlv_packet_add_u32(p, TLV_TYPE_PROBE_ERROR, err);
+	if (err == 0) {
+		p = tlv_packet_add_u32(p, TLV_TYPE_PROBE_RTT,
+			metric_now_us() - slot->started_us);
+	}
+	probe->response = tlv_packet_add_child(probe->response, p);
+	probe->response = tlv_packet_response_continue(probe->ctx, probe->response);
+}
+
+/*
+ * Picks the next address and port to try, returning false when done
+ */
+static bool probe_next_attempt(struct connect_probe *probe, struct probe_slot *slot)
+{
+	if (tlv_handler_ctx_cancelled(probe->ctx)) {
+		return false;
+	}
+
+	while (probe->port_idx < probe->num_ports) {
+		if (probe->target_idx == probe->num_targets) {
+			probe->target_idx = 0;
+			probe->port_idx++;
+			continue;
+		}
+		struct probe_target *t = &probe->targets[probe->target_idx];
+		if (probe->host_idx >= t->count) {
+			probe->host_idx = 0;
+			probe->target_idx++;
+			continue;
+		}
+
+		slot->addr = t->first;
+		if (t->first.addr_type == ADDR_TYPE_IP) {
+			slot->addr.addr_ip = htonl(ntohl(t->first.addr_ip) + probe->host_idx);
+		}
+		slot->port = probe->ports[probe->port_idx];
+		probe->host_idx++;
+		return true;
+	}
+	return false;
+}
+
+static void probe_finish(struct connect_probe *probe)
+{
+	struct tlv_handler_ctx *ctx = probe->ctx;
+	int result = tlv_handler_ctx_cancelled(ctx) ? ECANCELED : TLV_RESULT_SUCCESS;
+	tlv_dispatcher_enqueue_response(ctx->td,
+		tlv_packet_add_result(probe->response, result));
+	tlv_handler_ctx_free(ctx);
+}
+
+static void probe_close(struct probe_slot *slot)
+{
+	struct connect_probe *probe = slot->probe;
+	ev_io_stop(probe->loop, &slot->connect_event);
+	ev_timer_stop(probe->loop, &slot->timer);
+
+	// Reset rather than linger in TIME_WAIT, there may be thousands of these
+	struct linger l = { .l_onoff = 1, .l_linger = 0 };
+	setsockopt(slot->sock, SOL_SOCKET, SO_LINGER, (void *)&l, sizeof(l));
+	close(slot->sock);
+	slot->sock = -1;
+}
+
+/*
+ * Starts connects on the slot until one is in flight or nothing is left.
+ * The socket is set up as bufferev_connect_addrinfo sets up its own.
+ */
+static void probe_slot_run(struct probe_slot *slot)
+{
+	struct connect_probe *probe = slot->probe;
+
+	while (probe_next_attempt(probe, slot)) {
+		struct sockaddr_storage ss;
+		socklen_t ss_len = slot->addr.addr_type == ADDR_TYPE_IP ?
+			sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+		addr_ntos(&slot->addr, (struct sockaddr *)&ss);
+		if (ss.ss_family == AF_INET) {
+			((struct sockaddr_in *)&ss)->sin_port = htons(slot->port);
+		} else {
+			((struct sockaddr_in6 *)&ss)->sin6_port = htons(slot->port);
+		}
+
+		slot->started_us = metric_now_us();
+		slot->sock = socket(ss.ss_family, SOCK_STREAM, IPPROTO_TCP);
+		if (slot->sock < 0) {
+			probe_add_result(probe, slot, errno);
+			continue;
+		}
+		make_socket_nonblocking(slot->sock);
+
+		int rc = connect(slot->sock, (struct sockaddr *)&ss, ss_len);
+		if (rc == 0) {
+			probe_add_result(probe, slot, 0);
+			probe_close(slot);
+		} else if (errno == EINPROGRESS || errno == EWOULDBLOCK) {
+			ev_io_set(&slot->connect_event, slot->sock, EV_WRITE);
+			ev_io_start(probe->loop, &slot->connect_event);
+			ev_timer_set(&slot->timer, probe->timeout_s, 0);
+			ev_timer_start(probe->loop, &slot->timer);
+			return;
+		} else {
+			probe_add_result(probe, slot, errno);
+			probe_close(slot);
+		}
+	}
+
+	if (--probe->active == 0 && !probe->starting) {
+		probe_finish(probe);
+	}
+}
+
+static void probe_connect_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+	struct probe_slot *slot = w->data;
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	getsockopt(slot->sock, SOL_SOCKET, SO_ERROR, (void *)&err, &len);
+	probe_add_result(slot->probe, slot, err);
+	probe_close(slot);
+	probe_slot_run(slot);
+}
+
+static void probe_timeout_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+	struct probe_slot *slot = w->data;
+
+	probe_add_result(slot->probe, slot, ETIMEDOUT);
+	probe_close(slot);
+	probe_slot_run(slot);
+}
+
+static void probe_start(struct connect_probe *probe)
+{
+	probe->starting = true;
+	probe->active = probe->num_slots;
+	for (unsigned i = 0; i < probe->num_slots; i++) {
+		probe_slot_run(&probe->slots[i]);
+	}
+	probe->starting = false;
+	if (probe->active == 0) {
+		probe_finish(probe);
+	}
+}
+
+static int probe_resolve_done(struct eio_req *req)
+{
+	probe_start(req->data);
+	return 0;
+}
+
+/*
+ * Expands a list such as "22,80,8000-8100" into 'ports', or only counts
+ * the ports in it when 'ports' is NULL. Returns -1 if it is malformed.
+ */
+static ssize_t probe_parse_port_list(const char *s, uint16_t *ports)
+{
+	ssize_t n = 0;
+	while (s && *s) {
+		char *end;
+		unsigned long lo = strtoul(s, &end, 10), hi = lo;
+		if (*end == '-') {
+			hi = strtoul(end + 1, &end, 10);
+		}
+		if (end == s || lo == 0 || hi < lo || hi > UINT16_MAX ||
+				(*end && *end != ',')) {
+			return -1;
+		}
+		for (unsigned long port = lo; port <= hi; port++, n++) {
+			if (ports) {
+				ports[n] = port;
+			}
+		}
+		s = *end ? end + 1 : end;
+	}
+	return n;
+}
+
+/*
+ * Ports come as a list in TLV_TYPE_PROBE_PORTS, as TLV_TYPE_PEER_PORT
+ * values, or both
+ */
+static ssize_t probe_parse_ports(struct tlv_handler_ctx *ctx, uint16_t **ports)
+{
+	const char *list = tlv_packet_get_str(ctx->req, TLV_TYPE_PROBE_PORTS);
+	ssize_t count = probe_parse_port_list(list, NULL);
+	if (count == -1) {
+		return -1;
+	}
+
+	size_t len;
+	struct tlv_iterator i = {
+		.packet = ctx->req,
+		.value_type = TLV_TYPE_PEER_PORT,
+	};
+	while (tlv_packet_iterate(&i, &len)) {
+		count++;
+	}
+	if (count == 0) {
+		return 0;
+	}
+
+	*ports = tlv_handler_ctx_alloc(ctx, count * sizeof(uint16_t));
+	if (*ports == NULL) {
+		return -1;
+	}
+	ssize_t n = probe_parse_port_list(list, *ports);
+	struct tlv_iterator j = {
+		.packet = ctx->req,
+		.value_type = TLV_TYPE_PEER_PORT,
+	};
+	void *val;
+	while ((val = tlv_packet_iterate(&j, &len))) {
+		uint32_t port = 0;
+		if (len == sizeof(port)) {
+			memcpy(&port, val, sizeof(port));
+			port = ntohl(port);
+		}
+		if (port == 0 || port > UINT16_MAX) {
+			return -1;
+		}
+		(*ports)[n++] = port;
+	}
+	return n;
+}
+
+static unsigned probe_max_concurrency(void)
+{
+	unsigned max = PROBE_MAX_CONCURRENCY;
+	struct rlimit rl;
+
+	// Leave at least half the descriptors for everything else
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+			rl.rlim_cur / 2 < max) {
+		max = rl.rlim_cur / 2 ? rl.rlim_cur / 2 : 1;
+	}
+	return max;
+}
+
+static struct tlv_packet *net_connect_probe(struct tlv_handler_ctx *ctx)
+{
+	struct mettle *m = ctx->arg;
+
+	uint16_t *ports = NULL;
+	ssize_t num_ports = probe_parse_ports(ctx, &ports);
+	if (num_ports == -1) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_EINVAL);
+	}
+
+	struct tlv_iterator i = {
+		.packet = ctx->req,
+		.value_type = TLV_TYPE_PEER_HOST,
+	};
+	size_t num_targets = 0;
+	while (tlv_packet_iterate_str(&i)) {
+		num_targets++;
+	}
+	if (num_targets == 0 || num_ports == 0) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+	}
+
+	uint32_t concurrency = PROBE_DEFAULT_CONCURRENCY;
+	uint32_t timeout_ms = PROBE_DEFAULT_TIMEOUT_MS;
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_PROBE_CONCURRENCY, &concurrency);
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_PROBE_TIMEOUT, &timeout_ms);
+	unsigned max_concurrency = probe_max_concurrency();
+	if (concurrency == 0 || concurrency > max_concurrency) {
+		concurrency = max_concurrency;
+	}
+
+	struct connect_probe *probe = tlv_handler_ctx_alloc(ctx,
+		sizeof(*probe) + concurrency * sizeof(probe->slots[0]));
+	struct probe_target *targets = tlv_handler_ctx_alloc(ctx,
+		num_targets * sizeof(*targets));
+	if (probe == NULL || targets == NULL) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_ENOMEM);
+	}
+	memset(probe, 0, sizeof(*probe));
+
+	bool needs_lookup = false;
+	struct tlv_iterator j = {
+		.packet = ctx->req,
+		.value_type = TLV_TYPE_PEER_HOST,
+	};
+	for (size_t n = 0; n < num_targets; n++) {
+		if (probe_parse_target(&targets[n], tlv_packet_iterate_str(&j)) == -1) {
+			return tlv_packet_response_result(ctx, TLV_RESULT_EINVAL);
+		}
+		needs_lookup |= targets[n].first.addr_type == ADDR_TYPE_NONE;
+	}
+
+	probe->ctx = ctx;
+	probe->loop = mettle_get_loop(m);
+	probe->response = tlv_packet_response(ctx);
+	probe->targets = targets;
+	probe->num_targets = num_targets;
+	probe->ports = ports;
+	probe->num_ports = num_ports;
+	probe->timeout_s = timeout_ms / 1000.0;
+	tlv_packet_get_bool(ctx->req, TLV_TYPE_PROBE_OPEN_ONLY, &probe->open_only);
+	probe->num_slots = concurrency;
+	for (unsigned n = 0; n < concurrency; n++) {
+		struct probe_slot *slot = &probe->slots[n];
+		slot->probe = probe;
+		slot->sock = -1;
+		ev_io_init(&slot->connect_event, probe_connect_cb, -1, EV_WRITE);
+		slot->connect_event.data = slot;
+		ev_timer_init(&slot->timer, probe_timeout_cb, 0, 0);
+		slot->timer.data = slot;
+	}
+
+	if (needs_lookup) {
+		eio_custom(probe_resolve, 0, probe_resolve_done, probe);
+	} else {
+		probe_start(probe);
+	}
+	return NULL;
+}
+
+void net_probe_register_handlers(struct mettle *m)
+{
+	struct tlv_dispatcher *td = mettle_get_tlv_dispatcher(m);
+
+	tlv_dispatcher_add_handler(td, "stdapi_net_connect_probe", net_connect_probe, m);
+}
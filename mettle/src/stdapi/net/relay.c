@@ -0,0 +1,474 @@
+/**
+ * Copyright 2016 Rapid7
+ * @brief On-target TCP relay channel
+ * @file relay.c
+ *
+ * A relay listens on a local port and connects every client it accepts to a
+ * fixed peer, moving the bytes between the two sockets without going through
+ * the C2 link. On Linux the data is spliced through a pipe so it never enters
+ * userspace; elsewhere, or when a socket refuses splice, it is copied through
+ * a small buffer instead. Only byte counters are reported back.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include <ev.h>
+#include <mettle.h>
+
+#include "channel.h"
+#include "log.h"
+#include "tlv.h"
+#include "util.h"
+#include "utlist.h"
+
+#ifdef METTLE_LOW_MEMORY
+#define RELAY_BUF_LEN 8192
+#else
+#define RELAY_BUF_LEN 65536
+#endif
+
+struct tcp_relay;
+
+struct relay_pump {
+	struct tcp_relay_conn *conn;
+	int from, to;
+	struct ev_io read_event;
+	struct ev_io write_event;
+	int pipe[2];
+	char *buf;
+	size_t pending, offset;
+	bool eof, done;
+	uint64_t *counter;
+};
+
+struct tcp_relay_conn {
+	struct tcp_relay *relay;
+	int client, peer;
+	struct ev_io connect_event;
+	struct relay_pump up, down;
+	struct tcp_relay_conn *next;
+};
+
+struct tcp_relay {
+	struct ev_loop *loop;
+	struct channel *channel;
+	int listener;
+	struct ev_io accept_event;
+	struct sockaddr_storage peer_addr;
+	socklen_t peer_addr_len;
+	struct tcp_relay_conn *conns;
+	uint64_t tx_bytes, rx_bytes;
+	uint32_t accepted, active;
+};
+
+static void relay_pump_stop(struct relay_pump *pump)
+{
+	struct ev_loop *loop = pump->conn->relay->loop;
+	ev_io_stop(loop, &pump->read_event);
+	ev_io_stop(loop, &pump->write_event);
+	if (pump->pipe[0] != -1) {
+		close(pump->pipe[0]);
+		close(pump->pipe[1]);
+		pump->pipe[0] = pump->pipe[1] = -1;
+	}
+	free(pump->buf);
+	pump->buf = NULL;
+}
+
+static void relay_conn_free(struct tcp_relay_conn *conn)
+{
+	struct tcp_relay *relay = conn->relay;
+	ev_io_stop(relay->loop, &conn->connect_event);
+	relay_pump_stop(&conn->up);
+	relay_pump_stop(&conn->down);
+	close(conn->client);
+	if (conn->peer != -1) {
+		close(conn->peer);
+	}
+	LL_DELETE(relay->conns, conn);
+	relay->active--;
+	free(conn);
+}
+
+static void relay_pump_finish(struct relay_pump *pump)
+{
+	struct tcp_relay_conn *conn = pump->conn;
+	pump->done = true;
+	relay_pump_stop(pump);
+	shutdown(pump->to, SHUT_WR);
+	if (conn->up.done && conn->down.done) {
+		relay_conn_free(conn);
+	}
+}
+
+/*
+ * Switches a pump to copying through a buffer. Anything already sitting in
+ * the pipe is pulled back out so no data is lost in the transition.
+ */
+static int relay_pump_use_buffer(struct relay_pump *pump)
+{
+	pump->buf = malloc(RELAY_BUF_LEN);
+	if (pump->buf == NULL) {
+		return -1;
+	}
+	pump->offset = 0;
+	if (pump->pipe[0] != -1) {
+		ssize_t n = pump->pending ? read(pump->pipe[0], pump->buf, pump->pending) : 0;
+		pump->pending = n > 0 ? n : 0;
+		close(pump->pipe[0]);
+		close(pump->pipe[1]);
+		pump->pipe[0] = pump->pipe[1] = -1;
+	}
+	return 0;
+}
+
+static ssize_t relay_pump_fill(struct relay_pump *pump)
+{
+#ifdef __linux__
+	if (pump->pipe[0] != -1) {
+		ssize_t n = splice(pump->from, NULL, pump->pipe[1], NULL,
+			RELAY_BUF_LEN, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n != -1 || (errno != EINVAL && errno != ENOSYS)) {
+			return n;
+		}
+		if (relay_pump_use_buffer(pump) == -1) {
+			return -1;
+		}
+	}
+#endif
+	pump->offset = 0;
+	return recv(pump->from, pump->buf, RELAY_BUF_LEN, 0);
+}
+
+static ssize_t relay_pump_drain(struct relay_pump *pump)
+{
+#ifdef __linux__
+	if (pump->pipe[0] != -1) {
+		ssize_t n = splice(pump->pipe[0], NULL, pump->to, NULL,
+			pump->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n != -1 || (errno != EINVAL && errno != ENOSYS)) {
+			return n;
+		}
+		if (relay_pump_use_buffer(pump) == -1) {
+			return -1;
+		}
+	}
+#endif
+	ssize_t n = send(pump->to, pump->buf + pump->offset, pump->pending, 0);
+	if (n > 0) {
+		pump->offset += n;
+	}
+	return n;
+}
+
+/*
+ * Moves as much as the sockets allow, then waits on whichever side is
+ * holding things up: writable on the destination while data is pending,
+ * readable on the source otherwise.
+ */
+static void relay_pump_run(struct relay_pump *pump)
+{
+	struct ev_loop *loop = pump->conn->relay->loop;
+
+	for (;;) {
+		if (pump->pending) {
+			ssize_t n = relay_pump_drain(pump);
+			if (n > 0) {
+				pump->pending -= n;
+				*pump->counter += n;
+				continue;
+			}
+			if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				ev_io_stop(loop, &pump->read_event);
+				ev_io_start(loop, &pump->write_event);
+				return;
+			}
+			relay_pump_finish(pump);
+			return;
+		}
+
+		if (pump->eof) {
+			relay_pump_finish(pump);
+			return;
+		}
+
+		ssize_t n = relay_pump_fill(pump);
+		if (n > 0) {
+			pump->pending = n;
+		} else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			ev_io_stop(loop, &pump->write_event);
+			ev_io_start(loop, &pump->read_event);
+			return;
+		} else {
+			pump->eof = true;
+		}
+	}
+}
+
+static void relay_pump_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+	relay_pump_run(w->data);
+}
+
+static int relay_pump_start(struct relay_pump *pump, struct tcp_relay_conn *conn,
+	int from, int to, uint64_t *counter)
+{
+	pump->conn = conn;
+	pump->from = from;
+	pump->to = to;
+	pump->counter = counter;
+	pump->pipe[0] = pump->pipe[1] = -1;
+
+	ev_io_init(&pump->read_event, relay_pump_cb, from, EV_READ);
+	pump->read_event.data = pump;
+	ev_io_init(&pump->write_event, relay_pump_cb, to, EV_WRITE);
+	pump->write_event.data = pump;
+
+#ifdef __linux__
+	if (pipe(pump->pipe) == 0) {
+		fcntl(pump->pipe[0], F_SETFL, O_NONBLOCK);
+		fcntl(pump->pipe[1], F_SETFL, O_NONBLOCK);
+		return 0;
+	}
+	pump->pipe[0] = pump->pipe[1] = -1;
+#endif
+	return relay_pump_use_buffer(pump);
+}
+
+static void relay_connect_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+	struct tcp_relay_conn *conn = w->data;
+	struct tcp_relay *relay = conn->relay;
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	ev_io_stop(loop, w);
+	getsockopt(conn->peer, SOL_SOCKET, SO_ERROR, (void *)&err, &len);
+	if (err) {
+		log_info("relay could not connect to peer: %s", strerror(err));
+		relay_conn_free(conn);
+		return;
+	}
+
+	if (relay_pump_start(&conn->up, conn, conn->client, conn->peer, &relay->tx_bytes) == -1
+		|| relay_pump_start(&conn->down, conn, conn->peer, conn->client, &relay->rx_bytes) == -1) {
+		relay_conn_free(conn);
+		return;
+	}
+	relay_pump_run(&conn->up);
+	relay_pump_run(&conn->down);
+}
+
+static void relay_accept_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+	struct tcp_relay *relay = w->data;
+	int fd = accept(relay->listener, NULL, NULL);
+	if (fd < 0) {
+		log_error("could not accept: %s", strerror(errno));
+		return;
+	}
+	make_socket_nonblocking(fd);
+
+	struct tcp_relay_conn *conn = calloc(1, sizeof(*conn));
+	if (conn == NULL) {
+		close(fd);
+		return;
+	}
+	conn->relay = relay;
+	conn->client = fd;
+	conn->up.pipe[0] = conn->up.pipe[1] = -1;
+	conn->down.pipe[0] = conn->down.pipe[1] = -1;
+	conn->up.conn = conn->down.conn = conn;
+	ev_io_init(&conn->connect_event, relay_connect_cb, -1, EV_WRITE);
+	conn->connect_event.data = conn;
+	LL_PREPEND(relay->conns, conn);
+	relay->accepted++;
+	relay->active++;
+
+	conn->peer = socket(relay->peer_addr.ss_family, SOCK_STREAM, 0);
+	if (conn->peer == -1) {
+		relay_conn_free(conn);
+		return;
+	}
+	make_socket_nonblocking(conn->peer);
+
+	if (connect(conn->peer, (struct sockaddr *)&relay->peer_addr,
+			relay->peer_addr_len) == -1 && errno != EINPROGRESS) {
+		log_info("relay could not connect to peer: %s", strerror(errno));
+		relay_conn_free(conn);
+		return;
+	}
+	ev_io_set(&conn->connect_event, conn->peer, EV_WRITE);
+	ev_io_start(loop, &conn->connect_event);
+}
+
+static void tcp_relay_free(struct tcp_relay *relay)
+{
+	if (relay) {
+		struct tcp_relay_conn *conn, *tmp;
+		LL_FOREACH_SAFE(relay->conns, conn, tmp) {
+			relay_conn_free(conn);
+		}
+		if (relay->listener != -1) {
+			ev_io_stop(relay->loop, &relay->accept_event);
+			close(relay->listener);
+		}
+		free(relay);
+	}
+}
+
+/*
+ * The peer is resolved once when the relay opens, so accepting a client
+ * never blocks the loop on a lookup
+ */
+static int tcp_relay_resolve_peer(struct tcp_relay *relay, const char *host, uint32_t port)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *res = NULL;
+	char service[16];
+
+	snprintf(service, sizeof(service), "%u", port);
+	if (getaddrinfo(host, service, &hints, &res) != 0 || res == NULL) {
+		return -1;
+	}
+	memcpy(&relay->peer_addr, res->ai_addr, res->ai_addrlen);
+	relay->peer_addr_len = res->ai_addrlen;
+	freeaddrinfo(res);
+	return 0;
+}
+
+static int tcp_relay_listen(struct tcp_relay *relay, uint32_t port)
+{
+	struct sockaddr_in6 sin = {
+		.sin6_family = AF_INET6,
+		.sin6_port = htons((uint16_t)port),
+		.sin6_addr = in6addr_any,
+	};
+
+	relay->listener = socket(AF_INET6, SOCK_STREAM, 0);
+	if (relay->listener == -1) {
+		return -1;
+	}
+	make_socket_nonblocking(relay->listener);
+
+#ifndef _WIN32
+	int yes = 1;
+	setsockopt(relay->listener, SOL_SOCKET, SO_REUSEADDR, (void *)&yes, sizeof(yes));
+#endif
+#ifdef IPV6_V6ONLY
+	int no = 0;
+	setsockopt(relay->listener, IPPROTO_IPV6, IPV6_V6ONLY, (void *)&no, sizeof(no));
+#endif
+
+	if (bind(relay->listener, (struct sockaddr *)&sin, sizeof(sin)) == -1
+		|| listen(relay->listener, 16) == -1) {
+		return -1;
+	}
+
+	ev_io_init(&relay->accept_event, relay_accept_cb, relay->listener, EV_READ);
+	relay->accept_event.data = relay;
+	ev_io_start(relay->loop, &relay->accept_event);
+	return 0;
+}
+
+static int tcp_relay_new(struct tlv_handler_ctx *ctx, struct channel *c)
+{
+	struct mettle *m = ctx->arg;
+	uint32_t local_port = 0, peer_port = 0;
+
+	const char *peer_host = tlv_packet_get_str(ctx->req, TLV_TYPE_PEER_HOST);
+	if (peer_host == NULL
+		|| tlv_packet_get_u32(ctx->req, TLV_TYPE_PEER_PORT, &peer_port) == -1
+		|| tlv_packet_get_u32(ctx->req, TLV_TYPE_LOCAL_PORT, &local_port) == -1) {
+		log_error("relay needs a local port and a peer");
+		return -1;
+	}
+
+	struct tcp_relay *relay = calloc(1, sizeof(*relay));
+	if (relay == NULL) {
+		return -1;
+	}
+	relay->loop = mettle_get_loop(m);
+	relay->channel = c;
+	relay->listener = -1;
+
+	if (tcp_relay_resolve_peer(relay, peer_host, peer_port) == -1) {
+		log_info("could not resolve relay peer %s:%u", peer_host, peer_port);
+		goto err;
+	}
+
+	if (tcp_relay_listen(relay, local_port) == -1) {
+		log_info("relay failed to listen on port %u: %s", local_port, strerror(errno));
+		goto err;
+	}
+
+	channel_set_ctx(c, relay);
+	log_info("relaying port %u to %s:%u", local_port, peer_host, peer_port);
+	return 0;
+
+err:
+	tcp_relay_free(relay);
+	return -1;
+}
+
+static int tcp_relay_channel_free(struct channel *c)
+{
+	struct tcp_relay *relay = channel_get_ctx(c);
+	if (relay) {
+		channel_set_ctx(c, NULL);
+		tcp_relay_free(relay);
+	}
+	return 0;
+}
+
+static struct tlv_packet *tcp_relay_stats(struct tlv_handler_ctx *ctx)
+{
+	struct mettle *m = ctx->arg;
+	uint32_t channel_id;
+
+	if (tlv_packet_get_u32(ctx->req, TLV_TYPE_CHANNEL_ID, &channel_id) == -1) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_EINVAL);
+	}
+
+	struct channel *c = channelmgr_channel_by_id(mettle_get_channelmgr(m), channel_id);
+	if (c == NULL || strcmp(channel_get_type(c), "stdapi_net_tcp_relay")) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_EINVAL);
+	}
+
+	struct tcp_relay *relay = channel_get_ctx(c);
+	if (relay == NULL) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_EINVAL);
+	}
+
+	struct tlv_packet *p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+	p = tlv_packet_add_u64(p, TLV_TYPE_RELAY_TX_BYTES, relay->tx_bytes);
+	p = tlv_packet_add_u64(p, TLV_TYPE_RELAY_RX_BYTES, relay->rx_bytes);
+	p = tlv_packet_add_u32(p, TLV_TYPE_RELAY_ACCEPTED, relay->accepted);
+	p = tlv_packet_add_u32(p, TLV_TYPE_RELAY_ACTIVE, relay->active);
+	return p;
+}
+
+void net_relay_register_handlers(struct mettle *m)
+{
+	struct tlv_dispatcher *td = mettle_get_tlv_dispatcher(m);
+	struct channelmgr *cm = mettle_get_channelmgr(m);
+
+	struct channel_callbacks tcp_relay_cbs = {
+		.new_cb = tcp_relay_new,
+		.free_cb = tcp_relay_channel_free,
+	};
+	channelmgr_add_channel_type(cm, "stdapi_net_tcp_relay", &tcp_relay_cbs);
+
+	tlv_dispatcher_add_handler(td, "stdapi_net_tcp_relay_stats", tcp_relay_stats, m);
+}
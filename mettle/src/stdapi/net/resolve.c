@@ -7,74 +7,156 @@
 #include <unistd.h>
 
 #include <dnet.h>
+#include <eio.h>
 #include <mettle.h>
 #include <sigar.h>
 
+#include "dns_cache.h"
 #include "log.h"
 #include "tlv.h"
 
-static
-void resolve_host_async(struct eio_req *req)
+/*
+ * Names are looked up RESOLVE_BATCH to an eio request, so a long list is
+ * spread over the worker pool, and answered in the order asked once the
+ * last batch is done
+ */
+#define RESOLVE_BATCH 4
+
+struct resolve_name {
+	const char *host;
+	int result;
+	struct addr addr;
+};
+
+struct resolve_hosts {
+	struct tlv_handler_ctx *ctx;
+	int family;
+	unsigned pending;
+	size_t count;
+	struct resolve_name names[];
+};
+
+struct resolve_batch {
+	struct resolve_hosts *rh;
+	size_t start, end;
+};
+
+static void resolve_name(struct resolve_name *name, int family)
+{
+	struct addrinfo hints = {
+		.ai_family = family,
+	};
+	struct addrinfo *resolved_host = NULL;
+
+	name->result = dns_cache_getaddrinfo(name->host, NULL, &hints, &resolved_host);
+	if (name->result != 0) {
+		return;
+	}
+
+	if (family == AF_INET) {
+		addr_pack(&name->addr, ADDR_TYPE_IP, IP_ADDR_BITS,
+				&((struct sockaddr_in *)(resolved_host->ai_addr))->sin_addr,
+				IP_ADDR_LEN);
+	} else {
+		addr_pack(&name->addr, ADDR_TYPE_IP6, IP6_ADDR_BITS,
+				&((struct sockaddr_in6 *)(resolved_host->ai_addr))->sin6_addr,
+				IP6_ADDR_LEN);
+	}
+	dns_cache_freeaddrinfo(resolved_host);
+}
+
+static void resolve_batch(struct eio_req *req)
 {
-	struct tlv_handler_ctx *ctx = req->data;
-	struct tlv_packet *p = tlv_packet_response(ctx);
-	int ret_val = TLV_RESULT_SUCCESS;
+	struct resolve_batch *b = req->data;
+	struct resolve_hosts *rh = b->rh;
 
+	for (size_t i = b->start; i < b->end; i++) {
+		if (tlv_handler_ctx_cancelled(rh->ctx)) {
+			rh->names[i].result = EAI_AGAIN;
+			continue;
+		}
+		resolve_name(&rh->names[i], rh->family);
+	}
+}
+
+static int resolve_batch_done(struct eio_req *req)
+{
+	struct resolve_batch *b = req->data;
+	struct resolve_hosts *rh = b->rh;
+
+	if (__atomic_sub_fetch(&rh->pending, 1, __ATOMIC_ACQ_REL)) {
+		return 0;
+	}
+
+	struct tlv_packet *p = tlv_packet_response(rh->ctx);
+	for (size_t i = 0; i < rh->count; i++) {
+		struct resolve_name *name = &rh->names[i];
+		if (name->result == 0) {
+			p = tlv_packet_add_addr(p, TLV_TYPE_IP, 0, 0, &name->addr);
+			p = tlv_packet_add_u32(p, TLV_TYPE_ADDR_TYPE, rh->family);
+		} else {
+			log_info("Unable to resolve host '%s': %d (%s)",
+					name->host, name->result, gai_strerror(name->result));
+			p = tlv_packet_add_raw(p, TLV_TYPE_IP, NULL, 0);
+		}
+	}
+	p = tlv_packet_add_result(p, TLV_RESULT_SUCCESS);
+
+	tlv_dispatcher_enqueue_response(rh->ctx->td, p);
+	tlv_handler_ctx_free(rh->ctx);
+	return 0;
+}
+
+static
+struct tlv_packet *resolve_host_req(struct tlv_handler_ctx *ctx)
+{
 	uint32_t addr_type;
 	if (tlv_packet_get_u32(ctx->req, TLV_TYPE_ADDR_TYPE, &addr_type) ||
 			(addr_type != AF_INET && addr_type != AF_INET6)) {
 		log_info("Unsupported address family '%u' for hostname resolution", addr_type);
-		ret_val = TLV_RESULT_EINVAL;
-		goto done;
+		return tlv_packet_response_result(ctx, TLV_RESULT_EINVAL);
 	}
 
-	struct addrinfo hints = {
-		.ai_family = addr_type,
+	struct tlv_iterator i = {
+		.packet = ctx->req,
+		.value_type = TLV_TYPE_HOST_NAME,
 	};
+	size_t count = 0;
+	while (tlv_packet_iterate_str(&i)) {
+		count++;
+	}
+	if (count == 0) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+	}
 
-	struct tlv_iterator i = {
+	size_t num_batches = (count + RESOLVE_BATCH - 1) / RESOLVE_BATCH;
+	struct resolve_hosts *rh = tlv_handler_ctx_alloc(ctx,
+		sizeof(*rh) + count * sizeof(rh->names[0]));
+	struct resolve_batch *batches = tlv_handler_ctx_alloc(ctx,
+		num_batches * sizeof(*batches));
+	if (rh == NULL || batches == NULL) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_ENOMEM);
+	}
+
+	rh->ctx = ctx;
+	rh->family = addr_type;
+	rh->count = count;
+	rh->pending = num_batches;
+	struct tlv_iterator j = {
 		.packet = ctx->req,
 		.value_type = TLV_TYPE_HOST_NAME,
 	};
-	const char *hostname;
-	while ((hostname = tlv_packet_iterate_str(&i))) {
-		struct addrinfo *resolved_host = NULL;
-
-		int result = getaddrinfo(hostname, NULL, &hints, &resolved_host);
-		if (result == 0) {
-			struct addr addr_host;
-
-			if (addr_type == AF_INET) {
-				addr_pack(&addr_host, ADDR_TYPE_IP, IP_ADDR_BITS, \
-						&((struct sockaddr_in *)(resolved_host->ai_addr))->sin_addr, \
-						IP_ADDR_LEN);
-			} else {
-				addr_pack(&addr_host, ADDR_TYPE_IP6, IP6_ADDR_BITS, \
-						&((struct sockaddr_in6 *)(resolved_host->ai_addr))->sin6_addr, \
-						IP6_ADDR_LEN);
-			}
-			p = tlv_packet_add_addr(p, TLV_TYPE_IP, 0, 0, &addr_host);
-			p = tlv_packet_add_u32(p, TLV_TYPE_ADDR_TYPE, addr_type);
-
-			// XXX: C meterpreter has comment about this free possibliy causing segfaults on Linux
-			freeaddrinfo(resolved_host);
-		} else {
-			log_info("Unable to resolve host '%s': %d (%s)",
-					hostname, result, gai_strerror(result));
-			tlv_packet_add_raw(p, TLV_TYPE_IP, NULL, 0);
-		}
+	for (size_t n = 0; n < count; n++) {
+		rh->names[n].host = tlv_packet_iterate_str(&j);
 	}
-done:
-	tlv_packet_add_result(p, ret_val);
-	tlv_dispatcher_enqueue_response(ctx->td, p);
-	tlv_handler_ctx_free(ctx);
-}
 
-static
-struct tlv_packet *resolve_host_req(struct tlv_handler_ctx *ctx)
-{
-	struct mettle *m = ctx->arg;
-	eio_custom(resolve_host_async, 0, NULL, ctx);
+	for (size_t n = 0; n < num_batches; n++) {
+		batches[n].rh = rh;
+		batches[n].start = n * RESOLVE_BATCH;
+		batches[n].end = batches[n].start + RESOLVE_BATCH < count ?
+			batches[n].start + RESOLVE_BATCH : count;
+		eio_custom(resolve_batch, 0, resolve_batch_done, &batches[n]);
+	}
 	return NULL;
 }
 
@@ -88,10 +170,14 @@ struct tlv_packet *net_resolve_hosts(struct tlv_handler_ctx *ctx)
 	return resolve_host_req(ctx);
 }
 
+static const struct tlv_handler_def net_resolve_handlers[] = {
+	{ "stdapi_net_resolve_host", net_resolve_host },
+	{ "stdapi_net_resolve_hosts", net_resolve_hosts },
+};
+
 void net_resolve_register_handlers(struct mettle *m)
 {
 	struct tlv_dispatcher *td = mettle_get_tlv_dispatcher(m);
 
-	tlv_dispatcher_add_handler(td, "stdapi_net_resolve_host", net_resolve_host, m);
-	tlv_dispatcher_add_handler(td, "stdapi_net_resolve_hosts", net_resolve_hosts, m);
+	tlv_dispatcher_add_handlers(td, net_resolve_handlers, COUNT_OF(net_resolve_handlers), m);
 }
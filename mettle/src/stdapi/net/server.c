@@ -17,6 +17,7 @@ struct network_server_channel
 	struct tlv_dispatcher *td;
 	struct channel *channel;
 	struct network_server *ns;
+	uint32_t sock_profile;
 };
 
 struct tcp_server_conn
@@ -80,6 +81,7 @@ static void open_tcp_channel(struct network_server_channel *nsc, struct bufferev
 	p = tlv_packet_add_u32(p, TLV_TYPE_PEER_PORT, peer_port);
 
 	bufferev_set_cbs(be, conn_read_cb, NULL, conn_event_cb, conn);
+	bufferev_set_sock_profile(be, nsc->sock_profile);
 	channel_set_ctx(conn->channel, conn);
 	channel_set_interactive(conn->channel, true);
 
@@ -97,7 +99,7 @@ static void tcp_server_event_cb(struct bufferev *be, int event, void *arg)
 
 static int tcp_server_new(struct tlv_handler_ctx *ctx, struct channel *c)
 {
-	uint32_t port = 0;
+	uint32_t port = 0, listeners = 1;
 	struct mettle *m = ctx->arg;
 	struct network_server_channel *nsc;
 
@@ -107,6 +109,7 @@ static int tcp_server_new(struct tlv_handler_ctx *ctx, struct channel *c)
 		log_error("no port specified");
 		return -1;
 	}
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_SERVER_LISTENERS, &listeners);
 
 	nsc = calloc(1, sizeof(*nsc));
 	if (nsc == NULL) {
@@ -115,8 +118,13 @@ static int tcp_server_new(struct tlv_handler_ctx *ctx, struct channel *c)
 
 	nsc->channel = c;
 	nsc->td = mettle_get_tlv_dispatcher(m);
+	nsc->sock_profile = BUFFEREV_SOCK_INTERACTIVE;
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_SOCKET_PROFILE, &nsc->sock_profile);
+	if (nsc->sock_profile > BUFFEREV_SOCK_C2) {
+		nsc->sock_profile = BUFFEREV_SOCK_DEFAULT;
+	}
 
-	nsc->ns = network_server_new(mettle_get_loop(m), host, port);
+	nsc->ns = network_server_new_shared(mettle_get_loop(m), host, port, listeners);
 	if (nsc->ns == NULL) {
 		log_info("failed to listen on %s:%d", host, port);
 		free(nsc);
@@ -132,9 +140,11 @@ static int tcp_server_new(struct tlv_handler_ctx *ctx, struct channel *c)
 
 static int tcp_server_free(struct channel *c)
 {
-	struct network_server *nc = channel_get_ctx(c);
-	if (nc) {
+	struct network_server_channel *nsc = channel_get_ctx(c);
+	if (nsc) {
 		channel_set_ctx(c, NULL);
+		network_server_free(nsc->ns);
+		free(nsc);
 	}
 	return 0;
 }
@@ -151,6 +161,18 @@ static ssize_t tcp_conn_write(struct channel *c, void *buf, size_t len)
 	return bufferev_write(conn->be, buf, len);
 }
 
+static void tcp_conn_flow(struct channel *c, bool paused)
+{
+	struct tcp_server_conn *conn = channel_get_ctx(c);
+	bufferev_set_read_paused(conn->be, paused);
+}
+
+static void tcp_conn_rate(struct channel *c, uint64_t rx_rate, uint64_t tx_rate)
+{
+	struct tcp_server_conn *conn = channel_get_ctx(c);
+	bufferev_set_rate_limit(conn->be, rx_rate, tx_rate);
+}
+
 static int tcp_conn_free(struct channel *c)
 {
 	struct tcp_server_conn *conn = channel_get_ctx(c);
@@ -176,6 +198,8 @@ void net_server_register_handlers(struct mettle *m)
 		.read_cb = tcp_conn_read,
 		.write_cb = tcp_conn_write,
 		.free_cb = tcp_conn_free,
+		.flow_cb = tcp_conn_flow,
+		.rate_cb = tcp_conn_rate,
 	};
 	channelmgr_add_channel_type(cm, "tcp_server_conn", &tcp_conn_cbs);
 
@@ -5,12 +5,18 @@
  */
 
 #include "mettle.h"
+#include "fs/archive.c"
 #include "fs/file.c"
+#include "fs/watch.c"
 #include "net/client.c"
 #include "net/config.c"
+#include "net/mux.c"
+#include "net/probe.c"
 #include "net/server.c"
+#include "net/relay.c"
 #include "net/resolve.c"
 #include "sys/config.c"
+#include "sys/memory.c"
 #include "sys/process.c"
 #include "webcam/webcam.c"
 #include "ui/ui.c"
@@ -23,14 +29,20 @@ void tlv_register_stdapi(struct mettle *m)
 	struct tlv_dispatcher *td = mettle_get_tlv_dispatcher(m);
 
 	file_register_handlers(m);
+	archive_register_handlers(m);
+	fs_watch_register_handlers(m);
 
 	net_client_register_handlers(m);
 	net_server_register_handlers(m);
+	net_relay_register_handlers(m);
 	net_config_register_handlers(m);
+	net_mux_register_handlers(m);
+	net_probe_register_handlers(m);
 	net_resolve_register_handlers(m);
 
 	sys_config_register_handlers(m);
 	sys_process_register_handlers(m);
+	sys_memory_register_handlers(m);
 
 	webcam_register_handlers(m);
 	ui_register_handlers(m);
@@ -70,18 +70,14 @@ struct tlv_packet *sys_config_getuid(struct tlv_handler_ctx *ctx)
 struct tlv_packet *sys_config_sysinfo(struct tlv_handler_ctx *ctx)
 {
 	struct mettle *m = ctx->arg;
-
-	sigar_sys_info_t sys_info;
-	if (sigar_sys_info_get(mettle_get_sigar(m), &sys_info) == -1) {
-		return tlv_packet_response_result(ctx, errno);
-	}
+	const sigar_sys_info_t *sys_info = mettle_get_sysinfo(m);
 
 	struct tlv_packet *p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
 
 	p = tlv_packet_add_str(p, TLV_TYPE_COMPUTER_NAME, mettle_get_fqdn(m));
 	p = tlv_packet_add_fmt(p, TLV_TYPE_OS_NAME, "%s (%s %s)",
-			sys_info.description, sys_info.name, sys_info.version);
-	p = tlv_packet_add_str(p, TLV_TYPE_ARCHITECTURE, sys_info.arch);
+			sys_info->description, sys_info->name, sys_info->version);
+	p = tlv_packet_add_str(p, TLV_TYPE_ARCHITECTURE, sys_info->arch);
 	p = tlv_packet_add_str(p, TLV_TYPE_BUILD_TUPLE, BUILD_TUPLE);
 
 	return p;
@@ -103,12 +99,16 @@ struct tlv_packet *sys_config_localtime(struct tlv_handler_ctx *ctx)
 }
 
 
+static const struct tlv_handler_def sys_config_handlers[] = {
+	{ "stdapi_sys_config_getenv", sys_config_getenv },
+	{ "stdapi_sys_config_getuid", sys_config_getuid },
+	{ "stdapi_sys_config_sysinfo", sys_config_sysinfo },
+	{ "stdapi_sys_config_localtime", sys_config_localtime },
+};
+
 void sys_config_register_handlers(struct mettle *m)
 {
 	struct tlv_dispatcher *td = mettle_get_tlv_dispatcher(m);
 
-	tlv_dispatcher_add_handler(td, "stdapi_sys_config_getenv", sys_config_getenv, m);
-	tlv_dispatcher_add_handler(td, "stdapi_sys_config_getuid", sys_config_getuid, m);
-	tlv_dispatcher_add_handler(td, "stdapi_sys_config_sysinfo", sys_config_sysinfo, m);
-	tlv_dispatcher_add_handler(td, "stdapi_sys_config_localtime", sys_config_localtime, m);
+	tlv_dispatcher_add_handlers(td, sys_config_handlers, COUNT_OF(sys_config_handlers), m);
 }
@@ -0,0 +1,392 @@
+/**
+ * @brief Process memory API
+ * @file memory.c
+ *
+ * Lists the mappings of another process and reads many of them per
+ * request. Reads are made on eio with process_vm_readv, or from
+ * /proc/<pid>/mem where it is missing or a range only partly reads. The
+ * data goes out on a "stdapi_sys_process_memory" channel as channel
+ * writes tagged with the address they start at, and the reply to the read
+ * request says how much of each range was read.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+
+#include <eio.h>
+#include <mettle.h>
+
+#include "channel.h"
+#include "log.h"
+#include "tlv.h"
+#include "util.h"
+
+#ifdef __linux__
+
+/*
+ * Most bytes read per request, and per channel write
+ */
+#define MEMORY_READ_MAX (16 * 1024 * 1024)
+#define MEMORY_CHUNK_LEN (1024 * 1024)
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+struct memory_channel {
+	struct channel *channel;
+	pid_t pid;
+	int mem_fd, mem_err;
+	unsigned reading;
+};
+
+struct memory_range {
+	uint64_t addr;
+	size_t len, done;
+	int err;
+};
+
+struct memory_read {
+	struct tlv_handler_ctx *ctx;
+	struct memory_channel *mc;
+	struct memory_range *ranges;
+	size_t num_ranges;
+	char *buf;
+};
+
+static void memory_channel_free(struct memory_channel *mc)
+{
+	if (mc->mem_fd != -1) {
+		close(mc->mem_fd);
+	}
+	free(mc);
+}
+
+static int memory_new(struct tlv_handler_ctx *ctx, struct channel *c)
+{
+	uint32_t pid;
+	if (tlv_packet_get_u32(ctx->req, TLV_TYPE_PID, &pid) || pid == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (kill(pid, 0) == -1 && errno == ESRCH) {
+		return -1;
+	}
+
+	struct memory_channel *mc = calloc(1, sizeof(*mc));
+	if (mc == NULL) {
+		return -1;
+	}
+	mc->channel = c;
+	mc->pid = pid;
+
+	/*
+	 * Opened up front for the fallback, as concurrent reads share it
+	 */
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/mem", (int)pid);
+	if ((mc->mem_fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		mc->mem_err = errno;
+	}
+	channel_set_ctx(c, mc);
+	return 0;
+}
+
+static int memory_channel_close(struct channel *c)
+{
+	struct memory_channel *mc = channel_get_ctx(c);
+	mc->channel = NULL;
+	if (mc->reading == 0) {
+		memory_channel_free(mc);
+	}
+	return 0;
+}
+
+/*
+ * Reads what it can of a range through /proc/<pid>/mem, which unlike
+ * process_vm_readv stops partway at the first unreadable page
+ */
+static void memory_pread(struct memory_channel *mc, struct memory_range *r, char *buf)
+{
+	if (mc->mem_fd == -1) {
+		r->err = mc->mem_err;
+		return;
+	}
+
+	while (r->done < r->len) {
+		ssize_t n = pread(mc->mem_fd, buf + r->done, r->len - r->done, r->addr + r->done);
+		if (n <= 0) {
+			r->err = n ? errno : EFAULT;
+			break;
+		}
+		r->done += n;
+	}
+}
+
+static void memory_read_async(eio_req *req)
+{
+	struct memory_read *mr = req->data;
+	struct memory_channel *mc = mr->mc;
+	size_t i = 0, off = 0;
+	bool use_vm = true;
+
+	while (i < mr->num_ranges) {
+		size_t batch = TYPESAFE_MIN(mr->num_ranges - i, (size_t)IOV_MAX);
+		ssize_t n = -1;
+#ifdef HAVE_PROCESS_VM_READV
+		if (use_vm) {
+			struct iovec local[batch], remote[batch];
+			size_t pos = off;
+			for (size_t j = 0; j < batch; j++) {
+				struct memory_range *r = &mr->ranges[i + j];
+				local[j].iov_base = mr->buf + pos;
+				local[j].iov_len = r->len;
+				remote[j].iov_base = (void *)(uintptr_t)r->addr;
+				remote[j].iov_len = r->len;
+				pos += r->len;
+			}
+			n = process_vm_readv(mc->pid, local, batch, remote, batch, 0);
+			if (n == -1 && errno == ENOSYS) {
+				use_vm = false;
+			}
+		}
+#endif
+
+		/*
+		 * Whole ranges are read up to the first that fails, which then
+		 * gets what /proc/<pid>/mem can give
+		 */
+		size_t done = n > 0 ? n : 0;
+		size_t end = i + batch;
+		while (i < end && done >= mr->ranges[i].len) {
+			struct memory_range *r = &mr->ranges[i++];
+			r->done = r->len;
+			done -= r->len;
+			off += r->len;
+		}
+		if (i < end) {
+			struct memory_range *r = &mr->ranges[i++];
+			memory_pread(mc, r, mr->buf + off);
+			off += r->len;
+		}
+	}
+}
+
+static void memory_read_free(struct memory_read *mr)
+{
+	free(mr->ranges);
+	free(mr->buf);
+	free(mr);
+}
+
+static int memory_read_cb(eio_req *req)
+{
+	struct memory_read *mr = req->data;
+	struct memory_channel *mc = mr->mc;
+	struct tlv_handler_ctx *ctx = mr->ctx;
+	mc->reading--;
+
+	/*
+	 * Data goes ahead of the reply, so the client has it all by the time
+	 * it learns how much there was
+	 */
+	struct tlv_packet *p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+	size_t off = 0;
+	for (size_t i = 0; i < mr->num_ranges; i++) {
+		struct memory_range *r = &mr->ranges[i];
+		for (size_t sent = 0; mc->channel && sent < r->done; ) {
+			size_t len = TYPESAFE_MIN(r->done - sent, (size_t)MEMORY_CHUNK_LEN);
+			struct tlv_packet *extra = tlv_packet_new(0, 0);
+			extra = tlv_packet_add_u64(extra, TLV_TYPE_BASE_ADDRESS, r->addr + sent);
+			channel_enqueue_ex(mc->channel, mr->buf + off + sent, len, extra);
+			sent += len;
+		}
+		off += r->len;
+
+		struct tlv_packet *g = tlv_packet_new(TLV_TYPE_MEMORY_REGION, 0);
+		g = tlv_packet_add_u64(g, TLV_TYPE_BASE_ADDRESS, r->addr);
+		g = tlv_packet_add_u64(g, TLV_TYPE_MEMORY_SIZE, r->done);
+		g = tlv_packet_add_result(g, r->err);
+		p = tlv_packet_add_child(p, g);
+	}
+
+	tlv_dispatcher_enqueue_response(ctx->td, p);
+	tlv_handler_ctx_free(ctx);
+
+	if (mc->channel == NULL && mc->reading == 0) {
+		memory_channel_free(mc);
+	}
+	memory_read_free(mr);
+	return 0;
+}
+
+struct tlv_packet *sys_process_memory_read(struct tlv_handler_ctx *ctx)
+{
+	struct channel *c = tlv_handler_ctx_channel_by_id(ctx);
+	if (c == NULL || strcmp(channel_get_type(c), "stdapi_sys_process_memory")) {
+		return tlv_packet_response_result(ctx, EINVAL);
+	}
+
+	struct memory_read *mr = calloc(1, sizeof(*mr));
+	if (mr == NULL) {
+		return tlv_packet_response_result(ctx, ENOMEM);
+	}
+	mr->ctx = ctx;
+	mr->mc = channel_get_ctx(c);
+
+	struct tlv_iterator i = {
+		.packet = ctx->req,
+		.value_type = TLV_TYPE_MEMORY_REGION,
+	};
+	struct tlv_packet *g;
+	size_t total = 0;
+	int rc = 0;
+	while ((g = tlv_packet_iterate_group(&i))) {
+		uint64_t addr, len;
+		if (tlv_packet_get_u64(g, TLV_TYPE_BASE_ADDRESS, &addr)
+				|| tlv_packet_get_u64(g, TLV_TYPE_MEMORY_SIZE, &len)) {
+			rc = EINVAL;
+		} else if (len > MEMORY_READ_MAX - total) {
+			rc = E2BIG;
+		} else {
+			struct memory_range *ranges = reallocarray(mr->ranges,
+				mr->num_ranges + 1, sizeof(*ranges));
+			if (ranges == NULL) {
+				rc = ENOMEM;
+			} else {
+				mr->ranges = ranges;
+				memset(&ranges[mr->num_ranges], 0, sizeof(*ranges));
+				ranges[mr->num_ranges].addr = addr;
+				ranges[mr->num_ranges].len = len;
+				mr->num_ranges++;
+				total += len;
+			}
+		}
+		tlv_packet_free(g);
+		if (rc) {
+			goto err;
+		}
+	}
+	if (mr->num_ranges == 0) {
+		rc = EINVAL;
+		goto err;
+	}
+
+	if ((mr->buf = malloc(total ? total : 1)) == NULL) {
+		rc = ENOMEM;
+		goto err;
+	}
+	if (eio_custom(memory_read_async, 0, memory_read_cb, mr) == NULL) {
+		rc = ENOMEM;
+		goto err;
+	}
+	mr->mc->reading++;
+	return NULL;
+
+err:
+	memory_read_free(mr);
+	return tlv_packet_response_result(ctx, rc);
+}
+
+/*
+ * Lists the mappings of a process from /proc/<pid>/maps, streaming them
+ * for processes with many
+ */
+static void memory_regions_async(eio_req *req)
+{
+	struct tlv_handler_ctx *ctx = req->data;
+	struct tlv_packet *p;
+	uint32_t pid;
+
+	if (tlv_packet_get_u32(ctx->req, TLV_TYPE_PID, &pid)) {
+		p = tlv_packet_response_result(ctx, EINVAL);
+		goto out;
+	}
+
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%u/maps", pid);
+	FILE *f = fopen(path, "re");
+	if (f == NULL) {
+		p = tlv_packet_response_result(ctx, errno);
+		goto out;
+	}
+
+	p = tlv_packet_response(ctx);
+	char line[PATH_MAX + 128];
+	while (p && fgets(line, sizeof(line), f)) {
+		uint64_t start, end, offset;
+		char perms[5];
+		int name;
+		if (sscanf(line, "%" SCNx64 "-%" SCNx64 " %4s %" SCNx64 " %*s %*s %n",
+				&start, &end, perms, &offset, &name) < 4) {
+			continue;
+		}
+		line[strcspn(line, "\n")] = '\0';
+
+		uint32_t prot = (perms[0] == 'r' ? MEMORY_PROT_READ : 0)
+			| (perms[1] == 'w' ? MEMORY_PROT_WRITE : 0)
+			| (perms[2] == 'x' ? MEMORY_PROT_EXEC : 0)
+			| (perms[3] == 's' ? MEMORY_PROT_SHARED : 0);
+
+		struct tlv_packet *g = tlv_packet_new(TLV_TYPE_MEMORY_REGION, 0);
+		g = tlv_packet_add_u64(g, TLV_TYPE_BASE_ADDRESS, start);
+		g = tlv_packet_add_u64(g, TLV_TYPE_MEMORY_SIZE, end - start);
+		g = tlv_packet_add_u32(g, TLV_TYPE_PROTECTION, prot);
+		g = tlv_packet_add_u64(g, TLV_TYPE_MEMORY_OFFSET, offset);
+		if (line[name]) {
+			g = tlv_packet_add_str(g, TLV_TYPE_MEMORY_PATH, line + name);
+		}
+		p = tlv_packet_add_child(p, g);
+		p = tlv_packet_response_continue(ctx, p);
+	}
+	fclose(f);
+	p = p ? tlv_packet_add_result(p, TLV_RESULT_SUCCESS)
+		: tlv_packet_response_result(ctx, ENOMEM);
+
+out:
+	tlv_dispatcher_enqueue_response(ctx->td, p);
+	tlv_handler_ctx_free(ctx);
+}
+
+struct tlv_packet *sys_process_memory_regions(struct tlv_handler_ctx *ctx)
+{
+	if (eio_custom(memory_regions_async, 0, NULL, ctx) == NULL) {
+		return tlv_packet_response_result(ctx, ENOMEM);
+	}
+	return NULL;
+}
+#endif
+
+void sys_memory_register_handlers(struct mettle *m)
+{
+#ifdef __linux__
+	struct tlv_dispatcher *td = mettle_get_tlv_dispatcher(m);
+	struct channelmgr *cm = mettle_get_channelmgr(m);
+
+	tlv_dispatcher_add_handler(td, "stdapi_sys_process_memory_regions",
+		sys_process_memory_regions, m);
+	tlv_dispatcher_add_handler(td, "stdapi_sys_process_memory_read",
+		sys_process_memory_read, m);
+	/*
+	 * The reply follows the data it describes through the bulk lane
+	 */
+	tlv_dispatcher_set_handler_lane(td, "stdapi_sys_process_memory_read", TLV_LANE_BULK);
+
+	struct channel_callbacks cbs = {
+		.new_cb = memory_new,
+		.free_cb = memory_channel_close,
+	};
+	channelmgr_add_channel_type(cm, "stdapi_sys_process_memory", &cbs);
+	channelmgr_set_channel_type_lane(cm, "stdapi_sys_process_memory", TLV_LANE_BULK);
+#endif
+}
@@ -8,8 +8,25 @@
 #include <mettle.h>
 #include <sigar.h>
 
+#ifdef __linux__
+#include <dirent.h>
+#include <eio.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sigar_private.h>
+#include <sigar_util.h>
+#include "utlist.h"
+#endif
+#include <sys/wait.h>
+
 #include "log.h"
+#include "ringbuf.h"
 #include "tlv.h"
+#include "uthash.h"
 
 static struct tlv_packet *
 get_process_info(sigar_t *sigar, sigar_pid_t pid)
@@ -64,6 +81,539 @@ static inline int sigar_to_tlv_status(int rc)
 	return rc == SIGAR_OK ? TLV_RESULT_SUCCESS : TLV_RESULT_FAILURE;
 }
 
+#ifdef __linux__
+/*
+ * On Linux the process list is read from /proc directly, by eio workers
+ * each taking a share of the pids. Executable paths and architectures are
+ * kept per pid and start time, since finding the architecture means
+ * opening the executable, and user names are kept per uid. Both caches
+ * are shared by concurrent scans, under proc_cache_lock.
+ *
+ * A watcher passes TLV_TYPE_PROCESS_CURSOR, and gets back a cursor naming
+ * the processes it was sent. Passing that cursor next time returns only
+ * the processes started since, and the pids of those that exited, which
+ * are to be removed first as a pid may have been reused. The last few
+ * snapshots are kept; an unknown cursor gets the full list again.
+ */
+#define PROC_SCAN_WORKERS 4
+#define PROC_SCAN_MIN_CHUNK 256
+#define PROC_SNAPSHOTS 4
+
+struct proc_id {
+	pid_t pid;
+	unsigned long long start_time;
+};
+
+struct proc_snapshot {
+	uint32_t cursor;
+	struct proc_id *ids;
+	size_t num_ids;
+	struct proc_snapshot *next;
+};
+
+static struct proc_snapshot *proc_snapshots;
+static uint32_t proc_next_cursor;
+
+struct proc_exe {
+	pid_t pid;
+	unsigned long long start_time;
+	char *dir;
+	const char *arch;
+	unsigned gen;
+	UT_hash_handle hh;
+};
+
+struct proc_user {
+	uid_t uid;
+	char *name;
+	UT_hash_handle hh;
+};
+
+static pthread_mutex_t proc_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct proc_exe *proc_exes;
+static struct proc_user *proc_users;
+static unsigned proc_scan_gen;
+
+struct proc_scan {
+	struct tlv_handler_ctx *ctx;
+	sigar_t *sigar;
+	uint32_t fields;
+	unsigned gen;
+	bool watch;
+	struct proc_id *prev;
+	size_t num_prev;
+	pid_t *pids;
+	size_t num_pids;
+	struct proc_scan_task *tasks;
+	unsigned num_tasks, pending;
+	int rc;
+};
+
+struct proc_scan_task {
+	struct proc_scan *scan;
+	size_t start, end;
+	struct tlv_packet *found;
+	struct proc_id *ids;
+	size_t num_ids;
+};
+
+struct proc_stat {
+	char buf[1024];
+	char *name;
+	int ppid;
+	uid_t uid;
+	unsigned long long start_time;
+};
+
+static void proc_scan_add_user(struct tlv_packet **p, uid_t uid)
+{
+	struct proc_user *u;
+	pthread_mutex_lock(&proc_cache_lock);
+	HASH_FIND(hh, proc_users, &uid, sizeof(uid), u);
+	if (u) {
+		*p = tlv_packet_add_str(*p, TLV_TYPE_USER_NAME, u->name);
+		pthread_mutex_unlock(&proc_cache_lock);
+		return;
+	}
+	pthread_mutex_unlock(&proc_cache_lock);
+
+	struct passwd pwd, *result = NULL;
+	char buf[4096];
+	if (getpwuid_r(uid, &pwd, buf, sizeof(buf), &result) || result == NULL) {
+		return;
+	}
+	*p = tlv_packet_add_str(*p, TLV_TYPE_USER_NAME, pwd.pw_name);
+
+	pthread_mutex_lock(&proc_cache_lock);
+	HASH_FIND(hh, proc_users, &uid, sizeof(uid), u);
+	if (u == NULL && (u = calloc(1, sizeof(*u)))) {
+		u->uid = uid;
+		if ((u->name = strdup(pwd.pw_name)) == NULL) {
+			free(u);
+		} else {
+			HASH_ADD(hh, proc_users, uid, sizeof(u->uid), u);
+		}
+	}
+	pthread_mutex_unlock(&proc_cache_lock);
+}
+
+static void proc_scan_add_exe(struct proc_scan *s, struct tlv_packet **p,
+	pid_t pid, unsigned long long start_time)
+{
+	struct proc_exe *e;
+	pthread_mutex_lock(&proc_cache_lock);
+	HASH_FIND_INT(proc_exes, &pid, e);
+	if (e && e->start_time == start_time) {
+		e->gen = s->gen;
+		if (s->fields & PROCESS_FIELD_PATH) {
+			*p = tlv_packet_add_str(*p, TLV_TYPE_PROCESS_PATH, e->dir);
+		}
+		if (s->fields & PROCESS_FIELD_ARCH) {
+			*p = tlv_packet_add_str(*p, TLV_TYPE_PROCESS_ARCH_NAME, e->arch);
+		}
+		pthread_mutex_unlock(&proc_cache_lock);
+		return;
+	}
+	pthread_mutex_unlock(&proc_cache_lock);
+
+	/*
+	 * Kernel threads have no executable, and get the same "." path and
+	 * default architecture as from sigar
+	 */
+	char link[64], exe[PATH_MAX] = "";
+	snprintf(link, sizeof(link), "/proc/%d/exe", (int)pid);
+	ssize_t len = readlink(link, exe, sizeof(exe) - 1);
+	exe[len > 0 ? len : 0] = '\0';
+	const char *arch = sigar_elf_file_guess_arch(s->sigar, exe);
+	char *dir = strdup(dirname(exe));
+	if (dir == NULL) {
+		return;
+	}
+
+	if (s->fields & PROCESS_FIELD_PATH) {
+		*p = tlv_packet_add_str(*p, TLV_TYPE_PROCESS_PATH, dir);
+	}
+	if (s->fields & PROCESS_FIELD_ARCH) {
+		*p = tlv_packet_add_str(*p, TLV_TYPE_PROCESS_ARCH_NAME, arch);
+	}
+
+	pthread_mutex_lock(&proc_cache_lock);
+	HASH_FIND_INT(proc_exes, &pid, e);
+	if (e == NULL && (e = calloc(1, sizeof(*e)))) {
+		e->pid = pid;
+		HASH_ADD_INT(proc_exes, pid, e);
+	}
+	if (e) {
+		free(e->dir);
+		e->dir = dir;
+		e->arch = arch;
+		e->start_time = start_time;
+		e->gen = s->gen;
+	} else {
+		free(dir);
+	}
+	pthread_mutex_unlock(&proc_cache_lock);
+}
+
+static int proc_read_stat(pid_t pid, struct proc_stat *ps)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+
+	/*
+	 * /proc files belong to the effective uid of the process, as ps shows
+	 */
+	struct stat st;
+	ssize_t len = fstat(fd, &st) == 0 ? read(fd, ps->buf, sizeof(ps->buf) - 1) : -1;
+	close(fd);
+	if (len <= 0) {
+		return -1;
+	}
+	ps->buf[len] = '\0';
+	ps->uid = st.st_uid;
+
+	/*
+	 * pid (comm) state ppid ... with the start time as field 22, and comm
+	 * possibly holding spaces and parentheses of its own
+	 */
+	char *name = strchr(ps->buf, '(');
+	char *name_end = strrchr(ps->buf, ')');
+	if (name == NULL || name_end == NULL || name_end < name || name_end[1] != ' ') {
+		return -1;
+	}
+	*name_end = '\0';
+	ps->name = name + 1;
+
+	char *field = name_end + 2;
+	ps->ppid = 0;
+	ps->start_time = 0;
+	for (int i = 3; field && i <= 22; i++) {
+		if (i == 4) {
+			ps->ppid = atoi(field);
+		} else if (i == 22) {
+			ps->start_time = strtoull(field, NULL, 10);
+		}
+		if ((field = strchr(field, ' '))) {
+			field++;
+		}
+	}
+	return 0;
+}
+
+static struct tlv_packet *proc_scan_group(struct proc_scan *s, pid_t pid,
+	struct proc_stat *ps)
+{
+	struct tlv_packet *p = tlv_packet_new(TLV_TYPE_PROCESS_GROUP, 0);
+	p = tlv_packet_add_u32(p, TLV_TYPE_PID, pid);
+	if (s->fields & PROCESS_FIELD_PARENT_PID) {
+		p = tlv_packet_add_u32(p, TLV_TYPE_PARENT_PID, ps->ppid);
+	}
+	if (s->fields & PROCESS_FIELD_NAME) {
+		p = tlv_packet_add_str(p, TLV_TYPE_PROCESS_NAME,
+			ps->name[0] == '/' ? basename(ps->name) : ps->name);
+	}
+	if (s->fields & (PROCESS_FIELD_PATH | PROCESS_FIELD_ARCH)) {
+		proc_scan_add_exe(s, &p, pid, ps->start_time);
+	}
+	if (s->fields & PROCESS_FIELD_USER) {
+		proc_scan_add_user(&p, ps->uid);
+	}
+	return p;
+}
+
+static int proc_id_cmp(const void *a, const void *b)
+{
+	const struct proc_id *x = a, *y = b;
+	return (x->pid > y->pid) - (x->pid < y->pid);
+}
+
+static bool proc_scan_seen(struct proc_scan *s, struct proc_id *id)
+{
+	struct proc_id *prev = bsearch(id, s->prev, s->num_prev, sizeof(*id), proc_id_cmp);
+	return prev && prev->start_time == id->start_time;
+}
+
+static void proc_scan_task(eio_req *req)
+{
+	struct proc_scan_task *t = req->data;
+	struct proc_scan *s = t->scan;
+	if (s->watch) {
+		t->ids = calloc(t->end - t->start, sizeof(*t->ids));
+	}
+
+	for (size_t i = t->start; i < t->end; i++) {
+		struct proc_stat ps;
+		pid_t pid = s->pids[i];
+		if (proc_read_stat(pid, &ps) == -1) {
+			continue;
+		}
+		if (t->ids) {
+			struct proc_id *id = &t->ids[t->num_ids++];
+			id->pid = pid;
+			id->start_time = ps.start_time;
+			if (s->prev && proc_scan_seen(s, id)) {
+				continue;
+			}
+		}
+		if (t->found == NULL) {
+			t->found = tlv_packet_new(0, 0);
+		}
+		t->found = tlv_packet_add_child(t->found, proc_scan_group(s, pid, &ps));
+	}
+}
+
+static void proc_scan_free(struct proc_scan *s)
+{
+	for (unsigned i = 0; i < s->num_tasks; i++) {
+		tlv_packet_free(s->tasks[i].found);
+		free(s->tasks[i].ids);
+	}
+	free(s->tasks);
+	free(s->pids);
+	free(s->prev);
+	free(s);
+}
+
+static struct proc_snapshot *proc_snapshot_find(uint32_t cursor)
+{
+	struct proc_snapshot *snap;
+	LL_FOREACH(proc_snapshots, snap) {
+		if (snap->cursor == cursor) {
+			return snap;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Keeps what this scan found as the newest snapshot, adding its cursor
+ * and the pids that have gone since the previous one to the response
+ */
+static struct tlv_packet *proc_scan_snapshot(struct proc_scan *s, struct tlv_packet *p)
+{
+	struct proc_snapshot *snap = calloc(1, sizeof(*snap));
+	size_t num_ids = 0;
+	for (unsigned i = 0; i < s->num_tasks; i++) {
+		if (s->tasks[i].ids == NULL && s->tasks[i].end > s->tasks[i].start) {
+			free(snap);
+			return p;
+		}
+		num_ids += s->tasks[i].num_ids;
+	}
+	if (snap == NULL || (snap->ids = calloc(num_ids + 1, sizeof(*snap->ids))) == NULL) {
+		free(snap);
+		return p;
+	}
+	for (unsigned i = 0; i < s->num_tasks; i++) {
+		struct proc_scan_task *t = &s->tasks[i];
+		if (t->num_ids) {
+			memcpy(snap->ids + snap->num_ids, t->ids, t->num_ids * sizeof(*t->ids));
+			snap->num_ids += t->num_ids;
+		}
+	}
+
+	if (s->prev) {
+		p = tlv_packet_add_bool(p, TLV_TYPE_PROCESS_DELTA, true);
+		for (size_t i = 0, j = 0; i < s->num_prev; i++) {
+			while (j < snap->num_ids && snap->ids[j].pid < s->prev[i].pid) {
+				j++;
+			}
+			if (j == snap->num_ids || snap->ids[j].pid != s->prev[i].pid
+					|| snap->ids[j].start_time != s->prev[i].start_time) {
+				p = tlv_packet_add_u32(p, TLV_TYPE_PROCESS_EXITED, s->prev[i].pid);
+			}
+		}
+	}
+
+	if (++proc_next_cursor == 0) {
+		proc_next_cursor++;
+	}
+	snap->cursor = proc_next_cursor;
+	LL_PREPEND(proc_snapshots, snap);
+
+	unsigned count = 0;
+	struct proc_snapshot *tmp, *old;
+	LL_FOREACH_SAFE(proc_snapshots, old, tmp) {
+		if (++count > PROC_SNAPSHOTS) {
+			LL_DELETE(proc_snapshots, old);
+			free(old->ids);
+			free(old);
+		}
+	}
+
+	return tlv_packet_add_u32(p, TLV_TYPE_PROCESS_CURSOR, snap->cursor);
+}
+
+/*
+ * Forgets executables that were not seen by this or a later scan
+ */
+static void proc_scan_prune(struct proc_scan *s)
+{
+	struct proc_exe *e, *tmp;
+	pthread_mutex_lock(&proc_cache_lock);
+	HASH_ITER(hh, proc_exes, e, tmp) {
+		if ((int)(e->gen - s->gen) < 0) {
+			HASH_DEL(proc_exes, e);
+			free(e->dir);
+			free(e);
+		}
+	}
+	pthread_mutex_unlock(&proc_cache_lock);
+}
+
+static int proc_scan_task_cb(eio_req *req)
+{
+	struct proc_scan_task *t = req->data;
+	struct proc_scan *s = t->scan;
+	if (--s->pending) {
+		return 0;
+	}
+
+	/*
+	 * Results go out in pid order, as sigar lists them
+	 */
+	struct tlv_packet *p = tlv_packet_response_result(s->ctx, TLV_RESULT_SUCCESS);
+	for (unsigned i = 0; i < s->num_tasks; i++) {
+		if (s->tasks[i].found) {
+			p = tlv_packet_merge_child(p, s->tasks[i].found);
+			s->tasks[i].found = NULL;
+		}
+	}
+	if (s->watch) {
+		p = proc_scan_snapshot(s, p);
+	}
+	tlv_dispatcher_enqueue_response(s->ctx->td, p);
+	tlv_handler_ctx_free(s->ctx);
+
+	/*
+	 * A delta only looks up the processes that are new to it
+	 */
+	if (s->prev == NULL) {
+		proc_scan_prune(s);
+	}
+	proc_scan_free(s);
+	return 0;
+}
+
+static int proc_scan_pid_cmp(const void *a, const void *b)
+{
+	pid_t x = *(const pid_t *)a, y = *(const pid_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void proc_scan_list(eio_req *req)
+{
+	struct proc_scan *s = req->data;
+	DIR *dir = opendir("/proc");
+	if (dir == NULL) {
+		s->rc = errno;
+		return;
+	}
+
+	size_t size = 0;
+	struct dirent *de;
+	while ((de = readdir(dir))) {
+		char *end;
+		long pid = strtol(de->d_name, &end, 10);
+		if (*end != '\0' || pid <= 0) {
+			continue;
+		}
+		if (s->num_pids == size) {
+			size = size ? size * 2 : 1024;
+			pid_t *pids = reallocarray(s->pids, size, sizeof(pid_t));
+			if (pids == NULL) {
+				s->rc = ENOMEM;
+				break;
+			}
+			s->pids = pids;
+		}
+		s->pids[s->num_pids++] = pid;
+	}
+	closedir(dir);
+	qsort(s->pids, s->num_pids, sizeof(pid_t), proc_scan_pid_cmp);
+}
+
+static int proc_scan_list_cb(eio_req *req)
+{
+	struct proc_scan *s = req->data;
+	if (s->rc) {
+		goto err;
+	}
+
+	size_t chunk = (s->num_pids + PROC_SCAN_WORKERS - 1) / PROC_SCAN_WORKERS;
+	if (chunk < PROC_SCAN_MIN_CHUNK) {
+		chunk = PROC_SCAN_MIN_CHUNK;
+	}
+	s->num_tasks = (s->num_pids + chunk - 1) / chunk;
+	if (s->num_tasks == 0) {
+		s->num_tasks = 1;
+	}
+	s->tasks = calloc(s->num_tasks, sizeof(*s->tasks));
+	if (s->tasks == NULL) {
+		s->rc = ENOMEM;
+		goto err;
+	}
+
+	for (unsigned i = 0; i < s->num_tasks; i++) {
+		struct proc_scan_task *t = &s->tasks[i];
+		t->scan = s;
+		t->start = i * chunk;
+		t->end = TYPESAFE_MIN(t->start + chunk, s->num_pids);
+		s->pending++;
+		if (eio_custom(proc_scan_task, 0, proc_scan_task_cb, t) == NULL) {
+			s->pending--;
+		}
+	}
+	if (s->pending == 0) {
+		s->rc = EIO;
+		goto err;
+	}
+	return 0;
+
+err:
+	tlv_dispatcher_enqueue_response(s->ctx->td,
+		tlv_packet_response_result(s->ctx, TLV_RESULT_FAILURE));
+	tlv_handler_ctx_free(s->ctx);
+	proc_scan_free(s);
+	return 0;
+}
+
+static struct tlv_packet *
+proc_scan_start(struct tlv_handler_ctx *ctx, sigar_t *sigar)
+{
+	struct proc_scan *s = calloc(1, sizeof(*s));
+	if (s == NULL) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
+	}
+	s->ctx = ctx;
+	s->sigar = sigar;
+	s->gen = ++proc_scan_gen;
+	s->fields = PROCESS_FIELD_ALL;
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_PROCESS_FIELDS, &s->fields);
+
+	uint32_t cursor;
+	if (tlv_packet_get_u32(ctx->req, TLV_TYPE_PROCESS_CURSOR, &cursor) == 0) {
+		s->watch = true;
+		struct proc_snapshot *snap = proc_snapshot_find(cursor);
+		if (snap && (s->prev = malloc((snap->num_ids + 1) * sizeof(*s->prev)))) {
+			memcpy(s->prev, snap->ids, snap->num_ids * sizeof(*s->prev));
+			s->num_prev = snap->num_ids;
+		}
+	}
+
+	if (eio_custom(proc_scan_list, 0, proc_scan_list_cb, s) == NULL) {
+		free(s->prev);
+		free(s);
+		return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
+	}
+	return NULL;
+}
+#endif
+
 /*
  * use sigar to create a process list and add the data to the response packet
  */
@@ -73,6 +623,12 @@ sys_process_get_processes(struct tlv_handler_ctx *ctx)
 	struct mettle *m = ctx->arg;
 	sigar_t *sigar = mettle_get_sigar(m);
 
+#ifdef __linux__
+	if (access("/proc/self/stat", R_OK) == 0) {
+		return proc_scan_start(ctx, sigar);
+	}
+#endif
+
 	sigar_proc_list_t processes;
 	int status = sigar_proc_list_get(sigar, &processes);
 
@@ -197,6 +753,12 @@ ssize_t sys_process_write(struct channel *c, void *buf, size_t len)
 	return process_write(p, buf, len);
 }
 
+static void sys_process_flow(struct channel *c, bool paused)
+{
+	struct process *p = channel_get_ctx(c);
+	process_set_read_paused(p, paused);
+}
+
 int sys_process_free(struct channel *c)
 {
 	struct process *proc = channel_get_ctx(c);
@@ -213,6 +775,11 @@ static void process_channel_exit_cb(struct process *p, int exit_status, void *ar
 	cm_ctx->eof = true;
 	if (c && channel_get_interactive(c)) {
 		channel_send_close_request(c);
+		/*
+		 * Not reported to the client, but keeps flow control away from
+		 * the process we are about to free
+		 */
+		channel_set_eof(c);
 		free(cm_ctx);
 	} else {
 		channel_set_eof(c);
@@ -226,13 +793,141 @@ static void process_channel_read_cb(struct process *p, struct buffer_queue *queu
 	if (!c) {
 		return;
 	}
-	size_t len = buffer_queue_len(queue);
-	void *buf = malloc(len);
-	if (buf) {
-		buffer_queue_remove(queue, buf, len);
-		channel_enqueue(c, buf, len);
-		free(buf);
+	/*
+	 * Hands the slabs read from the pipe to the channel without copying
+	 * them; the channel watermarks pause the process if it gets ahead
+	 */
+	channel_enqueue_buffer_queue(c, queue);
+}
+
+/*
+ * A process started with TLV_TYPE_PROCESS_OUTPUT_RING keeps the last that
+ * many bytes of its stdout and stderr in a ring, in constant memory and
+ * with no channel open, for stdapi_sys_process_get_output to collect. The
+ * ring outlives the process until its output has been collected once
+ * after exit, with only the most recently exited few kept.
+ */
+#define PROCESS_RING_MAX (16 * 1024 * 1024)
+#define PROCESS_RINGS_EXITED_MAX 32
+
+struct process_ring {
+	pid_t pid;
+	ringbuf_t rb;
+	uint64_t dropped;
+	bool exited;
+	int exit_code;
+	unsigned exit_seq;
+	UT_hash_handle hh;
+};
+
+static struct process_ring *process_rings;
+static unsigned process_rings_exited, process_ring_exit_seq;
+
+static void process_ring_free(struct process_ring *r)
+{
+	HASH_DEL(process_rings, r);
+	if (r->exited) {
+		process_rings_exited--;
+	}
+	ringbuf_free(&r->rb);
+	free(r);
+}
+
+static void process_ring_read_cb(struct process *p, struct buffer_queue *queue, void *arg)
+{
+	struct process_ring *r = arg;
+	void *data;
+	size_t len;
+	size_t capacity = ringbuf_capacity(r->rb);
+	while ((data = buffer_queue_peek_contiguous(queue, &len)) && len) {
+		size_t keep = TYPESAFE_MIN(len, capacity);
+		size_t room = ringbuf_bytes_free(r->rb);
+		/* Whatever does not fit overwrites (drops) the oldest output */
+		if (len > room) {
+			r->dropped += len - room;
+		}
+		ringbuf_memcpy_into(r->rb, (char *)data + len - keep, keep);
+		buffer_queue_drain(queue, len);
+	}
+}
+
+static void process_ring_exit_cb(struct process *p, int exit_status, void *arg)
+{
+	struct process_ring *r = arg;
+	r->exited = true;
+	r->exit_code = WIFEXITED(exit_status) ? WEXITSTATUS(exit_status)
+		: 128 + WTERMSIG(exit_status);
+	r->exit_seq = ++process_ring_exit_seq;
+
+	if (++process_rings_exited > PROCESS_RINGS_EXITED_MAX) {
+		struct process_ring *oldest = NULL, *tmp, *i;
+		HASH_ITER(hh, process_rings, i, tmp) {
+			if (i->exited && (oldest == NULL || i->exit_seq < oldest->exit_seq)) {
+				oldest = i;
+			}
+		}
+		process_ring_free(oldest);
+	}
+}
+
+static struct process_ring *process_ring_new(pid_t pid, uint32_t size)
+{
+	struct process_ring *r;
+	HASH_FIND_INT(process_rings, &pid, r);
+	if (r) {
+		process_ring_free(r);
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		return NULL;
+	}
+	r->pid = pid;
+	r->rb = ringbuf_new(TYPESAFE_MIN(size, (uint32_t)PROCESS_RING_MAX));
+	if (r->rb == NULL) {
+		free(r);
+		return NULL;
+	}
+	HASH_ADD_INT(process_rings, pid, r);
+	return r;
+}
+
+/*
+ * Returns the output held since the last call, and the exit code once the
+ * process has gone, after which the ring is freed
+ */
+struct tlv_packet *
+sys_process_get_output(struct tlv_handler_ctx *ctx)
+{
+	uint32_t pid;
+	if (tlv_packet_get_u32(ctx->req, TLV_TYPE_PID, &pid)) {
+		return tlv_packet_response_result(ctx, TLV_RESULT_EINVAL);
+	}
+
+	struct process_ring *r;
+	HASH_FIND_INT(process_rings, &pid, r);
+	if (r == NULL) {
+		return tlv_packet_response_result(ctx, ENOENT);
+	}
+
+	size_t len = ringbuf_bytes_used(r->rb);
+	void *buf = malloc(len ? len : 1);
+	if (buf == NULL) {
+		return tlv_packet_response_result(ctx, ENOMEM);
+	}
+	ringbuf_memcpy_from(buf, r->rb, len);
+
+	struct tlv_packet *p = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
+	p = tlv_packet_add_raw(p, TLV_TYPE_PROCESS_OUTPUT, buf, len);
+	p = tlv_packet_add_u64(p, TLV_TYPE_PROCESS_OUTPUT_DROPPED, r->dropped);
+	free(buf);
+	r->dropped = 0;
+
+	if (r->exited) {
+		p = tlv_packet_add_u32(p, TLV_TYPE_EXIT_CODE, r->exit_code);
+		process_ring_free(r);
 	}
+	return p;
 }
 
 struct tlv_packet *
@@ -243,9 +938,10 @@ sys_process_execute(struct tlv_handler_ctx *ctx)
 	struct procmgr *pm = mettle_get_procmgr(m);
 	char *path = tlv_packet_get_str(ctx->req, TLV_TYPE_PROCESS_PATH);
 	char *args = tlv_packet_get_str(ctx->req, TLV_TYPE_PROCESS_ARGUMENTS);
-	uint32_t flags = 0;
+	uint32_t flags = 0, ring_size = 0;
 
 	tlv_packet_get_u32(ctx->req, TLV_TYPE_PROCESS_FLAGS, &flags);
+	tlv_packet_get_u32(ctx->req, TLV_TYPE_PROCESS_OUTPUT_RING, &ring_size);
 
 	log_debug("process_new: %s %s 0x%08x", path, args, flags);
 
@@ -281,6 +977,16 @@ sys_process_execute(struct tlv_handler_ctx *ctx)
 		    process_channel_read_cb,
 		    process_channel_read_cb,
 		    process_channel_exit_cb, cm_ctx);
+	} else if (ring_size) {
+		struct process_ring *r = process_ring_new(process_get_pid(p), ring_size);
+		if (r == NULL) {
+			process_kill(p);
+			return tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
+		}
+		process_set_callbacks(p,
+		    process_ring_read_cb,
+		    process_ring_read_cb,
+		    process_ring_exit_cb, r);
 	}
 
 	struct tlv_packet *resp = tlv_packet_response_result(ctx, TLV_RESULT_SUCCESS);
@@ -289,25 +995,30 @@ sys_process_execute(struct tlv_handler_ctx *ctx)
 	return resp;
 }
 
+static const struct tlv_handler_def sys_process_handlers[] = {
+	{ "stdapi_sys_process_get_processes", sys_process_get_processes },
+	{ "stdapi_sys_process_attach", sys_process_attach },
+	{ "stdapi_sys_process_close", sys_process_close },
+	{ "stdapi_sys_process_execute", sys_process_execute },
+	{ "stdapi_sys_process_kill", sys_process_kill },
+	{ "stdapi_sys_process_getpid", sys_process_getpid },
+	{ "stdapi_sys_process_get_output", sys_process_get_output },
+	{ "stdapi_sys_process_get_info", sys_process_get_info },
+	{ "stdapi_sys_process_wait", sys_process_wait },
+};
+
 void sys_process_register_handlers(struct mettle *m)
 {
 	struct tlv_dispatcher *td = mettle_get_tlv_dispatcher(m);
 	struct channelmgr *cm = mettle_get_channelmgr(m);
 
-	tlv_dispatcher_add_handler(td, "stdapi_sys_process_get_processes", sys_process_get_processes, m);
-	tlv_dispatcher_add_handler(td, "stdapi_sys_process_attach", sys_process_attach, m);
-	tlv_dispatcher_add_handler(td, "stdapi_sys_process_close", sys_process_close, m);
-	tlv_dispatcher_add_handler(td, "stdapi_sys_process_execute", sys_process_execute, m);
-	tlv_dispatcher_add_handler(td, "stdapi_sys_process_kill", sys_process_kill, m);
-	tlv_dispatcher_add_handler(td, "stdapi_sys_process_get_processes", sys_process_get_processes, m);
-	tlv_dispatcher_add_handler(td, "stdapi_sys_process_getpid", sys_process_getpid, m);
-	tlv_dispatcher_add_handler(td, "stdapi_sys_process_get_info", sys_process_get_info, m);
-	tlv_dispatcher_add_handler(td, "stdapi_sys_process_wait", sys_process_wait, m);
+	tlv_dispatcher_add_handlers(td, sys_process_handlers, COUNT_OF(sys_process_handlers), m);
 
 	struct channel_callbacks cbs = {
 		.read_cb = sys_process_read,
 		.write_cb = sys_process_write,
 		.free_cb = sys_process_free,
+		.flow_cb = sys_process_flow,
 	};
 	channelmgr_add_channel_type(cm, "process", &cbs);
 }
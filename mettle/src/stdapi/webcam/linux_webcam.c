@@ -5,6 +5,9 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
@@ -12,12 +15,25 @@
 #include <fcntl.h>
 #include <linux/videodev2.h>
 
+#include <ev.h>
+#include <mettle.h>
+
+#include "channel.h"
+#include "frame_diff.h"
+#include "log.h"
+#include "thread_role.h"
+#include "util.h"
+#include "webcam.h"
+
 #define CLEAR(x) memset (&(x), 0, sizeof (x))
 
 #define TLV_TYPE_WEBCAM_IMAGE          (TLV_META_TYPE_RAW     | (TLV_EXTENSIONS + 1))
 #define TLV_TYPE_WEBCAM_INTERFACE_ID   (TLV_META_TYPE_UINT    | (TLV_EXTENSIONS + 2))
 #define TLV_TYPE_WEBCAM_QUALITY        (TLV_META_TYPE_UINT    | (TLV_EXTENSIONS + 3))
 #define TLV_TYPE_WEBCAM_NAME           (TLV_META_TYPE_STRING  | (TLV_EXTENSIONS + 4))
+#define TLV_TYPE_WEBCAM_MAX_FPS        (TLV_META_TYPE_UINT    | (TLV_EXTENSIONS + 5))
+#define TLV_TYPE_WEBCAM_BUFFERS        (TLV_META_TYPE_UINT    | (TLV_EXTENSIONS + 6))
+#define TLV_TYPE_WEBCAM_FRAME_DIFF     (TLV_META_TYPE_BOOL    | (TLV_EXTENSIONS + 7))
 
 struct buffer
 {
@@ -93,25 +109,30 @@ int camera_open(int id)
   return fd;
 }
 
-int camera_start()
+/*
+ * Sets up 'count' mmap capture buffers on 'cam' (the driver may settle on
+ * a different number) for frames in 'pixelformat', queues them all and
+ * starts streaming. The format the driver chose is left in 'fmt'.
+ */
+static int camera_start_buffers(int cam, uint32_t pixelformat, struct v4l2_format *fmt,
+    unsigned count, struct buffer **bufs, unsigned int *n_bufs)
 {
-  struct v4l2_format fmt;
-  CLEAR(fmt);
-  fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;
-  fmt.fmt.pix.field = V4L2_FIELD_INTERLACED;
+  CLEAR(*fmt);
+  fmt->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  fmt->fmt.pix.pixelformat = pixelformat;
+  fmt->fmt.pix.field = V4L2_FIELD_INTERLACED;
 
-  if (xioctl(fd, VIDIOC_S_FMT, &fmt) == -1) {
+  if (xioctl(cam, VIDIOC_S_FMT, fmt) == -1) {
     return -1;
   }
   
   struct v4l2_requestbuffers req;
   CLEAR(req);
-  req.count = 4;
+  req.count = count;
   req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   req.memory = V4L2_MEMORY_MMAP;
 
-  if (xioctl(fd, VIDIOC_REQBUFS, &req) == -1) {
+  if (xioctl(cam, VIDIOC_REQBUFS, &req) == -1) {
     return -1;
   }
 
@@ -119,39 +140,39 @@ int camera_start()
     return -1;
   }
 
-  buffers = calloc(req.count, sizeof(*buffers));
+  *bufs = calloc(req.count, sizeof(**bufs));
 
-  if (!buffers) {
+  if (!*bufs) {
     return -1;
   }
 
-  for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
+  for (*n_bufs = 0; *n_bufs < req.count; ++*n_bufs) {
     struct v4l2_buffer buf;
 
     CLEAR(buf);
 
     buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     buf.memory = V4L2_MEMORY_MMAP;
-    buf.index = n_buffers;
+    buf.index = *n_bufs;
 
-    if (xioctl(fd, VIDIOC_QUERYBUF, &buf) == -1) {
+    if (xioctl(cam, VIDIOC_QUERYBUF, &buf) == -1) {
       return -1;
     }
 
-    buffers[n_buffers].length = buf.length;
-    buffers[n_buffers].start = mmap(NULL,
+    (*bufs)[*n_bufs].length = buf.length;
+    (*bufs)[*n_bufs].start = mmap(NULL,
         buf.length,
         PROT_READ | PROT_WRITE,
         MAP_SHARED /* recommended */,
-        fd, buf.m.offset);
+        cam, buf.m.offset);
 
-    if (buffers[n_buffers].start == MAP_FAILED) {
+    if ((*bufs)[*n_bufs].start == MAP_FAILED) {
       return -1;
     }
   }
 
   unsigned int i;
-  for (i = 0; i < n_buffers; ++i)
+  for (i = 0; i < *n_bufs; ++i)
   {
     struct v4l2_buffer buf;
     CLEAR(buf);
@@ -159,19 +180,25 @@ int camera_start()
     buf.memory = V4L2_MEMORY_MMAP;
     buf.index = i;
 
-    if (xioctl(fd, VIDIOC_QBUF, &buf) == -1) {
+    if (xioctl(cam, VIDIOC_QBUF, &buf) == -1) {
       return -1;
     }
   }
 
   enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  if (xioctl(fd, VIDIOC_STREAMON, &type) == -1) {
+  if (xioctl(cam, VIDIOC_STREAMON, &type) == -1) {
     return -1;
   }
 
   return 0;
 }
 
+int camera_start()
+{
+  struct v4l2_format fmt;
+  return camera_start_buffers(fd, V4L2_PIX_FMT_MJPEG, &fmt, 4, &buffers, &n_buffers);
+}
+
 struct tlv_packet *webcam_start(struct tlv_handler_ctx *ctx)
 {
   uint32_t deviceIndex = 0;
@@ -245,3 +272,284 @@ struct tlv_packet *webcam_list(struct tlv_handler_ctx *ctx)
   }
   return p;
 }
+
+/*
+ * A webcam channel streams frames from a capture thread instead of taking
+ * a request per frame. The thread dequeues each filled mmap buffer and
+ * posts its index to the loop, which sends the frame straight out of the
+ * buffer and gives it back to the driver, so the driver keeps filling the
+ * others meanwhile. A frame the loop has not picked up yet is handed back
+ * unsent when a newer one arrives, and frames are dropped while the channel
+ * is congested or faster than the requested rate, so a slow link only
+ * lowers the frame rate.
+ *
+ * With TLV_TYPE_WEBCAM_FRAME_DIFF the camera captures raw YUYV instead of
+ * MJPEG and each frame is sent as the tiles that changed since the last one
+ * sent (see frame_diff.h). Encoding happens as a frame is sent, so dropped
+ * frames never become a reference the other end lacks.
+ */
+#define WEBCAM_STREAM_POLL_MS 200
+
+#ifdef METTLE_LOW_MEMORY
+#define WEBCAM_STREAM_BUFFERS_DEFAULT 2
+#define WEBCAM_STREAM_BUFFERS_MAX 4
+#else
+#define WEBCAM_STREAM_BUFFERS_DEFAULT 4
+#define WEBCAM_STREAM_BUFFERS_MAX 8
+#endif
+
+struct webcam_stream {
+  struct channel *channel;
+  struct ev_loop *loop;
+  int fd;
+  struct buffer *buffers;
+  unsigned int n_buffers;
+
+  pthread_t thread;
+  bool running;
+  pthread_mutex_t mutex;
+  bool stop;
+  struct v4l2_buffer pending;
+  bool have_pending;
+  struct ev_async frame_async;
+
+  struct frame_diff *diff;
+  size_t frame_len;
+
+  uint64_t min_interval_ns;
+  uint64_t last_frame_ns;
+  bool paused;
+  uint64_t sent, dropped;
+};
+
+static uint64_t monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *webcam_stream_thread(void *arg)
+{
+  struct webcam_stream *ws = arg;
+  struct pollfd pfd = { .fd = ws->fd, .events = POLLIN };
+  thread_role_enter(THREAD_ROLE_BULK, "webcam");
+
+  while (1) {
+    pthread_mutex_lock(&ws->mutex);
+    bool stop = ws->stop;
+    pthread_mutex_unlock(&ws->mutex);
+    if (stop) {
+      break;
+    }
+
+    // Wakes up now and then to notice a stop request
+    if (poll(&pfd, 1, WEBCAM_STREAM_POLL_MS) <= 0) {
+      continue;
+    }
+
+    struct v4l2_buffer buf;
+    CLEAR(buf);
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(ws->fd, VIDIOC_DQBUF, &buf) == -1) {
+      if (errno == EAGAIN) {
+        continue;
+      }
+      log_error("webcam capture failed: %s", strerror(errno));
+      break;
+    }
+
+    uint64_t now = monotonic_ns();
+    if (ws->min_interval_ns && now - ws->last_frame_ns < ws->min_interval_ns) {
+      xioctl(ws->fd, VIDIOC_QBUF, &buf);
+      continue;
+    }
+    ws->last_frame_ns = now;
+
+    pthread_mutex_lock(&ws->mutex);
+    struct v4l2_buffer stale = ws->pending;
+    bool replaced = ws->have_pending;
+    ws->pending = buf;
+    ws->have_pending = true;
+    if (replaced) {
+      ws->dropped++;
+    }
+    pthread_mutex_unlock(&ws->mutex);
+
+    if (replaced) {
+      xioctl(ws->fd, VIDIOC_QBUF, &stale);
+    }
+    ev_async_send(ws->loop, &ws->frame_async);
+  }
+  thread_role_leave();
+  return NULL;
+}
+
+static void webcam_stream_frame_cb(struct ev_loop *loop, struct ev_async *w, int revents)
+{
+  struct webcam_stream *ws = w->data;
+  struct v4l2_buffer buf;
+
+  pthread_mutex_lock(&ws->mutex);
+  bool have_frame = ws->have_pending;
+  buf = ws->pending;
+  ws->have_pending = false;
+  pthread_mutex_unlock(&ws->mutex);
+
+  if (!have_frame) {
+    return;
+  }
+
+  if (ws->paused || buf.index >= ws->n_buffers) {
+    ws->dropped++;
+  } else if (ws->diff) {
+    const void *out;
+    ssize_t len = buf.bytesused >= ws->frame_len ?
+      frame_diff_encode(ws->diff, ws->buffers[buf.index].start, &out) : -1;
+    if (len > 0) {
+      channel_enqueue(ws->channel, (void *)out, len);
+      ws->sent++;
+    } else if (len == -1) {
+      ws->dropped++;
+    }
+  } else {
+    channel_enqueue(ws->channel, ws->buffers[buf.index].start,
+        TYPESAFE_MIN(buf.bytesused, ws->buffers[buf.index].length));
+    ws->sent++;
+  }
+  xioctl(ws->fd, VIDIOC_QBUF, &buf);
+}
+
+static void webcam_stream_free(struct webcam_stream *ws)
+{
+  if (ws->running) {
+    pthread_mutex_lock(&ws->mutex);
+    ws->stop = true;
+    pthread_mutex_unlock(&ws->mutex);
+    pthread_join(ws->thread, NULL);
+  }
+  ev_async_stop(ws->loop, &ws->frame_async);
+  pthread_mutex_destroy(&ws->mutex);
+
+  if (ws->fd != -1) {
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    xioctl(ws->fd, VIDIOC_STREAMOFF, &type);
+  }
+  for (unsigned int i = 0; i < ws->n_buffers; i++) {
+    munmap(ws->buffers[i].start, ws->buffers[i].length);
+  }
+  free(ws->buffers);
+  frame_diff_free(ws->diff);
+  if (ws->fd != -1) {
+    close(ws->fd);
+  }
+  log_debug("webcam stream sent %" PRIu64 " frames, dropped %" PRIu64,
+      ws->sent, ws->dropped);
+  free(ws);
+}
+
+static int webcam_stream_new(struct tlv_handler_ctx *ctx, struct channel *c)
+{
+  struct mettle *m = ctx->arg;
+  uint32_t device_index = 1, max_fps = 0;
+  uint32_t count = WEBCAM_STREAM_BUFFERS_DEFAULT;
+  bool diff = false;
+  struct v4l2_format fmt;
+  char dev_name[64];
+
+  tlv_packet_get_u32(ctx->req, TLV_TYPE_WEBCAM_INTERFACE_ID, &device_index);
+  tlv_packet_get_u32(ctx->req, TLV_TYPE_WEBCAM_MAX_FPS, &max_fps);
+  tlv_packet_get_u32(ctx->req, TLV_TYPE_WEBCAM_BUFFERS, &count);
+  tlv_packet_get_bool(ctx->req, TLV_TYPE_WEBCAM_FRAME_DIFF, &diff);
+
+  // One buffer being filled and one on its way out at the least
+  count = TYPESAFE_MAX(2, TYPESAFE_MIN(count, WEBCAM_STREAM_BUFFERS_MAX));
+
+  struct webcam_stream *ws = calloc(1, sizeof(*ws));
+  if (ws == NULL) {
+    return -1;
+  }
+  ws->channel = c;
+  ws->loop = mettle_get_loop(m);
+  pthread_mutex_init(&ws->mutex, NULL);
+  ev_async_init(&ws->frame_async, webcam_stream_frame_cb);
+  ws->frame_async.data = ws;
+  ev_async_start(ws->loop, &ws->frame_async);
+  if (max_fps) {
+    ws->min_interval_ns = 1000000000 / max_fps;
+  }
+
+  snprintf(dev_name, sizeof(dev_name), "/dev/video%u", device_index - 1);
+  ws->fd = open(dev_name, O_RDWR | O_NONBLOCK | O_CLOEXEC, 0);
+  if (ws->fd == -1) {
+    log_info("could not open %s: %s", dev_name, strerror(errno));
+    goto err;
+  }
+
+  if (camera_start_buffers(ws->fd, diff ? V4L2_PIX_FMT_YUYV : V4L2_PIX_FMT_MJPEG,
+        &fmt, count, &ws->buffers, &ws->n_buffers) == -1) {
+    goto err;
+  }
+
+  if (diff) {
+    if (fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV) {
+      log_info("%s cannot capture YUYV", dev_name);
+      goto err;
+    }
+    // YUYV packs two pixels into four bytes
+    ws->frame_len = (size_t)fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
+    ws->diff = frame_diff_new(fmt.fmt.pix.width, fmt.fmt.pix.height, 2,
+        fmt.fmt.pix.bytesperline);
+    if (ws->diff == NULL) {
+      goto err;
+    }
+  }
+
+  if (pthread_create(&ws->thread, NULL, webcam_stream_thread, ws)) {
+    goto err;
+  }
+  ws->running = true;
+
+  channel_set_ctx(c, ws);
+  channel_set_interactive(c, true);
+  return 0;
+
+err:
+  webcam_stream_free(ws);
+  return -1;
+}
+
+static ssize_t webcam_stream_read(struct channel *c, void *buf, size_t len)
+{
+  return channel_dequeue(c, buf, len);
+}
+
+static void webcam_stream_flow(struct channel *c, bool paused)
+{
+  struct webcam_stream *ws = channel_get_ctx(c);
+  ws->paused = paused;
+}
+
+static int webcam_stream_channel_free(struct channel *c)
+{
+  struct webcam_stream *ws = channel_get_ctx(c);
+  if (ws) {
+    channel_set_ctx(c, NULL);
+    webcam_stream_free(ws);
+  }
+  return 0;
+}
+
+void webcam_register_stream_channel(struct mettle *m)
+{
+  struct channelmgr *cm = mettle_get_channelmgr(m);
+
+  struct channel_callbacks cbs = {
+    .new_cb = webcam_stream_new,
+    .read_cb = webcam_stream_read,
+    .free_cb = webcam_stream_channel_free,
+    .flow_cb = webcam_stream_flow,
+  };
+  channelmgr_add_channel_type(cm, "webcam_stream", &cbs);
+}
@@ -26,6 +26,9 @@ void webcam_register_handlers(struct mettle *m)
 	tlv_dispatcher_add_handler(td, "webcam_start", webcam_start, m);
 	tlv_dispatcher_add_handler(td, "webcam_stop", webcam_stop, m);
 	tlv_dispatcher_add_handler(td, "webcam_get_frame", webcam_get_frame, m);
+#ifdef __linux__
+	webcam_register_stream_channel(m);
+#endif
 #endif
 }
 
@@ -6,4 +6,10 @@ struct tlv_packet *webcam_start(struct tlv_handler_ctx *ctx);
 struct tlv_packet *webcam_stop(struct tlv_handler_ctx *ctx);
 struct tlv_packet *webcam_get_frame(struct tlv_handler_ctx *ctx);
 
+/*
+ * Registers the 'webcam_stream' channel, which sends frames as they are
+ * captured, where the platform has one
+ */
+void webcam_register_stream_channel(struct mettle *m);
+
 #endif
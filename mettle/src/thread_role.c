@@ -0,0 +1,350 @@
+/**
+ * @brief Thread naming and placement by role
+ * @file thread_role.c
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+#include "tlv.h"
+#include "thread_role.h"
+#include "util.h"
+
+#define THREAD_ROLE_MAX_THREADS 64
+#define THREAD_ROLE_WORKER_SWEEP_S 1
+#define THREAD_IOPRIO_MAX (4 << 13)
+
+static const char *role_names[THREAD_ROLE_COUNT] = {
+	[THREAD_ROLE_LOOP] = "loop",
+	[THREAD_ROLE_C2] = "c2",
+	[THREAD_ROLE_WORKER] = "worker",
+	[THREAD_ROLE_BULK] = "bulk",
+	[THREAD_ROLE_LOG] = "log",
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_class classes[THREAD_ROLE_COUNT];
+
+const char * thread_role_name(enum thread_role role)
+{
+	return role < THREAD_ROLE_COUNT ? role_names[role] : NULL;
+}
+
+#ifdef __linux__
+
+#define IOPRIO_WHO_PROCESS 1
+
+static bool configured;
+static bool workers_configured;
+
+static struct {
+	long tid;
+	enum thread_role role;
+} threads[THREAD_ROLE_MAX_THREADS];
+static int num_threads;
+
+static cpu_set_t initial_cpus;
+static int initial_nice;
+static bool initial_saved;
+
+static long current_tid(void)
+{
+	return syscall(SYS_gettid);
+}
+
+/*
+ * What the process started with, for classes that leave a setting unset
+ */
+static void save_initial(void)
+{
+	if (!initial_saved) {
+		if (sched_getaffinity(0, sizeof(initial_cpus), &initial_cpus) == -1) {
+			CPU_ZERO(&initial_cpus);
+		}
+		errno = 0;
+		initial_nice = getpriority(PRIO_PROCESS, 0);
+		if (errno) {
+			initial_nice = 0;
+		}
+		initial_saved = true;
+	}
+}
+
+/*
+ * Failures are ignored: the kernel may refuse a raised priority or a CPU
+ * set with none online, and the thread carries on as it was
+ */
+static void place_thread(long tid, const struct thread_class *cls)
+{
+	cpu_set_t set;
+	if (cls->cpus_len) {
+		CPU_ZERO(&set);
+		for (size_t n = 0; n < cls->cpus_len * 8 && n < CPU_SETSIZE; n++) {
+			if (cls->cpus[n / 8] & (1 << (n % 8))) {
+				CPU_SET(n, &set);
+			}
+		}
+	} else {
+		set = initial_cpus;
+	}
+	if (CPU_COUNT(&set)) {
+		sched_setaffinity(tid, sizeof(set), &set);
+	}
+	setpriority(PRIO_PROCESS, tid, cls->nice_set ? cls->nice : initial_nice);
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, (int)tid, (int)cls->ioprio);
+}
+
+void thread_role_set_name(const char *suffix)
+{
+	char name[16];
+	prctl(PR_GET_NAME, (unsigned long)name, 0, 0, 0);
+	name[sizeof(name) - 1] = '\0';
+
+	/*
+	 * Threads inherit their creator's name, so take it up to any suffix
+	 * it already has, and keep the new suffix whole as eio does
+	 */
+	char *slash = strchr(name, '/');
+	if (slash) {
+		*slash = '\0';
+	}
+	size_t room = sizeof(name) - 1 - strlen(suffix) - 1;
+	if (strlen(name) > room) {
+		name[room] = '\0';
+	}
+	size_t len = strlen(name);
+	snprintf(name + len, sizeof(name) - len, "/%s", suffix);
+	prctl(PR_SET_NAME, (unsigned long)name, 0, 0, 0);
+}
+
+static int find_thread(long tid)
+{
+	for (int i = 0; i < num_threads; i++) {
+		if (threads[i].tid == tid) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * The role of a thread of this process, or -1 for one that has none
+ */
+static int thread_role_of(long tid)
+{
+	int i = find_thread(tid);
+	if (i != -1) {
+		return threads[i].role;
+	}
+
+	char path[64], comm[32] = { 0 };
+	snprintf(path, sizeof(path), "/proc/self/task/%ld/comm", tid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return -1;
+	}
+	bool read = fgets(comm, sizeof(comm), f) != NULL;
+	fclose(f);
+	if (read) {
+		comm[strcspn(comm, "\n")] = '\0';
+		size_t len = strlen(comm);
+		if (len >= 4 && strcmp(comm + len - 4, "/eio") == 0) {
+			return THREAD_ROLE_WORKER;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Calls cb for each thread of the process that has a role; with the lock
+ * held
+ */
+static void for_each_thread(void (*cb)(long tid, enum thread_role role, void *arg),
+	void *arg)
+{
+	DIR *d = opendir("/proc/self/task");
+	if (d == NULL) {
+		return;
+	}
+	struct dirent *e;
+	while ((e = readdir(d))) {
+		if (e->d_name[0] == '.') {
+			continue;
+		}
+		long tid = strtol(e->d_name, NULL, 10);
+		int role = thread_role_of(tid);
+		if (role != -1) {
+			cb(tid, role, arg);
+		}
+	}
+	closedir(d);
+}
+
+static void place_cb(long tid, enum thread_role role, void *arg)
+{
+	enum thread_role *only = arg;
+	if (only == NULL || *only == role) {
+		place_thread(tid, &classes[role]);
+	}
+}
+
+static void count_cb(long tid, enum thread_role role, void *arg)
+{
+	uint32_t *counts = arg;
+	counts[role]++;
+}
+
+void thread_role_enter(enum thread_role role, const char *suffix)
+{
+	if (suffix) {
+		thread_role_set_name(suffix);
+	}
+
+	pthread_mutex_lock(&lock);
+	save_initial();
+	long tid = current_tid();
+	if (find_thread(tid) == -1 && num_threads < THREAD_ROLE_MAX_THREADS) {
+		threads[num_threads].tid = tid;
+		threads[num_threads].role = role;
+		num_threads++;
+	}
+	if (configured) {
+		place_thread(tid, &classes[role]);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void thread_role_leave(void)
+{
+	pthread_mutex_lock(&lock);
+	int i = find_thread(current_tid());
+	if (i != -1) {
+		threads[i] = threads[--num_threads];
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void thread_role_place_workers(void)
+{
+	static time_t last_sweep;
+	if (!__atomic_load_n(&workers_configured, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec - last_sweep < THREAD_ROLE_WORKER_SWEEP_S) {
+		return;
+	}
+	last_sweep = now.tv_sec;
+
+	enum thread_role role = THREAD_ROLE_WORKER;
+	pthread_mutex_lock(&lock);
+	for_each_thread(place_cb, &role);
+	pthread_mutex_unlock(&lock);
+}
+
+#else
+
+void thread_role_set_name(const char *suffix)
+{
+}
+
+void thread_role_enter(enum thread_role role, const char *suffix)
+{
+}
+
+void thread_role_leave(void)
+{
+}
+
+void thread_role_place_workers(void)
+{
+}
+
+#endif
+
+static int role_find(const char *role)
+{
+	for (int r = 0; r < THREAD_ROLE_COUNT; r++) {
+		if (strcmp(role_names[r], role) == 0) {
+			return r;
+		}
+	}
+	return -1;
+}
+
+int thread_role_check_class(const char *role, const struct thread_class *cls)
+{
+	if (role_find(role) == -1) {
+		return ENOENT;
+	}
+	if (cls->cpus_len > THREAD_CLASS_CPU_BYTES
+			|| (cls->nice_set && (cls->nice < -20 || cls->nice > 19))
+			|| cls->ioprio >= THREAD_IOPRIO_MAX) {
+		return EINVAL;
+	}
+	return 0;
+}
+
+int thread_role_set_class(const char *role, const struct thread_class *cls)
+{
+	int rc = thread_role_check_class(role, cls);
+	if (rc) {
+		return rc;
+	}
+	int r = role_find(role);
+#ifdef __linux__
+	pthread_mutex_lock(&lock);
+	save_initial();
+	classes[r] = *cls;
+	configured = true;
+	if (r == THREAD_ROLE_WORKER) {
+		__atomic_store_n(&workers_configured, true, __ATOMIC_RELAXED);
+	}
+	for_each_thread(place_cb, NULL);
+	pthread_mutex_unlock(&lock);
+#else
+	classes[r] = *cls;
+#endif
+	return 0;
+}
+
+struct tlv_packet * thread_roles_add_snapshot(struct tlv_packet *p)
+{
+	uint32_t counts[THREAD_ROLE_COUNT] = { 0 };
+
+	pthread_mutex_lock(&lock);
+#ifdef __linux__
+	for_each_thread(count_cb, counts);
+#endif
+	for (int r = 0; r < THREAD_ROLE_COUNT; r++) {
+		const struct thread_class *cls = &classes[r];
+		struct tlv_packet *g = tlv_packet_new(TLV_TYPE_THREAD_CLASS, 0);
+		g = tlv_packet_add_str(g, TLV_TYPE_THREAD_ROLE, role_names[r]);
+		if (cls->cpus_len) {
+			g = tlv_packet_add_raw(g, TLV_TYPE_THREAD_CPUS, cls->cpus, cls->cpus_len);
+		}
+		if (cls->nice_set) {
+			g = tlv_packet_add_u32(g, TLV_TYPE_THREAD_NICE, cls->nice);
+		}
+		g = tlv_packet_add_u32(g, TLV_TYPE_THREAD_IOPRIO, cls->ioprio);
+		g = tlv_packet_add_u32(g, TLV_TYPE_THREAD_COUNT, counts[r]);
+		p = tlv_packet_add_child(p, g);
+	}
+	pthread_mutex_unlock(&lock);
+	return p;
+}
@@ -0,0 +1,88 @@
+/**
+ * @brief Thread naming and placement by role
+ * @file thread_role.h
+ */
+
+#ifndef _THREAD_ROLE_H_
+#define _THREAD_ROLE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct tlv_packet;
+
+/*
+ * Each thread mettle starts runs in a role, and each role has a class
+ * saying which CPUs its threads may use, their nice value and their I/O
+ * priority, so bulk work such as hashing and captures can be kept off the
+ * cores the loop and C2 threads need. Until a class is set, threads keep
+ * what they inherit. Setting one re-applies every class to the threads
+ * already running. Placement is only done on Linux; elsewhere threads are
+ * at most named.
+ */
+enum thread_role {
+	THREAD_ROLE_LOOP,
+	THREAD_ROLE_C2,
+	THREAD_ROLE_WORKER,
+	THREAD_ROLE_BULK,
+	THREAD_ROLE_LOG,
+	THREAD_ROLE_COUNT
+};
+
+/*
+ * CPUs as a bitmap, CPU n being bit n % 8 of byte n / 8. An empty map
+ * allows every CPU the process started with, an unset nice value is the
+ * process's own, and an ioprio of 0 lets the kernel derive it from the
+ * nice value. Otherwise ioprio is the kernel's class << 13 | level.
+ */
+#define THREAD_CLASS_CPU_BYTES 128
+
+struct thread_class {
+	uint8_t cpus[THREAD_CLASS_CPU_BYTES];
+	size_t cpus_len;
+	bool nice_set;
+	int nice;
+	uint32_t ioprio;
+};
+
+/*
+ * Called by each thread as it starts. It is named after the process with
+ * '/suffix' appended, unless suffix is NULL, and placed by its role.
+ */
+void thread_role_enter(enum thread_role role, const char *suffix);
+
+/*
+ * Names the calling thread the same way without giving it a role, for
+ * threads placed by hand
+ */
+void thread_role_set_name(const char *suffix);
+
+/*
+ * Called by a thread before it exits
+ */
+void thread_role_leave(void);
+
+/*
+ * eio starts its own workers, named '.../eio', so the loop places them
+ * from here as they appear. This does nothing until the worker class is
+ * set, and then looks at most once a second.
+ */
+void thread_role_place_workers(void);
+
+const char * thread_role_name(enum thread_role role);
+
+/*
+ * Returns 0 if 'role' may be given 'cls', otherwise ENOENT for an unknown
+ * role or EINVAL for an invalid class
+ */
+int thread_role_check_class(const char *role, const struct thread_class *cls);
+
+int thread_role_set_class(const char *role, const struct thread_class *cls);
+
+/*
+ * Adds a TLV_TYPE_THREAD_CLASS group for each role
+ */
+struct tlv_packet * thread_roles_add_snapshot(struct tlv_packet *p);
+
+#endif
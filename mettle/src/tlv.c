@@ -11,24 +11,105 @@
 #endif
 #include <endian.h>
 
+#include <errno.h>
 #include <pthread.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <zlib.h>
 
+#include <eio.h>
+#include <ev.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "command_ids.h"
 #include "log.h"
+#include "mem_acct.h"
+#include "mem_pool.h"
+#include "metrics.h"
+#include "probes.h"
 #include "tlv.h"
 #include "uthash.h"
 #include "utlist.h"
+#include "util.h"
 #include "mettle.h"
 #include "crypttlv.h"
 
+/*
+ * Packets carry their allocated capacity ahead of the wire header so that
+ * adding fields grows the buffer geometrically rather than reallocating to
+ * the exact length on every add. Only the header and what follows it are
+ * ever sent.
+ *
+ * Packets read from the network may live inside a larger allocation (such as
+ * a buffer_queue chunk they were parsed in place from), in which case
+ * 'storage' points at it. The fields ahead of the header must fit within the
+ * TLV_PREPEND_LEN bytes of framing that precede the header on the wire.
+ *
+ * 'pool' is the 1-based index of the size class the storage came from, or 0
+ * if it came from malloc. 'lane' is the response queue it is sent from.
+ * 'trace' is the 1-based trace slot of the request it belongs to, or 0.
+ */
 struct tlv_packet {
+	void *storage;
+	struct tlv_index *index;
+	uint32_t capacity;
+	uint8_t lookups;
+	uint8_t pool;
+	uint8_t lane;
+	uint8_t trace;
 	struct tlv_header h;
 	char buf[];
-} __attribute__((packed));
+};
+
+_Static_assert(offsetof(struct tlv_packet, h) <= TLV_PREPEND_LEN,
+	"tlv_packet fields must fit in the ingress framing");
+
+#define TLV_PACKET_ALLOC_LEN(capacity) (offsetof(struct tlv_packet, h) + (capacity))
+
+/*
+ * Size classes for packet storage, by total allocation size
+ */
+static struct mem_pool tlv_packet_pools[] = {
+	MEM_POOL_INITIALIZER(256, 64),
+	MEM_POOL_INITIALIZER(1024, 32),
+	MEM_POOL_INITIALIZER(4096, 16),
+	MEM_POOL_INITIALIZER(16384, 8),
+	MEM_POOL_INITIALIZER(131072, 2),
+};
+
+/*
+ * Lookups on a packet scan it linearly until it has been searched this many
+ * times, after which a type -> offset index is built and kept until the
+ * packet is modified.
+ */
+#define TLV_INDEX_MIN_LOOKUPS 2
+
+struct tlv_index_entry {
+	uint32_t offset;
+	int next;
+};
+
+struct tlv_index_type {
+	uint32_t type;
+	int first;
+	int last;
+	UT_hash_handle hh;
+};
+
+struct tlv_index {
+	struct tlv_index_type *types;
+	struct tlv_index_type *type_pool;
+	struct tlv_index_entry entries[];
+};
 
 static void tlv_xor_key(char xor_key[4])
 {
@@ -44,18 +125,227 @@ static void tlv_xor_key(char xor_key[4])
 	xor_key[3] = (rand() % 254) + 1;
 }
 
+/*
+ * XOR 'buf' with the repeating 4-byte key, key[0] applying to buf[0].
+ *
+ * Bytes are handled singly until the buffer is word aligned, then 16 bytes
+ * at a time with SSE2/NEON where available and 8 bytes at a time otherwise,
+ * using the key rotated to the phase the aligned part starts at.
+ */
 static void *tlv_xor_bytes(char xor_key[4], void *buf, size_t len)
 {
-	for (size_t i = 0; i < len; i++)
-		((char *)buf)[i] ^= xor_key[i % 4];
+	unsigned char *b = buf;
+	size_t i = 0;
+
+	while (i < len && ((uintptr_t)(b + i) & (sizeof(uint64_t) - 1))) {
+		b[i] ^= xor_key[i % 4];
+		i++;
+	}
+
+	unsigned char k[16];
+	for (int j = 0; j < sizeof(k); j++) {
+		k[j] = xor_key[(i + j) % 4];
+	}
+
+#if defined(__SSE2__)
+	__m128i kv = _mm_loadu_si128((__m128i *)k);
+	for (; len - i >= 16; i += 16) {
+		__m128i v = _mm_loadu_si128((__m128i *)(b + i));
+		_mm_storeu_si128((__m128i *)(b + i), _mm_xor_si128(v, kv));
+	}
+#elif defined(__ARM_NEON)
+	uint8x16_t kv = vld1q_u8(k);
+	for (; len - i >= 16; i += 16) {
+		vst1q_u8(b + i, veorq_u8(vld1q_u8(b + i), kv));
+	}
+#endif
+
+	uint64_t kw;
+	memcpy(&kw, k, sizeof(kw));
+	for (; len - i >= sizeof(kw); i += sizeof(kw)) {
+		uint64_t w;
+		memcpy(&w, b + i, sizeof(w));
+		w ^= kw;
+		memcpy(b + i, &w, sizeof(w));
+	}
+
+	for (; i < len; i++) {
+		b[i] ^= xor_key[i % 4];
+	}
 
 	return buf;
 }
 
+/*
+ * Allocate a packet with room for at least 'capacity' bytes of header and
+ * value, from the smallest size class that fits if there is one.
+ */
+static struct tlv_packet *tlv_packet_alloc(size_t capacity)
+{
+	struct tlv_packet *p = NULL;
+	int pool = 0;
+
+	for (int i = 0; i < COUNT_OF(tlv_packet_pools); i++) {
+		if (TLV_PACKET_ALLOC_LEN(capacity) <= tlv_packet_pools[i].size) {
+			p = mem_pool_alloc(&tlv_packet_pools[i]);
+			if (p) {
+				mem_acct_add(MEM_TAG_TLV_PACKET, tlv_packet_pools[i].size);
+			}
+			capacity = tlv_packet_pools[i].size - offsetof(struct tlv_packet, h);
+			pool = i + 1;
+			break;
+		}
+	}
+	if (pool == 0) {
+		p = mem_acct_malloc(MEM_TAG_TLV_PACKET, TLV_PACKET_ALLOC_LEN(capacity));
+	}
+
+	if (p) {
+		p->storage = NULL;
+		p->index = NULL;
+		p->capacity = capacity;
+		p->lookups = 0;
+		p->pool = pool;
+		p->lane = TLV_LANE_INTERACTIVE;
+		p->trace = 0;
+	}
+	return p;
+}
+
+/*
+ * Request tracing. A traced request holds a slot, which its packet and the
+ * responses built for it refer to by number, there being no room in the
+ * packet for more. The slot is stamped as the request goes through, and
+ * once the last packet using it is freed, the trace is kept in the history
+ * if it took at least the threshold.
+ */
+#define TLV_TRACE_SLOTS 64
+
+struct tlv_trace {
+	unsigned refs;
+	char method[64];
+	char id[48];
+	uint64_t rx_us, start_us, end_us, enqueue_us, dequeue_us, sent_us;
+};
+
+static struct tlv_trace *tlv_traces;
+static struct tlv_trace *tlv_trace_history;
+static unsigned tlv_trace_history_next;
+static uint64_t tlv_trace_threshold_us;
+static bool tlv_trace_enabled;
+static pthread_mutex_t tlv_trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define TLV_TRACE(slot) (&tlv_traces[(slot) - 1])
+
+#define TLV_TRACE_STAMP(slot, field) do { \
+	if (slot) { \
+		TLV_TRACE(slot)->field = metric_now_us(); \
+	} \
+} while (0)
+
+static uint8_t tlv_trace_claim(void)
+{
+	uint8_t slot = 0;
+	if (!__atomic_load_n(&tlv_trace_enabled, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&tlv_trace_mutex);
+	for (int i = 0; i < TLV_TRACE_SLOTS; i++) {
+		if (tlv_traces[i].refs == 0) {
+			memset(&tlv_traces[i], 0, sizeof(tlv_traces[i]));
+			tlv_traces[i].refs = 1;
+			tlv_traces[i].rx_us = metric_now_us();
+			slot = i + 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&tlv_trace_mutex);
+	return slot;
+}
+
+static void tlv_trace_ref(uint8_t slot)
+{
+	pthread_mutex_lock(&tlv_trace_mutex);
+	TLV_TRACE(slot)->refs++;
+	pthread_mutex_unlock(&tlv_trace_mutex);
+}
+
+static void tlv_trace_unref(uint8_t slot)
+{
+	struct tlv_trace *t = TLV_TRACE(slot);
+	pthread_mutex_lock(&tlv_trace_mutex);
+	if (--t->refs == 0 && t->sent_us
+			&& t->sent_us - t->rx_us >= tlv_trace_threshold_us) {
+		tlv_trace_history[tlv_trace_history_next++ % TLV_TRACE_HISTORY] = *t;
+	}
+	pthread_mutex_unlock(&tlv_trace_mutex);
+}
+
+int tlv_trace_enable(bool enable, uint64_t threshold_us)
+{
+	pthread_mutex_lock(&tlv_trace_mutex);
+	if (enable && tlv_traces == NULL) {
+		tlv_traces = calloc(TLV_TRACE_SLOTS, sizeof(*tlv_traces));
+		tlv_trace_history = calloc(TLV_TRACE_HISTORY, sizeof(*tlv_trace_history));
+		if (tlv_traces == NULL || tlv_trace_history == NULL) {
+			free(tlv_traces);
+			free(tlv_trace_history);
+			tlv_traces = tlv_trace_history = NULL;
+			pthread_mutex_unlock(&tlv_trace_mutex);
+			return -1;
+		}
+	}
+	tlv_trace_threshold_us = threshold_us;
+	__atomic_store_n(&tlv_trace_enabled, enable, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&tlv_trace_mutex);
+	return 0;
+}
+
+static uint32_t trace_offset(struct tlv_trace *t, uint64_t us)
+{
+	return us > t->rx_us ? us - t->rx_us : 0;
+}
+
+struct tlv_packet *tlv_trace_add_history(struct tlv_packet *p)
+{
+	pthread_mutex_lock(&tlv_trace_mutex);
+	unsigned count = TYPESAFE_MIN(tlv_trace_history_next, TLV_TRACE_HISTORY);
+	for (unsigned i = 1; tlv_trace_history && i <= count; i++) {
+		struct tlv_trace *t = &tlv_trace_history[
+			(tlv_trace_history_next - i) % TLV_TRACE_HISTORY];
+		struct tlv_packet *g = tlv_packet_new(TLV_TYPE_TRACE, 0);
+		g = tlv_packet_add_str(g, TLV_TYPE_METHOD, t->method);
+		g = tlv_packet_add_str(g, TLV_TYPE_REQUEST_ID, t->id);
+		g = tlv_packet_add_u32(g, TLV_TYPE_TRACE_HANDLER_START, trace_offset(t, t->start_us));
+		g = tlv_packet_add_u32(g, TLV_TYPE_TRACE_HANDLER_END, trace_offset(t, t->end_us));
+		g = tlv_packet_add_u32(g, TLV_TYPE_TRACE_ENQUEUED, trace_offset(t, t->enqueue_us));
+		g = tlv_packet_add_u32(g, TLV_TYPE_TRACE_DEQUEUED, trace_offset(t, t->dequeue_us));
+		g = tlv_packet_add_u32(g, TLV_TYPE_TRACE_SENT, trace_offset(t, t->sent_us));
+		p = tlv_packet_add_child(p, g);
+	}
+	pthread_mutex_unlock(&tlv_trace_mutex);
+	return p;
+}
+
+/*
+ * Free the allocation backing a packet
+ */
+static void tlv_packet_release(struct tlv_packet *p)
+{
+	void *alloc = p->storage ? p->storage : p;
+	if (p->pool) {
+		mem_acct_sub(MEM_TAG_TLV_PACKET, tlv_packet_pools[p->pool - 1].size);
+		mem_pool_free(&tlv_packet_pools[p->pool - 1], alloc);
+	} else {
+		mem_acct_free(MEM_TAG_TLV_PACKET, alloc);
+	}
+}
+
 struct tlv_packet *tlv_packet_new(uint32_t type, int initial_len)
 {
-	struct tlv_packet *p = calloc(1, sizeof(struct tlv_packet) +
-			(initial_len ? initial_len : 64));
+	struct tlv_packet *p = tlv_packet_alloc(TLV_MIN_LEN +
+		(initial_len > 0 ? initial_len : 64));
 	if (p) {
 		p->h.type = htonl(type);
 		p->h.len = htonl(TLV_MIN_LEN);
@@ -63,9 +353,167 @@ struct tlv_packet *tlv_packet_new(uint32_t type, int initial_len)
 	return p;
 }
 
+static struct tlv_packet *tlv_packet_inflate(struct tlv_packet *p);
+
+struct tlv_packet *tlv_packet_read_raw_buffer_queue(struct buffer_queue *q, size_t len)
+{
+	if (len < TLV_MIN_LEN || len > INT_MAX || buffer_queue_len(q) < len) {
+		return NULL;
+	}
+
+	struct tlv_packet *p = tlv_packet_alloc(len);
+	if (p) {
+		buffer_queue_remove(q, &p->h, len);
+		p = tlv_packet_inflate(p);
+	}
+	return p;
+}
+
+struct tlv_packet *tlv_packet_read_raw_frame(struct buffer_queue *q)
+{
+	struct tlv_header h;
+	if (buffer_queue_copy(q, &h, sizeof(h)) < sizeof(h)) {
+		return NULL;
+	}
+
+	size_t len = ntohl(h.len);
+	if (len < TLV_MIN_LEN || len > INT_MAX) {
+		log_error("bad packet length %zu, dropping %zu queued bytes",
+			len, buffer_queue_len(q));
+		buffer_queue_drain_all(q);
+		return NULL;
+	}
+	return tlv_packet_read_raw_buffer_queue(q, len);
+}
+
+/*
+ * Ensure there is room for 'len' bytes of header and value, doubling the
+ * capacity as needed. The original packet is freed on failure.
+ */
+static struct tlv_packet *tlv_packet_reserve(struct tlv_packet *p, size_t len)
+{
+	if (len <= p->capacity) {
+		return p;
+	}
+
+	size_t capacity = p->capacity * 2;
+	if (capacity < len) {
+		capacity = len;
+	}
+	if (capacity > INT_MAX) {
+		tlv_packet_free(p);
+		return NULL;
+	}
+
+	struct tlv_packet *new_p;
+	if (p->storage || p->pool || TLV_PACKET_ALLOC_LEN(capacity) <=
+			tlv_packet_pools[COUNT_OF(tlv_packet_pools) - 1].size) {
+		new_p = tlv_packet_alloc(capacity);
+		if (new_p) {
+			memcpy(&new_p->h, &p->h, tlv_packet_len(p));
+			new_p->lane = p->lane;
+			new_p->trace = p->trace;
+			tlv_packet_release(p);
+		}
+	} else {
+		new_p = mem_acct_realloc(MEM_TAG_TLV_PACKET, p, TLV_PACKET_ALLOC_LEN(capacity));
+		if (new_p) {
+			new_p->capacity = capacity;
+		}
+	}
+	if (new_p == NULL) {
+		tlv_packet_free(p);
+	}
+	return new_p;
+}
+
+static void tlv_index_free(struct tlv_index *index)
+{
+	if (index) {
+		HASH_CLEAR(hh, index->types);
+		mem_acct_free(MEM_TAG_TLV_PACKET, index);
+	}
+}
+
+static struct tlv_index *tlv_index_new(struct tlv_packet *p)
+{
+	size_t packet_len = tlv_packet_len(p) - TLV_MIN_LEN;
+	size_t offset = 0;
+	int count = 0;
+	while (offset + TLV_MIN_LEN <= packet_len) {
+		struct tlv_header *h = (struct tlv_header *)(p->buf + offset);
+		size_t len = ntohl(h->len);
+		if (len < TLV_MIN_LEN || len > packet_len - offset) {
+			break;
+		}
+		offset += len;
+		count++;
+	}
+
+	struct tlv_index *index = mem_acct_calloc(MEM_TAG_TLV_PACKET, 1, sizeof(*index) +
+		count * (sizeof(struct tlv_index_entry) + sizeof(struct tlv_index_type)));
+	if (index == NULL) {
+		return NULL;
+	}
+	index->type_pool = (void *)&index->entries[count];
+
+	offset = 0;
+	int types = 0;
+	for (int i = 0; i < count; i++) {
+		struct tlv_header *h = (struct tlv_header *)(p->buf + offset);
+		uint32_t type = ntohl(h->type) & ~TLV_META_TYPE_COMPRESSED;
+		struct tlv_index_type *t = NULL;
+
+		index->entries[i].offset = offset;
+		index->entries[i].next = -1;
+
+		HASH_FIND(hh, index->types, &type, sizeof(type), t);
+		if (t) {
+			index->entries[t->last].next = i;
+			t->last = i;
+		} else {
+			t = &index->type_pool[types++];
+			t->type = type;
+			t->first = t->last = i;
+			HASH_ADD(hh, index->types, type, sizeof(type), t);
+		}
+		offset += ntohl(h->len);
+	}
+
+	return index;
+}
+
+static struct tlv_index *tlv_packet_index(struct tlv_packet *p)
+{
+	if (p->index == NULL && ++p->lookups >= TLV_INDEX_MIN_LOOKUPS) {
+		p->index = tlv_index_new(p);
+	}
+	return p->index;
+}
+
+static int tlv_index_first(struct tlv_index *index, uint32_t type)
+{
+	struct tlv_index_type *t = NULL;
+	HASH_FIND(hh, index->types, &type, sizeof(type), t);
+	return t ? t->first : -1;
+}
+
+static void tlv_packet_invalidate_index(struct tlv_packet *p)
+{
+	tlv_index_free(p->index);
+	p->index = NULL;
+	p->lookups = 0;
+}
+
 void tlv_packet_free(struct tlv_packet *p)
 {
-	free(p);
+	if (p) {
+		if (p->trace) {
+			tlv_trace_unref(p->trace);
+		}
+		tlv_index_free(p->index);
+		tlv_packet_release(p);
+	}
 }
 
 void *tlv_packet_data(struct tlv_packet *p)
@@ -99,6 +547,31 @@ char *tlv_packet_get_buf_str(void * buf, size_t len)
 void *tlv_packet_iterate(struct tlv_iterator *i, size_t *len)
 {
 	*len = 0;
+	struct tlv_index *index = tlv_packet_index(i->packet);
+	if (index) {
+		int e = i->index_next;
+		if (e == 0) {
+			e = tlv_index_first(index, i->value_type);
+		} else if (e > 0) {
+			e--;
+		}
+		while (e >= 0 && index->entries[e].offset < i->offset) {
+			e = index->entries[e].next;
+		}
+		if (e < 0) {
+			i->index_next = -1;
+			return NULL;
+		}
+		struct tlv_header *h = (struct tlv_header *)(i->packet->buf + index->entries[e].offset);
+		i->offset = index->entries[e].offset + ntohl(h->len);
+		i->index_next = index->entries[e].next + 1;
+		if (i->index_next == 0) {
+			i->index_next = -1;
+		}
+		*len = ntohl(h->len) - TLV_MIN_LEN;
+		return h + 1;
+	}
+
 	size_t packet_len = tlv_packet_len(i->packet) - TLV_MIN_LEN;
 	while (i->offset < packet_len) {
 		struct tlv_header *h = (struct tlv_header *)(i->packet->buf + i->offset);
@@ -112,6 +585,35 @@ void *tlv_packet_iterate(struct tlv_iterator *i, size_t *len)
 	return NULL;
 }
 
+struct tlv_packet *tlv_packet_iterate_group(struct tlv_iterator *i)
+{
+	size_t len;
+	struct tlv_header *h = tlv_packet_iterate(i, &len);
+	if (h == NULL) {
+		return NULL;
+	}
+	h--;
+
+	/*
+	 * The values inside have not been checked like the outer packet's were
+	 */
+	size_t offset = 0;
+	while (offset < len) {
+		struct tlv_header *child = (void *)(h + 1) + offset;
+		size_t child_len = len - offset < TLV_MIN_LEN ? 0 : ntohl(child->len);
+		if (child_len < TLV_MIN_LEN || child_len > len - offset) {
+			return NULL;
+		}
+		offset += child_len;
+	}
+
+	struct tlv_packet *p = tlv_packet_alloc(TLV_MIN_LEN + len);
+	if (p) {
+		memcpy(&p->h, h, TLV_MIN_LEN + len);
+	}
+	return p;
+}
+
 char *tlv_packet_iterate_str(struct tlv_iterator *i)
 {
 	size_t len;
@@ -122,6 +624,17 @@ char *tlv_packet_iterate_str(struct tlv_iterator *i)
 void *tlv_packet_get_raw(struct tlv_packet *p, uint32_t value_type, size_t *len)
 {
 	*len = 0;
+	struct tlv_index *index = tlv_packet_index(p);
+	if (index) {
+		int e = tlv_index_first(index, value_type);
+		if (e < 0) {
+			return NULL;
+		}
+		struct tlv_header *h = (struct tlv_header *)(p->buf + index->entries[e].offset);
+		*len = ntohl(h->len) - TLV_MIN_LEN;
+		return h + 1;
+	}
+
 	off_t offset = 0;
 	int packet_len = tlv_packet_len(p) - TLV_MIN_LEN;
 	while (offset < packet_len) {
@@ -191,14 +704,113 @@ int tlv_packet_get_u64(struct tlv_packet *p, uint32_t value_type, uint64_t *valu
 	return 0;
 }
 
+/*
+ * Stores one value, returning false if it is malformed
+ */
+static bool tlv_field_store(const struct tlv_field *f, void *val, size_t len, void *out)
+{
+	void *member = (char *)out + f->offset;
+	switch (f->kind) {
+		case TLV_FIELD_STR: {
+			char *str = tlv_packet_get_buf_str(val, len);
+			if (str == NULL) {
+				return false;
+			}
+			*(char **)member = str;
+			return true;
+		}
+		case TLV_FIELD_RAW: {
+			struct tlv_raw_value *raw = member;
+			raw->buf = val;
+			raw->len = len;
+			return true;
+		}
+		case TLV_FIELD_BOOL:
+			if (len != 1) {
+				return false;
+			}
+			*(bool *)member = *(char *)val;
+			return true;
+		case TLV_FIELD_U16: {
+			uint16_t v;
+			if (len != sizeof(v)) {
+				return false;
+			}
+			memcpy(&v, val, sizeof(v));
+			*(uint16_t *)member = ntohs(v);
+			return true;
+		}
+		case TLV_FIELD_U32: {
+			uint32_t v;
+			if (len != sizeof(v)) {
+				return false;
+			}
+			memcpy(&v, val, sizeof(v));
+			*(uint32_t *)member = ntohl(v);
+			return true;
+		}
+		case TLV_FIELD_U64: {
+			uint64_t v;
+			if (len != sizeof(v)) {
+				return false;
+			}
+			memcpy(&v, val, sizeof(v));
+			*(uint64_t *)member = dnet_ntohll(v);
+			return true;
+		}
+	}
+	return false;
+}
+
+int tlv_packet_decode(struct tlv_packet *p, const struct tlv_field *fields,
+		size_t num_fields, void *out)
+{
+	if (num_fields > TLV_SCHEMA_MAX_FIELDS) {
+		return -1;
+	}
+
+	uint64_t all = num_fields == 64 ? UINT64_MAX : (UINT64_C(1) << num_fields) - 1;
+	uint64_t seen = 0, found = 0;
+	size_t offset = 0;
+	size_t packet_len = tlv_packet_len(p) - TLV_MIN_LEN;
+	while (offset < packet_len && seen != all) {
+		struct tlv_header *h = (struct tlv_header *)(p->buf + offset);
+		uint32_t type = ntohl(h->type) & ~TLV_META_TYPE_COMPRESSED;
+		size_t len = ntohl(h->len) - TLV_MIN_LEN;
+		offset += ntohl(h->len);
+
+		for (size_t i = 0; i < num_fields; i++) {
+			uint64_t bit = UINT64_C(1) << i;
+			if (fields[i].type == type && !(seen & bit)) {
+				seen |= bit;
+				if (tlv_field_store(&fields[i], h + 1, len, out)) {
+					found |= bit;
+				}
+			}
+		}
+	}
+
+	for (size_t i = 0; i < num_fields; i++) {
+		if (fields[i].required && !(found & (UINT64_C(1) << i))) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
 static struct tlv_packet *
 tlv_packet_add_child_raw(struct tlv_packet *p, const void *val, size_t len)
 {
+	if (p == NULL) {
+		return NULL;
+	}
+
+	tlv_packet_invalidate_index(p);
 	int packet_len = tlv_packet_len(p);
 	int new_len = packet_len + len;
-	p = realloc(p, new_len);
+	p = tlv_packet_reserve(p, new_len);
 	if (p) {
-		memcpy((void *)p + packet_len, val, len);
+		memcpy((void *)&p->h + packet_len, val, len);
 		p->h.len = htonl(new_len);
 	}
 	return p;
@@ -207,11 +819,17 @@ tlv_packet_add_child_raw(struct tlv_packet *p, const void *val, size_t len)
 struct tlv_packet *
 tlv_packet_add_child(struct tlv_packet *p, struct tlv_packet *child)
 {
-	p = tlv_packet_add_child_raw(p, child, tlv_packet_len(child));
+	p = tlv_packet_add_child_raw(p, &child->h, tlv_packet_len(child));
 	tlv_packet_free(child);
 	return p;
 }
 
+struct tlv_packet *
+tlv_packet_add_values(struct tlv_packet *p, struct tlv_packet *src)
+{
+	return tlv_packet_add_child_raw(p, src->buf, tlv_packet_len(src) - sizeof(src->h));
+}
+
 struct tlv_packet *
 tlv_packet_merge_child(struct tlv_packet *p, struct tlv_packet *child)
 {
@@ -230,11 +848,12 @@ struct tlv_packet * tlv_packet_add_raw(struct tlv_packet *p, uint32_t type,
 		return NULL;
 	}
 
+	tlv_packet_invalidate_index(p);
 	int packet_len = tlv_packet_len(p);
 	int new_len = packet_len + TLV_MIN_LEN + len;
-	p = realloc(p, new_len);
+	p = tlv_packet_reserve(p, new_len);
 	if (p) {
-		struct tlv_header *hdr = (void *)p + packet_len;
+		struct tlv_header *hdr = (void *)&p->h + packet_len;
 		hdr->type = htonl(type);
 		hdr->len = htonl(TLV_MIN_LEN + len);
 		memcpy(hdr + 1, val, len);
@@ -243,23 +862,54 @@ struct tlv_packet * tlv_packet_add_raw(struct tlv_packet *p, uint32_t type,
 	return p;
 }
 
-struct tlv_packet * tlv_packet_add_str(struct tlv_packet *p,
-		uint32_t type, const char *str)
+struct tlv_packet * tlv_packet_reserve_raw(struct tlv_packet *p,
+		uint32_t type, size_t len, void **val)
 {
-	return tlv_packet_add_raw(p, type, str, strlen(str) + 1);
-}
+	if (p == NULL) {
+		return NULL;
+	}
 
-struct tlv_packet * tlv_packet_add_u32(struct tlv_packet *p,
-		uint32_t type, uint32_t val)
-{
-	val = htonl(val);
-	return tlv_packet_add_raw(p, type, &val, sizeof(val));
+	int packet_len = tlv_packet_len(p);
+	p = tlv_packet_reserve(p, packet_len + TLV_MIN_LEN + len);
+	if (p) {
+		struct tlv_header *hdr = (void *)&p->h + packet_len;
+		hdr->type = htonl(type);
+		*val = hdr + 1;
+	}
+	return p;
 }
 
-struct tlv_packet * tlv_packet_add_result(struct tlv_packet *p, int rc)
+struct tlv_packet * tlv_packet_commit_raw(struct tlv_packet *p, size_t len)
 {
-	return tlv_packet_add_u32(p, TLV_TYPE_RESULT, rc);
-}
+	if (p == NULL) {
+		return NULL;
+	}
+
+	tlv_packet_invalidate_index(p);
+	int packet_len = tlv_packet_len(p);
+	struct tlv_header *hdr = (void *)&p->h + packet_len;
+	hdr->len = htonl(TLV_MIN_LEN + len);
+	p->h.len = htonl(packet_len + TLV_MIN_LEN + len);
+	return p;
+}
+
+struct tlv_packet * tlv_packet_add_str(struct tlv_packet *p,
+		uint32_t type, const char *str)
+{
+	return tlv_packet_add_raw(p, type, str, strlen(str) + 1);
+}
+
+struct tlv_packet * tlv_packet_add_u32(struct tlv_packet *p,
+		uint32_t type, uint32_t val)
+{
+	val = htonl(val);
+	return tlv_packet_add_raw(p, type, &val, sizeof(val));
+}
+
+struct tlv_packet * tlv_packet_add_result(struct tlv_packet *p, int rc)
+{
+	return tlv_packet_add_u32(p, TLV_TYPE_RESULT, rc);
+}
 
 struct tlv_packet * tlv_packet_add_u64(struct tlv_packet *p,
 		uint32_t type, uint64_t val)
@@ -322,221 +972,1367 @@ struct tlv_packet * tlv_packet_add_addr(struct tlv_packet *p,
 						sizeof(intf_index));
 			}
 		}
-	} else {
-		p = tlv_packet_add_raw(p, addr_tlv, a->addr_data8, ETH_ADDR_LEN);
+	} else {
+		p = tlv_packet_add_raw(p, addr_tlv, a->addr_data8, ETH_ADDR_LEN);
+	}
+	return p;
+}
+
+struct tlv_packet * tlv_packet_add_fmt(struct tlv_packet *p,
+		uint32_t type, char const *fmt, ...)
+{
+	va_list va;
+	char small[256];
+	char *buffer = small;
+
+	// Most values fit on the stack, only long ones need the heap
+	va_start(va, fmt);
+	int printed = vsnprintf(small, sizeof(small), fmt, va);
+	va_end(va);
+	if (printed >= (int)sizeof(small)) {
+		va_start(va, fmt);
+		printed = vasprintf(&buffer, fmt, va);
+		va_end(va);
+	}
+	if (printed >= 0) {
+		p = tlv_packet_add_raw(p, type, buffer, printed + 1);
+	}
+	if (buffer != small && printed >= 0) {
+		free(buffer);
+	}
+	return p;
+}
+
+/*
+ * Compressed values (TLV_META_TYPE_COMPRESSED) hold a zlib stream of the
+ * original value. Inflating is capped to keep a hostile packet from
+ * exhausting memory.
+ */
+#define TLV_MAX_INFLATED_LEN (64 * 1024 * 1024)
+
+static void *tlv_inflate(const void *in, size_t in_len, size_t *out_len)
+{
+	z_stream strm = {
+		.next_in = (Bytef *)in,
+		.avail_in = in_len,
+	};
+	if (inflateInit(&strm) != Z_OK) {
+		return NULL;
+	}
+
+	size_t buf_len = in_len * 4 > 4096 ? in_len * 4 : 4096;
+	void *buf = NULL;
+	int rc;
+	do {
+		if (buf == NULL || strm.avail_out == 0) {
+			if (buf && buf_len * 2 > TLV_MAX_INFLATED_LEN) {
+				goto err;
+			}
+			buf_len = buf ? buf_len * 2 : buf_len;
+			void *new_buf = realloc(buf, buf_len);
+			if (new_buf == NULL) {
+				goto err;
+			}
+			buf = new_buf;
+			strm.next_out = buf + strm.total_out;
+			strm.avail_out = buf_len - strm.total_out;
+		}
+		rc = inflate(&strm, Z_NO_FLUSH);
+	} while (rc == Z_OK || (rc == Z_BUF_ERROR && strm.avail_out == 0));
+
+	if (rc != Z_STREAM_END) {
+		goto err;
+	}
+
+	*out_len = strm.total_out;
+	inflateEnd(&strm);
+	return buf;
+
+err:
+	inflateEnd(&strm);
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Replace compressed top-level values with their inflated contents. Values
+ * that fail to inflate are left as they are.
+ */
+static struct tlv_packet *tlv_packet_inflate(struct tlv_packet *p)
+{
+	size_t packet_len = tlv_packet_len(p) - TLV_MIN_LEN;
+	size_t offset = 0;
+	bool compressed = false;
+	while (offset + TLV_MIN_LEN <= packet_len) {
+		struct tlv_header *h = (struct tlv_header *)(p->buf + offset);
+		size_t len = ntohl(h->len);
+		if (len < TLV_MIN_LEN || len > packet_len - offset) {
+			break;
+		}
+		if (ntohl(h->type) & TLV_META_TYPE_COMPRESSED) {
+			compressed = true;
+			break;
+		}
+		offset += len;
+	}
+	if (!compressed) {
+		return p;
+	}
+
+	struct tlv_packet *out = tlv_packet_new(ntohl(p->h.type), tlv_packet_len(p) * 2);
+	offset = 0;
+	while (out && offset + TLV_MIN_LEN <= packet_len) {
+		struct tlv_header *h = (struct tlv_header *)(p->buf + offset);
+		size_t len = ntohl(h->len);
+		uint32_t type = ntohl(h->type);
+		if (len < TLV_MIN_LEN || len > packet_len - offset) {
+			break;
+		}
+
+		void *val = NULL;
+		size_t val_len;
+		if (type & TLV_META_TYPE_COMPRESSED) {
+			val = tlv_inflate(h + 1, len - TLV_MIN_LEN, &val_len);
+		}
+		if (val) {
+			out = tlv_packet_add_raw(out, type & ~TLV_META_TYPE_COMPRESSED, val, val_len);
+			free(val);
+		} else {
+			out = tlv_packet_add_child_raw(out, h, len);
+		}
+		offset += len;
+	}
+
+	tlv_packet_free(p);
+	return out;
+}
+
+/*
+ * Compress top-level raw and string values of at least 'threshold' bytes,
+ * keeping the result only if it saves at least an eighth of the value.
+ */
+static struct tlv_packet *tlv_packet_deflate(struct tlv_packet *p, size_t threshold)
+{
+	size_t packet_len = tlv_packet_len(p) - TLV_MIN_LEN;
+	size_t offset = 0;
+	bool compressible = false;
+	while (offset + TLV_MIN_LEN <= packet_len) {
+		struct tlv_header *h = (struct tlv_header *)(p->buf + offset);
+		size_t len = ntohl(h->len);
+		uint32_t type = ntohl(h->type);
+		if (len < TLV_MIN_LEN || len > packet_len - offset) {
+			return p;
+		}
+		if ((type & (TLV_META_TYPE_RAW | TLV_META_TYPE_STRING))
+				&& !(type & TLV_META_TYPE_COMPRESSED)
+				&& len - TLV_MIN_LEN >= threshold) {
+			compressible = true;
+		}
+		offset += len;
+	}
+	if (!compressible) {
+		return p;
+	}
+
+	struct tlv_packet *out = tlv_packet_new(ntohl(p->h.type), tlv_packet_len(p));
+	offset = 0;
+	while (out && offset + TLV_MIN_LEN <= packet_len) {
+		struct tlv_header *h = (struct tlv_header *)(p->buf + offset);
+		size_t len = ntohl(h->len);
+		size_t val_len = len - TLV_MIN_LEN;
+		uint32_t type = ntohl(h->type);
+		offset += len;
+
+		if ((type & (TLV_META_TYPE_RAW | TLV_META_TYPE_STRING))
+				&& !(type & TLV_META_TYPE_COMPRESSED)
+				&& val_len >= threshold) {
+			size_t out_len = tlv_packet_len(out);
+			uLongf comp_len = compressBound(val_len);
+			out = tlv_packet_reserve(out, out_len + TLV_MIN_LEN + comp_len);
+			if (out == NULL) {
+				break;
+			}
+			struct tlv_header *ch = (void *)&out->h + out_len;
+			if (compress2((Bytef *)(ch + 1), &comp_len, (Bytef *)(h + 1),
+						val_len, Z_BEST_SPEED) == Z_OK
+					&& comp_len <= val_len - val_len / 8) {
+				ch->type = htonl(type | TLV_META_TYPE_COMPRESSED);
+				ch->len = htonl(TLV_MIN_LEN + comp_len);
+				out->h.len = htonl(out_len + TLV_MIN_LEN + comp_len);
+				continue;
+			}
+		}
+		out = tlv_packet_add_child_raw(out, h, len);
+	}
+
+	if (out) {
+		out->trace = p->trace;
+		p->trace = 0;
+	}
+	tlv_packet_free(p);
+	return out;
+}
+
+struct tlv_packet * tlv_packet_response(struct tlv_handler_ctx *ctx)
+{
+	struct tlv_packet *p = tlv_packet_new(TLV_PACKET_TYPE_RESPONSE,
+			tlv_packet_len(ctx->req) + 32);
+
+	p = tlv_packet_add_uuid(p, ctx->td);
+	p = tlv_packet_add_str(p, TLV_TYPE_METHOD, ctx->method);
+	if (ctx->command_id) {
+		p = tlv_packet_add_u32(p, TLV_TYPE_COMMAND_ID, ctx->command_id);
+	}
+
+	if (ctx->channel_id) {
+		p = tlv_packet_add_u32(p, TLV_TYPE_CHANNEL_ID, ctx->channel_id);
+	}
+	tlv_packet_set_lane(p, ctx->lane);
+	if (p && ctx->req && ctx->req->trace) {
+		p->trace = ctx->req->trace;
+		tlv_trace_ref(p->trace);
+	}
+	return tlv_packet_add_str(p, TLV_TYPE_REQUEST_ID, ctx->id);
+};
+
+struct tlv_packet * tlv_packet_response_result(struct tlv_handler_ctx *ctx, int rc)
+{
+	struct tlv_packet *p = tlv_packet_response(ctx);
+	return tlv_packet_add_result(p, rc);
+}
+
+bool tlv_handler_ctx_can_stream(struct tlv_handler_ctx *ctx)
+{
+	bool can_stream = false;
+	tlv_packet_get_bool(ctx->req, TLV_TYPE_CONTINUATION, &can_stream);
+	return can_stream;
+}
+
+struct tlv_packet * tlv_packet_response_continue(struct tlv_handler_ctx *ctx,
+		struct tlv_packet *p)
+{
+	if (p == NULL || tlv_packet_len(p) < TLV_STREAM_CHUNK_LEN
+			|| !tlv_handler_ctx_can_stream(ctx)) {
+		return p;
+	}
+
+	p = tlv_packet_add_bool(p, TLV_TYPE_CONTINUATION, true);
+	if (tlv_dispatcher_enqueue_response(ctx->td, p) == -1) {
+		return NULL;
+	}
+	return tlv_packet_response(ctx);
+}
+
+/*
+ * TLV Dispatcher
+ */
+struct tlv_handler {
+	tlv_handler_cb cb;
+	void *arg;
+	uint32_t command_id;
+	enum tlv_lane lane;
+	bool blocking;
+	bool serial;
+	int pri;
+	struct metric *latency;
+	unsigned cache_ttl_ms;
+	struct tlv_cache_entry *cache;
+	bool in_table;
+	const char *method;
+	UT_hash_handle hh;
+	char name[];
+};
+
+/*
+ * Handlers registered from a static table share one allocation and point
+ * at the table's method names rather than copying them
+ */
+struct tlv_handler_table {
+	struct tlv_handler_table *next;
+	struct tlv_handler handlers[];
+};
+
+/*
+ * In ID order, so an ID is found by bisection, and the dispatcher indexes
+ * its handlers by their command's place here
+ */
+#define COMMAND_ENTRY(id, method) { id, method },
+static const struct {
+	uint32_t id;
+	const char *method;
+} command_table[] = {
+	COMMAND_IDS(COMMAND_ENTRY)
+};
+
+#define COMMAND_TABLE_LEN COUNT_OF(command_table)
+
+static int compare_command_id(const void *a, const void *b)
+{
+	uint32_t id = *(const uint32_t *)a, entry = *(const uint32_t *)b;
+	return id < entry ? -1 : id > entry;
+}
+
+static int command_slot(uint32_t command_id)
+{
+	const void *entry = bsearch(&command_id, command_table, COMMAND_TABLE_LEN,
+		sizeof(command_table[0]), compare_command_id);
+	return entry ? (int)(((const char *)entry - (const char *)command_table)
+		/ sizeof(command_table[0])) : -1;
+}
+
+uint32_t tlv_command_id(const char *method)
+{
+	for (size_t i = 0; i < COMMAND_TABLE_LEN; i++) {
+		if (strcmp(command_table[i].method, method) == 0) {
+			return command_table[i].id;
+		}
+	}
+	return 0;
+}
+
+const char *tlv_command_name(uint32_t command_id)
+{
+	int slot = command_slot(command_id);
+	return slot != -1 ? command_table[slot].method : NULL;
+}
+
+struct tlv_response {
+	struct tlv_packet *p;
+	struct tlv_response *next;
+};
+
+struct tlv_response_lane {
+	struct tlv_response *head;
+	struct tlv_response *tail;
+	unsigned weight;
+};
+
+/*
+ * Commands whose responses are large enough to hold up interactive traffic
+ * queued behind them. Others can be moved with tlv_dispatcher_set_handler_lane.
+ */
+static const char *tlv_bulk_methods[] = {
+	"sniffer_capture_dump_read",
+	"stdapi_fs_ls",
+	"stdapi_sys_process_get_processes",
+	"stdapi_ui_desktop_screenshot",
+};
+
+/*
+ * Commands that block for long enough to stall the loop, which are run on
+ * eio workers instead. Others can be marked with
+ * tlv_dispatcher_set_handler_blocking.
+ *
+ * Serial ones share state that is not thread safe, such as the sigar
+ * handle or the webcam buffers, so only one of them runs at a time. Bulk
+ * filesystem work is queued at low eio priority, behind C2 and other
+ * short requests.
+ */
+static const struct {
+	const char *method;
+	bool serial;
+	int pri;
+} tlv_blocking_methods[] = {
+	{ "stdapi_fs_file_copy", false, EIO_PRI_MIN },
+	{ "stdapi_fs_ls", false, 0 },
+	{ "stdapi_fs_md5", false, EIO_PRI_MIN },
+	{ "stdapi_fs_put_by_hash", false, EIO_PRI_MIN },
+	{ "stdapi_fs_sha1", false, EIO_PRI_MIN },
+	{ "stdapi_net_config_get_interfaces", true, 0 },
+	{ "stdapi_net_config_get_netstat", true, 0 },
+	{ "stdapi_net_config_get_routes", true, 0 },
+	{ "stdapi_sys_config_sysinfo", false, 0 },
+	{ "stdapi_sys_process_get_processes", true, 0 },
+	{ "webcam_get_frame", true, 0 },
+	{ "webcam_start", true, 0 },
+	{ "webcam_stop", true, 0 },
+};
+
+/*
+ * Idempotent queries framework scripts repeat, whose responses are cached
+ * for the given time once caching is enabled. Others can be marked with
+ * tlv_dispatcher_set_handler_cache_ttl.
+ */
+static const struct {
+	const char *method;
+	unsigned ttl_ms;
+} tlv_cached_methods[] = {
+	{ "core_enumextcmd", 60000 },
+	{ "core_machine_id", 300000 },
+	{ "stdapi_net_config_get_interfaces", 10000 },
+	{ "stdapi_sys_config_getuid", 10000 },
+	{ "stdapi_sys_config_sysinfo", 30000 },
+};
+
+/*
+ * A cached response, keyed by the values of the request that produced it.
+ * 'body' holds the response values other than those tlv_packet_response
+ * adds, so a hit only needs a new header for the request it answers.
+ */
+#define TLV_CACHE_MAX_ENTRIES 8
+
+struct tlv_cache_entry {
+	struct tlv_packet *body;
+	double expires;
+	UT_hash_handle hh;
+	size_t key_len;
+	char key[];
+};
+
+/*
+ * A blocking request waiting for, or running on, a worker. Requests with
+ * the same key run in the order they arrived, one at a time; key 0 has no
+ * ordering. Requests naming a channel are keyed by it, and serial handlers
+ * share TLV_JOB_KEY_SERIAL.
+ */
+#define TLV_JOB_KEY_SERIAL UINT32_MAX
+
+struct tlv_job {
+	struct tlv_dispatcher *td;
+	struct tlv_handler_ctx *ctx;
+	struct tlv_handler *handler;
+	tlv_handler_cb cb;
+	uint32_t key;
+	int pri;
+	struct tlv_job *next;
+};
+
+static struct mem_pool tlv_response_pool =
+	MEM_POOL_INITIALIZER(sizeof(struct tlv_response), 256);
+
+static struct mem_pool tlv_handler_ctx_pool =
+	MEM_POOL_INITIALIZER(sizeof(struct tlv_handler_ctx), 64);
+
+/*
+ * Handler scratch memory is carved front to back out of pooled chunks and
+ * released all at once with the request's context
+ */
+#define TLV_ARENA_CHUNK_LEN 4096
+#define TLV_ARENA_ALIGN 16
+
+struct tlv_arena_chunk {
+	struct tlv_arena_chunk *next;
+	size_t size;
+	size_t used;
+	bool pooled;
+	char data[] __attribute__((aligned(TLV_ARENA_ALIGN)));
+};
+
+static struct mem_pool tlv_arena_pool =
+	MEM_POOL_INITIALIZER(TLV_ARENA_CHUNK_LEN, 16);
+
+static void tlv_arena_free(struct tlv_arena_chunk *c)
+{
+	while (c) {
+		struct tlv_arena_chunk *next = c->next;
+		if (c->pooled) {
+			mem_pool_free(&tlv_arena_pool, c);
+		} else {
+			free(c);
+		}
+		c = next;
+	}
+}
+
+static void log_pool_stats(const char *name, struct mem_pool *pool)
+{
+	struct mem_pool_stats stats;
+	mem_pool_get_stats(pool, &stats);
+	log_info("%s pool (%zu bytes): %llu allocs, %llu hits, %zu cached",
+		name, stats.size, (unsigned long long)stats.allocs,
+		(unsigned long long)stats.hits, stats.cached);
+}
+
+void tlv_log_pool_stats(void)
+{
+	for (int i = 0; i < COUNT_OF(tlv_packet_pools); i++) {
+		log_pool_stats("packet", &tlv_packet_pools[i]);
+	}
+	log_pool_stats("response", &tlv_response_pool);
+	log_pool_stats("handler ctx", &tlv_handler_ctx_pool);
+	log_pool_stats("handler arena", &tlv_arena_pool);
+}
+
+struct tlv_dispatcher {
+	struct tlv_handler *handlers;
+	struct tlv_handler_table *handler_tables;
+	struct tlv_handler *commands[COMMAND_TABLE_LEN];
+	tlv_response_cb response_cb;
+
+	/*
+	 * Responses are produced by the loop and eio worker threads alike and
+	 * consumed by the loop, appending at the tail of their lane under
+	 * 'mutex'. Lanes are served weighted round robin, 'lane_credit' being
+	 * what is left of the current lane's turn.
+	 */
+	pthread_mutex_t mutex;
+	struct tlv_response_lane lanes[TLV_LANE_COUNT];
+	int lane;
+	unsigned lane_credit;
+	size_t responses_queued;
+	size_t responses_queued_bytes;
+	void *response_cb_arg;
+
+	char *uuid;
+	size_t uuid_len;
+
+	char session_guid[SESSION_GUID_LEN];
+	struct tlv_encryption_ctx *enc_ctx;
+
+	size_t compress_threshold;
+
+	bool sequencing;
+	uint32_t tx_seq;
+	bool resumption;
+	bool rx_seq_valid;
+	uint32_t rx_seq;
+
+	/*
+	 * Blocking requests, queued and running, under 'jobs_mutex'
+	 */
+	pthread_mutex_t jobs_mutex;
+	struct tlv_job *jobs_queued;
+	struct tlv_job *jobs_running;
+	unsigned jobs_running_count;
+	unsigned max_jobs;
+
+	/*
+	 * Requests being handled, so they can be cancelled
+	 */
+	pthread_mutex_t requests_mutex;
+	struct tlv_handler_ctx *requests;
+
+	/*
+	 * Handler response caches, under 'cache_mutex'. 'cache_gen' counts
+	 * invalidations, so a response computed across one is not stored.
+	 */
+	pthread_mutex_t cache_mutex;
+	bool caching;
+	unsigned cache_gen;
+};
+
+struct tlv_packet *tlv_packet_add_uuid(struct tlv_packet *p, struct tlv_dispatcher *td)
+{
+	size_t uuid_len = 0;
+	const char* uuid = tlv_dispatcher_get_uuid(td, &uuid_len);
+	if (uuid && uuid_len) {
+		p = tlv_packet_add_raw(p, TLV_TYPE_UUID, uuid, uuid_len);
+	}
+	return p;
+}
+
+int tlv_dispatcher_enqueue_response(struct tlv_dispatcher *td, struct tlv_packet *p)
+{
+	if (p == NULL) {
+		return -1;
+	}
+
+	struct tlv_response *r = mem_pool_alloc(&tlv_response_pool);
+	if (r == NULL) {
+		tlv_packet_free(p);
+		return -1;
+	}
+
+	r->p = p;
+	r->next = NULL;
+	if (p->trace && TLV_TRACE(p->trace)->enqueue_us == 0) {
+		TLV_TRACE_STAMP(p->trace, enqueue_us);
+	}
+
+	struct tlv_response_lane *lane = &td->lanes[p->lane < TLV_LANE_COUNT ? p->lane : 0];
+	pthread_mutex_lock(&td->mutex);
+	if (lane->tail) {
+		lane->tail->next = r;
+	} else {
+		lane->head = r;
+	}
+	lane->tail = r;
+	td->responses_queued++;
+	td->responses_queued_bytes += tlv_packet_len(p);
+	pthread_mutex_unlock(&td->mutex);
+
+	if (td->response_cb) {
+		td->response_cb(td, td->response_cb_arg);
+	}
+
+	return 0;
+}
+
+void * tlv_dispatcher_dequeue_response(struct tlv_dispatcher *td, bool add_prepend, size_t *len)
+{
+	*len = 0;
+
+	pthread_mutex_lock(&td->mutex);
+	struct tlv_response *r = NULL;
+	for (int i = 0; i < 2 * TLV_LANE_COUNT && r == NULL; i++) {
+		struct tlv_response_lane *lane = &td->lanes[td->lane];
+		if (lane->head && td->lane_credit) {
+			r = lane->head;
+			lane->head = r->next;
+			if (lane->head == NULL) {
+				lane->tail = NULL;
+			}
+			td->lane_credit--;
+		} else {
+			td->lane = (td->lane + 1) % TLV_LANE_COUNT;
+			td->lane_credit = td->lanes[td->lane].weight;
+		}
+	}
+	if (r) {
+		td->responses_queued--;
+		td->responses_queued_bytes -= tlv_packet_len(r->p);
+	}
+	pthread_mutex_unlock(&td->mutex);
+
+	if (r == NULL) {
+		return NULL;
+	}
+
+	struct tlv_packet *p = r->p;
+	mem_pool_free(&tlv_response_pool, r);
+	TLV_TRACE_STAMP(p->trace, dequeue_us);
+	return tlv_dispatcher_encode_response(td, p, add_prepend, len);
+}
+
+void * tlv_dispatcher_encode_response(struct tlv_dispatcher *td, struct tlv_packet *p,
+	bool add_prepend, size_t *len)
+{
+	void *out_buf = NULL;
+	*len = 0;
+
+	if (add_prepend && td->compress_threshold) {
+		p = tlv_packet_deflate(p, td->compress_threshold);
+		if (p == NULL) {
+			return NULL;
+		}
+	}
+
+	/*
+	 * A number is only used up by a packet that goes out, so the C2
+	 * side counting packets stays in step
+	 */
+	if (add_prepend && td->sequencing) {
+		p = tlv_packet_add_u32(p, TLV_TYPE_PACKET_SEQ, td->tx_seq);
+		if (p && td->resumption && td->rx_seq_valid) {
+			p = tlv_packet_add_u32(p, TLV_TYPE_PACKET_ACK, td->rx_seq);
+		}
+		if (p == NULL) {
+			return NULL;
+		}
+	}
+
+	void *tlv_buf = tlv_packet_data(p);
+	size_t tlv_len = tlv_packet_len(p);
+	if (add_prepend) {
+		// usual communications flow between server and target
+		out_buf = encrypt_tlv(td->enc_ctx, p, tlv_len);
+		if (out_buf) {
+			struct tlv_xor_header *hdr = out_buf;
+			tlv_xor_key(hdr->xor_key);
+			tlv_len = ntohl(hdr->tlv.len);
+			memcpy(hdr->session_guid, td->session_guid, SESSION_GUID_LEN);
+			tlv_xor_bytes(hdr->xor_key, &hdr->xor_key + 1, tlv_len + TLV_PREPEND_LEN - sizeof(hdr->xor_key));
+			*len = tlv_len + TLV_PREPEND_LEN;
+			if (td->sequencing) {
+				td->tx_seq++;
+			}
+		}
+	} else {
+		// an extension, which doesn't require the GUID or XOR logic
+		out_buf = calloc(tlv_len, 1);
+		if (out_buf) {
+			memcpy(out_buf, tlv_buf, tlv_len);
+			*len = tlv_len;
+		}
+	}
+
+	TLV_TRACE_STAMP(p->trace, sent_us);
+	METTLE_PROBE(packet__out, *len, p->lane);
+	tlv_packet_free(p);
+	return out_buf;
+}
+
+struct tlv_dispatcher * tlv_dispatcher_new(tlv_response_cb cb, void *cb_arg)
+{
+	struct tlv_dispatcher *td = calloc(1, sizeof(*td));
+	if (td) {
+		pthread_mutex_init(&td->mutex, NULL);
+		pthread_mutex_init(&td->jobs_mutex, NULL);
+		pthread_mutex_init(&td->requests_mutex, NULL);
+		pthread_mutex_init(&td->cache_mutex, NULL);
+		td->max_jobs = TLV_MAX_JOBS;
+		td->compress_threshold = TLV_COMPRESS_THRESHOLD;
+		td->lanes[TLV_LANE_INTERACTIVE].weight = TLV_LANE_INTERACTIVE_WEIGHT;
+		td->lanes[TLV_LANE_BULK].weight = 1;
+		td->response_cb = cb;
+		td->response_cb_arg = cb_arg;
+		char default_session_guid[SESSION_GUID_LEN] = {0};
+		tlv_dispatcher_set_session_guid(td, default_session_guid);
+	}
+	return td;
+}
+
+static void handler_init(struct tlv_dispatcher *td, struct tlv_handler *handler,
+		const char *method, tlv_handler_cb cb, void *arg)
+{
+	handler->method = method;
+	handler->cb = cb;
+	handler->arg = arg;
+	handler->command_id = tlv_command_id(method);
+	for (int i = 0; i < COUNT_OF(tlv_bulk_methods); i++) {
+		if (strcmp(method, tlv_bulk_methods[i]) == 0) {
+			handler->lane = TLV_LANE_BULK;
+		}
+	}
+	for (int i = 0; i < COUNT_OF(tlv_blocking_methods); i++) {
+		if (strcmp(method, tlv_blocking_methods[i].method) == 0) {
+			handler->blocking = true;
+			handler->serial = tlv_blocking_methods[i].serial;
+			handler->pri = tlv_blocking_methods[i].pri;
+		}
+	}
+	for (int i = 0; i < COUNT_OF(tlv_cached_methods); i++) {
+		if (strcmp(method, tlv_cached_methods[i].method) == 0) {
+			handler->cache_ttl_ms = tlv_cached_methods[i].ttl_ms;
+		}
+	}
+
+	HASH_ADD_KEYPTR(hh, td->handlers, handler->method, strlen(handler->method), handler);
+	if (handler->command_id) {
+		td->commands[command_slot(handler->command_id)] = handler;
+	}
+
+	// What enumextcmd answers, at least, depends on the handlers there are
+	tlv_dispatcher_invalidate_cache(td, NULL);
+}
+
+int tlv_dispatcher_add_handler(struct tlv_dispatcher *td,
+		const char *method, tlv_handler_cb cb, void *arg)
+{
+	struct tlv_handler *handler =
+		calloc(1, sizeof(*handler) + strlen(method) + 1);
+	if (handler == NULL) {
+		return -1;
+	}
+
+	strcpy(handler->name, method);
+	handler_init(td, handler, handler->name, cb, arg);
+	return 0;
+}
+
+int tlv_dispatcher_add_handlers(struct tlv_dispatcher *td,
+		const struct tlv_handler_def *defs, size_t count, void *arg)
+{
+	struct tlv_handler_table *table =
+		calloc(1, sizeof(*table) + count * sizeof(table->handlers[0]));
+	if (table == NULL) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		table->handlers[i].in_table = true;
+		handler_init(td, &table->handlers[i], defs[i].method, defs[i].cb, arg);
+	}
+	table->next = td->handler_tables;
+	td->handler_tables = table;
+	return 0;
+}
+
+void tlv_dispatcher_add_encryption(struct tlv_dispatcher *td, struct tlv_encryption_ctx *ctx)
+{
+	td->enc_ctx = ctx;
+}
+
+size_t tlv_dispatcher_queued_responses(struct tlv_dispatcher *td, size_t *bytes)
+{
+	pthread_mutex_lock(&td->mutex);
+	size_t queued = td->responses_queued;
+	if (bytes) {
+		*bytes = td->responses_queued_bytes;
+	}
+	pthread_mutex_unlock(&td->mutex);
+	return queued;
+}
+
+void tlv_dispatcher_unsend_response(struct tlv_dispatcher *td)
+{
+	if (td->sequencing) {
+		td->tx_seq--;
+	}
+}
+
+void tlv_dispatcher_set_compress_threshold(struct tlv_dispatcher *td, size_t threshold)
+{
+	td->compress_threshold = threshold;
+}
+
+void tlv_dispatcher_set_sequencing(struct tlv_dispatcher *td, bool enable)
+{
+	td->sequencing = enable;
+}
+
+void tlv_dispatcher_set_resumption(struct tlv_dispatcher *td, bool enable)
+{
+	td->resumption = enable;
+	if (enable) {
+		td->sequencing = true;
+	}
+}
+
+/*
+ * Whether a request is one already received before the link was lost
+ */
+static bool tlv_dispatcher_is_replay(struct tlv_dispatcher *td, struct tlv_packet *p)
+{
+	uint32_t seq;
+	if (!td->resumption || tlv_packet_get_u32(p, TLV_TYPE_PACKET_SEQ, &seq) == -1) {
+		return false;
+	}
+	if (td->rx_seq_valid && (int32_t)(seq - td->rx_seq) <= 0) {
+		log_debug("dropping replayed request %u", seq);
+		return true;
+	}
+	td->rx_seq = seq;
+	td->rx_seq_valid = true;
+	return false;
+}
+
+static void tlv_dispatcher_run_jobs(struct tlv_dispatcher *td);
+
+void tlv_dispatcher_set_max_jobs(struct tlv_dispatcher *td, unsigned max_jobs)
+{
+	pthread_mutex_lock(&td->jobs_mutex);
+	td->max_jobs = max_jobs ? max_jobs : 1;
+	tlv_dispatcher_run_jobs(td);
+	pthread_mutex_unlock(&td->jobs_mutex);
+}
+
+void tlv_dispatcher_iter_extension_methods(struct tlv_dispatcher *td,
+		const char *extension,
+		void (*cb)(const char *method, void *arg), void *arg)
+{
+	struct tlv_handler *handler, *tmp;
+	size_t extension_len = extension ? strlen(extension) : 0;
+	HASH_ITER(hh, td->handlers, handler, tmp) {
+		if (extension == NULL || strncmp(handler->method, extension, extension_len) == 0) {
+			cb(handler->method, arg);
+		}
+	}
+}
+
+static struct tlv_handler * find_handler(struct tlv_dispatcher *td,
+		const char *method)
+{
+	struct tlv_handler *handler = NULL;
+	HASH_FIND_STR(td->handlers, method, handler);
+	return handler;
+}
+
+struct tlv_packet *tlv_dispatcher_run_inline(struct tlv_dispatcher *td,
+		const char *method, struct tlv_packet *req, const char *id)
+{
+	struct tlv_handler *handler = find_handler(td, method);
+	if (handler == NULL || handler->blocking) {
+		return NULL;
+	}
+
+	struct tlv_handler_ctx ctx = {
+		.method = handler->method,
+		.id = id,
+		.req = req,
+		.td = td,
+		.lane = handler->lane,
+		.arg = handler->arg,
+	};
+	log_info("processing method: '%s' id: '%s' inline", ctx.method, ctx.id);
+	METTLE_PROBE(handler__entry, handler->method, ctx.id, &ctx);
+	struct tlv_packet *response = handler->cb(&ctx);
+	METTLE_PROBE(handler__exit, handler->method, &ctx,
+		response ? tlv_packet_len(response) : 0);
+	tlv_arena_free(ctx.arena);
+	return response;
+}
+
+int tlv_dispatcher_set_handler_lane(struct tlv_dispatcher *td,
+		const char *method, enum tlv_lane lane)
+{
+	struct tlv_handler *handler = find_handler(td, method);
+	if (handler == NULL || lane >= TLV_LANE_COUNT) {
+		return -1;
+	}
+	handler->lane = lane;
+	return 0;
+}
+
+int tlv_dispatcher_set_handler_blocking(struct tlv_dispatcher *td,
+		const char *method, bool blocking)
+{
+	struct tlv_handler *handler = find_handler(td, method);
+	if (handler == NULL) {
+		return -1;
+	}
+	handler->blocking = blocking;
+	return 0;
+}
+
+int tlv_dispatcher_set_handler_priority(struct tlv_dispatcher *td,
+		const char *method, int pri)
+{
+	struct tlv_handler *handler = find_handler(td, method);
+	if (handler == NULL || pri < EIO_PRI_MIN || pri > EIO_PRI_MAX) {
+		return -1;
+	}
+	handler->pri = pri;
+	return 0;
+}
+
+enum tlv_lane tlv_dispatcher_get_handler_lane(struct tlv_dispatcher *td,
+		const char *method)
+{
+	struct tlv_handler *handler = method ? find_handler(td, method) : NULL;
+	return handler ? handler->lane : TLV_LANE_INTERACTIVE;
+}
+
+/*
+ * Values that differ between repeats of the same request, or that
+ * tlv_packet_response adds to each response
+ */
+static bool tlv_cache_skips(uint32_t type)
+{
+	switch (type) {
+		case TLV_TYPE_METHOD:
+		case TLV_TYPE_COMMAND_ID:
+		case TLV_TYPE_REQUEST_ID:
+		case TLV_TYPE_REQUEST_DEADLINE:
+		case TLV_TYPE_UUID:
+		case TLV_TYPE_PACKET_SEQ:
+		case TLV_TYPE_PACKET_ACK:
+			return true;
+	}
+	return false;
+}
+
+static struct tlv_packet *tlv_cache_copy(struct tlv_packet *p)
+{
+	size_t len = tlv_packet_len(p) - TLV_MIN_LEN;
+	struct tlv_packet *copy = tlv_packet_new(TLV_PACKET_TYPE_RESPONSE, len);
+	size_t offset = 0;
+	while (copy && len - offset >= TLV_MIN_LEN) {
+		struct tlv_header *h = (struct tlv_header *)(p->buf + offset);
+		size_t value_len = ntohl(h->len);
+		if (value_len < TLV_MIN_LEN || value_len > len - offset) {
+			break;
+		}
+		if (!tlv_cache_skips(ntohl(h->type))) {
+			copy = tlv_packet_add_child_raw(copy, h, value_len);
+		}
+		offset += value_len;
 	}
-	return p;
+	return copy;
 }
 
-struct tlv_packet * tlv_packet_add_fmt(struct tlv_packet *p,
-		uint32_t type, char const *fmt, ...)
+static void tlv_cache_entry_free(struct tlv_cache_entry *e)
 {
-	va_list va;
-	char *buffer = NULL;
-	va_start(va, fmt);
-	int printed = vasprintf(&buffer, fmt, va);
-	if (printed != -1) {
-		p = tlv_packet_add_raw(p, type, buffer, printed + 1);
-		free(buffer);
+	if (e) {
+		tlv_packet_free(e->body);
+		free(e);
 	}
-	va_end(va);
-	return p;
 }
 
-struct tlv_packet * tlv_packet_response(struct tlv_handler_ctx *ctx)
+static void tlv_cache_flush(struct tlv_handler *handler)
 {
-	struct tlv_packet *p = tlv_packet_new(TLV_PACKET_TYPE_RESPONSE,
-			tlv_packet_len(ctx->req) + 32);
+	struct tlv_cache_entry *e, *tmp;
+	HASH_ITER(hh, handler->cache, e, tmp) {
+		HASH_DEL(handler->cache, e);
+		tlv_cache_entry_free(e);
+	}
+}
 
-	p = tlv_packet_add_uuid(p, ctx->td);
-	p = tlv_packet_add_str(p, TLV_TYPE_METHOD, ctx->method);
+/*
+ * Answers a request from the cache if it can, otherwise notes the
+ * invalidations so far for tlv_cache_store
+ */
+static struct tlv_packet *tlv_cache_lookup(struct tlv_dispatcher *td,
+		struct tlv_handler *handler, struct tlv_handler_ctx *ctx)
+{
+	if (!td->caching || handler->cache_ttl_ms == 0
+			|| tlv_handler_ctx_can_stream(ctx)) {
+		return NULL;
+	}
 
-	if (ctx->channel_id) {
-		p = tlv_packet_add_u32(p, TLV_TYPE_CHANNEL_ID, ctx->channel_id);
+	struct tlv_packet *key = tlv_cache_copy(ctx->req);
+	if (key == NULL) {
+		return NULL;
 	}
-	return tlv_packet_add_str(p, TLV_TYPE_REQUEST_ID, ctx->id);
-};
 
-struct tlv_packet * tlv_packet_response_result(struct tlv_handler_ctx *ctx, int rc)
-{
-	struct tlv_packet *p = tlv_packet_response(ctx);
-	return tlv_packet_add_result(p, rc);
+	struct tlv_packet *p = NULL;
+	struct tlv_cache_entry *e;
+	pthread_mutex_lock(&td->cache_mutex);
+	HASH_FIND(hh, handler->cache, key->buf, tlv_packet_len(key) - TLV_MIN_LEN, e);
+	if (e && e->expires > ev_time()) {
+		log_debug("answering '%s' from cache", ctx->method);
+		p = tlv_packet_add_values(tlv_packet_response(ctx), e->body);
+	} else {
+		ctx->cacheable = true;
+		ctx->cache_gen = td->cache_gen;
+	}
+	pthread_mutex_unlock(&td->cache_mutex);
+
+	tlv_packet_free(key);
+	return p;
 }
 
 /*
- * TLV Dispatcher
+ * Keeps a copy of a successful response to a request that missed the
+ * cache, unless the cache was invalidated while it was being handled
  */
-struct tlv_handler {
-	tlv_handler_cb cb;
-	void *arg;
-	UT_hash_handle hh;
-	char method[];
-};
-
-struct tlv_response {
-	struct tlv_packet *p;
-	struct tlv_response *next;
-};
+static void tlv_cache_store(struct tlv_dispatcher *td,
+		struct tlv_handler *handler, struct tlv_handler_ctx *ctx,
+		struct tlv_packet *response)
+{
+	uint32_t result;
+	if (!ctx->cacheable || response == NULL
+			|| tlv_packet_get_u32(response, TLV_TYPE_RESULT, &result) == -1
+			|| result != TLV_RESULT_SUCCESS) {
+		return;
+	}
 
-struct tlv_dispatcher {
-	struct tlv_handler *handlers;
-	tlv_response_cb response_cb;
+	struct tlv_packet *key = tlv_cache_copy(ctx->req);
+	if (key == NULL) {
+		return;
+	}
+	size_t key_len = tlv_packet_len(key) - TLV_MIN_LEN;
+	struct tlv_cache_entry *e = calloc(1, sizeof(*e) + key_len);
+	if (e) {
+		e->body = tlv_cache_copy(response);
+		memcpy(e->key, key->buf, key_len);
+		e->key_len = key_len;
+		e->expires = ev_time() + handler->cache_ttl_ms / 1000.0;
+	}
+	tlv_packet_free(key);
+	if (e == NULL || e->body == NULL) {
+		tlv_cache_entry_free(e);
+		return;
+	}
 
-	pthread_mutex_t mutex;
-	struct tlv_response *responses;
-	void *response_cb_arg;
+	pthread_mutex_lock(&td->cache_mutex);
+	if (td->caching && handler->cache_ttl_ms && ctx->cache_gen == td->cache_gen) {
+		struct tlv_cache_entry *old;
+		HASH_FIND(hh, handler->cache, e->key, e->key_len, old);
+		if (old == NULL && HASH_COUNT(handler->cache) >= TLV_CACHE_MAX_ENTRIES) {
+			old = handler->cache;
+		}
+		if (old) {
+			HASH_DEL(handler->cache, old);
+			tlv_cache_entry_free(old);
+		}
+		HASH_ADD_KEYPTR(hh, handler->cache, e->key, e->key_len, e);
+		e = NULL;
+	}
+	pthread_mutex_unlock(&td->cache_mutex);
+	tlv_cache_entry_free(e);
+}
 
-	char *uuid;
-	size_t uuid_len;
+int tlv_dispatcher_invalidate_cache(struct tlv_dispatcher *td, const char *method)
+{
+	struct tlv_handler *handler = NULL;
+	if (method && (handler = find_handler(td, method)) == NULL) {
+		return -1;
+	}
 
-	char session_guid[SESSION_GUID_LEN];
-	struct tlv_encryption_ctx *enc_ctx;
-};
+	pthread_mutex_lock(&td->cache_mutex);
+	td->cache_gen++;
+	if (handler) {
+		tlv_cache_flush(handler);
+	} else {
+		struct tlv_handler *tmp;
+		HASH_ITER(hh, td->handlers, handler, tmp) {
+			tlv_cache_flush(handler);
+		}
+	}
+	pthread_mutex_unlock(&td->cache_mutex);
+	return 0;
+}
 
-struct tlv_packet *tlv_packet_add_uuid(struct tlv_packet *p, struct tlv_dispatcher *td)
+void tlv_dispatcher_set_caching(struct tlv_dispatcher *td, bool enable)
 {
-	size_t uuid_len = 0;
-	const char* uuid = tlv_dispatcher_get_uuid(td, &uuid_len);
-	if (uuid && uuid_len) {
-		p = tlv_packet_add_raw(p, TLV_TYPE_UUID, uuid, uuid_len);
+	pthread_mutex_lock(&td->cache_mutex);
+	td->caching = enable;
+	pthread_mutex_unlock(&td->cache_mutex);
+	if (!enable) {
+		tlv_dispatcher_invalidate_cache(td, NULL);
 	}
-	return p;
 }
 
-int tlv_dispatcher_enqueue_response(struct tlv_dispatcher *td, struct tlv_packet *p)
+int tlv_dispatcher_set_handler_cache_ttl(struct tlv_dispatcher *td,
+		const char *method, unsigned ttl_ms)
 {
-	if (p == NULL) {
+	struct tlv_handler *handler = find_handler(td, method);
+	if (handler == NULL) {
 		return -1;
 	}
+	pthread_mutex_lock(&td->cache_mutex);
+	handler->cache_ttl_ms = ttl_ms;
+	td->cache_gen++;
+	tlv_cache_flush(handler);
+	pthread_mutex_unlock(&td->cache_mutex);
+	return 0;
+}
 
-	struct tlv_response *r = malloc(sizeof(*r));
-	if (r == NULL) {
-		return -1;
+void tlv_dispatcher_set_lane_weight(struct tlv_dispatcher *td,
+		enum tlv_lane lane, unsigned weight)
+{
+	if (lane < TLV_LANE_COUNT) {
+		pthread_mutex_lock(&td->mutex);
+		td->lanes[lane].weight = weight ? weight : 1;
+		pthread_mutex_unlock(&td->mutex);
 	}
+}
 
-	r->p = p;
+void tlv_packet_set_lane(struct tlv_packet *p, enum tlv_lane lane)
+{
+	if (p && lane < TLV_LANE_COUNT) {
+		p->lane = lane;
+	}
+}
 
-	pthread_mutex_lock(&td->mutex);
-	LL_APPEND(td->responses, r);
-	pthread_mutex_unlock(&td->mutex);
+static void tlv_dispatcher_track_request(struct tlv_dispatcher *td,
+		struct tlv_handler_ctx *ctx)
+{
+	uint32_t deadline_ms;
+	if (tlv_packet_get_u32(ctx->req, TLV_TYPE_REQUEST_DEADLINE, &deadline_ms) == 0) {
+		ctx->deadline = ev_time() + deadline_ms / 1000.0;
+	}
 
-	if (td->response_cb) {
-		td->response_cb(td, td->response_cb_arg);
+	pthread_mutex_lock(&td->requests_mutex);
+	DL_APPEND(td->requests, ctx);
+	ctx->tracked = true;
+	pthread_mutex_unlock(&td->requests_mutex);
+}
+
+int tlv_dispatcher_cancel_request(struct tlv_dispatcher *td, const char *id)
+{
+	struct tlv_handler_ctx *ctx;
+	int found = 0;
+
+	pthread_mutex_lock(&td->requests_mutex);
+	DL_FOREACH(td->requests, ctx) {
+		if (strcmp(ctx->id, id) == 0) {
+			__atomic_store_n(&ctx->cancelled, 1, __ATOMIC_RELAXED);
+			found++;
+		}
 	}
+	pthread_mutex_unlock(&td->requests_mutex);
+	return found ? 0 : -1;
+}
 
-	return 0;
+bool tlv_handler_ctx_cancelled(struct tlv_handler_ctx *ctx)
+{
+	if (__atomic_load_n(&ctx->cancelled, __ATOMIC_RELAXED)) {
+		return true;
+	}
+	return ctx->deadline && ev_time() >= ctx->deadline;
 }
 
-void * tlv_dispatcher_dequeue_response(struct tlv_dispatcher *td, bool add_prepend, size_t *len)
+void tlv_handler_ctx_free(struct tlv_handler_ctx *ctx)
 {
-	struct tlv_packet *p = NULL;
-	struct tlv_response *r = td->responses;
-	void *out_buf = NULL;
-	*len = 0;
+	if (ctx) {
+		if (ctx->latency) {
+			metric_observe(ctx->latency, metric_now_us() - ctx->start_us);
+		}
+		if (ctx->tracked) {
+			pthread_mutex_lock(&ctx->td->requests_mutex);
+			DL_DELETE(ctx->td->requests, ctx);
+			pthread_mutex_unlock(&ctx->td->requests_mutex);
+		}
+		tlv_arena_free(ctx->arena);
+		tlv_packet_free(ctx->req);
+		mem_pool_free(&tlv_handler_ctx_pool, ctx);
+	}
+}
 
-	if (r) {
-		pthread_mutex_lock(&td->mutex);
-		LL_DELETE(td->responses, r);
-		pthread_mutex_unlock(&td->mutex);
+void *tlv_handler_ctx_alloc(struct tlv_handler_ctx *ctx, size_t len)
+{
+	struct tlv_arena_chunk *c = ctx->arena;
 
-		p = r->p;
-		free(r);
-
-		void *tlv_buf = tlv_packet_data(p);
-		size_t tlv_len = tlv_packet_len(p);
-		if (add_prepend) {
-			// usual communications flow between server and target
-			out_buf = encrypt_tlv(td->enc_ctx, p, tlv_len);
-			if (out_buf) {
-				struct tlv_xor_header *hdr = out_buf;
-				tlv_xor_key(hdr->xor_key);
-				tlv_len = ntohl(hdr->tlv.len);
-				memcpy(hdr->session_guid, td->session_guid, SESSION_GUID_LEN);
-				tlv_xor_bytes(hdr->xor_key, &hdr->xor_key + 1, tlv_len + TLV_PREPEND_LEN - sizeof(hdr->xor_key));
-				*len = tlv_len + TLV_PREPEND_LEN;
-			}
+	len = (len + TLV_ARENA_ALIGN - 1) & ~(size_t)(TLV_ARENA_ALIGN - 1);
+	if (c && c->size - c->used >= len) {
+		void *ptr = c->data + c->used;
+		c->used += len;
+		return ptr;
+	}
+
+	size_t chunk_data = TLV_ARENA_CHUNK_LEN - sizeof(*c);
+	if (len > chunk_data / 2) {
+		/*
+		 * Big allocations get a chunk of their own, queued behind the
+		 * current one so it keeps serving small requests
+		 */
+		struct tlv_arena_chunk *big = malloc(sizeof(*big) + len);
+		if (big == NULL) {
+			return NULL;
+		}
+		big->pooled = false;
+		big->size = big->used = len;
+		if (c) {
+			big->next = c->next;
+			c->next = big;
 		} else {
-			// an extension, which doesn't require the GUID or XOR logic
-			out_buf = calloc(tlv_len, 1);
-			if (out_buf) {
-				memcpy(out_buf, tlv_buf, tlv_len);
-				*len = tlv_len;
-			}
+			big->next = NULL;
+			ctx->arena = big;
 		}
-
-		tlv_packet_free(p);
+		return big->data;
 	}
 
-	return out_buf;
+	c = mem_pool_alloc(&tlv_arena_pool);
+	if (c == NULL) {
+		return NULL;
+	}
+	c->pooled = true;
+	c->size = chunk_data;
+	c->used = len;
+	c->next = ctx->arena;
+	ctx->arena = c;
+	return c->data;
 }
 
-struct tlv_dispatcher * tlv_dispatcher_new(tlv_response_cb cb, void *cb_arg)
+char *tlv_handler_ctx_strdup(struct tlv_handler_ctx *ctx, const char *str)
 {
-	struct tlv_dispatcher *td = calloc(1, sizeof(*td));
-	if (td) {
-		pthread_mutex_init(&td->mutex, NULL);
-		td->response_cb = cb;
-		td->response_cb_arg = cb_arg;
-		char default_session_guid[SESSION_GUID_LEN] = {0};
-		tlv_dispatcher_set_session_guid(td, default_session_guid);
+	size_t len = strlen(str) + 1;
+	char *copy = tlv_handler_ctx_alloc(ctx, len);
+	if (copy) {
+		memcpy(copy, str, len);
 	}
-	return td;
+	return copy;
 }
 
-int tlv_dispatcher_add_handler(struct tlv_dispatcher *td,
-		const char *method, tlv_handler_cb cb, void *arg)
+char *tlv_handler_ctx_printf(struct tlv_handler_ctx *ctx, const char *fmt, ...)
 {
-	struct tlv_handler *handler =
-		calloc(1, sizeof(*handler) + strlen(method) + 1);
-	if (handler == NULL) {
-		return -1;
+	va_list va;
+	va_start(va, fmt);
+	int len = vsnprintf(NULL, 0, fmt, va);
+	va_end(va);
+	if (len < 0) {
+		return NULL;
 	}
 
-	strcpy(handler->method, method);
-	handler->cb = cb;
-	handler->arg = arg;
-
-	HASH_ADD_STR(td->handlers, method, handler);
-	return 0;
+	char *str = tlv_handler_ctx_alloc(ctx, len + 1);
+	if (str) {
+		va_start(va, fmt);
+		vsnprintf(str, len + 1, fmt, va);
+		va_end(va);
+	}
+	return str;
 }
 
-void tlv_dispatcher_add_encryption(struct tlv_dispatcher *td, struct tlv_encryption_ctx *ctx)
+static void tlv_job_run(struct eio_req *req)
 {
-	td->enc_ctx = ctx;
+	struct tlv_job *job = req->data;
+	struct tlv_dispatcher *td = job->td;
+	struct tlv_handler_ctx *ctx = job->ctx;
+
+	// Respond before releasing the key, so responses stay in order too.
+	struct tlv_packet *response;
+	uint8_t trace = ctx->req->trace;
+	if (tlv_handler_ctx_cancelled(ctx)) {
+		log_info("not running cancelled request '%s'", ctx->id);
+		response = tlv_packet_response_result(ctx, ECANCELED);
+	} else {
+		TLV_TRACE_STAMP(trace, start_us);
+		METTLE_PROBE(handler__entry, job->handler->method, ctx->id, ctx);
+		response = job->cb(ctx);
+		METTLE_PROBE(handler__exit, job->handler->method, ctx,
+			response ? tlv_packet_len(response) : 0);
+		TLV_TRACE_STAMP(trace, end_us);
+	}
+	METTLE_PROBE(job__complete, job->handler->method, ctx,
+		response ? tlv_packet_len(response) : 0);
+	if (response) {
+		tlv_cache_store(td, job->handler, ctx, response);
+		tlv_handler_ctx_free(ctx);
+		tlv_dispatcher_enqueue_response(td, response);
+	}
+
+	pthread_mutex_lock(&td->jobs_mutex);
+	LL_DELETE(td->jobs_running, job);
+	td->jobs_running_count--;
+	tlv_dispatcher_run_jobs(td);
+	pthread_mutex_unlock(&td->jobs_mutex);
+	free(job);
 }
 
-void tlv_dispatcher_iter_extension_methods(struct tlv_dispatcher *td,
-		const char *extension,
-		void (*cb)(const char *method, void *arg), void *arg)
+static bool tlv_job_key_busy(struct tlv_job *list, struct tlv_job *until, uint32_t key)
 {
-	struct tlv_handler *handler, *tmp;
-	size_t extension_len = extension ? strlen(extension) : 0;
-	HASH_ITER(hh, td->handlers, handler, tmp) {
-		if (extension == NULL || strncmp(handler->method, extension, extension_len) == 0) {
-			cb(handler->method, arg);
+	for (struct tlv_job *job = list; job && job != until; job = job->next) {
+		if (job->key == key) {
+			return true;
 		}
 	}
+	return false;
 }
 
-static struct tlv_handler * find_handler(struct tlv_dispatcher *td,
-		const char *method)
+/*
+ * Starts queued jobs, oldest first, while under the concurrency limit and
+ * nothing earlier with the same key is queued or running. Called with
+ * 'jobs_mutex' held.
+ */
+static void tlv_dispatcher_run_jobs(struct tlv_dispatcher *td)
 {
-	struct tlv_handler *handler = NULL;
-	HASH_FIND_STR(td->handlers, method, handler);
-	return handler;
+	struct tlv_job *job, *tmp;
+	LL_FOREACH_SAFE(td->jobs_queued, job, tmp) {
+		if (td->jobs_running_count >= td->max_jobs) {
+			break;
+		}
+		if (job->key && (tlv_job_key_busy(td->jobs_running, NULL, job->key)
+				|| tlv_job_key_busy(td->jobs_queued, job, job->key))) {
+			continue;
+		}
+		LL_DELETE(td->jobs_queued, job);
+		METTLE_PROBE(job__submit, job->handler->method, job->ctx, job->pri);
+		if (eio_custom(tlv_job_run, job->pri, NULL, job) == NULL) {
+			log_error("could not start '%s'", job->ctx->method);
+			tlv_dispatcher_enqueue_response(td,
+				tlv_packet_response_result(job->ctx, TLV_RESULT_FAILURE));
+			tlv_handler_ctx_free(job->ctx);
+			free(job);
+			continue;
+		}
+		LL_PREPEND(td->jobs_running, job);
+		td->jobs_running_count++;
+	}
 }
 
-void tlv_handler_ctx_free(struct tlv_handler_ctx *ctx)
+static int tlv_dispatcher_queue_job(struct tlv_dispatcher *td,
+		struct tlv_handler *handler, struct tlv_handler_ctx *ctx)
 {
-	if (ctx) {
-		tlv_packet_free(ctx->req);
-		free(ctx);
+	struct tlv_job *job = calloc(1, sizeof(*job));
+	if (job == NULL) {
+		return -1;
 	}
+	job->td = td;
+	job->ctx = ctx;
+	job->handler = handler;
+	job->cb = handler->cb;
+	job->pri = handler->pri;
+	if (tlv_packet_get_u32(ctx->req, TLV_TYPE_CHANNEL_ID, &job->key) == -1) {
+		job->key = handler->serial ? TLV_JOB_KEY_SERIAL : 0;
+	}
+
+	pthread_mutex_lock(&td->jobs_mutex);
+	LL_APPEND(td->jobs_queued, job);
+	tlv_dispatcher_run_jobs(td);
+	pthread_mutex_unlock(&td->jobs_mutex);
+	return 0;
 }
 
 int tlv_dispatcher_process_request(struct tlv_dispatcher *td, struct tlv_packet *p)
 {
-	struct tlv_handler_ctx *ctx = calloc(1, sizeof(*ctx));
+	if (tlv_dispatcher_is_replay(td, p)) {
+		tlv_packet_free(p);
+		return 0;
+	}
+
+	struct tlv_handler_ctx *ctx = mem_pool_calloc(&tlv_handler_ctx_pool);
 
 	if (ctx == NULL) {
 		return -1;
@@ -544,7 +2340,27 @@ int tlv_dispatcher_process_request(struct tlv_dispatcher *td, struct tlv_packet
 
 	ctx->req = p;
 	ctx->td = td;
-	ctx->method = tlv_packet_get_str(p, TLV_TYPE_METHOD);
+
+	/*
+	 * Requests naming a known command ID index straight into the command
+	 * table, anything else is looked up by method name.
+	 */
+	struct tlv_handler *handler = NULL;
+	uint32_t command_id;
+	int slot = -1;
+	if (tlv_packet_get_u32(p, TLV_TYPE_COMMAND_ID, &command_id) == 0) {
+		slot = command_slot(command_id);
+	}
+	if (slot != -1 && td->commands[slot]) {
+		handler = td->commands[slot];
+		ctx->method = handler->method;
+		ctx->command_id = command_id;
+	} else {
+		ctx->method = tlv_packet_get_str(p, TLV_TYPE_METHOD);
+		if (ctx->method) {
+			handler = find_handler(td, ctx->method);
+		}
+	}
 	ctx->id = tlv_packet_get_str(p, TLV_TYPE_REQUEST_ID);
 
 	if (ctx->method == NULL) {
@@ -557,7 +2373,6 @@ int tlv_dispatcher_process_request(struct tlv_dispatcher *td, struct tlv_packet
 	}
 
 	struct tlv_packet *response = NULL;
-	struct tlv_handler *handler = find_handler(td, ctx->method);
 	if (handler == NULL) {
 		log_error("no handler found for method: '%s'", ctx->method);
 		response = tlv_packet_response_result(ctx, TLV_RESULT_FAILURE);
@@ -565,7 +2380,41 @@ int tlv_dispatcher_process_request(struct tlv_dispatcher *td, struct tlv_packet
 	} else {
 		log_info("processing method: '%s' id: '%s'", ctx->method, ctx->id);
 		ctx->arg = handler->arg;
-		response = handler->cb(ctx);
+		ctx->lane = handler->lane;
+		if (handler->latency == NULL) {
+			// Registered on first use, so idle methods cost nothing
+			char name[128];
+			snprintf(name, sizeof(name), "tlv.method.%s", handler->method);
+			handler->latency = metric_histogram(name);
+		}
+		ctx->latency = handler->latency;
+		ctx->start_us = metric_now_us();
+		tlv_dispatcher_track_request(td, ctx);
+		if (p->trace) {
+			struct tlv_trace *t = TLV_TRACE(p->trace);
+			strncpy(t->method, ctx->method, sizeof(t->method) - 1);
+			strncpy(t->id, ctx->id, sizeof(t->id) - 1);
+		}
+		response = tlv_cache_lookup(td, handler, ctx);
+		if (response == NULL) {
+			if (handler->blocking && tlv_dispatcher_queue_job(td, handler, ctx) == 0) {
+				return 0;
+			}
+			/*
+			 * Handlers that respond later, or already have, may have
+			 * freed the request by the time they return
+			 */
+			uint8_t trace = p->trace;
+			TLV_TRACE_STAMP(trace, start_us);
+			METTLE_PROBE(handler__entry, handler->method, ctx->id, ctx);
+			response = handler->cb(ctx);
+			METTLE_PROBE(handler__exit, handler->method, ctx,
+				response ? tlv_packet_len(response) : 0);
+			TLV_TRACE_STAMP(trace, end_us);
+			if (response) {
+				tlv_cache_store(td, handler, ctx, response);
+			}
+		}
 	}
 
 	if (response) {
@@ -576,25 +2425,71 @@ int tlv_dispatcher_process_request(struct tlv_dispatcher *td, struct tlv_packet
 }
 
 /*
- * This works around garbage on the socket by attempting to read past it.
+ * These work around garbage on the socket by attempting to read past it.
+ *
+ * Every field after the xor key is xored with the key at the same phase, so a
+ * raw header can be checked in place with 32-bit compares against the key.
+ * With 'want_len' set this matches the fixed-size first packet, otherwise any
+ * plausibly framed packet.
  */
-bool tlv_found_first_packet(struct buffer_queue *q)
+static inline bool tlv_xor_header_match(const void *raw, uint32_t want_len)
 {
-	bool found = false;
+	const struct tlv_xor_header *h = raw;
+	uint32_t key, flags, len, type;
+	memcpy(&key, h->xor_key, sizeof(key));
+	memcpy(&flags, &h->encryption_flags, sizeof(flags));
+	memcpy(&len, &h->tlv.len, sizeof(len));
+	memcpy(&type, &h->tlv.type, sizeof(type));
+	len = ntohl(len ^ key);
+	type = ntohl(type ^ key);
+
+	if (want_len) {
+		return len == want_len && type == TLV_PACKET_TYPE_REQUEST;
+	}
+	return len >= TLV_MIN_LEN && len <= INT_MAX
+		&& type <= 0xff && ntohl(flags ^ key) <= 0xff;
+}
 
-	while (buffer_queue_len(q) >= 571) {
-		struct tlv_xor_header h;
-		buffer_queue_copy(q, &h, sizeof(h));
-		tlv_xor_bytes(h.xor_key, &h.xor_key + 1, sizeof(h) - sizeof(h.xor_key)); // this just locates a header
-		size_t len = ntohl(h.tlv.len);
-		if (len == (547) && h.tlv.type == 0) {
-			found = true;
-			break;
+/*
+ * Drop bytes from the head of the queue until it starts with a matching
+ * header. Offsets where the header lies wholly within the head chunk are
+ * scanned in place; only the few straddling a chunk boundary are pulled up.
+ */
+static bool tlv_resync_buffer_queue(struct buffer_queue *q, uint32_t want_len)
+{
+	struct tlv_xor_header h;
+
+	while (buffer_queue_len(q) >= sizeof(h)) {
+		size_t avail;
+		const char *data = buffer_queue_peek_contiguous(q, &avail);
+		if (avail >= sizeof(h)) {
+			size_t last = avail - sizeof(h);
+			for (size_t i = 0; i <= last; i++) {
+				if (tlv_xor_header_match(data + i, want_len)) {
+					buffer_queue_drain(q, i);
+					return true;
+				}
+			}
+			buffer_queue_drain(q, last + 1);
+		} else {
+			data = buffer_queue_pullup(q, sizeof(h));
+			if (data == NULL) {
+				break;
+			}
+			if (tlv_xor_header_match(data, want_len)) {
+				return true;
+			}
+			buffer_queue_drain(q, 1);
 		}
-		buffer_queue_drain(q, 1);
 	}
 
-	return found;
+	return false;
+}
+
+bool tlv_found_first_packet(struct buffer_queue *q)
+{
+	return tlv_resync_buffer_queue(q, 547)
+		&& buffer_queue_len(q) >= 547 + TLV_PREPEND_LEN;
 }
 
 struct tlv_packet * tlv_packet_read_buffer_queue(struct tlv_dispatcher *td , struct buffer_queue *q)
@@ -609,8 +2504,22 @@ struct tlv_packet * tlv_packet_read_buffer_queue(struct tlv_dispatcher *td , str
 
 	/*
 	 * Ensure there are enough bytes for the rest of the packet
+	 *
+	 * A corrupt frame would otherwise leave a bogus length at the head of
+	 * the queue forever, so skip ahead to the next plausible header.
 	 */
-	buffer_queue_copy(q, &h, sizeof(h));
+	const void *raw = buffer_queue_pullup(q, sizeof(h));
+	if (raw == NULL) {
+		return NULL;
+	}
+	if (!tlv_xor_header_match(raw, 0)) {
+		log_error("bad packet header, resynchronizing");
+		if (!tlv_resync_buffer_queue(q, 0)) {
+			return NULL;
+		}
+		raw = buffer_queue_pullup(q, sizeof(h));
+	}
+	memcpy(&h, raw, sizeof(h));
 	tlv_xor_bytes(h.xor_key, &h.session_guid, sizeof(h) - sizeof(h.xor_key)); // this is just checking length of read no enc applies
 	size_t len = ntohl(h.tlv.len);
 	if (len > INT_MAX || len < TLV_MIN_LEN
@@ -619,23 +2528,71 @@ struct tlv_packet * tlv_packet_read_buffer_queue(struct tlv_dispatcher *td , str
 	}
 
 	/*
-	 * Header is OK, read the rest of the packet
+	 * Header is OK. If the whole packet sits in one queue chunk, take the
+	 * chunk over and parse in place, otherwise read the rest of the packet
+	 * into a new allocation. Taking the chunk copies whatever follows the
+	 * packet in it, so only do so when that is less than the packet itself.
 	 */
-	struct tlv_packet *p = malloc(TLV_MIN_LEN + len);
-	if (p) {
-		p->h = h.tlv;
+	size_t total_len = len + TLV_PREPEND_LEN;
+	struct tlv_packet *p = NULL;
+	void *storage = NULL;
+	size_t contiguous;
+	void *start = buffer_queue_peek_contiguous(q, &contiguous);
+	start += TLV_PREPEND_LEN - offsetof(struct tlv_packet, h);
+	if (contiguous >= total_len && contiguous - total_len <= total_len
+			&& ((uintptr_t)start % __alignof__(struct tlv_packet)) == 0
+			&& buffer_queue_detach(q, total_len, &storage)) {
+		mem_acct_retag(storage, MEM_TAG_NONE, MEM_TAG_TLV_PACKET);
+		p = start;
+		p->storage = storage;
+		p->index = NULL;
+		p->capacity = len;
+		p->lookups = 0;
+		p->pool = 0;
+		p->lane = TLV_LANE_INTERACTIVE;
+		p->trace = 0;
+	} else {
+		p = tlv_packet_alloc(len);
+		if (p == NULL) {
+			return NULL;
+		}
+		storage = p;
 		buffer_queue_drain(q, sizeof(h));
-		len -= TLV_MIN_LEN;
-		buffer_queue_remove(q, p->buf, len);
-		tlv_xor_bytes(h.xor_key, p->buf, len);
-		if (td != NULL && td->enc_ctx != NULL && ntohl(h.encryption_flags) == td->enc_ctx->flag) {
-			void *result = decrypt_tlv(td->enc_ctx, p, len + TLV_MIN_LEN);
-			if (result) {
-				memset(p->buf, 0, len);
-				memcpy(p->buf, result, len);
-				free(result);
-			}
+		buffer_queue_remove(q, p->buf, len - TLV_MIN_LEN);
+	}
+
+	p->h = h.tlv;
+	len -= TLV_MIN_LEN;
+	tlv_xor_bytes(h.xor_key, p->buf, len);
+
+	/*
+	 * Decrypt the value in place. CBC leaves the plaintext after the iv, so
+	 * the packet is moved up to have the header immediately precede it.
+	 */
+	if (td != NULL && td->enc_ctx != NULL && td->enc_ctx->flag != ENC_NONE
+			&& ntohl(h.encryption_flags) == td->enc_ctx->flag) {
+		size_t plain_off = 0;
+		ssize_t plain_len = decrypt_tlv_in_place(td->enc_ctx, p->buf, len, &plain_off);
+		if (plain_len < 0) {
+			log_error("dropping packet that failed to decrypt");
+			tlv_packet_free(p);
+			return NULL;
+		}
+		if (plain_off) {
+			size_t capacity = p->capacity - plain_off;
+			uint16_t pool = p->pool;
+			p = (void *)p + plain_off;
+			p->storage = storage;
+			p->capacity = capacity;
+			p->index = NULL;
+			p->lookups = 0;
+			p->pool = pool;
+			p->lane = TLV_LANE_INTERACTIVE;
+			p->trace = 0;
+			p->h.type = h.tlv.type;
 		}
+		p->h.len = htonl(TLV_MIN_LEN + plain_len);
+		len = plain_len;
 	}
 
 	/*
@@ -654,7 +2611,7 @@ struct tlv_packet * tlv_packet_read_buffer_queue(struct tlv_dispatcher *td , str
 		 */
 		if ((tlv_len > (len - offset) || tlv_len < TLV_MIN_LEN)) {
 			if (!found_tlv) {
-				free(p);
+				tlv_packet_free(p);
 				return NULL;
 			}
 			else {
@@ -669,6 +2626,11 @@ struct tlv_packet * tlv_packet_read_buffer_queue(struct tlv_dispatcher *td , str
 		}
 	}
 
+	p = tlv_packet_inflate(p);
+	if (p) {
+		p->trace = tlv_trace_claim();
+		METTLE_PROBE(packet__in, total_len);
+	}
 	return p;
 }
 
@@ -708,10 +2670,26 @@ void tlv_dispatcher_free(struct tlv_dispatcher *td)
 	if (td) {
 		struct tlv_handler *h, *h_tmp;
 		HASH_ITER(hh, td->handlers, h, h_tmp) {
-			free(h);
+			HASH_DEL(td->handlers, h);
+			tlv_cache_flush(h);
+			if (!h->in_table) {
+				free(h);
+			}
+		}
+		struct tlv_handler_table *table, *table_tmp;
+		LL_FOREACH_SAFE(td->handler_tables, table, table_tmp) {
+			free(table);
+		}
+		for (int i = 0; i < TLV_LANE_COUNT; i++) {
+			struct tlv_response *r, *r_tmp;
+			LL_FOREACH_SAFE(td->lanes[i].head, r, r_tmp) {
+				tlv_packet_free(r->p);
+				mem_pool_free(&tlv_response_pool, r);
+			}
 		}
 		if (td->enc_ctx)
 			free_tlv_encryption_ctx(td->enc_ctx);
 		free(td);
+		tlv_log_pool_stats();
 	}
 }
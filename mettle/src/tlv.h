@@ -8,6 +8,7 @@
 #define _TLV_H_
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <dirent.h>
 
@@ -36,6 +37,7 @@ struct tlv_xor_header {
 	struct tlv_header tlv;
 } __attribute__((packed));
 
+struct metric;
 struct tlv_packet;
 struct tlv_dispatcher;
 
@@ -45,6 +47,16 @@ bool tlv_found_first_packet(struct buffer_queue *q);
 
 struct tlv_packet * tlv_packet_read_buffer_queue(struct tlv_dispatcher *td , struct buffer_queue *q);
 
+struct tlv_packet *tlv_packet_read_raw_buffer_queue(struct buffer_queue *q, size_t len);
+
+/*
+ * Removes the next packet from a stream of unencrypted packets, each framed
+ * by the length in its own header, as exchanged with extensions. Returns
+ * NULL until the whole of it has arrived. A corrupt length cannot be
+ * resynchronized from, so the queued bytes are then dropped.
+ */
+struct tlv_packet *tlv_packet_read_raw_frame(struct buffer_queue *q);
+
 void *tlv_packet_data(struct tlv_packet *p);
 
 int tlv_packet_len(struct tlv_packet *p);
@@ -63,25 +75,91 @@ int tlv_packet_get_u32(struct tlv_packet *p, uint32_t value_type, uint32_t *valu
 
 int tlv_packet_get_u64(struct tlv_packet *p, uint32_t value_type, uint64_t *value);
 
+/*
+ * Request schemas: a table of the values a handler reads, each stored at an
+ * offset into a struct of its own, filled in by one walk over the packet
+ * rather than a lookup per value. Strings point into the packet like
+ * tlv_packet_get_str's, and raw values fill a struct tlv_raw_value. Only the
+ * first of each type counts, and values missing or of the wrong size leave
+ * their members as they were, so the caller sets defaults beforehand.
+ * Returns -1 if a required value was missing or malformed.
+ */
+enum tlv_field_kind {
+	TLV_FIELD_STR,
+	TLV_FIELD_RAW,
+	TLV_FIELD_BOOL,
+	TLV_FIELD_U16,
+	TLV_FIELD_U32,
+	TLV_FIELD_U64,
+};
+
+struct tlv_field {
+	uint32_t type;
+	enum tlv_field_kind kind;
+	size_t offset;
+	bool required;
+};
+
+struct tlv_raw_value {
+	void *buf;
+	size_t len;
+};
+
+#define TLV_FIELD(type, kind, st, member) \
+	{ (type), (kind), offsetof(st, member), false }
+#define TLV_FIELD_REQUIRED(type, kind, st, member) \
+	{ (type), (kind), offsetof(st, member), true }
+
+/*
+ * At most this many fields per schema
+ */
+#define TLV_SCHEMA_MAX_FIELDS 64
+
+int tlv_packet_decode(struct tlv_packet *p, const struct tlv_field *fields,
+		size_t num_fields, void *out);
+
 struct tlv_iterator {
 	struct tlv_packet *packet;
 	size_t offset;
 	uint32_t value_type;
+	int index_next; /* internal, leave zeroed */
 };
 
 void *tlv_packet_iterate(struct tlv_iterator *i, size_t *len);
 
 char *tlv_packet_iterate_str(struct tlv_iterator *i);
 
+/*
+ * Returns the next group as a packet of its own, to be freed by the caller,
+ * or NULL at the end or if the group's values are malformed
+ */
+struct tlv_packet *tlv_packet_iterate_group(struct tlv_iterator *i);
+
 struct tlv_packet * tlv_packet_add_child(struct tlv_packet *p,
 		struct tlv_packet *child);
 
 struct tlv_packet * tlv_packet_merge_child(struct tlv_packet *p,
 		struct tlv_packet *child);
 
+/*
+ * Appends a copy of the values in src, leaving src as it was
+ */
+struct tlv_packet * tlv_packet_add_values(struct tlv_packet *p,
+		struct tlv_packet *src);
+
 struct tlv_packet * tlv_packet_add_raw(struct tlv_packet *p,
 		uint32_t type, const void *val, size_t len);
 
+/*
+ * Makes room for a value of up to len bytes, to be filled in at *val and
+ * added with tlv_packet_commit_raw once its final length is known. Nothing
+ * else may be added to the packet in between.
+ */
+struct tlv_packet * tlv_packet_reserve_raw(struct tlv_packet *p,
+		uint32_t type, size_t len, void **val);
+
+struct tlv_packet * tlv_packet_commit_raw(struct tlv_packet *p, size_t len);
+
 struct tlv_packet * tlv_packet_add_str(struct tlv_packet *p,
 		uint32_t type, const char *str);
 
@@ -108,28 +186,106 @@ void tlv_packet_free(struct tlv_packet *p);
  * TLV Handler
  */
 struct channel;
+struct mbedtls_aes_context;
+struct mbedtls_cipher_context_t;
+
 struct tlv_encryption_ctx {
 	unsigned char *key;
 	unsigned char *iv;
 
+	/*
+	 * Key schedules, expanded once for the life of the session
+	 */
+	struct mbedtls_aes_context *aes_enc;
+	struct mbedtls_aes_context *aes_dec;
+
+	/*
+	 * AES-GCM or ChaCha20-Poly1305, where iv holds the next nonce
+	 */
+	struct mbedtls_cipher_context_t *aead;
+
 	uint32_t flag;
 	bool initialized;
 };
 
+/*
+ * Outbound packets are queued in lanes so that bulk transfers do not hold up
+ * interactive traffic. Responses take the lane of their handler, which may
+ * change ctx->lane before building them.
+ */
+enum tlv_lane {
+	TLV_LANE_INTERACTIVE,
+	TLV_LANE_BULK,
+	TLV_LANE_COUNT
+};
+
+/*
+ * Interactive packets sent for each bulk one while both lanes are busy
+ */
+#define TLV_LANE_INTERACTIVE_WEIGHT 8
+
+void tlv_packet_set_lane(struct tlv_packet *p, enum tlv_lane lane);
+
 struct tlv_handler_ctx {
 	const char *method;
+	uint32_t command_id;
 	const char *id;
 	struct tlv_packet *req;
 	struct tlv_dispatcher *td;
 	uint32_t channel_id;
 	struct channel *channel;
+	enum tlv_lane lane;
 	void *arg;
+
+	/*
+	 * Set once the request is cancelled, and the time it must be done by
+	 * if the request gave a TLV_TYPE_REQUEST_DEADLINE in milliseconds
+	 */
+	int cancelled;
+	double deadline;
+
+	bool tracked;
+	struct tlv_handler_ctx *prev, *next;
+
+	/*
+	 * Timed from dispatch until the request is done with
+	 */
+	uint64_t start_us;
+	struct metric *latency;
+
+	/*
+	 * Scratch memory handed out by tlv_handler_ctx_alloc
+	 */
+	struct tlv_arena_chunk *arena;
+
+	/*
+	 * Set when the response may be cached, with the invalidations seen
+	 */
+	bool cacheable;
+	unsigned cache_gen;
 };
 
 typedef struct tlv_packet *(*tlv_handler_cb)(struct tlv_handler_ctx *);
 
 void tlv_handler_ctx_free(struct tlv_handler_ctx *ctx);
 
+/*
+ * Scratch memory that lives until the request's context is freed, so
+ * handlers need not free it on each exit path. Returns NULL on failure.
+ */
+void *tlv_handler_ctx_alloc(struct tlv_handler_ctx *ctx, size_t len);
+
+char *tlv_handler_ctx_strdup(struct tlv_handler_ctx *ctx, const char *str);
+
+char *tlv_handler_ctx_printf(struct tlv_handler_ctx *ctx, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/*
+ * Long-running handlers should check this as they go, and give up with
+ * ECANCELED once it returns true
+ */
+bool tlv_handler_ctx_cancelled(struct tlv_handler_ctx *ctx);
+
 struct tlv_packet * tlv_packet_add_result(struct tlv_packet *p, int rc);
 
 struct tlv_packet * tlv_packet_add_uuid(struct tlv_packet *p, struct tlv_dispatcher *td);
@@ -138,6 +294,23 @@ struct tlv_packet * tlv_packet_response(struct tlv_handler_ctx *ctx);
 
 struct tlv_packet * tlv_packet_response_result(struct tlv_handler_ctx *ctx, int rc);
 
+/*
+ * Long responses may be streamed as a series of partial responses flagged
+ * with TLV_TYPE_CONTINUATION, followed by a final one carrying the result.
+ * This is only done if the request set TLV_TYPE_CONTINUATION, to say the
+ * client can reassemble them.
+ *
+ * tlv_packet_response_continue sends 'p' as a partial response once it has
+ * grown past TLV_STREAM_CHUNK_LEN and returns a new empty response to carry
+ * on filling. Otherwise it returns 'p' unchanged.
+ */
+#define TLV_STREAM_CHUNK_LEN (64 * 1024)
+
+bool tlv_handler_ctx_can_stream(struct tlv_handler_ctx *ctx);
+
+struct tlv_packet * tlv_packet_response_continue(struct tlv_handler_ctx *ctx,
+		struct tlv_packet *p);
+
 /*
  * TLV Dispatcher
  */
@@ -150,17 +323,152 @@ int tlv_dispatcher_process_request(struct tlv_dispatcher *td, struct tlv_packet
 int tlv_dispatcher_add_handler(struct tlv_dispatcher *td,
 		const char *method, tlv_handler_cb cb, void *arg);
 
+/*
+ * Registers a whole table of handlers sharing 'arg' with one allocation.
+ * The table's method names are used in place, so it should be static.
+ */
+struct tlv_handler_def {
+	const char *method;
+	tlv_handler_cb cb;
+};
+
+int tlv_dispatcher_add_handlers(struct tlv_dispatcher *td,
+		const struct tlv_handler_def *defs, size_t count, void *arg);
+
+int tlv_dispatcher_set_handler_lane(struct tlv_dispatcher *td,
+		const char *method, enum tlv_lane lane);
+
+enum tlv_lane tlv_dispatcher_get_handler_lane(struct tlv_dispatcher *td,
+		const char *method);
+
+/*
+ * Blocking handlers are run on an eio worker rather than the loop, and
+ * their response enqueued from there. They may still return NULL and
+ * respond later themselves.
+ *
+ * Up to 'max_jobs' of them run at once. Requests for the same channel
+ * start in the order they arrived, each once the previous one returns.
+ */
+#define TLV_MAX_JOBS 4
+
+int tlv_dispatcher_set_handler_blocking(struct tlv_dispatcher *td,
+		const char *method, bool blocking);
+
+void tlv_dispatcher_set_max_jobs(struct tlv_dispatcher *td, unsigned max_jobs);
+
+/*
+ * eio priority, from EIO_PRI_MIN to EIO_PRI_MAX, of a blocking handler
+ */
+int tlv_dispatcher_set_handler_priority(struct tlv_dispatcher *td,
+		const char *method, int pri);
+
+/*
+ * Responses to idempotent queries can be cached for 'ttl_ms' and replayed
+ * to repeats of the same request, with any values other than its ID,
+ * method and sequencing the same. Only successful responses to requests
+ * that are not streamed are cached. Caching is off until enabled, and
+ * turning it off or invalidating a method drops what was cached.
+ */
+void tlv_dispatcher_set_caching(struct tlv_dispatcher *td, bool enable);
+
+int tlv_dispatcher_set_handler_cache_ttl(struct tlv_dispatcher *td,
+		const char *method, unsigned ttl_ms);
+
+/*
+ * Drops the cached responses of 'method', or of every handler if NULL
+ */
+int tlv_dispatcher_invalidate_cache(struct tlv_dispatcher *td, const char *method);
+
+/*
+ * Flags every request in progress with the given ID as cancelled. Queued
+ * blocking requests are answered with ECANCELED without being run.
+ */
+int tlv_dispatcher_cancel_request(struct tlv_dispatcher *td, const char *id);
+
+/*
+ * Traces requests from being read to their last response being handed to
+ * the transport. The last TLV_TRACE_HISTORY requests taking at least
+ * 'threshold_us' are kept, and added as TLV_TYPE_TRACE groups by
+ * tlv_trace_add_history.
+ */
+#define TLV_TRACE_HISTORY 32
+
+int tlv_trace_enable(bool enable, uint64_t threshold_us);
+
+struct tlv_packet *tlv_trace_add_history(struct tlv_packet *p);
+
+void tlv_dispatcher_set_lane_weight(struct tlv_dispatcher *td,
+		enum tlv_lane lane, unsigned weight);
+
 void tlv_dispatcher_add_encryption(struct tlv_dispatcher *td, struct tlv_encryption_ctx *ctx);
 
+/*
+ * Values sent to the network of at least 'threshold' bytes are compressed
+ * when that saves space, 0 disables compression.
+ */
+#define TLV_COMPRESS_THRESHOLD 4096
+
+void tlv_dispatcher_set_compress_threshold(struct tlv_dispatcher *td, size_t threshold);
+
+/*
+ * Number packets sent to the network with TLV_TYPE_PACKET_SEQ, so a handler
+ * receiving them over several links can put them back in order
+ */
+void tlv_dispatcher_set_sequencing(struct tlv_dispatcher *td, bool enable);
+
+/*
+ * Sequencing in both directions, for resuming a session over a new link.
+ * Packets sent carry TLV_TYPE_PACKET_ACK, the last TLV_TYPE_PACKET_SEQ
+ * received, and requests with a sequence number already seen are replays
+ * and dropped rather than run again.
+ */
+void tlv_dispatcher_set_resumption(struct tlv_dispatcher *td, bool enable);
+
 int tlv_dispatcher_enqueue_response(struct tlv_dispatcher *td, struct tlv_packet *p);
 
 void * tlv_dispatcher_dequeue_response(struct tlv_dispatcher *td,
 		bool add_prepend, size_t *len);
 
+/*
+ * Frames, and encrypts, a response as tlv_dispatcher_dequeue_response
+ * would, for a caller sending it ahead of those still queued. Takes
+ * ownership of 'p'.
+ */
+void * tlv_dispatcher_encode_response(struct tlv_dispatcher *td,
+		struct tlv_packet *p, bool add_prepend, size_t *len);
+
+/*
+ * Gives back the sequence number taken by the last response encoded with a
+ * prepend, for a caller that frees it instead of sending it
+ */
+void tlv_dispatcher_unsend_response(struct tlv_dispatcher *td);
+
+/*
+ * Returns the number of responses waiting to be dequeued, and optionally
+ * their total size
+ */
+size_t tlv_dispatcher_queued_responses(struct tlv_dispatcher *td, size_t *bytes);
+
 void tlv_dispatcher_iter_extension_methods(struct tlv_dispatcher *td,
 		const char *extension,
 		void (*cb)(const char *method, void *arg), void *arg);
 
+/*
+ * Runs the handler for 'method' on 'req' straight away and returns its
+ * response, for requests bundled into another. 'req' stays the caller's.
+ * Returns NULL if there is no such handler, it is blocking, or it responds
+ * later, so only handlers that answer in place should be run this way.
+ */
+struct tlv_packet *tlv_dispatcher_run_inline(struct tlv_dispatcher *td,
+		const char *method, struct tlv_packet *req, const char *id);
+
+/*
+ * The framework's ID for a core or stdapi method, 0 if it has none
+ */
+uint32_t tlv_command_id(const char *method);
+
+const char *tlv_command_name(uint32_t command_id);
+
 const char *tlv_dispatcher_get_uuid(struct tlv_dispatcher *td, size_t *len);
 
 int tlv_dispatcher_set_uuid(struct tlv_dispatcher *td, char *uuid, size_t len);
@@ -170,10 +478,18 @@ int tlv_dispatcher_set_session_guid(struct tlv_dispatcher *td, char *uuid);
 
 void tlv_dispatcher_free(struct tlv_dispatcher *td);
 
+void tlv_log_pool_stats(void);
+
 struct mettle;
 
 void tlv_register_coreapi(struct mettle *m);
 
+/*
+ * Queues an unsolicited core_bootstrap request carrying what the other end
+ * asks for first on a new session, so it need not wait a round trip each
+ */
+void tlv_coreapi_push_bootstrap(struct mettle *m);
+
 void tlv_register_stdapi(struct mettle *m);
 
 #endif
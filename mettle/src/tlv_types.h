@@ -48,6 +48,7 @@
  */
 #define TLV_TYPE_ANY                   (TLV_META_TYPE_NONE    | 0)
 #define TLV_TYPE_METHOD                (TLV_META_TYPE_STRING  | 1)
+#define TLV_TYPE_COMMAND_ID            (TLV_META_TYPE_UINT    | 1)
 #define TLV_TYPE_REQUEST_ID            (TLV_META_TYPE_STRING  | 2)
 #define TLV_TYPE_EXCEPTION             (TLV_META_TYPE_GROUP   | 3)
 #define TLV_TYPE_RESULT                (TLV_META_TYPE_UINT    | 4)
@@ -55,6 +56,7 @@
 #define TLV_TYPE_STRING                (TLV_META_TYPE_STRING  | 10)
 #define TLV_TYPE_UINT                  (TLV_META_TYPE_UINT    | 11)
 #define TLV_TYPE_BOOL                  (TLV_META_TYPE_BOOL    | 12)
+#define TLV_TYPE_CONTINUATION          (TLV_META_TYPE_BOOL    | 13)
 
 #define TLV_TYPE_LENGTH                (TLV_META_TYPE_UINT    | 25)
 #define TLV_TYPE_DATA                  (TLV_META_TYPE_RAW     | 26)
@@ -66,10 +68,15 @@
 #define TLV_TYPE_CHANNEL_DATA_GROUP    (TLV_META_TYPE_GROUP   | 53)
 #define TLV_TYPE_CHANNEL_CLASS         (TLV_META_TYPE_UINT    | 54)
 #define TLV_TYPE_CHANNEL_PARENTID      (TLV_META_TYPE_UINT    | 55)
+#define TLV_TYPE_CHANNEL_WINDOW        (TLV_META_TYPE_UINT    | 56)
+#define TLV_TYPE_CHANNEL_COALESCE_MS   (TLV_META_TYPE_UINT    | 57)
+#define TLV_TYPE_CHANNEL_COALESCE_LEN  (TLV_META_TYPE_UINT    | 58)
 
 #define TLV_TYPE_SEEK_WHENCE           (TLV_META_TYPE_UINT    | 70)
 #define TLV_TYPE_SEEK_OFFSET           (TLV_META_TYPE_UINT    | 71)
 #define TLV_TYPE_SEEK_POS              (TLV_META_TYPE_UINT    | 72)
+#define TLV_TYPE_SEEK_OFFSET_64        (TLV_META_TYPE_QWORD   | 73)
+#define TLV_TYPE_SEEK_POS_64           (TLV_META_TYPE_QWORD   | 74)
 
 #define TLV_TYPE_EXCEPTION_CODE        (TLV_META_TYPE_UINT    | 300)
 #define TLV_TYPE_EXCEPTION_STRING      (TLV_META_TYPE_STRING  | 301)
@@ -95,6 +102,75 @@
 #define TLV_TYPE_MACHINE_ID            (TLV_META_TYPE_STRING  | 460)
 #define TLV_TYPE_UUID                  (TLV_META_TYPE_RAW     | 461)
 #define TLV_TYPE_SESSION_GUID          (TLV_META_TYPE_RAW     | 462)
+#define TLV_TYPE_BOOTSTRAP_METHOD      (TLV_META_TYPE_STRING  | 463)
+#define TLV_TYPE_BOOTSTRAP_RESPONSE    (TLV_META_TYPE_GROUP   | 464)
+
+#define TLV_TYPE_RATE_LIMIT_RX         (TLV_META_TYPE_QWORD   | 470)
+#define TLV_TYPE_RATE_LIMIT_TX         (TLV_META_TYPE_QWORD   | 471)
+#define TLV_TYPE_TRANS_MULTI_PACKET    (TLV_META_TYPE_BOOL    | 472)
+#define TLV_TYPE_TRANS_LONG_POLL       (TLV_META_TYPE_UINT    | 473)
+#define TLV_TYPE_PACKET_SEQ            (TLV_META_TYPE_UINT    | 474)
+#define TLV_TYPE_REQUEST_DEADLINE      (TLV_META_TYPE_UINT    | 475)
+#define TLV_TYPE_CANCEL_REQUEST_ID     (TLV_META_TYPE_STRING  | 476)
+#define TLV_TYPE_PACKET_ACK            (TLV_META_TYPE_UINT    | 477)
+#define TLV_TYPE_STREAM_COMPRESSION    (TLV_META_TYPE_UINT    | 478)
+
+#define TLV_TYPE_EXTENSION_RING_FD       (TLV_META_TYPE_UINT  | 480)
+#define TLV_TYPE_EXTENSION_RING_DATA_FD  (TLV_META_TYPE_UINT  | 481)
+#define TLV_TYPE_EXTENSION_RING_SPACE_FD (TLV_META_TYPE_UINT  | 482)
+#define TLV_TYPE_EXTENSION_IMAGE_HASH    (TLV_META_TYPE_RAW   | 483)
+#define TLV_TYPE_EXTENSION_COMMAND       (TLV_META_TYPE_STRING | 484)
+
+#define TLV_TYPE_WORKER_MAX_PARALLEL   (TLV_META_TYPE_UINT    | 485)
+#define TLV_TYPE_WORKER_MAX_IDLE       (TLV_META_TYPE_UINT    | 486)
+#define TLV_TYPE_WORKER_IDLE_TIMEOUT   (TLV_META_TYPE_UINT    | 487)
+#define TLV_TYPE_WORKER_MAX_JOBS       (TLV_META_TYPE_UINT    | 488)
+
+#define TLV_TYPE_LOG_LEVEL             (TLV_META_TYPE_UINT    | 490)
+#define TLV_TYPE_LOG_INTERVAL          (TLV_META_TYPE_UINT    | 491)
+#define TLV_TYPE_LOG_RATE              (TLV_META_TYPE_QWORD   | 492)
+#define TLV_TYPE_LOG_DATA              (TLV_META_TYPE_RAW     | 493)
+#define TLV_TYPE_LOG_DROPPED           (TLV_META_TYPE_UINT    | 494)
+
+#define TLV_TYPE_METRIC                (TLV_META_TYPE_GROUP   | 495)
+#define TLV_TYPE_METRIC_NAME           (TLV_META_TYPE_STRING  | 496)
+#define TLV_TYPE_METRIC_TYPE           (TLV_META_TYPE_UINT    | 497)
+#define TLV_TYPE_METRIC_VALUE          (TLV_META_TYPE_QWORD   | 498)
+#define TLV_TYPE_METRIC_SUM            (TLV_META_TYPE_QWORD   | 499)
+#define TLV_TYPE_METRIC_MAX            (TLV_META_TYPE_QWORD   | 500)
+#define TLV_TYPE_METRIC_P50            (TLV_META_TYPE_QWORD   | 501)
+#define TLV_TYPE_METRIC_P90            (TLV_META_TYPE_QWORD   | 502)
+#define TLV_TYPE_METRIC_P99            (TLV_META_TYPE_QWORD   | 503)
+
+#define TLV_TYPE_TRACE                 (TLV_META_TYPE_GROUP   | 505)
+#define TLV_TYPE_TRACE_THRESHOLD       (TLV_META_TYPE_UINT    | 506)
+#define TLV_TYPE_TRACE_HANDLER_START   (TLV_META_TYPE_UINT    | 507)
+#define TLV_TYPE_TRACE_HANDLER_END     (TLV_META_TYPE_UINT    | 508)
+#define TLV_TYPE_TRACE_ENQUEUED        (TLV_META_TYPE_UINT    | 509)
+#define TLV_TYPE_TRACE_DEQUEUED        (TLV_META_TYPE_UINT    | 510)
+#define TLV_TYPE_TRACE_SENT            (TLV_META_TYPE_UINT    | 511)
+
+#define TLV_TYPE_MEM_TAG               (TLV_META_TYPE_GROUP   | 512)
+#define TLV_TYPE_MEM_TAG_NAME          (TLV_META_TYPE_STRING  | 513)
+#define TLV_TYPE_MEM_LIVE              (TLV_META_TYPE_QWORD   | 514)
+#define TLV_TYPE_MEM_PEAK              (TLV_META_TYPE_QWORD   | 515)
+#define TLV_TYPE_MEM_ALLOCS            (TLV_META_TYPE_QWORD   | 516)
+
+#define TLV_TYPE_CACHE_ENABLE          (TLV_META_TYPE_BOOL    | 517)
+#define TLV_TYPE_CACHE_METHOD          (TLV_META_TYPE_STRING  | 518)
+
+#define TLV_TYPE_TUNABLE               (TLV_META_TYPE_GROUP   | 519)
+#define TLV_TYPE_TUNABLE_NAME          (TLV_META_TYPE_STRING  | 520)
+#define TLV_TYPE_TUNABLE_VALUE         (TLV_META_TYPE_QWORD   | 521)
+#define TLV_TYPE_TUNABLE_MIN           (TLV_META_TYPE_QWORD   | 522)
+#define TLV_TYPE_TUNABLE_MAX           (TLV_META_TYPE_QWORD   | 523)
+
+#define TLV_TYPE_THREAD_CLASS          (TLV_META_TYPE_GROUP   | 524)
+#define TLV_TYPE_THREAD_ROLE           (TLV_META_TYPE_STRING  | 525)
+#define TLV_TYPE_THREAD_CPUS           (TLV_META_TYPE_RAW     | 526)
+#define TLV_TYPE_THREAD_NICE           (TLV_META_TYPE_UINT    | 527)
+#define TLV_TYPE_THREAD_IOPRIO         (TLV_META_TYPE_UINT    | 528)
+#define TLV_TYPE_THREAD_COUNT          (TLV_META_TYPE_UINT    | 529)
 
 #define TLV_TYPE_RSA_PUB_KEY           (TLV_META_TYPE_STRING  | 550)
 #define TLV_TYPE_SYM_KEY_TYPE          (TLV_META_TYPE_UINT    | 551)
@@ -125,8 +201,46 @@
 #define TLV_TYPE_SEARCH_GLOB           (TLV_META_TYPE_STRING  | 1231)
 #define TLV_TYPE_SEARCH_ROOT           (TLV_META_TYPE_STRING  | 1232)
 #define TLV_TYPE_SEARCH_RESULTS        (TLV_META_TYPE_GROUP   | 1233)
+#define TLV_TYPE_SEARCH_M_START_DATE   (TLV_META_TYPE_UINT    | 1235)
+#define TLV_TYPE_SEARCH_M_END_DATE     (TLV_META_TYPE_UINT    | 1236)
 
 #define TLV_TYPE_FILE_MODE_T           (TLV_META_TYPE_UINT    | 1234)
+#define TLV_TYPE_FILE_READAHEAD        (TLV_META_TYPE_UINT    | 1240)
+#define TLV_TYPE_FILE_HASH_TYPE        (TLV_META_TYPE_UINT    | 1241)
+#define TLV_TYPE_FILE_HASH_GROUP       (TLV_META_TYPE_GROUP   | 1242)
+#define TLV_TYPE_FILE_HASH_MD5         (TLV_META_TYPE_RAW     | 1243)
+#define TLV_TYPE_FILE_HASH_SHA1        (TLV_META_TYPE_RAW     | 1244)
+#define TLV_TYPE_FILE_HASH_SHA256      (TLV_META_TYPE_RAW     | 1245)
+#define TLV_TYPE_DIRECTORY_NO_STAT     (TLV_META_TYPE_BOOL    | 1246)
+#define TLV_TYPE_SEARCH_DEPTH          (TLV_META_TYPE_UINT    | 1247)
+#define TLV_TYPE_SEARCH_ID             (TLV_META_TYPE_UINT    | 1248)
+#define TLV_TYPE_SEARCH_MIN_SIZE       (TLV_META_TYPE_QWORD   | 1249)
+#define TLV_TYPE_SEARCH_MAX_SIZE       (TLV_META_TYPE_QWORD   | 1250)
+#define TLV_TYPE_SEARCH_PATTERN        (TLV_META_TYPE_RAW     | 1251)
+#define TLV_TYPE_SEARCH_OFFSET         (TLV_META_TYPE_QWORD   | 1252)
+#define TLV_TYPE_SEARCH_CONTEXT        (TLV_META_TYPE_RAW     | 1253)
+#define TLV_TYPE_SEARCH_CONTEXT_LEN    (TLV_META_TYPE_UINT    | 1254)
+#define TLV_TYPE_SEARCH_MAX_MATCHES    (TLV_META_TYPE_UINT    | 1255)
+#define TLV_TYPE_ARCHIVE_COMPRESSION   (TLV_META_TYPE_UINT    | 1256)
+#define TLV_TYPE_ARCHIVE_LEVEL         (TLV_META_TYPE_UINT    | 1257)
+#define TLV_TYPE_FILE_BLOCK_SIZE       (TLV_META_TYPE_UINT    | 1258)
+#define TLV_TYPE_FILE_BLOCK_HASH       (TLV_META_TYPE_RAW     | 1259)
+#define TLV_TYPE_FILE_BLOCK_OFFSET     (TLV_META_TYPE_QWORD   | 1260)
+#define TLV_TYPE_FILE_BLOCK_COUNT      (TLV_META_TYPE_UINT    | 1261)
+#define TLV_TYPE_FILE_TOTAL_SIZE       (TLV_META_TYPE_QWORD   | 1262)
+#define TLV_TYPE_FILE_WRITE_BUFFER     (TLV_META_TYPE_UINT    | 1263)
+#define TLV_TYPE_FILE_HOLE             (TLV_META_TYPE_RAW     | 1264)
+#define TLV_TYPE_FILE_RANGE_LENGTH     (TLV_META_TYPE_QWORD   | 1265)
+#define TLV_TYPE_FILE_RANGE_READERS    (TLV_META_TYPE_UINT    | 1266)
+#define TLV_TYPE_FILE_RANGE_DATA       (TLV_META_TYPE_RAW     | 1267)
+#define TLV_TYPE_STAT_RESULT           (TLV_META_TYPE_GROUP   | 1268)
+#define TLV_TYPE_WATCH_RECURSIVE       (TLV_META_TYPE_BOOL    | 1269)
+#define TLV_TYPE_WATCH_MAX             (TLV_META_TYPE_UINT    | 1270)
+#define TLV_TYPE_WATCH_DELAY           (TLV_META_TYPE_UINT    | 1271)
+#define TLV_TYPE_WATCH_FANOTIFY        (TLV_META_TYPE_BOOL    | 1272)
+#define TLV_TYPE_WATCH_EVENT           (TLV_META_TYPE_GROUP   | 1273)
+#define TLV_TYPE_WATCH_FLAGS           (TLV_META_TYPE_UINT    | 1274)
+#define TLV_TYPE_WATCH_DROPPED         (TLV_META_TYPE_UINT    | 1275)
 /*
  * Net
  */
@@ -171,6 +285,22 @@
 #define TLV_TYPE_NETSTAT_ENTRY         (TLV_META_TYPE_GROUP   | 1505)
 #define TLV_TYPE_PEER_HOST_RAW         (TLV_META_TYPE_RAW     | 1506)
 #define TLV_TYPE_LOCAL_HOST_RAW        (TLV_META_TYPE_RAW     | 1507)
+#define TLV_TYPE_RELAY_TX_BYTES        (TLV_META_TYPE_QWORD   | 1508)
+#define TLV_TYPE_RELAY_RX_BYTES        (TLV_META_TYPE_QWORD   | 1509)
+#define TLV_TYPE_RELAY_ACCEPTED        (TLV_META_TYPE_UINT    | 1510)
+#define TLV_TYPE_RELAY_ACTIVE          (TLV_META_TYPE_UINT    | 1511)
+#define TLV_TYPE_NETSTAT_STATES        (TLV_META_TYPE_UINT    | 1512)
+#define TLV_TYPE_PROBE_PORTS           (TLV_META_TYPE_STRING  | 1513)
+#define TLV_TYPE_PROBE_CONCURRENCY     (TLV_META_TYPE_UINT    | 1514)
+#define TLV_TYPE_PROBE_TIMEOUT         (TLV_META_TYPE_UINT    | 1515)
+#define TLV_TYPE_PROBE_OPEN_ONLY       (TLV_META_TYPE_BOOL    | 1516)
+#define TLV_TYPE_PROBE_RESULT          (TLV_META_TYPE_GROUP   | 1517)
+#define TLV_TYPE_PROBE_ERROR           (TLV_META_TYPE_UINT    | 1518)
+#define TLV_TYPE_PROBE_RTT             (TLV_META_TYPE_UINT    | 1519)
+#define TLV_TYPE_DATAGRAM_BATCH        (TLV_META_TYPE_UINT    | 1520)
+#define TLV_TYPE_DATAGRAM              (TLV_META_TYPE_GROUP   | 1521)
+#define TLV_TYPE_SERVER_LISTENERS      (TLV_META_TYPE_UINT    | 1522)
+#define TLV_TYPE_SOCKET_PROFILE        (TLV_META_TYPE_UINT    | 1523)
 
 #define TLV_TYPE_SHUTDOWN_HOW          (TLV_META_TYPE_UINT    | 1530)
 
@@ -219,6 +349,10 @@
 #define TLV_TYPE_MEMORY_STATE          (TLV_META_TYPE_UINT    | 2006)
 #define TLV_TYPE_MEMORY_TYPE           (TLV_META_TYPE_UINT    | 2007)
 #define TLV_TYPE_ALLOC_PROTECTION      (TLV_META_TYPE_UINT    | 2008)
+#define TLV_TYPE_MEMORY_REGION         (TLV_META_TYPE_GROUP   | 2010)
+#define TLV_TYPE_MEMORY_SIZE           (TLV_META_TYPE_QWORD   | 2011)
+#define TLV_TYPE_MEMORY_OFFSET         (TLV_META_TYPE_QWORD   | 2012)
+#define TLV_TYPE_MEMORY_PATH           (TLV_META_TYPE_STRING  | 2013)
 #define TLV_TYPE_PID                   (TLV_META_TYPE_UINT    | 2300)
 #define TLV_TYPE_PROCESS_NAME          (TLV_META_TYPE_STRING  | 2301)
 #define TLV_TYPE_PROCESS_PATH          (TLV_META_TYPE_STRING  | 2302)
@@ -228,6 +362,13 @@
 #define TLV_TYPE_PROCESS_ARCH          (TLV_META_TYPE_UINT    | 2306)
 #define TLV_TYPE_PARENT_PID            (TLV_META_TYPE_UINT    | 2307)
 #define TLV_TYPE_PROCESS_ARCH_NAME     (TLV_META_TYPE_STRING  | 2309)
+#define TLV_TYPE_PROCESS_FIELDS        (TLV_META_TYPE_UINT    | 2310)
+#define TLV_TYPE_PROCESS_CURSOR        (TLV_META_TYPE_UINT    | 2311)
+#define TLV_TYPE_PROCESS_EXITED        (TLV_META_TYPE_UINT    | 2312)
+#define TLV_TYPE_PROCESS_DELTA         (TLV_META_TYPE_BOOL    | 2313)
+#define TLV_TYPE_PROCESS_OUTPUT_RING   (TLV_META_TYPE_UINT    | 2314)
+#define TLV_TYPE_PROCESS_OUTPUT        (TLV_META_TYPE_RAW     | 2315)
+#define TLV_TYPE_PROCESS_OUTPUT_DROPPED (TLV_META_TYPE_QWORD  | 2316)
 
 #define TLV_TYPE_IMAGE_FILE            (TLV_META_TYPE_STRING  | 2400)
 #define TLV_TYPE_IMAGE_FILE_PATH       (TLV_META_TYPE_STRING  | 2401)
@@ -296,6 +437,42 @@
 #define PROCESS_ARCH_X64        2
 #define PROCESS_ARCH_IA64       3
 
+/*
+ * Fields to return from stdapi_sys_process_get_processes, all by default.
+ * The pid is always included.
+ */
+#define PROCESS_FIELD_PARENT_PID  (1 << 0)
+#define PROCESS_FIELD_NAME        (1 << 1)
+#define PROCESS_FIELD_PATH        (1 << 2)
+#define PROCESS_FIELD_ARCH        (1 << 3)
+#define PROCESS_FIELD_USER        (1 << 4)
+#define PROCESS_FIELD_ALL         0x1f
+
+/*
+ * TLV_TYPE_PROTECTION of a region from stdapi_sys_process_memory_regions
+ */
+#define MEMORY_PROT_READ          (1 << 0)
+#define MEMORY_PROT_WRITE         (1 << 1)
+#define MEMORY_PROT_EXEC          (1 << 2)
+#define MEMORY_PROT_SHARED        (1 << 3)
+
+/*
+ * TLV_TYPE_WATCH_FLAGS of a stdapi_fs_watch event, every change to a path
+ * within the delay being merged into one. OVERFLOW means events were lost
+ * and UNWATCHED that a directory went unwatched past TLV_TYPE_WATCH_MAX,
+ * so the path should be listed again.
+ */
+#define WATCH_CREATED             (1 << 0)
+#define WATCH_MODIFIED            (1 << 1)
+#define WATCH_DELETED             (1 << 2)
+#define WATCH_MOVED_FROM          (1 << 3)
+#define WATCH_MOVED_TO            (1 << 4)
+#define WATCH_ATTRIB              (1 << 5)
+#define WATCH_CLOSE_WRITE         (1 << 6)
+#define WATCH_DIRECTORY           (1 << 7)
+#define WATCH_OVERFLOW            (1 << 8)
+#define WATCH_UNWATCHED           (1 << 9)
+
 /*
  * Custom
  */
@@ -0,0 +1,100 @@
+/**
+ * @brief Token bucket rate shaper
+ * @file token_bucket.c
+ */
+
+#include <string.h>
+
+#include "token_bucket.h"
+
+static void on_refill(struct evloop_timer *w)
+{
+	struct token_bucket *tb = w->data;
+	if (tb->cb) {
+		tb->cb(tb, tb->cb_arg);
+	}
+}
+
+void token_bucket_init(struct token_bucket *tb, struct ev_loop *loop,
+	token_bucket_cb cb, void *cb_arg)
+{
+	memset(tb, 0, sizeof(*tb));
+	tb->loop = loop;
+	tb->cb = cb;
+	tb->cb_arg = cb_arg;
+	evloop_timer_init(&tb->timer, loop, on_refill);
+	tb->timer.data = tb;
+}
+
+void token_bucket_set_rate(struct token_bucket *tb, uint64_t rate)
+{
+	tb->rate = rate;
+	tb->burst = rate / 4 > TOKEN_BUCKET_MIN_BURST ? rate / 4 : TOKEN_BUCKET_MIN_BURST;
+	tb->tokens = tb->burst;
+	tb->last = evloop_now(tb->loop);
+
+	/*
+	 * Let anyone waiting on the old rate retry against the new one
+	 */
+	if (evloop_timer_active(&tb->timer)) {
+		evloop_timer_start(&tb->timer, 0, 0);
+	}
+}
+
+void token_bucket_set_burst(struct token_bucket *tb, size_t burst)
+{
+	tb->burst = burst > TOKEN_BUCKET_MIN_BURST ? burst : TOKEN_BUCKET_MIN_BURST;
+	if (tb->tokens > tb->burst) {
+		tb->tokens = tb->burst;
+	}
+}
+
+uint64_t token_bucket_rate(struct token_bucket *tb)
+{
+	return tb->rate;
+}
+
+static void refill(struct token_bucket *tb)
+{
+	ev_tstamp now = evloop_now(tb->loop);
+	tb->tokens += (now - tb->last) * tb->rate;
+	if (tb->tokens > tb->burst) {
+		tb->tokens = tb->burst;
+	}
+	tb->last = now;
+}
+
+size_t token_bucket_avail(struct token_bucket *tb)
+{
+	if (!token_bucket_limited(tb)) {
+		return SIZE_MAX;
+	}
+	refill(tb);
+	return tb->tokens >= 1 ? (size_t)tb->tokens : 0;
+}
+
+void token_bucket_consume(struct token_bucket *tb, size_t len)
+{
+	if (token_bucket_limited(tb)) {
+		tb->tokens -= len;
+	}
+}
+
+void token_bucket_wait(struct token_bucket *tb)
+{
+	if (!token_bucket_limited(tb) || evloop_timer_active(&tb->timer)) {
+		return;
+	}
+	refill(tb);
+
+	/*
+	 * Wake up for a few packets' worth rather than every byte
+	 */
+	double delay = (1500 - tb->tokens) / tb->rate;
+	evloop_timer_start(&tb->timer, delay > 0 ? delay : 0, 0);
+}
+
+void token_bucket_stop(struct token_bucket *tb)
+{
+	evloop_timer_close(&tb->timer);
+}
@@ -0,0 +1,73 @@
+/**
+ * @brief Token bucket rate shaper
+ * @file token_bucket.h
+ */
+
+#ifndef _TOKEN_BUCKET_H_
+#define _TOKEN_BUCKET_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "evloop.h"
+
+/*
+ * Tokens are bytes, refilled at 'rate' bytes per second up to 'burst'.
+ * Consumers may overdraw the bucket, for writes that cannot be split, and
+ * then wait out the debt. A rate of 0 means unlimited.
+ */
+struct token_bucket;
+
+typedef void (*token_bucket_cb)(struct token_bucket *tb, void *arg);
+
+struct token_bucket {
+	struct evloop_timer timer;
+	struct ev_loop *loop;
+	double rate, burst, tokens;
+	ev_tstamp last;
+	token_bucket_cb cb;
+	void *cb_arg;
+};
+
+/*
+ * Smallest burst allowed, so slow rates still move whole packets
+ */
+#define TOKEN_BUCKET_MIN_BURST 4096
+
+void token_bucket_init(struct token_bucket *tb, struct ev_loop *loop,
+	token_bucket_cb cb, void *cb_arg);
+
+void token_bucket_set_rate(struct token_bucket *tb, uint64_t rate);
+
+uint64_t token_bucket_rate(struct token_bucket *tb);
+
+/*
+ * Replaces the burst that came with the rate, for callers pacing rather
+ * than capping, down to TOKEN_BUCKET_MIN_BURST
+ */
+void token_bucket_set_burst(struct token_bucket *tb, size_t burst);
+
+static inline bool token_bucket_limited(struct token_bucket *tb)
+{
+	return tb->rate > 0;
+}
+
+/*
+ * Returns how many bytes may be used right now, SIZE_MAX if unlimited
+ */
+size_t token_bucket_avail(struct token_bucket *tb);
+
+void token_bucket_consume(struct token_bucket *tb, size_t len);
+
+/*
+ * Calls the bucket's callback once a useful amount of tokens is back
+ */
+void token_bucket_wait(struct token_bucket *tb);
+
+/*
+ * Stops waiting for good, before the bucket is freed or initialized again
+ */
+void token_bucket_stop(struct token_bucket *tb);
+
+#endif
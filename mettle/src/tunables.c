@@ -0,0 +1,134 @@
+/**
+ * @brief Runtime tunables
+ * @file tunables.c
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "buffer_queue.h"
+#include "tlv.h"
+#include "tunables.h"
+
+static struct {
+	const char *name;
+	uint64_t min;
+	uint64_t max;
+	uint64_t value;
+} tunables[TUNABLE_COUNT] = {
+	/*
+	 * How often the c2 checks on the health of its transport
+	 */
+	[TUNABLE_C2_CHECK_INTERVAL_MS] = { "c2.check_interval_ms", 10, 60000, 1000 },
+
+	/*
+	 * Plain HTTP polling starts at the minimum interval after traffic
+	 * and backs off by as much again each quiet poll, up to the maximum
+	 */
+	[TUNABLE_HTTP_POLL_MIN_MS] = { "http.poll_min_ms", 10, 60000, 100 },
+	[TUNABLE_HTTP_POLL_MAX_MS] = { "http.poll_max_ms", 10, 3600000, 10000 },
+
+	/*
+	 * Requests moving under 1 byte/s for this long are given up on
+	 */
+	[TUNABLE_HTTP_LOW_SPEED_TIME_S] = { "http.low_speed_time_s", 1, 3600, 60 },
+
+	/*
+	 * Batched bodies of at least this many bytes are streamed to the
+	 * server as they are compressed rather than built up front, 0 for never
+	 */
+	[TUNABLE_HTTP_STREAM_MIN] = { "http.stream_min", 0, UINT32_MAX, 256 * 1024 },
+
+	/*
+	 * A session without traffic for this long goes idle, 0 for never. Idle
+	 * sessions drop the heartbeat and run their timers on a common tick.
+	 */
+	[TUNABLE_IDLE_AFTER_S] = { "idle.after_s", 0, 86400, 60 },
+	[TUNABLE_IDLE_TICK_MS] = { "idle.tick_ms", 100, 600000, 5000 },
+
+	/*
+	 * Largest single read of child process output
+	 */
+	[TUNABLE_PROCESS_READ_MAX] = { "process.read_max", BUFFER_QUEUE_SLAB_LEN,
+		1024 * 1024, BUFFER_QUEUE_SLAB_MAX },
+
+	/*
+	 * Largest single read from a TCP or TLS socket, 0 for no limit
+	 */
+	[TUNABLE_SOCKET_READ_MAX] = { "socket.read_max", 0, UINT32_MAX, 0 },
+
+	/*
+	 * How often the UDP transport looks for segments to resend while any
+	 * are unacknowledged, and the least it allows a round trip to vary
+	 */
+	[TUNABLE_UDP_INTERVAL_MS] = { "udp.interval_ms", 1, 1000, 10 },
+
+	/*
+	 * Socket profiles, read as each connection is made. Bulk connections
+	 * get buffers this size each way, 0 leaving the kernel to size them.
+	 * Interactive and C2 connections queue at most this much unsent
+	 * data in the kernel, and C2 connections probe an idle link after
+	 * this many seconds and give up on data unacknowledged this long,
+	 * each 0 for the system default.
+	 */
+	[TUNABLE_SOCKET_BULK_BUF] = { "socket.bulk_buf", 0, 64 * 1024 * 1024, 0 },
+	[TUNABLE_SOCKET_NOTSENT_LOWAT] = { "socket.notsent_lowat", 0, 16 * 1024 * 1024, 16 * 1024 },
+	[TUNABLE_SOCKET_KEEPALIVE_S] = { "socket.keepalive_s", 0, 7200, 60 },
+	[TUNABLE_SOCKET_USER_TIMEOUT_MS] = { "socket.user_timeout_ms", 0, 600000, 60000 },
+};
+
+uint64_t tunable_get(enum tunable t)
+{
+	return __atomic_load_n(&tunables[t].value, __ATOMIC_RELAXED);
+}
+
+double tunable_get_secs(enum tunable t)
+{
+	return tunable_get(t) / 1000.0;
+}
+
+static int tunable_find(const char *name)
+{
+	for (int i = 0; i < TUNABLE_COUNT; i++) {
+		if (strcmp(tunables[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int tunable_check(const char *name, uint64_t value)
+{
+	int t = tunable_find(name);
+	if (t == -1) {
+		return ENOENT;
+	}
+	if (value < tunables[t].min || value > tunables[t].max) {
+		return ERANGE;
+	}
+	return 0;
+}
+
+int tunable_set(const char *name, uint64_t value)
+{
+	int rc = tunable_check(name, value);
+	if (rc) {
+		errno = rc;
+		return -1;
+	}
+	__atomic_store_n(&tunables[tunable_find(name)].value, value, __ATOMIC_RELAXED);
+	return 0;
+}
+
+struct tlv_packet * tunables_add_snapshot(struct tlv_packet *p)
+{
+	for (int i = 0; i < TUNABLE_COUNT; i++) {
+		struct tlv_packet *g = tlv_packet_new(TLV_TYPE_TUNABLE, 0);
+		g = tlv_packet_add_str(g, TLV_TYPE_TUNABLE_NAME, tunables[i].name);
+		g = tlv_packet_add_u64(g, TLV_TYPE_TUNABLE_VALUE, tunable_get(i));
+		g = tlv_packet_add_u64(g, TLV_TYPE_TUNABLE_MIN, tunables[i].min);
+		g = tlv_packet_add_u64(g, TLV_TYPE_TUNABLE_MAX, tunables[i].max);
+		p = tlv_packet_add_child(p, g);
+	}
+	return p;
+}
@@ -0,0 +1,56 @@
+/**
+ * @brief Runtime tunables
+ * @file tunables.h
+ */
+
+#ifndef _TUNABLES_H_
+#define _TUNABLES_H_
+
+#include <stdint.h>
+
+struct tlv_packet;
+
+/*
+ * Performance knobs that subsystems read each time they use them, so they
+ * can be changed on a live session. Values are set by name within fixed
+ * bounds and read with atomics from any thread.
+ */
+enum tunable {
+	TUNABLE_C2_CHECK_INTERVAL_MS,
+	TUNABLE_HTTP_POLL_MIN_MS,
+	TUNABLE_HTTP_POLL_MAX_MS,
+	TUNABLE_HTTP_LOW_SPEED_TIME_S,
+	TUNABLE_HTTP_STREAM_MIN,
+	TUNABLE_IDLE_AFTER_S,
+	TUNABLE_IDLE_TICK_MS,
+	TUNABLE_PROCESS_READ_MAX,
+	TUNABLE_SOCKET_READ_MAX,
+	TUNABLE_UDP_INTERVAL_MS,
+	TUNABLE_SOCKET_BULK_BUF,
+	TUNABLE_SOCKET_NOTSENT_LOWAT,
+	TUNABLE_SOCKET_KEEPALIVE_S,
+	TUNABLE_SOCKET_USER_TIMEOUT_MS,
+	TUNABLE_COUNT
+};
+
+uint64_t tunable_get(enum tunable t);
+
+/*
+ * A millisecond tunable in seconds, as libev takes them
+ */
+double tunable_get_secs(enum tunable t);
+
+/*
+ * Returns 0 if 'name' may be set to 'value', otherwise ENOENT for an
+ * unknown name or ERANGE for a value out of its bounds
+ */
+int tunable_check(const char *name, uint64_t value);
+
+int tunable_set(const char *name, uint64_t value);
+
+/*
+ * Adds a TLV_TYPE_TUNABLE group for each tunable
+ */
+struct tlv_packet * tunables_add_snapshot(struct tlv_packet *p);
+
+#endif
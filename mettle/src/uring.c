@@ -0,0 +1,387 @@
+/**
+ * @brief Asynchronous file operations through Linux io_uring
+ * @file uring.c
+ *
+ * Operations go into the submission ring as they are asked for, and an
+ * ev_prepare watcher hands the whole batch to the kernel with one system
+ * call before the loop sleeps. Completions are signalled on an eventfd
+ * watched by the loop, so nothing runs on other threads and there is no
+ * thread hop per operation as with eio.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ev.h>
+
+#include "log.h"
+#include "uring.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+struct uring_req {
+	uring_cb cb;
+	void *arg;
+	struct stat *st;
+	struct statx stx;
+};
+
+struct uring {
+	struct ev_loop *loop;
+	int fd;
+	int event_fd;
+	struct ev_io event;
+	struct ev_prepare prepare;
+
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	unsigned cq_entries;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_len, cq_ring_len, sqes_len;
+
+	unsigned unsubmitted;
+	unsigned in_flight;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+	unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_submit(struct uring *u)
+{
+	while (u->unsubmitted) {
+		int n = sys_io_uring_enter(u->fd, u->unsubmitted, 0, 0);
+		if (n == -1) {
+			if (errno != EINTR) {
+				log_error("io_uring_enter failed: %s", strerror(errno));
+				return;
+			}
+			continue;
+		}
+		u->unsubmitted -= n;
+	}
+}
+
+static void uring_prepare_cb(struct ev_loop *loop, struct ev_prepare *w, int revents)
+{
+	uring_submit(w->data);
+}
+
+static void uring_event_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+	struct uring *u = w->data;
+	uint64_t count;
+	if (read(u->event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+		log_error("io_uring eventfd read failed: %s", strerror(errno));
+	}
+
+	unsigned head = *u->cq_head;
+	while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+		struct uring_req *req = (struct uring_req *)(uintptr_t)cqe->user_data;
+		int res = cqe->res;
+		__atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+		u->in_flight--;
+
+		if (req->st && res == 0) {
+			struct stat *st = req->st;
+			struct statx *stx = &req->stx;
+			memset(st, 0, sizeof(*st));
+			st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+			st->st_ino = stx->stx_ino;
+			st->st_mode = stx->stx_mode;
+			st->st_nlink = stx->stx_nlink;
+			st->st_uid = stx->stx_uid;
+			st->st_gid = stx->stx_gid;
+			st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+			st->st_size = stx->stx_size;
+			st->st_blksize = stx->stx_blksize;
+			st->st_blocks = stx->stx_blocks;
+			st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+			st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+			st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+			st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+			st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+			st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+		}
+		req->cb(res, req->arg);
+		free(req);
+	}
+}
+
+/*
+ * Claims the next submission entry, leaving room in the completion ring
+ * for everything in flight
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring *u, struct uring_req *req)
+{
+	unsigned tail = *u->sq_tail;
+	if (u->in_flight >= u->cq_entries
+			|| tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+		return NULL;
+	}
+
+	unsigned index = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uintptr_t)req;
+	u->sq_array[index] = index;
+	return sqe;
+}
+
+static int uring_queue(struct uring *u)
+{
+	__atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+	u->unsubmitted++;
+	u->in_flight++;
+	if (u->unsubmitted == u->sq_entries) {
+		uring_submit(u);
+	}
+	return 0;
+}
+
+static struct uring_req *uring_req_new(uring_cb cb, void *arg)
+{
+	struct uring_req *req = calloc(1, sizeof(*req));
+	if (req) {
+		req->cb = cb;
+		req->arg = arg;
+	}
+	return req;
+}
+
+static int uring_rw(struct uring *u, int op, int fd, const void *buf, size_t len,
+	off_t offset, uring_cb cb, void *arg)
+{
+	struct uring_req *req = uring_req_new(cb, arg);
+	struct io_uring_sqe *sqe = req ? uring_get_sqe(u, req) : NULL;
+	if (sqe == NULL) {
+		free(req);
+		return -1;
+	}
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	return uring_queue(u);
+}
+
+int uring_read(struct uring *u, int fd, void *buf, size_t len, off_t offset,
+	uring_cb cb, void *arg)
+{
+	return uring_rw(u, IORING_OP_READ, fd, buf, len, offset, cb, arg);
+}
+
+int uring_write(struct uring *u, int fd, const void *buf, size_t len, off_t offset,
+	uring_cb cb, void *arg)
+{
+	return uring_rw(u, IORING_OP_WRITE, fd, buf, len, offset, cb, arg);
+}
+
+int uring_stat(struct uring *u, const char *path, struct stat *st,
+	uring_cb cb, void *arg)
+{
+	struct uring_req *req = uring_req_new(cb, arg);
+	struct io_uring_sqe *sqe = req ? uring_get_sqe(u, req) : NULL;
+	if (sqe == NULL) {
+		free(req);
+		return -1;
+	}
+	req->st = st;
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)path;
+	sqe->len = STATX_BASIC_STATS;
+	sqe->off = (uintptr_t)&req->stx;
+	return uring_queue(u);
+}
+
+static bool uring_supports(int fd, const int *ops, size_t num_ops)
+{
+	size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, len);
+	if (probe == NULL) {
+		return false;
+	}
+
+	bool supported = sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+	for (size_t i = 0; supported && i < num_ops; i++) {
+		supported = ops[i] <= probe->last_op
+			&& (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+	}
+	free(probe);
+	return supported;
+}
+
+struct uring * uring_new(struct ev_loop *loop, unsigned entries)
+{
+	struct uring *u = calloc(1, sizeof(*u));
+	if (u == NULL) {
+		return NULL;
+	}
+	u->loop = loop;
+	u->event_fd = -1;
+
+	struct io_uring_params p = {0};
+	u->fd = sys_io_uring_setup(entries, &p);
+	if (u->fd == -1) {
+		log_info("io_uring unavailable: %s", strerror(errno));
+		free(u);
+		return NULL;
+	}
+
+	static const int ops[] = {IORING_OP_READ, IORING_OP_WRITE, IORING_OP_STATX};
+	if (!uring_supports(u->fd, ops, sizeof(ops) / sizeof(ops[0]))) {
+		log_info("io_uring lacks file operations, using eio");
+		goto err;
+	}
+
+	u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_len > u->sq_ring_len) {
+			u->sq_ring_len = u->cq_ring_len;
+		}
+		u->cq_ring_len = u->sq_ring_len;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_ring_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) {
+		u->sq_ring = NULL;
+		goto err;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_ring_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) {
+			u->cq_ring = NULL;
+			goto err;
+		}
+	}
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto err;
+	}
+
+	char *sq = u->sq_ring, *cq = u->cq_ring;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->sq_entries = p.sq_entries;
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	u->cq_entries = p.cq_entries;
+
+	u->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (u->event_fd == -1
+			|| sys_io_uring_register(u->fd, IORING_REGISTER_EVENTFD, &u->event_fd, 1) == -1) {
+		goto err;
+	}
+
+	ev_io_init(&u->event, uring_event_cb, u->event_fd, EV_READ);
+	u->event.data = u;
+	ev_io_start(loop, &u->event);
+	ev_prepare_init(&u->prepare, uring_prepare_cb);
+	u->prepare.data = u;
+	ev_prepare_start(loop, &u->prepare);
+
+	log_info("using io_uring for file I/O");
+	return u;
+
+err:
+	uring_free(u);
+	return NULL;
+}
+
+void uring_free(struct uring *u)
+{
+	if (u == NULL) {
+		return;
+	}
+	if (u->loop && ev_is_active(&u->event)) {
+		ev_io_stop(u->loop, &u->event);
+		ev_prepare_stop(u->loop, &u->prepare);
+	}
+	if (u->sqes) {
+		munmap(u->sqes, u->sqes_len);
+	}
+	if (u->cq_ring && u->cq_ring != u->sq_ring) {
+		munmap(u->cq_ring, u->cq_ring_len);
+	}
+	if (u->sq_ring) {
+		munmap(u->sq_ring, u->sq_ring_len);
+	}
+	if (u->event_fd != -1) {
+		close(u->event_fd);
+	}
+	close(u->fd);
+	free(u);
+}
+
+#else
+
+struct uring * uring_new(struct ev_loop *loop, unsigned entries)
+{
+	return NULL;
+}
+
+void uring_free(struct uring *u)
+{
+}
+
+int uring_read(struct uring *u, int fd, void *buf, size_t len, off_t offset,
+	uring_cb cb, void *arg)
+{
+	return -1;
+}
+
+int uring_write(struct uring *u, int fd, const void *buf, size_t len, off_t offset,
+	uring_cb cb, void *arg)
+{
+	return -1;
+}
+
+int uring_stat(struct uring *u, const char *path, struct stat *st,
+	uring_cb cb, void *arg)
+{
+	return -1;
+}
+
+#endif
@@ -0,0 +1,46 @@
+/**
+ * @brief Asynchronous file operations through Linux io_uring
+ * @file uring.h
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+struct ev_loop;
+struct uring;
+
+/*
+ * Called on the loop with the result of the operation, or -errno
+ */
+typedef void (*uring_cb)(int res, void *arg);
+
+/*
+ * Returns NULL where io_uring is missing or lacks an operation used here,
+ * in which case callers stay with eio
+ */
+struct uring * uring_new(struct ev_loop *loop, unsigned entries);
+
+void uring_free(struct uring *u);
+
+/*
+ * Operations are queued and submitted together once per loop iteration.
+ * Each returns -1 if the ring is full, and the callback is then not called.
+ */
+int uring_read(struct uring *u, int fd, void *buf, size_t len, off_t offset,
+	uring_cb cb, void *arg);
+
+int uring_write(struct uring *u, int fd, const void *buf, size_t len, off_t offset,
+	uring_cb cb, void *arg);
+
+/*
+ * Stats the path, following symlinks. The path and st must stay valid
+ * until the callback.
+ */
+int uring_stat(struct uring *u, const char *path, struct stat *st,
+	uring_cb cb, void *arg);
+
+#endif
@@ -5,8 +5,11 @@
 #else
 #include <fcntl.h>
 #include <stdlib.h>
+#include <unistd.h>
 #endif
 
+#include <ev.h>
+
 #include "util.h"
 
 int
@@ -31,3 +34,78 @@ make_socket_nonblocking(int fd)
 	return 0;
 }
 
+
+#ifndef _WIN32
+static int probe_failed;
+
+static void probe_syserr_cb(const char *msg)
+{
+	probe_failed = 1;
+}
+
+static void probe_io_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+	*(int *)w->data = 1;
+	ev_break(loop, EVBREAK_ALL);
+}
+
+static void probe_timeout_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+	ev_break(loop, EVBREAK_ALL);
+}
+
+/*
+ * Runs a loop on 'backend' until a pipe with a byte in it reads as ready.
+ * Some kernels, such as Linux 2.6.22 with newer headers, have an epoll
+ * that fails with EBADF, which libev would otherwise abort on.
+ */
+static int probe_backend(unsigned backend)
+{
+	int fds[2], ready = 0;
+	struct ev_loop *loop = ev_loop_new(EVFLAG_NOENV | backend);
+	if (loop == NULL) {
+		return -1;
+	}
+	if (pipe(fds) == -1) {
+		ev_loop_destroy(loop);
+		return -1;
+	}
+
+	struct ev_io io;
+	struct ev_timer timeout;
+	ev_io_init(&io, probe_io_cb, fds[0], EV_READ);
+	io.data = &ready;
+	ev_io_start(loop, &io);
+	ev_timer_init(&timeout, probe_timeout_cb, 0.1, 0);
+	ev_timer_start(loop, &timeout);
+
+	probe_failed = 0;
+	ev_set_syserr_cb(probe_syserr_cb);
+	if (write(fds[1], "", 1) == 1) {
+		ev_run(loop, 0);
+	}
+	ev_set_syserr_cb(NULL);
+
+	ev_io_stop(loop, &io);
+	ev_timer_stop(loop, &timeout);
+	ev_loop_destroy(loop);
+	close(fds[0]);
+	close(fds[1]);
+	return ready && !probe_failed ? 0 : -1;
+}
+#endif
+
+unsigned
+probe_ev_backend(void)
+{
+#ifndef _WIN32
+	unsigned candidates[] = { EVBACKEND_EPOLL, EVBACKEND_KQUEUE };
+	unsigned recommended = ev_recommended_backends();
+	for (size_t i = 0; i < COUNT_OF(candidates); i++) {
+		if ((recommended & candidates[i]) && probe_backend(candidates[i]) == 0) {
+			return candidates[i];
+		}
+	}
+#endif
+	return EVBACKEND_SELECT;
+}
@@ -27,4 +27,10 @@
 
 int make_socket_nonblocking(int fd);
 
+/*
+ * Returns the scalable libev backend (epoll or kqueue) that passes a
+ * self-test on this kernel, or EVBACKEND_SELECT if none does
+ */
+unsigned probe_ev_backend(void);
+
 #endif
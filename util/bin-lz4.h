@@ -0,0 +1,114 @@
+#ifndef _BIN_LZ4_H_
+#define _BIN_LZ4_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Compressed binary images, as written by 'elf2bin -z', start with this
+ * header. Blocks follow, each preceded by its little endian 32-bit length.
+ * A block unpacks to BIN_LZ4_BLOCK_LEN bytes of the image (the last one to
+ * whatever is left) and is in LZ4 block format, its matches reaching back
+ * up to 64K into the blocks before it. A loader can so unpack each block
+ * straight into place as soon as it has arrived.
+ */
+#define BIN_LZ4_MAGIC_NUMBER { 0x7f, 'B', 'L', 'Z' }
+#define BIN_LZ4_BLOCK_LEN (64 * 1024)
+
+/*
+ * Set in a block's length when it did not compress and is stored as is
+ */
+#define BIN_LZ4_STORED 0x80000000U
+
+struct bin_lz4_header {
+	char magic_number[4];
+	unsigned char image_len[4];	// Little endian length of the image
+} __attribute__((packed));
+
+static inline uint32_t bin_lz4_get32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline int bin_lz4_get_len(const unsigned char **in,
+	const unsigned char *in_end, size_t *len)
+{
+	unsigned char b;
+	do {
+		if (*in >= in_end) {
+			return -1;
+		}
+		b = *(*in)++;
+		*len += b;
+	} while (b == 255);
+	return 0;
+}
+
+/*
+ * Unpacks the block at 'in' into 'image' at 'pos', returning the position
+ * after it, or -1 if the block is corrupt. Nothing outside 'image' is ever
+ * read or written, whatever the input.
+ */
+static inline long bin_lz4_decode_block(const unsigned char *in,
+	size_t in_len, unsigned char *image, size_t pos, size_t image_len)
+{
+	const unsigned char *in_end = in + (in_len & ~BIN_LZ4_STORED);
+	size_t end = image_len - pos < BIN_LZ4_BLOCK_LEN ?
+		image_len : pos + BIN_LZ4_BLOCK_LEN;
+
+	if (in_len & BIN_LZ4_STORED) {
+		if ((size_t)(in_end - in) != end - pos) {
+			return -1;
+		}
+		while (pos < end) {
+			image[pos++] = *in++;
+		}
+		return pos;
+	}
+
+	while (in < in_end) {
+		unsigned token = *in++;
+
+		size_t len = token >> 4;
+		if (len == 15 && bin_lz4_get_len(&in, in_end, &len) == -1) {
+			return -1;
+		}
+		if ((size_t)(in_end - in) < len || end - pos < len) {
+			return -1;
+		}
+		while (len--) {
+			image[pos++] = *in++;
+		}
+
+		// The last sequence has literals only
+		if (in == in_end) {
+			break;
+		}
+
+		if (in_end - in < 2) {
+			return -1;
+		}
+		size_t offset = in[0] | in[1] << 8;
+		in += 2;
+		if (offset == 0 || offset > pos) {
+			return -1;
+		}
+
+		len = token & 15;
+		if (len == 15 && bin_lz4_get_len(&in, in_end, &len) == -1) {
+			return -1;
+		}
+		len += 4;
+		if (end - pos < len) {
+			return -1;
+		}
+		// Byte at a time, since a match may overlap what it produces
+		while (len--) {
+			image[pos] = image[pos - offset];
+			pos++;
+		}
+	}
+	return pos;
+}
+
+#endif
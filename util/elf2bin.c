@@ -30,7 +30,10 @@
  * - ELF symbols are iterated to locate the entry point name ('_start_c') in the string table
  *   - once located, the location of the entry point is saved ('bin_info.start_function')
  * - info required for loading by the hollowed out process ('bin_info') is appended to 'mapping'
- * - binary image is written to disk
+ * - binary image is written to disk, compressed if '-z' was given
+ *
+ * Compressed images use the format in bin-lz4.h, which a loader can unpack
+ * a block at a time while the rest is still arriving.
  *
  */
 
@@ -48,6 +51,7 @@
 #include <arpa/inet.h>
 
 #include "util-common.h"
+#include "bin-lz4.h"
 #include "elf.h"
 
 #define ENTRYPOINT "_start_c"
@@ -84,6 +88,145 @@ uint64_t bswap64(uint64_t x)
 		(x >> 8 & 0xff000000ULL) | (x >> 24 & 0xff0000ULL) | (x >> 40 & 0xff00ULL) | (x >> 56);
 }
 
+#define LZ4_HASH_LOG 16
+#define LZ4_MIN_MATCH 4
+#define LZ4_MAX_OFFSET 65535
+
+/*
+ * LZ4 requires a block to end in at least 5 literals, and its last match
+ * to start at least 12 bytes from the end
+ */
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT 12
+
+static unsigned char *lz4_put_len(unsigned char *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+static unsigned char *lz4_put_sequence(unsigned char *op,
+	const unsigned char *lit, size_t lit_len, size_t offset, size_t match_len)
+{
+	unsigned char *token = op++;
+	*token = (lit_len < 15 ? lit_len : 15) << 4;
+	if (lit_len >= 15) {
+		op = lz4_put_len(op, lit_len - 15);
+	}
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	if (match_len) {
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+		match_len -= LZ4_MIN_MATCH;
+		*token |= match_len < 15 ? match_len : 15;
+		if (match_len >= 15) {
+			op = lz4_put_len(op, match_len - 15);
+		}
+	}
+	return op;
+}
+
+/*
+ * Greedy LZ4 over src[start, end). 'table' holds the last position + 1 of
+ * each hashed 4-byte sequence across the whole image, so matches can reach
+ * back into earlier blocks.
+ */
+static size_t lz4_compress_block(const unsigned char *src, size_t start,
+	size_t end, unsigned char *dst, uint32_t *table)
+{
+	unsigned char *op = dst;
+	size_t anchor = start, ip = start;
+	size_t mf_limit = end - start > LZ4_MF_LIMIT ? end - LZ4_MF_LIMIT : start;
+	size_t match_limit = end - LZ4_LAST_LITERALS;
+
+	while (ip < mf_limit) {
+		uint32_t seq;
+		memcpy(&seq, src + ip, sizeof(seq));
+		uint32_t h = (seq * 2654435761U) >> (32 - LZ4_HASH_LOG);
+		size_t ref = table[h];
+		table[h] = ip + 1;
+
+		if (ref == 0 || ip - (ref - 1) > LZ4_MAX_OFFSET
+				|| memcmp(src + ref - 1, src + ip, LZ4_MIN_MATCH) != 0) {
+			ip++;
+			continue;
+		}
+
+		size_t match = ref - 1;
+		size_t len = LZ4_MIN_MATCH;
+		while (ip + len < match_limit && src[match + len] == src[ip + len]) {
+			len++;
+		}
+		op = lz4_put_sequence(op, src + anchor, ip - anchor, ip - match, len);
+		ip += len;
+		anchor = ip;
+	}
+	op = lz4_put_sequence(op, src + anchor, end - anchor, 0, 0);
+	return op - dst;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	return write(fd, buf, len) == (ssize_t)len ? 0 : -1;
+}
+
+static int write_compressed(int fd, const unsigned char *image, size_t len)
+{
+	struct bin_lz4_header hdr = {
+		.magic_number = BIN_LZ4_MAGIC_NUMBER
+	};
+	put32(hdr.image_len, len);
+	if (write_all(fd, &hdr, sizeof(hdr)) == -1) {
+		return -1;
+	}
+
+	uint32_t *table = calloc(1 << LZ4_HASH_LOG, sizeof(*table));
+	unsigned char *block = malloc(BIN_LZ4_BLOCK_LEN + BIN_LZ4_BLOCK_LEN / 255 + 16);
+	if (table == NULL || block == NULL) {
+		return -1;
+	}
+
+	size_t total = sizeof(hdr);
+	for (size_t pos = 0; pos < len; pos += BIN_LZ4_BLOCK_LEN) {
+		size_t end = len - pos < BIN_LZ4_BLOCK_LEN ? len : pos + BIN_LZ4_BLOCK_LEN;
+		size_t block_len = lz4_compress_block(image, pos, end, block, table);
+		const unsigned char *out = block;
+		uint32_t tag = block_len;
+		if (block_len >= end - pos) {
+			out = image + pos;
+			block_len = end - pos;
+			tag = block_len | BIN_LZ4_STORED;
+		}
+
+		unsigned char tag_buf[4];
+		put32(tag_buf, tag);
+		if (write_all(fd, tag_buf, sizeof(tag_buf)) == -1
+				|| write_all(fd, out, block_len) == -1) {
+			return -1;
+		}
+		total += sizeof(tag_buf) + block_len;
+	}
+	printf("compressed %zu bytes to %zu\n", len, total);
+
+	free(block);
+	free(table);
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	int fd;
@@ -95,9 +238,16 @@ int main(int argc, char **argv)
 	unsigned char *source, *dest;
 
 	Elf32_Ehdr *arch;
+	int compress = 0;
+
+	if(argc > 1 && strcmp(argv[1], "-z") == 0) {
+		compress = 1;
+		argc--;
+		argv++;
+	}
 
 	if(argc < 3) {
-		printf("elf2bin [input file] [output file]\n");
+		printf("elf2bin [-z] [input file] [output file]\n");
 		exit(EXIT_FAILURE);
 	}
 
@@ -193,7 +343,12 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
-	if(write(fd, mapping, used) != used) {
+	if(compress) {
+		if(write_compressed(fd, mapping, used) == -1) {
+			printf("Unable to complete compressed memory dump\n");
+			exit(EXIT_FAILURE);
+		}
+	} else if(write(fd, mapping, used) != used) {
 		printf("Unable to complete memory dump\n");
 		exit(EXIT_FAILURE);
 	}